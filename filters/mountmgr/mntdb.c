@@ -0,0 +1,1033 @@
+/*++
+
+Copyright (c) 2003  Microsoft Corporation
+
+Module Name:
+
+    mntdb.c
+
+Abstract:
+
+    This module keeps the mounted devices database, the MountedDevices key,
+    cached in memory.
+
+    The key is read once, when the driver loads.  Its values are indexed by
+    name and by data, so finding the names that a unique id has does not
+    enumerate the key.  Writes and deletes change the cache and queue the
+    value to be written.  The queued values are written with one open of the
+    key, one second after the first change of a batch, and at shutdown and
+    unload.
+
+    The routines take the same arguments as the RtlQueryRegistryValues,
+    RtlWriteRegistryValue and RtlDeleteRegistryValue calls that they replace.
+    Query routines may write and delete values, including the one being
+    queried.  If the key cannot be read into memory, the routines pass every
+    call through to the registry.
+
+Environment:
+
+    kernel mode only
+
+Notes:
+
+    This module is also built into the user mode arrival benchmark, with
+    UTEST defined.
+
+Revision History:
+
+--*/
+
+#ifndef UTEST
+
+#define _NTSRV_
+
+#include <ntosp.h>
+#include <zwapi.h>
+#include <mountmgr.h>
+#include <mountdev.h>
+#include <mntmgr.h>
+
+#ifdef POOL_TAGGING
+#undef ExAllocatePool
+
+#define ExAllocatePool(_a,_b) ExAllocatePoolWithTag((_a), (_b), MOUNTMGR_TAG_DATABASE)
+
+#define MOUNTMGR_TAG_DATABASE   'DtnM'  // MntD
+
+#endif
+
+#endif
+
+MOUNTMGR_DATABASE MountedDevicesDatabase;
+
+PMOUNTMGR_DATABASE_ENTRY
+MountMgrLookupDatabaseEntry(
+    IN  PMOUNTMGR_DATABASE  Database,
+    IN  PUNICODE_STRING     ValueName
+    );
+
+NTSTATUS
+MountMgrSetDatabaseEntryData(
+    IN      PMOUNTMGR_DATABASE          Database,
+    IN OUT  PMOUNTMGR_DATABASE_ENTRY    Entry,
+    IN      ULONG                       ValueType,
+    IN      PVOID                       ValueData,
+    IN      ULONG                       ValueLength
+    );
+
+PMOUNTMGR_DATABASE_ENTRY
+MountMgrCreateDatabaseEntry(
+    IN  PMOUNTMGR_DATABASE  Database,
+    IN  PUNICODE_STRING     ValueName,
+    IN  ULONG               ValueType,
+    IN  PVOID               ValueData,
+    IN  ULONG               ValueLength
+    );
+
+VOID
+MountMgrFreeDatabaseEntry(
+    IN  PMOUNTMGR_DATABASE          Database,
+    IN  PMOUNTMGR_DATABASE_ENTRY    Entry
+    );
+
+VOID
+MountMgrMarkDatabaseEntryDirty(
+    IN  PMOUNTMGR_DATABASE          Database,
+    IN  PMOUNTMGR_DATABASE_ENTRY    Entry
+    );
+
+NTSTATUS
+MountMgrWriteDirtyDatabaseEntries(
+    IN  PMOUNTMGR_DATABASE  Database
+    );
+
+VOID
+MountMgrDatabaseFlushDpc(
+    IN  PKDPC   Dpc,
+    IN  PVOID   DeferredContext,
+    IN  PVOID   SystemArgument1,
+    IN  PVOID   SystemArgument2
+    );
+
+VOID
+MountMgrDatabaseFlushWorker(
+    IN  PVOID   Context
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(INIT, MountMgrLoadDatabase)
+#pragma alloc_text(PAGE, MountMgrUnloadDatabase)
+#pragma alloc_text(PAGE, MountMgrQueryDatabaseValues)
+#pragma alloc_text(PAGE, MountMgrWriteDatabaseValue)
+#pragma alloc_text(PAGE, MountMgrDeleteDatabaseValue)
+#pragma alloc_text(PAGE, MountMgrFlushDatabase)
+#pragma alloc_text(PAGE, MountMgrLookupDatabaseEntry)
+#pragma alloc_text(PAGE, MountMgrSetDatabaseEntryData)
+#pragma alloc_text(PAGE, MountMgrCreateDatabaseEntry)
+#pragma alloc_text(PAGE, MountMgrFreeDatabaseEntry)
+#pragma alloc_text(PAGE, MountMgrMarkDatabaseEntryDirty)
+#pragma alloc_text(PAGE, MountMgrWriteDirtyDatabaseEntries)
+#pragma alloc_text(PAGE, MountMgrDatabaseFlushWorker)
+#endif
+
+#define MountMgrAcquireDatabase(Database)                                   \
+        KeEnterCriticalRegion();                                            \
+        ExAcquireResourceExclusiveLite(&(Database)->Resource, TRUE)
+
+#define MountMgrReleaseDatabase(Database)                                   \
+        ExReleaseResourceLite(&(Database)->Resource);                       \
+        KeLeaveCriticalRegion()
+
+PMOUNTMGR_DATABASE_ENTRY
+MountMgrLookupDatabaseEntry(
+    IN  PMOUNTMGR_DATABASE  Database,
+    IN  PUNICODE_STRING     ValueName
+    )
+
+/*++
+
+Routine Description:
+
+    This routine finds the entry with the given value name.  Deleted entries
+    that have not been written yet are found too.
+
+Arguments:
+
+    Database    - Supplies the database.
+
+    ValueName   - Supplies the value name.
+
+Return Value:
+
+    The entry or NULL.
+
+--*/
+
+{
+    ULONG                       hash;
+    PLIST_ENTRY                 bucket, l;
+    PMOUNTMGR_DATABASE_ENTRY    entry;
+
+    hash = MountMgrHashName(ValueName);
+    bucket = MountMgrHashBucket(&Database->NameIndex, hash);
+
+    for (l = bucket->Flink; l != bucket; l = l->Flink) {
+
+        entry = CONTAINING_RECORD(l, MOUNTMGR_DATABASE_ENTRY,
+                                  NameLink.ListEntry);
+
+        if (entry->NameLink.Hash == hash &&
+            RtlEqualUnicodeString(ValueName, &entry->ValueName, TRUE)) {
+
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+NTSTATUS
+MountMgrSetDatabaseEntryData(
+    IN      PMOUNTMGR_DATABASE          Database,
+    IN OUT  PMOUNTMGR_DATABASE_ENTRY    Entry,
+    IN      ULONG                       ValueType,
+    IN      PVOID                       ValueData,
+    IN      ULONG                       ValueLength
+    )
+
+/*++
+
+Routine Description:
+
+    This routine replaces the data of an entry and moves the entry to the
+    data index bucket for the new data.
+
+Arguments:
+
+    Database    - Supplies the database.
+
+    Entry       - Supplies the entry.
+
+    ValueType   - Supplies the type of the value.
+
+    ValueData   - Supplies the data of the value.
+
+    ValueLength - Supplies the length of the value.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    PVOID   data;
+
+    Entry->ValueType = ValueType;
+
+    if (Entry->ValueData && Entry->ValueLength == ValueLength &&
+        RtlCompareMemory(Entry->ValueData, ValueData, ValueLength) ==
+        ValueLength) {
+
+        return STATUS_SUCCESS;
+    }
+
+    if (Entry->ValueData && Entry->ValueLength == ValueLength) {
+        data = Entry->ValueData;
+    } else {
+        data = ExAllocatePool(PagedPool, ValueLength ? ValueLength : 1);
+        if (!data) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    RtlCopyMemory(data, ValueData, ValueLength);
+
+    if (Entry->ValueData) {
+        MountMgrRemoveHashLink(&Database->DataIndex, &Entry->DataLink);
+        if (data != Entry->ValueData) {
+            ExFreePool(Entry->ValueData);
+        }
+    }
+
+    Entry->ValueData = data;
+    Entry->ValueLength = ValueLength;
+
+    MountMgrInsertHashLink(&Database->DataIndex, &Entry->DataLink,
+                           MountMgrHashBytes(data, ValueLength));
+
+    return STATUS_SUCCESS;
+}
+
+PMOUNTMGR_DATABASE_ENTRY
+MountMgrCreateDatabaseEntry(
+    IN  PMOUNTMGR_DATABASE  Database,
+    IN  PUNICODE_STRING     ValueName,
+    IN  ULONG               ValueType,
+    IN  PVOID               ValueData,
+    IN  ULONG               ValueLength
+    )
+
+/*++
+
+Routine Description:
+
+    This routine creates an entry at the end of the database.
+
+Arguments:
+
+    Database    - Supplies the database.
+
+    ValueName   - Supplies the value name.
+
+    ValueType   - Supplies the type of the value.
+
+    ValueData   - Supplies the data of the value.
+
+    ValueLength - Supplies the length of the value.
+
+Return Value:
+
+    The new entry or NULL.
+
+--*/
+
+{
+    PMOUNTMGR_DATABASE_ENTRY    entry;
+
+    entry = ExAllocatePool(PagedPool, sizeof(MOUNTMGR_DATABASE_ENTRY) +
+                           ValueName->Length + sizeof(WCHAR));
+    if (!entry) {
+        return NULL;
+    }
+
+    RtlZeroMemory(entry, sizeof(MOUNTMGR_DATABASE_ENTRY));
+
+    entry->ValueName.Length = ValueName->Length;
+    entry->ValueName.MaximumLength = ValueName->Length + sizeof(WCHAR);
+    entry->ValueName.Buffer = (PWSTR) (entry + 1);
+    RtlCopyMemory(entry->ValueName.Buffer, ValueName->Buffer,
+                  ValueName->Length);
+    entry->ValueName.Buffer[ValueName->Length/sizeof(WCHAR)] = 0;
+
+    if (!NT_SUCCESS(MountMgrSetDatabaseEntryData(Database, entry, ValueType,
+                                                 ValueData, ValueLength))) {
+
+        ExFreePool(entry);
+        return NULL;
+    }
+
+    MountMgrInsertHashLink(&Database->NameIndex, &entry->NameLink,
+                           MountMgrHashName(&entry->ValueName));
+    InsertTailList(&Database->EntryList, &entry->ListEntry);
+
+    return entry;
+}
+
+VOID
+MountMgrFreeDatabaseEntry(
+    IN  PMOUNTMGR_DATABASE          Database,
+    IN  PMOUNTMGR_DATABASE_ENTRY    Entry
+    )
+
+/*++
+
+Routine Description:
+
+    This routine removes an entry from the database and frees it.
+
+Arguments:
+
+    Database    - Supplies the database.
+
+    Entry       - Supplies the entry.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    if (Entry->IsDirty) {
+        RemoveEntryList(&Entry->DirtyListEntry);
+    }
+
+    RemoveEntryList(&Entry->ListEntry);
+    MountMgrRemoveHashLink(&Database->NameIndex, &Entry->NameLink);
+    MountMgrRemoveHashLink(&Database->DataIndex, &Entry->DataLink);
+
+    ExFreePool(Entry->ValueData);
+    ExFreePool(Entry);
+}
+
+VOID
+MountMgrMarkDatabaseEntryDirty(
+    IN  PMOUNTMGR_DATABASE          Database,
+    IN  PMOUNTMGR_DATABASE_ENTRY    Entry
+    )
+
+/*++
+
+Routine Description:
+
+    This routine queues an entry to be written, and schedules the lazy
+    writer if it is not already scheduled.
+
+Arguments:
+
+    Database    - Supplies the database.
+
+    Entry       - Supplies the entry.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    LARGE_INTEGER   dueTime;
+
+    if (!Entry->IsDirty) {
+        InsertTailList(&Database->DirtyList, &Entry->DirtyListEntry);
+        Entry->IsDirty = TRUE;
+    }
+
+    if (!Database->FlushScheduled) {
+        Database->FlushScheduled = TRUE;
+        KeClearEvent(&Database->FlushIdleEvent);
+        dueTime.QuadPart = MOUNTMGR_DATABASE_FLUSH_DELAY;
+        KeSetTimer(&Database->FlushTimer, dueTime, &Database->FlushDpc);
+    }
+}
+
+NTSTATUS
+MountMgrWriteDirtyDatabaseEntries(
+    IN  PMOUNTMGR_DATABASE  Database
+    )
+
+/*++
+
+Routine Description:
+
+    This routine writes the queued entries to the registry.  Entries that
+    cannot be written stay queued, and are tried again by the next flush.
+
+Arguments:
+
+    Database    - Supplies the database.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    OBJECT_ATTRIBUTES           oa;
+    HANDLE                      handle;
+    NTSTATUS                    status, result;
+    PLIST_ENTRY                 l;
+    PMOUNTMGR_DATABASE_ENTRY    entry;
+
+    if (IsListEmpty(&Database->DirtyList)) {
+        return STATUS_SUCCESS;
+    }
+
+    InitializeObjectAttributes(&oa, &Database->KeyName,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                               NULL, NULL);
+
+    status = ZwOpenKey(&handle, KEY_SET_VALUE, &oa);
+    if (!NT_SUCCESS(status)) {
+        Database->FlushFailures++;
+        return status;
+    }
+
+    result = STATUS_SUCCESS;
+    l = Database->DirtyList.Flink;
+    while (l != &Database->DirtyList) {
+
+        entry = CONTAINING_RECORD(l, MOUNTMGR_DATABASE_ENTRY, DirtyListEntry);
+        l = l->Flink;
+
+        if (entry->IsDeleted) {
+            status = ZwDeleteValueKey(handle, &entry->ValueName);
+            if (status == STATUS_OBJECT_NAME_NOT_FOUND) {
+                status = STATUS_SUCCESS;
+            }
+        } else {
+            status = ZwSetValueKey(handle, &entry->ValueName, 0,
+                                   entry->ValueType, entry->ValueData,
+                                   entry->ValueLength);
+        }
+
+        if (!NT_SUCCESS(status)) {
+            Database->FlushFailures++;
+            result = status;
+            continue;
+        }
+
+        RemoveEntryList(&entry->DirtyListEntry);
+        entry->IsDirty = FALSE;
+
+        if (entry->IsDeleted) {
+            Database->ValuesDeleted++;
+            MountMgrFreeDatabaseEntry(Database, entry);
+        } else {
+            Database->ValuesWritten++;
+        }
+    }
+
+    ZwClose(handle);
+
+    Database->Flushes++;
+
+    return result;
+}
+
+VOID
+MountMgrDatabaseFlushDpc(
+    IN  PKDPC   Dpc,
+    IN  PVOID   DeferredContext,
+    IN  PVOID   SystemArgument1,
+    IN  PVOID   SystemArgument2
+    )
+
+/*++
+
+Routine Description:
+
+    This routine runs when the lazy writer's timer expires.  It queues the
+    flush to a worker thread.
+
+Arguments:
+
+    Dpc             - Supplies the DPC.
+
+    DeferredContext - Supplies the database.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PMOUNTMGR_DATABASE  database = DeferredContext;
+
+    ExQueueWorkItem(&database->FlushWorkItem, DelayedWorkQueue);
+}
+
+VOID
+MountMgrDatabaseFlushWorker(
+    IN  PVOID   Context
+    )
+
+/*++
+
+Routine Description:
+
+    This routine is the lazy writer.  It writes the queued entries.
+
+Arguments:
+
+    Context - Supplies the database.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PMOUNTMGR_DATABASE  database = Context;
+
+    MountMgrAcquireDatabase(database);
+
+    database->FlushScheduled = FALSE;
+    MountMgrWriteDirtyDatabaseEntries(database);
+    KeSetEvent(&database->FlushIdleEvent, IO_NO_INCREMENT, FALSE);
+
+    MountMgrReleaseDatabase(database);
+}
+
+NTSTATUS
+MountMgrLoadDatabase(
+    IN  PWSTR   KeyName
+    )
+
+/*++
+
+Routine Description:
+
+    This routine reads the database key into memory.  If the key cannot be
+    read, the database is left in pass through mode.
+
+Arguments:
+
+    KeyName     - Supplies the absolute name of the database key.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    PMOUNTMGR_DATABASE              database = &MountedDevicesDatabase;
+    NTSTATUS                        status;
+    OBJECT_ATTRIBUTES               oa;
+    HANDLE                          handle;
+    PKEY_VALUE_FULL_INFORMATION     info;
+    ULONG                           infoSize, resultLength, i;
+    UNICODE_STRING                  valueName;
+    PLIST_ENTRY                     l;
+
+    RtlZeroMemory(database, sizeof(MOUNTMGR_DATABASE));
+    ExInitializeResourceLite(&database->Resource);
+    RtlInitUnicodeString(&database->KeyName, KeyName);
+    InitializeListHead(&database->EntryList);
+    InitializeListHead(&database->DirtyList);
+    KeInitializeTimer(&database->FlushTimer);
+    KeInitializeDpc(&database->FlushDpc, MountMgrDatabaseFlushDpc, database);
+    ExInitializeWorkItem(&database->FlushWorkItem,
+                         MountMgrDatabaseFlushWorker, database);
+    KeInitializeEvent(&database->FlushIdleEvent, NotificationEvent, TRUE);
+
+    status = MountMgrInitializeHashTable(&database->NameIndex);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = MountMgrInitializeHashTable(&database->DataIndex);
+    if (!NT_SUCCESS(status)) {
+        MountMgrFreeHashTable(&database->NameIndex);
+        return status;
+    }
+
+    InitializeObjectAttributes(&oa, &database->KeyName,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                               NULL, NULL);
+
+    status = ZwOpenKey(&handle, KEY_QUERY_VALUE, &oa);
+    if (!NT_SUCCESS(status)) {
+        MountMgrFreeHashTable(&database->NameIndex);
+        MountMgrFreeHashTable(&database->DataIndex);
+        return status;
+    }
+
+    infoSize = PAGE_SIZE;
+    info = ExAllocatePool(PagedPool, infoSize);
+
+    for (i = 0; info; ) {
+
+        status = ZwEnumerateValueKey(handle, i, KeyValueFullInformation,
+                                     info, infoSize, &resultLength);
+
+        if (status == STATUS_BUFFER_OVERFLOW ||
+            status == STATUS_BUFFER_TOO_SMALL) {
+
+            ExFreePool(info);
+            infoSize = resultLength;
+            info = ExAllocatePool(PagedPool, infoSize);
+            continue;
+        }
+
+        if (status == STATUS_NO_MORE_ENTRIES) {
+            status = STATUS_SUCCESS;
+            break;
+        }
+
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        valueName.Length = valueName.MaximumLength = (USHORT) info->NameLength;
+        valueName.Buffer = info->Name;
+
+        if (!MountMgrCreateDatabaseEntry(database, &valueName, info->Type,
+                                         (PCHAR) info + info->DataOffset,
+                                         info->DataLength)) {
+
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+
+        i++;
+    }
+
+    if (info) {
+        ExFreePool(info);
+    } else {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ZwClose(handle);
+
+    if (!NT_SUCCESS(status)) {
+        while (!IsListEmpty(&database->EntryList)) {
+            l = database->EntryList.Flink;
+            MountMgrFreeDatabaseEntry(database,
+                    CONTAINING_RECORD(l, MOUNTMGR_DATABASE_ENTRY, ListEntry));
+        }
+        MountMgrFreeHashTable(&database->NameIndex);
+        MountMgrFreeHashTable(&database->DataIndex);
+        return status;
+    }
+
+    database->Loaded = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+MountMgrUnloadDatabase(
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    This routine writes the queued entries and frees the database.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PMOUNTMGR_DATABASE  database = &MountedDevicesDatabase;
+    PLIST_ENTRY         l;
+
+    if (database->Loaded) {
+
+        MountMgrFlushDatabase();
+
+        KeWaitForSingleObject(&database->FlushIdleEvent, Executive,
+                              KernelMode, FALSE, NULL);
+
+        MountMgrAcquireDatabase(database);
+
+        MountMgrWriteDirtyDatabaseEntries(database);
+
+        while (!IsListEmpty(&database->EntryList)) {
+            l = database->EntryList.Flink;
+            MountMgrFreeDatabaseEntry(database,
+                    CONTAINING_RECORD(l, MOUNTMGR_DATABASE_ENTRY, ListEntry));
+        }
+
+        MountMgrFreeHashTable(&database->NameIndex);
+        MountMgrFreeHashTable(&database->DataIndex);
+        database->Loaded = FALSE;
+
+        MountMgrReleaseDatabase(database);
+    }
+
+    ExDeleteResourceLite(&database->Resource);
+}
+
+NTSTATUS
+MountMgrQueryDatabaseValues(
+    IN  PWSTR                       ValueName,
+    IN  PMOUNTDEV_UNIQUE_ID         UniqueId,
+    IN  PRTL_QUERY_REGISTRY_ROUTINE QueryRoutine,
+    IN  PVOID                       Context,
+    IN  PVOID                       EntryContext
+    )
+
+/*++
+
+Routine Description:
+
+    This routine calls the given query routine for values of the database,
+    the same way that RtlQueryRegistryValues does for a one entry query
+    table.  Values are passed as they are stored; the database only holds
+    REG_BINARY values.
+
+    The query routine may change the database.  Values that it writes may
+    or may not be passed to it in the same query.
+
+Arguments:
+
+    ValueName       - Supplies the name of the value to query, or NULL.
+
+    UniqueId        - Supplies, when 'ValueName' is NULL, the unique id
+                        whose values are to be queried.  If this is NULL too,
+                        every value is queried.
+
+    QueryRoutine    - Supplies the query routine.
+
+    Context         - Supplies the context for the query routine.
+
+    EntryContext    - Supplies the entry context for the query routine.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    PMOUNTMGR_DATABASE          database = &MountedDevicesDatabase;
+    RTL_QUERY_REGISTRY_TABLE    queryTable[2];
+    NTSTATUS                    status;
+    UNICODE_STRING              name;
+    PMOUNTMGR_DATABASE_ENTRY    entry;
+    PLIST_ENTRY                 list, l, next;
+    ULONG                       hash;
+
+    if (!database->Loaded) {
+        RtlZeroMemory(queryTable, 2*sizeof(RTL_QUERY_REGISTRY_TABLE));
+        queryTable[0].QueryRoutine = QueryRoutine;
+        queryTable[0].Name = ValueName;
+        queryTable[0].EntryContext = EntryContext;
+
+        return RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE,
+                                      database->KeyName.Buffer, queryTable,
+                                      Context, NULL);
+    }
+
+    MountMgrAcquireDatabase(database);
+
+    status = STATUS_SUCCESS;
+
+    if (ValueName) {
+
+        RtlInitUnicodeString(&name, ValueName);
+        entry = MountMgrLookupDatabaseEntry(database, &name);
+        if (entry && !entry->IsDeleted) {
+            status = QueryRoutine(entry->ValueName.Buffer, entry->ValueType,
+                                  entry->ValueData, entry->ValueLength,
+                                  Context, EntryContext);
+        }
+
+        MountMgrReleaseDatabase(database);
+
+        return status;
+    }
+
+    //
+    // Walk either the whole database or the data index bucket for the
+    // unique id.  Entries are not freed while the database is held and the
+    // buckets do not move while the data index is frozen, so the next entry
+    // can be picked up before calling the query routine.
+    //
+
+    if (UniqueId) {
+        hash = MountMgrHashBytes(UniqueId->UniqueId, UniqueId->UniqueIdLength);
+        list = MountMgrHashBucket(&database->DataIndex, hash);
+        database->DataIndex.Frozen++;
+    } else {
+        list = &database->EntryList;
+    }
+
+    for (l = list->Flink; l != list; l = next) {
+
+        next = l->Flink;
+
+        if (UniqueId) {
+            entry = CONTAINING_RECORD(l, MOUNTMGR_DATABASE_ENTRY,
+                                      DataLink.ListEntry);
+            if (entry->DataLink.Hash != hash ||
+                entry->ValueLength != UniqueId->UniqueIdLength ||
+                RtlCompareMemory(entry->ValueData, UniqueId->UniqueId,
+                                 entry->ValueLength) != entry->ValueLength) {
+
+                continue;
+            }
+        } else {
+            entry = CONTAINING_RECORD(l, MOUNTMGR_DATABASE_ENTRY, ListEntry);
+        }
+
+        if (entry->IsDeleted) {
+            continue;
+        }
+
+        status = QueryRoutine(entry->ValueName.Buffer, entry->ValueType,
+                              entry->ValueData, entry->ValueLength, Context,
+                              EntryContext);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+    }
+
+    if (UniqueId) {
+        database->DataIndex.Frozen--;
+    }
+
+    MountMgrReleaseDatabase(database);
+
+    return status;
+}
+
+NTSTATUS
+MountMgrWriteDatabaseValue(
+    IN  PWSTR   ValueName,
+    IN  PVOID   ValueData,
+    IN  ULONG   ValueLength
+    )
+
+/*++
+
+Routine Description:
+
+    This routine sets a REG_BINARY value in the database.
+
+Arguments:
+
+    ValueName   - Supplies the value name.
+
+    ValueData   - Supplies the value data.
+
+    ValueLength - Supplies the value length.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    PMOUNTMGR_DATABASE          database = &MountedDevicesDatabase;
+    UNICODE_STRING              name;
+    PMOUNTMGR_DATABASE_ENTRY    entry;
+    NTSTATUS                    status;
+
+    if (!database->Loaded) {
+        return RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE,
+                                     database->KeyName.Buffer, ValueName,
+                                     REG_BINARY, ValueData, ValueLength);
+    }
+
+    RtlInitUnicodeString(&name, ValueName);
+
+    MountMgrAcquireDatabase(database);
+
+    entry = MountMgrLookupDatabaseEntry(database, &name);
+    if (entry) {
+        status = MountMgrSetDatabaseEntryData(database, entry, REG_BINARY,
+                                              ValueData, ValueLength);
+        if (NT_SUCCESS(status)) {
+            entry->IsDeleted = FALSE;
+        }
+    } else {
+        entry = MountMgrCreateDatabaseEntry(database, &name, REG_BINARY,
+                                            ValueData, ValueLength);
+        status = entry ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (NT_SUCCESS(status)) {
+        MountMgrMarkDatabaseEntryDirty(database, entry);
+    }
+
+    MountMgrReleaseDatabase(database);
+
+    return status;
+}
+
+NTSTATUS
+MountMgrDeleteDatabaseValue(
+    IN  PWSTR   ValueName
+    )
+
+/*++
+
+Routine Description:
+
+    This routine deletes a value from the database.
+
+Arguments:
+
+    ValueName   - Supplies the value name.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    PMOUNTMGR_DATABASE          database = &MountedDevicesDatabase;
+    UNICODE_STRING              name;
+    PMOUNTMGR_DATABASE_ENTRY    entry;
+    NTSTATUS                    status;
+
+    if (!database->Loaded) {
+        return RtlDeleteRegistryValue(RTL_REGISTRY_ABSOLUTE,
+                                      database->KeyName.Buffer, ValueName);
+    }
+
+    RtlInitUnicodeString(&name, ValueName);
+
+    MountMgrAcquireDatabase(database);
+
+    entry = MountMgrLookupDatabaseEntry(database, &name);
+    if (entry && !entry->IsDeleted) {
+        entry->IsDeleted = TRUE;
+        MountMgrMarkDatabaseEntryDirty(database, entry);
+        status = STATUS_SUCCESS;
+    } else {
+        status = STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    MountMgrReleaseDatabase(database);
+
+    return status;
+}
+
+NTSTATUS
+MountMgrFlushDatabase(
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    This routine writes the queued entries now, instead of waiting for the
+    lazy writer.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    PMOUNTMGR_DATABASE  database = &MountedDevicesDatabase;
+    NTSTATUS            status;
+
+    if (!database->Loaded) {
+        return STATUS_SUCCESS;
+    }
+
+    MountMgrAcquireDatabase(database);
+
+    //
+    // If the timer has not fired, the lazy writer will not run.  Otherwise
+    // it is queued and will find nothing left to write.
+    //
+
+    if (database->FlushScheduled && KeCancelTimer(&database->FlushTimer)) {
+        database->FlushScheduled = FALSE;
+        KeSetEvent(&database->FlushIdleEvent, IO_NO_INCREMENT, FALSE);
+    }
+
+    status = MountMgrWriteDirtyDatabaseEntries(database);
+
+    MountMgrReleaseDatabase(database);
+
+    return status;
+}
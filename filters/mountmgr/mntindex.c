@@ -0,0 +1,778 @@
+/*++
+
+Copyright (c) 2003  Microsoft Corporation
+
+Module Name:
+
+    mntindex.c
+
+Abstract:
+
+    This module maintains the hash indexes used by the MOUNTMGR.  The
+    mounted device list is indexed by device name and by unique id, and the
+    symbolic links of the mounted devices are indexed by symbolic link name,
+    so that finding a device does not walk the mounted device list.
+
+    The indexes are protected by the extension mutex, the same as the
+    mounted device list.  A device is in the indexes while it is in the
+    mounted device list, and so are its symbolic links.
+
+Environment:
+
+    kernel mode only
+
+Notes:
+
+    This module is also built into the user mode arrival benchmark, with
+    UTEST defined.
+
+Revision History:
+
+--*/
+
+#ifndef UTEST
+
+#define _NTSRV_
+
+#include <ntosp.h>
+#include <zwapi.h>
+#include <mountmgr.h>
+#include <mountdev.h>
+#include <mntmgr.h>
+
+#ifdef POOL_TAGGING
+#undef ExAllocatePool
+
+#define ExAllocatePool(_a,_b) ExAllocatePoolWithTag((_a), (_b), MOUNTMGR_TAG_INDEX)
+
+#define MOUNTMGR_TAG_INDEX      'ItnM'  // MntI
+
+#endif
+
+#endif
+
+//
+// FNV-1a.
+//
+
+#define MOUNTMGR_HASH_BASIS 2166136261
+#define MOUNTMGR_HASH_PRIME 16777619
+
+VOID
+MountMgrGrowHashTable(
+    IN OUT  PMOUNTMGR_HASH_TABLE    Table
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, MountMgrInitializeHashTable)
+#pragma alloc_text(PAGE, MountMgrFreeHashTable)
+#pragma alloc_text(PAGE, MountMgrGrowHashTable)
+#pragma alloc_text(PAGE, MountMgrInsertHashLink)
+#pragma alloc_text(PAGE, MountMgrRemoveHashLink)
+#pragma alloc_text(PAGE, MountMgrHashName)
+#pragma alloc_text(PAGE, MountMgrHashBytes)
+#pragma alloc_text(PAGE, MountMgrInitializeIndexes)
+#pragma alloc_text(PAGE, MountMgrFreeIndexes)
+#pragma alloc_text(PAGE, MountMgrIndexMountedDevice)
+#pragma alloc_text(PAGE, MountMgrUnindexMountedDevice)
+#pragma alloc_text(PAGE, MountMgrIndexUniqueId)
+#pragma alloc_text(PAGE, MountMgrUnindexUniqueId)
+#pragma alloc_text(PAGE, MountMgrIndexSymbolicLink)
+#pragma alloc_text(PAGE, MountMgrUnindexSymbolicLink)
+#pragma alloc_text(PAGE, MountMgrLookupDeviceName)
+#pragma alloc_text(PAGE, MountMgrLookupUniqueId)
+#pragma alloc_text(PAGE, MountMgrLookupSymbolicLink)
+#endif
+
+NTSTATUS
+MountMgrInitializeHashTable(
+    OUT PMOUNTMGR_HASH_TABLE    Table
+    )
+
+/*++
+
+Routine Description:
+
+    This routine initializes an empty hash table.
+
+Arguments:
+
+    Table   - Returns the hash table.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    ULONG   i;
+
+    Table->Buckets = ExAllocatePool(PagedPool, MOUNTMGR_HASH_INITIAL_BUCKETS*
+                                               sizeof(LIST_ENTRY));
+    if (!Table->Buckets) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (i = 0; i < MOUNTMGR_HASH_INITIAL_BUCKETS; i++) {
+        InitializeListHead(&Table->Buckets[i]);
+    }
+
+    Table->BucketMask = MOUNTMGR_HASH_INITIAL_BUCKETS - 1;
+    Table->EntryCount = 0;
+    Table->Frozen = 0;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+MountMgrFreeHashTable(
+    IN OUT  PMOUNTMGR_HASH_TABLE    Table
+    )
+
+/*++
+
+Routine Description:
+
+    This routine frees the buckets of a hash table.  The entries are not
+    touched.
+
+Arguments:
+
+    Table   - Supplies the hash table.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    if (Table->Buckets) {
+        ExFreePool(Table->Buckets);
+        Table->Buckets = NULL;
+    }
+
+    Table->EntryCount = 0;
+}
+
+VOID
+MountMgrGrowHashTable(
+    IN OUT  PMOUNTMGR_HASH_TABLE    Table
+    )
+
+/*++
+
+Routine Description:
+
+    This routine doubles the number of buckets in a hash table.  If the new
+    buckets cannot be allocated the table is left as it is.
+
+    Entries are moved in bucket order and appended to their new buckets, so
+    entries with the same hash stay in the order they were inserted.
+
+Arguments:
+
+    Table   - Supplies the hash table.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    ULONG               newCount, i;
+    PLIST_ENTRY         newBuckets, l;
+    PMOUNTMGR_HASH_LINK link;
+
+    newCount = 2*(Table->BucketMask + 1);
+    newBuckets = ExAllocatePool(PagedPool, newCount*sizeof(LIST_ENTRY));
+    if (!newBuckets) {
+        return;
+    }
+
+    for (i = 0; i < newCount; i++) {
+        InitializeListHead(&newBuckets[i]);
+    }
+
+    for (i = 0; i <= Table->BucketMask; i++) {
+        while (!IsListEmpty(&Table->Buckets[i])) {
+            l = RemoveHeadList(&Table->Buckets[i]);
+            link = CONTAINING_RECORD(l, MOUNTMGR_HASH_LINK, ListEntry);
+            InsertTailList(&newBuckets[link->Hash & (newCount - 1)], l);
+        }
+    }
+
+    ExFreePool(Table->Buckets);
+    Table->Buckets = newBuckets;
+    Table->BucketMask = newCount - 1;
+}
+
+VOID
+MountMgrInsertHashLink(
+    IN OUT  PMOUNTMGR_HASH_TABLE    Table,
+    IN OUT  PMOUNTMGR_HASH_LINK     Link,
+    IN      ULONG                   Hash
+    )
+
+/*++
+
+Routine Description:
+
+    This routine inserts an entry at the end of its bucket.
+
+Arguments:
+
+    Table   - Supplies the hash table.
+
+    Link    - Supplies the hash link of the entry.
+
+    Hash    - Supplies the hash of the entry's key.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    if (!Table->Frozen && Table->EntryCount >= 2*(Table->BucketMask + 1)) {
+        MountMgrGrowHashTable(Table);
+    }
+
+    Link->Hash = Hash;
+    InsertTailList(MountMgrHashBucket(Table, Hash), &Link->ListEntry);
+    Table->EntryCount++;
+}
+
+VOID
+MountMgrRemoveHashLink(
+    IN OUT  PMOUNTMGR_HASH_TABLE    Table,
+    IN OUT  PMOUNTMGR_HASH_LINK     Link
+    )
+
+/*++
+
+Routine Description:
+
+    This routine removes an entry from a hash table.
+
+Arguments:
+
+    Table   - Supplies the hash table.
+
+    Link    - Supplies the hash link of the entry.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    RemoveEntryList(&Link->ListEntry);
+    Table->EntryCount--;
+}
+
+ULONG
+MountMgrHashName(
+    IN  PUNICODE_STRING Name
+    )
+
+/*++
+
+Routine Description:
+
+    This routine hashes a name without regard to case, so that names that
+    RtlEqualUnicodeString considers equal when ignoring case hash the same.
+
+Arguments:
+
+    Name    - Supplies the name.
+
+Return Value:
+
+    The hash of the name.
+
+--*/
+
+{
+    ULONG   hash, i;
+
+    hash = MOUNTMGR_HASH_BASIS;
+    for (i = 0; i < Name->Length/sizeof(WCHAR); i++) {
+        hash ^= RtlUpcaseUnicodeChar(Name->Buffer[i]);
+        hash *= MOUNTMGR_HASH_PRIME;
+    }
+
+    return hash;
+}
+
+ULONG
+MountMgrHashBytes(
+    IN  PVOID   Buffer,
+    IN  ULONG   Length
+    )
+
+/*++
+
+Routine Description:
+
+    This routine hashes a unique id or other binary data.
+
+Arguments:
+
+    Buffer  - Supplies the data.
+
+    Length  - Supplies the length of the data.
+
+Return Value:
+
+    The hash of the data.
+
+--*/
+
+{
+    PUCHAR  p = Buffer;
+    ULONG   hash, i;
+
+    hash = MOUNTMGR_HASH_BASIS;
+    for (i = 0; i < Length; i++) {
+        hash ^= p[i];
+        hash *= MOUNTMGR_HASH_PRIME;
+    }
+
+    return hash;
+}
+
+NTSTATUS
+MountMgrInitializeIndexes(
+    IN OUT  PDEVICE_EXTENSION   Extension
+    )
+
+/*++
+
+Routine Description:
+
+    This routine initializes the mounted device indexes.
+
+Arguments:
+
+    Extension   - Supplies the device extension.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    NTSTATUS    status;
+
+    status = MountMgrInitializeHashTable(&Extension->DeviceNameIndex);
+    if (NT_SUCCESS(status)) {
+        status = MountMgrInitializeHashTable(&Extension->UniqueIdIndex);
+    }
+    if (NT_SUCCESS(status)) {
+        status = MountMgrInitializeHashTable(&Extension->SymbolicLinkIndex);
+    }
+
+    if (!NT_SUCCESS(status)) {
+        MountMgrFreeIndexes(Extension);
+    }
+
+    return status;
+}
+
+VOID
+MountMgrFreeIndexes(
+    IN OUT  PDEVICE_EXTENSION   Extension
+    )
+
+/*++
+
+Routine Description:
+
+    This routine frees the mounted device indexes.
+
+Arguments:
+
+    Extension   - Supplies the device extension.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    MountMgrFreeHashTable(&Extension->DeviceNameIndex);
+    MountMgrFreeHashTable(&Extension->UniqueIdIndex);
+    MountMgrFreeHashTable(&Extension->SymbolicLinkIndex);
+}
+
+VOID
+MountMgrIndexMountedDevice(
+    IN OUT  PDEVICE_EXTENSION           Extension,
+    IN OUT  PMOUNTED_DEVICE_INFORMATION DeviceInfo
+    )
+
+/*++
+
+Routine Description:
+
+    This routine adds a device that is being inserted in the mounted
+    device list, and its symbolic links, to the indexes.
+
+Arguments:
+
+    Extension   - Supplies the device extension.
+
+    DeviceInfo  - Supplies the device information.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PLIST_ENTRY                 l;
+    PSYMBOLIC_LINK_NAME_ENTRY   symlinkEntry;
+
+    MountMgrInsertHashLink(&Extension->DeviceNameIndex,
+                           &DeviceInfo->DeviceNameLink,
+                           MountMgrHashName(&DeviceInfo->DeviceName));
+
+    MountMgrIndexUniqueId(Extension, DeviceInfo);
+
+    for (l = DeviceInfo->SymbolicLinkNames.Flink;
+         l != &DeviceInfo->SymbolicLinkNames; l = l->Flink) {
+
+        symlinkEntry = CONTAINING_RECORD(l, SYMBOLIC_LINK_NAME_ENTRY,
+                                         ListEntry);
+        MountMgrIndexSymbolicLink(Extension, DeviceInfo, symlinkEntry);
+    }
+}
+
+VOID
+MountMgrUnindexMountedDevice(
+    IN OUT  PDEVICE_EXTENSION           Extension,
+    IN OUT  PMOUNTED_DEVICE_INFORMATION DeviceInfo
+    )
+
+/*++
+
+Routine Description:
+
+    This routine removes a device that is being removed from the mounted
+    device list, and its symbolic links, from the indexes.
+
+Arguments:
+
+    Extension   - Supplies the device extension.
+
+    DeviceInfo  - Supplies the device information.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PLIST_ENTRY                 l;
+    PSYMBOLIC_LINK_NAME_ENTRY   symlinkEntry;
+
+    for (l = DeviceInfo->SymbolicLinkNames.Flink;
+         l != &DeviceInfo->SymbolicLinkNames; l = l->Flink) {
+
+        symlinkEntry = CONTAINING_RECORD(l, SYMBOLIC_LINK_NAME_ENTRY,
+                                         ListEntry);
+        MountMgrUnindexSymbolicLink(Extension, symlinkEntry);
+    }
+
+    MountMgrUnindexUniqueId(Extension, DeviceInfo);
+
+    MountMgrRemoveHashLink(&Extension->DeviceNameIndex,
+                           &DeviceInfo->DeviceNameLink);
+}
+
+VOID
+MountMgrIndexUniqueId(
+    IN OUT  PDEVICE_EXTENSION           Extension,
+    IN OUT  PMOUNTED_DEVICE_INFORMATION DeviceInfo
+    )
+
+/*++
+
+Routine Description:
+
+    This routine adds a device to the unique id index.  It is called when
+    the device is indexed and after its unique id changes.
+
+Arguments:
+
+    Extension   - Supplies the device extension.
+
+    DeviceInfo  - Supplies the device information.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    MountMgrInsertHashLink(&Extension->UniqueIdIndex,
+                           &DeviceInfo->UniqueIdLink,
+                           MountMgrHashBytes(DeviceInfo->UniqueId->UniqueId,
+                                    DeviceInfo->UniqueId->UniqueIdLength));
+}
+
+VOID
+MountMgrUnindexUniqueId(
+    IN OUT  PDEVICE_EXTENSION           Extension,
+    IN OUT  PMOUNTED_DEVICE_INFORMATION DeviceInfo
+    )
+
+/*++
+
+Routine Description:
+
+    This routine removes a device from the unique id index.  It is called
+    when the device is unindexed and before its unique id changes.
+
+Arguments:
+
+    Extension   - Supplies the device extension.
+
+    DeviceInfo  - Supplies the device information.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    MountMgrRemoveHashLink(&Extension->UniqueIdIndex,
+                           &DeviceInfo->UniqueIdLink);
+}
+
+VOID
+MountMgrIndexSymbolicLink(
+    IN OUT  PDEVICE_EXTENSION           Extension,
+    IN      PMOUNTED_DEVICE_INFORMATION DeviceInfo,
+    IN OUT  PSYMBOLIC_LINK_NAME_ENTRY   SymlinkEntry
+    )
+
+/*++
+
+Routine Description:
+
+    This routine adds a symbolic link of a device in the mounted device
+    list to the symbolic link index.
+
+Arguments:
+
+    Extension       - Supplies the device extension.
+
+    DeviceInfo      - Supplies the device that the link belongs to.
+
+    SymlinkEntry    - Supplies the symbolic link entry.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    SymlinkEntry->DeviceInfo = DeviceInfo;
+    MountMgrInsertHashLink(&Extension->SymbolicLinkIndex,
+                           &SymlinkEntry->HashLink,
+                           MountMgrHashName(&SymlinkEntry->SymbolicLinkName));
+}
+
+VOID
+MountMgrUnindexSymbolicLink(
+    IN OUT  PDEVICE_EXTENSION           Extension,
+    IN OUT  PSYMBOLIC_LINK_NAME_ENTRY   SymlinkEntry
+    )
+
+/*++
+
+Routine Description:
+
+    This routine removes a symbolic link from the symbolic link index.
+
+Arguments:
+
+    Extension       - Supplies the device extension.
+
+    SymlinkEntry    - Supplies the symbolic link entry.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    MountMgrRemoveHashLink(&Extension->SymbolicLinkIndex,
+                           &SymlinkEntry->HashLink);
+    SymlinkEntry->DeviceInfo = NULL;
+}
+
+PMOUNTED_DEVICE_INFORMATION
+MountMgrLookupDeviceName(
+    IN  PDEVICE_EXTENSION   Extension,
+    IN  PUNICODE_STRING     DeviceName
+    )
+
+/*++
+
+Routine Description:
+
+    This routine finds the mounted device with the given device name.  The
+    comparison ignores case.
+
+Arguments:
+
+    Extension   - Supplies the device extension.
+
+    DeviceName  - Supplies the device name.
+
+Return Value:
+
+    The device information or NULL.
+
+--*/
+
+{
+    ULONG                       hash;
+    PLIST_ENTRY                 bucket, l;
+    PMOUNTED_DEVICE_INFORMATION deviceInfo;
+
+    hash = MountMgrHashName(DeviceName);
+    bucket = MountMgrHashBucket(&Extension->DeviceNameIndex, hash);
+
+    for (l = bucket->Flink; l != bucket; l = l->Flink) {
+
+        deviceInfo = CONTAINING_RECORD(l, MOUNTED_DEVICE_INFORMATION,
+                                       DeviceNameLink.ListEntry);
+
+        if (deviceInfo->DeviceNameLink.Hash == hash &&
+            RtlEqualUnicodeString(DeviceName, &deviceInfo->DeviceName,
+                                  TRUE)) {
+
+            return deviceInfo;
+        }
+    }
+
+    return NULL;
+}
+
+PMOUNTED_DEVICE_INFORMATION
+MountMgrLookupUniqueId(
+    IN  PDEVICE_EXTENSION   Extension,
+    IN  PVOID               UniqueId,
+    IN  ULONG               UniqueIdLength
+    )
+
+/*++
+
+Routine Description:
+
+    This routine finds the first mounted device to arrive with the given
+    unique id.
+
+Arguments:
+
+    Extension       - Supplies the device extension.
+
+    UniqueId        - Supplies the unique id.
+
+    UniqueIdLength  - Supplies the length of the unique id.
+
+Return Value:
+
+    The device information or NULL.
+
+--*/
+
+{
+    ULONG                       hash;
+    PLIST_ENTRY                 bucket, l;
+    PMOUNTED_DEVICE_INFORMATION deviceInfo;
+
+    hash = MountMgrHashBytes(UniqueId, UniqueIdLength);
+    bucket = MountMgrHashBucket(&Extension->UniqueIdIndex, hash);
+
+    for (l = bucket->Flink; l != bucket; l = l->Flink) {
+
+        deviceInfo = CONTAINING_RECORD(l, MOUNTED_DEVICE_INFORMATION,
+                                       UniqueIdLink.ListEntry);
+
+        if (deviceInfo->UniqueIdLink.Hash == hash &&
+            deviceInfo->UniqueId->UniqueIdLength == UniqueIdLength &&
+            RtlCompareMemory(deviceInfo->UniqueId->UniqueId, UniqueId,
+                             UniqueIdLength) == UniqueIdLength) {
+
+            return deviceInfo;
+        }
+    }
+
+    return NULL;
+}
+
+PSYMBOLIC_LINK_NAME_ENTRY
+MountMgrLookupSymbolicLink(
+    IN  PDEVICE_EXTENSION   Extension,
+    IN  PUNICODE_STRING     SymbolicLinkName
+    )
+
+/*++
+
+Routine Description:
+
+    This routine finds the symbolic link entry with the given name.  The
+    entry's 'DeviceInfo' is the device that the link belongs to.
+
+Arguments:
+
+    Extension           - Supplies the device extension.
+
+    SymbolicLinkName    - Supplies the symbolic link name.
+
+Return Value:
+
+    The symbolic link entry or NULL.
+
+--*/
+
+{
+    ULONG                       hash;
+    PLIST_ENTRY                 bucket, l;
+    PSYMBOLIC_LINK_NAME_ENTRY   symlinkEntry;
+
+    hash = MountMgrHashName(SymbolicLinkName);
+    bucket = MountMgrHashBucket(&Extension->SymbolicLinkIndex, hash);
+
+    for (l = bucket->Flink; l != bucket; l = l->Flink) {
+
+        symlinkEntry = CONTAINING_RECORD(l, SYMBOLIC_LINK_NAME_ENTRY,
+                                         HashLink.ListEntry);
+
+        if (symlinkEntry->HashLink.Hash == hash &&
+            RtlEqualUnicodeString(SymbolicLinkName,
+                                  &symlinkEntry->SymbolicLinkName, TRUE)) {
+
+            return symlinkEntry;
+        }
+    }
+
+    return NULL;
+}
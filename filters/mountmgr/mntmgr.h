@@ -21,10 +21,36 @@ Revision History:
 #define MOUNTED_DEVICES_KEY         L"\\Registry\\Machine\\System\\MountedDevices"
 #define MOUNTED_DEVICES_OFFLINE_KEY L"\\Registry\\Machine\\System\\MountedDevices\\Offline"
 
+//
+// Hash tables used to index the mounted devices, their symbolic links and
+// the mounted devices database.  Each bucket is a list of hash links.  The
+// table doubles when it holds twice as many entries as buckets, unless it
+// is frozen because its buckets are being walked.
+//
+
+#define MOUNTMGR_HASH_INITIAL_BUCKETS   64
+
+typedef struct _MOUNTMGR_HASH_LINK {
+    LIST_ENTRY  ListEntry;
+    ULONG       Hash;
+} MOUNTMGR_HASH_LINK, *PMOUNTMGR_HASH_LINK;
+
+typedef struct _MOUNTMGR_HASH_TABLE {
+    PLIST_ENTRY Buckets;
+    ULONG       BucketMask;
+    ULONG       EntryCount;
+    ULONG       Frozen;
+} MOUNTMGR_HASH_TABLE, *PMOUNTMGR_HASH_TABLE;
+
+#define MountMgrHashBucket(Table, Hash) \
+        (&(Table)->Buckets[(Hash) & (Table)->BucketMask])
+
 typedef struct _SYMBOLIC_LINK_NAME_ENTRY {
-    LIST_ENTRY      ListEntry;
-    UNICODE_STRING  SymbolicLinkName;
-    BOOLEAN         IsInDatabase;
+    LIST_ENTRY                          ListEntry;
+    UNICODE_STRING                      SymbolicLinkName;
+    BOOLEAN                             IsInDatabase;
+    MOUNTMGR_HASH_LINK                  HashLink;
+    struct _MOUNTED_DEVICE_INFORMATION* DeviceInfo;
 } SYMBOLIC_LINK_NAME_ENTRY, *PSYMBOLIC_LINK_NAME_ENTRY;
 
 typedef struct _REPLICATED_UNIQUE_ID {
@@ -32,6 +58,100 @@ typedef struct _REPLICATED_UNIQUE_ID {
     PMOUNTDEV_UNIQUE_ID UniqueId;
 } REPLICATED_UNIQUE_ID, *PREPLICATED_UNIQUE_ID;
 
+//
+// Volume arrivals and removals are run by a pool of worker threads.  Each
+// volume, by notification name, has a queue of work items that are run one
+// at a time in the order they were queued, so that the work for one volume
+// is serialized while the work for different volumes runs in parallel.  A
+// volume queue exists while it has work, and is on the ready list while no
+// worker is running it.
+//
+// The same device can arrive again under another notification name before
+// the removal queued under its old name has run.  Such an arrival is queued
+// again behind that removal, with its own notification name.
+//
+
+#define MOUNTMGR_MINIMUM_VOLUME_WORKERS 2
+#define MOUNTMGR_MAXIMUM_VOLUME_WORKERS 8
+
+//
+// The lock wait histogram buckets are powers of ten of 100 microseconds:
+// < 100us, < 1ms, < 10ms, < 100ms, < 1s, and longer.
+//
+
+#define MOUNTMGR_LOCK_WAIT_BUCKETS      6
+
+typedef struct _MOUNTMGR_VOLUME_WORK_BATCH {
+    LONG        Outstanding;
+    NTSTATUS    Status;
+    KEVENT      Event;
+} MOUNTMGR_VOLUME_WORK_BATCH, *PMOUNTMGR_VOLUME_WORK_BATCH;
+
+typedef struct _MOUNTMGR_VOLUME_WORK_ITEM {
+    LIST_ENTRY                  ListEntry;
+    BOOLEAN                     Arrival;
+    BOOLEAN                     NotAPdo;
+    ULONGLONG                   QueueTime;
+    PMOUNTMGR_VOLUME_WORK_BATCH Batch;
+    UNICODE_STRING              NotificationName;   // if not the queue's
+} MOUNTMGR_VOLUME_WORK_ITEM, *PMOUNTMGR_VOLUME_WORK_ITEM;
+
+typedef struct _MOUNTMGR_VOLUME_QUEUE {
+    MOUNTMGR_HASH_LINK  HashLink;
+    LIST_ENTRY          ReadyListEntry;
+    LIST_ENTRY          WorkItems;
+    ULONG               Removals;   // removals queued or running
+    UNICODE_STRING      NotificationName;
+} MOUNTMGR_VOLUME_QUEUE, *PMOUNTMGR_VOLUME_QUEUE;
+
+typedef struct _MOUNTMGR_VOLUME_POOL {
+
+    //
+    // Protects the pool.
+    //
+
+    KSEMAPHORE Lock;
+
+    //
+    // The volume queues, indexed by notification name, and the ones that
+    // are ready to run.  'ReadyCount' is released once for every queue put
+    // on the ready list, and once for every worker when the pool stops.
+    //
+
+    MOUNTMGR_HASH_TABLE Queues;
+    LIST_ENTRY ReadyList;
+    KSEMAPHORE ReadyCount;
+
+    ULONG WorkerCount;
+    PVOID Workers[MOUNTMGR_MAXIMUM_VOLUME_WORKERS];
+    BOOLEAN Stopping;
+
+    //
+    // The number of work items queued or running.  'IdleEvent' is signalled
+    // when it is zero.
+    //
+
+    LONG Outstanding;
+    KEVENT IdleEvent;
+
+    //
+    // Statistics, for the debugger.  Times are in 100ns units.  The lock
+    // wait of an arrival is the total time it waited for the driver mutex.
+    //
+
+    ULONG Arrivals;
+    ULONG Removals;
+    ULONGLONG TotalQueueTime;
+    ULONGLONG MaximumQueueTime;
+
+    ULONG TimedArrivals;
+    ULONGLONG TotalArrivalTime;
+    ULONGLONG TotalLockWaitTime;
+    ULONGLONG MaximumLockWaitTime;
+    ULONG LockWaitHistogram[MOUNTMGR_LOCK_WAIT_BUCKETS];
+
+} MOUNTMGR_VOLUME_POOL, *PMOUNTMGR_VOLUME_POOL;
+
 
 typedef struct _DEVICE_EXTENSION {
 
@@ -139,6 +259,22 @@ typedef struct _DEVICE_EXTENSION {
 
     UNICODE_STRING RegistryPath;
 
+    //
+    // Indexes over the mounted device list, by device name and by unique
+    // id, and over the symbolic links of the mounted devices, by symbolic
+    // link name.  Protect with 'mutex'.
+    //
+
+    MOUNTMGR_HASH_TABLE DeviceNameIndex;
+    MOUNTMGR_HASH_TABLE UniqueIdIndex;
+    MOUNTMGR_HASH_TABLE SymbolicLinkIndex;
+
+    //
+    // The worker pool that runs volume arrivals and removals.
+    //
+
+    MOUNTMGR_VOLUME_POOL VolumePool;
+
 } DEVICE_EXTENSION, *PDEVICE_EXTENSION;
 
 
@@ -161,6 +297,8 @@ typedef struct _MOUNTED_DEVICE_INFORMATION {
     BOOLEAN             RemoteDatabaseMigrated;
     PVOID               TargetDeviceNotificationEntry;
     PDEVICE_EXTENSION   Extension;
+    MOUNTMGR_HASH_LINK  DeviceNameLink;
+    MOUNTMGR_HASH_LINK  UniqueIdLink;
 } MOUNTED_DEVICE_INFORMATION, *PMOUNTED_DEVICE_INFORMATION;
 
 typedef struct _SAVED_LINKS_INFORMATION {
@@ -203,3 +341,295 @@ typedef struct _REMOTE_DATABASE_MIGRATION_CONTEXT {
     HANDLE                      Handle;
 } REMOTE_DATABASE_MIGRATION_CONTEXT, *PREMOTE_DATABASE_MIGRATION_CONTEXT;
 
+//
+// The mounted devices database is the MountedDevices key, cached in memory.
+// Every value of the key is an entry, indexed by value name and by value
+// data (a unique id).  Changes are made to the cache and written to the key
+// in batches, a short time after the first change of a batch.  Deleted
+// entries are kept until they have been written.
+//
+
+#define MOUNTMGR_DATABASE_FLUSH_DELAY   (-10*1000*1000)
+
+typedef struct _MOUNTMGR_DATABASE_ENTRY {
+    LIST_ENTRY          ListEntry;
+    LIST_ENTRY          DirtyListEntry;
+    MOUNTMGR_HASH_LINK  NameLink;
+    MOUNTMGR_HASH_LINK  DataLink;
+    UNICODE_STRING      ValueName;
+    ULONG               ValueType;
+    PVOID               ValueData;
+    ULONG               ValueLength;
+    BOOLEAN             IsDirty;
+    BOOLEAN             IsDeleted;
+} MOUNTMGR_DATABASE_ENTRY, *PMOUNTMGR_DATABASE_ENTRY;
+
+typedef struct _MOUNTMGR_DATABASE {
+
+    //
+    // Protects the database.  Acquired exclusive, and recursively from the
+    // query routines that change the database.
+    //
+
+    ERESOURCE Resource;
+
+    //
+    // The registry key.  If the key could not be loaded, the database
+    // passes every request through to the registry.
+    //
+
+    UNICODE_STRING KeyName;
+    BOOLEAN Loaded;
+
+    //
+    // All entries in key order, and the entries not yet written.
+    //
+
+    LIST_ENTRY EntryList;
+    LIST_ENTRY DirtyList;
+
+    MOUNTMGR_HASH_TABLE NameIndex;
+    MOUNTMGR_HASH_TABLE DataIndex;
+
+    //
+    // The lazy writer.  'FlushIdleEvent' is signalled when no flush is
+    // scheduled.
+    //
+
+    BOOLEAN FlushScheduled;
+    KTIMER FlushTimer;
+    KDPC FlushDpc;
+    WORK_QUEUE_ITEM FlushWorkItem;
+    KEVENT FlushIdleEvent;
+
+    //
+    // Statistics, for the debugger.
+    //
+
+    ULONG Flushes;
+    ULONG FlushFailures;
+    ULONG ValuesWritten;
+    ULONG ValuesDeleted;
+
+} MOUNTMGR_DATABASE, *PMOUNTMGR_DATABASE;
+
+//
+// mntindex.c
+//
+
+NTSTATUS
+MountMgrInitializeHashTable(
+    OUT PMOUNTMGR_HASH_TABLE    Table
+    );
+
+VOID
+MountMgrFreeHashTable(
+    IN OUT  PMOUNTMGR_HASH_TABLE    Table
+    );
+
+VOID
+MountMgrInsertHashLink(
+    IN OUT  PMOUNTMGR_HASH_TABLE    Table,
+    IN OUT  PMOUNTMGR_HASH_LINK     Link,
+    IN      ULONG                   Hash
+    );
+
+VOID
+MountMgrRemoveHashLink(
+    IN OUT  PMOUNTMGR_HASH_TABLE    Table,
+    IN OUT  PMOUNTMGR_HASH_LINK     Link
+    );
+
+ULONG
+MountMgrHashName(
+    IN  PUNICODE_STRING Name
+    );
+
+ULONG
+MountMgrHashBytes(
+    IN  PVOID   Buffer,
+    IN  ULONG   Length
+    );
+
+NTSTATUS
+MountMgrInitializeIndexes(
+    IN OUT  PDEVICE_EXTENSION   Extension
+    );
+
+VOID
+MountMgrFreeIndexes(
+    IN OUT  PDEVICE_EXTENSION   Extension
+    );
+
+VOID
+MountMgrIndexMountedDevice(
+    IN OUT  PDEVICE_EXTENSION           Extension,
+    IN OUT  PMOUNTED_DEVICE_INFORMATION DeviceInfo
+    );
+
+VOID
+MountMgrUnindexMountedDevice(
+    IN OUT  PDEVICE_EXTENSION           Extension,
+    IN OUT  PMOUNTED_DEVICE_INFORMATION DeviceInfo
+    );
+
+VOID
+MountMgrIndexUniqueId(
+    IN OUT  PDEVICE_EXTENSION           Extension,
+    IN OUT  PMOUNTED_DEVICE_INFORMATION DeviceInfo
+    );
+
+VOID
+MountMgrUnindexUniqueId(
+    IN OUT  PDEVICE_EXTENSION           Extension,
+    IN OUT  PMOUNTED_DEVICE_INFORMATION DeviceInfo
+    );
+
+VOID
+MountMgrIndexSymbolicLink(
+    IN OUT  PDEVICE_EXTENSION           Extension,
+    IN      PMOUNTED_DEVICE_INFORMATION DeviceInfo,
+    IN OUT  PSYMBOLIC_LINK_NAME_ENTRY   SymlinkEntry
+    );
+
+VOID
+MountMgrUnindexSymbolicLink(
+    IN OUT  PDEVICE_EXTENSION           Extension,
+    IN OUT  PSYMBOLIC_LINK_NAME_ENTRY   SymlinkEntry
+    );
+
+PMOUNTED_DEVICE_INFORMATION
+MountMgrLookupDeviceName(
+    IN  PDEVICE_EXTENSION   Extension,
+    IN  PUNICODE_STRING     DeviceName
+    );
+
+PMOUNTED_DEVICE_INFORMATION
+MountMgrLookupUniqueId(
+    IN  PDEVICE_EXTENSION   Extension,
+    IN  PVOID               UniqueId,
+    IN  ULONG               UniqueIdLength
+    );
+
+PSYMBOLIC_LINK_NAME_ENTRY
+MountMgrLookupSymbolicLink(
+    IN  PDEVICE_EXTENSION   Extension,
+    IN  PUNICODE_STRING     SymbolicLinkName
+    );
+
+//
+// mntdb.c
+//
+
+extern MOUNTMGR_DATABASE MountedDevicesDatabase;
+
+NTSTATUS
+MountMgrLoadDatabase(
+    IN  PWSTR   KeyName
+    );
+
+VOID
+MountMgrUnloadDatabase(
+    VOID
+    );
+
+NTSTATUS
+MountMgrQueryDatabaseValues(
+    IN  PWSTR                       ValueName,
+    IN  PMOUNTDEV_UNIQUE_ID         UniqueId,
+    IN  PRTL_QUERY_REGISTRY_ROUTINE QueryRoutine,
+    IN  PVOID                       Context,
+    IN  PVOID                       EntryContext
+    );
+
+NTSTATUS
+MountMgrWriteDatabaseValue(
+    IN  PWSTR   ValueName,
+    IN  PVOID   ValueData,
+    IN  ULONG   ValueLength
+    );
+
+NTSTATUS
+MountMgrDeleteDatabaseValue(
+    IN  PWSTR   ValueName
+    );
+
+NTSTATUS
+MountMgrFlushDatabase(
+    VOID
+    );
+
+//
+// mntpool.c
+//
+
+NTSTATUS
+MountMgrStartVolumePool(
+    IN OUT  PDEVICE_EXTENSION   Extension
+    );
+
+VOID
+MountMgrStopVolumePool(
+    IN OUT  PDEVICE_EXTENSION   Extension
+    );
+
+VOID
+MountMgrWaitForVolumePool(
+    IN  PDEVICE_EXTENSION   Extension
+    );
+
+NTSTATUS
+MountMgrQueueVolumeWork(
+    IN OUT  PDEVICE_EXTENSION           Extension,
+    IN      PUNICODE_STRING             NotificationName,
+    IN      BOOLEAN                     Arrival,
+    IN      BOOLEAN                     NotAPdo,
+    IN      PMOUNTMGR_VOLUME_WORK_BATCH Batch
+    );
+
+NTSTATUS
+MountMgrQueueArrivalAfterRemoval(
+    IN OUT  PDEVICE_EXTENSION   Extension,
+    IN      PUNICODE_STRING     RemovalName,
+    IN      PUNICODE_STRING     NotificationName,
+    IN      BOOLEAN             NotAPdo
+    );
+
+VOID
+MountMgrInitializeVolumeWorkBatch(
+    OUT PMOUNTMGR_VOLUME_WORK_BATCH Batch
+    );
+
+NTSTATUS
+MountMgrWaitForVolumeWorkBatch(
+    IN OUT  PMOUNTMGR_VOLUME_WORK_BATCH Batch
+    );
+
+ULONGLONG
+MountMgrWaitForMutex(
+    IN  PDEVICE_EXTENSION   Extension
+    );
+
+VOID
+MountMgrRecordArrival(
+    IN OUT  PDEVICE_EXTENSION   Extension,
+    IN      ULONGLONG           LockWaitTime,
+    IN      ULONGLONG           ArrivalTime
+    );
+
+//
+// mountmgr.c
+//
+
+NTSTATUS
+MountMgrMountedDeviceArrival(
+    IN  PDEVICE_EXTENSION   Extension,
+    IN  PUNICODE_STRING     NotificationName,
+    IN  BOOLEAN             NotAPdo
+    );
+
+NTSTATUS
+MountMgrMountedDeviceRemoval(
+    IN  PDEVICE_EXTENSION   Extension,
+    IN  PUNICODE_STRING     NotificationName
+    );
@@ -0,0 +1,734 @@
+/*++
+
+Copyright (c) 2003  Microsoft Corporation
+
+Module Name:
+
+    mntpool.c
+
+Abstract:
+
+    This module runs volume arrivals and removals for the MOUNTMGR on a pool
+    of worker threads, so that a PnP notification for one volume does not
+    wait behind the arrival of another.  The work for one volume is run one
+    item at a time, in the order it was queued.
+
+    The arrival itself still takes the extension mutex around the mounted
+    device list and the drive letter assignment, so this module also keeps
+    the time arrivals spend waiting for it.
+
+Environment:
+
+    kernel mode only
+
+Notes:
+
+Revision History:
+
+--*/
+
+#define _NTSRV_
+
+#include <ntosp.h>
+#include <zwapi.h>
+#include <mountmgr.h>
+#include <mountdev.h>
+#include <mntmgr.h>
+
+#ifdef POOL_TAGGING
+#undef ExAllocatePool
+
+#define ExAllocatePool(_a,_b) ExAllocatePoolWithTag((_a), (_b), MOUNTMGR_TAG_POOL)
+
+#define MOUNTMGR_TAG_POOL       'PtnM'  // MntP
+
+#endif
+
+VOID
+MountMgrVolumeWorker(
+    IN  PVOID   Extension
+    );
+
+PMOUNTMGR_VOLUME_QUEUE
+MountMgrFindVolumeQueue(
+    IN  PMOUNTMGR_VOLUME_POOL   Pool,
+    IN  PUNICODE_STRING         NotificationName,
+    IN  ULONG                   Hash
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, MountMgrStartVolumePool)
+#pragma alloc_text(PAGE, MountMgrStopVolumePool)
+#pragma alloc_text(PAGE, MountMgrWaitForVolumePool)
+#pragma alloc_text(PAGE, MountMgrVolumeWorker)
+#pragma alloc_text(PAGE, MountMgrFindVolumeQueue)
+#pragma alloc_text(PAGE, MountMgrQueueVolumeWork)
+#pragma alloc_text(PAGE, MountMgrQueueArrivalAfterRemoval)
+#pragma alloc_text(PAGE, MountMgrInitializeVolumeWorkBatch)
+#pragma alloc_text(PAGE, MountMgrWaitForVolumeWorkBatch)
+#pragma alloc_text(PAGE, MountMgrWaitForMutex)
+#pragma alloc_text(PAGE, MountMgrRecordArrival)
+#endif
+
+NTSTATUS
+MountMgrStartVolumePool(
+    IN OUT  PDEVICE_EXTENSION   Extension
+    )
+
+/*++
+
+Routine Description:
+
+    This routine starts the volume worker pool.  When no worker can be
+    started the pool refuses all work, and the callers run it themselves.
+
+Arguments:
+
+    Extension   - Supplies the device extension.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    PMOUNTMGR_VOLUME_POOL   pool = &Extension->VolumePool;
+    NTSTATUS                status;
+    ULONG                   workerCount, i;
+    HANDLE                  handle;
+
+    KeInitializeSemaphore(&pool->Lock, 1, 1);
+    InitializeListHead(&pool->ReadyList);
+    KeInitializeSemaphore(&pool->ReadyCount, 0, MAXLONG);
+    KeInitializeEvent(&pool->IdleEvent, NotificationEvent, TRUE);
+    pool->WorkerCount = 0;
+    pool->Stopping = FALSE;
+    pool->Outstanding = 0;
+
+    status = MountMgrInitializeHashTable(&pool->Queues);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    workerCount = 2*KeNumberProcessors;
+    if (workerCount < MOUNTMGR_MINIMUM_VOLUME_WORKERS) {
+        workerCount = MOUNTMGR_MINIMUM_VOLUME_WORKERS;
+    } else if (workerCount > MOUNTMGR_MAXIMUM_VOLUME_WORKERS) {
+        workerCount = MOUNTMGR_MAXIMUM_VOLUME_WORKERS;
+    }
+
+    for (i = 0; i < workerCount; i++) {
+
+        status = PsCreateSystemThread(&handle, THREAD_ALL_ACCESS, NULL, NULL,
+                                      NULL, MountMgrVolumeWorker, Extension);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        status = ObReferenceObjectByHandle(handle, THREAD_ALL_ACCESS,
+                                           *PsThreadType, KernelMode,
+                                           &pool->Workers[i], NULL);
+        ASSERT(NT_SUCCESS(status));
+        ZwClose(handle);
+
+        pool->WorkerCount++;
+    }
+
+    return pool->WorkerCount ? STATUS_SUCCESS : status;
+}
+
+VOID
+MountMgrStopVolumePool(
+    IN OUT  PDEVICE_EXTENSION   Extension
+    )
+
+/*++
+
+Routine Description:
+
+    This routine waits for the queued volume work to finish and then stops
+    the volume workers.
+
+Arguments:
+
+    Extension   - Supplies the device extension.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PMOUNTMGR_VOLUME_POOL   pool = &Extension->VolumePool;
+    ULONG                   i;
+
+    MountMgrWaitForVolumePool(Extension);
+
+    KeWaitForSingleObject(&pool->Lock, Executive, KernelMode, FALSE, NULL);
+    pool->Stopping = TRUE;
+    KeReleaseSemaphore(&pool->Lock, IO_NO_INCREMENT, 1, FALSE);
+
+    if (pool->WorkerCount) {
+        KeReleaseSemaphore(&pool->ReadyCount, IO_NO_INCREMENT,
+                           pool->WorkerCount, FALSE);
+    }
+
+    for (i = 0; i < pool->WorkerCount; i++) {
+        KeWaitForSingleObject(pool->Workers[i], Executive, KernelMode, FALSE,
+                              NULL);
+        ObDereferenceObject(pool->Workers[i]);
+    }
+    pool->WorkerCount = 0;
+
+    ASSERT(IsListEmpty(&pool->ReadyList));
+    MountMgrFreeHashTable(&pool->Queues);
+}
+
+VOID
+MountMgrWaitForVolumePool(
+    IN  PDEVICE_EXTENSION   Extension
+    )
+
+/*++
+
+Routine Description:
+
+    This routine waits until there is no volume work queued or running.
+
+Arguments:
+
+    Extension   - Supplies the device extension.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    KeWaitForSingleObject(&Extension->VolumePool.IdleEvent, Executive,
+                          KernelMode, FALSE, NULL);
+}
+
+VOID
+MountMgrVolumeWorker(
+    IN  PVOID   Extension
+    )
+
+/*++
+
+Routine Description:
+
+    This is the volume worker thread.  It takes a volume queue off of the
+    ready list, runs the first work item of it, and puts the queue back on
+    the ready list if more work was queued for the volume meanwhile.
+
+Arguments:
+
+    Extension   - Supplies the device extension.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PDEVICE_EXTENSION           extension = Extension;
+    PMOUNTMGR_VOLUME_POOL       pool = &extension->VolumePool;
+    PLIST_ENTRY                 l;
+    PMOUNTMGR_VOLUME_QUEUE      queue;
+    PMOUNTMGR_VOLUME_WORK_ITEM  workItem;
+    PMOUNTMGR_VOLUME_WORK_BATCH batch;
+    PUNICODE_STRING             notificationName;
+    BOOLEAN                     arrival;
+    ULONGLONG                   queueTime;
+    NTSTATUS                    status;
+
+    PsSetThreadHardErrorsAreDisabled(PsGetCurrentThread(), TRUE);
+
+    for (;;) {
+
+        KeWaitForSingleObject(&pool->ReadyCount, Executive, KernelMode,
+                              FALSE, NULL);
+
+        KeWaitForSingleObject(&pool->Lock, Executive, KernelMode, FALSE,
+                              NULL);
+
+        if (IsListEmpty(&pool->ReadyList)) {
+
+            //
+            // The pool is stopping.
+            //
+
+            ASSERT(pool->Stopping);
+            KeReleaseSemaphore(&pool->Lock, IO_NO_INCREMENT, 1, FALSE);
+            break;
+        }
+
+        l = RemoveHeadList(&pool->ReadyList);
+        queue = CONTAINING_RECORD(l, MOUNTMGR_VOLUME_QUEUE, ReadyListEntry);
+
+        ASSERT(!IsListEmpty(&queue->WorkItems));
+        l = RemoveHeadList(&queue->WorkItems);
+        workItem = CONTAINING_RECORD(l, MOUNTMGR_VOLUME_WORK_ITEM, ListEntry);
+
+        queueTime = KeQueryInterruptTime() - workItem->QueueTime;
+        pool->TotalQueueTime += queueTime;
+        if (queueTime > pool->MaximumQueueTime) {
+            pool->MaximumQueueTime = queueTime;
+        }
+        if (workItem->Arrival) {
+            pool->Arrivals++;
+        } else {
+            pool->Removals++;
+        }
+
+        KeReleaseSemaphore(&pool->Lock, IO_NO_INCREMENT, 1, FALSE);
+
+        if (workItem->NotificationName.Buffer) {
+            notificationName = &workItem->NotificationName;
+        } else {
+            notificationName = &queue->NotificationName;
+        }
+
+        arrival = workItem->Arrival;
+        if (arrival) {
+            status = MountMgrMountedDeviceArrival(extension, notificationName,
+                                                  workItem->NotAPdo);
+        } else {
+            status = MountMgrMountedDeviceRemoval(extension, notificationName);
+        }
+
+        batch = workItem->Batch;
+        ExFreePool(workItem);
+
+        if (batch) {
+            if (!NT_SUCCESS(status)) {
+                InterlockedCompareExchange(&batch->Status, status,
+                                           STATUS_SUCCESS);
+            }
+            if (!InterlockedDecrement(&batch->Outstanding)) {
+                KeSetEvent(&batch->Event, IO_NO_INCREMENT, FALSE);
+            }
+        }
+
+        KeWaitForSingleObject(&pool->Lock, Executive, KernelMode, FALSE,
+                              NULL);
+
+        if (!arrival) {
+            queue->Removals--;
+        }
+
+        if (IsListEmpty(&queue->WorkItems)) {
+            MountMgrRemoveHashLink(&pool->Queues, &queue->HashLink);
+            ExFreePool(queue);
+        } else {
+            InsertTailList(&pool->ReadyList, &queue->ReadyListEntry);
+            KeReleaseSemaphore(&pool->ReadyCount, IO_NO_INCREMENT, 1, FALSE);
+        }
+
+        if (!--pool->Outstanding) {
+            KeSetEvent(&pool->IdleEvent, IO_NO_INCREMENT, FALSE);
+        }
+
+        KeReleaseSemaphore(&pool->Lock, IO_NO_INCREMENT, 1, FALSE);
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+PMOUNTMGR_VOLUME_QUEUE
+MountMgrFindVolumeQueue(
+    IN  PMOUNTMGR_VOLUME_POOL   Pool,
+    IN  PUNICODE_STRING         NotificationName,
+    IN  ULONG                   Hash
+    )
+
+/*++
+
+Routine Description:
+
+    This routine finds the volume queue for the given notification name.
+    The pool lock must be held.
+
+Arguments:
+
+    Pool                - Supplies the volume pool.
+
+    NotificationName    - Supplies the notification name of the volume.
+
+    Hash                - Supplies the hash of the notification name.
+
+Return Value:
+
+    The volume queue or NULL.
+
+--*/
+
+{
+    PLIST_ENTRY             bucket, l;
+    PMOUNTMGR_VOLUME_QUEUE  queue;
+
+    bucket = MountMgrHashBucket(&Pool->Queues, Hash);
+    for (l = bucket->Flink; l != bucket; l = l->Flink) {
+        queue = CONTAINING_RECORD(l, MOUNTMGR_VOLUME_QUEUE, HashLink.ListEntry);
+        if (queue->HashLink.Hash == Hash &&
+            RtlEqualUnicodeString(&queue->NotificationName, NotificationName,
+                                  TRUE)) {
+
+            return queue;
+        }
+    }
+
+    return NULL;
+}
+
+NTSTATUS
+MountMgrQueueVolumeWork(
+    IN OUT  PDEVICE_EXTENSION           Extension,
+    IN      PUNICODE_STRING             NotificationName,
+    IN      BOOLEAN                     Arrival,
+    IN      BOOLEAN                     NotAPdo,
+    IN      PMOUNTMGR_VOLUME_WORK_BATCH Batch
+    )
+
+/*++
+
+Routine Description:
+
+    This routine queues the arrival or removal of a volume to the volume
+    worker pool.  When this routine fails the caller must run the work
+    itself.
+
+Arguments:
+
+    Extension           - Supplies the device extension.
+
+    NotificationName    - Supplies the notification name of the volume.
+
+    Arrival             - Supplies whether this is an arrival or a removal.
+
+    NotAPdo             - Supplies whether the device is not a PDO, for
+                            arrivals.
+
+    Batch               - Supplies an optional batch to count the work in.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    PMOUNTMGR_VOLUME_POOL       pool = &Extension->VolumePool;
+    PMOUNTMGR_VOLUME_WORK_ITEM  workItem;
+    PMOUNTMGR_VOLUME_QUEUE      queue;
+    ULONG                       hash;
+
+    if (!pool->WorkerCount) {
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    workItem = ExAllocatePool(PagedPool, sizeof(MOUNTMGR_VOLUME_WORK_ITEM));
+    if (!workItem) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    workItem->Arrival = Arrival;
+    workItem->NotAPdo = NotAPdo;
+    workItem->QueueTime = KeQueryInterruptTime();
+    workItem->Batch = Batch;
+    workItem->NotificationName.Buffer = NULL;
+
+    hash = MountMgrHashName(NotificationName);
+
+    KeWaitForSingleObject(&pool->Lock, Executive, KernelMode, FALSE, NULL);
+
+    if (pool->Stopping) {
+        KeReleaseSemaphore(&pool->Lock, IO_NO_INCREMENT, 1, FALSE);
+        ExFreePool(workItem);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    queue = MountMgrFindVolumeQueue(pool, NotificationName, hash);
+    if (!queue) {
+
+        queue = ExAllocatePool(PagedPool, sizeof(MOUNTMGR_VOLUME_QUEUE) +
+                                          NotificationName->Length +
+                                          sizeof(WCHAR));
+        if (!queue) {
+            KeReleaseSemaphore(&pool->Lock, IO_NO_INCREMENT, 1, FALSE);
+            ExFreePool(workItem);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        InitializeListHead(&queue->WorkItems);
+        queue->Removals = 0;
+        queue->NotificationName.Length = NotificationName->Length;
+        queue->NotificationName.MaximumLength = NotificationName->Length +
+                                                sizeof(WCHAR);
+        queue->NotificationName.Buffer = (PWSTR) (queue + 1);
+        RtlCopyMemory(queue->NotificationName.Buffer, NotificationName->Buffer,
+                      NotificationName->Length);
+        queue->NotificationName.Buffer[NotificationName->Length/sizeof(WCHAR)] = 0;
+
+        MountMgrInsertHashLink(&pool->Queues, &queue->HashLink, hash);
+        InsertTailList(&pool->ReadyList, &queue->ReadyListEntry);
+        KeReleaseSemaphore(&pool->ReadyCount, IO_NO_INCREMENT, 1, FALSE);
+    }
+
+    InsertTailList(&queue->WorkItems, &workItem->ListEntry);
+
+    if (!Arrival) {
+        queue->Removals++;
+    }
+
+    if (!pool->Outstanding++) {
+        KeClearEvent(&pool->IdleEvent);
+    }
+
+    if (Batch) {
+        InterlockedIncrement(&Batch->Outstanding);
+    }
+
+    KeReleaseSemaphore(&pool->Lock, IO_NO_INCREMENT, 1, FALSE);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MountMgrQueueArrivalAfterRemoval(
+    IN OUT  PDEVICE_EXTENSION   Extension,
+    IN      PUNICODE_STRING     RemovalName,
+    IN      PUNICODE_STRING     NotificationName,
+    IN      BOOLEAN             NotAPdo
+    )
+
+/*++
+
+Routine Description:
+
+    This routine is called by an arrival that finds its device already
+    mounted under another notification name.  If a removal is queued or
+    running for that name, the arrival is queued again behind it, so that it
+    runs once the old instance of the device is gone.
+
+Arguments:
+
+    Extension           - Supplies the device extension.
+
+    RemovalName         - Supplies the notification name the device is
+                            mounted under.
+
+    NotificationName    - Supplies the notification name of the arrival.
+
+    NotAPdo             - Supplies whether the device is not a PDO.
+
+Return Value:
+
+    STATUS_SUCCESS if the arrival was queued, or STATUS_NOT_FOUND if no
+    removal is pending for the device.
+
+--*/
+
+{
+    PMOUNTMGR_VOLUME_POOL       pool = &Extension->VolumePool;
+    PMOUNTMGR_VOLUME_WORK_ITEM  workItem;
+    PMOUNTMGR_VOLUME_QUEUE      queue;
+    ULONG                       hash;
+
+    if (!pool->WorkerCount) {
+        return STATUS_NOT_FOUND;
+    }
+
+    workItem = ExAllocatePool(PagedPool, sizeof(MOUNTMGR_VOLUME_WORK_ITEM) +
+                                         NotificationName->Length +
+                                         sizeof(WCHAR));
+    if (!workItem) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    workItem->Arrival = TRUE;
+    workItem->NotAPdo = NotAPdo;
+    workItem->QueueTime = KeQueryInterruptTime();
+    workItem->Batch = NULL;
+    workItem->NotificationName.Length = NotificationName->Length;
+    workItem->NotificationName.MaximumLength = NotificationName->Length +
+                                               sizeof(WCHAR);
+    workItem->NotificationName.Buffer = (PWSTR) (workItem + 1);
+    RtlCopyMemory(workItem->NotificationName.Buffer, NotificationName->Buffer,
+                  NotificationName->Length);
+    workItem->NotificationName.Buffer[NotificationName->Length/sizeof(WCHAR)] = 0;
+
+    hash = MountMgrHashName(RemovalName);
+
+    KeWaitForSingleObject(&pool->Lock, Executive, KernelMode, FALSE, NULL);
+
+    queue = MountMgrFindVolumeQueue(pool, RemovalName, hash);
+    if (pool->Stopping || !queue || !queue->Removals) {
+        KeReleaseSemaphore(&pool->Lock, IO_NO_INCREMENT, 1, FALSE);
+        ExFreePool(workItem);
+        return STATUS_NOT_FOUND;
+    }
+
+    //
+    // The queue is either on the ready list or being run, and its worker
+    // puts it back on the ready list for this item.
+    //
+
+    InsertTailList(&queue->WorkItems, &workItem->ListEntry);
+
+    if (!pool->Outstanding++) {
+        KeClearEvent(&pool->IdleEvent);
+    }
+
+    KeReleaseSemaphore(&pool->Lock, IO_NO_INCREMENT, 1, FALSE);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+MountMgrInitializeVolumeWorkBatch(
+    OUT PMOUNTMGR_VOLUME_WORK_BATCH Batch
+    )
+
+/*++
+
+Routine Description:
+
+    This routine initializes a batch of volume work.  The batch starts with
+    one reference, which is dropped by waiting for it.
+
+Arguments:
+
+    Batch   - Returns the batch.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    Batch->Outstanding = 1;
+    Batch->Status = STATUS_SUCCESS;
+    KeInitializeEvent(&Batch->Event, NotificationEvent, FALSE);
+}
+
+NTSTATUS
+MountMgrWaitForVolumeWorkBatch(
+    IN OUT  PMOUNTMGR_VOLUME_WORK_BATCH Batch
+    )
+
+/*++
+
+Routine Description:
+
+    This routine waits for the work queued in the given batch to finish.
+
+Arguments:
+
+    Batch   - Supplies the batch.
+
+Return Value:
+
+    The first failure status of the work in the batch, or STATUS_SUCCESS.
+
+--*/
+
+{
+    if (InterlockedDecrement(&Batch->Outstanding)) {
+        KeWaitForSingleObject(&Batch->Event, Executive, KernelMode, FALSE,
+                              NULL);
+    }
+
+    return Batch->Status;
+}
+
+ULONGLONG
+MountMgrWaitForMutex(
+    IN  PDEVICE_EXTENSION   Extension
+    )
+
+/*++
+
+Routine Description:
+
+    This routine acquires the extension mutex.
+
+Arguments:
+
+    Extension   - Supplies the device extension.
+
+Return Value:
+
+    The time waited, in 100ns units.
+
+--*/
+
+{
+    ULONGLONG   start;
+
+    start = KeQueryInterruptTime();
+    KeWaitForSingleObject(&Extension->Mutex, Executive, KernelMode, FALSE,
+                          NULL);
+
+    return KeQueryInterruptTime() - start;
+}
+
+VOID
+MountMgrRecordArrival(
+    IN OUT  PDEVICE_EXTENSION   Extension,
+    IN      ULONGLONG           LockWaitTime,
+    IN      ULONGLONG           ArrivalTime
+    )
+
+/*++
+
+Routine Description:
+
+    This routine records the time an arrival took and the time it waited
+    for the extension mutex.
+
+Arguments:
+
+    Extension           - Supplies the device extension.
+
+    LockWaitTime        - Supplies the time waited for the mutex.
+
+    ArrivalTime         - Supplies the time the arrival took.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PMOUNTMGR_VOLUME_POOL   pool = &Extension->VolumePool;
+    ULONG                   bucket;
+    ULONGLONG               limit;
+
+    limit = 100*10;
+    for (bucket = 0; bucket < MOUNTMGR_LOCK_WAIT_BUCKETS - 1; bucket++) {
+        if (LockWaitTime < limit) {
+            break;
+        }
+        limit *= 10;
+    }
+
+    KeWaitForSingleObject(&pool->Lock, Executive, KernelMode, FALSE, NULL);
+
+    pool->TimedArrivals++;
+    pool->TotalArrivalTime += ArrivalTime;
+    pool->TotalLockWaitTime += LockWaitTime;
+    if (LockWaitTime > pool->MaximumLockWaitTime) {
+        pool->MaximumLockWaitTime = LockWaitTime;
+    }
+    pool->LockWaitHistogram[bucket]++;
+
+    KeReleaseSemaphore(&pool->Lock, IO_NO_INCREMENT, 1, FALSE);
+}
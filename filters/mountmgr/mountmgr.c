@@ -113,12 +113,6 @@ ReconcileThisDatabaseWithMaster(
     );
 
 
-NTSTATUS
-MountMgrMountedDeviceRemoval(
-    IN  PDEVICE_EXTENSION   Extension,
-    IN  PUNICODE_STRING     NotificationName
-    );
-
 VOID
 MountMgrUnload(
     IN PDRIVER_OBJECT DriverObject
@@ -696,7 +690,6 @@ Return Value:
 {
     UNICODE_STRING              targetName;
     NTSTATUS                    status;
-    PLIST_ENTRY                 l;
     PMOUNTED_DEVICE_INFORMATION deviceInfo;
 
     if (IsCanonicalName) {
@@ -709,23 +702,13 @@ Return Value:
         }
     }
 
-    for (l = Extension->MountedDeviceList.Flink;
-         l != &Extension->MountedDeviceList; l = l->Flink) {
-
-        deviceInfo = CONTAINING_RECORD(l, MOUNTED_DEVICE_INFORMATION,
-                                       ListEntry);
-
-        if (RtlEqualUnicodeString(&targetName, &deviceInfo->DeviceName,
-                                  TRUE)) {
-            break;
-        }
-    }
+    deviceInfo = MountMgrLookupDeviceName(Extension, &targetName);
 
     if (!IsCanonicalName) {
         ExFreePool(targetName.Buffer);
     }
 
-    if (l == &Extension->MountedDeviceList) {
+    if (!deviceInfo) {
         return STATUS_OBJECT_NAME_NOT_FOUND;
     }
 
@@ -1115,18 +1098,14 @@ Return Value:
 --*/
 
 {
-    RTL_QUERY_REGISTRY_TABLE    queryTable[2];
     BOOLEAN                     extraLink;
     NTSTATUS                    status;
-
-    RtlZeroMemory(queryTable, 2*sizeof(RTL_QUERY_REGISTRY_TABLE));
-    queryTable[0].QueryRoutine = SymbolicLinkNamesFromUniqueIdCount;
-    queryTable[0].EntryContext = NumNames;
+    PUNICODE_STRING             names;
 
     *NumNames = 0;
-    status = RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE,
-                                    MOUNTED_DEVICES_KEY, queryTable,
-                                    DeviceInfo->UniqueId, NULL);
+    status = MountMgrQueryDatabaseValues(NULL, DeviceInfo->UniqueId,
+                                         SymbolicLinkNamesFromUniqueIdCount,
+                                         DeviceInfo->UniqueId, NumNames);
 
     if (!NT_SUCCESS(status)) {
         *NumNames = 0;
@@ -1152,19 +1131,14 @@ Return Value:
 
     if (extraLink) {
 
-        RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE, MOUNTED_DEVICES_KEY,
-                              SuggestedName->Buffer, REG_BINARY,
-                              DeviceInfo->UniqueId->UniqueId,
-                              DeviceInfo->UniqueId->UniqueIdLength);
-
-        RtlZeroMemory(queryTable, 2*sizeof(RTL_QUERY_REGISTRY_TABLE));
-        queryTable[0].QueryRoutine = SymbolicLinkNamesFromUniqueIdCount;
-        queryTable[0].EntryContext = NumNames;
+        MountMgrWriteDatabaseValue(SuggestedName->Buffer,
+                                   DeviceInfo->UniqueId->UniqueId,
+                                   DeviceInfo->UniqueId->UniqueIdLength);
 
         *NumNames = 0;
-        status = RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE,
-                                        MOUNTED_DEVICES_KEY, queryTable,
-                                        DeviceInfo->UniqueId, NULL);
+        status = MountMgrQueryDatabaseValues(NULL, DeviceInfo->UniqueId,
+                                             SymbolicLinkNamesFromUniqueIdCount,
+                                             DeviceInfo->UniqueId, NumNames);
 
         if (!NT_SUCCESS(status) || *NumNames == 0) {
             return STATUS_NOT_FOUND;
@@ -1181,9 +1155,6 @@ Return Value:
     }
     RtlZeroMemory(*SymbolicLinkNames, *NumNames*sizeof(UNICODE_STRING));
 
-    RtlZeroMemory(queryTable, 2*sizeof(RTL_QUERY_REGISTRY_TABLE));
-    queryTable[0].QueryRoutine = SymbolicLinkNamesFromUniqueIdQuery;
-
     if (IsStable) {
 
         status = CreateNewVolumeName(&((*SymbolicLinkNames)[0]), StableGuid);
@@ -1192,14 +1163,14 @@ Return Value:
             return status;
         }
 
-        queryTable[0].EntryContext = &((*SymbolicLinkNames)[1]);
+        names = &((*SymbolicLinkNames)[1]);
     } else {
-        queryTable[0].EntryContext = *SymbolicLinkNames;
+        names = *SymbolicLinkNames;
     }
 
-    status = RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE,
-                                    MOUNTED_DEVICES_KEY, queryTable,
-                                    DeviceInfo->UniqueId, NULL);
+    status = MountMgrQueryDatabaseValues(NULL, DeviceInfo->UniqueId,
+                                         SymbolicLinkNamesFromUniqueIdQuery,
+                                         DeviceInfo->UniqueId, names);
 
     return STATUS_SUCCESS;
 }
@@ -1251,9 +1222,8 @@ Return Value:
         return STATUS_SUCCESS;
     }
 
-    RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE, MOUNTED_DEVICES_KEY,
-                          ValueName, ValueType, newId->UniqueId,
-                          newId->UniqueIdLength);
+    MountMgrWriteDatabaseValue(ValueName, newId->UniqueId,
+                               newId->UniqueIdLength);
 
     return STATUS_SUCCESS;
 }
@@ -2238,7 +2208,6 @@ Return Value:
 {
     NTSTATUS                    status;
     PDEVICE_EXTENSION           extension = Context;
-    RTL_QUERY_REGISTRY_TABLE    queryTable[2];
     PLIST_ENTRY                 l, ll;
     PMOUNTED_DEVICE_INFORMATION deviceInfo;
     PREPLICATED_UNIQUE_ID       replUniqueId;
@@ -2250,36 +2219,13 @@ Return Value:
     KeWaitForSingleObject(&extension->Mutex, Executive, KernelMode, FALSE,
                           NULL);
 
-    RtlZeroMemory(queryTable, 2*sizeof(RTL_QUERY_REGISTRY_TABLE));
-    queryTable[0].QueryRoutine = ChangeUniqueIdRoutine;
-    queryTable[0].EntryContext = NewUniqueId;
-
-    RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, MOUNTED_DEVICES_KEY,
-                           queryTable, OldUniqueId, NULL);
-
-    for (l = extension->MountedDeviceList.Flink;
-         l != &extension->MountedDeviceList; l = l->Flink) {
-
-        deviceInfo = CONTAINING_RECORD(l, MOUNTED_DEVICE_INFORMATION,
-                                       ListEntry);
-        if (OldUniqueId->UniqueIdLength !=
-            deviceInfo->UniqueId->UniqueIdLength) {
-
-            continue;
-        }
-
-        if (RtlCompareMemory(OldUniqueId->UniqueId,
-                             deviceInfo->UniqueId->UniqueId,
-                             OldUniqueId->UniqueIdLength) !=
-                             OldUniqueId->UniqueIdLength) {
-
-            continue;
-        }
+    MountMgrQueryDatabaseValues(NULL, OldUniqueId, ChangeUniqueIdRoutine,
+                                OldUniqueId, NewUniqueId);
 
-        break;
-    }
+    deviceInfo = MountMgrLookupUniqueId(extension, OldUniqueId->UniqueId,
+                                        OldUniqueId->UniqueIdLength);
 
-    if (l == &extension->MountedDeviceList) {
+    if (!deviceInfo) {
         KeReleaseSemaphore(&extension->Mutex, IO_NO_INCREMENT, 1, FALSE);
         if (NT_SUCCESS(status)) {
             ReleaseRemoteDatabaseSemaphore(extension);
@@ -2300,12 +2246,14 @@ Return Value:
         ReleaseRemoteDatabaseSemaphore(extension);
         return;
     }
+    MountMgrUnindexUniqueId(extension, deviceInfo);
     ExFreePool(deviceInfo->UniqueId);
     deviceInfo->UniqueId = p;
 
     deviceInfo->UniqueId->UniqueIdLength = NewUniqueId->UniqueIdLength;
     RtlCopyMemory(deviceInfo->UniqueId->UniqueId,
                   NewUniqueId->UniqueId, NewUniqueId->UniqueIdLength);
+    MountMgrIndexUniqueId(extension, deviceInfo);
 
     for (l = extension->MountedDeviceList.Flink;
          l != &extension->MountedDeviceList; l = l->Flink) {
@@ -2547,9 +2495,8 @@ Return Value:
     valueName[1 + guidString.Length/sizeof(WCHAR)] = 0;
     ExFreePool(guidString.Buffer);
 
-    RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE, MOUNTED_DEVICES_KEY,
-                          valueName, REG_BINARY, UniqueId->UniqueId,
-                          UniqueId->UniqueIdLength);
+    MountMgrWriteDatabaseValue(valueName, UniqueId->UniqueId,
+                               UniqueId->UniqueIdLength);
 
     ExFreePool(valueName);
 }
@@ -2710,16 +2657,11 @@ Return Value:
 --*/
 
 {
-    RTL_QUERY_REGISTRY_TABLE    queryTable[2];
     BOOLEAN                     hasNoDriveLetterEntry;
 
-    RtlZeroMemory(queryTable, 2*sizeof(RTL_QUERY_REGISTRY_TABLE));
-    queryTable[0].QueryRoutine = CheckForNoDriveLetterEntry;
-    queryTable[0].EntryContext = &hasNoDriveLetterEntry;
-
     hasNoDriveLetterEntry = FALSE;
-    RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, MOUNTED_DEVICES_KEY,
-                           queryTable, UniqueId, NULL);
+    MountMgrQueryDatabaseValues(NULL, UniqueId, CheckForNoDriveLetterEntry,
+                                UniqueId, &hasNoDriveLetterEntry);
 
     return hasNoDriveLetterEntry;
 }
@@ -3307,17 +3249,12 @@ Return Value:
 --*/
 
 {
-    RTL_QUERY_REGISTRY_TABLE    queryTable[2];
     NTSTATUS                    status;
     PMOUNTED_DEVICE_INFORMATION deviceInfo;
 
-    RtlZeroMemory(queryTable, 2*sizeof(RTL_QUERY_REGISTRY_TABLE));
-    queryTable[0].QueryRoutine = QueryUniqueIdQueryRoutine;
-    queryTable[0].Name = VolumeName->Buffer;
-
     *UniqueId = NULL;
-    RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, MOUNTED_DEVICES_KEY,
-                           queryTable, UniqueId, NULL);
+    MountMgrQueryDatabaseValues(VolumeName->Buffer, NULL,
+                                QueryUniqueIdQueryRoutine, UniqueId, NULL);
 
     if (!(*UniqueId)) {
         status = FindDeviceInfo(Extension, VolumeName, FALSE, &deviceInfo);
@@ -3389,8 +3326,7 @@ Return Value:
 
     RtlInitUnicodeString(&string, ValueName);
     if (IsDriveLetter(&string)) {
-        RtlDeleteRegistryValue(RTL_REGISTRY_ABSOLUTE, MOUNTED_DEVICES_KEY,
-                               ValueName);
+        MountMgrDeleteDatabaseValue(ValueName);
     }
 
     return STATUS_SUCCESS;
@@ -3421,13 +3357,8 @@ Return Value:
 --*/
 
 {
-    RTL_QUERY_REGISTRY_TABLE    queryTable[2];
-
-    RtlZeroMemory(queryTable, 2*sizeof(RTL_QUERY_REGISTRY_TABLE));
-    queryTable[0].QueryRoutine = DeleteDriveLetterRoutine;
-
-    RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, MOUNTED_DEVICES_KEY,
-                           queryTable, UniqueId, NULL);
+    MountMgrQueryDatabaseValues(NULL, UniqueId, DeleteDriveLetterRoutine,
+                                UniqueId, NULL);
 }
 
 BOOLEAN
@@ -3518,8 +3449,7 @@ Return Value:
         return STATUS_SUCCESS;
     }
 
-    RtlDeleteRegistryValue(RTL_REGISTRY_ABSOLUTE, MOUNTED_DEVICES_KEY,
-                           ValueName);
+    MountMgrDeleteDatabaseValue(ValueName);
 
     return STATUS_SUCCESS;
 }
@@ -3546,13 +3476,9 @@ Return Value:
 --*/
 
 {
-    RTL_QUERY_REGISTRY_TABLE    queryTable[2];
-
-    RtlZeroMemory(queryTable, 2*sizeof(RTL_QUERY_REGISTRY_TABLE));
-    queryTable[0].QueryRoutine = DeleteNoDriveLetterEntryRoutine;
-
-    RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, MOUNTED_DEVICES_KEY,
-                           queryTable, UniqueId, NULL);
+    MountMgrQueryDatabaseValues(NULL, UniqueId,
+                                DeleteNoDriveLetterEntryRoutine, UniqueId,
+                                NULL);
 }
 
 VOID
@@ -3585,7 +3511,6 @@ Return Value:
 --*/
 
 {
-    PLIST_ENTRY                         l;
     PMOUNTED_DEVICE_INFORMATION         deviceInfo;
     NTSTATUS                            status;
     PFILE_OBJECT                        fileObject;
@@ -3598,20 +3523,8 @@ Return Value:
     TARGET_DEVICE_CUSTOM_NOTIFICATION   notification;
 
     if (CheckForPdo) {
-        for (l = Extension->MountedDeviceList.Flink;
-             l != &Extension->MountedDeviceList; l = l->Flink) {
-
-            deviceInfo = CONTAINING_RECORD(l, MOUNTED_DEVICE_INFORMATION,
-                                           ListEntry);
-
-            if (!RtlCompareUnicodeString(DeviceName, &deviceInfo->DeviceName,
-                                         TRUE)) {
-
-                break;
-            }
-        }
-
-        if (l == &Extension->MountedDeviceList || deviceInfo->NotAPdo) {
+        deviceInfo = MountMgrLookupDeviceName(Extension, DeviceName);
+        if (!deviceInfo || deviceInfo->NotAPdo) {
             return;
         }
     }
@@ -3770,18 +3683,7 @@ Return Value:
         return status;
     }
 
-    for (l = Extension->MountedDeviceList.Flink;
-         l != &Extension->MountedDeviceList; l = l->Flink) {
-
-        deviceInfo = CONTAINING_RECORD(l, MOUNTED_DEVICE_INFORMATION,
-                                       ListEntry);
-
-        if (!RtlCompareUnicodeString(&targetName, &deviceInfo->DeviceName,
-                                     TRUE)) {
-
-            break;
-        }
-    }
+    deviceInfo = MountMgrLookupDeviceName(Extension, &targetName);
 
     symName = ExAllocatePool(PagedPool, symbolicLinkName.Length +
                                         sizeof(WCHAR));
@@ -3797,7 +3699,7 @@ Return Value:
     symbolicLinkName.Buffer = symName;
     symbolicLinkName.MaximumLength += sizeof(WCHAR);
 
-    if (l == &Extension->MountedDeviceList) {
+    if (!deviceInfo) {
 
         status = QueryDeviceInformation(&deviceName, NULL, &uniqueId, NULL,
                                         NULL, NULL, NULL, NULL);
@@ -3819,10 +3721,8 @@ Return Value:
             DeleteRegistryDriveLetter(uniqueId);
         }
 
-        status = RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE,
-                                       MOUNTED_DEVICES_KEY,
-                                       symName, REG_BINARY, uniqueId->UniqueId,
-                                       uniqueId->UniqueIdLength);
+        status = MountMgrWriteDatabaseValue(symName, uniqueId->UniqueId,
+                                            uniqueId->UniqueIdLength);
 
         ExFreePool(uniqueId);
         ExFreePool(symName);
@@ -3845,10 +3745,8 @@ Return Value:
     }
 
     uniqueId = deviceInfo->UniqueId;
-    status = RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE,
-                                   MOUNTED_DEVICES_KEY,
-                                   symName, REG_BINARY, uniqueId->UniqueId,
-                                   uniqueId->UniqueIdLength);
+    status = MountMgrWriteDatabaseValue(symName, uniqueId->UniqueId,
+                                        uniqueId->UniqueIdLength);
 
     if (!NT_SUCCESS(status)) {
         GlobalDeleteSymbolicLink(&symbolicLinkName);
@@ -3883,6 +3781,7 @@ Return Value:
     symlinkEntry->IsInDatabase = TRUE;
 
     InsertTailList(&deviceInfo->SymbolicLinkNames, &symlinkEntry->ListEntry);
+    MountMgrIndexSymbolicLink(Extension, deviceInfo, symlinkEntry);
 
     SendLinkCreated(&symlinkEntry->SymbolicLinkName);
 
@@ -3947,7 +3846,6 @@ Return Value:
     PWSTR                       name;
     NTSTATUS                    status;
     UNICODE_STRING              symName;
-    PLIST_ENTRY                 l;
     PMOUNTED_DEVICE_INFORMATION deviceInfo;
 
     name = ExAllocatePool(PagedPool, DatabaseEntry->VolumeNameLength +
@@ -3961,10 +3859,9 @@ Return Value:
                   DatabaseEntry->VolumeNameLength);
     name[DatabaseEntry->VolumeNameLength/sizeof(WCHAR)] = 0;
 
-    status = RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE, MOUNTED_DEVICES_KEY,
-                                   name, REG_BINARY, (PCHAR) DatabaseEntry +
-                                   DatabaseEntry->UniqueIdOffset,
-                                   DatabaseEntry->UniqueIdLength);
+    status = MountMgrWriteDatabaseValue(name, (PCHAR) DatabaseEntry +
+                                        DatabaseEntry->UniqueIdOffset,
+                                        DatabaseEntry->UniqueIdLength);
 
     ExFreePool(name);
 
@@ -3972,25 +3869,11 @@ Return Value:
     symName.Buffer = (PWSTR) ((PCHAR) DatabaseEntry +
                               DatabaseEntry->VolumeNameOffset);
 
-    for (l = Extension->MountedDeviceList.Flink;
-         l != &Extension->MountedDeviceList; l = l->Flink) {
-
-        deviceInfo = CONTAINING_RECORD(l, MOUNTED_DEVICE_INFORMATION,
-                                       ListEntry);
+    deviceInfo = MountMgrLookupUniqueId(Extension, (PCHAR) DatabaseEntry +
+                                        DatabaseEntry->UniqueIdOffset,
+                                        DatabaseEntry->UniqueIdLength);
 
-        if (DatabaseEntry->UniqueIdLength ==
-            deviceInfo->UniqueId->UniqueIdLength &&
-            RtlCompareMemory((PCHAR) DatabaseEntry +
-                             DatabaseEntry->UniqueIdOffset,
-                             deviceInfo->UniqueId->UniqueId,
-                             DatabaseEntry->UniqueIdLength) ==
-                             DatabaseEntry->UniqueIdLength) {
-
-            break;
-        }
-    }
-
-    if (l != &Extension->MountedDeviceList) {
+    if (deviceInfo) {
         MountMgrCreatePointWorker(Extension, &symName,
                                   &deviceInfo->DeviceName);
     }
@@ -4095,25 +3978,11 @@ Return Value:
 --*/
 
 {
-    PLIST_ENTRY                 l;
-    PMOUNTED_DEVICE_INFORMATION deviceInfo;
-
-    for (l = Extension->MountedDeviceList.Flink;
-         l != &Extension->MountedDeviceList; l = l->Flink) {
-
-        deviceInfo = CONTAINING_RECORD(l, MOUNTED_DEVICE_INFORMATION,
-                                       ListEntry);
-
-        if (DatabaseEntry->UniqueIdLength ==
-            deviceInfo->UniqueId->UniqueIdLength &&
-            RtlCompareMemory((PCHAR) DatabaseEntry +
-                             DatabaseEntry->UniqueIdOffset,
-                             deviceInfo->UniqueId->UniqueId,
-                             DatabaseEntry->UniqueIdLength) ==
-                             DatabaseEntry->UniqueIdLength) {
+    if (MountMgrLookupUniqueId(Extension, (PCHAR) DatabaseEntry +
+                               DatabaseEntry->UniqueIdOffset,
+                               DatabaseEntry->UniqueIdLength)) {
 
-            return TRUE;
-        }
+        return TRUE;
     }
 
     return FALSE;
@@ -4789,8 +4658,7 @@ Return Value:
         RtlCompareMemory(uniqueId->UniqueId,
                          ValueData, ValueLength) == ValueLength) {
 
-        RtlDeleteRegistryValue(RTL_REGISTRY_ABSOLUTE, MOUNTED_DEVICES_KEY,
-                               ValueName);
+        MountMgrDeleteDatabaseValue(ValueName);
     }
 
     return STATUS_SUCCESS;
@@ -4823,14 +4691,9 @@ Return Value:
 --*/
 
 {
-    RTL_QUERY_REGISTRY_TABLE    queryTable[2];
-
-    RtlZeroMemory(queryTable, 2*sizeof(RTL_QUERY_REGISTRY_TABLE));
-    queryTable[0].QueryRoutine = DeleteFromLocalDatabaseRoutine;
-    queryTable[0].Name = SymbolicLinkName->Buffer;
-
-    RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, MOUNTED_DEVICES_KEY,
-                           queryTable, UniqueId, NULL);
+    MountMgrQueryDatabaseValues(SymbolicLinkName->Buffer, NULL,
+                                DeleteFromLocalDatabaseRoutine, UniqueId,
+                                NULL);
 }
 
 PSAVED_LINKS_INFORMATION
@@ -5182,10 +5045,11 @@ MountMgrFreeSavedLink(
 }
 
 NTSTATUS
-MountMgrMountedDeviceArrival(
+MountMgrMountedDeviceArrivalWorker(
     IN  PDEVICE_EXTENSION   Extension,
     IN  PUNICODE_STRING     NotificationName,
-    IN  BOOLEAN             NotAPdo
+    IN  BOOLEAN             NotAPdo,
+    OUT PULONGLONG          LockWaitTime
     )
 
 {
@@ -5246,8 +5110,7 @@ MountMgrMountedDeviceArrival(
                                     &isStable, &stableGuid, &isFT);
     if (!NT_SUCCESS(status)) {
 
-        KeWaitForSingleObject(&extension->Mutex, Executive, KernelMode,
-                              FALSE, NULL);
+        *LockWaitTime += MountMgrWaitForMutex(extension);
 
         for (l = extension->DeadMountedDeviceList.Flink;
              l != &extension->DeadMountedDeviceList; l = l->Flink) {
@@ -5301,19 +5164,23 @@ MountMgrMountedDeviceArrival(
         deviceInfo->SuggestedDriveLetter = 0;
     }
 
-    KeWaitForSingleObject(&extension->Mutex, Executive, KernelMode, FALSE,
-                          NULL);
+    *LockWaitTime += MountMgrWaitForMutex(extension);
 
-    for (l = extension->MountedDeviceList.Flink;
-         l != &extension->MountedDeviceList; l = l->Flink) {
+    d = MountMgrLookupDeviceName(extension, &targetName);
+    if (d) {
 
-        d = CONTAINING_RECORD(l, MOUNTED_DEVICE_INFORMATION, ListEntry);
-        if (!RtlCompareUnicodeString(&d->DeviceName, &targetName, TRUE)) {
-            break;
+        //
+        // If the device is mounted under another notification name whose
+        // removal has not run yet, arrive again once it has.
+        //
+
+        if (!RtlEqualUnicodeString(&d->NotificationName, NotificationName,
+                                   TRUE)) {
+
+            MountMgrQueueArrivalAfterRemoval(extension, &d->NotificationName,
+                                             NotificationName, NotAPdo);
         }
-    }
 
-    if (l != &extension->MountedDeviceList) {
         if (suggestedName.Buffer) {
             ExFreePool(suggestedName.Buffer);
         }
@@ -5428,9 +5295,8 @@ MountMgrMountedDeviceArrival(
     if (!hasVolumeName) {
         status = CreateNewVolumeName(&volumeName, NULL);
         if (NT_SUCCESS(status)) {
-            RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE,
-                    MOUNTED_DEVICES_KEY, volumeName.Buffer, REG_BINARY,
-                    uniqueId->UniqueId, uniqueId->UniqueIdLength);
+            MountMgrWriteDatabaseValue(volumeName.Buffer, uniqueId->UniqueId,
+                                       uniqueId->UniqueIdLength);
 
             GlobalCreateSymbolicLink(&volumeName, &targetName);
 
@@ -5462,10 +5328,9 @@ MountMgrMountedDeviceArrival(
                                           deviceInfo->SuggestedDriveLetter,
                                           uniqueId);
         if (NT_SUCCESS(status)) {
-            RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE,
-                    MOUNTED_DEVICES_KEY, driveLetterName.Buffer,
-                    REG_BINARY, uniqueId->UniqueId,
-                    uniqueId->UniqueIdLength);
+            MountMgrWriteDatabaseValue(driveLetterName.Buffer,
+                                       uniqueId->UniqueId,
+                                       uniqueId->UniqueIdLength);
 
             symlinkEntry = ExAllocatePool(PagedPool,
                                           sizeof(SYMBOLIC_LINK_NAME_ENTRY));
@@ -5488,6 +5353,7 @@ MountMgrMountedDeviceArrival(
     }
 
     InsertTailList(&extension->MountedDeviceList, &deviceInfo->ListEntry);
+    MountMgrIndexMountedDevice(extension, deviceInfo);
 
     allocSize = FIELD_OFFSET(MOUNTDEV_UNIQUE_ID, UniqueId) +
                 uniqueId->UniqueIdLength;
@@ -5527,8 +5393,7 @@ MountMgrMountedDeviceArrival(
     }
 
     if (extension->AutomaticDriveLetterAssignment) {
-        KeWaitForSingleObject(&extension->Mutex, Executive, KernelMode,
-                              FALSE, NULL);
+        *LockWaitTime += MountMgrWaitForMutex(extension);
 
         ReconcileThisDatabaseWithMaster(extension, deviceInfo);
 
@@ -5547,6 +5412,50 @@ MountMgrMountedDeviceArrival(
     return STATUS_SUCCESS;
 }
 
+NTSTATUS
+MountMgrMountedDeviceArrival(
+    IN  PDEVICE_EXTENSION   Extension,
+    IN  PUNICODE_STRING     NotificationName,
+    IN  BOOLEAN             NotAPdo
+    )
+
+/*++
+
+Routine Description:
+
+    This routine processes the arrival of a mounted device, and records how
+    long it took and how long of that it waited for the extension mutex.
+
+Arguments:
+
+    Extension           - Supplies the device extension.
+
+    NotificationName    - Supplies the notification name of the device.
+
+    NotAPdo             - Supplies whether the device is not a PDO.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    ULONGLONG   start, lockWaitTime;
+    NTSTATUS    status;
+
+    start = KeQueryInterruptTime();
+    lockWaitTime = 0;
+
+    status = MountMgrMountedDeviceArrivalWorker(Extension, NotificationName,
+                                                NotAPdo, &lockWaitTime);
+
+    MountMgrRecordArrival(Extension, lockWaitTime,
+                          KeQueryInterruptTime() - start);
+
+    return status;
+}
+
 VOID
 MountMgrFreeMountedDeviceInfo(
     IN  PMOUNTED_DEVICE_INFORMATION DeviceInfo
@@ -5636,6 +5545,8 @@ MountMgrMountedDeviceRemoval(
 
     if (l != &extension->MountedDeviceList) {
 
+        MountMgrUnindexMountedDevice(extension, deviceInfo);
+
         if (deviceInfo->KeepLinksWhenOffline) {
             savedLinks = ExAllocatePool(PagedPool,
                                         sizeof(SAVED_LINKS_INFORMATION));
@@ -5799,15 +5710,24 @@ Return Value:
 
     if (IsEqualGUID(&notification->Event, &GUID_DEVICE_INTERFACE_ARRIVAL)) {
 
-        status = MountMgrMountedDeviceArrival(extension,
-                                              notification->SymbolicLinkName,
-                                              FALSE);
+        status = MountMgrQueueVolumeWork(extension,
+                                         notification->SymbolicLinkName,
+                                         TRUE, FALSE, NULL);
+        if (!NT_SUCCESS(status)) {
+            status = MountMgrMountedDeviceArrival(
+                        extension, notification->SymbolicLinkName, FALSE);
+        }
 
     } else if (IsEqualGUID(&notification->Event,
                            &GUID_DEVICE_INTERFACE_REMOVAL)) {
 
-        status = MountMgrMountedDeviceRemoval(extension,
-                                              notification->SymbolicLinkName);
+        status = MountMgrQueueVolumeWork(extension,
+                                         notification->SymbolicLinkName,
+                                         FALSE, FALSE, NULL);
+        if (!NT_SUCCESS(status)) {
+            status = MountMgrMountedDeviceRemoval(
+                        extension, notification->SymbolicLinkName);
+        }
 
     } else {
         status = STATUS_INVALID_PARAMETER;
@@ -5945,7 +5865,7 @@ Return Value:
 {
     NTSTATUS                    status;
     UNICODE_STRING              deviceName;
-    PLIST_ENTRY                 l, ll;
+    PLIST_ENTRY                 l;
     PMOUNTED_DEVICE_INFORMATION deviceInfo;
     PSYMBOLIC_LINK_NAME_ENTRY   symEntry;
     ULONG                       len;
@@ -5956,22 +5876,11 @@ Return Value:
                                     NULL, NULL, NULL, NULL);
     if (NT_SUCCESS(status)) {
 
-        for (l = Extension->MountedDeviceList.Flink;
-             l != &Extension->MountedDeviceList; l = l->Flink) {
-
-            deviceInfo = CONTAINING_RECORD(l, MOUNTED_DEVICE_INFORMATION,
-                                           ListEntry);
-
-            if (!RtlCompareUnicodeString(&deviceName, &deviceInfo->DeviceName,
-                                         TRUE)) {
-
-                break;
-            }
-        }
+        deviceInfo = MountMgrLookupDeviceName(Extension, &deviceName);
 
         ExFreePool(deviceName.Buffer);
 
-        if (l == &Extension->MountedDeviceList) {
+        if (!deviceInfo) {
             return STATUS_INVALID_PARAMETER;
         }
 
@@ -5991,32 +5900,12 @@ Return Value:
         }
     } else {
 
-        for (l = Extension->MountedDeviceList.Flink;
-             l != &Extension->MountedDeviceList; l = l->Flink) {
-
-            deviceInfo = CONTAINING_RECORD(l, MOUNTED_DEVICE_INFORMATION,
-                                           ListEntry);
-
-            for (ll = deviceInfo->SymbolicLinkNames.Flink;
-                 ll != &deviceInfo->SymbolicLinkNames; ll = ll->Flink) {
-
-                symEntry = CONTAINING_RECORD(ll, SYMBOLIC_LINK_NAME_ENTRY,
-                                             ListEntry);
-                if (RtlEqualUnicodeString(SymbolicLinkName,
-                                          &symEntry->SymbolicLinkName, TRUE)) {
-
-                    break;
-                }
-            }
-
-            if (ll != &deviceInfo->SymbolicLinkNames) {
-                break;
-            }
-        }
-
-        if (l == &Extension->MountedDeviceList) {
+        symEntry = MountMgrLookupSymbolicLink(Extension, SymbolicLinkName);
+        if (!symEntry) {
             return STATUS_OBJECT_NAME_NOT_FOUND;
         }
+
+        deviceInfo = symEntry->DeviceInfo;
     }
 
     len = sizeof(MOUNTMGR_MOUNT_POINTS) + symEntry->SymbolicLinkName.Length +
@@ -6108,7 +5997,7 @@ Return Value:
     UNICODE_STRING              targetName;
     ULONG                       numPoints, size;
     PLIST_ENTRY                 l, ll;
-    PMOUNTED_DEVICE_INFORMATION deviceInfo;
+    PMOUNTED_DEVICE_INFORMATION deviceInfo, target;
     PSYMBOLIC_LINK_NAME_ENTRY   symlinkEntry;
     PIO_STACK_LOCATION          irpSp;
     PMOUNTMGR_MOUNT_POINTS      output;
@@ -6123,40 +6012,34 @@ Return Value:
         }
     }
 
+    //
+    // When the query is for a single volume, find it in the index and
+    // start the walks below at its entry.
+    //
+
+    target = NULL;
+    if (UniqueId) {
+        target = MountMgrLookupUniqueId(Extension, UniqueId->UniqueId,
+                                        UniqueId->UniqueIdLength);
+    } else if (DeviceName) {
+        target = MountMgrLookupDeviceName(Extension, &targetName);
+    }
+
+    if ((UniqueId || DeviceName) && !target) {
+        if (DeviceName) {
+            ExFreePool(targetName.Buffer);
+        }
+        return STATUS_INVALID_PARAMETER;
+    }
+
     numPoints = 0;
     size = 0;
-    for (l = Extension->MountedDeviceList.Flink;
+    for (l = target ? &target->ListEntry : Extension->MountedDeviceList.Flink;
          l != &Extension->MountedDeviceList; l = l->Flink) {
 
         deviceInfo = CONTAINING_RECORD(l, MOUNTED_DEVICE_INFORMATION,
                                        ListEntry);
 
-        if (UniqueId) {
-
-            if (UniqueId->UniqueIdLength ==
-                deviceInfo->UniqueId->UniqueIdLength) {
-
-                if (RtlCompareMemory(UniqueId->UniqueId,
-                                     deviceInfo->UniqueId->UniqueId,
-                                     UniqueId->UniqueIdLength) !=
-                    UniqueId->UniqueIdLength) {
-
-                    continue;
-                }
-
-            } else {
-                continue;
-            }
-
-        } else if (DeviceName) {
-
-            if (!RtlEqualUnicodeString(&targetName, &deviceInfo->DeviceName,
-                                       TRUE)) {
-
-                continue;
-            }
-        }
-
         size += deviceInfo->UniqueId->UniqueIdLength;
         size += deviceInfo->DeviceName.Length;
 
@@ -6170,17 +6053,11 @@ Return Value:
             size += symlinkEntry->SymbolicLinkName.Length;
         }
 
-        if (UniqueId || DeviceName) {
+        if (target) {
             break;
         }
     }
 
-    if (UniqueId || DeviceName) {
-        if (l == &Extension->MountedDeviceList) {
-            return STATUS_INVALID_PARAMETER;
-        }
-    }
-
     irpSp = IoGetCurrentIrpStackLocation(Irp);
     output = Irp->AssociatedIrp.SystemBuffer;
     output->Size = FIELD_OFFSET(MOUNTMGR_MOUNT_POINTS, MountPoints) +
@@ -6198,38 +6075,12 @@ Return Value:
 
     numPoints = 0;
     offset = output->Size - size;
-    for (l = Extension->MountedDeviceList.Flink;
+    for (l = target ? &target->ListEntry : Extension->MountedDeviceList.Flink;
          l != &Extension->MountedDeviceList; l = l->Flink) {
 
         deviceInfo = CONTAINING_RECORD(l, MOUNTED_DEVICE_INFORMATION,
                                        ListEntry);
 
-        if (UniqueId) {
-
-            if (UniqueId->UniqueIdLength ==
-                deviceInfo->UniqueId->UniqueIdLength) {
-
-                if (RtlCompareMemory(UniqueId->UniqueId,
-                                     deviceInfo->UniqueId->UniqueId,
-                                     UniqueId->UniqueIdLength) !=
-                    UniqueId->UniqueIdLength) {
-
-                    continue;
-                }
-
-            } else {
-                continue;
-            }
-
-        } else if (DeviceName) {
-
-            if (!RtlEqualUnicodeString(&targetName, &deviceInfo->DeviceName,
-                                       TRUE)) {
-
-                continue;
-            }
-        }
-
         uOffset = offset;
         uLen = deviceInfo->UniqueId->UniqueIdLength;
         dOffset = uOffset + uLen;
@@ -6270,7 +6121,7 @@ Return Value:
             numPoints++;
         }
 
-        if (UniqueId || DeviceName) {
+        if (target) {
             break;
         }
     }
@@ -6588,41 +6439,27 @@ Return Value:
 --*/
 
 {
-    PLIST_ENTRY                 l, ll;
     PMOUNTED_DEVICE_INFORMATION deviceInfo;
     PSYMBOLIC_LINK_NAME_ENTRY   symlinkEntry;
 
-    for (l = Extension->MountedDeviceList.Flink;
-         l != &Extension->MountedDeviceList; l = l->Flink) {
-
-        deviceInfo = CONTAINING_RECORD(l, MOUNTED_DEVICE_INFORMATION,
-                                       ListEntry);
-
-        for (ll = deviceInfo->SymbolicLinkNames.Flink;
-             ll != &deviceInfo->SymbolicLinkNames; ll = ll->Flink) {
-
-            symlinkEntry = CONTAINING_RECORD(ll, SYMBOLIC_LINK_NAME_ENTRY,
-                                             ListEntry);
+    symlinkEntry = MountMgrLookupSymbolicLink(Extension, SymbolicLinkName);
+    if (!symlinkEntry) {
+        return;
+    }
 
-            if (!RtlCompareUnicodeString(SymbolicLinkName,
-                                         &symlinkEntry->SymbolicLinkName,
-                                         TRUE)) {
+    if (DbOnly) {
+        symlinkEntry->IsInDatabase = FALSE;
+        return;
+    }
 
-                if (DbOnly) {
-                    symlinkEntry->IsInDatabase = FALSE;
-                } else {
+    deviceInfo = symlinkEntry->DeviceInfo;
 
-                    SendLinkDeleted(&deviceInfo->NotificationName,
-                                    SymbolicLinkName);
+    SendLinkDeleted(&deviceInfo->NotificationName, SymbolicLinkName);
 
-                    RemoveEntryList(ll);
-                    ExFreePool(symlinkEntry->SymbolicLinkName.Buffer);
-                    ExFreePool(symlinkEntry);
-                }
-                return;
-            }
-        }
-    }
+    MountMgrUnindexSymbolicLink(Extension, symlinkEntry);
+    RemoveEntryList(&symlinkEntry->ListEntry);
+    ExFreePool(symlinkEntry->SymbolicLinkName.Buffer);
+    ExFreePool(symlinkEntry);
 }
 
 NTSTATUS
@@ -6733,8 +6570,7 @@ Return Value:
         GlobalDeleteSymbolicLink(&symbolicLinkName);
         DeleteSymbolicLinkNameFromMemory(Extension, &symbolicLinkName, FALSE);
 
-        RtlDeleteRegistryValue(RTL_REGISTRY_ABSOLUTE, MOUNTED_DEVICES_KEY,
-                               symbolicLinkName.Buffer);
+        MountMgrDeleteDatabaseValue(symbolicLinkName.Buffer);
 
         ExFreePool(symbolicLinkName.Buffer);
 
@@ -6827,8 +6663,7 @@ Return Value:
 
         DeleteSymbolicLinkNameFromMemory(Extension, &symbolicLinkName, TRUE);
 
-        RtlDeleteRegistryValue(RTL_REGISTRY_ABSOLUTE, MOUNTED_DEVICES_KEY,
-                               symbolicLinkName.Buffer);
+        MountMgrDeleteDatabaseValue(symbolicLinkName.Buffer);
 
         ExFreePool(symbolicLinkName.Buffer);
     }
@@ -7006,20 +6841,8 @@ MountMgrNextDriveLetterWorker(
         return status;
     }
 
-    for (l = Extension->MountedDeviceList.Flink;
-         l != &Extension->MountedDeviceList; l = l->Flink) {
-
-        deviceInfo = CONTAINING_RECORD(l, MOUNTED_DEVICE_INFORMATION,
-                                       ListEntry);
-
-        if (!RtlCompareUnicodeString(&targetName, &deviceInfo->DeviceName,
-                                     TRUE)) {
-
-            break;
-        }
-    }
-
-    if (l == &Extension->MountedDeviceList) {
+    deviceInfo = MountMgrLookupDeviceName(Extension, &targetName);
+    if (!deviceInfo) {
         ExFreePool(targetName.Buffer);
         return STATUS_OBJECT_NAME_NOT_FOUND;
     }
@@ -8075,6 +7898,7 @@ Return Value:
     PLIST_ENTRY                 l;
     PMOUNTED_DEVICE_INFORMATION deviceInfo;
     NTSTATUS                    status2;
+    MOUNTMGR_VOLUME_WORK_BATCH  batch;
 
     if (IsListEmpty(&Extension->DeadMountedDeviceList)) {
         KeReleaseSemaphore(&Extension->Mutex, IO_NO_INCREMENT, 1, FALSE);
@@ -8089,6 +7913,13 @@ Return Value:
     q.Blink->Flink = &q;
     q.Flink->Blink = &q;
 
+    //
+    // Run the arrivals on the volume workers, in parallel.  The workers
+    // keep their own copy of the notification name.
+    //
+
+    MountMgrInitializeVolumeWorkBatch(&batch);
+
     while (!IsListEmpty(&q)) {
 
         l = RemoveHeadList(&q);
@@ -8096,9 +7927,14 @@ Return Value:
         deviceInfo = CONTAINING_RECORD(l, MOUNTED_DEVICE_INFORMATION,
                                        ListEntry);
 
-        status2 = MountMgrMountedDeviceArrival(Extension,
-                                               &deviceInfo->NotificationName,
-                                               deviceInfo->NotAPdo);
+        status2 = MountMgrQueueVolumeWork(Extension,
+                                          &deviceInfo->NotificationName,
+                                          TRUE, deviceInfo->NotAPdo, &batch);
+        if (!NT_SUCCESS(status2)) {
+            status2 = MountMgrMountedDeviceArrival(
+                        Extension, &deviceInfo->NotificationName,
+                        deviceInfo->NotAPdo);
+        }
         MountMgrFreeDeadDeviceInfo (deviceInfo);
 
         if (NT_SUCCESS(status)) {
@@ -8106,6 +7942,11 @@ Return Value:
         }
     }
 
+    status2 = MountMgrWaitForVolumeWorkBatch(&batch);
+    if (NT_SUCCESS(status)) {
+        status = status2;
+    }
+
     return status;
 }
 
@@ -8964,36 +8805,32 @@ ScrubRegistryRoutine(
 {
     PDEVICE_EXTENSION           extension = Extension;
     PBOOLEAN                    entriesDeleted = EntriesDeleted;
-    PLIST_ENTRY                 l;
-    PMOUNTED_DEVICE_INFORMATION deviceInfo;
     NTSTATUS                    status;
 
     if (ValueType != REG_BINARY) {
         return STATUS_SUCCESS;
     }
 
-    for (l = extension->MountedDeviceList.Flink;
-         l != &extension->MountedDeviceList; l = l->Flink) {
-
-        deviceInfo = CONTAINING_RECORD(l, MOUNTED_DEVICE_INFORMATION,
-                                       ListEntry);
-
-        if (deviceInfo->UniqueId &&
-            deviceInfo->UniqueId->UniqueIdLength == ValueLength &&
-            RtlCompareMemory(deviceInfo->UniqueId->UniqueId,
-                             ValueData, ValueLength) == ValueLength) {
-
-            return STATUS_SUCCESS;
-        }
+    if (MountMgrLookupUniqueId(extension, ValueData, ValueLength)) {
+        return STATUS_SUCCESS;
     }
 
-    status = RtlDeleteRegistryValue(RTL_REGISTRY_ABSOLUTE,
-                                    MOUNTED_DEVICES_KEY, ValueName);
+    status = MountMgrDeleteDatabaseValue(ValueName);
     if (!NT_SUCCESS(status)) {
         *entriesDeleted = FALSE;
         return status;
     }
 
+    //
+    // The database keeps deleted values until they are written out, so the
+    // walk can go on.  When the registry is used directly, the enumeration
+    // has to be started over.
+    //
+
+    if (MountedDevicesDatabase.Loaded) {
+        return STATUS_SUCCESS;
+    }
+
     *entriesDeleted = TRUE;
 
     return STATUS_UNSUCCESSFUL;
@@ -9005,20 +8842,15 @@ MountMgrScrubRegistry(
     )
 
 {
-    RTL_QUERY_REGISTRY_TABLE    queryTable[2];
     BOOLEAN                     entriesDeleted;
     NTSTATUS                    status;
 
     for (;;) {
 
-        RtlZeroMemory(queryTable, 2*sizeof(RTL_QUERY_REGISTRY_TABLE));
-        queryTable[0].QueryRoutine = ScrubRegistryRoutine;
-        queryTable[0].EntryContext = &entriesDeleted;
         entriesDeleted = FALSE;
 
-        status = RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE,
-                                        MOUNTED_DEVICES_KEY, queryTable,
-                                        Extension, NULL);
+        status = MountMgrQueryDatabaseValues(NULL, NULL, ScrubRegistryRoutine,
+                                             Extension, &entriesDeleted);
         if (!entriesDeleted) {
             break;
         }
@@ -9638,6 +9470,8 @@ MountMgrShutdown(
         InterlockedDecrement(&extension->WorkerRefCount);
     }
 
+    MountMgrFlushDatabase();
+
     Irp->IoStatus.Status = STATUS_SUCCESS;
     Irp->IoStatus.Information = 0;
 
@@ -9733,12 +9567,19 @@ Return Value:
     KeInitializeSpinLock(&extension->WorkerSpinLock);
     InitializeListHead(&extension->UniqueIdChangeNotifyList);
 
+    status = MountMgrInitializeIndexes(extension);
+    if (!NT_SUCCESS(status)) {
+        IoDeleteDevice(deviceObject);
+        return status;
+    }
+
     extension->RegistryPath.Length = RegistryPath->Length;
     extension->RegistryPath.MaximumLength = extension->RegistryPath.Length +
                                             sizeof(WCHAR);
     extension->RegistryPath.Buffer = ExAllocatePool(PagedPool,
                                      extension->RegistryPath.MaximumLength);
     if (!extension->RegistryPath.Buffer) {
+        MountMgrFreeIndexes(extension);
         IoDeleteDevice(deviceObject);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
@@ -9749,6 +9590,20 @@ Return Value:
 
     GlobalCreateSymbolicLink(&DeviceSymbolicLinkName, &DeviceName);
 
+    //
+    // Read the mounted devices database into memory.  If it can't be read,
+    // the database routines go to the registry for every request.
+    //
+
+    MountMgrLoadDatabase(MOUNTED_DEVICES_KEY);
+
+    //
+    // Start the volume workers.  If none can be started the arrivals and
+    // removals are run on the notifying thread.
+    //
+
+    MountMgrStartVolumePool(extension);
+
     status = IoRegisterPlugPlayNotification(
              EventCategoryDeviceInterfaceChange,
              PNPNOTIFY_DEVICE_INTERFACE_INCLUDE_EXISTING_INTERFACES,
@@ -9757,10 +9612,19 @@ Return Value:
              &extension->NotificationEntry);
 
     if (!NT_SUCCESS(status)) {
+        MountMgrStopVolumePool(extension);
+        MountMgrUnloadDatabase();
+        MountMgrFreeIndexes(extension);
         IoDeleteDevice(deviceObject);
         return status;
     }
 
+    //
+    // Let the arrivals of the existing volumes finish before returning.
+    //
+
+    MountMgrWaitForVolumePool(extension);
+
     DriverObject->MajorFunction[IRP_MJ_CREATE] = MountMgrCreateClose;
     DriverObject->MajorFunction[IRP_MJ_CLOSE] = MountMgrCreateClose;
     DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = MountMgrDeviceControl;
@@ -9770,6 +9634,9 @@ Return Value:
 
     status = IoRegisterShutdownNotification(gdeviceObject);
     if (!NT_SUCCESS(status)) {
+        MountMgrStopVolumePool(extension);
+        MountMgrUnloadDatabase();
+        MountMgrFreeIndexes(extension);
         IoDeleteDevice(deviceObject);
         return status;
     }
@@ -9827,6 +9694,7 @@ Return Value:
     }
 
     IoUnregisterPlugPlayNotification(extension->NotificationEntry);
+    MountMgrStopVolumePool(extension);
 
     KeWaitForSingleObject(&extension->Mutex,
                           Executive,
@@ -9892,6 +9760,8 @@ Return Value:
 
     KeReleaseSemaphore(&extension->Mutex, IO_NO_INCREMENT, 1, FALSE);
 
+    MountMgrUnloadDatabase();
+    MountMgrFreeIndexes(extension);
 
     GlobalDeleteSymbolicLink(&DeviceSymbolicLinkName);
 
@@ -0,0 +1,810 @@
+//
+// Benchmark for the mounted device indexes and the mounted devices database.
+//
+// The arrival of N volumes is run the way MountMgrMountedDeviceArrival does
+// it: check that the device is not in the mounted device list yet, count and
+// then collect the names that its unique id has in the database, write its
+// volume name if it has none, and insert it in the mounted device list.
+//
+// Each N is run once with the linear walks of the mounted device list and
+// the RtlQueryRegistryValues scans of the key that the driver used to do,
+// and once with the indexes and the in-memory database, and the time per
+// arrival is reported.  Both start with the key holding the volume names of
+// the even numbered volumes; the odd numbered ones write theirs as they
+// arrive.  Symbolic link lookups, as done for IOCTL_MOUNTMGR_QUERY_POINTS,
+// are timed the same way.
+//
+// After the indexed run every device, unique id and symbolic link is looked
+// up, and the key is checked to hold what was written through the database.
+//
+// A scratch key under HKEY_CURRENT_USER stands in for the MountedDevices
+// key.
+//
+// Usage:
+//
+//     tarrival [-n maximum volumes] [-l maximum linear volumes]
+//
+
+#include <nt.h>
+#include <ntrtl.h>
+#include <nturtl.h>
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+//
+// Kernel services used by the indexes and the database.  The lazy writer
+// is never started; the database is written by MountMgrFlushDatabase.
+//
+
+typedef PVOID PDEVICE_OBJECT, PDRIVER_OBJECT, PIO_WORKITEM;
+typedef HANDLE KEVENT, *PKEVENT, KSEMAPHORE;
+typedef ULONG_PTR KSPIN_LOCK;
+typedef CRITICAL_SECTION ERESOURCE;
+typedef ULONG KTIMER, KDPC, *PKDPC, WORK_QUEUE_ITEM;
+
+#define ExAllocatePool(Type, Size) malloc (Size)
+#define ExAllocatePoolWithTag(Type, Size, Tag) malloc (Size)
+#define ExFreePool(Buffer) free (Buffer)
+
+#define ExInitializeResourceLite(Resource) InitializeCriticalSection (Resource)
+#define ExDeleteResourceLite(Resource) DeleteCriticalSection (Resource)
+#define ExAcquireResourceExclusiveLite(Resource, Wait) \
+        EnterCriticalSection (Resource)
+#define ExReleaseResourceLite(Resource) LeaveCriticalSection (Resource)
+#define KeEnterCriticalRegion()
+#define KeLeaveCriticalRegion()
+
+#define KeInitializeEvent(Event, Type, State) \
+        (*(Event) = CreateEvent (NULL, TRUE, (State), NULL))
+#define KeSetEvent(Event, Increment, Wait) SetEvent (*(Event))
+#define KeClearEvent(Event) ResetEvent (*(Event))
+#define KeWaitForSingleObject(Object, Reason, Mode, Alertable, Timeout) \
+        WaitForSingleObject (*(Object), INFINITE)
+
+#define KeInitializeTimer(Timer)
+#define KeInitializeDpc(Dpc, Routine, Context)
+#define KeSetTimer(Timer, DueTime, Dpc) ((VOID) 0)
+#define KeCancelTimer(Timer) TRUE
+#define ExInitializeWorkItem(Item, Routine, Context)
+#define ExQueueWorkItem(Item, Queue)
+
+#define ZwOpenKey NtOpenKey
+#define ZwClose NtClose
+#define ZwSetValueKey NtSetValueKey
+#define ZwDeleteValueKey NtDeleteValueKey
+#define ZwEnumerateValueKey NtEnumerateValueKey
+
+#undef OBJ_KERNEL_HANDLE
+#define OBJ_KERNEL_HANDLE 0
+
+#define PAGED_CODE()
+
+#include <mountmgr.h>
+#include <mountdev.h>
+#include <mntmgr.h>
+
+#include "..\mntindex.c"
+#include "..\mntdb.c"
+
+#define TEST_KEY L"Software\\MountMgrArrivalTest"
+
+#define UNIQUE_ID_LENGTH 12
+
+#define LOOKUPS 100000
+
+ULONG VolumeCounts[] = { 250, 500, 1000, 2000, 4000 };
+
+//
+// Test parameters.
+//
+
+ULONG MaximumVolumes = 4000;
+ULONG MaximumLinearVolumes = 2000;
+
+WCHAR KeyName[256];
+DEVICE_EXTENSION Extension;
+PMOUNTED_DEVICE_INFORMATION* Devices;
+ULONG Failures;
+ULONGLONG RandomState = 0x9e3779b97f4a7c15;
+
+typedef struct _NAME_QUERY {
+    PMOUNTED_DEVICE_INFORMATION DeviceInfo;
+    ULONG                       NameCount;
+    BOOLEAN                     Collect;
+} NAME_QUERY, *PNAME_QUERY;
+
+ULONG
+NextRandom(
+    IN  ULONG   Limit
+    )
+
+{
+    RandomState ^= RandomState << 13;
+    RandomState ^= RandomState >> 7;
+    RandomState ^= RandomState << 17;
+
+    return (ULONG) (RandomState % Limit);
+}
+
+VOID
+FormatVolumeName(
+    IN  ULONG   Volume,
+    OUT PWSTR   Buffer
+    )
+
+{
+    swprintf(Buffer, L"\\??\\Volume{%08x-0000-0000-0000-000000000000}",
+             Volume);
+}
+
+VOID
+FormatDeviceName(
+    IN  ULONG   Volume,
+    OUT PWSTR   Buffer
+    )
+
+{
+    swprintf(Buffer, L"\\Device\\HarddiskVolume%d", Volume + 1);
+}
+
+VOID
+FormatUniqueId(
+    IN  ULONG   Volume,
+    OUT PUCHAR  UniqueId
+    )
+
+{
+    ULONG       signature;
+    LONGLONG    offset;
+
+    //
+    // Same shape as the unique id of an MBR partition: the disk signature
+    // and the partition offset.
+    //
+
+    signature = 0x4d4d0000 + Volume/4;
+    offset = (LONGLONG) (Volume%4 + 1)*0x100000;
+
+    RtlCopyMemory(UniqueId, &signature, sizeof(signature));
+    RtlCopyMemory(UniqueId + sizeof(signature), &offset, sizeof(offset));
+}
+
+BOOLEAN
+ResetKey(
+    IN  ULONG   VolumeCount
+    )
+
+/*++
+
+Routine Description:
+
+    This routine recreates the scratch key with the volume names of the
+    even numbered volumes and the drive letters of the first volumes.
+
+--*/
+
+{
+    ULONG       i;
+    WCHAR       name[64];
+    UCHAR       uniqueId[UNIQUE_ID_LENGTH];
+    NTSTATUS    status;
+
+    RegDeleteKeyW(HKEY_CURRENT_USER, TEST_KEY);
+
+    status = RtlCreateRegistryKey(RTL_REGISTRY_ABSOLUTE, KeyName);
+    if (!NT_SUCCESS(status)) {
+        printf("Failed to create the scratch key: %x\n", status);
+        return FALSE;
+    }
+
+    for (i = 0; i < VolumeCount; i++) {
+
+        FormatUniqueId(i, uniqueId);
+
+        if (i%2 == 0) {
+            FormatVolumeName(i, name);
+            RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE, KeyName, name,
+                                  REG_BINARY, uniqueId, UNIQUE_ID_LENGTH);
+        }
+
+        if (i < 24) {
+            swprintf(name, L"\\DosDevices\\%c:", 'C' + i);
+            RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE, KeyName, name,
+                                  REG_BINARY, uniqueId, UNIQUE_ID_LENGTH);
+        }
+    }
+
+    return TRUE;
+}
+
+PMOUNTED_DEVICE_INFORMATION
+CreateDevice(
+    IN  ULONG   Volume
+    )
+
+{
+    PMOUNTED_DEVICE_INFORMATION deviceInfo;
+    WCHAR                       name[64];
+
+    deviceInfo = calloc(1, sizeof(MOUNTED_DEVICE_INFORMATION));
+    deviceInfo->UniqueId = malloc(sizeof(MOUNTDEV_UNIQUE_ID) +
+                                  UNIQUE_ID_LENGTH);
+    deviceInfo->UniqueId->UniqueIdLength = UNIQUE_ID_LENGTH;
+    FormatUniqueId(Volume, deviceInfo->UniqueId->UniqueId);
+
+    FormatDeviceName(Volume, name);
+    RtlCreateUnicodeString(&deviceInfo->DeviceName, name);
+
+    InitializeListHead(&deviceInfo->SymbolicLinkNames);
+    InitializeListHead(&deviceInfo->ReplicatedUniqueIds);
+    InitializeListHead(&deviceInfo->MountPointsPointingHere);
+    deviceInfo->Extension = &Extension;
+
+    return deviceInfo;
+}
+
+VOID
+FreeDevices(
+    VOID
+    )
+
+{
+    PLIST_ENTRY                 l;
+    PMOUNTED_DEVICE_INFORMATION deviceInfo;
+    PSYMBOLIC_LINK_NAME_ENTRY   symlinkEntry;
+
+    while (!IsListEmpty(&Extension.MountedDeviceList)) {
+
+        l = RemoveHeadList(&Extension.MountedDeviceList);
+        deviceInfo = CONTAINING_RECORD(l, MOUNTED_DEVICE_INFORMATION,
+                                       ListEntry);
+
+        while (!IsListEmpty(&deviceInfo->SymbolicLinkNames)) {
+            l = RemoveHeadList(&deviceInfo->SymbolicLinkNames);
+            symlinkEntry = CONTAINING_RECORD(l, SYMBOLIC_LINK_NAME_ENTRY,
+                                             ListEntry);
+            RtlFreeUnicodeString(&symlinkEntry->SymbolicLinkName);
+            free(symlinkEntry);
+        }
+
+        RtlFreeUnicodeString(&deviceInfo->DeviceName);
+        free(deviceInfo->UniqueId);
+        free(deviceInfo);
+    }
+
+    MountMgrFreeIndexes(&Extension);
+}
+
+VOID
+AddLink(
+    IN OUT  PMOUNTED_DEVICE_INFORMATION DeviceInfo,
+    IN      PWSTR                       SymbolicLinkName
+    )
+
+{
+    PSYMBOLIC_LINK_NAME_ENTRY   symlinkEntry;
+
+    symlinkEntry = calloc(1, sizeof(SYMBOLIC_LINK_NAME_ENTRY));
+    RtlCreateUnicodeString(&symlinkEntry->SymbolicLinkName, SymbolicLinkName);
+    symlinkEntry->IsInDatabase = TRUE;
+    InsertTailList(&DeviceInfo->SymbolicLinkNames, &symlinkEntry->ListEntry);
+}
+
+NTSTATUS
+QueryNamesRoutine(
+    IN  PWSTR   ValueName,
+    IN  ULONG   ValueType,
+    IN  PVOID   ValueData,
+    IN  ULONG   ValueLength,
+    IN  PVOID   Context,
+    IN  PVOID   EntryContext
+    )
+
+/*++
+
+Routine Description:
+
+    This routine counts or collects the names that the device's unique id
+    has, like QuerySymbolicLinkNamesFromStorage.
+
+--*/
+
+{
+    PNAME_QUERY         query = EntryContext;
+    PMOUNTDEV_UNIQUE_ID uniqueId = query->DeviceInfo->UniqueId;
+
+    if (ValueType != REG_BINARY ||
+        ValueLength != uniqueId->UniqueIdLength ||
+        RtlCompareMemory(ValueData, uniqueId->UniqueId, ValueLength) !=
+        ValueLength) {
+
+        return STATUS_SUCCESS;
+    }
+
+    query->NameCount++;
+
+    if (query->Collect) {
+        AddLink(query->DeviceInfo, ValueName);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+ArriveLinear(
+    IN  ULONG   Volume
+    )
+
+{
+    PMOUNTED_DEVICE_INFORMATION deviceInfo = Devices[Volume];
+    RTL_QUERY_REGISTRY_TABLE    queryTable[2];
+    NAME_QUERY                  query;
+    PLIST_ENTRY                 l;
+    PMOUNTED_DEVICE_INFORMATION d;
+    WCHAR                       name[64];
+
+    for (l = Extension.MountedDeviceList.Flink;
+         l != &Extension.MountedDeviceList; l = l->Flink) {
+
+        d = CONTAINING_RECORD(l, MOUNTED_DEVICE_INFORMATION, ListEntry);
+        if (!RtlCompareUnicodeString(&d->DeviceName, &deviceInfo->DeviceName,
+                                     TRUE)) {
+
+            printf("volume %d arrived twice\n", Volume);
+            Failures++;
+            return;
+        }
+    }
+
+    RtlZeroMemory(&query, sizeof(query));
+    query.DeviceInfo = deviceInfo;
+
+    RtlZeroMemory(queryTable, 2*sizeof(RTL_QUERY_REGISTRY_TABLE));
+    queryTable[0].QueryRoutine = QueryNamesRoutine;
+    queryTable[0].EntryContext = &query;
+
+    RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, KeyName, queryTable, NULL,
+                           NULL);
+
+    if (query.NameCount) {
+        query.NameCount = 0;
+        query.Collect = TRUE;
+        RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, KeyName, queryTable,
+                               NULL, NULL);
+    }
+
+    if (Volume%2) {
+        FormatVolumeName(Volume, name);
+        RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE, KeyName, name,
+                              REG_BINARY, deviceInfo->UniqueId->UniqueId,
+                              deviceInfo->UniqueId->UniqueIdLength);
+        AddLink(deviceInfo, name);
+    }
+
+    InsertTailList(&Extension.MountedDeviceList, &deviceInfo->ListEntry);
+}
+
+VOID
+ArriveIndexed(
+    IN  ULONG   Volume
+    )
+
+{
+    PMOUNTED_DEVICE_INFORMATION deviceInfo = Devices[Volume];
+    NAME_QUERY                  query;
+    WCHAR                       name[64];
+
+    if (MountMgrLookupDeviceName(&Extension, &deviceInfo->DeviceName)) {
+        printf("volume %d arrived twice\n", Volume);
+        Failures++;
+        return;
+    }
+
+    RtlZeroMemory(&query, sizeof(query));
+    query.DeviceInfo = deviceInfo;
+
+    MountMgrQueryDatabaseValues(NULL, deviceInfo->UniqueId,
+                                QueryNamesRoutine, NULL, &query);
+
+    if (query.NameCount) {
+        query.NameCount = 0;
+        query.Collect = TRUE;
+        MountMgrQueryDatabaseValues(NULL, deviceInfo->UniqueId,
+                                    QueryNamesRoutine, NULL, &query);
+    }
+
+    if (Volume%2) {
+        FormatVolumeName(Volume, name);
+        MountMgrWriteDatabaseValue(name, deviceInfo->UniqueId->UniqueId,
+                                   deviceInfo->UniqueId->UniqueIdLength);
+        AddLink(deviceInfo, name);
+    }
+
+    InsertTailList(&Extension.MountedDeviceList, &deviceInfo->ListEntry);
+    MountMgrIndexMountedDevice(&Extension, deviceInfo);
+}
+
+PSYMBOLIC_LINK_NAME_ENTRY
+LookupLinkLinear(
+    IN  PUNICODE_STRING SymbolicLinkName
+    )
+
+{
+    PLIST_ENTRY                 l, ll;
+    PMOUNTED_DEVICE_INFORMATION deviceInfo;
+    PSYMBOLIC_LINK_NAME_ENTRY   symlinkEntry;
+
+    for (l = Extension.MountedDeviceList.Flink;
+         l != &Extension.MountedDeviceList; l = l->Flink) {
+
+        deviceInfo = CONTAINING_RECORD(l, MOUNTED_DEVICE_INFORMATION,
+                                       ListEntry);
+
+        for (ll = deviceInfo->SymbolicLinkNames.Flink;
+             ll != &deviceInfo->SymbolicLinkNames; ll = ll->Flink) {
+
+            symlinkEntry = CONTAINING_RECORD(ll, SYMBOLIC_LINK_NAME_ENTRY,
+                                             ListEntry);
+            if (RtlEqualUnicodeString(SymbolicLinkName,
+                                      &symlinkEntry->SymbolicLinkName,
+                                      TRUE)) {
+
+                return symlinkEntry;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+double
+TimeLookups(
+    IN  ULONG   VolumeCount,
+    IN  BOOLEAN Indexed
+    )
+
+/*++
+
+Routine Description:
+
+    This routine times lookups of random volume names and returns the
+    microseconds per lookup.
+
+--*/
+
+{
+    LARGE_INTEGER               frequency, start, end;
+    UNICODE_STRING              linkName;
+    WCHAR                       name[64];
+    ULONG                       i, volume, lookups;
+    PSYMBOLIC_LINK_NAME_ENTRY   symlinkEntry;
+
+    lookups = Indexed ? LOOKUPS : LOOKUPS/10;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    for (i = 0; i < lookups; i++) {
+
+        volume = NextRandom(VolumeCount);
+        FormatVolumeName(volume, name);
+        RtlInitUnicodeString(&linkName, name);
+
+        if (Indexed) {
+            symlinkEntry = MountMgrLookupSymbolicLink(&Extension, &linkName);
+        } else {
+            symlinkEntry = LookupLinkLinear(&linkName);
+        }
+
+        if (!symlinkEntry) {
+            printf("link of volume %d not found\n", volume);
+            Failures++;
+            break;
+        }
+    }
+
+    QueryPerformanceCounter(&end);
+
+    return (double) (end.QuadPart - start.QuadPart)*1000000.0/
+           (double) frequency.QuadPart/(double) lookups;
+}
+
+ULONG
+CountKeyValues(
+    VOID
+    )
+
+{
+    HKEY    key;
+    DWORD   count;
+
+    count = 0;
+    if (RegOpenKeyExW(HKEY_CURRENT_USER, TEST_KEY, 0, KEY_QUERY_VALUE,
+                      &key) == ERROR_SUCCESS) {
+
+        RegQueryInfoKeyW(key, NULL, NULL, NULL, NULL, NULL, NULL, &count,
+                         NULL, NULL, NULL, NULL);
+        RegCloseKey(key);
+    }
+
+    return count;
+}
+
+VOID
+CheckIndexes(
+    IN  ULONG   VolumeCount
+    )
+
+/*++
+
+Routine Description:
+
+    This routine looks up every device, unique id and symbolic link after
+    an indexed run.
+
+--*/
+
+{
+    ULONG                       i, errors;
+    PMOUNTED_DEVICE_INFORMATION deviceInfo;
+    PLIST_ENTRY                 l;
+    PSYMBOLIC_LINK_NAME_ENTRY   symlinkEntry;
+
+    errors = 0;
+
+    for (i = 0; i < VolumeCount; i++) {
+
+        deviceInfo = Devices[i];
+
+        if (MountMgrLookupDeviceName(&Extension, &deviceInfo->DeviceName) !=
+            deviceInfo) {
+
+            if (errors++ < 10) {
+                printf("device name of volume %d not found\n", i);
+            }
+        }
+
+        if (MountMgrLookupUniqueId(&Extension, deviceInfo->UniqueId->UniqueId,
+                                   deviceInfo->UniqueId->UniqueIdLength) !=
+            deviceInfo) {
+
+            if (errors++ < 10) {
+                printf("unique id of volume %d not found\n", i);
+            }
+        }
+
+        for (l = deviceInfo->SymbolicLinkNames.Flink;
+             l != &deviceInfo->SymbolicLinkNames; l = l->Flink) {
+
+            symlinkEntry = CONTAINING_RECORD(l, SYMBOLIC_LINK_NAME_ENTRY,
+                                             ListEntry);
+            if (MountMgrLookupSymbolicLink(&Extension,
+                                           &symlinkEntry->SymbolicLinkName) !=
+                symlinkEntry || symlinkEntry->DeviceInfo != deviceInfo) {
+
+                if (errors++ < 10) {
+                    printf("link %ws of volume %d not found\n",
+                           symlinkEntry->SymbolicLinkName.Buffer, i);
+                }
+            }
+        }
+    }
+
+    if (errors) {
+        Failures++;
+    }
+}
+
+VOID
+CheckDatabase(
+    IN  ULONG   VolumeCount
+    )
+
+/*++
+
+Routine Description:
+
+    This routine checks that the database was written to the key, and that
+    a deleted value is deleted from the key when the database is flushed.
+
+--*/
+
+{
+    ULONG       expected, found;
+    WCHAR       name[64];
+    UCHAR       uniqueId[UNIQUE_ID_LENGTH];
+
+    expected = VolumeCount + (VolumeCount < 24 ? VolumeCount : 24);
+
+    found = CountKeyValues();
+    if (found != expected) {
+        printf("key has %d values after the flush, expected %d\n", found,
+               expected);
+        Failures++;
+    }
+
+    //
+    // Write and delete the same name before the flush; the key should not
+    // see it.  Then delete a volume name.
+    //
+
+    FormatUniqueId(0, uniqueId);
+    MountMgrWriteDatabaseValue(L"\\DosDevices\\Z:", uniqueId,
+                               UNIQUE_ID_LENGTH);
+    MountMgrDeleteDatabaseValue(L"\\DosDevices\\Z:");
+
+    FormatVolumeName(1, name);
+    MountMgrDeleteDatabaseValue(name);
+    MountMgrFlushDatabase();
+
+    found = CountKeyValues();
+    if (found != expected - 1) {
+        printf("key has %d values after the delete, expected %d\n", found,
+               expected - 1);
+        Failures++;
+    }
+}
+
+VOID
+RunArrivals(
+    IN  ULONG   VolumeCount,
+    IN  BOOLEAN Indexed,
+    OUT double* ArrivalTime,
+    OUT double* LookupTime
+    )
+
+{
+    LARGE_INTEGER   frequency, start, end;
+    ULONG           i;
+    NTSTATUS        status;
+
+    *ArrivalTime = 0;
+    *LookupTime = 0;
+
+    if (!ResetKey(VolumeCount)) {
+        Failures++;
+        return;
+    }
+
+    RtlZeroMemory(&Extension, sizeof(Extension));
+    InitializeListHead(&Extension.MountedDeviceList);
+    MountMgrInitializeIndexes(&Extension);
+
+    for (i = 0; i < VolumeCount; i++) {
+        Devices[i] = CreateDevice(i);
+    }
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    //
+    // The database is read as the driver loads, so the load is part of
+    // the time.
+    //
+
+    if (Indexed) {
+        status = MountMgrLoadDatabase(KeyName);
+        if (!NT_SUCCESS(status)) {
+            printf("Failed to load the database: %x\n", status);
+            Failures++;
+        }
+    }
+
+    for (i = 0; i < VolumeCount; i++) {
+        if (Indexed) {
+            ArriveIndexed(i);
+        } else {
+            ArriveLinear(i);
+        }
+    }
+
+    if (Indexed) {
+        MountMgrFlushDatabase();
+    }
+
+    QueryPerformanceCounter(&end);
+
+    *ArrivalTime = (double) (end.QuadPart - start.QuadPart)*1000000.0/
+                   (double) frequency.QuadPart/(double) VolumeCount;
+
+    *LookupTime = TimeLookups(VolumeCount, Indexed);
+
+    if (Indexed) {
+        CheckIndexes(VolumeCount);
+        CheckDatabase(VolumeCount);
+        MountMgrUnloadDatabase();
+    }
+
+    FreeDevices();
+}
+
+int
+__cdecl
+main(
+    int     argc,
+    char*   argv[]
+    )
+
+{
+    UNICODE_STRING  userKey;
+    NTSTATUS        status;
+    double          linearArrival, linearLookup, indexedArrival, indexedLookup;
+    ULONG           i;
+    int             arg;
+
+    for (arg = 1; arg < argc; arg++) {
+        if ((argv[arg][0] != '-' && argv[arg][0] != '/') || arg + 1 == argc) {
+            goto Usage;
+        }
+        switch (argv[arg][1]) {
+            case 'n':
+                MaximumVolumes = atoi(argv[++arg]);
+                break;
+
+            case 'l':
+                MaximumLinearVolumes = atoi(argv[++arg]);
+                break;
+
+            default:
+                goto Usage;
+        }
+    }
+
+    if (!MaximumVolumes) {
+        goto Usage;
+    }
+
+    status = RtlFormatCurrentUserKeyPath(&userKey);
+    if (!NT_SUCCESS(status)) {
+        printf("Failed to find the user key: %x\n", status);
+        return 1;
+    }
+
+    _snwprintf(KeyName, sizeof(KeyName)/sizeof(WCHAR) - 1, L"%.*s\\%s",
+               userKey.Length/sizeof(WCHAR), userKey.Buffer, TEST_KEY);
+    RtlFreeUnicodeString(&userKey);
+
+    Devices = malloc(MaximumVolumes*sizeof(PMOUNTED_DEVICE_INFORMATION));
+    if (!Devices) {
+        printf("Failed to allocate the devices!\n");
+        return 1;
+    }
+
+    printf("microseconds per arrival and per link lookup\n\n");
+    printf("volumes     linear   indexed      linear   indexed\n");
+
+    for (i = 0; i < sizeof(VolumeCounts)/sizeof(VolumeCounts[0]); i++) {
+
+        if (VolumeCounts[i] > MaximumVolumes) {
+            break;
+        }
+
+        if (VolumeCounts[i] <= MaximumLinearVolumes) {
+            RunArrivals(VolumeCounts[i], FALSE, &linearArrival,
+                        &linearLookup);
+        } else {
+            linearArrival = linearLookup = 0;
+        }
+
+        RunArrivals(VolumeCounts[i], TRUE, &indexedArrival, &indexedLookup);
+
+        printf("%7d  %9.1f %9.1f   %9.2f %9.2f\n", VolumeCounts[i],
+               linearArrival, indexedArrival, linearLookup, indexedLookup);
+    }
+
+    RegDeleteKeyW(HKEY_CURRENT_USER, TEST_KEY);
+    free(Devices);
+
+    if (Failures) {
+        printf("FAILED\n");
+        return 1;
+    }
+
+    return 0;
+
+Usage:
+    printf("usage: tarrival [-n maximum volumes] [-l maximum linear volumes]\n");
+    return 2;
+}
@@ -557,6 +557,13 @@ PortMapDeleteLunEntry(
     );
 
 
+//
+// Queue tag allocator.
+//
+
+#include "porttag.h"
+
+
 typedef struct _INTERNAL_WAIT_CONTEXT_BLOCK {
     ULONG Flags;
     PMDL Mdl;
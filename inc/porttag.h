@@ -0,0 +1,113 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved.
+
+Module Name:
+
+    porttag.h
+
+Abstract:
+
+    Queue tag allocator exported by the storage port driver library.
+
+Revision History:
+
+--*/
+
+#ifndef _PORTTAG_H_
+#define _PORTTAG_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+//
+// Queue tag allocator. Tags are allocated and freed without taking a lock,
+// using a bitmap of free tags and a one word summary of which parts of the
+// bitmap have free tags.
+//
+
+#define PORT_MAXIMUM_TAGS   (32 * 32)
+#define PORT_INVALID_TAG    ((ULONG)-1)
+
+typedef struct _PORT_TAG_ALLOCATOR {
+
+    //
+    // Number of tags. Tags are in the range 0 - Count - 1.
+    //
+    
+    ULONG Count;
+
+    //
+    // Number of words in FreeMap.
+    //
+    
+    ULONG WordCount;
+
+    //
+    // Bit n is set when FreeMap[n] may contain a free tag.
+    //
+    
+    LONG Summary;
+
+    //
+    // Bitmap with a bit set for each free tag.
+    //
+    
+    PLONG FreeMap;
+
+    //
+    // Per-processor index of the FreeMap word to search first.
+    //
+    
+    PULONG Hints;
+    ULONG HintCount;
+
+    //
+    // Number of outstanding tags, and the most that have been outstanding
+    // at one time.
+    //
+    
+    LONG OutstandingTags;
+    LONG HighWaterMark;
+
+} PORT_TAG_ALLOCATOR, *PPORT_TAG_ALLOCATOR;
+
+VOID
+PortCreateTagAllocator(
+    OUT PPORT_TAG_ALLOCATOR Allocator
+    );
+
+NTSTATUS
+PortInitializeTagAllocator(
+    IN OUT PPORT_TAG_ALLOCATOR Allocator,
+    IN ULONG TagCount
+    );
+
+VOID
+PortDeleteTagAllocator(
+    IN PPORT_TAG_ALLOCATOR Allocator
+    );
+
+ULONG
+PortAllocateTag(
+    IN PPORT_TAG_ALLOCATOR Allocator
+    );
+
+BOOLEAN
+PortAllocateSpecificTag(
+    IN PPORT_TAG_ALLOCATOR Allocator,
+    IN ULONG Tag
+    );
+
+VOID
+PortFreeTag(
+    IN PPORT_TAG_ALLOCATOR Allocator,
+    IN ULONG Tag
+    );
+
+#ifdef __cplusplus
+}
+#endif  // __cplusplus
+
+#endif //_PORTTAG_H_
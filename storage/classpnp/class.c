@@ -1666,9 +1666,16 @@ NTSTATUS ClassReadWrite(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
 
                         /*
                          *  Perform the actual transfer(s) on the hardware
-                         *  to service this request.
+                         *  to service this request, unless the merge stage
+                         *  holds it back to send it along with its neighbours.
                          */
-                        status = ServiceTransferRequest(DeviceObject, Irp);
+                        if (((PFUNCTIONAL_DEVICE_EXTENSION)commonExtension)->PrivateFdoData->Merge.Enabled &&
+                            MergeClientIrp(DeviceObject, Irp)){
+                            status = STATUS_PENDING;
+                        }
+                        else {
+                            status = ServiceTransferRequest(DeviceObject, Irp);
+                        }
                     }
                     else {
                         /*
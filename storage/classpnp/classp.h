@@ -66,6 +66,7 @@ extern ULONG ClassMaxInterleavePerCriticalIo;
 #define CLASSP_REG_WRITE_CACHE_VALUE_NAME       (L"WriteCacheEnableOverride")
 #define CLASSP_REG_PERF_RESTORE_VALUE_NAME      (L"RestorePerfAtCount")
 #define CLASSP_REG_REMOVAL_POLICY_VALUE_NAME    (L"UserRemovalPolicy")
+#define CLASSP_REG_MERGE_SEQUENTIAL_VALUE_NAME  (L"MergeSequentialIo")
 
 #define CLASS_PERF_RESTORE_MINIMUM              (0x10)
 #define CLASS_ERROR_LEVEL_1                     (0x4)
@@ -381,6 +382,12 @@ typedef struct _TRANSFER_PACKET {
         ULONG BufLenCopy;
         LARGE_INTEGER TargetLocationCopy;
 
+        /*
+         *  Interrupt time at which a read/write packet was set up;
+         *  used to measure completion latency for sizing the packet working set.
+         */
+        ULONGLONG TimeSetup;
+
         /*
          *  This is a standard SCSI structure that receives a detailed
          *  report about a SCSI error on the hardware.
@@ -430,6 +437,75 @@ typedef struct _TRANSFER_PACKET {
 #define MIN_WORKINGSET_TRANSFER_PACKETS_Enterprise    256
 #define MAX_WORKINGSET_TRANSFER_PACKETS_Enterprise   2048
 
+/*
+ *  Optional merge stage for sequential client reads and writes (clntirp.c).
+ *  While the device has transfers outstanding, a client irp that starts
+ *  page-aligned is held back for up to one completion (or one
+ *  CLASS_MERGE_WINDOW_MS timer tick) so that the LBA-contiguous irps right
+ *  behind it can be sent down as a single SRB of up to HwMaxXferLen bytes.
+ *  Enabled per device with the MergeSequentialIo registry value.
+ */
+#define CLASS_MERGE_MAX_IRPS        32
+#define CLASS_MERGE_WINDOW_MS       1
+
+typedef struct _CLASS_MERGED_TRANSFER {
+    LIST_ENTRY ClientIrpList;
+    ULONG NumClientIrps;
+    PDEVICE_OBJECT Fdo;
+    PMDL Mdl;
+} CLASS_MERGED_TRANSFER, *PCLASS_MERGED_TRANSFER;
+
+/*
+ *  On multiprocessor machines each processor keeps a small private cache
+ *  ("magazine") of free TRANSFER_PACKETs in front of the shared free list
+ *  ("depot") so that the common allocate/free path only touches a
+ *  processor-local cache line.  A magazine overflows into the depot when it
+ *  is full and is refilled from the depot when it is empty.
+ *
+ *  The magazine depth is MinWorkingSetTransferPackets spread across the
+ *  processors, clamped to the range below.
+ */
+#define MIN_TRANSFER_PACKET_MAGAZINE_DEPTH          2
+#define MAX_TRANSFER_PACKET_MAGAZINE_DEPTH         16
+
+/*
+ *  The SKU thresholds above are only the starting point for each device.
+ *  Once every TRANSFER_PACKET_WORKINGSET_WINDOW (in 100ns units) we
+ *  recompute the device's MIN/MAX working set from the outstanding I/O
+ *  depth observed during the window, within the FLOOR..CEILING bounds.
+ *  When the device gets busier we preallocate up to
+ *  TRANSFER_PACKET_WORKINGSET_MAX_PREALLOC packets per window ahead of demand.
+ */
+#define TRANSFER_PACKET_WORKINGSET_WINDOW               (10*1000*1000)
+#define TRANSFER_PACKET_WORKINGSET_FLOOR                MIN_WORKINGSET_TRANSFER_PACKETS_Consumer
+#define TRANSFER_PACKET_WORKINGSET_CEILING              MAX_WORKINGSET_TRANSFER_PACKETS_Enterprise
+#define TRANSFER_PACKET_WORKINGSET_MAX_PREALLOC         32
+#define TRANSFER_PACKET_WORKINGSET_MAX_DECAY_WINDOWS    16
+
+/*
+ *  Magazines are padded out to a cache line so that two processors
+ *  never share one.
+ */
+#define TRANSFER_PACKET_MAGAZINE_CACHE_LINE       128
+
+typedef union _TRANSFER_PACKET_MAGAZINE {
+    struct {
+        SLIST_HEADER FreeList;
+        LONG NumFree;
+
+        /*
+         *  Cumulative per-processor statistics for the working set sizing:
+         *  packets handed out from a free list (rather than allocated),
+         *  and read/write packets completed on this processor along with
+         *  their total latency (100ns units).
+         */
+        ULONG NumHits;
+        ULONG NumCompletions;
+        LARGE_INTEGER CompletionLatency;
+    };
+    UCHAR Pad[TRANSFER_PACKET_MAGAZINE_CACHE_LINE];
+} TRANSFER_PACKET_MAGAZINE, *PTRANSFER_PACKET_MAGAZINE;
+
 
 //
 // add to the front of this structure to help prevent illegal
@@ -487,18 +563,69 @@ struct _CLASS_PRIVATE_FDO_DATA {
      *   interlocked operations on it; but the relatively-static
      *   AllTransferPacketsList list has to be
      *   a doubly-linked list since we have to dequeue from the middle).
+     *
+     *  FreeTransferPacketsList is the shared depot behind the per-processor
+     *  magazines; NumFreeTransferPackets only counts packets in the depot.
+     *  TransferPacketMagazines is NULL on uniprocessor machines, in which
+     *  case all free packets live in the depot.
      */
     LIST_ENTRY AllTransferPacketsList;
     SLIST_HEADER FreeTransferPacketsList;
     ULONG NumFreeTransferPackets;
     ULONG NumTotalTransferPackets;
     ULONG DbgPeakNumTransferPackets;
+    PTRANSFER_PACKET_MAGAZINE TransferPacketMagazines;
+    ULONG NumTransferPacketMagazines;
+    ULONG TransferPacketMagazineDepth;
+
+    /*
+     *  Adaptive transfer packet working set (see AdjustTransferPacketWorkingSet).
+     *  MinWorkingSet/MaxWorkingSet are this device's current trimming thresholds.
+     *  The window fields are protected by SpinLock; the rest are
+     *  updated with interlocked operations or are advisory.
+     */
+    struct {
+        ULONG MinWorkingSet;
+        ULONG MaxWorkingSet;
+        ULONG SmoothedDepth;        // decaying peak of the per-window depth
+        ULONG LastWindowDepth;
+        ULONG LastWindowLatencyUs;  // average read/write latency last window
+        ULONG WindowPeakDepth;      // packets in use when we ran dry this window
+        ULONG NumMisses;            // cumulative packets allocated on demand
+        ULONG NumPreallocated;      // cumulative packets allocated ahead of demand
+        ULONGLONG WindowStartTime;
+        ULONGLONG WindowEndTime;
+        ULONG LastNumCompletions;
+        LARGE_INTEGER LastCompletionLatency;
+    } PacketWorkingSet;
 
     /*
      *  Queue for deferred client irps
      */
     LIST_ENTRY DeferredClientIrpList;
 
+    /*
+     *  Merge stage for sequential client irps (see clntirp.c).
+     *  The run of held irps is protected by SpinLock.
+     *  NumOutstanding counts read/write packets in flight and is
+     *  only maintained when the merge stage is enabled.
+     */
+    struct {
+        BOOLEAN Enabled;
+        UCHAR MajorFunction;
+        UCHAR StackFlags;
+        BOOLEAN EndsOnPageBoundary;
+        LIST_ENTRY IrpList;
+        ULONG NumIrps;
+        ULONG Length;
+        LARGE_INTEGER NextOffset;
+        LONG NumOutstanding;
+        KTIMER Timer;
+        KDPC TimerDpc;
+        ULONG NumMergedTransfers;
+        ULONG NumMergedIrps;
+    } Merge;
+
     /*
      *  Precomputed maximum transfer length for the hardware.
      */
@@ -994,6 +1121,8 @@ PTRANSFER_PACKET NewTransferPacket(PDEVICE_OBJECT Fdo);
 VOID DestroyTransferPacket(PTRANSFER_PACKET Pkt);
 VOID EnqueueFreeTransferPacket(PDEVICE_OBJECT Fdo, PTRANSFER_PACKET Pkt);
 PTRANSFER_PACKET DequeueFreeTransferPacket(PDEVICE_OBJECT Fdo, BOOLEAN AllocIfNeeded);
+ULONG CountFreeTransferPackets(PCLASS_PRIVATE_FDO_DATA FdoData);
+VOID AdjustTransferPacketWorkingSet(PDEVICE_OBJECT Fdo, ULONGLONG CurrentTime);
 VOID SetupReadWriteTransferPacket(PTRANSFER_PACKET pkt, PVOID Buf, ULONG Len, LARGE_INTEGER DiskLocation, PIRP OriginalIrp);
 NTSTATUS SubmitTransferPacket(PTRANSFER_PACKET Pkt);
 NTSTATUS TransferPktComplete(IN PDEVICE_OBJECT NullFdo, IN PIRP Irp, IN PVOID Context);
@@ -1003,6 +1132,12 @@ BOOLEAN InterpretTransferPacketError(PTRANSFER_PACKET Pkt);
 BOOLEAN RetryTransferPacket(PTRANSFER_PACKET Pkt);
 VOID EnqueueDeferredClientIrp(PCLASS_PRIVATE_FDO_DATA FdoData, PIRP Irp);
 PIRP DequeueDeferredClientIrp(PCLASS_PRIVATE_FDO_DATA FdoData);
+VOID InitializeMergeQueue(PDEVICE_OBJECT Fdo);
+VOID DestroyMergeQueue(PDEVICE_OBJECT Fdo);
+BOOLEAN MergeClientIrp(PDEVICE_OBJECT Fdo, PIRP Irp);
+VOID FlushMergeQueue(PDEVICE_OBJECT Fdo);
+VOID MergeQueueTimerDpc(IN PKDPC Dpc, IN PVOID DeferredContext, IN PVOID SystemArgument1, IN PVOID SystemArgument2);
+NTSTATUS MergedTransferComplete(IN PDEVICE_OBJECT NullFdo, IN PIRP Irp, IN PVOID Context);
 VOID InitLowMemRetry(PTRANSFER_PACKET Pkt, PVOID BufPtr, ULONG Len, LARGE_INTEGER TargetLocation);
 BOOLEAN StepLowMemRetry(PTRANSFER_PACKET Pkt);
 VOID SetupEjectionTransferPacket(TRANSFER_PACKET *Pkt, BOOLEAN PreventMediaRemoval, PKEVENT SyncEventPtr, PIRP OriginalIrp);
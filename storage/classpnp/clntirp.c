@@ -24,6 +24,11 @@ Revision History:
 #include "classp.h"
 #include "debug.h"
 
+#ifdef ALLOC_PRAGMA
+    #pragma alloc_text(PAGE, InitializeMergeQueue)
+    #pragma alloc_text(PAGE, DestroyMergeQueue)
+#endif
+
 
 /*
  *  EnqueueDeferredClientIrp
@@ -83,3 +88,346 @@ PIRP DequeueDeferredClientIrp(PCLASS_PRIVATE_FDO_DATA FdoData)
 }
 
 
+
+/*
+ *  InitializeMergeQueue
+ *
+ *      Set up the optional merge stage for sequential client irps.
+ *      It is off unless the device's Classpnp\MergeSequentialIo
+ *      registry value is nonzero.
+ */
+VOID InitializeMergeQueue(PDEVICE_OBJECT Fdo)
+{
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExt = Fdo->DeviceExtension;
+    PCLASS_PRIVATE_FDO_DATA fdoData = fdoExt->PrivateFdoData;
+    ULONG mergeEnabled = 0;
+
+    PAGED_CODE();
+
+    InitializeListHead(&fdoData->Merge.IrpList);
+    fdoData->Merge.NumIrps = 0;
+    fdoData->Merge.Length = 0;
+    fdoData->Merge.NumOutstanding = 0;
+    fdoData->Merge.NumMergedTransfers = 0;
+    fdoData->Merge.NumMergedIrps = 0;
+    KeInitializeTimer(&fdoData->Merge.Timer);
+    KeInitializeDpc(&fdoData->Merge.TimerDpc, MergeQueueTimerDpc, Fdo);
+
+    ClassGetDeviceParameter(fdoExt,
+                            CLASSP_REG_SUBKEY_NAME,
+                            CLASSP_REG_MERGE_SEQUENTIAL_VALUE_NAME,
+                            &mergeEnabled);
+    fdoData->Merge.Enabled = (mergeEnabled != 0);
+}
+
+
+/*
+ *  DestroyMergeQueue
+ *
+ *      Make sure the merge timer can't fire on a device that's going away.
+ *      Every held irp holds the remove lock, so the queue is empty by now.
+ */
+VOID DestroyMergeQueue(PDEVICE_OBJECT Fdo)
+{
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExt = Fdo->DeviceExtension;
+    PCLASS_PRIVATE_FDO_DATA fdoData = fdoExt->PrivateFdoData;
+
+    PAGED_CODE();
+
+    ASSERT(IsListEmpty(&fdoData->Merge.IrpList));
+
+    if (fdoData->Merge.Enabled){
+        KeCancelTimer(&fdoData->Merge.Timer);
+        KeFlushQueuedDpcs();
+    }
+}
+
+
+/*
+ *  MergeClientIrp
+ *
+ *      Called for each client read/write on a device with the merge stage enabled.
+ *      Returns TRUE if the irp was taken into the merge queue; the irp has then
+ *      been marked pending and the caller must return STATUS_PENDING for it.
+ *      Returns FALSE if the caller should send the irp down itself.
+ *
+ *      An irp can start or extend a run only if it is not paging i/o,
+ *      is described by a single MDL and starts on a page boundary
+ *      (so that the run can be described by one MDL).
+ *      We only start a run while other transfers are outstanding,
+ *      so that an idle device never sees added latency.
+ */
+BOOLEAN MergeClientIrp(PDEVICE_OBJECT Fdo, PIRP Irp)
+{
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExt = Fdo->DeviceExtension;
+    PCLASS_PRIVATE_FDO_DATA fdoData = fdoExt->PrivateFdoData;
+    PIO_STACK_LOCATION currentSp = IoGetCurrentIrpStackLocation(Irp);
+    ULONG len = currentSp->Parameters.Read.Length;
+    LARGE_INTEGER offset = currentSp->Parameters.Read.ByteOffset;
+    UCHAR stackFlags = currentSp->Flags;
+    BOOLEAN mergeIt = FALSE;
+    BOOLEAN flushRun = FALSE;
+    KIRQL oldIrql;
+
+    ASSERT(fdoData->Merge.Enabled);
+
+    if (TEST_FLAG(Irp->Flags, IRP_PAGING_IO) ||
+        TEST_FLAG(Irp->Flags, IRP_SYNCHRONOUS_PAGING_IO) ||
+        (fdoData->NumHighPriorityPagingIo != 0) ||
+        !Irp->MdlAddress ||
+        Irp->MdlAddress->Next ||
+        ((ULONG_PTR)MmGetMdlVirtualAddress(Irp->MdlAddress) & (PAGE_SIZE-1)) ||
+        (len > fdoData->HwMaxXferLen)){
+
+        return FALSE;
+    }
+
+    KeAcquireSpinLock(&fdoData->SpinLock, &oldIrql);
+
+    if (fdoData->Merge.NumIrps &&
+        (fdoData->Merge.MajorFunction == currentSp->MajorFunction) &&
+        (fdoData->Merge.StackFlags == stackFlags) &&
+        fdoData->Merge.EndsOnPageBoundary &&
+        (fdoData->Merge.NextOffset.QuadPart == offset.QuadPart) &&
+        (fdoData->Merge.Length + len <= fdoData->HwMaxXferLen)){
+
+        /*
+         *  This irp continues the current run.
+         *  Send the run as soon as it can't grow any more.
+         */
+        mergeIt = TRUE;
+        flushRun = ((fdoData->Merge.NumIrps+1 >= CLASS_MERGE_MAX_IRPS) ||
+                    (fdoData->Merge.Length + len == fdoData->HwMaxXferLen));
+    }
+    else if (fdoData->Merge.NumIrps == 0){
+        /*
+         *  Start a new run, but only if something is in flight that
+         *  will flush it for us when it completes.
+         */
+        if (fdoData->Merge.NumOutstanding > 0){
+            LARGE_INTEGER dueTime;
+
+            fdoData->Merge.MajorFunction = currentSp->MajorFunction;
+            fdoData->Merge.StackFlags = stackFlags;
+            fdoData->Merge.Length = 0;
+            mergeIt = TRUE;
+
+            dueTime.QuadPart = -10000 * CLASS_MERGE_WINDOW_MS;
+            KeSetTimer(&fdoData->Merge.Timer, dueTime, &fdoData->Merge.TimerDpc);
+        }
+    }
+    else {
+        /*
+         *  This irp breaks the current run.  Send the run down now
+         *  so that we don't reorder it behind this irp.
+         */
+        flushRun = TRUE;
+    }
+
+    if (mergeIt){
+        IoMarkIrpPending(Irp);
+        InsertTailList(&fdoData->Merge.IrpList, &Irp->Tail.Overlay.ListEntry);
+        fdoData->Merge.NumIrps++;
+        fdoData->Merge.Length += len;
+        fdoData->Merge.NextOffset.QuadPart = offset.QuadPart + len;
+        fdoData->Merge.EndsOnPageBoundary = ((len & (PAGE_SIZE-1)) == 0);
+    }
+
+    KeReleaseSpinLock(&fdoData->SpinLock, oldIrql);
+
+    if (flushRun){
+        FlushMergeQueue(Fdo);
+    }
+
+    return mergeIt;
+}
+
+
+/*
+ *  FlushMergeQueue
+ *
+ *      Send down the current run of held client irps, if any.
+ *      A run of one irp goes down as is; a longer run is sent as a single
+ *      transfer through a private irp whose MDL concatenates the clients'
+ *      page frames.  If we can't get the resources for that, the held irps
+ *      are sent down individually.
+ */
+VOID FlushMergeQueue(PDEVICE_OBJECT Fdo)
+{
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExt = Fdo->DeviceExtension;
+    PCLASS_PRIVATE_FDO_DATA fdoData = fdoExt->PrivateFdoData;
+    LIST_ENTRY irpList;
+    ULONG numIrps, runLen;
+    UCHAR majorFunc, stackFlags;
+    PCLASS_MERGED_TRANSFER mergedXfer = NULL;
+    PIRP mergedIrp = NULL;
+    PMDL mergedMdl = NULL;
+    PIRP firstIrp;
+    PLIST_ENTRY listEntry;
+    KIRQL oldIrql;
+
+    /*
+     *  This is called on every completion, so check for an empty queue
+     *  before grabbing the spinlock.
+     */
+    if (fdoData->Merge.NumIrps == 0){
+        return;
+    }
+
+    InitializeListHead(&irpList);
+
+    KeAcquireSpinLock(&fdoData->SpinLock, &oldIrql);
+    numIrps = fdoData->Merge.NumIrps;
+    runLen = fdoData->Merge.Length;
+    majorFunc = fdoData->Merge.MajorFunction;
+    stackFlags = fdoData->Merge.StackFlags;
+    while (!IsListEmpty(&fdoData->Merge.IrpList)){
+        listEntry = RemoveHeadList(&fdoData->Merge.IrpList);
+        InsertTailList(&irpList, listEntry);
+    }
+    fdoData->Merge.NumIrps = 0;
+    fdoData->Merge.Length = 0;
+    KeCancelTimer(&fdoData->Merge.Timer);
+    KeReleaseSpinLock(&fdoData->SpinLock, oldIrql);
+
+    if (numIrps == 0){
+        return;
+    }
+
+    firstIrp = CONTAINING_RECORD(irpList.Flink, IRP, Tail.Overlay.ListEntry);
+
+    if (numIrps > 1){
+        mergedXfer = ExAllocatePoolWithTag(NonPagedPool, sizeof(CLASS_MERGED_TRANSFER), 'gmPC');
+        mergedIrp = IoAllocateIrp(1, FALSE);
+        mergedMdl = IoAllocateMdl(MmGetMdlVirtualAddress(firstIrp->MdlAddress), runLen, FALSE, FALSE, NULL);
+    }
+
+    if (mergedXfer && mergedIrp && mergedMdl){
+        PIO_STACK_LOCATION mergedSp;
+        PPFN_NUMBER pfnArray = MmGetMdlPfnArray(mergedMdl);
+        LARGE_INTEGER targetLocation = IoGetCurrentIrpStackLocation(firstIrp)->Parameters.Read.ByteOffset;
+
+        /*
+         *  Build the MDL for the run from the clients' page frames.
+         *  Every irp but the last covers whole pages, so the run
+         *  is one virtually contiguous buffer as far as the port driver can tell.
+         *  Mark the MDL partial so that if the port driver maps it,
+         *  MmPrepareMdlForReuse will unmap it for us.
+         */
+        for (listEntry = irpList.Flink; listEntry != &irpList; listEntry = listEntry->Flink){
+            PIRP clientIrp = CONTAINING_RECORD(listEntry, IRP, Tail.Overlay.ListEntry);
+            ULONG clientLen = IoGetCurrentIrpStackLocation(clientIrp)->Parameters.Read.Length;
+            ULONG numPages = ADDRESS_AND_SIZE_TO_SPAN_PAGES(MmGetMdlVirtualAddress(clientIrp->MdlAddress), clientLen);
+
+            RtlCopyMemory(pfnArray, MmGetMdlPfnArray(clientIrp->MdlAddress), numPages*sizeof(PFN_NUMBER));
+            pfnArray += numPages;
+        }
+        mergedMdl->MdlFlags |= MDL_PARTIAL;
+
+        mergedXfer->Fdo = Fdo;
+        mergedXfer->Mdl = mergedMdl;
+        mergedXfer->NumClientIrps = numIrps;
+        InitializeListHead(&mergedXfer->ClientIrpList);
+        while (!IsListEmpty(&irpList)){
+            listEntry = RemoveHeadList(&irpList);
+            InsertTailList(&mergedXfer->ClientIrpList, listEntry);
+        }
+
+        /*
+         *  Set up our private irp to look like a client read/write
+         *  so that the packet engine can service it as usual.
+         *  Our completion routine sits in the irp's only stack location.
+         */
+        IoSetCompletionRoutine(mergedIrp, MergedTransferComplete, mergedXfer, TRUE, TRUE, TRUE);
+        IoSetNextIrpStackLocation(mergedIrp);
+        mergedSp = IoGetCurrentIrpStackLocation(mergedIrp);
+        mergedSp->DeviceObject = Fdo;
+        mergedSp->MajorFunction = majorFunc;
+        mergedSp->Flags = stackFlags;
+        mergedSp->Parameters.Read.Length = runLen;
+        mergedSp->Parameters.Read.ByteOffset = targetLocation;
+        mergedIrp->MdlAddress = mergedMdl;
+
+        InterlockedIncrement((PLONG)&fdoData->Merge.NumMergedTransfers);
+        InterlockedExchangeAdd((PLONG)&fdoData->Merge.NumMergedIrps, numIrps);
+
+        DBGTRACE(ClassDebugTrace, ("FlushMergeQueue: merged %d irps (%xh bytes) into irp %ph.", numIrps, runLen, mergedIrp));
+
+        ClassAcquireRemoveLock(Fdo, mergedIrp);
+        ServiceTransferRequest(Fdo, mergedIrp);
+    }
+    else {
+        if (mergedXfer) ExFreePool(mergedXfer);
+        if (mergedIrp) IoFreeIrp(mergedIrp);
+        if (mergedMdl) IoFreeMdl(mergedMdl);
+
+        /*
+         *  Send the held irps down one at a time.
+         *  They were already marked pending when we took them.
+         */
+        while (!IsListEmpty(&irpList)){
+            listEntry = RemoveHeadList(&irpList);
+            InitializeListHead(listEntry);
+            ServiceTransferRequest(Fdo, CONTAINING_RECORD(listEntry, IRP, Tail.Overlay.ListEntry));
+        }
+    }
+}
+
+
+/*
+ *  MergeQueueTimerDpc
+ *
+ *      Flush a run that nothing completed behind in time.
+ */
+VOID MergeQueueTimerDpc(IN PKDPC Dpc, IN PVOID DeferredContext, IN PVOID SystemArgument1, IN PVOID SystemArgument2)
+{
+    PDEVICE_OBJECT fdo = (PDEVICE_OBJECT)DeferredContext;
+
+    FlushMergeQueue(fdo);
+}
+
+
+/*
+ *  MergedTransferComplete
+ *
+ *      Completion routine for the private irp of a merged transfer.
+ *      On success, complete each client irp for its own length.
+ *      On failure, send each client irp down again by itself, so that
+ *      the error (and the retries) apply only to the irps that really fail.
+ */
+NTSTATUS MergedTransferComplete(IN PDEVICE_OBJECT NullFdo, IN PIRP Irp, IN PVOID Context)
+{
+    PCLASS_MERGED_TRANSFER mergedXfer = (PCLASS_MERGED_TRANSFER)Context;
+    PDEVICE_OBJECT Fdo = mergedXfer->Fdo;
+    NTSTATUS status = Irp->IoStatus.Status;
+    PLIST_ENTRY listEntry;
+
+    if (!NT_SUCCESS(status)){
+        DBGWARN(("MergedTransferComplete: merged transfer of %d irps failed with %xh, resending them individually.", mergedXfer->NumClientIrps, status));
+    }
+
+    while (!IsListEmpty(&mergedXfer->ClientIrpList)){
+        PIRP clientIrp;
+
+        listEntry = RemoveHeadList(&mergedXfer->ClientIrpList);
+        InitializeListHead(listEntry);
+        clientIrp = CONTAINING_RECORD(listEntry, IRP, Tail.Overlay.ListEntry);
+
+        if (NT_SUCCESS(status)){
+            clientIrp->IoStatus.Status = status;
+            clientIrp->IoStatus.Information = IoGetCurrentIrpStackLocation(clientIrp)->Parameters.Read.Length;
+            ClassReleaseRemoveLock(Fdo, clientIrp);
+            ClassCompleteRequest(Fdo, clientIrp, IO_DISK_INCREMENT);
+        }
+        else {
+            ServiceTransferRequest(Fdo, clientIrp);
+        }
+    }
+
+    MmPrepareMdlForReuse(mergedXfer->Mdl);
+    IoFreeMdl(mergedXfer->Mdl);
+    ExFreePool(mergedXfer);
+    IoFreeIrp(Irp);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
@@ -36,6 +36,49 @@ ULONG MinWorkingSetTransferPackets = MIN_WORKINGSET_TRANSFER_PACKETS_Consumer;
 ULONG MaxWorkingSetTransferPackets = MAX_WORKINGSET_TRANSFER_PACKETS_Consumer;
 
 
+/*
+ *  GetTransferPacketMagazine
+ *
+ *      Return the current processor's free packet magazine,
+ *      or NULL if this FDO does not use magazines.
+ *      The caller may get rescheduled onto another processor right after this;
+ *      that only costs us locality, since the magazine is an interlocked slist.
+ */
+__inline PTRANSFER_PACKET_MAGAZINE GetTransferPacketMagazine(PCLASS_PRIVATE_FDO_DATA FdoData)
+{
+    PTRANSFER_PACKET_MAGAZINE magazine = NULL;
+
+    if (FdoData->TransferPacketMagazines){
+        ULONG procNum = KeGetCurrentProcessorNumber();
+        if (procNum < FdoData->NumTransferPacketMagazines){
+            magazine = &FdoData->TransferPacketMagazines[procNum];
+        }
+    }
+
+    return magazine;
+}
+
+
+/*
+ *  CountFreeTransferPackets
+ *
+ *      Sum the free packets in the depot and in all the magazines.
+ *      This touches every processor's magazine, so it is only used
+ *      on the trimming path, never for an ordinary transfer.
+ */
+ULONG CountFreeTransferPackets(PCLASS_PRIVATE_FDO_DATA FdoData)
+{
+    ULONG numFree = FdoData->NumFreeTransferPackets;
+    ULONG i;
+
+    for (i = 0; i < FdoData->NumTransferPacketMagazines; i++){
+        numFree += FdoData->TransferPacketMagazines[i].NumFree;
+    }
+
+    return numFree;
+}
+
+
 /*
  *  InitializeTransferPackets
  *
@@ -64,6 +107,9 @@ NTSTATUS InitializeTransferPackets(PDEVICE_OBJECT Fdo)
 
     fdoData->NumTotalTransferPackets = 0;
     fdoData->NumFreeTransferPackets = 0;
+    fdoData->TransferPacketMagazines = NULL;
+    fdoData->NumTransferPacketMagazines = 0;
+    fdoData->TransferPacketMagazineDepth = 0;
     InitializeSListHead(&fdoData->FreeTransferPacketsList);
     InitializeListHead(&fdoData->AllTransferPacketsList);
     InitializeListHead(&fdoData->DeferredClientIrpList);
@@ -92,7 +138,51 @@ NTSTATUS InitializeTransferPackets(PDEVICE_OBJECT Fdo)
         MaxWorkingSetTransferPackets = MAX_WORKINGSET_TRANSFER_PACKETS_Consumer;
     }
 
-    while (fdoData->NumFreeTransferPackets < MIN_INITIAL_TRANSFER_PACKETS){
+    /*
+     *  The working set thresholds start out at the SKU defaults;
+     *  AdjustTransferPacketWorkingSet moves them with the load on this device.
+     */
+    RtlZeroMemory(&fdoData->PacketWorkingSet, sizeof(fdoData->PacketWorkingSet));
+    fdoData->PacketWorkingSet.MinWorkingSet = MinWorkingSetTransferPackets;
+    fdoData->PacketWorkingSet.MaxWorkingSet = MaxWorkingSetTransferPackets;
+    fdoData->PacketWorkingSet.SmoothedDepth = MinWorkingSetTransferPackets;
+    fdoData->PacketWorkingSet.WindowStartTime = KeQueryInterruptTime();
+    fdoData->PacketWorkingSet.WindowEndTime = fdoData->PacketWorkingSet.WindowStartTime + TRANSFER_PACKET_WORKINGSET_WINDOW;
+
+    /*
+     *  Set up the per-processor packet magazines.
+     *  On a uniprocessor they have zero depth and only carry the statistics.
+     *  If we can't get the memory for them, we just run with the shared depot
+     *  (FreeTransferPacketsList) alone and with the static SKU thresholds.
+     */
+    {
+        ULONG numProcs = (ULONG)KeNumberProcessors;
+
+        fdoData->TransferPacketMagazines = ExAllocatePoolWithTag(NonPagedPool, numProcs*sizeof(TRANSFER_PACKET_MAGAZINE), 'mnPC');
+        if (fdoData->TransferPacketMagazines){
+            ULONG i;
+
+            RtlZeroMemory(fdoData->TransferPacketMagazines, numProcs*sizeof(TRANSFER_PACKET_MAGAZINE));
+            for (i = 0; i < numProcs; i++){
+                InitializeSListHead(&fdoData->TransferPacketMagazines[i].FreeList);
+            }
+
+            fdoData->NumTransferPacketMagazines = numProcs;
+            if (numProcs > 1){
+                fdoData->TransferPacketMagazineDepth = MinWorkingSetTransferPackets/numProcs;
+                fdoData->TransferPacketMagazineDepth = MAX(fdoData->TransferPacketMagazineDepth, MIN_TRANSFER_PACKET_MAGAZINE_DEPTH);
+                fdoData->TransferPacketMagazineDepth = MIN(fdoData->TransferPacketMagazineDepth, MAX_TRANSFER_PACKET_MAGAZINE_DEPTH);
+            }
+        }
+        else {
+            DBGWARN(("InitializeTransferPackets: magazine allocation failed, using shared free list only"));
+            fdoData->PacketWorkingSet.WindowEndTime = (ULONGLONG)-1;
+        }
+    }
+
+    InitializeMergeQueue(Fdo);
+
+    while (fdoData->NumTotalTransferPackets < MIN_INITIAL_TRANSFER_PACKETS){
         PTRANSFER_PACKET pkt = NewTransferPacket(Fdo);
         if (pkt){
             InterlockedIncrement(&fdoData->NumTotalTransferPackets);
@@ -131,12 +221,20 @@ VOID DestroyAllTransferPackets(PDEVICE_OBJECT Fdo)
 
     ASSERT(IsListEmpty(&fdoData->DeferredClientIrpList));
 
+    DestroyMergeQueue(Fdo);
+
     while (pkt = DequeueFreeTransferPacket(Fdo, FALSE)){
         DestroyTransferPacket(pkt);
         InterlockedDecrement(&fdoData->NumTotalTransferPackets);
     }
 
     ASSERT(fdoData->NumTotalTransferPackets == 0);
+
+    if (fdoData->TransferPacketMagazines){
+        ExFreePool(fdoData->TransferPacketMagazines);
+        fdoData->TransferPacketMagazines = NULL;
+        fdoData->NumTransferPacketMagazines = 0;
+    }
 }
 
 
@@ -215,33 +313,57 @@ VOID EnqueueFreeTransferPacket(PDEVICE_OBJECT Fdo, PTRANSFER_PACKET Pkt)
 {
     PFUNCTIONAL_DEVICE_EXTENSION fdoExt = Fdo->DeviceExtension;
     PCLASS_PRIVATE_FDO_DATA fdoData = fdoExt->PrivateFdoData;
+    PTRANSFER_PACKET_MAGAZINE magazine;
     KIRQL oldIrql;
     ULONG newNumPkts;
 
     ASSERT(!Pkt->SlistEntry.Next);
 
-    InterlockedPushEntrySList(&fdoData->FreeTransferPacketsList, &Pkt->SlistEntry);
-    newNumPkts = InterlockedIncrement(&fdoData->NumFreeTransferPackets);
-    ASSERT(newNumPkts <= fdoData->NumTotalTransferPackets);
+    /*
+     *  Return the packet to this processor's magazine if there is room;
+     *  otherwise let it overflow into the shared depot.
+     */
+    magazine = GetTransferPacketMagazine(fdoData);
+    if (magazine && ((ULONG)magazine->NumFree < fdoData->TransferPacketMagazineDepth)){
+        InterlockedPushEntrySList(&magazine->FreeList, &Pkt->SlistEntry);
+        InterlockedIncrement(&magazine->NumFree);
+    }
+    else {
+        InterlockedPushEntrySList(&fdoData->FreeTransferPacketsList, &Pkt->SlistEntry);
+        newNumPkts = InterlockedIncrement(&fdoData->NumFreeTransferPackets);
+        ASSERT(newNumPkts <= fdoData->NumTotalTransferPackets);
+    }
+
+    /*
+     *  There is nothing to trim unless we have grown past our lower threshold.
+     *  NumTotalTransferPackets only changes when packets are allocated or freed,
+     *  so in steady state this check costs us a read of a clean cache line.
+     *  Also don't bother counting the free packets in all the magazines
+     *  unless the depot is full enough that they could all be free.
+     */
+    if ((fdoData->NumTotalTransferPackets <= fdoData->PacketWorkingSet.MinWorkingSet) ||
+        (fdoData->NumFreeTransferPackets + fdoData->NumTransferPacketMagazines*fdoData->TransferPacketMagazineDepth < fdoData->NumTotalTransferPackets)){
+        return;
+    }
 
     /*
-     *  If the total number of packets is larger than MinWorkingSetTransferPackets,
+     *  If the total number of packets is larger than this device's MinWorkingSet,
      *  that means that we've been in stress.  If all those packets are now
      *  free, then we are now out of stress and can free the extra packets.
-     *  Free down to MaxWorkingSetTransferPackets immediately, and
-     *  down to MinWorkingSetTransferPackets lazily (one at a time).
+     *  Free down to MaxWorkingSet immediately, and
+     *  down to MinWorkingSet lazily (one at a time).
      */
-    if (fdoData->NumFreeTransferPackets >= fdoData->NumTotalTransferPackets){
+    if (CountFreeTransferPackets(fdoData) >= fdoData->NumTotalTransferPackets){
 
         /*
          *  1.  Immediately snap down to our UPPER threshold.
          */
-        if (fdoData->NumTotalTransferPackets > MaxWorkingSetTransferPackets){
+        if (fdoData->NumTotalTransferPackets > fdoData->PacketWorkingSet.MaxWorkingSet){
             SINGLE_LIST_ENTRY pktList;
             PSINGLE_LIST_ENTRY slistEntry;
             PTRANSFER_PACKET pktToDelete;
 
-            DBGTRACE(ClassDebugTrace, ("Exiting stress, block freeing (%d-%d) packets.", fdoData->NumTotalTransferPackets, MaxWorkingSetTransferPackets));
+            DBGTRACE(ClassDebugTrace, ("Exiting stress, block freeing (%d-%d) packets.", fdoData->NumTotalTransferPackets, fdoData->PacketWorkingSet.MaxWorkingSet));
 
             /*
              *  Check the counter again with lock held.  This eliminates a race condition
@@ -254,8 +376,8 @@ VOID EnqueueFreeTransferPacket(PDEVICE_OBJECT Fdo, PTRANSFER_PACKET Pkt)
              */
             SimpleInitSlistHdr(&pktList);
             KeAcquireSpinLock(&fdoData->SpinLock, &oldIrql);
-            while ((fdoData->NumFreeTransferPackets >= fdoData->NumTotalTransferPackets) &&
-                   (fdoData->NumTotalTransferPackets > MaxWorkingSetTransferPackets)){
+            while ((CountFreeTransferPackets(fdoData) >= fdoData->NumTotalTransferPackets) &&
+                   (fdoData->NumTotalTransferPackets > fdoData->PacketWorkingSet.MaxWorkingSet)){
 
                 pktToDelete = DequeueFreeTransferPacket(Fdo, FALSE);
                 if (pktToDelete){
@@ -264,7 +386,7 @@ VOID EnqueueFreeTransferPacket(PDEVICE_OBJECT Fdo, PTRANSFER_PACKET Pkt)
                     InterlockedDecrement(&fdoData->NumTotalTransferPackets);
                 }
                 else {
-                    DBGTRACE(ClassDebugTrace, ("Extremely unlikely condition (non-fatal): %d packets dequeued at once for Fdo %p. NumTotalTransferPackets=%d (1).", MaxWorkingSetTransferPackets, Fdo, fdoData->NumTotalTransferPackets));
+                    DBGTRACE(ClassDebugTrace, ("Extremely unlikely condition (non-fatal): %d packets dequeued at once for Fdo %p. NumTotalTransferPackets=%d (1).", fdoData->PacketWorkingSet.MaxWorkingSet, Fdo, fdoData->NumTotalTransferPackets));
                     break;
                 }
             }
@@ -280,7 +402,7 @@ VOID EnqueueFreeTransferPacket(PDEVICE_OBJECT Fdo, PTRANSFER_PACKET Pkt)
         /*
          *  2.  Lazily work down to our LOWER threshold (by only freeing one packet at a time).
          */
-        if (fdoData->NumTotalTransferPackets > MinWorkingSetTransferPackets){
+        if (fdoData->NumTotalTransferPackets > fdoData->PacketWorkingSet.MinWorkingSet){
             /*
              *  Check the counter again with lock held.  This eliminates a race condition
              *  while still allowing us to not grab the spinlock in the common codepath.
@@ -292,18 +414,18 @@ VOID EnqueueFreeTransferPacket(PDEVICE_OBJECT Fdo, PTRANSFER_PACKET Pkt)
              */
             PTRANSFER_PACKET pktToDelete = NULL;
 
-            DBGTRACE(ClassDebugTrace, ("Exiting stress, lazily freeing one of %d/%d packets.", fdoData->NumTotalTransferPackets, MinWorkingSetTransferPackets));
+            DBGTRACE(ClassDebugTrace, ("Exiting stress, lazily freeing one of %d/%d packets.", fdoData->NumTotalTransferPackets, fdoData->PacketWorkingSet.MinWorkingSet));
 
             KeAcquireSpinLock(&fdoData->SpinLock, &oldIrql);
-            if ((fdoData->NumFreeTransferPackets >= fdoData->NumTotalTransferPackets) &&
-                (fdoData->NumTotalTransferPackets > MinWorkingSetTransferPackets)){
+            if ((CountFreeTransferPackets(fdoData) >= fdoData->NumTotalTransferPackets) &&
+                (fdoData->NumTotalTransferPackets > fdoData->PacketWorkingSet.MinWorkingSet)){
 
                 pktToDelete = DequeueFreeTransferPacket(Fdo, FALSE);
                 if (pktToDelete){
                     InterlockedDecrement(&fdoData->NumTotalTransferPackets);
                 }
                 else {
-                    DBGTRACE(ClassDebugTrace, ("Extremely unlikely condition (non-fatal): %d packets dequeued at once for Fdo %p. NumTotalTransferPackets=%d (2).", MinWorkingSetTransferPackets, Fdo, fdoData->NumTotalTransferPackets));
+                    DBGTRACE(ClassDebugTrace, ("Extremely unlikely condition (non-fatal): %d packets dequeued at once for Fdo %p. NumTotalTransferPackets=%d (2).", fdoData->PacketWorkingSet.MinWorkingSet, Fdo, fdoData->NumTotalTransferPackets));
                 }
             }
             KeReleaseSpinLock(&fdoData->SpinLock, oldIrql);
@@ -322,14 +444,49 @@ PTRANSFER_PACKET DequeueFreeTransferPacket(PDEVICE_OBJECT Fdo, BOOLEAN AllocIfNe
 {
     PFUNCTIONAL_DEVICE_EXTENSION fdoExt = Fdo->DeviceExtension;
     PCLASS_PRIVATE_FDO_DATA fdoData = fdoExt->PrivateFdoData;
+    PTRANSFER_PACKET_MAGAZINE magazine;
     PTRANSFER_PACKET pkt;
-    PSLIST_ENTRY slistEntry;
+    PSLIST_ENTRY slistEntry = NULL;
+    ULONG i;
+
+    /*
+     *  Look for a free packet in this processor's magazine first,
+     *  then in the shared depot.
+     */
+    magazine = GetTransferPacketMagazine(fdoData);
+    if (magazine && (magazine->NumFree > 0)){
+        slistEntry = InterlockedPopEntrySList(&magazine->FreeList);
+        if (slistEntry){
+            InterlockedDecrement(&magazine->NumFree);
+        }
+    }
+    if (!slistEntry){
+        slistEntry = InterlockedPopEntrySList(&fdoData->FreeTransferPacketsList);
+        if (slistEntry){
+            InterlockedDecrement(&fdoData->NumFreeTransferPackets);
+        }
+    }
+
+    /*
+     *  Before allocating a new packet, steal one that is cached
+     *  on another processor.  This is also how the trimming and teardown
+     *  paths (AllocIfNeeded==FALSE) find every free packet.
+     */
+    for (i = 0; !slistEntry && (i < fdoData->NumTransferPacketMagazines); i++){
+        if (fdoData->TransferPacketMagazines[i].NumFree > 0){
+            slistEntry = InterlockedPopEntrySList(&fdoData->TransferPacketMagazines[i].FreeList);
+            if (slistEntry){
+                InterlockedDecrement(&fdoData->TransferPacketMagazines[i].NumFree);
+            }
+        }
+    }
 
-    slistEntry = InterlockedPopEntrySList(&fdoData->FreeTransferPacketsList);
     if (slistEntry){
         slistEntry->Next = NULL;
         pkt = CONTAINING_RECORD(slistEntry, TRANSFER_PACKET, SlistEntry);
-        InterlockedDecrement(&fdoData->NumFreeTransferPackets);
+        if (magazine && AllocIfNeeded){
+            InterlockedIncrement((PLONG)&magazine->NumHits);
+        }
     }
     else {
         if (AllocIfNeeded){
@@ -338,11 +495,16 @@ PTRANSFER_PACKET DequeueFreeTransferPacket(PDEVICE_OBJECT Fdo, BOOLEAN AllocIfNe
              *  In order to service the current transfer,
              *  allocate an extra packet.
              *  We will free it lazily when we are out of stress.
+             *
+             *  Every packet is in use right now, so this is also
+             *  the peak depth for the working set sizing.
              */
             pkt = NewTransferPacket(Fdo);
             if (pkt){
-                InterlockedIncrement(&fdoData->NumTotalTransferPackets);
+                ULONG numTotalPkts = InterlockedIncrement(&fdoData->NumTotalTransferPackets);
                 fdoData->DbgPeakNumTransferPackets = max(fdoData->DbgPeakNumTransferPackets, fdoData->NumTotalTransferPackets);
+                InterlockedIncrement((PLONG)&fdoData->PacketWorkingSet.NumMisses);
+                fdoData->PacketWorkingSet.WindowPeakDepth = max(fdoData->PacketWorkingSet.WindowPeakDepth, numTotalPkts);
             }
             else {
                 DBGWARN(("DequeueFreeTransferPacket: packet allocation failed"));
@@ -358,6 +520,116 @@ PTRANSFER_PACKET DequeueFreeTransferPacket(PDEVICE_OBJECT Fdo, BOOLEAN AllocIfNe
 
 
 
+/*
+ *  AdjustTransferPacketWorkingSet
+ *
+ *      Called once per TRANSFER_PACKET_WORKINGSET_WINDOW from the completion path
+ *      to resize this device's packet working set from the observed load.
+ *
+ *      The depth for the window is the larger of
+ *        - the number of packets in use when we last ran out of free packets, and
+ *        - the average number of requests outstanding (by Little's law,
+ *          the summed completion latency divided by the window length).
+ *      The smoothed depth jumps up to a higher depth immediately and decays
+ *      by a quarter per window once the load drops off (including the idle
+ *      windows during which nothing completed).  The lower threshold tracks the
+ *      smoothed depth and the upper threshold allows twice that for bursts.
+ */
+VOID AdjustTransferPacketWorkingSet(PDEVICE_OBJECT Fdo, ULONGLONG CurrentTime)
+{
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExt = Fdo->DeviceExtension;
+    PCLASS_PRIVATE_FDO_DATA fdoData = fdoExt->PrivateFdoData;
+    ULONG numCompletions = 0;
+    LARGE_INTEGER completionLatency;
+    ULONGLONG windowLen, windowLatency;
+    ULONG windowCompletions, numWindows, depth, smoothedDepth;
+    ULONG newMin, newMax, numToPrealloc = 0;
+    KIRQL oldIrql;
+    ULONG i;
+
+    if (!fdoData->TransferPacketMagazines){
+        return;
+    }
+
+    KeAcquireSpinLock(&fdoData->SpinLock, &oldIrql);
+
+    /*
+     *  Someone else may have closed this window while we waited for the lock.
+     */
+    if (CurrentTime < fdoData->PacketWorkingSet.WindowEndTime){
+        KeReleaseSpinLock(&fdoData->SpinLock, oldIrql);
+        return;
+    }
+
+    completionLatency.QuadPart = 0;
+    for (i = 0; i < fdoData->NumTransferPacketMagazines; i++){
+        numCompletions += fdoData->TransferPacketMagazines[i].NumCompletions;
+        completionLatency.QuadPart += fdoData->TransferPacketMagazines[i].CompletionLatency.QuadPart;
+    }
+
+    windowLen = CurrentTime - fdoData->PacketWorkingSet.WindowStartTime;
+    windowLen = MAX(windowLen, 1);
+    windowCompletions = numCompletions - fdoData->PacketWorkingSet.LastNumCompletions;
+    windowLatency = completionLatency.QuadPart - fdoData->PacketWorkingSet.LastCompletionLatency.QuadPart;
+    numWindows = (ULONG)MIN(windowLen/TRANSFER_PACKET_WORKINGSET_WINDOW, TRANSFER_PACKET_WORKINGSET_MAX_DECAY_WINDOWS);
+    numWindows = MAX(numWindows, 1);
+
+    depth = (ULONG)MIN((windowLatency + windowLen - 1)/windowLen, TRANSFER_PACKET_WORKINGSET_CEILING);
+    depth = MAX(depth, fdoData->PacketWorkingSet.WindowPeakDepth);
+
+    smoothedDepth = fdoData->PacketWorkingSet.SmoothedDepth;
+    if (depth >= smoothedDepth){
+        smoothedDepth = depth;
+    }
+    else {
+        while (numWindows-- && (smoothedDepth > depth)){
+            smoothedDepth -= (smoothedDepth - depth + 3)/4;
+        }
+    }
+
+    newMin = MAX(smoothedDepth, TRANSFER_PACKET_WORKINGSET_FLOOR);
+    newMin = MIN(newMin, TRANSFER_PACKET_WORKINGSET_CEILING);
+    newMax = MAX(2*newMin, MAX_WORKINGSET_TRANSFER_PACKETS_Consumer);
+    newMax = MIN(newMax, TRANSFER_PACKET_WORKINGSET_CEILING);
+
+    if (newMin > fdoData->NumTotalTransferPackets){
+        numToPrealloc = MIN(newMin - fdoData->NumTotalTransferPackets, TRANSFER_PACKET_WORKINGSET_MAX_PREALLOC);
+    }
+
+    DBGTRACE(ClassDebugTrace, ("Fdo %p packet working set: depth=%d smoothed=%d min=%d->%d max=%d->%d", Fdo, depth, smoothedDepth, fdoData->PacketWorkingSet.MinWorkingSet, newMin, fdoData->PacketWorkingSet.MaxWorkingSet, newMax));
+
+    fdoData->PacketWorkingSet.MinWorkingSet = newMin;
+    fdoData->PacketWorkingSet.MaxWorkingSet = newMax;
+    fdoData->PacketWorkingSet.SmoothedDepth = smoothedDepth;
+    fdoData->PacketWorkingSet.LastWindowDepth = depth;
+    fdoData->PacketWorkingSet.LastWindowLatencyUs = windowCompletions ? (ULONG)(windowLatency/windowCompletions/10) : 0;
+    fdoData->PacketWorkingSet.WindowPeakDepth = 0;
+    fdoData->PacketWorkingSet.LastNumCompletions = numCompletions;
+    fdoData->PacketWorkingSet.LastCompletionLatency = completionLatency;
+    fdoData->PacketWorkingSet.WindowStartTime = CurrentTime;
+    fdoData->PacketWorkingSet.WindowEndTime = CurrentTime + TRANSFER_PACKET_WORKINGSET_WINDOW;
+
+    KeReleaseSpinLock(&fdoData->SpinLock, oldIrql);
+
+    /*
+     *  The device is getting busier; allocate packets ahead of demand
+     *  so that the next burst doesn't have to.
+     */
+    while (numToPrealloc--){
+        PTRANSFER_PACKET pkt = NewTransferPacket(Fdo);
+        if (pkt){
+            InterlockedIncrement(&fdoData->NumTotalTransferPackets);
+            InterlockedIncrement((PLONG)&fdoData->PacketWorkingSet.NumPreallocated);
+            fdoData->DbgPeakNumTransferPackets = max(fdoData->DbgPeakNumTransferPackets, fdoData->NumTotalTransferPackets);
+            EnqueueFreeTransferPacket(Fdo, pkt);
+        }
+        else {
+            break;
+        }
+    }
+}
+
+
 /*
  *  SetupReadWriteTransferPacket
  *
@@ -452,6 +724,16 @@ VOID SetupReadWriteTransferPacket(  PTRANSFER_PACKET Pkt,
     Pkt->NumRetries = NUM_IO_RETRIES;
     Pkt->SyncEventPtr = NULL;
     Pkt->CompleteOriginalIrpWhenLastPacketCompletes = TRUE;
+    Pkt->TimeSetup = KeQueryInterruptTime();
+
+    /*
+     *  The merge stage only holds client irps back while transfers are in flight.
+     *  (Low-memory retries set up the same packet again for each chunk;
+     *  count the packet only once.)
+     */
+    if (fdoData->Merge.Enabled && !Pkt->InLowMemRetry){
+        InterlockedIncrement(&fdoData->Merge.NumOutstanding);
+    }
 
     DBGLOGFLUSHINFO(fdoData, TRUE, (BOOLEAN)(pCdb->CDB10.ForceUnitAccess), FALSE);
 }
@@ -647,6 +929,8 @@ NTSTATUS TransferPktComplete(IN PDEVICE_OBJECT NullFdo, IN PIRP Irp, IN PVOID Co
         PIRP deferredIrp;
         PDEVICE_OBJECT Fdo = pkt->Fdo;
         UCHAR uniqueAddr;
+        ULONGLONG currentTime = 0;
+        BOOLEAN releaseMergeSlot;
 
         /*
          *  In case a remove is pending, bump the lock count so we don't get freed
@@ -794,13 +1078,46 @@ NTSTATUS TransferPktComplete(IN PDEVICE_OBJECT NullFdo, IN PIRP Irp, IN PVOID Co
             pkt->SyncEventPtr = NULL;
         }
 
+        /*
+         *  Account the read/write latency to this processor's magazine
+         *  for the working set sizing.
+         */
+        if (pkt->CompleteOriginalIrpWhenLastPacketCompletes){
+            PTRANSFER_PACKET_MAGAZINE magazine = GetTransferPacketMagazine(fdoData);
+
+            currentTime = KeQueryInterruptTime();
+            if (magazine){
+                InterlockedIncrement((PLONG)&magazine->NumCompletions);
+                ExInterlockedAddLargeStatistic(&magazine->CompletionLatency, (ULONG)MIN(currentTime - pkt->TimeSetup, MAXULONG));
+            }
+        }
+
         /*
          *  Free the completed packet.
+         *  Another processor may reuse the packet as soon as it is on the free list,
+         *  so decide now whether it held a merge slot.
          */
+        releaseMergeSlot = (fdoData->Merge.Enabled && pkt->CompleteOriginalIrpWhenLastPacketCompletes);
         pkt->OriginalIrp = NULL;
         pkt->InLowMemRetry = FALSE;
         EnqueueFreeTransferPacket(Fdo, pkt);
 
+        /*
+         *  A transfer just finished; send down any client irps
+         *  the merge stage was holding back behind it.
+         */
+        if (releaseMergeSlot){
+            InterlockedDecrement(&fdoData->Merge.NumOutstanding);
+            FlushMergeQueue(Fdo);
+        }
+
+        /*
+         *  Once per window, resize the packet working set from the observed load.
+         */
+        if (currentTime >= fdoData->PacketWorkingSet.WindowEndTime){
+            AdjustTransferPacketWorkingSet(Fdo, currentTime);
+        }
+
         /*
          *  Now that we have freed some resources,
          *  try again to send one of the previously deferred irps.
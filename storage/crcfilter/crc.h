@@ -18,6 +18,8 @@ Notes:
 
 --*/
 
+#include "crcsum.h"
+
 //
 //  Each CRC Entry is 2 bytes: 
 //      --  2 bytes CRC for 512 bytes.
@@ -42,8 +44,59 @@ Notes:
  *  Maximum amount of locked pool to use for recently-accessed checksums (per disk)
  */
 #define MAX_LOCKED_BYTES_FOR_CHECKSUMS  0x400000   // 4MB per disk
-#define MAX_LOCKED_CHECKSUM_ARRAYS (MAX_LOCKED_BYTES_FOR_CHECKSUMS/(CRC_MDL_LOGIC_BLOCK_SIZE*sizeof(USHORT)))
-#define MAX_LOCKED_CHECKSUM_ARRAY_PAIRS (MAX_LOCKED_CHECKSUM_ARRAYS/2)
+#define CHECKSUM_ARRAY_BYTES (CRC_MDL_LOGIC_BLOCK_SIZE*sizeof(USHORT))
+#define MAX_LOCKED_CHECKSUM_ARRAYS (MAX_LOCKED_BYTES_FOR_CHECKSUMS/CHECKSUM_ARRAY_BYTES)
+
+/*
+ *  Default for the most pool to use for all the checksums of a disk, locked and packed (per disk).
+ *  Can be set with the ChecksumMemoryBudgetMB value in the Parameters key of the service.
+ *  When the budget is used up, the least recently used packed checksums are dropped.
+ */
+#define DEFAULT_CHECKSUM_MEMORY_BUDGET_MB   64
+#define MAX_CHECKSUM_MEMORY_BUDGET_MB       2048
+
+/*
+ *  Size of the sector bitmap of a sparse CRC_PACKED_REGION
+ */
+#define CHECKSUM_BITMAP_BYTES (CRC_MDL_LOGIC_BLOCK_SIZE/8)
+
+/*
+ *  When to verify a read after completing it, instead of in its completion routine.
+ *  Set with the VerifyAfterPolicy value in the Parameters key of the service.
+ */
+#define CRC_VERIFY_AFTER_NEVER          0   // verify every read in its completion (the default)
+#define CRC_VERIFY_AFTER_LARGE_READS    1   // defer reads of at least VerifyAfterMinBytes
+#define CRC_VERIFY_AFTER_ALL_READS      2   // defer every read
+
+#define DEFAULT_VERIFY_AFTER_MIN_BYTES          0x10000
+#define DEFAULT_VERIFY_AFTER_MAX_OUTSTANDING    256     // per disk; more are verified inline
+
+#define CRC_VERIFY_MAX_QUEUES   32  // one verify worker per processor, up to this many
+#define CRC_VERIFY_BATCH        16  // most reads a worker takes off its queue at once
+#define CRC_VERIFY_GROUP        64  // most sectors checksummed before taking the locks to check them
+
+typedef struct _CRC_VERIFY_QUEUE {
+    KSPIN_LOCK              Lock;
+    LIST_ENTRY              List;           // CRC_COMPLETION_CONTEXT's in the order the reads completed
+    KEVENT                  WorkEvent;
+    PKTHREAD                Thread;
+    KAFFINITY               Affinity;
+
+    ULONG                   Depth;
+    ULONG                   DbgMaxDepth;
+    ULONG                   DbgNumBatches;
+} CRC_VERIFY_QUEUE, *PCRC_VERIFY_QUEUE;
+
+typedef struct _CRC_VERIFY_POOL {
+    ULONG                   NumQueues;      // zero if the pool is not running
+    BOOLEAN                 Stopping;
+    CRC_VERIFY_QUEUE        Queues[CRC_VERIFY_MAX_QUEUES];
+} CRC_VERIFY_POOL, *PCRC_VERIFY_POOL;
+
+extern CRC_VERIFY_POOL g_VerifyPool;
+extern ULONG g_VerifyAfterPolicy;
+extern ULONG g_VerifyAfterMinBytes;
+extern ULONG g_VerifyAfterMaxOutstanding;
 
 
 //
@@ -139,6 +192,12 @@ PDEFERRED_CHECKSUM_ENTRY NewDeferredCheckSumEntry(  PDEVICE_EXTENSION DeviceExte
                                                                                             BOOLEAN IsWrite);
 VOID FreeDeferredCheckSumEntry( PDEVICE_EXTENSION DeviceExtension,
                                                                     PDEFERRED_CHECKSUM_ENTRY DefCheckSumEntry);
-                                                                    
-extern ULONG32 RtlCrc32Table[];
+NTSTATUS StartVerifyPool();
+VOID StopVerifyPool();
+BOOLEAN ReserveDeferredRead(PDEVICE_EXTENSION DeviceExtension, ULONG Length);
+VOID QueueDeferredRead(PDEVICE_EXTENSION DeviceExtension, PCRC_COMPLETION_CONTEXT CrcContext, ULONG LogicalBlockAddr, ULONG NumSectors, PUCHAR DataBuf);
+VOID MarkDeferredReadsStale(PDEVICE_EXTENSION DeviceExtension, ULONG LogicalBlockAddr, ULONG NumSectors);
+VOID VerifyWorkerThread(PVOID Context);
+VOID VerifyDeferredRead(PCRC_COMPLETION_CONTEXT CrcContext);
+
 
@@ -0,0 +1,249 @@
+/*++
+Copyright (c) 2001-2002  Microsoft Corporation
+
+Module Name:
+
+    CrcClmul.c
+
+Abstract:
+
+    CRC32 kernel using the carry-less multiply (PCLMULQDQ) instruction.
+
+    The buffer is folded 64 bytes at a time into four 128 bit
+    accumulators, which are folded into one, and the result is reduced to
+    32 bits with a Barrett reduction. See "Fast CRC Computation for Generic
+    Polynomials Using PCLMULQDQ Instruction" (Intel, 2009). The constants
+    are for the bit reflected ISO 3309 polynomial 0x04C11DB7.
+
+Environment:
+
+    kernel mode only, x86 and amd64
+
+Notes:
+
+    This file is also built into the user mode test harness, with UTEST
+    defined.
+
+--*/
+
+#if !defined (UTEST)
+#include <ntddk.h>
+#endif
+
+#include <intrin.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+
+#include "crcsum.h"
+
+//
+//  CPUID function 1, ECX bit 1.
+//
+#define CPUID_PCLMULQDQ     0x00000002
+
+//
+//  Fold constants: x^(4*128+32) and x^(4*128-32) mod P for the 64 byte
+//  fold, x^(128+32) and x^(128-32) mod P for the 16 byte fold, x^64 mod P
+//  to get from 96 to 64 bits, and P and floor(x^64 / P) for the Barrett
+//  reduction. All are bit reflected.
+//
+__declspec(align(16)) static const ULONGLONG CrcFold4[2]   = { 0x0154442bd4, 0x01c6e41596 };
+__declspec(align(16)) static const ULONGLONG CrcFold1[2]   = { 0x01751997d0, 0x00ccaa009e };
+__declspec(align(16)) static const ULONGLONG CrcFold64[2]  = { 0x0163cd6124, 0x0000000000 };
+__declspec(align(16)) static const ULONGLONG CrcBarrett[2] = { 0x01db710641, 0x01f7011641 };
+
+
+BOOLEAN
+CrcIsClmulPresent(
+    VOID
+    )
+{
+    int CpuInfo[4];
+
+    //
+    //  SSE2 is needed as well; it is part of every processor with
+    //  PCLMULQDQ, but make sure the OS has the XMM registers enabled.
+    //
+    if (!ExIsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE)) {
+        return FALSE;
+    }
+
+    __cpuid(CpuInfo, 1);
+
+    return (CpuInfo[2] & CPUID_PCLMULQDQ) ? TRUE : FALSE;
+}
+
+
+static
+ULONG32
+CrcFoldClmul(
+    ULONG32 Crc,
+    PUCHAR Buffer,
+    ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Fold Length bytes into the CRC register. Length must be at least 64
+    and a multiple of 16.
+
+--*/
+{
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    __m128i Mask;
+
+    x1 = _mm_loadu_si128((__m128i *)(Buffer + 0x00));
+    x2 = _mm_loadu_si128((__m128i *)(Buffer + 0x10));
+    x3 = _mm_loadu_si128((__m128i *)(Buffer + 0x20));
+    x4 = _mm_loadu_si128((__m128i *)(Buffer + 0x30));
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(Crc));
+
+    x0 = _mm_load_si128((__m128i *)CrcFold4);
+
+    Buffer += 64;
+    Length -= 64;
+
+    //
+    //  Fold 64 bytes at a time into the four accumulators.
+    //
+    while (Length >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((__m128i *)(Buffer + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                           _mm_loadu_si128((__m128i *)(Buffer + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                           _mm_loadu_si128((__m128i *)(Buffer + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                           _mm_loadu_si128((__m128i *)(Buffer + 0x30)));
+
+        Buffer += 64;
+        Length -= 64;
+    }
+
+    //
+    //  Fold the accumulators into one.
+    //
+    x0 = _mm_load_si128((__m128i *)CrcFold1);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    //
+    //  Fold in any remaining 16 byte blocks.
+    //
+    while (Length >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((__m128i *)Buffer)), x5);
+
+        Buffer += 16;
+        Length -= 16;
+    }
+
+    //
+    //  Reduce 128 bits to 64.
+    //
+    Mask = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    x0 = _mm_loadl_epi64((__m128i *)CrcFold64);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, Mask);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    //
+    //  Barrett reduction to 32 bits.
+    //
+    x0 = _mm_load_si128((__m128i *)CrcBarrett);
+
+    x2 = _mm_and_si128(x1, Mask);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, Mask);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (ULONG32)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+
+
+ULONG32
+CrcUpdateClmul(
+    ULONG32 Crc,
+    PUCHAR Buffer,
+    ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Update the CRC register using carry-less multiplies for the bulk of
+    the buffer and the slicing tables for what is left over.
+
+    On x86 the kernel does not preserve the XMM registers for us, so they
+    are saved around the fold. That costs a few hundred cycles, which a
+    512 byte sector still more than pays for.
+
+Arguments:
+
+    Crc - The CRC register.
+
+    Buffer - The buffer to CRC.
+
+    Length - The length of the buffer in bytes.
+
+Return Value:
+
+    The updated CRC register.
+
+--*/
+{
+    ULONG FoldLength;
+#if defined(_X86_)
+    KFLOATING_SAVE FloatSave;
+#endif
+
+    if (Length < 64) {
+        return CrcUpdateSlice8(Crc, Buffer, Length);
+    }
+
+    FoldLength = Length & ~15;
+
+#if defined(_X86_)
+    if (!NT_SUCCESS(KeSaveFloatingPointState(&FloatSave))) {
+        return CrcUpdateSlice8(Crc, Buffer, Length);
+    }
+#endif
+
+    Crc = CrcFoldClmul(Crc, Buffer, FoldLength);
+
+#if defined(_X86_)
+    KeRestoreFloatingPointState(&FloatSave);
+#endif
+
+    return CrcUpdateSlice8(Crc, Buffer + FoldLength, Length - FoldLength);
+}
@@ -207,55 +207,54 @@ VOID ShowBlockInfo(ULONG64 DevExtAddr, ULONG64 BlockNum, ULONG Depth)
             ULONG arrayIndex = (ULONG)BlockNum % CRC_MDL_LOGIC_BLOCK_SIZE;
             ULONG maxItems = (ULONG)GetULONGField(crcArrayAddr, "crcdisk!_CRC_MDL_ARRAY", "ulMaxItems");
             
-            if (regionIndex <= maxItems){
-                ULONG64 crcItemsArrayAddr = GetULONGField(crcArrayAddr, "crcdisk!_CRC_MDL_ARRAY", "pMdlItems");
-
-                if (crcItemsArrayAddr != BAD_VALUE){
-                    ULONG crcItemSize = GetTypeSize("crcdisk!_CRC_MDL_ITEM");
-                    ULONG64 crcItemAddr = crcItemsArrayAddr+(regionIndex*crcItemSize);
-                    BOOLEAN checkSumsArraysAllocated = GetUCHARField(crcItemAddr, "crcdisk!_CRC_MDL_ITEM", "checkSumsArraysAllocated");
-                    BOOLEAN checkSumsArraysLocked = GetUCHARField(crcItemAddr, "crcdisk!_CRC_MDL_ITEM", "checkSumsArraysLocked");
-                    
-                    if (checkSumsArraysAllocated){
-                        ULONG64 checkSumsArrayAddr = GetULONGField(crcItemAddr, "crcdisk!_CRC_MDL_ITEM", "checkSumsArray");
-                        ULONG64 checkSumsArrayCopyAddr = GetULONGField(crcItemAddr, "crcdisk!_CRC_MDL_ITEM", "checkSumsArrayCopy");
-
-                        if ((checkSumsArrayAddr != BAD_VALUE) && (checkSumsArrayCopyAddr != BAD_VALUE)){
-                            ULONG64 checkSumAddr = checkSumsArrayAddr+arrayIndex*sizeof(USHORT);
-                            ULONG64 checkSumCopyAddr = checkSumsArrayCopyAddr+arrayIndex*sizeof(USHORT);
-                            USHORT checkSum;
-                            USHORT checkSumCopy;
-
-                            if (GetUSHORT(checkSumAddr, &checkSum) && GetUSHORT(checkSumCopyAddr, &checkSumCopy)){
-
-                                if (checkSum == checkSumCopy){
+            if (regionIndex < maxItems){
+                ULONG64 crcChunksArrayAddr = GetULONGField(crcArrayAddr, "crcdisk!_CRC_MDL_ARRAY", "pMdlChunks");
+                ULONG64 crcChunkAddr;
+
+                if ((crcChunksArrayAddr != BAD_VALUE) && 
+                    ReadPointer(crcChunksArrayAddr+(regionIndex >> CRC_REGIONS_PER_CHUNK_SHIFT)*(IsPtr64() ? 8 : 4), &crcChunkAddr)){
+
+                    if (crcChunkAddr){
+                        ULONG crcItemSize = GetTypeSize("crcdisk!_CRC_MDL_ITEM");
+                        ULONG64 crcItemAddr = crcChunkAddr+((regionIndex & (CRC_REGIONS_PER_CHUNK-1))*crcItemSize);
+                        ULONG tier = (ULONG)GetULONGField(crcItemAddr, "crcdisk!_CRC_MDL_ITEM", "tier");
+
+                        if (tier == CRC_REGION_HOT){
+                            ULONG64 checkSumsArrayAddr = GetULONGField(crcItemAddr, "crcdisk!_CRC_MDL_ITEM", "checkSumsArray");
+
+                            if (checkSumsArrayAddr != BAD_VALUE){
+                                ULONG64 checkSumAddr = checkSumsArrayAddr+arrayIndex*sizeof(USHORT);
+                                USHORT checkSum;
+
+                                if (GetUSHORT(checkSumAddr, &checkSum)){
                                     if (checkSum == 0){
                                         xdprintf(Depth+2, ""), dprintf("no recorded checksum for block %lxh \n", BlockNum);
                                     }
                                     else {
-                                        xdprintf(Depth+2, ""), dprintf("recorded checksum for block %xh = %xh (@%08p,@%08p) \n", (ULONG)BlockNum, (ULONG)checkSum, checkSumAddr, checkSumCopyAddr);
+                                        xdprintf(Depth+2, ""), dprintf("recorded checksum for block %xh = %xh (@%08p) \n", (ULONG)BlockNum, (ULONG)checkSum, checkSumAddr);
                                     }                                        
-                                }
-                                else {
-                                    xdprintf(Depth+2, ""), dprintf("INTERNAL ERROR: checksum copies don't match (%xh != %xh) !!! (@%08p,@%08p) \n", (ULONG)checkSum, (ULONG)checkSumCopy, checkSumAddr, checkSumCopyAddr);
-                                }
-                            }           
-                            else {
-                                if (checkSumsArraysLocked){
-                                    xdprintf(Depth+2, ""), dprintf("INTERNAL ERROR: couldn't read checksums even though arrays are locked (@%08p,@%08p) \n", checkSumAddr, checkSumCopyAddr);
-                                }
+                                }           
                                 else {
-                                    xdprintf(Depth+2, ""), dprintf("checksums are currently paged out (@%08p,@%08p) \n", checkSumAddr, checkSumCopyAddr);
+                                    xdprintf(Depth+2, ""), dprintf("INTERNAL ERROR: couldn't read checksum even though array is nonpaged (@%08p) \n", checkSumAddr);
                                 }
-                            }
-                        }         
+                            }         
+                        }
+                        else if (tier == CRC_REGION_COLD){
+                            ULONG64 packedAddr = GetULONGField(crcItemAddr, "crcdisk!_CRC_MDL_ITEM", "packedCheckSums");
+                            
+                            xdprintf(Depth+2, ""), dprintf("checksums for block %08xh are packed (@%08p) \n", BlockNum, packedAddr);
+                            xdprintf(Depth+2, ""), dprintf("' dt crcdisk!_CRC_PACKED_REGION %08p '\n", packedAddr);
+                        }
+                        else {
+                            xdprintf(Depth+2, ""), dprintf("no recorded checksum for block %lxh \n", BlockNum);
+                        }
+
+                        dprintf("\n");
+                        xdprintf(Depth+2, ""), dprintf("' dt crcdisk!_CRC_MDL_ITEM %08p '\n", crcItemAddr);
                     }
                     else {
-                        xdprintf(Depth+2, ""), dprintf("checksums array not allocated for block %08xh\n", BlockNum);
+                        xdprintf(Depth+2, ""), dprintf("no recorded checksum for block %lxh \n", BlockNum);
                     }
-
-                    dprintf("\n");
-                    xdprintf(Depth+2, ""), dprintf("' dt crcdisk!_CRC_MDL_ITEM %08p '\n", crcItemAddr);
                 }
             }
             else {
@@ -0,0 +1,81 @@
+/*++
+Copyright (c) 2001-2002  Microsoft Corporation
+
+Module Name:
+
+    CrcSum.h
+
+Abstract:
+
+    CRC32 kernels used to checksum sectors.
+
+    All the kernels compute the same CRC32 (the ISO 3309 polynomial used
+    by RtlComputeCrc32) on the running CRC register, without pre- or
+    post-conditioning; ComputeCheckSum and ComputeCheckSum16 do that. The
+    fastest kernel the processor supports is chosen once, at driver
+    initialization, by CrcInitializeCheckSum.
+
+Environment:
+
+    kernel mode only
+
+Notes:
+
+--*/
+
+typedef
+ULONG32
+(*PCRC_UPDATE_ROUTINE)(
+    ULONG32 Crc,
+    PUCHAR Buffer,
+    ULONG Length
+    );
+
+//
+//  Byte at a time, using RtlCrc32Table.
+//
+ULONG32
+CrcUpdateTable(
+    ULONG32 Crc,
+    PUCHAR Buffer,
+    ULONG Length
+    );
+
+//
+//  Eight bytes at a time, using eight 256 entry tables.
+//
+ULONG32
+CrcUpdateSlice8(
+    ULONG32 Crc,
+    PUCHAR Buffer,
+    ULONG Length
+    );
+
+#if defined(_X86_) || defined(_AMD64_)
+
+//
+//  Carry-less multiply (PCLMULQDQ) folding, 64 bytes at a time.
+//  Only usable when CrcIsClmulPresent returns TRUE.
+//
+ULONG32
+CrcUpdateClmul(
+    ULONG32 Crc,
+    PUCHAR Buffer,
+    ULONG Length
+    );
+
+BOOLEAN
+CrcIsClmulPresent(
+    VOID
+    );
+
+#endif
+
+VOID
+CrcInitializeCheckSum(
+    VOID
+    );
+
+extern PCRC_UPDATE_ROUTINE CrcUpdateRoutine;
+extern PCSTR CrcUpdateRoutineName;
+extern ULONG32 RtlCrc32Table[];
@@ -21,36 +21,75 @@ Notes:
 #define DATA_VER_TAG            'REVD'  //Data VERify
 
 
+/*
+ *  The tiers a region of sector checksums can be in.
+ */
+typedef enum _CRC_REGION_TIER {
+    CRC_REGION_UNKNOWN = 0,     // no checksums recorded; costs nothing
+    CRC_REGION_HOT,             // full checksum array in nonpaged pool
+    CRC_REGION_COLD             // checksums packed into paged pool
+} CRC_REGION_TIER;
+
+/*
+ *  A cold region's checksums.  Only the nonzero checksums are kept if
+ *  that is smaller, along with a bitmap of the sectors they belong to.
+ *  The pool may get paged out to the disk which we are verifying,
+ *  so the packed checksums are sealed with a CRC.
+ */
+typedef struct _CRC_PACKED_REGION
+{
+    ULONG                       seal;               // CRC of everything after this field
+    ULONG                       numCheckSums;       // number of nonzero checksums
+    BOOLEAN                     isSparse;           // if true, a sector bitmap precedes the checksums
+    
+} CRC_PACKED_REGION, *PCRC_PACKED_REGION;
+
 typedef struct _CRC_MDL_ITEM
 {
-    BOOLEAN                 checkSumsArraysAllocated;
-    BOOLEAN                 checkSumsArraysLocked;   // if true, checkSums arrays are pagelocked
+    CRC_REGION_TIER             tier;
     
     ULONGLONG             latestAccessTimestamp;                      // records how recently this region was accessed
-    LIST_ENTRY              LockedLRUListEntry;
+    LIST_ENTRY              LRUListEntry;           // on the hot or the cold LRU list, according to the tier
     
     /*
-     *  PAGEABLE arrays of sector checksums.
-     *  These are pageable in order to keep from consuming all nonpaged pool.
-     *  Since the arrays may get paged out to the disk which we are verifying,
-     *  we keep 2 copies of the pageable checksum arrays.
+     *  HOT:  the checksum of each sector in the region.
+     *  These are nonpaged, so there is no need to keep a copy in case they are corrupted while paged out.
      */
     PUSHORT                     checkSumsArray;
-    PUSHORT                     checkSumsArrayCopy;
-    PMDL                           checkSumsArrayMdl;
-    PMDL                           checkSumsArrayCopyMdl;
+
+    /*
+     *  COLD:  the packed checksums, in paged pool.
+     */
+    PCRC_PACKED_REGION          packedCheckSums;
+    ULONG                       packedLength;
     
 } CRC_MDL_ITEM, *PCRC_MDL_ITEM;
 
+/*
+ *  The regions are kept in chunks, which are allocated the first time one of their regions is used.
+ *  A chunk is never freed while the device is running, so a region can be looked up without a lock.
+ */
+#define CRC_REGIONS_PER_CHUNK_SHIFT     6
+#define CRC_REGIONS_PER_CHUNK           (1 << CRC_REGIONS_PER_CHUNK_SHIFT)
+
 typedef struct _CRC_MDL_ARRAY
 {
     BOOLEAN                   mdlItemsAllocated;
-    PCRC_MDL_ITEM        pMdlItems;      
+    PCRC_MDL_ITEM       *pMdlChunks;
     ULONG                       ulMaxItems;
-    ULONG                       ulTotalLocked;
+    ULONG                       ulMaxChunks;
+    ULONG                       ulTotalLocked;      // number of HOT regions
+    ULONG                       ulMaxLocked;
     
     ULONGLONG               currentAccessCount;
-    LIST_ENTRY              LockedLRUList;  // list of locked CRC_MDL_ITEM's in least-to-most-recently-used order
+    LIST_ENTRY              LockedLRUList;  // list of HOT CRC_MDL_ITEM's in least-to-most-recently-used order
+    LIST_ENTRY              ColdLRUList;    // list of COLD CRC_MDL_ITEM's in least-to-most-recently-cooled order
+
+    /*
+     *  Bytes of checksum arrays and packed checksums, and the most we may use.
+     */
+    ULONG                       ulBytesInUse;
+    ULONG                       ulMemoryBudget;
     
 } CRC_MDL_ARRAY, *PCRC_MDL_ARRAY;
 
@@ -118,6 +157,14 @@ typedef struct _DEVICE_EXTENSION
 
     BOOLEAN                 NeedCriticalRecovery;
     ULONG                    CheckInProgress;
+
+    /*
+     *  Reads whose verification was deferred to the verify workers, in CRC_COMPLETION_CONTEXT's.
+     *  Protected by SpinLock.  DeferredReadsIdleEvent is signalled when there are none.
+     */
+    LIST_ENTRY              DeferredReadList;
+    ULONG                   DeferredReadsOutstanding;
+    KEVENT                  DeferredReadsIdleEvent;
     
     KEVENT                      SyncEvent;          // used as a passive-level spinlock (e.g. for syncing access to pageable memory)
     KSPIN_LOCK              SpinLock;
@@ -143,6 +190,16 @@ typedef struct _DEVICE_EXTENSION
     ULONG DbgNumCriticalRecoveries;
     LARGE_INTEGER DbgLastRecoveryTime;
     ULONG DbgNumHibernations;
+    ULONG DbgNumRegionsCooled;
+    ULONG DbgNumRegionsWarmed;
+    ULONG DbgNumRegionsDropped;
+    ULONG DbgNumDeferredReads;
+    ULONG DbgNumDeferredReadsVerified;
+    ULONG DbgNumDeferredReadsInline;            // verified inline because too many were outstanding
+    ULONG DbgMaxDeferredReadsOutstanding;
+    ULONG DbgNumDeferredSectorsSkipped;         // not verified because they were written or reallocated since the read
+    ULONGLONG DbgDeferredReadLagTotal;          // 100ns units from read completion to verification
+    ULONGLONG DbgDeferredReadLagMax;
     
     /*
      *  Log recent sector data so we have it in case a corruption above us is caught right away.
@@ -166,10 +223,17 @@ typedef struct _SCSI_READ_CAPACITY_PACKET
 NTSTATUS InitiateCRCTable(PDEVICE_EXTENSION DeviceExtension);
 NTSTATUS AllocAndMapPages(PDEVICE_EXTENSION DeviceExtension, ULONG LogicalBlockAddr, ULONG NumSectors);
 VOID FreeAllPages(PDEVICE_EXTENSION DeviceExtension);
-BOOLEAN LockCheckSumArrays(PDEVICE_EXTENSION DeviceExtension, ULONG RegionIndex);
-VOID UnlockLRUChecksumArray(PDEVICE_EXTENSION DeviceExtension);
+VOID FreeRegionChunks(PDEVICE_EXTENSION DeviceExtension);
+PCRC_MDL_ITEM LookupRegion(PDEVICE_EXTENSION DeviceExtension, ULONG RegionIndex);
+PCRC_MDL_ITEM GetRegion(PDEVICE_EXTENSION DeviceExtension, ULONG RegionIndex);
+BOOLEAN WarmRegion(PDEVICE_EXTENSION DeviceExtension, ULONG RegionIndex, PCRC_MDL_ITEM pCRCMdlItem);
+VOID PackRegion(PDEVICE_EXTENSION DeviceExtension, PCRC_MDL_ITEM pCRCMdlItem, PUSHORT CheckSums);
+VOID UnpackRegion(PDEVICE_EXTENSION DeviceExtension, ULONG RegionIndex, PCRC_MDL_ITEM pCRCMdlItem, PUSHORT CheckSums);
+VOID DropColdRegion(PDEVICE_EXTENSION DeviceExtension, PCRC_MDL_ITEM pCRCMdlItem);
+VOID CoolLRUChecksumArray(PDEVICE_EXTENSION DeviceExtension);
 VOID UpdateRegionAccessTimeStamp(PDEVICE_EXTENSION DeviceExtension, ULONG RegionIndex);
 VOID DoCriticalRecovery(PDEVICE_EXTENSION DeviceExtension);
 VOID CompleteXfer(PDEVICE_EXTENSION DeviceExtension, PIRP Irp);
 
+extern ULONG g_ChecksumMemoryBudget;
 
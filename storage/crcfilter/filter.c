@@ -66,6 +66,12 @@ extern PULONG InitSafeBootMode;
  */
 volatile ULONG DbgTrapSector = (ULONG)-1;
 
+/*
+ *  Most pool to use for the checksums of each disk, in bytes.
+ *  Read from the ChecksumMemoryBudgetMB value under the Parameters key in DriverEntry.
+ */
+ULONG g_ChecksumMemoryBudget = DEFAULT_CHECKSUM_MEMORY_BUDGET_MB << 20;
+
 
 NTSTATUS
 DriverEntry(
@@ -97,6 +103,8 @@ Return Value:
 
 {
     if (*InitSafeBootMode == 0){
+        RTL_QUERY_REGISTRY_TABLE queryTable[6];
+        ULONG budgetMB = DEFAULT_CHECKSUM_MEMORY_BUDGET_MB;
         ULONG ulIndex;
 
         #if DBG_WMI_TRACING
@@ -106,6 +114,51 @@ Return Value:
             WPP_INIT_TRACING(DriverObject, RegistryPath);
         #endif
 
+        //
+        // Pick the CRC kernel for this processor.
+        //
+        CrcInitializeCheckSum();
+
+        /*
+         *  Read the checksum memory budget and the verify-after policy.  The defaults are used if they are not set.
+         */
+        RtlZeroMemory(queryTable, sizeof(queryTable));
+        queryTable[0].Flags = RTL_QUERY_REGISTRY_SUBKEY;
+        queryTable[0].Name = L"Parameters";
+        queryTable[1].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        queryTable[1].Name = L"ChecksumMemoryBudgetMB";
+        queryTable[1].EntryContext = &budgetMB;
+        queryTable[1].DefaultType = REG_DWORD;
+        queryTable[1].DefaultData = &budgetMB;
+        queryTable[1].DefaultLength = sizeof(ULONG);
+        queryTable[2].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        queryTable[2].Name = L"VerifyAfterPolicy";
+        queryTable[2].EntryContext = &g_VerifyAfterPolicy;
+        queryTable[2].DefaultType = REG_DWORD;
+        queryTable[2].DefaultData = &g_VerifyAfterPolicy;
+        queryTable[2].DefaultLength = sizeof(ULONG);
+        queryTable[3].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        queryTable[3].Name = L"VerifyAfterMinBytes";
+        queryTable[3].EntryContext = &g_VerifyAfterMinBytes;
+        queryTable[3].DefaultType = REG_DWORD;
+        queryTable[3].DefaultData = &g_VerifyAfterMinBytes;
+        queryTable[3].DefaultLength = sizeof(ULONG);
+        queryTable[4].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        queryTable[4].Name = L"VerifyAfterMaxOutstanding";
+        queryTable[4].EntryContext = &g_VerifyAfterMaxOutstanding;
+        queryTable[4].DefaultType = REG_DWORD;
+        queryTable[4].DefaultData = &g_VerifyAfterMaxOutstanding;
+        queryTable[4].DefaultLength = sizeof(ULONG);
+        RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE | RTL_REGISTRY_OPTIONAL, RegistryPath->Buffer, queryTable, NULL, NULL);
+
+        budgetMB = max(budgetMB, 1);
+        budgetMB = min(budgetMB, MAX_CHECKSUM_MEMORY_BUDGET_MB);
+        g_ChecksumMemoryBudget = budgetMB << 20;
+
+        if ((g_VerifyAfterPolicy == CRC_VERIFY_AFTER_LARGE_READS) || (g_VerifyAfterPolicy == CRC_VERIFY_AFTER_ALL_READS)){
+            StartVerifyPool();
+        }
+
         for (ulIndex = 0; ulIndex <= IRP_MJ_MAXIMUM_FUNCTION; ulIndex++){
             DriverObject->MajorFunction[ ulIndex ] = DataVerFilter_DispatchAny;
         }
@@ -142,8 +195,9 @@ InitiateCRCTable (
 Routine Description:
 
     Initiate the CRC Array. This will be used to store CRC's on a per
-    sector basis. It's a simple array of pointers, each of which points
-    to a memory block of fixed size.
+    sector basis. It's a directory of pointers to chunks of regions,
+    each of which holds the checksums of a fixed number of sectors.
+    The chunks are allocated as the regions are used.
 
     Assumes SyncEvent is HELD.
     
@@ -165,21 +219,25 @@ Return Value:
     ASSERT(DeviceExtension->ulNumSectors);
     ASSERT(DeviceExtension->ulSectorSize);
 
-    if (!DeviceExtension->CRCMdlLists.pMdlItems){
+    if (!DeviceExtension->CRCMdlLists.pMdlChunks){
         DeviceExtension->CRCMdlLists.ulMaxItems = DeviceExtension->ulNumSectors / CRC_MDL_LOGIC_BLOCK_SIZE + 1;
+        DeviceExtension->CRCMdlLists.ulMaxChunks = (DeviceExtension->CRCMdlLists.ulMaxItems + CRC_REGIONS_PER_CHUNK - 1) >> CRC_REGIONS_PER_CHUNK_SHIFT;
 
-        DeviceExtension->CRCMdlLists.pMdlItems = AllocPool( 
+        DeviceExtension->CRCMdlLists.pMdlChunks = AllocPool( 
                                                 DeviceExtension,
                                                 NonPagedPool,
-                                                DeviceExtension->CRCMdlLists.ulMaxItems*sizeof(CRC_MDL_ITEM),
+                                                DeviceExtension->CRCMdlLists.ulMaxChunks*sizeof(PCRC_MDL_ITEM),
                                                 TRUE);
-        if (DeviceExtension->CRCMdlLists.pMdlItems){
-            ULONG i;
+        if (DeviceExtension->CRCMdlLists.pMdlChunks){
+            /*
+             *  Keep half of the budget for packed checksums.
+             */
+            DeviceExtension->CRCMdlLists.ulMemoryBudget = g_ChecksumMemoryBudget;
+            DeviceExtension->CRCMdlLists.ulMaxLocked = min(MAX_LOCKED_CHECKSUM_ARRAYS, g_ChecksumMemoryBudget/2/CHECKSUM_ARRAY_BYTES);
+            DeviceExtension->CRCMdlLists.ulMaxLocked = max(DeviceExtension->CRCMdlLists.ulMaxLocked, 1);
 
             InitializeListHead(&DeviceExtension->CRCMdlLists.LockedLRUList);
-            for (i = 0; i < DeviceExtension->CRCMdlLists.ulMaxItems; i++){
-                InitializeListHead(&DeviceExtension->CRCMdlLists.pMdlItems[i].LockedLRUListEntry);
-            }
+            InitializeListHead(&DeviceExtension->CRCMdlLists.ColdLRUList);
         }
         else {
             status = STATUS_INSUFFICIENT_RESOURCES;
@@ -245,6 +303,9 @@ Return Value:
     InitializeListHead(&deviceExtension->DeferredCheckSumList);
     InitializeListHead(&deviceExtension->AllContextsListEntry);
     InitializeListHead(&deviceExtension->CRCMdlLists.LockedLRUList);
+    InitializeListHead(&deviceExtension->CRCMdlLists.ColdLRUList);
+    InitializeListHead(&deviceExtension->DeferredReadList);
+    KeInitializeEvent(&deviceExtension->DeferredReadsIdleEvent, NotificationEvent, TRUE);
 
     deviceExtension->DeviceObject = filterDeviceObject;
 
@@ -460,8 +521,14 @@ Return Value:
 
     IoDetachDevice(deviceExtension->LowerDeviceObject);
 
+    /*
+     *  Wait for the verify workers to finish with the reads they still have from this disk.
+     */
+    KeWaitForSingleObject(&deviceExtension->DeferredReadsIdleEvent, Executive, KernelMode, FALSE, NULL);
+    ASSERT(IsListEmpty(&deviceExtension->DeferredReadList));
+
     FreeAllPages(deviceExtension);    
-    if (deviceExtension->CRCMdlLists.pMdlItems) FreePool(deviceExtension, deviceExtension->CRCMdlLists.pMdlItems, NonPagedPool);
+    FreeRegionChunks(deviceExtension);
     if (deviceExtension->StorageDeviceDesc) FreePool(deviceExtension, deviceExtension->StorageDeviceDesc, NonPagedPool);
     IoFreeWorkItem(deviceExtension->ReadCapacityWorkItem);
     IoFreeWorkItem(deviceExtension->CheckSumWorkItem);
@@ -785,10 +852,12 @@ VOID CompleteXfer(PDEVICE_EXTENSION DeviceExtension, PIRP Irp)
         }
         else {
             ULONG ulCRCIndex = ulLogicalBlockAddr / CRC_MDL_LOGIC_BLOCK_SIZE;
+            BOOLEAN deferVerify = FALSE;
 
             ASSERT(PCrcContext);
          
             if (PCrcContext->AllocMapped){
+                PUCHAR tempDataBuf = pSRB->DataBuffer;
             
                 if (srbStat == SRB_STATUS_SUCCESS){
 
@@ -798,7 +867,14 @@ VOID CompleteXfer(PDEVICE_EXTENSION DeviceExtension, PIRP Irp)
                         pDataBuf = pDataBuf + ( (PUCHAR)(pSRB->DataBuffer)
                                    - (PUCHAR)(MmGetMdlVirtualAddress(Irp->MdlAddress)) );
 
-                        bCRCOk = VerifyCheckSum(DeviceExtension, Irp, ulLogicalBlockAddr, ulLength, pDataBuf, FALSE);
+                        /*
+                         *  Under a verify-after policy, complete the read now
+                         *  and let a verify worker checksum the double-buffer.
+                         */
+                        deferVerify = ReserveDeferredRead(DeviceExtension, ulLength);
+                        if (!deferVerify){
+                            bCRCOk = VerifyCheckSum(DeviceExtension, Irp, ulLogicalBlockAddr, ulLength, pDataBuf, FALSE);
+                        }
                     }
                     else {
                         DBGERR(("Temporary MDL Assignment Failed"));
@@ -811,14 +887,26 @@ VOID CompleteXfer(PDEVICE_EXTENSION DeviceExtension, PIRP Irp)
                 ASSERT(pSRB->DataBuffer == PCrcContext->DbgDataBufPtrCopy);                   
                 RtlCopyBytes(PCrcContext->VirtualDataBuff, pSRB->DataBuffer, ulLength);
                 IoFreeMdl(Irp->MdlAddress);    
-                FreePool(DeviceExtension, pSRB->DataBuffer, NonPagedPool);
+                if (!deferVerify){
+                    FreePool(DeviceExtension, pSRB->DataBuffer, NonPagedPool);
+                }
                 Irp->MdlAddress  = PCrcContext->OriginalMdl;
                 pSRB->DataBuffer = PCrcContext->OriginalDataBuff;
+
+                /*
+                 *  The verify worker frees the double-buffer and the context.
+                 */
+                if (deferVerify){
+                    QueueDeferredRead(DeviceExtension, PCrcContext, ulLogicalBlockAddr, ulBlocks, tempDataBuf);
+                    PCrcContext = NULL;
+                }
             }  
             
         }
 
-        FreePool(DeviceExtension, PCrcContext, NonPagedPool); 
+        if (PCrcContext){
+            FreePool(DeviceExtension, PCrcContext, NonPagedPool); 
+        }
     }
     else {
         ASSERT(DeviceExtension->CRCMdlLists.mdlItemsAllocated);
@@ -1198,10 +1286,14 @@ VOID ReadCapacityWorkItemCallback(PDEVICE_OBJECT DevObj, PVOID Context)
 
         if (needToFree){
             FreeAllPages(deviceExtension);  
-            FreePool(deviceExtension, deviceExtension->CRCMdlLists.pMdlItems, NonPagedPool);
-            deviceExtension->CRCMdlLists.pMdlItems = NULL;
+            FreeRegionChunks(deviceExtension);
         }       
 
+        /*
+         *  The media may have changed, so don't record the checksums of reads that are waiting to be verified.
+         */
+        MarkDeferredReadsStale(deviceExtension, 0, (ULONG)-1);
+
         if (ulSectorSize == 0){
             ulSectorSize = 512;
         }
@@ -1338,6 +1430,8 @@ DataVerFilter_Unload(
     
     PAGED_CODE();
 
+    StopVerifyPool();
+
     #if DBG_WMI_TRACING
         //
         // WPP_CLEANUP can only occur after all KdPrintEx routines
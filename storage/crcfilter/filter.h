@@ -38,6 +38,20 @@ typedef struct _CRC_COMPLETION_CONTEXT {
     BOOLEAN                 AllocMapped;
     
     PUCHAR                  DbgDataBufPtrCopy;
+
+    /*
+     *  Used when the verification of a read is deferred to the verify workers (see Verify.c).
+     *  The context then stays around with the double-buffer until the read is verified.
+     */
+    LIST_ENTRY              VerifyListEntry;        // in the queue of a verify worker
+    LIST_ENTRY              DiskVerifyListEntry;    // in the DeferredReadList of the disk
+    struct _DEVICE_EXTENSION *VerifyDeviceExtension;
+    PUCHAR                  VerifyDataBuff;
+    ULONG                   VerifyLogicalBlockAddr;
+    ULONG                   VerifyNumSectors;
+    ULONG                   VerifySectorSize;
+    BOOLEAN                 VerifyStale;            // the sectors were written since the read; protected by the disk's SpinLock
+    ULONGLONG               VerifyQueueTime;
 } CRC_COMPLETION_CONTEXT, *PCRC_COMPLETION_CONTEXT;
 
 
@@ -7,7 +7,18 @@ Module Name:
 
 Abstract:
 
-    Utilities to allocate Physical memory and Mapping/Unmapping the MDLs.
+    Utilities to allocate, pack and free the checksum arrays of the regions.
+
+    A region's checksums are in one of three tiers:
+
+        HOT     - a full checksum array in nonpaged pool, in LockedLRUList.
+        COLD    - the checksums packed into sealed paged pool, in ColdLRUList.
+        UNKNOWN - nothing; no checksums are recorded for the region.
+
+    Regions are made hot when they are accessed, the least recently used
+    hot region is packed when there are too many, and the least recently
+    packed cold region is dropped when the disk is over its memory budget.
+    Dropping checksums only loses coverage; it can never cause a false mismatch.
 
 Environment:
 
@@ -34,17 +45,76 @@ Notes:
 
 
 
+/*
+ *  LookupRegion
+ *
+ *      Returns the region, or NULL if the chunk holding it has not been allocated (i.e. the region is UNKNOWN).
+ *
+ *      Takes no lock, so it may be called at any irql.
+ *      The chunks are only freed by FreeRegionChunks, once the checksums are no longer in use.
+ */
+PCRC_MDL_ITEM LookupRegion(PDEVICE_EXTENSION DeviceExtension, ULONG RegionIndex)
+{
+    PCRC_MDL_ITEM chunk;
+
+    ASSERT(RegionIndex < DeviceExtension->CRCMdlLists.ulMaxItems);
+
+    chunk = DeviceExtension->CRCMdlLists.pMdlChunks[RegionIndex >> CRC_REGIONS_PER_CHUNK_SHIFT];
+    
+    return chunk ? &chunk[RegionIndex & (CRC_REGIONS_PER_CHUNK-1)] : NULL;
+}
+
+
+/*
+ *  GetRegion
+ *
+ *      Returns the region, allocating the chunk that holds it if needed.
+ *
+ *      Must be called at PASSIVE irql with SyncEvent HELD but SPINLOCK NOT HELD.
+ */
+PCRC_MDL_ITEM GetRegion(PDEVICE_EXTENSION DeviceExtension, ULONG RegionIndex)
+{
+    PCRC_MDL_ITEM pCRCMdlItem = LookupRegion(DeviceExtension, RegionIndex);
+
+    ASSERT(KeGetCurrentIrql() < DISPATCH_LEVEL);
+
+    if (!pCRCMdlItem){
+        PCRC_MDL_ITEM chunk = AllocPool(DeviceExtension, NonPagedPool, CRC_REGIONS_PER_CHUNK*sizeof(CRC_MDL_ITEM), TRUE);
+        if (chunk){
+            ULONG i;
+
+            /*
+             *  AllocPool zeroes the chunk, so all its regions are UNKNOWN.
+             */
+            for (i = 0; i < CRC_REGIONS_PER_CHUNK; i++){
+                InitializeListHead(&chunk[i].LRUListEntry);
+            }
+
+            /*
+             *  Chunks are only allocated with SyncEvent held, so no one else can have beaten us to it.
+             *  Publish the initialized chunk with a barrier for the lookups that take no lock.
+             */
+            ASSERT(!DeviceExtension->CRCMdlLists.pMdlChunks[RegionIndex >> CRC_REGIONS_PER_CHUNK_SHIFT]);
+            InterlockedExchangePointer(&DeviceExtension->CRCMdlLists.pMdlChunks[RegionIndex >> CRC_REGIONS_PER_CHUNK_SHIFT], chunk);
+
+            pCRCMdlItem = &chunk[RegionIndex & (CRC_REGIONS_PER_CHUNK-1)];
+        }
+    }
+
+    return pCRCMdlItem;
+}
+
+
 NTSTATUS AllocAndMapPages(PDEVICE_EXTENSION DeviceExtension, ULONG LogicalBlockAddr, ULONG NumSectors)
 
 /*++
 
 Routine Description:
 
-    CRC_MDL_ARRAY is an array of pointers. Each of these pointers points to a memory location
-    of fixed size ( CRC_MDL_LOGIC_BLOCK_SIZE * sizeof(USHORT) ), which is used to store the
-    CRC's of that particular sector. In essence, this is a 2 dimensional array of CRC's
-    indexed by the sector number. Based on the logical block address, find out the CRC MDL block. 
-    If it hasn't been allocated, memory will be allocated.
+    The sector checksums are kept in regions of CRC_MDL_LOGIC_BLOCK_SIZE sectors.
+    Based on the logical block address, find the regions holding the checksums of the sectors,
+    and make them HOT so that the checksums can be checked and stored at raised irql.
+    A COLD region is unpacked, and an UNKNOWN region gets an empty checksum array.
 
     Must be called with SyncEvent HELD
     Must be called only when PAGING is allowed
@@ -67,104 +137,22 @@ Return Value:
         ULONG EndIndex = (LogicalBlockAddr + NumSectors - 1) / CRC_MDL_LOGIC_BLOCK_SIZE;
         ULONG i;
 
-        ASSERT (EndIndex <= DeviceExtension->CRCMdlLists.ulMaxItems);
+        ASSERT (EndIndex < DeviceExtension->CRCMdlLists.ulMaxItems);
         
         for (i = StartIndex; i <= EndIndex; i++){
-            PCRC_MDL_ITEM pCRCMdlItem = &DeviceExtension->CRCMdlLists.pMdlItems[i];
-            const ULONG checkSumsArrayLen = CRC_MDL_LOGIC_BLOCK_SIZE*sizeof(USHORT);
+            PCRC_MDL_ITEM pCRCMdlItem = GetRegion(DeviceExtension, i);
 
-            if (pCRCMdlItem->checkSumsArraysAllocated){
-                /*
-                 *  The checksum array pair for the region is already allocated.
-                 *  Lock it down.
-                 */
-                if (!pCRCMdlItem->checkSumsArraysLocked){
-                    if (!LockCheckSumArrays(DeviceExtension, i)){
-                        status = STATUS_INSUFFICIENT_RESOURCES;
-                        break;
-                    }
-                }
+            if (!pCRCMdlItem){
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                break;
             }
-            else {
-                /*
-                 *  Allocate the checksum arrays from PAGED pool so we don't take up all nonpagee pool.
-                 *  Allocate 2 copies of the checksums since they may be paged out to the disk that we are verifying.
-                 */
-                BOOLEAN buffersAssigned = FALSE;
-                PVOID checkSums = AllocPool(DeviceExtension, PagedPool, checkSumsArrayLen, TRUE);
-                if (checkSums){
-                    PVOID checkSumsCopy = AllocPool(DeviceExtension, PagedPool, checkSumsArrayLen, TRUE);
-                    if (checkSumsCopy){
-                        PMDL checkSumsMdl = IoAllocateMdl(checkSums, checkSumsArrayLen, FALSE, FALSE, NULL);
-                        if (checkSumsMdl){
-                           PMDL checkSumsCopyMdl = IoAllocateMdl(checkSumsCopy, checkSumsArrayLen, FALSE, FALSE, NULL);
-                           if (checkSumsCopyMdl){
-                                KIRQL oldIrql;
-
-                                /*
-                                 *  Now assign the pointers and update the pCRCMdlItem synchronously.
-                                 *  Make sure to not touch or alloc/free any pageable memory with lock held.
-                                 */
-                                KeAcquireSpinLock(&DeviceExtension->SpinLock, &oldIrql);
-                                if (!pCRCMdlItem->checkSumsArraysAllocated){
-                                    ASSERT(!pCRCMdlItem->checkSumsArray);
-                                    ASSERT(!pCRCMdlItem->checkSumsArrayCopy);
-                                    pCRCMdlItem->checkSumsArray = checkSums;
-                                    pCRCMdlItem->checkSumsArrayCopy = checkSumsCopy;
-                                    pCRCMdlItem->checkSumsArrayMdl = checkSumsMdl;
-                                    pCRCMdlItem->checkSumsArrayCopyMdl = checkSumsCopyMdl;
-                                    
-                                    pCRCMdlItem->checkSumsArraysAllocated = TRUE;
-                                    
-                                    buffersAssigned = TRUE;
-                                }
-                                else {
-                                    buffersAssigned = FALSE;
-                                }
-                                KeReleaseSpinLock(&DeviceExtension->SpinLock, oldIrql);
-
-                                if (buffersAssigned){
-                                    if (!LockCheckSumArrays(DeviceExtension, i)){
-                                        status = STATUS_INSUFFICIENT_RESOURCES;
-                                        break;
-                                    }
-                                }
-                                else {
-                                    IoFreeMdl(checkSumsCopyMdl);
-                                }
-                            }
-                            else {
-                                status = STATUS_INSUFFICIENT_RESOURCES;
-                                break;
-                            }
-                            
-                            if (!buffersAssigned){
-                                IoFreeMdl(checkSumsMdl);
-                            }
-                        }
-                        else {
-                            status = STATUS_INSUFFICIENT_RESOURCES;
-                            break;
-                        }
-                        
-                        if (!buffersAssigned){
-                            FreePool(DeviceExtension, checkSumsCopy, PagedPool);
-                        }
-                    }
-                    else {
-                        status = STATUS_INSUFFICIENT_RESOURCES;
-                        break;
-                    }
-
-                    if (!buffersAssigned){
-                        FreePool(DeviceExtension, checkSums, PagedPool);
-                    }
-                }
-                else {
+            
+            if (pCRCMdlItem->tier != CRC_REGION_HOT){
+                if (!WarmRegion(DeviceExtension, i, pCRCMdlItem)){
                     status = STATUS_INSUFFICIENT_RESOURCES;
                     break;
-                }  
-            }                
+                }
+            }
         }
     }
     
@@ -172,228 +160,438 @@ Return Value:
 }
 
 
-VOID FreeAllPages(PDEVICE_EXTENSION DeviceExtension)
-/*++
+/*
+ *  WarmRegion
+ *
+ *      Makes a COLD or UNKNOWN region HOT.
+ *      If there are too many HOT regions, the least recently used one is packed;
+ *      if the disk is over its memory budget, the least recently packed regions are dropped.
+ *
+ *      Must be called at PASSIVE irql with SyncEvent HELD but SPINLOCK NOT HELD.
+ */
+BOOLEAN WarmRegion(PDEVICE_EXTENSION DeviceExtension, ULONG RegionIndex, PCRC_MDL_ITEM pCRCMdlItem)
+{
+    PUSHORT checkSums;
+    BOOLEAN coolSome = FALSE;
+    KIRQL oldIrql;
 
-Routine Description:
+    ASSERT(KeGetCurrentIrql() < DISPATCH_LEVEL);
+    ASSERT(pCRCMdlItem->tier != CRC_REGION_HOT);
 
-   Frees all the memory which is not in use. This is done in reponse to capacity change
-   of the disk.
+    checkSums = AllocPool(DeviceExtension, NonPagedPool, CHECKSUM_ARRAY_BYTES, TRUE);
+    if (!checkSums){
+        return FALSE;
+    }
 
-    At runtime, must be called with SyncEvent HELD
+    /*
+     *  AllocPool may have packed regions to make room, but only HOT ones,
+     *  so this one is still in the tier it was in.
+     */
+    if (pCRCMdlItem->tier == CRC_REGION_COLD){
+        UnpackRegion(DeviceExtension, RegionIndex, pCRCMdlItem, checkSums);
+        DeviceExtension->DbgNumRegionsWarmed++;
+    }
+    
+    KeAcquireSpinLock(&DeviceExtension->SpinLock, &oldIrql);
 
-Arguments:
+    pCRCMdlItem->checkSumsArray = checkSums;
+    pCRCMdlItem->tier = CRC_REGION_HOT;
+    
+    /*
+     *  Update this regions's timestamp.  
+     *  That will make it the 'latest' one and keep it from getting packed below.
+     */
+    ASSERT(IsListEmpty(&pCRCMdlItem->LRUListEntry));
+    UpdateRegionAccessTimeStamp(DeviceExtension, RegionIndex);
+    
+    /*
+     *  Keep track of the number of HOT regions.
+     *  If it goes too high, pack the least-recently-used one.
+     */
+    DeviceExtension->CRCMdlLists.ulTotalLocked++;
+    if (DeviceExtension->CRCMdlLists.ulTotalLocked > DeviceExtension->CRCMdlLists.ulMaxLocked){
+        coolSome = TRUE;
+    }
 
-    deviceExtension - Device extension for the particular disk on which the filter is.
-    Force           - Free all memory, even if it's in use!
-    UseSpinLock     - Indicates if SpinLock needs to be held.
+    KeReleaseSpinLock(&DeviceExtension->SpinLock, oldIrql);
 
-Return Value:
+    DeviceExtension->CRCMdlLists.ulBytesInUse += CHECKSUM_ARRAY_BYTES;
 
-    N/A
+    if (coolSome){
+        CoolLRUChecksumArray(DeviceExtension);
 
---*/
+        /*
+         *  We recently updated the latestAccessTimestamp for the region we just warmed,
+         *  so we should not have packed the region we just warmed.
+         */
+        ASSERT(pCRCMdlItem->tier == CRC_REGION_HOT);
+    }
 
+    /*
+     *  Stay within the memory budget by dropping the checksums that were packed the longest ago.
+     */
+    while ((DeviceExtension->CRCMdlLists.ulBytesInUse > DeviceExtension->CRCMdlLists.ulMemoryBudget) &&
+           !IsListEmpty(&DeviceExtension->CRCMdlLists.ColdLRUList)){
+
+        PLIST_ENTRY listEntry = DeviceExtension->CRCMdlLists.ColdLRUList.Flink;
+
+        DropColdRegion(DeviceExtension, CONTAINING_RECORD(listEntry, CRC_MDL_ITEM, LRUListEntry));
+    }
+
+    return TRUE;
+}
+
+
+/*
+ *   CoolLRUChecksumArray
+ *
+ *      Pack the checksums of the least recently used HOT region, freeing its nonpaged checksum array.
+ *
+ *      Must be called at PASSIVE irql with SyncEvent HELD but SPINLOCK NOT HELD.
+ */
+VOID CoolLRUChecksumArray(PDEVICE_EXTENSION DeviceExtension)
 {
+    PCRC_MDL_ITEM lruMdlItem = NULL;
+    PUSHORT checkSums = NULL;
+    KIRQL oldIrql;
+
     ASSERT(KeGetCurrentIrql() < DISPATCH_LEVEL);
 
-    if (DeviceExtension->CRCMdlLists.pMdlItems){
-        ULONG StartSector = 0;
-        ULONG LastSector = DeviceExtension->ulNumSectors-1;
-        ULONG StartIndex = StartSector / CRC_MDL_LOGIC_BLOCK_SIZE;
-        ULONG EndIndex = LastSector / CRC_MDL_LOGIC_BLOCK_SIZE;
-        ULONG i;   
-        
-        for (i = StartIndex; i <= EndIndex; i++){
-            PCRC_MDL_ITEM pCRCMdlItem = &DeviceExtension->CRCMdlLists.pMdlItems[i];
-            PVOID bufToFree = NULL, bufCopyToFree = NULL;
-            KIRQL oldIrql;
-            
-            /*
-             *  We need the spinlock to synchronize allocation of the checkSum arrays,
-             *  but doing so raises irql to dispatch level, 
-             *  and we cannot free PAGED pool at dispatch level.
-             *  So we move the pointers with spinlock held, and free them after dropping the lock.
-             */
-            KeAcquireSpinLock(&DeviceExtension->SpinLock, &oldIrql);
-            if (pCRCMdlItem->checkSumsArraysAllocated){
+    KeAcquireSpinLock(&DeviceExtension->SpinLock, &oldIrql);
+
+    if (DeviceExtension->CRCMdlLists.mdlItemsAllocated){
+
+        /*
+         *  Take the region at the head of the LRU list; 
+         *  this is the 'oldest' (least recently touched) region.
+         *  Once it is no longer HOT, checks of its sectors at raised irql are deferred to the workItem,
+         *  which waits for the SyncEvent we are holding; so we can pack the array without the spinlock.
+         */
+        if (!IsListEmpty(&DeviceExtension->CRCMdlLists.LockedLRUList)){
+            PLIST_ENTRY listEntry = RemoveHeadList(&DeviceExtension->CRCMdlLists.LockedLRUList);
+            lruMdlItem = CONTAINING_RECORD(listEntry, CRC_MDL_ITEM, LRUListEntry);
+
+            InitializeListHead(&lruMdlItem->LRUListEntry); 
+            ASSERT(lruMdlItem->tier == CRC_REGION_HOT);
             
-                bufToFree = pCRCMdlItem->checkSumsArray;
-                pCRCMdlItem->checkSumsArray = NULL;
-                bufCopyToFree = pCRCMdlItem->checkSumsArrayCopy;
-                pCRCMdlItem->checkSumsArrayCopy = NULL;
+            checkSums = lruMdlItem->checkSumsArray;
+            lruMdlItem->checkSumsArray = NULL;
+            lruMdlItem->tier = CRC_REGION_COLD;
 
-                /*
-                 *  Unlock the checksum arrays before we free them, and remove them from the locked LRU list.
-                 */
-                if (pCRCMdlItem->checkSumsArraysLocked){
-                
-                    MmUnlockPages(pCRCMdlItem->checkSumsArrayMdl);
-                    MmUnlockPages(pCRCMdlItem->checkSumsArrayCopyMdl);
-                    pCRCMdlItem->checkSumsArraysLocked = FALSE;
-
-                    ASSERT(!IsListEmpty(&DeviceExtension->CRCMdlLists.LockedLRUList));
-                    ASSERT(!IsListEmpty(&pCRCMdlItem->LockedLRUListEntry));
-                    RemoveEntryList(&pCRCMdlItem->LockedLRUListEntry); 
-                    InitializeListHead(&pCRCMdlItem->LockedLRUListEntry);
-                    
-                    ASSERT(DeviceExtension->CRCMdlLists.ulTotalLocked > 0);
-                    DeviceExtension->CRCMdlLists.ulTotalLocked--;
-                }
-                
-                IoFreeMdl(pCRCMdlItem->checkSumsArrayMdl);
-                pCRCMdlItem->checkSumsArrayMdl = NULL;
-                IoFreeMdl(pCRCMdlItem->checkSumsArrayCopyMdl);
-                pCRCMdlItem->checkSumsArrayCopyMdl = NULL;
-                
-                pCRCMdlItem->checkSumsArraysAllocated = FALSE;
-            }
-            KeReleaseSpinLock(&DeviceExtension->SpinLock, oldIrql);
+            ASSERT(DeviceExtension->CRCMdlLists.ulTotalLocked > 0);
+            DeviceExtension->CRCMdlLists.ulTotalLocked--;
+        }       
+    }
+    
+    KeReleaseSpinLock(&DeviceExtension->SpinLock, oldIrql);
 
-            if (bufToFree) FreePool(DeviceExtension, bufToFree, PagedPool);
-            if (bufCopyToFree) FreePool(DeviceExtension, bufCopyToFree, PagedPool);
-        }
+    if (checkSums){
+        PackRegion(DeviceExtension, lruMdlItem, checkSums);
+        
+        FreePool(DeviceExtension, checkSums, NonPagedPool);
+        ASSERT(DeviceExtension->CRCMdlLists.ulBytesInUse >= CHECKSUM_ARRAY_BYTES);
+        DeviceExtension->CRCMdlLists.ulBytesInUse -= CHECKSUM_ARRAY_BYTES;
     }
     
-    ASSERT(DeviceExtension->CRCMdlLists.ulTotalLocked == 0);
-    ASSERT(IsListEmpty(&DeviceExtension->CRCMdlLists.LockedLRUList));
 }
 
 
 /*
- *  LockCheckSumArrays
+ *  PackRegion
+ *
+ *      Pack the checksums of a region that is being made COLD into paged pool.
+ *      If it has no checksums, or the pool can't be allocated, the region becomes UNKNOWN.
  *
  *      Must be called at PASSIVE irql with SyncEvent HELD but SPINLOCK NOT HELD.
  */
-BOOLEAN LockCheckSumArrays(PDEVICE_EXTENSION DeviceExtension, ULONG RegionIndex)
+VOID PackRegion(PDEVICE_EXTENSION DeviceExtension, PCRC_MDL_ITEM pCRCMdlItem, PUSHORT CheckSums)
 {
-    PCRC_MDL_ITEM pCRCMdlItem = &DeviceExtension->CRCMdlLists.pMdlItems[RegionIndex];
-    BOOLEAN lockedFirstArray = FALSE, lockSucceeded = FALSE;
-
-    ASSERT(KeGetCurrentIrql() < DISPATCH_LEVEL);
-    ASSERT(RegionIndex < DeviceExtension->CRCMdlLists.ulMaxItems);
-    ASSERT(!pCRCMdlItem->checkSumsArraysLocked);
+    PCRC_PACKED_REGION packed = NULL;
+    ULONG numCheckSums = 0;
+    ULONG packedLength;
+    BOOLEAN isSparse;
+    ULONG i;
+
+    ASSERT(pCRCMdlItem->tier == CRC_REGION_COLD);
+    ASSERT(!pCRCMdlItem->packedCheckSums);
+
+    for (i = 0; i < CRC_MDL_LOGIC_BLOCK_SIZE; i++){
+        if (CheckSums[i]){
+            numCheckSums++;
+        }
+    }
 
-    __try {
+    if (numCheckSums){
         /*
-         *  We are locking down pageable addresses, so do this at passivel level i.e. with spinlock not held.
-         *  If MmProbeAndLockPages fails, it will raise an exception, which we will catch in the _except block.
+         *  Keep only the nonzero checksums and a bitmap of their sectors, if that is smaller.
          */
-        MmProbeAndLockPages(pCRCMdlItem->checkSumsArrayMdl, KernelMode, IoWriteAccess);
-        lockedFirstArray = TRUE;
-        MmProbeAndLockPages(pCRCMdlItem->checkSumsArrayCopyMdl, KernelMode, IoWriteAccess);
-        lockSucceeded = TRUE;
-    }
-    __except(EXCEPTION_EXECUTE_HANDLER){
-        DBGERR(("MmProbeAndLockPages raised exception"));
-        DeviceExtension->DbgNumLockFailures++;
-        if (lockedFirstArray){
-            MmUnlockPages(pCRCMdlItem->checkSumsArrayMdl);
-        }
+        isSparse = (CHECKSUM_BITMAP_BYTES + numCheckSums*sizeof(USHORT) < CHECKSUM_ARRAY_BYTES);
+        packedLength = sizeof(CRC_PACKED_REGION) +
+                       (isSparse ? CHECKSUM_BITMAP_BYTES + numCheckSums*sizeof(USHORT) : CHECKSUM_ARRAY_BYTES);
+        
+        packed = AllocPool(DeviceExtension, PagedPool, packedLength, TRUE);
     }
 
-    if (lockSucceeded){
-        BOOLEAN unlockSome = FALSE;
-        KIRQL oldIrql;
+    if (packed){
+        PUCHAR data = (PUCHAR)(packed+1);
+
+        packed->numCheckSums = numCheckSums;
+        packed->isSparse = isSparse;
 
-        KeAcquireSpinLock(&DeviceExtension->SpinLock, &oldIrql);
+        if (isSparse){
+            PULONG bitmap = (PULONG)data;
+            PUSHORT nextCheckSum = (PUSHORT)(data+CHECKSUM_BITMAP_BYTES);
+
+            /*
+             *  AllocPool zeroed the bitmap.
+             */
+            for (i = 0; i < CRC_MDL_LOGIC_BLOCK_SIZE; i++){
+                if (CheckSums[i]){
+                    bitmap[i/32] |= 1 << (i%32);
+                    *nextCheckSum++ = CheckSums[i];
+                }
+            }
+        }
+        else {
+            RtlCopyMemory(data, CheckSums, CHECKSUM_ARRAY_BYTES);
+        }
 
-        pCRCMdlItem->checkSumsArraysLocked = TRUE;      
+        packed->seal = ComputeCheckSum(0, (PUCHAR)&packed->numCheckSums, packedLength-FIELD_OFFSET(CRC_PACKED_REGION, numCheckSums));
         
-        /*
-         *  Update this regions's timestamp.  
-         *  That will make it the 'latest' one and keep it from getting unlocked below.
-         */
-        ASSERT(IsListEmpty(&pCRCMdlItem->LockedLRUListEntry));
-        UpdateRegionAccessTimeStamp(DeviceExtension, RegionIndex);
+        pCRCMdlItem->packedCheckSums = packed;
+        pCRCMdlItem->packedLength = packedLength;
+        InsertTailList(&DeviceExtension->CRCMdlLists.ColdLRUList, &pCRCMdlItem->LRUListEntry);
         
+        DeviceExtension->CRCMdlLists.ulBytesInUse += packedLength;
+        DeviceExtension->DbgNumRegionsCooled++;
+    }
+    else {
         /*
-         *  Keep track of the number of locked checksum array pairs.
-         *  If it goes too high, unlock the least-recently-used array pair.
+         *  Forgetting checksums only loses coverage for the region, it can't cause a false mismatch.
          */
-        DeviceExtension->CRCMdlLists.ulTotalLocked++;
-        if (DeviceExtension->CRCMdlLists.ulTotalLocked > MAX_LOCKED_CHECKSUM_ARRAY_PAIRS){
-            unlockSome = TRUE;
+        if (numCheckSums){
+            DeviceExtension->DbgNumRegionsDropped++;
         }
+        pCRCMdlItem->tier = CRC_REGION_UNKNOWN;
+    }
+}
 
-        KeReleaseSpinLock(&DeviceExtension->SpinLock, oldIrql);
 
-        if (unlockSome){
-            UnlockLRUChecksumArray(DeviceExtension);
+/*
+ *  UnpackRegion
+ *
+ *      Unpack the checksums of a COLD region into a checksum array, and free the packed checksums.
+ *      The caller makes the region HOT.
+ *
+ *      Must be called at PASSIVE irql with SyncEvent HELD but SPINLOCK NOT HELD.
+ */
+VOID UnpackRegion(PDEVICE_EXTENSION DeviceExtension, ULONG RegionIndex, PCRC_MDL_ITEM pCRCMdlItem, PUSHORT CheckSums)
+{
+    PCRC_PACKED_REGION packed = pCRCMdlItem->packedCheckSums;
+    PUCHAR data = (PUCHAR)(packed+1);
+    ULONG i;
 
-            /*
-             *  We recently updated the latestAccessTimestamp for the region we just locked,
-             *  so we should not have unlocked the region we just locked.
-             */
-            ASSERT(pCRCMdlItem->checkSumsArraysLocked);
+    ASSERT(pCRCMdlItem->tier == CRC_REGION_COLD);
+    ASSERT(packed);
+
+    if (packed->seal != ComputeCheckSum(0, (PUCHAR)&packed->numCheckSums, pCRCMdlItem->packedLength-FIELD_OFFSET(CRC_PACKED_REGION, numCheckSums))){
+        /*
+         *  The packed checksums were corrupted,
+         *  possibly because they were paged out to disk and corrupted there.
+         */
+        DeviceExtension->IsRaisingException = TRUE;                
+        DeviceExtension->ExceptionSector = RegionIndex*CRC_MDL_LOGIC_BLOCK_SIZE;
+        DeviceExtension->ExceptionIrpOrCopyPtr = NULL;
+        DeviceExtension->ExceptionCheckSynchronous = FALSE;
+        KeBugCheckEx(DRIVER_VERIFIER_DETECTED_VIOLATION,
+                   (ULONG_PTR)0xA2,
+                   (ULONG_PTR)NULL,
+                   (ULONG_PTR)DeviceExtension->LowerDeviceObject,
+                    (ULONG_PTR)RegionIndex*CRC_MDL_LOGIC_BLOCK_SIZE);
+    }
+
+    if (packed->isSparse){
+        PULONG bitmap = (PULONG)data;
+        PUSHORT nextCheckSum = (PUSHORT)(data+CHECKSUM_BITMAP_BYTES);
+
+        /*
+         *  AllocPool zeroed the checksum array.
+         */
+        for (i = 0; i < CRC_MDL_LOGIC_BLOCK_SIZE; i++){
+            if (bitmap[i/32] & (1 << (i%32))){
+                CheckSums[i] = *nextCheckSum++;
+            }
         }
+        
+        ASSERT(nextCheckSum == (PUSHORT)(data+CHECKSUM_BITMAP_BYTES)+packed->numCheckSums);
+    }
+    else {
+        RtlCopyMemory(CheckSums, data, CHECKSUM_ARRAY_BYTES);
     }
 
-    return lockSucceeded;
+    RemoveEntryList(&pCRCMdlItem->LRUListEntry);
+    InitializeListHead(&pCRCMdlItem->LRUListEntry);
+    
+    ASSERT(DeviceExtension->CRCMdlLists.ulBytesInUse >= pCRCMdlItem->packedLength);
+    DeviceExtension->CRCMdlLists.ulBytesInUse -= pCRCMdlItem->packedLength;
+    
+    pCRCMdlItem->packedCheckSums = NULL;
+    pCRCMdlItem->packedLength = 0;
+    FreePool(DeviceExtension, packed, PagedPool);
 }
 
 
 /*
- *   UnlockLRUChecksumArray
+ *  DropColdRegion
  *
- *      Unlock the least recently used checksum array pair
+ *      Free the packed checksums of a COLD region, making it UNKNOWN.
  *
  *      Must be called at PASSIVE irql with SyncEvent HELD but SPINLOCK NOT HELD.
  */
-VOID UnlockLRUChecksumArray(PDEVICE_EXTENSION DeviceExtension)
+VOID DropColdRegion(PDEVICE_EXTENSION DeviceExtension, PCRC_MDL_ITEM pCRCMdlItem)
 {
-    KIRQL oldIrql;
+    ASSERT(pCRCMdlItem->tier == CRC_REGION_COLD);
 
-    ASSERT(KeGetCurrentIrql() < DISPATCH_LEVEL);
+    RemoveEntryList(&pCRCMdlItem->LRUListEntry);
+    InitializeListHead(&pCRCMdlItem->LRUListEntry);
 
-    KeAcquireSpinLock(&DeviceExtension->SpinLock, &oldIrql);
+    ASSERT(DeviceExtension->CRCMdlLists.ulBytesInUse >= pCRCMdlItem->packedLength);
+    DeviceExtension->CRCMdlLists.ulBytesInUse -= pCRCMdlItem->packedLength;
 
-    if (DeviceExtension->CRCMdlLists.mdlItemsAllocated){
+    FreePool(DeviceExtension, pCRCMdlItem->packedCheckSums, PagedPool);
+    pCRCMdlItem->packedCheckSums = NULL;
+    pCRCMdlItem->packedLength = 0;
+    pCRCMdlItem->tier = CRC_REGION_UNKNOWN;
 
-        /*
-         *  Unlock the checksum arrays for the region at the head of the LRU list; 
-         *  this is the 'oldest' (least recently touched) region.
-         */
-        if (!IsListEmpty(&DeviceExtension->CRCMdlLists.LockedLRUList)){
-            PLIST_ENTRY listEntry = RemoveHeadList(&DeviceExtension->CRCMdlLists.LockedLRUList);
-            PCRC_MDL_ITEM lruMdlItem = CONTAINING_RECORD(listEntry, CRC_MDL_ITEM, LockedLRUListEntry);
+    DeviceExtension->DbgNumRegionsDropped++;
+}
 
-            InitializeListHead(&lruMdlItem->LockedLRUListEntry); 
-            ASSERT(lruMdlItem->checkSumsArraysLocked);
-            lruMdlItem->checkSumsArraysLocked = FALSE;
 
-            MmUnlockPages(lruMdlItem->checkSumsArrayMdl);
-            MmUnlockPages(lruMdlItem->checkSumsArrayCopyMdl);
+VOID FreeAllPages(PDEVICE_EXTENSION DeviceExtension)
+/*++
 
-            ASSERT(DeviceExtension->CRCMdlLists.ulTotalLocked > 0);
-            DeviceExtension->CRCMdlLists.ulTotalLocked--;
-        }       
+Routine Description:
+
+   Frees all the checksums, making every region UNKNOWN. 
+   This is done in reponse to capacity change of the disk, and to recover.
+   The chunks of regions are kept; see FreeRegionChunks.
+
+    At runtime, must be called with SyncEvent HELD
+
+Arguments:
+
+    deviceExtension - Device extension for the particular disk on which the filter is.
+
+Return Value:
+
+    N/A
+
+--*/
+
+{
+    ASSERT(KeGetCurrentIrql() < DISPATCH_LEVEL);
+
+    if (DeviceExtension->CRCMdlLists.pMdlChunks){
+        ULONG i;   
+        
+        for (i = 0; i < DeviceExtension->CRCMdlLists.ulMaxItems; i++){
+            PCRC_MDL_ITEM pCRCMdlItem = LookupRegion(DeviceExtension, i);
+            PVOID bufToFree = NULL;
+            KIRQL oldIrql;
+
+            if (!pCRCMdlItem){
+                /*
+                 *  Skip the rest of the chunk
+                 */
+                i |= CRC_REGIONS_PER_CHUNK-1;
+                continue;
+            }
+            
+            /*
+             *  We need the spinlock to synchronize with checks at raised irql, 
+             *  but doing so raises irql to dispatch level, 
+             *  and we cannot free PAGED pool at dispatch level.
+             *  So we move the pointers with spinlock held, and free them after dropping the lock.
+             */
+            KeAcquireSpinLock(&DeviceExtension->SpinLock, &oldIrql);
+            if (pCRCMdlItem->tier == CRC_REGION_HOT){
+            
+                bufToFree = pCRCMdlItem->checkSumsArray;
+                pCRCMdlItem->checkSumsArray = NULL;
+
+                ASSERT(!IsListEmpty(&DeviceExtension->CRCMdlLists.LockedLRUList));
+                ASSERT(!IsListEmpty(&pCRCMdlItem->LRUListEntry));
+                RemoveEntryList(&pCRCMdlItem->LRUListEntry); 
+                InitializeListHead(&pCRCMdlItem->LRUListEntry);
+                
+                ASSERT(DeviceExtension->CRCMdlLists.ulTotalLocked > 0);
+                DeviceExtension->CRCMdlLists.ulTotalLocked--;
+                
+                pCRCMdlItem->tier = CRC_REGION_UNKNOWN;
+            }
+            KeReleaseSpinLock(&DeviceExtension->SpinLock, oldIrql);
+
+            if (bufToFree){
+                FreePool(DeviceExtension, bufToFree, NonPagedPool);
+                DeviceExtension->CRCMdlLists.ulBytesInUse -= CHECKSUM_ARRAY_BYTES;
+            }
+            else if (pCRCMdlItem->tier == CRC_REGION_COLD){
+                DropColdRegion(DeviceExtension, pCRCMdlItem);
+            }
+        }
     }
     
-    KeReleaseSpinLock(&DeviceExtension->SpinLock, oldIrql);
-    
+    ASSERT(DeviceExtension->CRCMdlLists.ulTotalLocked == 0);
+    ASSERT(DeviceExtension->CRCMdlLists.ulBytesInUse == 0);
+    ASSERT(IsListEmpty(&DeviceExtension->CRCMdlLists.LockedLRUList));
+    ASSERT(IsListEmpty(&DeviceExtension->CRCMdlLists.ColdLRUList));
+}
+
+
+/*
+ *  FreeRegionChunks
+ *
+ *      Frees the chunks of regions and the chunk directory, after FreeAllPages.
+ *
+ *      Must only be called when no checks can be in progress,
+ *      i.e. when mdlItemsAllocated is FALSE or the device is being removed.
+ */
+VOID FreeRegionChunks(PDEVICE_EXTENSION DeviceExtension)
+{
+    if (DeviceExtension->CRCMdlLists.pMdlChunks){
+        ULONG i;
+
+        for (i = 0; i < DeviceExtension->CRCMdlLists.ulMaxChunks; i++){
+            if (DeviceExtension->CRCMdlLists.pMdlChunks[i]){
+                FreePool(DeviceExtension, DeviceExtension->CRCMdlLists.pMdlChunks[i], NonPagedPool);
+            }
+        }
+
+        FreePool(DeviceExtension, DeviceExtension->CRCMdlLists.pMdlChunks, NonPagedPool);
+        DeviceExtension->CRCMdlLists.pMdlChunks = NULL;
+    }
 }
 
 
 /*
  *  UpdateRegionAccessTimeStamp
  *
- *      Updates latestAccessTimestamp for a LOCKED region, and maintains the LRU list.
+ *      Updates latestAccessTimestamp for a HOT region, and maintains the LRU list.
  *
  *      Must be called with SPINLOCK HELD
  */
 VOID UpdateRegionAccessTimeStamp(PDEVICE_EXTENSION DeviceExtension, ULONG RegionIndex)
 {
-    PCRC_MDL_ITEM pCRCMdlItem = &DeviceExtension->CRCMdlLists.pMdlItems[RegionIndex];
+    PCRC_MDL_ITEM pCRCMdlItem = LookupRegion(DeviceExtension, RegionIndex);
 
-    ASSERT(pCRCMdlItem->checkSumsArraysLocked);
+    ASSERT(pCRCMdlItem->tier == CRC_REGION_HOT);
 
     /*
      *  Update the regions's timestamp, and move it to the end of the LRU list.
      */
     pCRCMdlItem->latestAccessTimestamp = ++DeviceExtension->CRCMdlLists.currentAccessCount;
-    RemoveEntryList(&pCRCMdlItem->LockedLRUListEntry);  // listEntry is initialized, so this is ok even if its not queued
-    InsertTailList(&DeviceExtension->CRCMdlLists.LockedLRUList, &pCRCMdlItem->LockedLRUListEntry);
+    RemoveEntryList(&pCRCMdlItem->LRUListEntry);  // listEntry is initialized, so this is ok even if its not queued
+    InsertTailList(&DeviceExtension->CRCMdlLists.LockedLRUList, &pCRCMdlItem->LRUListEntry);
     
 }    
 
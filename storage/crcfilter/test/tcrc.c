@@ -0,0 +1,242 @@
+//
+// Correctness and throughput test for the crcdisk CRC32 kernels.
+//
+// Every kernel is checked bit for bit against the byte at a time table
+// kernel, over buffers of every length up to a few sectors, at every
+// alignment, and with the CRC carried across a split in the buffer. Then
+// each kernel is timed over sector sized and larger blocks.
+//
+// Usage:
+//
+//     tcrc [-t milliseconds]
+//
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+//
+// Kernel services used by the CRC kernels.
+//
+
+#define ExIsProcessorFeaturePresent(Feature) IsProcessorFeaturePresent (Feature)
+
+#if defined(_X86_)
+typedef ULONG KFLOATING_SAVE;
+#define KeSaveFloatingPointState(Save) (*(Save) = 0, 0)
+#define KeRestoreFloatingPointState(Save)
+#endif
+
+#include "..\crcsum.c"
+
+#if defined(_X86_) || defined(_AMD64_)
+#include "..\crcclmul.c"
+#endif
+
+#define MAX_TEST_LENGTH         (4 * 1024 + 64)
+#define BENCHMARK_BUFFER_SIZE   (1024 * 1024)
+
+typedef struct _TEST_KERNEL {
+	PCSTR Name;
+	PCRC_UPDATE_ROUTINE Update;
+} TEST_KERNEL, *PTEST_KERNEL;
+
+TEST_KERNEL Kernels [3];
+ULONG KernelCount;
+
+ULONG BlockSizes [] = { 512, 4096, 64 * 1024 };
+
+ULONG Duration = 1000;
+ULONG Failures;
+
+
+ULONG32
+Crc32(
+	IN PCRC_UPDATE_ROUTINE Update,
+	IN PUCHAR Buffer,
+	IN ULONG Length
+	)
+{
+	return Update (0xffffffff, Buffer, Length) ^ 0xffffffff;
+}
+
+
+VOID
+TestKernel(
+	IN PTEST_KERNEL Kernel,
+	IN PUCHAR Buffer
+	)
+{
+	ULONG Length;
+	ULONG Offset;
+	ULONG Split;
+	ULONG32 Expected;
+	ULONG32 Crc;
+	ULONG Errors;
+
+	Errors = 0;
+
+	//
+	// The standard check value.
+	//
+
+	Crc = Crc32 (Kernel->Update, (PUCHAR)"123456789", 9);
+	if (Crc != 0xcbf43926) {
+		printf ("%-12s check value %08x, expected cbf43926\n", Kernel->Name, Crc);
+		Errors++;
+	}
+
+	for (Offset = 0; Offset < 16; Offset++) {
+		for (Length = 0; Length <= MAX_TEST_LENGTH - 16; Length++) {
+
+			Expected = Crc32 (CrcUpdateTable, Buffer + Offset, Length);
+			Crc = Crc32 (Kernel->Update, Buffer + Offset, Length);
+
+			if (Crc != Expected && Errors++ < 10) {
+				printf ("%-12s length %d offset %d: %08x, expected %08x\n",
+						Kernel->Name,
+						Length,
+						Offset,
+						Crc,
+						Expected);
+			}
+
+			//
+			// Carry the CRC across a split in the buffer.
+			//
+
+			Split = Length / 3;
+			Crc = Kernel->Update (0xffffffff, Buffer + Offset, Split);
+			Crc = Kernel->Update (Crc, Buffer + Offset + Split, Length - Split);
+			Crc ^= 0xffffffff;
+
+			if (Crc != Expected && Errors++ < 10) {
+				printf ("%-12s length %d offset %d split %d: %08x, expected %08x\n",
+						Kernel->Name,
+						Length,
+						Offset,
+						Split,
+						Crc,
+						Expected);
+			}
+		}
+	}
+
+	if (Errors != 0) {
+		printf ("%-12s FAILED, %d mismatches\n", Kernel->Name, Errors);
+		Failures++;
+	} else {
+		printf ("%-12s matches the table kernel\n", Kernel->Name);
+	}
+}
+
+
+double
+BenchmarkKernel(
+	IN PTEST_KERNEL Kernel,
+	IN PUCHAR Buffer,
+	IN ULONG BlockSize
+	)
+{
+	LARGE_INTEGER Frequency;
+	LARGE_INTEGER Start;
+	LARGE_INTEGER Now;
+	LONGLONG Bytes;
+	LONGLONG End;
+	ULONG Offset;
+	volatile ULONG32 Sink;
+
+	QueryPerformanceFrequency (&Frequency);
+	QueryPerformanceCounter (&Start);
+	End = Start.QuadPart + Frequency.QuadPart * Duration / 1000;
+
+	Bytes = 0;
+	Sink = 0;
+
+	do {
+		for (Offset = 0; Offset < BENCHMARK_BUFFER_SIZE; Offset += BlockSize) {
+			Sink ^= Crc32 (Kernel->Update, Buffer + Offset, BlockSize);
+		}
+		Bytes += BENCHMARK_BUFFER_SIZE;
+		QueryPerformanceCounter (&Now);
+	} while (Now.QuadPart < End);
+
+	return ((double)Bytes / 1e9) /
+		   ((double)(Now.QuadPart - Start.QuadPart) / (double)Frequency.QuadPart);
+}
+
+
+int
+__cdecl
+main(
+	int argc,
+	char* argv[]
+	)
+{
+	PUCHAR Buffer;
+	ULONG i;
+	ULONG j;
+
+	if (argc == 3 && (argv[1][0] == '-' || argv[1][0] == '/') && argv[1][1] == 't') {
+		Duration = atoi (argv[2]);
+	} else if (argc != 1) {
+		printf ("usage: tcrc [-t milliseconds]\n");
+		return 2;
+	}
+
+	CrcInitializeCheckSum ();
+	printf ("crcdisk would use the %s kernel\n\n", CrcUpdateRoutineName);
+
+	Kernels[KernelCount].Name = "table";
+	Kernels[KernelCount++].Update = CrcUpdateTable;
+	Kernels[KernelCount].Name = "slice-by-8";
+	Kernels[KernelCount++].Update = CrcUpdateSlice8;
+
+#if defined(_X86_) || defined(_AMD64_)
+	if (CrcIsClmulPresent ()) {
+		Kernels[KernelCount].Name = "pclmulqdq";
+		Kernels[KernelCount++].Update = CrcUpdateClmul;
+	} else {
+		printf ("pclmulqdq    not supported by this processor\n");
+	}
+#endif
+
+	Buffer = malloc (BENCHMARK_BUFFER_SIZE);
+	if (Buffer == NULL) {
+		printf ("Failed to allocate buffer!\n");
+		return 1;
+	}
+
+	srand (1);
+	for (i = 0; i < BENCHMARK_BUFFER_SIZE; i++) {
+		Buffer[i] = (UCHAR)rand ();
+	}
+
+	for (i = 1; i < KernelCount; i++) {
+		TestKernel (&Kernels[i], Buffer);
+	}
+
+	printf ("\nthroughput, GB/s\n\n");
+	printf ("kernel      ");
+	for (j = 0; j < sizeof (BlockSizes) / sizeof (BlockSizes[0]); j++) {
+		printf ("  %6d", BlockSizes[j]);
+	}
+	printf ("\n");
+
+	for (i = 0; i < KernelCount; i++) {
+		printf ("%-12s", Kernels[i].Name);
+		for (j = 0; j < sizeof (BlockSizes) / sizeof (BlockSizes[0]); j++) {
+			printf ("  %6.2f", BenchmarkKernel (&Kernels[i], Buffer, BlockSizes[j]));
+		}
+		printf ("\n");
+	}
+
+	free (Buffer);
+
+	if (Failures != 0) {
+		printf ("\nFAILED\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -585,7 +585,7 @@ AllocPool (
                     if (!SyncEventHeld){
                         AcquirePassiveLevelLock(DeviceExtension);
                     }      
-                    UnlockLRUChecksumArray(DeviceExtension);
+                    CoolLRUChecksumArray(DeviceExtension);
                     if (!SyncEventHeld){
                         ReleasePassiveLevelLock(DeviceExtension);
                     }        
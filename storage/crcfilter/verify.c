@@ -0,0 +1,460 @@
+/*++
+Copyright (c) 2001-2002  Microsoft Corporation
+
+Module Name:
+
+    Verify.c
+
+Abstract:
+
+    Verification of reads after they complete.
+
+    By default each read is checksummed and verified in its completion routine,
+    which for a large read means the whole CRC cost at DISPATCH_LEVEL on the completing processor.
+    With a VerifyAfterPolicy, the read is completed right away and its double-buffer
+    is queued to a pool of verify workers, one per processor, which verify the reads in batches.
+
+    A write to a sector marks the deferred reads of that sector stale, so that a read
+    of the old data is never compared with the checksum of the new data.
+    Stale sectors are skipped; this only loses coverage, it can never cause a false mismatch.
+
+Environment:
+
+    kernel mode only
+
+Notes:
+
+--*/
+
+#include "Filter.h"
+#include "Device.h"
+#include "CRC.h"
+#include "Util.h"
+
+
+#if DBG_WMI_TRACING
+    //
+    // for any file that has software tracing printouts, you must include a
+    // header file <filename>.tmh
+    // this file will be generated by the WPP processing phase
+    //
+    #include "Verify.tmh"
+#endif
+
+
+CRC_VERIFY_POOL g_VerifyPool = {0};
+
+/*
+ *  Read from the Parameters key in DriverEntry.
+ */
+ULONG g_VerifyAfterPolicy = CRC_VERIFY_AFTER_NEVER;
+ULONG g_VerifyAfterMinBytes = DEFAULT_VERIFY_AFTER_MIN_BYTES;
+ULONG g_VerifyAfterMaxOutstanding = DEFAULT_VERIFY_AFTER_MAX_OUTSTANDING;
+
+
+/*
+ *  StartVerifyPool
+ *
+ *      Start a verify worker for each processor.
+ *      If no worker can be started, every read is verified in its completion.
+ *
+ *      Must be called at PASSIVE irql.
+ */
+NTSTATUS StartVerifyPool()
+{
+    KAFFINITY activeProcessors = KeQueryActiveProcessors();
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG numQueues = 0;
+    ULONG i;
+
+    ASSERT(!g_VerifyPool.NumQueues);
+
+    for (i = 0; (i < sizeof(KAFFINITY)*8) && (numQueues < CRC_VERIFY_MAX_QUEUES); i++){
+        PCRC_VERIFY_QUEUE queue = &g_VerifyPool.Queues[numQueues];
+        HANDLE threadHandle;
+
+        if (!(activeProcessors & ((KAFFINITY)1 << i))){
+            continue;
+        }
+
+        KeInitializeSpinLock(&queue->Lock);
+        InitializeListHead(&queue->List);
+        KeInitializeEvent(&queue->WorkEvent, SynchronizationEvent, FALSE);
+        queue->Affinity = (KAFFINITY)1 << i;
+
+        status = PsCreateSystemThread(&threadHandle, THREAD_ALL_ACCESS, NULL, NULL, NULL, VerifyWorkerThread, queue);
+        if (!NT_SUCCESS(status)){
+            DBGWARN(("PsCreateSystemThread failed with %xh", status));
+            break;
+        }
+
+        status = ObReferenceObjectByHandle(threadHandle, THREAD_ALL_ACCESS, *PsThreadType, KernelMode, &queue->Thread, NULL);
+        ASSERT(NT_SUCCESS(status));
+        ZwClose(threadHandle);
+
+        numQueues++;
+    }
+
+    /*
+     *  Reads are only queued once NumQueues is set.
+     */
+    g_VerifyPool.NumQueues = numQueues;
+
+    return numQueues ? STATUS_SUCCESS : status;
+}
+
+
+/*
+ *  StopVerifyPool
+ *
+ *      Stop the verify workers.
+ *      All the disks have been removed, so there are no more reads to verify.
+ *
+ *      Must be called at PASSIVE irql.
+ */
+VOID StopVerifyPool()
+{
+    ULONG numQueues = g_VerifyPool.NumQueues;
+    ULONG i;
+
+    g_VerifyPool.NumQueues = 0;
+    g_VerifyPool.Stopping = TRUE;
+
+    for (i = 0; i < numQueues; i++){
+        PCRC_VERIFY_QUEUE queue = &g_VerifyPool.Queues[i];
+
+        KeSetEvent(&queue->WorkEvent, IO_NO_INCREMENT, FALSE);
+        KeWaitForSingleObject(queue->Thread, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(queue->Thread);
+        queue->Thread = NULL;
+
+        ASSERT(IsListEmpty(&queue->List));
+    }
+}
+
+
+/*
+ *  ReserveDeferredRead
+ *
+ *      Decide whether to defer the verification of a read of Length bytes, according to the policy.
+ *      If so, the caller must pass the read to QueueDeferredRead.
+ *
+ *      Must be called with SPINLOCK NOT HELD.
+ */
+BOOLEAN ReserveDeferredRead(PDEVICE_EXTENSION DeviceExtension, ULONG Length)
+{
+    BOOLEAN deferIt;
+    KIRQL oldIrql;
+
+    if (!g_VerifyPool.NumQueues){
+        deferIt = FALSE;
+    }
+    else if (g_VerifyAfterPolicy == CRC_VERIFY_AFTER_ALL_READS){
+        deferIt = TRUE;
+    }
+    else if (g_VerifyAfterPolicy == CRC_VERIFY_AFTER_LARGE_READS){
+        deferIt = (Length >= g_VerifyAfterMinBytes);
+    }
+    else {
+        deferIt = FALSE;
+    }
+
+    if (deferIt){
+        KeAcquireSpinLock(&DeviceExtension->SpinLock, &oldIrql);
+
+        if (DeviceExtension->DeferredReadsOutstanding >= g_VerifyAfterMaxOutstanding){
+            /*
+             *  The workers are falling behind;
+             *  don't hold on to any more double-buffers for this disk.
+             */
+            DeviceExtension->DbgNumDeferredReadsInline++;
+            deferIt = FALSE;
+        }
+        else {
+            if (DeviceExtension->DeferredReadsOutstanding++ == 0){
+                KeClearEvent(&DeviceExtension->DeferredReadsIdleEvent);
+            }
+            DeviceExtension->DbgMaxDeferredReadsOutstanding = max(DeviceExtension->DbgMaxDeferredReadsOutstanding, DeviceExtension->DeferredReadsOutstanding);
+        }
+
+        KeReleaseSpinLock(&DeviceExtension->SpinLock, oldIrql);
+    }
+
+    return deferIt;
+}
+
+
+/*
+ *  QueueDeferredRead
+ *
+ *      Queue a completed read to the verify worker of this processor.
+ *      The worker frees DataBuf (the double-buffer) and the completion context.
+ *
+ *      Must be called with SPINLOCK NOT HELD, after ReserveDeferredRead.
+ */
+VOID QueueDeferredRead(PDEVICE_EXTENSION DeviceExtension, PCRC_COMPLETION_CONTEXT CrcContext, ULONG LogicalBlockAddr, ULONG NumSectors, PUCHAR DataBuf)
+{
+    PCRC_VERIFY_QUEUE queue;
+    BOOLEAN wasEmpty;
+    KIRQL oldIrql;
+
+    ASSERT(g_VerifyPool.NumQueues);
+
+    CrcContext->VerifyDeviceExtension = DeviceExtension;
+    CrcContext->VerifyDataBuff = DataBuf;
+    CrcContext->VerifyLogicalBlockAddr = LogicalBlockAddr;
+    CrcContext->VerifyNumSectors = NumSectors;
+    CrcContext->VerifySectorSize = DeviceExtension->ulSectorSize;
+    CrcContext->VerifyStale = FALSE;
+    CrcContext->VerifyQueueTime = KeQueryInterruptTime();
+
+    KeAcquireSpinLock(&DeviceExtension->SpinLock, &oldIrql);
+    InsertTailList(&DeviceExtension->DeferredReadList, &CrcContext->DiskVerifyListEntry);
+    DeviceExtension->DbgNumDeferredReads++;
+    KeReleaseSpinLock(&DeviceExtension->SpinLock, oldIrql);
+
+    /*
+     *  Use the worker of the processor that completed the read, whose cache has the data.
+     */
+    queue = &g_VerifyPool.Queues[KeGetCurrentProcessorNumber() % g_VerifyPool.NumQueues];
+
+    KeAcquireSpinLock(&queue->Lock, &oldIrql);
+    wasEmpty = IsListEmpty(&queue->List);
+    InsertTailList(&queue->List, &CrcContext->VerifyListEntry);
+    queue->Depth++;
+    queue->DbgMaxDepth = max(queue->DbgMaxDepth, queue->Depth);
+    KeReleaseSpinLock(&queue->Lock, oldIrql);
+
+    if (wasEmpty){
+        KeSetEvent(&queue->WorkEvent, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+
+/*
+ *  MarkDeferredReadsStale
+ *
+ *      Called for sectors that are being written or whose checksums are being invalidated,
+ *      before their new checksums are stored.
+ *      Keeps the deferred reads of those sectors from being verified against the new checksums.
+ *
+ *      Must be called with SPINLOCK NOT HELD.
+ */
+VOID MarkDeferredReadsStale(PDEVICE_EXTENSION DeviceExtension, ULONG LogicalBlockAddr, ULONG NumSectors)
+{
+    PLIST_ENTRY listEntry;
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&DeviceExtension->SpinLock, &oldIrql);
+
+    for (listEntry = DeviceExtension->DeferredReadList.Flink;
+         listEntry != &DeviceExtension->DeferredReadList;
+         listEntry = listEntry->Flink){
+
+        PCRC_COMPLETION_CONTEXT crcContext = CONTAINING_RECORD(listEntry, CRC_COMPLETION_CONTEXT, DiskVerifyListEntry);
+
+        if ((LogicalBlockAddr < crcContext->VerifyLogicalBlockAddr+crcContext->VerifyNumSectors) &&
+            (crcContext->VerifyLogicalBlockAddr < LogicalBlockAddr+NumSectors)){
+
+            crcContext->VerifyStale = TRUE;
+        }
+    }
+
+    KeReleaseSpinLock(&DeviceExtension->SpinLock, oldIrql);
+}
+
+
+/*
+ *  VerifyWorkerThread
+ *
+ *      Verify the reads queued to one processor's queue,
+ *      taking up to CRC_VERIFY_BATCH of them off the queue at a time.
+ */
+VOID VerifyWorkerThread(PVOID Context)
+{
+    PCRC_VERIFY_QUEUE queue = Context;
+
+    KeSetSystemAffinityThread(queue->Affinity);
+
+    while (TRUE){
+
+        KeWaitForSingleObject(&queue->WorkEvent, Executive, KernelMode, FALSE, NULL);
+
+        while (TRUE){
+            LIST_ENTRY batch;
+            ULONG numInBatch = 0;
+            KIRQL oldIrql;
+
+            InitializeListHead(&batch);
+
+            KeAcquireSpinLock(&queue->Lock, &oldIrql);
+            while (!IsListEmpty(&queue->List) && (numInBatch < CRC_VERIFY_BATCH)){
+                PLIST_ENTRY listEntry = RemoveHeadList(&queue->List);
+                InsertTailList(&batch, listEntry);
+                numInBatch++;
+            }
+            queue->Depth -= numInBatch;
+            KeReleaseSpinLock(&queue->Lock, oldIrql);
+
+            if (!numInBatch){
+                break;
+            }
+
+            queue->DbgNumBatches++;
+
+            while (!IsListEmpty(&batch)){
+                PLIST_ENTRY listEntry = RemoveHeadList(&batch);
+                InitializeListHead(listEntry);
+                VerifyDeferredRead(CONTAINING_RECORD(listEntry, CRC_COMPLETION_CONTEXT, VerifyListEntry));
+            }
+        }
+
+        if (g_VerifyPool.Stopping){
+            break;
+        }
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+
+/*
+ *  VerifyDeferredRead
+ *
+ *      Checksum a completed read and compare (or record) its checksums,
+ *      then free its double-buffer and completion context.
+ *      The sectors are done in groups that stay within one region, so that
+ *      the checksums are computed without holding any lock.
+ *
+ *      Must be called at PASSIVE irql with SyncEvent NOT HELD.
+ */
+VOID VerifyDeferredRead(PCRC_COMPLETION_CONTEXT CrcContext)
+{
+    PDEVICE_EXTENSION DeviceExtension = CrcContext->VerifyDeviceExtension;
+    ULONG sectorSize = CrcContext->VerifySectorSize;
+    ULONG startSector = CrcContext->VerifyLogicalBlockAddr;
+    ULONG endSector = startSector+CrcContext->VerifyNumSectors;
+    ULONGLONG lag = KeQueryInterruptTime()-CrcContext->VerifyQueueTime;
+    ULONG mismatchSector = (ULONG)-1;
+    USHORT checkSums[CRC_VERIFY_GROUP];
+    BOOLEAN lastOne;
+    KIRQL oldIrql;
+    ULONG i;
+
+    ASSERT(KeGetCurrentIrql() < DISPATCH_LEVEL);
+
+    for (i = startSector; (i < endSector) && (mismatchSector == (ULONG)-1); ){
+        ULONG regionIndex = i/CRC_MDL_LOGIC_BLOCK_SIZE;
+        ULONG groupSectors = min(endSector-i, CRC_VERIFY_GROUP);
+        BOOLEAN verified = FALSE;
+        ULONG j;
+
+        groupSectors = min(groupSectors, (regionIndex+1)*CRC_MDL_LOGIC_BLOCK_SIZE-i);
+
+        for (j = 0; j < groupSectors; j++){
+            checkSums[j] = ComputeCheckSum16(0, CrcContext->VerifyDataBuff+(i-startSector+j)*sectorSize, sectorSize);
+        }
+
+        AcquirePassiveLevelLock(DeviceExtension);
+
+        /*
+         *  Don't record checksums of the old sectors if the disk was reinitialized since the read.
+         */
+        if (DeviceExtension->CRCMdlLists.mdlItemsAllocated &&
+            !DeviceExtension->NeedCriticalRecovery &&
+            (DeviceExtension->ulSectorSize == sectorSize) &&
+            (regionIndex < DeviceExtension->CRCMdlLists.ulMaxItems) &&
+            NT_SUCCESS(AllocAndMapPages(DeviceExtension, i, groupSectors))){
+
+            KeAcquireSpinLock(&DeviceExtension->SpinLock, &oldIrql);
+
+            /*
+             *  Sectors with checks pending in DeferredCheckSumList may have been written since the read;
+             *  rather than search the list, skip the group.
+             */
+            if (!CrcContext->VerifyStale &&
+                !DeviceExtension->CheckInProgress &&
+                IsListEmpty(&DeviceExtension->DeferredCheckSumList)){
+
+                PCRC_MDL_ITEM pCRCMdlItem = LookupRegion(DeviceExtension, regionIndex);
+                PUSHORT recordedCheckSums = &pCRCMdlItem->checkSumsArray[i % CRC_MDL_LOGIC_BLOCK_SIZE];
+
+                ASSERT(pCRCMdlItem->tier == CRC_REGION_HOT);
+
+                for (j = 0; j < groupSectors; j++){
+                    DeviceExtension->SectorDataLog[DeviceExtension->SectorDataLogNextIndex].SectorNumber = i+j;
+                    DeviceExtension->SectorDataLog[DeviceExtension->SectorDataLogNextIndex].CheckSum = checkSums[j];
+                    DeviceExtension->SectorDataLog[DeviceExtension->SectorDataLogNextIndex].IsWrite = FALSE;
+                    DeviceExtension->SectorDataLogNextIndex++;
+                    DeviceExtension->SectorDataLogNextIndex %= NUM_SECTORDATA_LOGENTRIES;
+
+                    if (!recordedCheckSums[j]){
+                        recordedCheckSums[j] = checkSums[j];
+                    }
+                    else if (recordedCheckSums[j] != checkSums[j]){
+                        DBGERR(("Disk Integrity Verifier (crcdisk): checksum for sector %xh does not match (%xh (current) != %xh (recorded)), devObj=%ph ", i+j, (ULONG)checkSums[j], (ULONG)recordedCheckSums[j], DeviceExtension->DeviceObject));
+                        mismatchSector = i+j;
+                        break;
+                    }
+
+                    DeviceExtension->DbgNumChecks++;
+                }
+
+                UpdateRegionAccessTimeStamp(DeviceExtension, regionIndex);
+                verified = TRUE;
+            }
+
+            KeReleaseSpinLock(&DeviceExtension->SpinLock, oldIrql);
+        }
+
+        if (!verified){
+            DeviceExtension->DbgNumDeferredSectorsSkipped += groupSectors;
+        }
+
+        ReleasePassiveLevelLock(DeviceExtension);
+
+        i += groupSectors;
+    }
+
+    if (mismatchSector != (ULONG)-1){
+        /*
+         *  The read has already been completed, so all we have is the sector.
+         */
+        LogCRCReadFailure(DeviceExtension->ulDiskId, mismatchSector, 1, STATUS_CRC_ERROR);
+
+        DeviceExtension->IsRaisingException = TRUE;
+        DeviceExtension->ExceptionSector = mismatchSector;
+        DeviceExtension->ExceptionIrpOrCopyPtr = NULL;
+        DeviceExtension->ExceptionCheckSynchronous = FALSE;
+        KeBugCheckEx(DRIVER_VERIFIER_DETECTED_VIOLATION,
+                   (ULONG_PTR)0xA1,
+                   (ULONG_PTR)NULL,
+                   (ULONG_PTR)DeviceExtension->LowerDeviceObject,
+                    (ULONG_PTR)mismatchSector);
+    }
+
+    FreePool(DeviceExtension, CrcContext->VerifyDataBuff, NonPagedPool);
+
+    KeAcquireSpinLock(&DeviceExtension->SpinLock, &oldIrql);
+
+    RemoveEntryList(&CrcContext->DiskVerifyListEntry);
+
+    DeviceExtension->DbgNumDeferredReadsVerified++;
+    DeviceExtension->DbgDeferredReadLagTotal += lag;
+    DeviceExtension->DbgDeferredReadLagMax = max(DeviceExtension->DbgDeferredReadLagMax, lag);
+
+    ASSERT(DeviceExtension->DeferredReadsOutstanding > 0);
+    lastOne = (--DeviceExtension->DeferredReadsOutstanding == 0);
+
+    KeReleaseSpinLock(&DeviceExtension->SpinLock, oldIrql);
+
+    FreePool(DeviceExtension, CrcContext, NonPagedPool);
+
+    /*
+     *  Once this is set, the disk may be removed, so don't touch the device extension after.
+     *  No reads complete while the disk is being removed, so the event can't be cleared in between.
+     */
+    if (lastOne){
+        KeSetEvent(&DeviceExtension->DeferredReadsIdleEvent, IO_NO_INCREMENT, FALSE);
+    }
+}
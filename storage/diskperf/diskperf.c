@@ -31,6 +31,7 @@ Notes:
 #include "wmidata.h"
 #include "wmiguid.h"
 #include "wmilib.h"
+#include "dptrace.h"
 
 #ifdef POOL_TAGGING
 #ifdef ExAllocatePool
@@ -40,6 +41,97 @@ Notes:
 #endif
 
 #define DISKPERF_MAXSTR         64
+#define DISKPERF_MOF_RESOURCE   L"DISKPERFWMI"
+
+//
+// Latency histograms.
+//
+// Each device keeps, per processor, a histogram of request latencies for
+// reads and writes in each of DISKPERF_SIZE_CLASSES transfer size classes.
+// Latencies are counted in raw clock ticks. Every power of two is split
+// into DISKPERF_SUB_BUCKETS linear buckets, so a bucket is never wider
+// than a quarter of its lower bound; latencies too large for the last
+// bucket are counted in it.
+//
+// The histograms are only allocated and updated once the latency data
+// block has been enabled through WMI.
+//
+
+#define DISKPERF_SIZE_CLASSES           4
+#define DISKPERF_SUB_BUCKET_SHIFT       2
+#define DISKPERF_SUB_BUCKETS            (1 << DISKPERF_SUB_BUCKET_SHIFT)
+#define DISKPERF_LATENCY_BUCKETS        128
+
+#define DISKPERF_READ                   0
+#define DISKPERF_WRITE                  1
+
+typedef struct _DISKPERF_HISTOGRAM {
+    ULONG Buckets[2][DISKPERF_SIZE_CLASSES][DISKPERF_LATENCY_BUCKETS];
+} DISKPERF_HISTOGRAM, *PDISKPERF_HISTOGRAM;
+
+//
+// Upper bound, in bytes, of each transfer size class. The last class
+// takes everything larger.
+//
+
+const ULONG DiskPerfSizeClassLimit[DISKPERF_SIZE_CLASSES] = {
+    4 * 1024,
+    16 * 1024,
+    64 * 1024,
+    0xFFFFFFFF
+};
+
+//
+// Latency data block returned for DiskPerfLatencyGuid. All latencies are
+// in microseconds and are the upper bound of the histogram bucket the
+// percentile falls in.
+//
+
+DEFINE_GUID(DiskPerfLatencyGuid,
+    0x4b0c2f7e, 0x9d1a, 0x4e63, 0x8c, 0x52, 0x1f, 0x7a, 0x3d, 0x6b, 0x9e, 0x21);
+
+typedef struct _WMI_DISK_LATENCY_PERCENTILES {
+    ULONG RequestCount;
+    ULONG Median;
+    ULONG Percentile99;
+    ULONG Percentile999;
+} WMI_DISK_LATENCY_PERCENTILES, *PWMI_DISK_LATENCY_PERCENTILES;
+
+typedef struct _WMI_DISK_LATENCY {
+    ULONG StorageDeviceNumber;
+    ULONG SizeClassLimit[DISKPERF_SIZE_CLASSES];
+    WMI_DISK_LATENCY_PERCENTILES Read[DISKPERF_SIZE_CLASSES];
+    WMI_DISK_LATENCY_PERCENTILES Write[DISKPERF_SIZE_CLASSES];
+} WMI_DISK_LATENCY, *PWMI_DISK_LATENCY;
+
+//
+// I/O trace rings.
+//
+// Each processor has a ring of trace slots that its completions are
+// recorded in. A producer reserves a slot by advancing Head, fills it in
+// and then publishes it by setting the slot's Sequence to its position
+// plus one; the reader stops at the first slot that is not published yet.
+// When a ring is full new records are counted in Dropped and discarded,
+// records already in the ring are never overwritten.
+//
+
+typedef struct _DISKPERF_TRACE_SLOT {
+    ULONG Sequence;
+    ULONG Reserved;
+    DISKPERF_TRACE_RECORD Record;
+} DISKPERF_TRACE_SLOT, *PDISKPERF_TRACE_SLOT;
+
+typedef struct _DISKPERF_TRACE_RING {
+    ULONG Head;
+    ULONG Tail;
+    LONG Dropped;
+    ULONG Reserved;
+    DISKPERF_TRACE_SLOT Slots[1];
+} DISKPERF_TRACE_RING, *PDISKPERF_TRACE_RING;
+
+#define DISKPERF_TRACE_RING_SIZE(Records) \
+    (FIELD_OFFSET(DISKPERF_TRACE_RING, Slots) + \
+        (Records) * sizeof(DISKPERF_TRACE_SLOT))
 
 //
 // Device Extension
@@ -93,6 +185,24 @@ typedef struct _DEVICE_EXTENSION {
     LONG QueueDepth;
     LONG CountersEnabled;
 
+    //
+    // Per processor latency histograms, allocated the first time the
+    // latency data block is enabled
+    //
+
+    PDISKPERF_HISTOGRAM Histograms;
+    LONG HistogramsEnabled;
+
+    //
+    // Per processor I/O trace rings, allocated the first time tracing is
+    // started. TraceEvent serializes the trace control requests.
+    //
+
+    PUCHAR TraceRings;
+    ULONG TraceRingSize;
+    LONG TraceEnabled;
+    KEVENT TraceEvent;
+
     //
     // must synchronize paging path notifications
     //
@@ -288,6 +398,52 @@ DiskPerfAddCounters(
     IN LARGE_INTEGER Frequency
     );
 
+VOID
+DiskPerfEnableCounters(
+    IN PDEVICE_EXTENSION DeviceExtension
+    );
+
+VOID
+DiskPerfDisableCounters(
+    IN PDEVICE_EXTENSION DeviceExtension
+    );
+
+NTSTATUS
+DiskPerfEnableHistograms(
+    IN PDEVICE_EXTENSION DeviceExtension
+    );
+
+ULONG
+DiskPerfLatencyBucket(
+    IN LONGLONG Ticks
+    );
+
+VOID
+DiskPerfQueryPercentiles(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONG Direction,
+    IN ULONG SizeClass,
+    IN LARGE_INTEGER Frequency,
+    OUT PWMI_DISK_LATENCY_PERCENTILES Percentiles
+    );
+
+VOID
+DiskPerfTraceRequest(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PIRP Irp,
+    IN PIO_STACK_LOCATION IrpStack,
+    IN ULONG Length,
+    IN LARGE_INTEGER CompleteTime,
+    IN LARGE_INTEGER Latency,
+    IN LONG QueueDepth
+    );
+
+NTSTATUS
+DiskPerfTraceControl(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp
+    );
+
 #if DBG
 
 ULONG DiskPerfDebug = 0;
@@ -325,6 +481,9 @@ DiskPerfDebugPrint(
 #pragma alloc_text (PAGE, DiskperfQueryWmiDataBlock)
 #pragma alloc_text (PAGE, DiskPerfRegisterDevice)
 #pragma alloc_text (PAGE, DiskPerfSyncFilterWithTarget)
+#pragma alloc_text (PAGE, DiskPerfEnableHistograms)
+#pragma alloc_text (PAGE, DiskPerfQueryPercentiles)
+#pragma alloc_text (PAGE, DiskPerfTraceControl)
 #endif
 
 WMIGUIDREGINFO DiskperfGuidList[] =
@@ -332,9 +491,16 @@ WMIGUIDREGINFO DiskperfGuidList[] =
     { &DiskPerfGuid,
       1,
       0
+    },
+    { &DiskPerfLatencyGuid,
+      1,
+      0
     }
 };
 
+#define DISKPERF_GUID_INDEX_PERFORMANCE     0
+#define DISKPERF_GUID_INDEX_LATENCY         1
+
 #define DiskperfGuidCount (sizeof(DiskperfGuidList) / sizeof(WMIGUIDREGINFO))
 
 #define USE_PERF_CTR
@@ -572,6 +738,9 @@ Return Value:
     KeInitializeEvent(&deviceExtension->PagingPathCountEvent,
                       NotificationEvent, TRUE);
 
+    KeInitializeEvent(&deviceExtension->TraceEvent,
+                      SynchronizationEvent, TRUE);
+
 
     //
     // Initialize WMI library context
@@ -928,6 +1097,17 @@ Return Value:
     status = DiskPerfForwardIrpSynchronous(DeviceObject, Irp);
 
     IoDetachDevice(deviceExtension->TargetDeviceObject);
+
+    if (deviceExtension->Histograms != NULL) {
+        ExFreePool(deviceExtension->Histograms);
+        deviceExtension->Histograms = NULL;
+    }
+
+    if (deviceExtension->TraceRings != NULL) {
+        ExFreePool(deviceExtension->TraceRings);
+        deviceExtension->TraceRings = NULL;
+    }
+
     IoDeleteDevice(DeviceObject);
 
     //
@@ -1129,6 +1309,7 @@ Return Value:
     PDISK_PERFORMANCE  partitionCounters = NULL;
     LONG               queueLen;
     PLARGE_INTEGER     timeStamp;
+    ULONG              length = currentIrpStack->Parameters.Read.Length;
 
     if (deviceExtension->DiskCounters != NULL) {
         partitionCounters = (PDISK_PERFORMANCE)
@@ -1174,12 +1355,13 @@ Return Value:
     }
 
     //
-    // Set completion routine callback.
+    // Set completion routine callback. The time stamp overwrites the
+    // length in our stack location, so pass it as the context for tracing.
     //
 
     IoSetCompletionRoutine(Irp,
                            DiskPerfIoCompletion,
-                           DeviceObject,
+                           (PVOID)(ULONG_PTR) length,
                            TRUE,
                            TRUE,
                            TRUE);
@@ -1213,7 +1395,7 @@ Arguments:
 
     DeviceObject - for the IRP.
     Irp          - The I/O request that just completed.
-    Context      - Not used.
+    Context      - Length of the request.
 
 Return Value:
 
@@ -1229,8 +1411,9 @@ Return Value:
     PLARGE_INTEGER     difference;
     KIRQL              currentIrql;
     LONG               queueLen;
-
-    UNREFERENCED_PARAMETER(Context);
+    PDISKPERF_HISTOGRAM histogram;
+    ULONG              direction;
+    ULONG              sizeClass;
 
     //
     // Get the per processor partition counters
@@ -1328,6 +1511,42 @@ Return Value:
         partitionCounters->SplitCount++;
     }
 
+    //
+    // Count the request in this processor's latency histogram. Like the
+    // counters above the histogram is only ever updated from its own
+    // processor, so no interlocked operations are needed.
+    //
+
+    histogram = deviceExtension->Histograms;
+
+    if (deviceExtension->HistogramsEnabled > 0 && histogram != NULL) {
+
+        histogram += (ULONG)KeGetCurrentProcessorNumber();
+
+        direction = (irpStack->MajorFunction == IRP_MJ_READ) ?
+                        DISKPERF_READ : DISKPERF_WRITE;
+
+        for (sizeClass = 0;
+             sizeClass < DISKPERF_SIZE_CLASSES - 1 &&
+             Irp->IoStatus.Information > DiskPerfSizeClassLimit[sizeClass];
+             sizeClass++) {
+            NOTHING;
+        }
+
+        histogram->Buckets[direction][sizeClass]
+            [DiskPerfLatencyBucket(difference->QuadPart)]++;
+    }
+
+    if (deviceExtension->TraceEnabled) {
+        DiskPerfTraceRequest(deviceExtension,
+                             Irp,
+                             irpStack,
+                             (ULONG)(ULONG_PTR) Context,
+                             timeStampComplete,
+                             *difference,
+                             queueLen + 1);
+    }
+
     if (Irp->PendingReturned) {
         IoMarkIrpPending(Irp);
     }
@@ -1347,7 +1566,8 @@ DiskPerfDeviceControl(
 Routine Description:
 
     This device control dispatcher handles only the disk performance
-    device control. All others are passed down to the disk drivers.
+    and trace device controls. All others are passed down to the disk
+    drivers.
     The disk performane device control returns a current snapshot of
     the performance data.
 
@@ -1476,6 +1696,22 @@ Return Value:
 
     }
 
+    else if (currentIrpStack->Parameters.DeviceIoControl.IoControlCode ==
+                IOCTL_DISKPERF_START_TRACE ||
+             currentIrpStack->Parameters.DeviceIoControl.IoControlCode ==
+                IOCTL_DISKPERF_STOP_TRACE ||
+             currentIrpStack->Parameters.DeviceIoControl.IoControlCode ==
+                IOCTL_DISKPERF_READ_TRACE) {
+
+        NTSTATUS status;
+
+        status = DiskPerfTraceControl(DeviceObject, Irp);
+
+        Irp->IoStatus.Status = status;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return status;
+    }
+
     else {
 
         //
@@ -2027,6 +2263,7 @@ Return Value:
 
         *RegFlags = WMIREG_FLAG_INSTANCE_PDO | WMIREG_FLAG_EXPENSIVE;
         *Pdo = deviceExtension->PhysicalDeviceObject;
+        RtlInitUnicodeString(MofResourceName, DISKPERF_MOF_RESOURCE);
         status = STATUS_SUCCESS;
     } else {
         status = STATUS_INSUFFICIENT_RESOURCES;
@@ -2094,6 +2331,7 @@ Return Value:
     PDISK_PERFORMANCE totalCounters;
     PDISK_PERFORMANCE diskCounters;
     PWMI_DISK_PERFORMANCE diskPerformance;
+    PWMI_DISK_LATENCY diskLatency;
     ULONG deviceNameSize;
     PWCHAR diskNamePtr;
 
@@ -2101,7 +2339,7 @@ Return Value:
 
     deviceExtension = DeviceObject->DeviceExtension;
 
-    if (GuidIndex == 0)
+    if (GuidIndex == DISKPERF_GUID_INDEX_PERFORMANCE)
     {
         deviceNameSize = deviceExtension->PhysicalDeviceName.Length +
                          sizeof(USHORT);
@@ -2187,6 +2425,46 @@ Return Value:
             status = STATUS_BUFFER_TOO_SMALL;
         }
 
+    } else if (GuidIndex == DISKPERF_GUID_INDEX_LATENCY) {
+        sizeNeeded = sizeof(WMI_DISK_LATENCY);
+        if (deviceExtension->Histograms == NULL)
+        {
+            status = STATUS_UNSUCCESSFUL;
+        }
+        else if (BufferAvail >= sizeNeeded)
+        {
+            ULONG i;
+            LARGE_INTEGER frequency;
+
+#ifdef USE_PERF_CTR
+            KeQueryPerformanceCounter(&frequency);
+#else
+            frequency.QuadPart = 10000000;
+#endif
+            diskLatency = (PWMI_DISK_LATENCY)Buffer;
+            RtlZeroMemory(diskLatency, sizeof(WMI_DISK_LATENCY));
+
+            diskLatency->StorageDeviceNumber = deviceExtension->DiskNumber;
+            for (i = 0; i < DISKPERF_SIZE_CLASSES; i++) {
+                diskLatency->SizeClassLimit[i] = DiskPerfSizeClassLimit[i];
+                DiskPerfQueryPercentiles(deviceExtension,
+                                         DISKPERF_READ,
+                                         i,
+                                         frequency,
+                                         &diskLatency->Read[i]);
+                DiskPerfQueryPercentiles(deviceExtension,
+                                         DISKPERF_WRITE,
+                                         i,
+                                         frequency,
+                                         &diskLatency->Write[i]);
+            }
+            *InstanceLengthArray = sizeNeeded;
+
+            status = STATUS_SUCCESS;
+        } else {
+            status = STATUS_BUFFER_TOO_SMALL;
+        }
+
     } else {
         status = STATUS_WMI_GUID_NOT_FOUND;
         sizeNeeded = 0;
@@ -2242,42 +2520,42 @@ Return Value:
 {
     NTSTATUS status;
     PDEVICE_EXTENSION deviceExtension;
-    ULONG i;
 
     deviceExtension = DeviceObject->DeviceExtension;
 
-    if (GuidIndex == 0)
+    if (GuidIndex == DISKPERF_GUID_INDEX_PERFORMANCE)
     {
         if (Function == WmiDataBlockControl) {
           if (Enable) {
-             if (InterlockedIncrement(&deviceExtension->CountersEnabled) == 1) {
-                //
-                // Reset per processor counters to 0
-                //
-                if (deviceExtension->DiskCounters != NULL) {
-                    RtlZeroMemory(
-                        deviceExtension->DiskCounters,
-                        PROCESSOR_COUNTERS_SIZE * deviceExtension->Processors);
-                }
-                DiskPerfGetClock(deviceExtension->LastIdleClock, NULL);
-                DebugPrint((10,
-                    "DiskPerfWmiFunctionControl: LIC=%I64u\n",
-                    deviceExtension->LastIdleClock));
-                deviceExtension->QueueDepth = 0;
-                DebugPrint((3, "DiskPerfWmi: Counters enabled %d\n",
-                                deviceExtension->CountersEnabled));
+             DiskPerfEnableCounters(deviceExtension);
+          } else {
+             DiskPerfDisableCounters(deviceExtension);
+          }
+        }
+        status = STATUS_SUCCESS;
+    } else if (GuidIndex == DISKPERF_GUID_INDEX_LATENCY) {
+        status = STATUS_SUCCESS;
+        if (Function == WmiDataBlockControl) {
+
+          //
+          // Latencies are measured from the time stamps taken for the
+          // counters, so the counters are enabled along with the histograms
+          //
+
+          if (Enable) {
+             status = DiskPerfEnableHistograms(deviceExtension);
+             if (NT_SUCCESS(status)) {
+                DiskPerfEnableCounters(deviceExtension);
              }
           } else {
-             if (InterlockedDecrement(&deviceExtension->CountersEnabled)
+             if (InterlockedDecrement(&deviceExtension->HistogramsEnabled)
                   <= 0) {
-                deviceExtension->CountersEnabled = 0;
-                deviceExtension->QueueDepth = 0;
-                DebugPrint((3, "DiskPerfWmi: Counters disabled %d\n",
-                                deviceExtension->CountersEnabled));
-            }
+                deviceExtension->HistogramsEnabled = 0;
+                DebugPrint((3, "DiskPerfWmi: Histograms disabled\n"));
+             }
+             DiskPerfDisableCounters(deviceExtension);
           }
         }
-        status = STATUS_SUCCESS;
     } else {
         status = STATUS_WMI_GUID_NOT_FOUND;
     }
@@ -2322,6 +2600,589 @@ DiskPerfAddCounters(
     }
 }
 
+VOID
+DiskPerfEnableCounters(
+    IN PDEVICE_EXTENSION DeviceExtension
+    )
+/*++
+
+Routine Description:
+
+    Take a reference on counter collection for the device. The per
+    processor counters are reset when the first reference is taken.
+
+Arguments:
+
+    DeviceExtension - Extension of the device to collect counters for.
+
+Return Value:
+
+    None
+
+--*/
+{
+    if (InterlockedIncrement(&DeviceExtension->CountersEnabled) == 1) {
+        //
+        // Reset per processor counters to 0
+        //
+        if (DeviceExtension->DiskCounters != NULL) {
+            RtlZeroMemory(
+                DeviceExtension->DiskCounters,
+                PROCESSOR_COUNTERS_SIZE * DeviceExtension->Processors);
+        }
+        DiskPerfGetClock(DeviceExtension->LastIdleClock, NULL);
+        DebugPrint((10,
+            "DiskPerfEnableCounters: LIC=%I64u\n",
+            DeviceExtension->LastIdleClock));
+        DeviceExtension->QueueDepth = 0;
+        DebugPrint((3, "DiskPerfWmi: Counters enabled %d\n",
+                        DeviceExtension->CountersEnabled));
+    }
+}
+
+
+VOID
+DiskPerfDisableCounters(
+    IN PDEVICE_EXTENSION DeviceExtension
+    )
+/*++
+
+Routine Description:
+
+    Drop a reference on counter collection for the device taken by
+    DiskPerfEnableCounters.
+
+Arguments:
+
+    DeviceExtension - Extension of the device.
+
+Return Value:
+
+    None
+
+--*/
+{
+    if (InterlockedDecrement(&DeviceExtension->CountersEnabled) <= 0) {
+        DeviceExtension->CountersEnabled = 0;
+        DeviceExtension->QueueDepth = 0;
+        DebugPrint((3, "DiskPerfWmi: Counters disabled %d\n",
+                        DeviceExtension->CountersEnabled));
+    }
+}
+
+
+NTSTATUS
+DiskPerfEnableHistograms(
+    IN PDEVICE_EXTENSION DeviceExtension
+    )
+/*++
+
+Routine Description:
+
+    Take a reference on latency histogram collection for the device,
+    allocating the per processor histograms the first time through. The
+    histograms are reset when the first reference is taken.
+
+    The histograms are kept until the device is removed, so that the
+    completion routine never has to synchronize with them being freed.
+
+Arguments:
+
+    DeviceExtension - Extension of the device to collect latencies for.
+
+Return Value:
+
+    STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES.
+
+--*/
+{
+    PDISKPERF_HISTOGRAM histograms;
+    ULONG size;
+
+    PAGED_CODE();
+
+    size = sizeof(DISKPERF_HISTOGRAM) * DeviceExtension->Processors;
+
+    if (DeviceExtension->Histograms == NULL) {
+
+        histograms = (PDISKPERF_HISTOGRAM) ExAllocatePool(NonPagedPool, size);
+        if (histograms == NULL) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        RtlZeroMemory(histograms, size);
+
+        if (InterlockedCompareExchangePointer(&DeviceExtension->Histograms,
+                                              histograms,
+                                              NULL) != NULL) {
+            ExFreePool(histograms);
+        }
+    }
+
+    if (InterlockedIncrement(&DeviceExtension->HistogramsEnabled) == 1) {
+        RtlZeroMemory(DeviceExtension->Histograms, size);
+        DebugPrint((3, "DiskPerfWmi: Histograms enabled\n"));
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+ULONG
+DiskPerfLatencyBucket(
+    IN LONGLONG Ticks
+    )
+/*++
+
+Routine Description:
+
+    Map a latency to its histogram bucket. The first DISKPERF_SUB_BUCKETS
+    buckets hold one tick each; after that each power of two is split into
+    DISKPERF_SUB_BUCKETS buckets by the bits below the highest set bit.
+
+Arguments:
+
+    Ticks - Latency in clock ticks.
+
+Return Value:
+
+    Bucket index, less than DISKPERF_LATENCY_BUCKETS.
+
+--*/
+{
+    ULONGLONG value;
+    ULONG highBit;
+    ULONG bucket;
+
+    if (Ticks < DISKPERF_SUB_BUCKETS) {
+        return (Ticks > 0) ? (ULONG)Ticks : 0;
+    }
+
+    //
+    // Find the highest set bit
+    //
+
+    value = (ULONGLONG)Ticks;
+    highBit = 0;
+
+    if (value >> 32) { value >>= 32; highBit += 32; }
+    if (value >> 16) { value >>= 16; highBit += 16; }
+    if (value >> 8)  { value >>= 8;  highBit += 8;  }
+    if (value >> 4)  { value >>= 4;  highBit += 4;  }
+    if (value >> 2)  { value >>= 2;  highBit += 2;  }
+    if (value >> 1)  {               highBit += 1;  }
+
+    bucket = ((highBit - DISKPERF_SUB_BUCKET_SHIFT + 1)
+                << DISKPERF_SUB_BUCKET_SHIFT) +
+             (ULONG)(((ULONGLONG)Ticks >> (highBit - DISKPERF_SUB_BUCKET_SHIFT))
+                & (DISKPERF_SUB_BUCKETS - 1));
+
+    if (bucket >= DISKPERF_LATENCY_BUCKETS) {
+        bucket = DISKPERF_LATENCY_BUCKETS - 1;
+    }
+
+    return bucket;
+}
+
+
+VOID
+DiskPerfQueryPercentiles(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONG Direction,
+    IN ULONG SizeClass,
+    IN LARGE_INTEGER Frequency,
+    OUT PWMI_DISK_LATENCY_PERCENTILES Percentiles
+    )
+/*++
+
+Routine Description:
+
+    Merge the per processor histograms for one direction and size class
+    and compute the median, 99th and 99.9th percentile latencies.
+
+Arguments:
+
+    DeviceExtension - Extension of the device, with histograms allocated.
+
+    Direction - DISKPERF_READ or DISKPERF_WRITE.
+
+    SizeClass - Transfer size class.
+
+    Frequency - Frequency of the clock the latencies were measured with.
+
+    Percentiles - Returns the request count and percentiles, in
+        microseconds.
+
+Return Value:
+
+    None
+
+--*/
+{
+    static const ULONG permille[3] = { 500, 990, 999 };
+    ULONG buckets[DISKPERF_LATENCY_BUCKETS];
+    ULONG latency[3];
+    PDISKPERF_HISTOGRAM histogram;
+    ULONGLONG total;
+    ULONGLONG target;
+    ULONGLONG running;
+    ULONGLONG limit;
+    ULONG next;
+    ULONG i;
+    ULONG j;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(buckets, sizeof(buckets));
+    RtlZeroMemory(latency, sizeof(latency));
+
+    histogram = DeviceExtension->Histograms;
+    for (i = 0; i < DeviceExtension->Processors; i++, histogram++) {
+        for (j = 0; j < DISKPERF_LATENCY_BUCKETS; j++) {
+            buckets[j] += histogram->Buckets[Direction][SizeClass][j];
+        }
+    }
+
+    total = 0;
+    for (j = 0; j < DISKPERF_LATENCY_BUCKETS; j++) {
+        total += buckets[j];
+    }
+
+    running = 0;
+    next = 0;
+
+    for (j = 0; j < DISKPERF_LATENCY_BUCKETS && next < 3 && total != 0; j++) {
+
+        running += buckets[j];
+
+        //
+        // Report the exclusive upper bound of the bucket, converted from
+        // clock ticks to microseconds
+        //
+
+        if (j < DISKPERF_SUB_BUCKETS) {
+            limit = j + 1;
+        } else {
+            limit = (ULONGLONG)(DISKPERF_SUB_BUCKETS + (j & (DISKPERF_SUB_BUCKETS - 1)) + 1)
+                        << ((j >> DISKPERF_SUB_BUCKET_SHIFT) - 1);
+        }
+
+        if (Frequency.QuadPart > 0) {
+            limit = (limit * 1000000 + Frequency.QuadPart - 1) /
+                        Frequency.QuadPart;
+        }
+
+        while (next < 3) {
+            target = (total * permille[next] + 999) / 1000;
+            if (running < target) {
+                break;
+            }
+            latency[next++] = (limit > 0xFFFFFFFF) ? 0xFFFFFFFF : (ULONG)limit;
+        }
+    }
+
+    Percentiles->RequestCount = (total > 0xFFFFFFFF) ? 0xFFFFFFFF : (ULONG)total;
+    Percentiles->Median = latency[0];
+    Percentiles->Percentile99 = latency[1];
+    Percentiles->Percentile999 = latency[2];
+}
+
+VOID
+DiskPerfTraceRequest(
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PIRP Irp,
+    IN PIO_STACK_LOCATION IrpStack,
+    IN ULONG Length,
+    IN LARGE_INTEGER CompleteTime,
+    IN LARGE_INTEGER Latency,
+    IN LONG QueueDepth
+    )
+/*++
+
+Routine Description:
+
+    Record a completed request in the current processor's trace ring. If
+    the ring is full the request is counted as dropped.
+
+    This is called from the completion routine, at IRQL <= DISPATCH_LEVEL.
+    Another completion on this processor can preempt us at passive level,
+    so slots are reserved with an interlocked operation even though the
+    ring is only written from one processor.
+
+Arguments:
+
+    DeviceExtension - Extension of the device, with tracing enabled.
+
+    Irp - The request that completed.
+
+    IrpStack - Our stack location for the request.
+
+    Length - Length of the request.
+
+    CompleteTime - Time the request completed.
+
+    Latency - Time from issue to completion.
+
+    QueueDepth - Requests outstanding when this one completed, including
+        itself.
+
+Return Value:
+
+    None
+
+--*/
+{
+    PDISKPERF_TRACE_RING ring;
+    PDISKPERF_TRACE_SLOT slot;
+    ULONG head;
+
+    ring = (PDISKPERF_TRACE_RING)
+           (DeviceExtension->TraceRings +
+                ((ULONG)KeGetCurrentProcessorNumber() *
+                    DISKPERF_TRACE_RING_SIZE(DeviceExtension->TraceRingSize)));
+
+    do {
+        head = ring->Head;
+        if (head - ring->Tail >= DeviceExtension->TraceRingSize) {
+            InterlockedIncrement(&ring->Dropped);
+            return;
+        }
+    } while ((ULONG)InterlockedCompareExchange((PLONG)&ring->Head,
+                                               (LONG)(head + 1),
+                                               (LONG)head) != head);
+
+    slot = &ring->Slots[head & (DeviceExtension->TraceRingSize - 1)];
+
+    slot->Record.ByteOffset = IrpStack->Parameters.Read.ByteOffset;
+    slot->Record.IssueTime.QuadPart = CompleteTime.QuadPart - Latency.QuadPart;
+    slot->Record.CompleteTime = CompleteTime;
+    slot->Record.Length = Length;
+    slot->Record.QueueDepth = (USHORT)
+        ((QueueDepth > MAXUSHORT) ? MAXUSHORT : QueueDepth);
+    slot->Record.Direction = (IrpStack->MajorFunction == IRP_MJ_READ) ?
+                                DISKPERF_TRACE_READ : DISKPERF_TRACE_WRITE;
+    slot->Record.Flags = 0;
+
+    if (!NT_SUCCESS(Irp->IoStatus.Status)) {
+        slot->Record.Flags |= DISKPERF_TRACE_FAILED;
+    }
+    if (Irp->Flags & IRP_ASSOCIATED_IRP) {
+        slot->Record.Flags |= DISKPERF_TRACE_SPLIT;
+    }
+
+    //
+    // Publish the record
+    //
+
+    InterlockedExchange((PLONG)&slot->Sequence, (LONG)(head + 1));
+}
+
+
+NTSTATUS
+DiskPerfTraceControl(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp
+    )
+/*++
+
+Routine Description:
+
+    Handle the trace device controls: start and stop tracing, and read
+    the records collected so far out of the per processor rings.
+
+    Starting tracing allocates the rings the first time through, discards
+    anything left in them from an earlier trace and takes a reference on
+    the counters, since the trace uses their time stamps. Stopping leaves
+    the records in the rings so the reader can drain them. The rings are
+    kept until the device is removed, so the completion routine never has
+    to synchronize with them being freed.
+
+Arguments:
+
+    DeviceObject - Context for the activity.
+    Irp          - The device control argument block.
+
+Return Value:
+
+    Status is returned, Irp->IoStatus.Information is set but the request
+    is not completed.
+
+--*/
+{
+    PDEVICE_EXTENSION  deviceExtension = DeviceObject->DeviceExtension;
+    PIO_STACK_LOCATION currentIrpStack = IoGetCurrentIrpStackLocation(Irp);
+    PDISKPERF_TRACE_START traceStart;
+    PDISKPERF_TRACE_DATA traceData;
+    PDISKPERF_TRACE_RING ring;
+    PDISKPERF_TRACE_SLOT slot;
+    NTSTATUS status;
+    ULONG records;
+    ULONG capacity;
+    ULONG count;
+    ULONG tail;
+    ULONG i;
+
+    PAGED_CODE();
+
+    Irp->IoStatus.Information = 0;
+
+    KeWaitForSingleObject(&deviceExtension->TraceEvent,
+                          Executive,
+                          KernelMode,
+                          FALSE,
+                          NULL);
+
+    switch (currentIrpStack->Parameters.DeviceIoControl.IoControlCode) {
+
+        case IOCTL_DISKPERF_START_TRACE:
+
+            if (currentIrpStack->Parameters.DeviceIoControl.InputBufferLength <
+                    sizeof(DISKPERF_TRACE_START) ||
+                currentIrpStack->Parameters.DeviceIoControl.OutputBufferLength <
+                    sizeof(DISKPERF_TRACE_START)) {
+                status = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            traceStart = (PDISKPERF_TRACE_START) Irp->AssociatedIrp.SystemBuffer;
+
+            if (deviceExtension->TraceRings == NULL) {
+
+                //
+                // Round the ring size up to a power of two
+                //
+
+                records = traceStart->RecordsPerProcessor;
+                if (records == 0) {
+                    records = DISKPERF_TRACE_DEFAULT_RECORDS;
+                } else if (records > DISKPERF_TRACE_MAXIMUM_RECORDS) {
+                    records = DISKPERF_TRACE_MAXIMUM_RECORDS;
+                }
+                while (records & (records - 1)) {
+                    records = (records | (records - 1)) + 1;
+                }
+
+                deviceExtension->TraceRings = (PUCHAR) ExAllocatePool(
+                    NonPagedPool,
+                    DISKPERF_TRACE_RING_SIZE(records) *
+                        deviceExtension->Processors);
+
+                if (deviceExtension->TraceRings == NULL) {
+                    status = STATUS_INSUFFICIENT_RESOURCES;
+                    break;
+                }
+
+                RtlZeroMemory(deviceExtension->TraceRings,
+                              DISKPERF_TRACE_RING_SIZE(records) *
+                                deviceExtension->Processors);
+                deviceExtension->TraceRingSize = records;
+            }
+
+            if (!deviceExtension->TraceEnabled) {
+
+                for (i = 0; i < deviceExtension->Processors; i++) {
+                    ring = (PDISKPERF_TRACE_RING)
+                           (deviceExtension->TraceRings +
+                                i * DISKPERF_TRACE_RING_SIZE(
+                                        deviceExtension->TraceRingSize));
+                    ring->Tail = ring->Head;
+                    ring->Dropped = 0;
+                }
+
+                DiskPerfEnableCounters(deviceExtension);
+                InterlockedExchange(&deviceExtension->TraceEnabled, TRUE);
+                DebugPrint((3, "DiskPerfTraceControl: Tracing started\n"));
+            }
+
+            traceStart->RecordsPerProcessor = deviceExtension->TraceRingSize;
+            Irp->IoStatus.Information = sizeof(DISKPERF_TRACE_START);
+            status = STATUS_SUCCESS;
+            break;
+
+        case IOCTL_DISKPERF_STOP_TRACE:
+
+            if (deviceExtension->TraceEnabled) {
+                InterlockedExchange(&deviceExtension->TraceEnabled, FALSE);
+                DiskPerfDisableCounters(deviceExtension);
+                DebugPrint((3, "DiskPerfTraceControl: Tracing stopped\n"));
+            }
+            status = STATUS_SUCCESS;
+            break;
+
+        case IOCTL_DISKPERF_READ_TRACE:
+
+            if (currentIrpStack->Parameters.DeviceIoControl.OutputBufferLength <
+                    FIELD_OFFSET(DISKPERF_TRACE_DATA, Records)) {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            if (deviceExtension->TraceRings == NULL) {
+                status = STATUS_INVALID_DEVICE_STATE;
+                break;
+            }
+
+            traceData = (PDISKPERF_TRACE_DATA) Irp->AssociatedIrp.SystemBuffer;
+            RtlZeroMemory(traceData, FIELD_OFFSET(DISKPERF_TRACE_DATA, Records));
+
+#ifdef USE_PERF_CTR
+            KeQueryPerformanceCounter(&traceData->Frequency);
+#else
+            traceData->Frequency.QuadPart = 10000000;
+#endif
+            traceData->DiskNumber = deviceExtension->DiskNumber;
+
+            capacity = (currentIrpStack->Parameters.DeviceIoControl.OutputBufferLength -
+                            FIELD_OFFSET(DISKPERF_TRACE_DATA, Records)) /
+                       sizeof(DISKPERF_TRACE_RECORD);
+            count = 0;
+
+            for (i = 0; i < deviceExtension->Processors; i++) {
+
+                ring = (PDISKPERF_TRACE_RING)
+                       (deviceExtension->TraceRings +
+                            i * DISKPERF_TRACE_RING_SIZE(
+                                    deviceExtension->TraceRingSize));
+
+                traceData->DroppedCount += InterlockedExchange(&ring->Dropped, 0);
+
+                //
+                // Copy out published records, stopping at the first one
+                // that is still being filled in
+                //
+
+                for (tail = ring->Tail;
+                     tail != ring->Head && count < capacity;
+                     tail++) {
+
+                    slot = &ring->Slots[tail & (deviceExtension->TraceRingSize - 1)];
+                    if (slot->Sequence != tail + 1) {
+                        break;
+                    }
+                    KeMemoryBarrier();
+
+                    traceData->Records[count++] = slot->Record;
+                }
+
+                InterlockedExchange((PLONG)&ring->Tail, (LONG)tail);
+            }
+
+            traceData->RecordCount = count;
+            Irp->IoStatus.Information =
+                FIELD_OFFSET(DISKPERF_TRACE_DATA, Records) +
+                    count * sizeof(DISKPERF_TRACE_RECORD);
+            status = STATUS_SUCCESS;
+            break;
+
+        default:
+            status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+    }
+
+    KeSetEvent(&deviceExtension->TraceEvent, IO_NO_INCREMENT, FALSE);
+
+    return status;
+}
+
 #if DBG
 
 VOID
@@ -0,0 +1,112 @@
+/*++
+
+Copyright (C) Microsoft Corporation, 2002
+
+Module Name:
+
+    dptrace.h
+
+Abstract:
+
+    Definitions shared between the disk performance driver and the user
+    mode tools that capture and replay its I/O traces.
+
+    While tracing is on, diskperf records every read and write that
+    completes on a disk in a ring per processor. A reader drains the rings
+    with IOCTL_DISKPERF_READ_TRACE and writes the records to a trace file:
+    a DISKPERF_TRACE_FILE_HEADER followed by DISKPERF_TRACE_RECORDs.
+
+Environment:
+
+    kernel and user mode
+
+Notes:
+
+--*/
+
+#ifndef _DPTRACE_H_
+#define _DPTRACE_H_
+
+//
+// Trace control codes. These are sent to the disk device and handled by
+// diskperf on the way down; if diskperf is not loaded the disk driver
+// fails them.
+//
+// IOCTL_DISKPERF_START_TRACE
+//      Input and output: DISKPERF_TRACE_START
+//
+// IOCTL_DISKPERF_STOP_TRACE
+//      No input or output.
+//
+// IOCTL_DISKPERF_READ_TRACE
+//      Output: DISKPERF_TRACE_DATA with as many records as fit.
+//
+
+#define IOCTL_DISKPERF_START_TRACE  CTL_CODE(IOCTL_DISK_BASE, 0x0C00, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_DISKPERF_STOP_TRACE   CTL_CODE(IOCTL_DISK_BASE, 0x0C01, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_DISKPERF_READ_TRACE   CTL_CODE(IOCTL_DISK_BASE, 0x0C02, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+//
+// Ring sizes, in records per processor. The driver rounds the requested
+// size up to a power of two. The rings are allocated the first time
+// tracing is started and keep their size until the device is removed.
+//
+
+#define DISKPERF_TRACE_DEFAULT_RECORDS  4096
+#define DISKPERF_TRACE_MAXIMUM_RECORDS  (64 * 1024)
+
+typedef struct _DISKPERF_TRACE_START {
+    ULONG RecordsPerProcessor;
+} DISKPERF_TRACE_START, *PDISKPERF_TRACE_START;
+
+//
+// One completed request. Times are in ticks of the clock reported in
+// DISKPERF_TRACE_DATA; QueueDepth is the number of requests outstanding
+// on the device when this one completed, including itself.
+//
+
+#define DISKPERF_TRACE_READ         0
+#define DISKPERF_TRACE_WRITE        1
+
+#define DISKPERF_TRACE_FAILED       0x01
+#define DISKPERF_TRACE_SPLIT        0x02
+
+typedef struct _DISKPERF_TRACE_RECORD {
+    LARGE_INTEGER ByteOffset;
+    LARGE_INTEGER IssueTime;
+    LARGE_INTEGER CompleteTime;
+    ULONG Length;
+    USHORT QueueDepth;
+    UCHAR Direction;
+    UCHAR Flags;
+} DISKPERF_TRACE_RECORD, *PDISKPERF_TRACE_RECORD;
+
+typedef struct _DISKPERF_TRACE_DATA {
+    LARGE_INTEGER Frequency;
+    ULONG DiskNumber;
+    ULONG RecordCount;
+    ULONG DroppedCount;
+    ULONG Reserved;
+    DISKPERF_TRACE_RECORD Records[1];
+} DISKPERF_TRACE_DATA, *PDISKPERF_TRACE_DATA;
+
+//
+// Trace file header. Records from the different processors are written
+// in the order they were drained, not sorted by time.
+//
+
+#define DISKPERF_TRACE_SIGNATURE    'rTpD'
+#define DISKPERF_TRACE_VERSION      1
+
+typedef struct _DISKPERF_TRACE_FILE_HEADER {
+    ULONG Signature;
+    ULONG Version;
+    ULONG HeaderSize;
+    ULONG RecordSize;
+    LARGE_INTEGER Frequency;
+    ULONG DiskNumber;
+    ULONG DroppedCount;
+    ULONGLONG RecordCount;
+} DISKPERF_TRACE_FILE_HEADER, *PDISKPERF_TRACE_FILE_HEADER;
+
+#endif // _DPTRACE_H_
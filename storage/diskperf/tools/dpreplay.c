@@ -0,0 +1,576 @@
+/*++
+
+Copyright (C) Microsoft Corporation, 2002
+
+Module Name:
+
+    dpreplay.c
+
+Abstract:
+
+    Replay a disk performance trace captured by dptrace against a file or
+    a device, such as a ramdisk, and compare the latencies seen with the
+    ones in the trace.
+
+    Requests are issued in the order and, scaled by the speed factor, at
+    the times they were issued in the trace, with at most a fixed number
+    outstanding. Offsets beyond the end of the target wrap around. Writes
+    are skipped unless -w is given, since they destroy the target's data.
+
+    usage: dpreplay [-s speed] [-q depth] [-w] trace target
+
+Environment:
+
+    User mode
+
+Notes:
+
+--*/
+
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "dptrace.h"
+
+#define SECTOR_SIZE             512
+#define DEFAULT_QUEUE_DEPTH     64
+
+typedef struct _REPLAY_REQUEST {
+    OVERLAPPED Overlapped;
+    LARGE_INTEGER IssueTime;
+    struct _REPLAY_REQUEST* NextFree;
+} REPLAY_REQUEST, *PREPLAY_REQUEST;
+
+//
+// Options.
+//
+
+double Speed = 1.0;
+ULONG QueueDepth = DEFAULT_QUEUE_DEPTH;
+BOOL ReplayWrites = FALSE;
+PCSTR TraceName;
+PCSTR TargetName;
+
+//
+// Replay state.
+//
+
+DISKPERF_TRACE_FILE_HEADER Header;
+PDISKPERF_TRACE_RECORD Records;
+ULONG RecordCount;
+
+HANDLE Target;
+HANDLE Port;
+LONGLONG TargetSize;
+PVOID Buffer;
+
+PREPLAY_REQUEST Requests;
+PREPLAY_REQUEST FreeRequests;
+ULONG Outstanding;
+
+LARGE_INTEGER Frequency;
+PULONG TraceLatencies;
+PULONG ReplayLatencies;
+ULONG TraceCount;
+ULONG ReplayCount;
+ULONG SkippedCount;
+ULONG ErrorCount;
+
+
+VOID
+Usage(
+    )
+{
+    printf("usage: dpreplay [-s speed] [-q depth] [-w] trace target\n"
+           "\n"
+           "    -s  speed up (or, below 1, slow down) the trace by this factor;\n"
+           "        0 issues requests as fast as the queue depth allows (default 1)\n"
+           "    -q  most requests outstanding at once (default %d)\n"
+           "    -w  replay writes; without this they are skipped\n"
+           "    trace   trace file written by dptrace\n"
+           "    target  file or device to replay against, e.g. \\\\.\\R:\n",
+           DEFAULT_QUEUE_DEPTH);
+    exit(2);
+}
+
+
+VOID
+ParseArguments(
+    IN int argc,
+    IN char* argv[]
+    )
+{
+    int i;
+    int positional = 0;
+
+    for (i = 1; i < argc; i++) {
+
+        if (argv[i][0] == '-' || argv[i][0] == '/') {
+
+            if (tolower(argv[i][1]) == 'w') {
+                ReplayWrites = TRUE;
+                continue;
+            }
+
+            if (i + 1 >= argc) {
+                Usage();
+            }
+
+            switch (tolower(argv[i][1])) {
+                case 's': Speed = atof(argv[++i]); break;
+                case 'q': QueueDepth = atoi(argv[++i]); break;
+                default:
+                    Usage();
+            }
+            continue;
+        }
+
+        switch (positional++) {
+            case 0: TraceName = argv[i]; break;
+            case 1: TargetName = argv[i]; break;
+            default:
+                Usage();
+        }
+    }
+
+    if (positional != 2 || QueueDepth == 0 || Speed < 0) {
+        Usage();
+    }
+}
+
+
+int
+__cdecl
+CompareIssueTime(
+    const void* First,
+    const void* Second
+    )
+{
+    LONGLONG difference;
+
+    difference = ((PDISKPERF_TRACE_RECORD)First)->IssueTime.QuadPart -
+                 ((PDISKPERF_TRACE_RECORD)Second)->IssueTime.QuadPart;
+
+    return (difference < 0) ? -1 : (difference > 0);
+}
+
+
+int
+__cdecl
+CompareLatency(
+    const void* First,
+    const void* Second
+    )
+{
+    ULONG first = *(PULONG)First;
+    ULONG second = *(PULONG)Second;
+
+    return (first < second) ? -1 : (first > second);
+}
+
+
+VOID
+LoadTrace(
+    )
+/*++
+
+Routine Description:
+
+    Read the trace file into memory and sort the records by the time they
+    were issued; the reader writes them in the order they came out of the
+    per processor rings.
+
+--*/
+{
+    HANDLE file;
+    ULONG bytes;
+
+    file = CreateFileA(TraceName,
+                       GENERIC_READ,
+                       FILE_SHARE_READ,
+                       NULL,
+                       OPEN_EXISTING,
+                       FILE_FLAG_SEQUENTIAL_SCAN,
+                       NULL);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        printf("dpreplay: cannot open %s, error %d\n", TraceName, GetLastError());
+        exit(1);
+    }
+
+    if (!ReadFile(file, &Header, sizeof(Header), &bytes, NULL) ||
+        bytes != sizeof(Header) ||
+        Header.Signature != DISKPERF_TRACE_SIGNATURE ||
+        Header.Version != DISKPERF_TRACE_VERSION ||
+        Header.RecordSize != sizeof(DISKPERF_TRACE_RECORD) ||
+        Header.Frequency.QuadPart == 0 ||
+        Header.RecordCount > MAXLONG / sizeof(DISKPERF_TRACE_RECORD)) {
+
+        printf("dpreplay: %s is not a disk performance trace\n", TraceName);
+        exit(1);
+    }
+
+    RecordCount = (ULONG)Header.RecordCount;
+    Records = (PDISKPERF_TRACE_RECORD) malloc(RecordCount * sizeof(DISKPERF_TRACE_RECORD) + 1);
+    TraceLatencies = (PULONG) malloc(RecordCount * sizeof(ULONG) + 1);
+    ReplayLatencies = (PULONG) malloc(RecordCount * sizeof(ULONG) + 1);
+
+    if (Records == NULL || TraceLatencies == NULL || ReplayLatencies == NULL) {
+        printf("dpreplay: out of memory\n");
+        exit(1);
+    }
+
+    SetFilePointer(file, Header.HeaderSize, NULL, FILE_BEGIN);
+
+    if (!ReadFile(file,
+                  Records,
+                  RecordCount * sizeof(DISKPERF_TRACE_RECORD),
+                  &bytes,
+                  NULL) ||
+        bytes != RecordCount * sizeof(DISKPERF_TRACE_RECORD)) {
+
+        printf("dpreplay: %s is truncated\n", TraceName);
+        exit(1);
+    }
+
+    CloseHandle(file);
+
+    qsort(Records, RecordCount, sizeof(DISKPERF_TRACE_RECORD), CompareIssueTime);
+}
+
+
+VOID
+OpenTarget(
+    )
+{
+    GET_LENGTH_INFORMATION lengthInfo;
+    OVERLAPPED overlapped;
+    LARGE_INTEGER size;
+    ULONG maximumLength;
+    ULONG bytes;
+    ULONG i;
+
+    Target = CreateFileA(TargetName,
+                         ReplayWrites ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE,
+                         NULL,
+                         OPEN_EXISTING,
+                         FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED,
+                         NULL);
+
+    if (Target == INVALID_HANDLE_VALUE) {
+        printf("dpreplay: cannot open %s, error %d\n", TargetName, GetLastError());
+        exit(1);
+    }
+
+    //
+    // Devices report a size of zero, ask them for their length instead
+    //
+
+    if (GetFileSizeEx(Target, &size) && size.QuadPart != 0) {
+        TargetSize = size.QuadPart;
+    } else {
+        ZeroMemory(&overlapped, sizeof(overlapped));
+        overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+        if (overlapped.hEvent != NULL &&
+            (DeviceIoControl(Target,
+                             IOCTL_DISK_GET_LENGTH_INFO,
+                             NULL,
+                             0,
+                             &lengthInfo,
+                             sizeof(lengthInfo),
+                             &bytes,
+                             &overlapped) ||
+             GetLastError() == ERROR_IO_PENDING) &&
+            GetOverlappedResult(Target, &overlapped, &bytes, TRUE)) {
+
+            TargetSize = lengthInfo.Length.QuadPart;
+        }
+
+        if (overlapped.hEvent != NULL) {
+            CloseHandle(overlapped.hEvent);
+        }
+    }
+
+    TargetSize &= ~(LONGLONG)(SECTOR_SIZE - 1);
+
+    if (TargetSize == 0) {
+        printf("dpreplay: cannot get the size of %s\n", TargetName);
+        exit(1);
+    }
+
+    Port = CreateIoCompletionPort(Target, NULL, 0, 1);
+
+    if (Port == NULL) {
+        printf("dpreplay: cannot create completion port, error %d\n", GetLastError());
+        exit(1);
+    }
+
+    //
+    // Every request transfers to or from the same buffer; the data does
+    // not matter, only the shape of the I/O
+    //
+
+    maximumLength = SECTOR_SIZE;
+    for (i = 0; i < RecordCount; i++) {
+        maximumLength = max(maximumLength, Records[i].Length);
+    }
+    maximumLength = (maximumLength + SECTOR_SIZE - 1) & ~(SECTOR_SIZE - 1);
+
+    Buffer = VirtualAlloc(NULL, maximumLength, MEM_COMMIT, PAGE_READWRITE);
+    Requests = (PREPLAY_REQUEST) malloc(QueueDepth * sizeof(REPLAY_REQUEST));
+
+    if (Buffer == NULL || Requests == NULL) {
+        printf("dpreplay: out of memory\n");
+        exit(1);
+    }
+
+    FreeRequests = NULL;
+    for (i = 0; i < QueueDepth; i++) {
+        Requests[i].NextFree = FreeRequests;
+        FreeRequests = &Requests[i];
+    }
+}
+
+
+VOID
+WaitForCompletions(
+    IN ULONG Timeout
+    )
+/*++
+
+Routine Description:
+
+    Retire completed requests, waiting up to Timeout milliseconds for the
+    first one.
+
+--*/
+{
+    PREPLAY_REQUEST request;
+    LPOVERLAPPED overlapped;
+    LARGE_INTEGER now;
+    ULONG_PTR key;
+    ULONG bytes;
+    BOOL succeeded;
+
+    for (;;) {
+
+        overlapped = NULL;
+        succeeded = GetQueuedCompletionStatus(Port,
+                                              &bytes,
+                                              &key,
+                                              &overlapped,
+                                              Timeout);
+        if (overlapped == NULL) {
+            return;
+        }
+
+        QueryPerformanceCounter(&now);
+        request = CONTAINING_RECORD(overlapped, REPLAY_REQUEST, Overlapped);
+
+        if (succeeded) {
+            ReplayLatencies[ReplayCount++] = (ULONG)
+                ((now.QuadPart - request->IssueTime.QuadPart) *
+                    1000000 / Frequency.QuadPart);
+        } else {
+            ErrorCount++;
+        }
+
+        request->NextFree = FreeRequests;
+        FreeRequests = request;
+        Outstanding--;
+
+        Timeout = 0;
+    }
+}
+
+
+VOID
+Replay(
+    )
+{
+    PDISKPERF_TRACE_RECORD record;
+    PREPLAY_REQUEST request;
+    LARGE_INTEGER start;
+    LARGE_INTEGER now;
+    LONGLONG due;
+    LONGLONG offset;
+    ULONG length;
+    ULONG i;
+    BOOL succeeded;
+    double seconds;
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&start);
+
+    for (i = 0; i < RecordCount; i++) {
+
+        record = &Records[i];
+
+        if (record->Direction == DISKPERF_TRACE_WRITE && !ReplayWrites) {
+            SkippedCount++;
+            continue;
+        }
+
+        length = (record->Length + SECTOR_SIZE - 1) & ~(SECTOR_SIZE - 1);
+        if (length == 0 || length > TargetSize) {
+            SkippedCount++;
+            continue;
+        }
+
+        offset = record->ByteOffset.QuadPart % (TargetSize - length + 1);
+        offset &= ~(LONGLONG)(SECTOR_SIZE - 1);
+
+        TraceLatencies[TraceCount++] = (ULONG)
+            ((record->CompleteTime.QuadPart - record->IssueTime.QuadPart) *
+                1000000 / Header.Frequency.QuadPart);
+
+        //
+        // Wait until it is time to issue the request, retiring completed
+        // ones meanwhile
+        //
+
+        if (Speed > 0) {
+            due = start.QuadPart + (LONGLONG)
+                ((double)(record->IssueTime.QuadPart - Records[0].IssueTime.QuadPart) *
+                    Frequency.QuadPart / Header.Frequency.QuadPart / Speed);
+
+            for (;;) {
+                QueryPerformanceCounter(&now);
+                if (now.QuadPart >= due) {
+                    break;
+                }
+                WaitForCompletions((ULONG)((due - now.QuadPart) * 1000 / Frequency.QuadPart));
+            }
+        }
+
+        while (Outstanding >= QueueDepth) {
+            WaitForCompletions(INFINITE);
+        }
+
+        request = FreeRequests;
+        FreeRequests = request->NextFree;
+        Outstanding++;
+
+        ZeroMemory(&request->Overlapped, sizeof(OVERLAPPED));
+        request->Overlapped.Offset = (ULONG)offset;
+        request->Overlapped.OffsetHigh = (ULONG)(offset >> 32);
+
+        QueryPerformanceCounter(&request->IssueTime);
+
+        if (record->Direction == DISKPERF_TRACE_READ) {
+            succeeded = ReadFile(Target, Buffer, length, NULL, &request->Overlapped);
+        } else {
+            succeeded = WriteFile(Target, Buffer, length, NULL, &request->Overlapped);
+        }
+
+        //
+        // Requests that complete right away are still queued to the port
+        //
+
+        if (!succeeded && GetLastError() != ERROR_IO_PENDING) {
+            ErrorCount++;
+            request->NextFree = FreeRequests;
+            FreeRequests = request;
+            Outstanding--;
+        }
+    }
+
+    while (Outstanding != 0) {
+        WaitForCompletions(INFINITE);
+    }
+
+    QueryPerformanceCounter(&now);
+    seconds = (double)(now.QuadPart - start.QuadPart) / Frequency.QuadPart;
+
+    printf("%d requests replayed in %.2f seconds, %.0f per second; "
+           "%d skipped, %d failed\n",
+           ReplayCount,
+           seconds,
+           seconds > 0 ? ReplayCount / seconds : 0.0,
+           SkippedCount,
+           ErrorCount);
+}
+
+
+VOID
+PrintLatencies(
+    IN PCSTR Name,
+    IN PULONG Latencies,
+    IN ULONG Count
+    )
+{
+    ULONGLONG total;
+    ULONG i;
+
+    if (Count == 0) {
+        printf("%-8s no requests\n", Name);
+        return;
+    }
+
+    qsort(Latencies, Count, sizeof(ULONG), CompareLatency);
+
+    total = 0;
+    for (i = 0; i < Count; i++) {
+        total += Latencies[i];
+    }
+
+    printf("%-8s %10d %10I64u %10d %10d %10d %10d\n",
+           Name,
+           Count,
+           total / Count,
+           Latencies[(Count - 1) / 2],
+           Latencies[(ULONG)((Count - 1) * 0.99)],
+           Latencies[(ULONG)((Count - 1) * 0.999)],
+           Latencies[Count - 1]);
+}
+
+
+int
+__cdecl
+main(
+    int argc,
+    char* argv[]
+    )
+{
+    ParseArguments(argc, argv);
+
+    LoadTrace();
+
+    if (RecordCount == 0) {
+        printf("dpreplay: %s has no records\n", TraceName);
+        return 1;
+    }
+
+    OpenTarget();
+
+    printf("Replaying %d requests from disk %d against %s, "
+           "speed %.2f, queue depth %d%s\n",
+           RecordCount,
+           Header.DiskNumber,
+           TargetName,
+           Speed,
+           QueueDepth,
+           ReplayWrites ? "" : ", reads only");
+
+    if (Header.DroppedCount != 0) {
+        printf("Warning: %d requests were dropped from the trace\n",
+               Header.DroppedCount);
+    }
+
+    Replay();
+
+    printf("\nlatency, microseconds\n");
+    printf("           requests       mean     median        99%%      99.9%%        max\n");
+    PrintLatencies("traced", TraceLatencies, TraceCount);
+    PrintLatencies("replayed", ReplayLatencies, ReplayCount);
+
+    CloseHandle(Port);
+    CloseHandle(Target);
+
+    return ErrorCount != 0;
+}
@@ -0,0 +1,325 @@
+/*++
+
+Copyright (C) Microsoft Corporation, 2002
+
+Module Name:
+
+    dptrace.c
+
+Abstract:
+
+    Capture an I/O trace of a disk through the disk performance driver.
+
+    Tracing is started on the disk, the per processor trace rings are
+    drained periodically into a trace file until the time runs out or the
+    user hits Ctrl-C, and tracing is stopped again. The trace can be
+    replayed with dpreplay.
+
+    usage: dptrace [-r records] [-t seconds] [-i milliseconds] disk file
+
+Environment:
+
+    User mode
+
+Notes:
+
+    diskperf must be installed as an upper filter of the disk.
+
+--*/
+
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "dptrace.h"
+
+#define TRACE_BUFFER_SIZE       (1024 * 1024)
+
+//
+// Options.
+//
+
+ULONG RecordsPerProcessor = DISKPERF_TRACE_DEFAULT_RECORDS;
+ULONG Duration = 0;
+ULONG Interval = 250;
+ULONG DiskNumber;
+PCSTR FileName;
+
+//
+// Trace state.
+//
+
+volatile BOOL Stop = FALSE;
+DISKPERF_TRACE_FILE_HEADER Header;
+PDISKPERF_TRACE_DATA TraceData;
+
+
+BOOL
+WINAPI
+CtrlHandler(
+    IN DWORD CtrlType
+    )
+{
+    if (CtrlType == CTRL_C_EVENT || CtrlType == CTRL_BREAK_EVENT) {
+        Stop = TRUE;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+
+VOID
+Usage(
+    )
+{
+    printf("usage: dptrace [-r records] [-t seconds] [-i milliseconds] disk file\n"
+           "\n"
+           "    -r  records in each processor's trace ring (default %d)\n"
+           "    -t  seconds to trace for (default: until Ctrl-C)\n"
+           "    -i  milliseconds between reads of the rings (default 250)\n"
+           "    disk  number of the physical drive to trace\n"
+           "    file  trace file to write\n",
+           DISKPERF_TRACE_DEFAULT_RECORDS);
+    exit(2);
+}
+
+
+VOID
+ParseArguments(
+    IN int argc,
+    IN char* argv[]
+    )
+{
+    int i;
+    int positional = 0;
+
+    for (i = 1; i < argc; i++) {
+
+        if (argv[i][0] == '-' || argv[i][0] == '/') {
+
+            if (i + 1 >= argc) {
+                Usage();
+            }
+
+            switch (tolower(argv[i][1])) {
+                case 'r': RecordsPerProcessor = atoi(argv[++i]); break;
+                case 't': Duration = atoi(argv[++i]); break;
+                case 'i': Interval = atoi(argv[++i]); break;
+                default:
+                    Usage();
+            }
+            continue;
+        }
+
+        switch (positional++) {
+            case 0: DiskNumber = atoi(argv[i]); break;
+            case 1: FileName = argv[i]; break;
+            default:
+                Usage();
+        }
+    }
+
+    if (positional != 2 || Interval == 0) {
+        Usage();
+    }
+}
+
+
+BOOL
+DrainTrace(
+    IN HANDLE Disk,
+    IN HANDLE File
+    )
+/*++
+
+Routine Description:
+
+    Read everything currently in the trace rings and append it to the
+    trace file.
+
+Return Value:
+
+    TRUE on success, FALSE if the rings could not be read or the file
+    could not be written.
+
+--*/
+{
+    ULONG capacity;
+    ULONG bytes;
+    ULONG written;
+
+    capacity = (TRACE_BUFFER_SIZE - FIELD_OFFSET(DISKPERF_TRACE_DATA, Records)) /
+               sizeof(DISKPERF_TRACE_RECORD);
+
+    do {
+        if (!DeviceIoControl(Disk,
+                             IOCTL_DISKPERF_READ_TRACE,
+                             NULL,
+                             0,
+                             TraceData,
+                             TRACE_BUFFER_SIZE,
+                             &bytes,
+                             NULL)) {
+            printf("dptrace: reading trace failed, error %d\n", GetLastError());
+            return FALSE;
+        }
+
+        Header.Frequency = TraceData->Frequency;
+        Header.DiskNumber = TraceData->DiskNumber;
+        Header.DroppedCount += TraceData->DroppedCount;
+        Header.RecordCount += TraceData->RecordCount;
+
+        if (TraceData->RecordCount != 0 &&
+            !WriteFile(File,
+                       TraceData->Records,
+                       TraceData->RecordCount * sizeof(DISKPERF_TRACE_RECORD),
+                       &written,
+                       NULL)) {
+            printf("dptrace: writing %s failed, error %d\n",
+                   FileName,
+                   GetLastError());
+            return FALSE;
+        }
+
+    } while (TraceData->RecordCount == capacity);
+
+    return TRUE;
+}
+
+
+int
+__cdecl
+main(
+    int argc,
+    char* argv[]
+    )
+{
+    CHAR diskName[32];
+    HANDLE disk;
+    HANDLE file;
+    DISKPERF_TRACE_START start;
+    ULONG bytes;
+    ULONG startTime;
+    BOOL succeeded;
+
+    ParseArguments(argc, argv);
+
+    TraceData = (PDISKPERF_TRACE_DATA) malloc(TRACE_BUFFER_SIZE);
+    if (TraceData == NULL) {
+        printf("dptrace: out of memory\n");
+        return 1;
+    }
+
+    sprintf(diskName, "\\\\.\\PhysicalDrive%d", DiskNumber);
+
+    disk = CreateFileA(diskName,
+                       GENERIC_READ,
+                       FILE_SHARE_READ | FILE_SHARE_WRITE,
+                       NULL,
+                       OPEN_EXISTING,
+                       0,
+                       NULL);
+
+    if (disk == INVALID_HANDLE_VALUE) {
+        printf("dptrace: cannot open %s, error %d\n", diskName, GetLastError());
+        return 1;
+    }
+
+    file = CreateFileA(FileName,
+                       GENERIC_WRITE,
+                       0,
+                       NULL,
+                       CREATE_ALWAYS,
+                       FILE_FLAG_SEQUENTIAL_SCAN,
+                       NULL);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        printf("dptrace: cannot create %s, error %d\n", FileName, GetLastError());
+        return 1;
+    }
+
+    //
+    // Leave room for the header, it is written once the counts are known
+    //
+
+    ZeroMemory(&Header, sizeof(Header));
+    Header.Signature = DISKPERF_TRACE_SIGNATURE;
+    Header.Version = DISKPERF_TRACE_VERSION;
+    Header.HeaderSize = sizeof(DISKPERF_TRACE_FILE_HEADER);
+    Header.RecordSize = sizeof(DISKPERF_TRACE_RECORD);
+
+    WriteFile(file, &Header, sizeof(Header), &bytes, NULL);
+
+    start.RecordsPerProcessor = RecordsPerProcessor;
+
+    if (!DeviceIoControl(disk,
+                         IOCTL_DISKPERF_START_TRACE,
+                         &start,
+                         sizeof(start),
+                         &start,
+                         sizeof(start),
+                         &bytes,
+                         NULL)) {
+        printf("dptrace: cannot start tracing on %s, error %d\n"
+               "         (is diskperf installed on this disk?)\n",
+               diskName,
+               GetLastError());
+        return 1;
+    }
+
+    printf("Tracing disk %d, %d records per processor, Ctrl-C to stop\n",
+           DiskNumber,
+           start.RecordsPerProcessor);
+
+    SetConsoleCtrlHandler(CtrlHandler, TRUE);
+    startTime = GetTickCount();
+    succeeded = TRUE;
+
+    while (!Stop && succeeded) {
+
+        Sleep(Interval);
+        succeeded = DrainTrace(disk, file);
+
+        if (Duration != 0 && GetTickCount() - startTime >= Duration * 1000) {
+            Stop = TRUE;
+        }
+    }
+
+    //
+    // Stop tracing, then pick up whatever completed in the meantime
+    //
+
+    DeviceIoControl(disk,
+                    IOCTL_DISKPERF_STOP_TRACE,
+                    NULL,
+                    0,
+                    NULL,
+                    0,
+                    &bytes,
+                    NULL);
+
+    if (succeeded) {
+        succeeded = DrainTrace(disk, file);
+    }
+
+    SetFilePointer(file, 0, NULL, FILE_BEGIN);
+    WriteFile(file, &Header, sizeof(Header), &bytes, NULL);
+
+    CloseHandle(file);
+    CloseHandle(disk);
+
+    printf("%I64u records written to %s, %d dropped\n",
+           Header.RecordCount,
+           FileName,
+           Header.DroppedCount);
+
+    if (Header.DroppedCount != 0) {
+        printf("Use a larger ring (-r) or a shorter interval (-i) "
+               "to avoid dropping records\n");
+    }
+
+    return succeeded ? 0 : 1;
+}
@@ -330,6 +330,7 @@ DECLARE_API(wmiperfclear)
     deviceExtension->WmiPerf.TimeStreaming     = 0;
     deviceExtension->WmiPerf.DataProcessed     = 0;
     deviceExtension->WmiPerf.StreamPausedCount = 0;
+    deviceExtension->WmiPerf.StreamUnderrunCount = 0;
 
     if(!WriteMemory(address, (PVOID)block, sizeof(REDBOOK_DEVICE_EXTENSION), &result)) {
         xdprintf(0, "Error writing redbook wmi data to address %p\n", address);
@@ -604,6 +605,14 @@ DumpRedBookWmiPerf(
              WmiPerf->DataProcessed,
              WmiPerf->StreamPausedCount
              );
+    xdprintf(Depth, "ReadLatency %I64x  ReadJitter %I64x\n",
+             WmiPerf->ReadLatency,
+             WmiPerf->ReadJitter
+             );
+    xdprintf(Depth, "ReadAheadDepth %x  StreamUnderrunCount %x\n",
+             WmiPerf->ReadAheadDepth,
+             WmiPerf->StreamUnderrunCount
+             );
     return;
 
 #if 0
@@ -775,6 +784,10 @@ DumpRedBookBufferData(
              Buffer->SilentBuffer,
              Buffer->SilentMdl
              );
+    xdprintf(Depth, "ReadAheadDepth %x  BuffersInUse %x\n",
+             Buffer->ReadAheadDepth,
+             Buffer->BuffersInUse
+             );
 
     dprintf("\n");
     xdprintf(Depth, "PRINTING %x BUFFERS (does it match?)\n", numBuf);
@@ -450,6 +450,18 @@ DECLARE_API(pdoext)
 
     dprintf ("OrbListDepth          = %d\n", ext.OrbListDepth);
     dprintf ("CurrentKey            = x%x\n", ext.CurrentKey);
+    dprintf ("OrbListDepthPeak      = %d\n", ext.OrbListDepthPeak);
+    dprintf ("OrbsSubmitted         = %d\n", ext.OrbsSubmitted);
+    dprintf ("OrbsCompleted         = %d\n", ext.OrbsCompleted);
+
+    if (ext.OrbsSubmitted)
+    {
+    dprintf ("  AvgOrbListDepth     = %I64d\n", ext.OrbListDepthTotal / ext.OrbsSubmitted);
+    }
+
+    dprintf ("OrbPoolEmptyCount     = %d\n", ext.OrbPoolEmptyCount);
+    dprintf ("OrbsSinceDepthCut     = %d\n", ext.OrbsSinceDepthCut);
+    dprintf ("BytesTransferred      = x%I64x\n", ext.BytesTransferred);
     dprintf ("LastFetchedContext    = x%p\n", ext.LastFetchedContext);
     dprintf ("NextContextToFree     = x%p\n", ext.NextContextToFree);
     dprintf ("DevicePowerState      = %d\n", (ULONG) ext.DevicePowerState);
@@ -393,6 +393,11 @@ ClassDumpFdoExtensionInternal(
      */
     ClassDumpTransferPacketLists(FdoDataAddr, Detail, Depth+1);
 
+    /*
+     *  Dump the adaptive TRANSFER_PACKET working set
+     */
+    ClassDumpTransferPacketWorkingSet(FdoDataAddr, Detail, Depth+1);
+
     /*
      *  Dump private error logs
      */
@@ -496,7 +501,7 @@ VOID ClassDumpTransferPacketLists(ULONG64 FdoDataAddr, ULONG Detail, ULONG Depth
              *  Print free packets sList
              */
             xdprintf(Depth, "\n");
-            xdprintf(Depth, "Free transfer packets in fast SLIST: (%d free)\n", numFreeXferPkts);
+            xdprintf(Depth, "Free transfer packets in shared depot SLIST: (%d free, not counting per-processor magazines)\n", numFreeXferPkts);
             if (IsPtr64()){
                 xdprintf(Depth, "(Cannot display fast SLIST on 64-bit system)\n");
             }
@@ -531,6 +536,77 @@ VOID ClassDumpTransferPacketLists(ULONG64 FdoDataAddr, ULONG Detail, ULONG Depth
 }
 
 
+/*
+ *  ClassDumpTransferPacketWorkingSet
+ *
+ *      Dump the working set sizing of the transfer packet pool
+ *      and the hit/miss counts of the per-processor magazines.
+ */
+VOID ClassDumpTransferPacketWorkingSet(ULONG64 FdoDataAddr, ULONG Detail, ULONG Depth)
+{
+    ULONG64 workingSetAddr;
+
+    workingSetAddr = GetFieldAddr(FdoDataAddr, "classpnp!_CLASS_PRIVATE_FDO_DATA", "PacketWorkingSet");
+    if (workingSetAddr != BAD_VALUE){
+        ULONG numTotalXferPkts = (ULONG)GetULONGField(FdoDataAddr, "classpnp!_CLASS_PRIVATE_FDO_DATA", "NumTotalTransferPackets");
+        ULONG numFreeXferPkts = (ULONG)GetULONGField(FdoDataAddr, "classpnp!_CLASS_PRIVATE_FDO_DATA", "NumFreeTransferPackets");
+        ULONG minWorkingSet = (ULONG)GetULONGField(FdoDataAddr, "classpnp!_CLASS_PRIVATE_FDO_DATA", "PacketWorkingSet.MinWorkingSet");
+        ULONG maxWorkingSet = (ULONG)GetULONGField(FdoDataAddr, "classpnp!_CLASS_PRIVATE_FDO_DATA", "PacketWorkingSet.MaxWorkingSet");
+        ULONG smoothedDepth = (ULONG)GetULONGField(FdoDataAddr, "classpnp!_CLASS_PRIVATE_FDO_DATA", "PacketWorkingSet.SmoothedDepth");
+        ULONG lastWindowDepth = (ULONG)GetULONGField(FdoDataAddr, "classpnp!_CLASS_PRIVATE_FDO_DATA", "PacketWorkingSet.LastWindowDepth");
+        ULONG lastWindowLatencyUs = (ULONG)GetULONGField(FdoDataAddr, "classpnp!_CLASS_PRIVATE_FDO_DATA", "PacketWorkingSet.LastWindowLatencyUs");
+        ULONG windowPeakDepth = (ULONG)GetULONGField(FdoDataAddr, "classpnp!_CLASS_PRIVATE_FDO_DATA", "PacketWorkingSet.WindowPeakDepth");
+        ULONG numMisses = (ULONG)GetULONGField(FdoDataAddr, "classpnp!_CLASS_PRIVATE_FDO_DATA", "PacketWorkingSet.NumMisses");
+        ULONG numPreallocated = (ULONG)GetULONGField(FdoDataAddr, "classpnp!_CLASS_PRIVATE_FDO_DATA", "PacketWorkingSet.NumPreallocated");
+        ULONG64 magazinesAddr = GetULONGField(FdoDataAddr, "classpnp!_CLASS_PRIVATE_FDO_DATA", "TransferPacketMagazines");
+        ULONG numMagazines = (ULONG)GetULONGField(FdoDataAddr, "classpnp!_CLASS_PRIVATE_FDO_DATA", "NumTransferPacketMagazines");
+        ULONG magazineDepth = (ULONG)GetULONGField(FdoDataAddr, "classpnp!_CLASS_PRIVATE_FDO_DATA", "TransferPacketMagazineDepth");
+        ULONG64 totalHits = 0;
+
+        xdprintf(Depth, "\n");
+        xdprintf(Depth, "Transfer packet working set:  (%d total, %d free in shared depot)\n", numTotalXferPkts, numFreeXferPkts);
+        xdprintf(Depth+1, "MinWorkingSet = %d, MaxWorkingSet = %d\n", minWorkingSet, maxWorkingSet);
+        xdprintf(Depth+1, "SmoothedDepth = %d, LastWindowDepth = %d, WindowPeakDepth = %d\n", smoothedDepth, lastWindowDepth, windowPeakDepth);
+        xdprintf(Depth+1, "LastWindowLatency = %d us\n", lastWindowLatencyUs);
+
+        if (magazinesAddr && (magazinesAddr != BAD_VALUE) && (numMagazines != (ULONG)BAD_VALUE)){
+            ULONG magazineSize = GetTypeSize("classpnp!_TRANSFER_PACKET_MAGAZINE");
+            ULONG i;
+
+            if (Detail > 0){
+                xdprintf(Depth+1, "Per-processor magazines:  (depth %d)\n", magazineDepth);
+                xdprintf(Depth+2, "proc  free      hits  completions  avg latency (us)\n");
+                xdprintf(Depth+2, "---- ----- --------- ------------ ----------------\n");
+            }
+
+            for (i = 0; i < numMagazines; i++){
+                ULONG64 magazineAddr = magazinesAddr + i*magazineSize;
+                ULONG numFree = (ULONG)GetULONGField(magazineAddr, "classpnp!_TRANSFER_PACKET_MAGAZINE", "NumFree");
+                ULONG numHits = (ULONG)GetULONGField(magazineAddr, "classpnp!_TRANSFER_PACKET_MAGAZINE", "NumHits");
+                ULONG numCompletions = (ULONG)GetULONGField(magazineAddr, "classpnp!_TRANSFER_PACKET_MAGAZINE", "NumCompletions");
+                ULONG64 completionLatency = GetULONGField(magazineAddr, "classpnp!_TRANSFER_PACKET_MAGAZINE", "CompletionLatency.QuadPart");
+
+                if ((numHits == (ULONG)BAD_VALUE) || (completionLatency == BAD_VALUE)){
+                    break;
+                }
+
+                totalHits += numHits;
+
+                if (Detail > 0){
+                    xdprintf(Depth+2, "%4d %5d %9d %12d %16d\n", i, numFree, numHits, numCompletions,
+                             numCompletions ? (ULONG)(completionLatency/10/numCompletions) : 0);
+                }
+            }
+        }
+        else {
+            xdprintf(Depth+1, "(no per-processor magazines; all free packets are in the shared depot)\n");
+        }
+
+        xdprintf(Depth+1, "Hits = %I64d, Misses = %d, Preallocated = %d\n", totalHits, numMisses, numPreallocated);
+    }
+}
+
+
 /*
  *  ClassDumpTransferPacket
  *
@@ -65,6 +65,7 @@ VOID ClassDumpTransferPacket(
     ULONG Depth);
 
 VOID ClassDumpTransferPacketLists(ULONG64 FdoDataAddr, ULONG Detail, ULONG Depth);
+VOID ClassDumpTransferPacketWorkingSet(ULONG64 FdoDataAddr, ULONG Detail, ULONG Depth);
 VOID ClassDumpPrivateErrorLogs(ULONG64 FdoDataAddr, ULONG Detail, ULONG Depth);
 VOID ClassDumpPrivatePacketLogs(ULONG64 FdoDataAddr, ULONG Detail, ULONG Depth);
 BOOLEAN ClassTryShowAllFDOs(ULONG Detail);
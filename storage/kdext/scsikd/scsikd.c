@@ -412,8 +412,8 @@ ScsiDumpFdo(
     ULONG   SequenceNumber = 0;
     ULONG64 SrbExtensionListHeader = 0;
     ULONG   NumberOfRequests = 0;
-    ULONG64 QueueTagBitMap = 0;
-    ULONG   QueueTagHint = 0;
+    ULONG64 QueueTagFreeMap = 0;
+    ULONG   QueueTagsOutstanding = 0;
     ULONG   HwLogicalUnitExtensionSize = 0;
     ULONG   SrbExtensionSize = 0;
     ULONG   LargeScatterGatherListSize = 0;
@@ -463,8 +463,8 @@ ScsiDumpFdo(
        {"SequenceNumber", NULL, 0, COPY, 0, (PVOID) &SequenceNumber},
        {"SrbExtensionListHeader", NULL, 0, COPY, 0, (PVOID) &SrbExtensionListHeader},
        {"NumberOfRequests", NULL, 0, COPY, 0, (PVOID) &NumberOfRequests},
-       {"QueueTagBitMap", NULL, 0, COPY, 0, (PVOID) &QueueTagBitMap},
-       {"QueueTagHint", NULL, 0, COPY, 0, (PVOID) &QueueTagHint},
+       {"QueueTags.FreeMap", NULL, 0, COPY, 0, (PVOID) &QueueTagFreeMap},
+       {"QueueTags.OutstandingTags", NULL, 0, COPY, 0, (PVOID) &QueueTagsOutstanding},
        {"HwLogicalUnitExtensionSize", NULL, 0, COPY, 0, (PVOID) &HwLogicalUnitExtensionSize},
        {"SrbExtensionSize", NULL, 0, COPY, 0, (PVOID) &SrbExtensionSize},
        {"LargeScatterGatherListSize", NULL, 0, COPY, 0, (PVOID) &LargeScatterGatherListSize},
@@ -587,8 +587,8 @@ ScsiDumpFdo(
     xdprintfEx(Depth, ("Srb Ext Header 0x%08p   No. Requests 0x%08lx\n",
                SrbExtensionListHeader, NumberOfRequests));
 
-    xdprintfEx(Depth, ("QueueTag BitMap 0x%08p   Hint 0x%08lx\n",
-               QueueTagBitMap, QueueTagHint));
+    xdprintfEx(Depth, ("QueueTag FreeMap 0x%08p   Outstanding %d\n",
+               QueueTagFreeMap, QueueTagsOutstanding));
 
     xdprintfEx(Depth, ("MaxQueueTag 0x%2x (@0x%08p)\n",
                MaxQueueTag, AddrOfMaxQueueTag));
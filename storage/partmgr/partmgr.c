@@ -236,30 +236,16 @@ PmAddSignatures(
     IN  PDRIVE_LAYOUT_INFORMATION_EX    Layout
     );
 
-RTL_GENERIC_COMPARE_RESULTS
-PmTableSignatureCompareRoutine(
-    IN  PRTL_GENERIC_TABLE  Table,
-    IN  PVOID               First,
-    IN  PVOID               Second
-    );
-
-RTL_GENERIC_COMPARE_RESULTS
-PmTableGuidCompareRoutine(
-    IN  PRTL_GENERIC_TABLE  Table,
-    IN  PVOID               First,
-    IN  PVOID               Second
-    );
-
-PVOID
-PmTableAllocateRoutine(
-    IN  PRTL_GENERIC_TABLE  Table,
-    IN  CLONG               Size
+PSIGNATURE_TABLE_ENTRY
+PmInsertSignature(
+    IN  PDEVICE_EXTENSION   Extension,
+    IN  ULONG               Signature
     );
 
-VOID
-PmTableFreeRoutine(
-    IN  PRTL_GENERIC_TABLE  Table,
-    IN  PVOID               Buffer
+PGUID_TABLE_ENTRY
+PmInsertGuid(
+    IN  PDEVICE_EXTENSION   Extension,
+    IN  GUID*               Guid
     );
 
 NTSTATUS
@@ -403,10 +389,8 @@ LockDriverWithTimeout(
 #pragma alloc_text(PAGE, PmChangePartitionIoctl)
 #pragma alloc_text(PAGE, PmEjectVolumeManagers)
 #pragma alloc_text(PAGE, PmAddSignatures)
-#pragma alloc_text(PAGE, PmTableSignatureCompareRoutine)
-#pragma alloc_text(PAGE, PmTableGuidCompareRoutine)
-#pragma alloc_text(PAGE, PmTableAllocateRoutine)
-#pragma alloc_text(PAGE, PmTableFreeRoutine)
+#pragma alloc_text(PAGE, PmInsertSignature)
+#pragma alloc_text(PAGE, PmInsertGuid)
 #pragma alloc_text(PAGE, PmQueryDiskSignature)
 #pragma alloc_text(PAGE, PmWmi)
 #pragma alloc_text(PAGE, PmWmiFunctionControl)
@@ -2048,8 +2032,6 @@ Return Value:
     SIGNATURE_TABLE_ENTRY   sigEntry;
     GUID_TABLE_ENTRY        guidEntry;
     NTSTATUS                status;
-    PVOID                   nodeOrParent, nodeOrParent2;
-    TABLE_SEARCH_RESULT     searchResult, searchResult2;
     UUID                    uuid;
     PULONG                  p;
     ULONG                   i;
@@ -2058,13 +2040,15 @@ Return Value:
     while (!IsListEmpty(&Extension->SignatureList)) {
         l = RemoveHeadList(&Extension->SignatureList);
         s = CONTAINING_RECORD(l, SIGNATURE_TABLE_ENTRY, ListEntry);
-        RtlDeleteElementGenericTable(&driverExtension->SignatureTable, s);
+        PmUnindexSignature(&driverExtension->SignatureIndex, s);
+        ExFreePool(s);
     }
 
     while (!IsListEmpty(&Extension->GuidList)) {
         l = RemoveHeadList(&Extension->GuidList);
         g = CONTAINING_RECORD(l, GUID_TABLE_ENTRY, ListEntry);
-        RtlDeleteElementGenericTable(&driverExtension->GuidTable, g);
+        PmUnindexGuid(&driverExtension->GuidIndex, g);
+        ExFreePool(g);
     }
 
     if (!Layout) {
@@ -2087,9 +2071,8 @@ Return Value:
         }
 
         sigEntry.Signature = Layout->Mbr.Signature;
-        s = RtlLookupElementGenericTableFull(
-                &driverExtension->SignatureTable, &sigEntry,
-                &nodeOrParent, &searchResult);
+        s = PmLookupSignature(&driverExtension->SignatureIndex,
+                              sigEntry.Signature);
         if (s || !sigEntry.Signature ||
             Extension->DriverExtension->BootDiskSig) {
 
@@ -2134,21 +2117,9 @@ Return Value:
             } else {
                 Extension->DiskSignature = Layout->Mbr.Signature;
             }
-
-            RtlLookupElementGenericTableFull(
-                &driverExtension->SignatureTable, &sigEntry,
-                &nodeOrParent, &searchResult);
         }
 
-        s = RtlInsertElementGenericTableFull(&driverExtension->SignatureTable,
-                                             &sigEntry, sizeof(sigEntry), NULL,
-                                             nodeOrParent, searchResult);
-        if (!s) {
-            return;
-        }
-
-        InsertTailList(&Extension->SignatureList, &s->ListEntry);
-        s->Extension = Extension;
+        PmInsertSignature(Extension, sigEntry.Signature);
 
         return;
     }
@@ -2165,12 +2136,9 @@ Return Value:
         sigEntry.Signature = p[0] ^ p[1] ^ p[2] ^ p[3];
         guidEntry.Guid = Layout->Gpt.DiskId;
 
-        s = RtlLookupElementGenericTableFull(
-                &driverExtension->SignatureTable, &sigEntry,
-                &nodeOrParent, &searchResult);
-        g = RtlLookupElementGenericTableFull(
-                &driverExtension->GuidTable, &guidEntry,
-                &nodeOrParent2, &searchResult2);
+        s = PmLookupSignature(&driverExtension->SignatureIndex,
+                              sigEntry.Signature);
+        g = PmLookupGuid(&driverExtension->GuidIndex, &guidEntry.Guid);
         if (s || g || !sigEntry.Signature) {
 
             if (g) {
@@ -2204,34 +2172,15 @@ Return Value:
             p = (PULONG) &Layout->Gpt.DiskId;
             sigEntry.Signature = p[0] ^ p[1] ^ p[2] ^ p[3];
             guidEntry.Guid = Layout->Gpt.DiskId;
-
-            RtlLookupElementGenericTableFull(
-                    &driverExtension->SignatureTable, &sigEntry,
-                    &nodeOrParent, &searchResult);
-            RtlLookupElementGenericTableFull(
-                    &driverExtension->GuidTable, &guidEntry,
-                    &nodeOrParent2, &searchResult2);
         }
 
-        s = RtlInsertElementGenericTableFull(
-                &driverExtension->SignatureTable, &sigEntry,
-                sizeof(sigEntry), NULL, nodeOrParent, searchResult);
-        if (!s) {
+        if (!PmInsertSignature(Extension, sigEntry.Signature)) {
             return;
         }
 
-        InsertTailList(&Extension->SignatureList, &s->ListEntry);
-        s->Extension = Extension;
-
-        g = RtlInsertElementGenericTableFull(
-                &driverExtension->GuidTable, &guidEntry,
-                sizeof(guidEntry), NULL, nodeOrParent2, searchResult2);
-        if (!g) {
+        if (!PmInsertGuid(Extension, &guidEntry.Guid)) {
             return;
         }
-
-        InsertTailList(&Extension->GuidList, &g->ListEntry);
-        g->Extension = Extension;
     }
 
     for (i = 0; i < Layout->PartitionCount; i++) {
@@ -2248,9 +2197,7 @@ Return Value:
         }
 
 
-        g = RtlLookupElementGenericTableFull(
-                &driverExtension->GuidTable, &guidEntry,
-                &nodeOrParent, &searchResult);
+        g = PmLookupGuid(&driverExtension->GuidIndex, &guidEntry.Guid);
         if (g || !sigEntry.Signature ||
             (driverExtension->BootPartitionGuidPresent && hasBootPartitionType)) {
 
@@ -2273,22 +2220,106 @@ Return Value:
             }
 
             guidEntry.Guid = Layout->PartitionEntry[i].Gpt.PartitionId;
-
-            RtlLookupElementGenericTableFull(
-                    &driverExtension->GuidTable, &guidEntry,
-                    &nodeOrParent, &searchResult);
         }
 
-        g = RtlInsertElementGenericTableFull(
-                &driverExtension->GuidTable, &guidEntry,
-                sizeof(guidEntry), NULL, nodeOrParent, searchResult);
-        if (!g) {
+        if (!PmInsertGuid(Extension, &guidEntry.Guid)) {
             return;
         }
+    }
+}
+
+PSIGNATURE_TABLE_ENTRY
+PmInsertSignature(
+    IN  PDEVICE_EXTENSION   Extension,
+    IN  ULONG               Signature
+    )
+
+/*++
+
+Routine Description:
+
+    This routine records a signature as in use by the given disk.
+
+Arguments:
 
-        InsertTailList(&Extension->GuidList, &g->ListEntry);
-        g->Extension = Extension;
+    Extension   - Supplies the device extension.
+
+    Signature   - Supplies the signature.
+
+Return Value:
+
+    The signature entry, or NULL.
+
+--*/
+
+{
+    PDO_EXTENSION           driverExtension = Extension->DriverExtension;
+    PSIGNATURE_TABLE_ENTRY  s;
+
+    s = ExAllocatePoolWithTag(PagedPool, sizeof(SIGNATURE_TABLE_ENTRY),
+                              PARTMGR_TAG_TABLE_ENTRY);
+    if (!s) {
+        return NULL;
+    }
+
+    s->Extension = Extension;
+    s->Signature = Signature;
+
+    if (!NT_SUCCESS(PmIndexSignature(&driverExtension->SignatureIndex, s))) {
+        ExFreePool(s);
+        return NULL;
     }
+
+    InsertTailList(&Extension->SignatureList, &s->ListEntry);
+
+    return s;
+}
+
+PGUID_TABLE_ENTRY
+PmInsertGuid(
+    IN  PDEVICE_EXTENSION   Extension,
+    IN  GUID*               Guid
+    )
+
+/*++
+
+Routine Description:
+
+    This routine records a GUID as in use by the given disk.
+
+Arguments:
+
+    Extension   - Supplies the device extension.
+
+    Guid        - Supplies the GUID.
+
+Return Value:
+
+    The GUID entry, or NULL.
+
+--*/
+
+{
+    PDO_EXTENSION       driverExtension = Extension->DriverExtension;
+    PGUID_TABLE_ENTRY   g;
+
+    g = ExAllocatePoolWithTag(PagedPool, sizeof(GUID_TABLE_ENTRY),
+                              PARTMGR_TAG_TABLE_ENTRY);
+    if (!g) {
+        return NULL;
+    }
+
+    g->Extension = Extension;
+    g->Guid = *Guid;
+
+    if (!NT_SUCCESS(PmIndexGuid(&driverExtension->GuidIndex, g))) {
+        ExFreePool(g);
+        return NULL;
+    }
+
+    InsertTailList(&Extension->GuidList, &g->ListEntry);
+
+    return g;
 }
 
 NTSTATUS
@@ -3410,82 +3441,6 @@ Return Value:
     return status;
 }
 
-RTL_GENERIC_COMPARE_RESULTS
-PmTableSignatureCompareRoutine(
-    IN  PRTL_GENERIC_TABLE  Table,
-    IN  PVOID               First,
-    IN  PVOID               Second
-    )
-
-{
-    PSIGNATURE_TABLE_ENTRY  f = First;
-    PSIGNATURE_TABLE_ENTRY  s = Second;
-
-    if (f->Signature < s->Signature) {
-        return GenericLessThan;
-    }
-
-    if (f->Signature > s->Signature) {
-        return GenericGreaterThan;
-    }
-
-    return GenericEqual;
-}
-
-RTL_GENERIC_COMPARE_RESULTS
-PmTableGuidCompareRoutine(
-    IN  PRTL_GENERIC_TABLE  Table,
-    IN  PVOID               First,
-    IN  PVOID               Second
-    )
-
-{
-    PGUID_TABLE_ENTRY   f = First;
-    PGUID_TABLE_ENTRY   s = Second;
-    PULONGLONG          p1, p2;
-
-    p1 = (PULONGLONG) &f->Guid;
-    p2 = (PULONGLONG) &s->Guid;
-
-    if (p1[0] < p2[0]) {
-        return GenericLessThan;
-    }
-
-    if (p1[0] > p2[0]) {
-        return GenericGreaterThan;
-    }
-
-    if (p1[1] < p2[1]) {
-        return GenericLessThan;
-    }
-
-    if (p1[1] > p2[1]) {
-        return GenericGreaterThan;
-    }
-
-    return GenericEqual;
-}
-
-PVOID
-PmTableAllocateRoutine(
-    IN  PRTL_GENERIC_TABLE  Table,
-    IN  CLONG               Size
-    )
-
-{
-    return ExAllocatePoolWithTag(PagedPool, Size, PARTMGR_TAG_TABLE_ENTRY);
-}
-
-VOID
-PmTableFreeRoutine(
-    IN  PRTL_GENERIC_TABLE  Table,
-    IN  PVOID               Buffer
-    )
-
-{
-    ExFreePool(Buffer);
-}
-
 NTSTATUS
 DriverEntry(
     IN PDRIVER_OBJECT DriverObject,
@@ -3562,15 +3517,8 @@ Return Value:
     KeInitializeMutex(&driverExtension->Mutex, 0);
     driverExtension->PastReinit = FALSE;
 
-    RtlInitializeGenericTable(&driverExtension->SignatureTable,
-                              PmTableSignatureCompareRoutine,
-                              PmTableAllocateRoutine,
-                              PmTableFreeRoutine, driverExtension);
-
-    RtlInitializeGenericTable(&driverExtension->GuidTable,
-                              PmTableGuidCompareRoutine,
-                              PmTableAllocateRoutine,
-                              PmTableFreeRoutine, driverExtension);    
+    PmInitializeIndex(&driverExtension->SignatureIndex);
+    PmInitializeIndex(&driverExtension->GuidIndex);
 
     IoRegisterBootDriverReinitialization(DriverObject, PmBootDriverReinit,
                                          driverExtension);    
@@ -19,6 +19,7 @@ Revision History:
 --*/
 
 #include <partmgrp.h>
+#include <pmindex.h>
 
 #define DEVICENAME_MAXSTR   64          // used to storage device name for WMI
 
@@ -31,6 +32,7 @@ Revision History:
 #define PARTMGR_TAG_TABLE_ENTRY                 'tRcS'  // ScRt
 #define PARTMGR_TAG_POWER_WORK_ITEM             'wRcS'  // ScRw
 #define PARTMGR_TAG_IOCTL_BUFFER                'iRcS'  // ScRi
+#define PARTMGR_TAG_INDEX                       'xRcS'  // ScRx
 
 #define PARTMGR_TAG_REMOVE_LOCK                 'rRcS'  // ScRr
 
@@ -109,17 +111,19 @@ typedef struct _DO_EXTENSION {
     LONG PastReinit;
 
     //
-    // A table to keep track disk signatures which includes signatures
-    // on MBR disks and squashed disk GUIDs on GPT disks.
+    // An index to keep track disk signatures which includes signatures
+    // on MBR disks and squashed disk GUIDs on GPT disks.  Protect with
+    // 'Mutex'.
     //
 
-    RTL_GENERIC_TABLE SignatureTable;
+    PM_INDEX SignatureIndex;
 
     //
-    // A table to keep track of GPT disk and partition GUIDs.
+    // An index to keep track of GPT disk and partition GUIDs.  Protect
+    // with 'Mutex'.
     //
 
-    RTL_GENERIC_TABLE GuidTable;
+    PM_INDEX GuidIndex;
 
     //
     // Registry Path.
@@ -316,18 +320,6 @@ typedef struct _DEVICE_EXTENSION {
 
 } DEVICE_EXTENSION, *PDEVICE_EXTENSION;
 
-typedef struct _SIGNATURE_TABLE_ENTRY {
-    LIST_ENTRY          ListEntry;
-    PDEVICE_EXTENSION   Extension;
-    ULONG               Signature;
-} SIGNATURE_TABLE_ENTRY, *PSIGNATURE_TABLE_ENTRY;
-
-typedef struct _GUID_TABLE_ENTRY {
-    LIST_ENTRY          ListEntry;
-    PDEVICE_EXTENSION   Extension;
-    GUID                Guid;
-} GUID_TABLE_ENTRY, *PGUID_TABLE_ENTRY;
-
 //
 //  Work item for PmPowerNotify
 //
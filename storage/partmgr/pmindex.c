@@ -0,0 +1,546 @@
+/*++
+
+Copyright (C) Microsoft Corporation, 2003
+
+Module Name:
+
+    pmindex.c
+
+Abstract:
+
+    This file contains the hash indexes of the disk signatures and GUIDs in
+    use, so that checking an arriving disk for collisions costs the same no
+    matter how many disks there are.
+
+    The indexes are protected by the driver extension mutex.
+
+Environment:
+
+    kernel mode only
+
+Notes:
+
+    This file is also built into the user mode index test, with UTEST
+    defined.
+
+Revision History:
+
+--*/
+
+#ifndef UTEST
+
+#define RTL_USE_AVL_TABLES 0
+
+#include <ntosp.h>
+#include <stdio.h>
+#include <ntddvol.h>
+#include <ntdddisk.h>
+#include <wmilib.h>
+#include <partmgr.h>
+
+#endif
+
+VOID
+PmGrowIndex(
+    IN OUT  PPM_INDEX   Index
+    );
+
+NTSTATUS
+PmInsertIndexLink(
+    IN OUT  PPM_INDEX       Index,
+    IN      PPM_INDEX_LINK  Link,
+    IN      ULONG           Hash
+    );
+
+VOID
+PmRemoveIndexLink(
+    IN OUT  PPM_INDEX       Index,
+    IN      PPM_INDEX_LINK  Link
+    );
+
+ULONG
+PmHashUlong(
+    IN  ULONG   Value
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, PmInitializeIndex)
+#pragma alloc_text(PAGE, PmFreeIndex)
+#pragma alloc_text(PAGE, PmGrowIndex)
+#pragma alloc_text(PAGE, PmInsertIndexLink)
+#pragma alloc_text(PAGE, PmRemoveIndexLink)
+#pragma alloc_text(PAGE, PmHashUlong)
+#pragma alloc_text(PAGE, PmIndexSignature)
+#pragma alloc_text(PAGE, PmUnindexSignature)
+#pragma alloc_text(PAGE, PmLookupSignature)
+#pragma alloc_text(PAGE, PmIndexGuid)
+#pragma alloc_text(PAGE, PmUnindexGuid)
+#pragma alloc_text(PAGE, PmLookupGuid)
+#endif
+
+VOID
+PmInitializeIndex(
+    OUT PPM_INDEX   Index
+    )
+
+/*++
+
+Routine Description:
+
+    This routine initializes an empty index.  The buckets are allocated on
+    the first insert.
+
+Arguments:
+
+    Index   - Returns the index.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PAGED_CODE();
+
+    Index->Buckets = NULL;
+    Index->BucketMask = 0;
+    Index->EntryCount = 0;
+}
+
+VOID
+PmFreeIndex(
+    IN OUT  PPM_INDEX   Index
+    )
+
+/*++
+
+Routine Description:
+
+    This routine frees the buckets of an index.  The entries are not
+    touched.
+
+Arguments:
+
+    Index   - Supplies the index.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PAGED_CODE();
+
+    if (Index->Buckets) {
+        ExFreePool(Index->Buckets);
+    }
+
+    PmInitializeIndex(Index);
+}
+
+VOID
+PmGrowIndex(
+    IN OUT  PPM_INDEX   Index
+    )
+
+/*++
+
+Routine Description:
+
+    This routine doubles the buckets of an index.  If the new buckets can't
+    be allocated, the index keeps the buckets it has.
+
+Arguments:
+
+    Index   - Supplies the index.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    ULONG           oldCount, newCount, i;
+    PLIST_ENTRY     buckets, l;
+    PPM_INDEX_LINK  link;
+
+    PAGED_CODE();
+
+    oldCount = Index->BucketMask + 1;
+    newCount = 2*oldCount;
+
+    buckets = ExAllocatePoolWithTag(PagedPool, newCount*sizeof(LIST_ENTRY),
+                                    PARTMGR_TAG_INDEX);
+    if (!buckets) {
+        return;
+    }
+
+    for (i = 0; i < newCount; i++) {
+        InitializeListHead(&buckets[i]);
+    }
+
+    for (i = 0; i < oldCount; i++) {
+        while (!IsListEmpty(&Index->Buckets[i])) {
+            l = RemoveHeadList(&Index->Buckets[i]);
+            link = CONTAINING_RECORD(l, PM_INDEX_LINK, ListEntry);
+            InsertTailList(&buckets[link->Hash&(newCount - 1)], l);
+        }
+    }
+
+    ExFreePool(Index->Buckets);
+    Index->Buckets = buckets;
+    Index->BucketMask = newCount - 1;
+}
+
+NTSTATUS
+PmInsertIndexLink(
+    IN OUT  PPM_INDEX       Index,
+    IN      PPM_INDEX_LINK  Link,
+    IN      ULONG           Hash
+    )
+
+/*++
+
+Routine Description:
+
+    This routine inserts a link into an index.
+
+Arguments:
+
+    Index   - Supplies the index.
+
+    Link    - Supplies the link.
+
+    Hash    - Supplies the hash of the key of the link.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    ULONG   i;
+
+    PAGED_CODE();
+
+    if (!Index->Buckets) {
+
+        Index->Buckets = ExAllocatePoolWithTag(PagedPool,
+                                               PM_INDEX_INITIAL_BUCKETS*
+                                               sizeof(LIST_ENTRY),
+                                               PARTMGR_TAG_INDEX);
+        if (!Index->Buckets) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        for (i = 0; i < PM_INDEX_INITIAL_BUCKETS; i++) {
+            InitializeListHead(&Index->Buckets[i]);
+        }
+        Index->BucketMask = PM_INDEX_INITIAL_BUCKETS - 1;
+
+    } else if (Index->EntryCount >= 2*(Index->BucketMask + 1)) {
+        PmGrowIndex(Index);
+    }
+
+    Link->Hash = Hash;
+    InsertTailList(PmIndexBucket(Index, Hash), &Link->ListEntry);
+    Index->EntryCount++;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+PmRemoveIndexLink(
+    IN OUT  PPM_INDEX       Index,
+    IN      PPM_INDEX_LINK  Link
+    )
+
+/*++
+
+Routine Description:
+
+    This routine removes a link from an index.
+
+Arguments:
+
+    Index   - Supplies the index.
+
+    Link    - Supplies the link.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PAGED_CODE();
+
+    ASSERT(Index->EntryCount);
+
+    RemoveEntryList(&Link->ListEntry);
+    Index->EntryCount--;
+}
+
+ULONG
+PmHashUlong(
+    IN  ULONG   Value
+    )
+
+/*++
+
+Routine Description:
+
+    This routine mixes the bits of a signature so that signatures that
+    differ only in their high bits, or that are handed out in sequence,
+    still spread over the buckets.
+
+Arguments:
+
+    Value   - Supplies the value.
+
+Return Value:
+
+    The hash.
+
+--*/
+
+{
+    PAGED_CODE();
+
+    Value ^= Value >> 16;
+    Value *= 0x85EBCA6B;
+    Value ^= Value >> 13;
+    Value *= 0xC2B2AE35;
+    Value ^= Value >> 16;
+
+    return Value;
+}
+
+NTSTATUS
+PmIndexSignature(
+    IN OUT  PPM_INDEX               Index,
+    IN      PSIGNATURE_TABLE_ENTRY  Entry
+    )
+
+/*++
+
+Routine Description:
+
+    This routine adds a signature entry to the signature index.
+
+Arguments:
+
+    Index   - Supplies the signature index.
+
+    Entry   - Supplies the signature entry.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    PAGED_CODE();
+
+    return PmInsertIndexLink(Index, &Entry->IndexLink,
+                             PmHashUlong(Entry->Signature));
+}
+
+VOID
+PmUnindexSignature(
+    IN OUT  PPM_INDEX               Index,
+    IN      PSIGNATURE_TABLE_ENTRY  Entry
+    )
+
+/*++
+
+Routine Description:
+
+    This routine removes a signature entry from the signature index.
+
+Arguments:
+
+    Index   - Supplies the signature index.
+
+    Entry   - Supplies the signature entry.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PAGED_CODE();
+
+    PmRemoveIndexLink(Index, &Entry->IndexLink);
+}
+
+PSIGNATURE_TABLE_ENTRY
+PmLookupSignature(
+    IN  PPM_INDEX   Index,
+    IN  ULONG       Signature
+    )
+
+/*++
+
+Routine Description:
+
+    This routine looks up a signature in the signature index.
+
+Arguments:
+
+    Index       - Supplies the signature index.
+
+    Signature   - Supplies the signature.
+
+Return Value:
+
+    The signature entry, or NULL.
+
+--*/
+
+{
+    ULONG                   hash;
+    PLIST_ENTRY             bucket, l;
+    PSIGNATURE_TABLE_ENTRY  entry;
+
+    PAGED_CODE();
+
+    if (!Index->Buckets) {
+        return NULL;
+    }
+
+    hash = PmHashUlong(Signature);
+    bucket = PmIndexBucket(Index, hash);
+
+    for (l = bucket->Flink; l != bucket; l = l->Flink) {
+        entry = CONTAINING_RECORD(l, SIGNATURE_TABLE_ENTRY,
+                                  IndexLink.ListEntry);
+        if (entry->IndexLink.Hash == hash && entry->Signature == Signature) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+NTSTATUS
+PmIndexGuid(
+    IN OUT  PPM_INDEX           Index,
+    IN      PGUID_TABLE_ENTRY   Entry
+    )
+
+/*++
+
+Routine Description:
+
+    This routine adds a GUID entry to the GUID index.
+
+Arguments:
+
+    Index   - Supplies the GUID index.
+
+    Entry   - Supplies the GUID entry.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    PULONG  p = (PULONG) &Entry->Guid;
+
+    PAGED_CODE();
+
+    return PmInsertIndexLink(Index, &Entry->IndexLink,
+                             PmHashUlong(p[0] ^ p[1] ^ p[2] ^ p[3]));
+}
+
+VOID
+PmUnindexGuid(
+    IN OUT  PPM_INDEX           Index,
+    IN      PGUID_TABLE_ENTRY   Entry
+    )
+
+/*++
+
+Routine Description:
+
+    This routine removes a GUID entry from the GUID index.
+
+Arguments:
+
+    Index   - Supplies the GUID index.
+
+    Entry   - Supplies the GUID entry.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PAGED_CODE();
+
+    PmRemoveIndexLink(Index, &Entry->IndexLink);
+}
+
+PGUID_TABLE_ENTRY
+PmLookupGuid(
+    IN  PPM_INDEX   Index,
+    IN  GUID*       Guid
+    )
+
+/*++
+
+Routine Description:
+
+    This routine looks up a GUID in the GUID index.
+
+Arguments:
+
+    Index   - Supplies the GUID index.
+
+    Guid    - Supplies the GUID.
+
+Return Value:
+
+    The GUID entry, or NULL.
+
+--*/
+
+{
+    PULONG              p = (PULONG) Guid;
+    ULONG               hash;
+    PLIST_ENTRY         bucket, l;
+    PGUID_TABLE_ENTRY   entry;
+
+    PAGED_CODE();
+
+    if (!Index->Buckets) {
+        return NULL;
+    }
+
+    hash = PmHashUlong(p[0] ^ p[1] ^ p[2] ^ p[3]);
+    bucket = PmIndexBucket(Index, hash);
+
+    for (l = bucket->Flink; l != bucket; l = l->Flink) {
+        entry = CONTAINING_RECORD(l, GUID_TABLE_ENTRY, IndexLink.ListEntry);
+        if (entry->IndexLink.Hash == hash &&
+            IsEqualGUID(&entry->Guid, Guid)) {
+
+            return entry;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,115 @@
+/*++
+
+Copyright (C) Microsoft Corporation, 2003
+
+Module Name:
+
+    pmindex.h
+
+Abstract:
+
+    This file defines the hash indexes that the PARTMGR driver keeps of the
+    disk signatures and GUIDs in use.
+
+Revision History:
+
+--*/
+
+//
+// The number of buckets an index starts out with.  An index doubles its
+// buckets when it holds more than two entries per bucket.
+//
+
+#define PM_INDEX_INITIAL_BUCKETS    64
+
+typedef struct _PM_INDEX_LINK {
+    LIST_ENTRY  ListEntry;
+    ULONG       Hash;
+} PM_INDEX_LINK, *PPM_INDEX_LINK;
+
+typedef struct _PM_INDEX {
+
+    //
+    // The buckets, allocated on the first insert.
+    //
+
+    PLIST_ENTRY Buckets;
+    ULONG BucketMask;
+
+    ULONG EntryCount;
+
+} PM_INDEX, *PPM_INDEX;
+
+#define PmIndexBucket(Index, Hash) \
+        (&(Index)->Buckets[(Hash) & (Index)->BucketMask])
+
+//
+// A signature in use, on an MBR disk or squashed from the disk GUID of a
+// GPT disk.  The entry is in the signature index and in the signature list
+// of the disk.
+//
+
+typedef struct _SIGNATURE_TABLE_ENTRY {
+    PM_INDEX_LINK               IndexLink;
+    LIST_ENTRY                  ListEntry;
+    struct _DEVICE_EXTENSION*   Extension;
+    ULONG                       Signature;
+} SIGNATURE_TABLE_ENTRY, *PSIGNATURE_TABLE_ENTRY;
+
+//
+// A GPT disk or partition GUID in use.  The entry is in the GUID index and
+// in the GUID list of the disk.
+//
+
+typedef struct _GUID_TABLE_ENTRY {
+    PM_INDEX_LINK               IndexLink;
+    LIST_ENTRY                  ListEntry;
+    struct _DEVICE_EXTENSION*   Extension;
+    GUID                        Guid;
+} GUID_TABLE_ENTRY, *PGUID_TABLE_ENTRY;
+
+VOID
+PmInitializeIndex(
+    OUT PPM_INDEX   Index
+    );
+
+VOID
+PmFreeIndex(
+    IN OUT  PPM_INDEX   Index
+    );
+
+NTSTATUS
+PmIndexSignature(
+    IN OUT  PPM_INDEX               Index,
+    IN      PSIGNATURE_TABLE_ENTRY  Entry
+    );
+
+VOID
+PmUnindexSignature(
+    IN OUT  PPM_INDEX               Index,
+    IN      PSIGNATURE_TABLE_ENTRY  Entry
+    );
+
+PSIGNATURE_TABLE_ENTRY
+PmLookupSignature(
+    IN  PPM_INDEX   Index,
+    IN  ULONG       Signature
+    );
+
+NTSTATUS
+PmIndexGuid(
+    IN OUT  PPM_INDEX           Index,
+    IN      PGUID_TABLE_ENTRY   Entry
+    );
+
+VOID
+PmUnindexGuid(
+    IN OUT  PPM_INDEX           Index,
+    IN      PGUID_TABLE_ENTRY   Entry
+    );
+
+PGUID_TABLE_ENTRY
+PmLookupGuid(
+    IN  PPM_INDEX   Index,
+    IN  GUID*       Guid
+    );
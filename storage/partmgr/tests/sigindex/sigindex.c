@@ -0,0 +1,612 @@
+
+
+
+#include <nt.h>
+#include <ntdef.h>
+#include <ntrtl.h>
+#include <nturtl.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+//
+// Build the driver's index code into the test.
+//
+
+#define PAGED_CODE()
+#define ExAllocatePoolWithTag(Type, Size, Tag)	malloc (Size)
+#define ExFreePool(Buffer)			free (Buffer)
+
+#include <pmindex.h>
+#include "..\..\pmindex.c"
+
+
+#define	PROGRAM_TITLE				"SigIndex - Signature Index Test V0.1"
+
+
+//
+// Every fourth disk to arrive is a second path to the disk before it, and
+// every other disk is a GPT disk.
+//
+
+#define PARTITIONS_PER_DISK			4
+#define	MAX_LINEAR_DISKS			4000
+#define	MAX_CHAIN_LENGTH			16
+
+
+ULONG DiskCounts [] = { 1000, 4000, 16000, 64000 };
+
+
+typedef struct _TEST_MODEL {
+    PCSTR	Name;
+    VOID	(*Initialize) (VOID);
+    BOOLEAN	(*LookupSignature) (ULONG Signature);
+    BOOLEAN	(*LookupGuid) (GUID *Guid);
+    VOID	(*InsertSignature) (ULONG Signature);
+    VOID	(*InsertGuid) (GUID *Guid);
+    VOID	(*Cleanup) (VOID);
+    } TEST_MODEL, *PTEST_MODEL;
+
+
+
+ULONG NextRandom (IN OUT PULONG State)
+    {
+    ULONG high;
+
+    *State = *State * 1103515245 + 12345;
+    high   = *State >> 16;
+    *State = *State * 1103515245 + 12345;
+
+    return (high << 16) | (*State >> 16);
+    }   // NextRandom
+
+
+
+VOID MakeDisk (IN  ULONG   Arrival,
+	       OUT PBOOLEAN IsGpt,
+	       OUT PULONG  Signature,
+	       OUT GUID    *DiskId,
+	       OUT GUID    *PartitionId)
+    {
+    ULONG	disk  = (Arrival % 4 == 3) ? Arrival - 1 : Arrival;
+    ULONG	state = disk * 2654435761 + 1;
+    PULONG	p;
+    ULONG	i;
+
+    *IsGpt = (BOOLEAN) (disk % 2);
+
+    p = (PULONG) DiskId;
+    for (i = 0; i < 4; i++)
+	{
+	p [i] = NextRandom (&state);
+	}
+
+    p = (PULONG) PartitionId;
+    for (i = 0; i < 4 * PARTITIONS_PER_DISK; i++)
+	{
+	p [i] = NextRandom (&state);
+	}
+
+    if (*IsGpt)
+	{
+	p = (PULONG) DiskId;
+	*Signature = p [0] ^ p [1] ^ p [2] ^ p [3];
+	}
+    else
+	{
+	*Signature = NextRandom (&state);
+	}
+    }   // MakeDisk
+
+
+
+//
+// This follows the collision checks of PmAddSignatures.  The result is the
+// number of collisions found, or ~0 for a redundant path.
+//
+
+ULONG SimulateArrival (IN PTEST_MODEL Model, IN ULONG Arrival)
+    {
+    BOOLEAN	isGpt;
+    ULONG	signature;
+    GUID	diskId;
+    GUID	partitionId [PARTITIONS_PER_DISK];
+    ULONG	collisions = 0;
+    ULONG	i;
+
+    MakeDisk (Arrival, &isGpt, &signature, &diskId, partitionId);
+
+    if (!isGpt)
+	{
+	if (Model->LookupSignature (signature))
+	    {
+	    return ~0;
+	    }
+
+	Model->InsertSignature (signature);
+	return 0;
+	}
+
+    if (Model->LookupSignature (signature) || Model->LookupGuid (&diskId))
+	{
+	return ~0;
+	}
+
+    Model->InsertSignature (signature);
+    Model->InsertGuid (&diskId);
+
+    for (i = 0; i < PARTITIONS_PER_DISK; i++)
+	{
+	if (Model->LookupGuid (&partitionId [i]))
+	    {
+	    collisions++;
+	    }
+	else
+	    {
+	    Model->InsertGuid (&partitionId [i]);
+	    }
+	}
+
+    return collisions;
+    }   // SimulateArrival
+
+
+
+//
+// The hash indexes, as used by the driver.
+//
+
+PM_INDEX	SignatureIndex;
+PM_INDEX	GuidIndex;
+LIST_ENTRY	SignatureList;
+LIST_ENTRY	GuidList;
+
+
+VOID HashInitialize (VOID)
+    {
+    PmInitializeIndex (&SignatureIndex);
+    PmInitializeIndex (&GuidIndex);
+    InitializeListHead (&SignatureList);
+    InitializeListHead (&GuidList);
+    }
+
+
+BOOLEAN HashLookupSignature (ULONG Signature)
+    {
+    return PmLookupSignature (&SignatureIndex, Signature) != NULL;
+    }
+
+
+BOOLEAN HashLookupGuid (GUID *Guid)
+    {
+    return PmLookupGuid (&GuidIndex, Guid) != NULL;
+    }
+
+
+VOID HashInsertSignature (ULONG Signature)
+    {
+    PSIGNATURE_TABLE_ENTRY s = malloc (sizeof (SIGNATURE_TABLE_ENTRY));
+
+    s->Extension = NULL;
+    s->Signature = Signature;
+    PmIndexSignature (&SignatureIndex, s);
+    InsertTailList (&SignatureList, &s->ListEntry);
+    }
+
+
+VOID HashInsertGuid (GUID *Guid)
+    {
+    PGUID_TABLE_ENTRY g = malloc (sizeof (GUID_TABLE_ENTRY));
+
+    g->Extension = NULL;
+    g->Guid      = *Guid;
+    PmIndexGuid (&GuidIndex, g);
+    InsertTailList (&GuidList, &g->ListEntry);
+    }
+
+
+VOID HashCleanup (VOID)
+    {
+    PLIST_ENTRY			l;
+    PSIGNATURE_TABLE_ENTRY	s;
+    PGUID_TABLE_ENTRY		g;
+
+    while (!IsListEmpty (&SignatureList))
+	{
+	l = RemoveHeadList (&SignatureList);
+	s = CONTAINING_RECORD (l, SIGNATURE_TABLE_ENTRY, ListEntry);
+	PmUnindexSignature (&SignatureIndex, s);
+	free (s);
+	}
+
+    while (!IsListEmpty (&GuidList))
+	{
+	l = RemoveHeadList (&GuidList);
+	g = CONTAINING_RECORD (l, GUID_TABLE_ENTRY, ListEntry);
+	PmUnindexGuid (&GuidIndex, g);
+	free (g);
+	}
+
+    PmFreeIndex (&SignatureIndex);
+    PmFreeIndex (&GuidIndex);
+    }
+
+
+TEST_MODEL HashModel = { "hash",
+			 HashInitialize,
+			 HashLookupSignature,
+			 HashLookupGuid,
+			 HashInsertSignature,
+			 HashInsertGuid,
+			 HashCleanup };
+
+
+
+//
+// The splay tables the driver used before.
+//
+
+RTL_GENERIC_TABLE	SignatureTable;
+RTL_GENERIC_TABLE	GuidTable;
+
+
+RTL_GENERIC_COMPARE_RESULTS NTAPI SplayCompareSignature (PRTL_GENERIC_TABLE Table,
+							 PVOID              First,
+							 PVOID              Second)
+    {
+    ULONG f = *(PULONG) First;
+    ULONG s = *(PULONG) Second;
+
+    UNREFERENCED_PARAMETER (Table);
+
+    return (f < s) ? GenericLessThan : (f > s) ? GenericGreaterThan : GenericEqual;
+    }
+
+
+RTL_GENERIC_COMPARE_RESULTS NTAPI SplayCompareGuid (PRTL_GENERIC_TABLE Table,
+						    PVOID              First,
+						    PVOID              Second)
+    {
+    int r = memcmp (First, Second, sizeof (GUID));
+
+    UNREFERENCED_PARAMETER (Table);
+
+    return (r < 0) ? GenericLessThan : (r > 0) ? GenericGreaterThan : GenericEqual;
+    }
+
+
+PVOID NTAPI SplayAllocate (PRTL_GENERIC_TABLE Table, CLONG Size)
+    {
+    UNREFERENCED_PARAMETER (Table);
+
+    return malloc (Size);
+    }
+
+
+VOID NTAPI SplayFree (PRTL_GENERIC_TABLE Table, PVOID Buffer)
+    {
+    UNREFERENCED_PARAMETER (Table);
+
+    free (Buffer);
+    }
+
+
+VOID SplayInitialize (VOID)
+    {
+    RtlInitializeGenericTable (&SignatureTable, SplayCompareSignature, SplayAllocate, SplayFree, NULL);
+    RtlInitializeGenericTable (&GuidTable,      SplayCompareGuid,      SplayAllocate, SplayFree, NULL);
+    }
+
+
+BOOLEAN SplayLookupSignature (ULONG Signature)
+    {
+    return RtlLookupElementGenericTable (&SignatureTable, &Signature) != NULL;
+    }
+
+
+BOOLEAN SplayLookupGuid (GUID *Guid)
+    {
+    return RtlLookupElementGenericTable (&GuidTable, Guid) != NULL;
+    }
+
+
+VOID SplayInsertSignature (ULONG Signature)
+    {
+    RtlInsertElementGenericTable (&SignatureTable, &Signature, sizeof (Signature), NULL);
+    }
+
+
+VOID SplayInsertGuid (GUID *Guid)
+    {
+    RtlInsertElementGenericTable (&GuidTable, Guid, sizeof (GUID), NULL);
+    }
+
+
+VOID SplayCleanup (VOID)
+    {
+    PVOID element;
+
+    while (NULL != (element = RtlEnumerateGenericTable (&SignatureTable, TRUE)))
+	{
+	RtlDeleteElementGenericTable (&SignatureTable, element);
+	}
+
+    while (NULL != (element = RtlEnumerateGenericTable (&GuidTable, TRUE)))
+	{
+	RtlDeleteElementGenericTable (&GuidTable, element);
+	}
+    }
+
+
+TEST_MODEL SplayModel = { "splay",
+			  SplayInitialize,
+			  SplayLookupSignature,
+			  SplayLookupGuid,
+			  SplayInsertSignature,
+			  SplayInsertGuid,
+			  SplayCleanup };
+
+
+
+//
+// A walk of every disk, for reference.
+//
+
+PULONG	LinearSignatures;
+GUID	*LinearGuids;
+ULONG	LinearSignatureCount;
+ULONG	LinearGuidCount;
+
+
+VOID LinearInitialize (VOID)
+    {
+    LinearSignatures     = malloc (MAX_LINEAR_DISKS * sizeof (ULONG));
+    LinearGuids          = malloc (MAX_LINEAR_DISKS * (PARTITIONS_PER_DISK + 1) * sizeof (GUID));
+    LinearSignatureCount = 0;
+    LinearGuidCount      = 0;
+    }
+
+
+BOOLEAN LinearLookupSignature (ULONG Signature)
+    {
+    ULONG i;
+
+    for (i = 0; i < LinearSignatureCount; i++)
+	{
+	if (LinearSignatures [i] == Signature)
+	    {
+	    return TRUE;
+	    }
+	}
+
+    return FALSE;
+    }
+
+
+BOOLEAN LinearLookupGuid (GUID *Guid)
+    {
+    ULONG i;
+
+    for (i = 0; i < LinearGuidCount; i++)
+	{
+	if (IsEqualGUID (&LinearGuids [i], Guid))
+	    {
+	    return TRUE;
+	    }
+	}
+
+    return FALSE;
+    }
+
+
+VOID LinearInsertSignature (ULONG Signature)
+    {
+    LinearSignatures [LinearSignatureCount++] = Signature;
+    }
+
+
+VOID LinearInsertGuid (GUID *Guid)
+    {
+    LinearGuids [LinearGuidCount++] = *Guid;
+    }
+
+
+VOID LinearCleanup (VOID)
+    {
+    free (LinearSignatures);
+    free (LinearGuids);
+    }
+
+
+TEST_MODEL LinearModel = { "linear",
+			   LinearInitialize,
+			   LinearLookupSignature,
+			   LinearLookupGuid,
+			   LinearInsertSignature,
+			   LinearInsertGuid,
+			   LinearCleanup };
+
+
+
+//
+// Runs the arrival of the given number of disks against a model, and returns
+// a checksum of the collision checks so that the models can be compared.
+//
+
+ULONG RunModel (IN PTEST_MODEL Model, IN ULONG Disks, OUT double *MicrosecondsPerDisk)
+    {
+    LARGE_INTEGER	frequency;
+    LARGE_INTEGER	start;
+    LARGE_INTEGER	end;
+    ULONG		checksum = 0;
+    ULONG		i;
+
+    QueryPerformanceFrequency (&frequency);
+
+    Model->Initialize ();
+
+    QueryPerformanceCounter (&start);
+
+    for (i = 0; i < Disks; i++)
+	{
+	checksum = checksum * 31 + SimulateArrival (Model, i);
+	}
+
+    QueryPerformanceCounter (&end);
+
+    Model->Cleanup ();
+
+    *MicrosecondsPerDisk = (double) (end.QuadPart - start.QuadPart) * 1000000.0 /
+			   (double) frequency.QuadPart / (double) Disks;
+
+    return checksum;
+    }   // RunModel
+
+
+
+ULONG LongestChain (IN PPM_INDEX Index)
+    {
+    PLIST_ENTRY	l;
+    ULONG	longest = 0;
+    ULONG	length;
+    ULONG	i;
+
+    for (i = 0; i <= Index->BucketMask; i++)
+	{
+	length = 0;
+	for (l = Index->Buckets [i].Flink; l != &Index->Buckets [i]; l = l->Flink)
+	    {
+	    length++;
+	    }
+
+	if (length > longest)
+	    {
+	    longest = length;
+	    }
+	}
+
+    return longest;
+    }   // LongestChain
+
+
+
+//
+// Sequential signatures, as handed out by some imaging tools, must still
+// spread over the buckets.
+//
+
+BOOLEAN CheckSequentialSignatures (ULONG Count)
+    {
+    ULONG	longest;
+    ULONG	i;
+    BOOLEAN	passed = TRUE;
+
+    HashInitialize ();
+
+    for (i = 0; i < Count; i++)
+	{
+	HashInsertSignature (0x10000000 + i);
+	}
+
+    for (i = 0; i < Count; i++)
+	{
+	if (!HashLookupSignature (0x10000000 + i))
+	    {
+	    printf ("  signature %08lx not found\n", 0x10000000 + i);
+	    passed = FALSE;
+	    break;
+	    }
+	}
+
+    if (HashLookupSignature (0x10000000 + Count))
+	{
+	printf ("  signature %08lx found but never inserted\n", 0x10000000 + Count);
+	passed = FALSE;
+	}
+
+    longest = LongestChain (&SignatureIndex);
+
+    printf ("  %6lu sequential signatures: %lu buckets, longest chain %lu\n",
+	    Count,
+	    SignatureIndex.BucketMask + 1,
+	    longest);
+
+    if (longest > MAX_CHAIN_LENGTH)
+	{
+	passed = FALSE;
+	}
+
+    HashCleanup ();
+
+    if (SignatureIndex.EntryCount || SignatureIndex.Buckets)
+	{
+	printf ("  index not empty after cleanup\n");
+	passed = FALSE;
+	}
+
+    return passed;
+    }   // CheckSequentialSignatures
+
+
+
+int __cdecl main (int argc, char *argv [])
+    {
+    ULONG	hashChecksum;
+    ULONG	splayChecksum;
+    ULONG	linearChecksum;
+    double	hashTime;
+    double	splayTime;
+    double	linearTime;
+    ULONG	i;
+    BOOLEAN	passed = TRUE;
+
+
+    UNREFERENCED_PARAMETER (argc);
+    UNREFERENCED_PARAMETER (argv);
+
+    printf ("%s\n\n", PROGRAM_TITLE);
+
+    printf ("  %6s  %12s  %12s  %12s   (microseconds per disk arrival)\n",
+	    "disks", "hash", "splay", "linear");
+
+    for (i = 0; i < sizeof (DiskCounts) / sizeof (DiskCounts [0]); i++)
+	{
+	hashChecksum  = RunModel (&HashModel,  DiskCounts [i], &hashTime);
+	splayChecksum = RunModel (&SplayModel, DiskCounts [i], &splayTime);
+
+	if (DiskCounts [i] <= MAX_LINEAR_DISKS)
+	    {
+	    linearChecksum = RunModel (&LinearModel, DiskCounts [i], &linearTime);
+
+	    printf ("  %6lu  %12.3f  %12.3f  %12.3f\n",
+		    DiskCounts [i], hashTime, splayTime, linearTime);
+	    }
+	else
+	    {
+	    linearChecksum = splayChecksum;
+
+	    printf ("  %6lu  %12.3f  %12.3f  %12s\n",
+		    DiskCounts [i], hashTime, splayTime, "-");
+	    }
+
+	if ((hashChecksum != splayChecksum) || (hashChecksum != linearChecksum))
+	    {
+	    printf ("  collision checks differ: hash %08lx, splay %08lx, linear %08lx\n",
+		    hashChecksum, splayChecksum, linearChecksum);
+	    passed = FALSE;
+	    }
+	}
+
+    printf ("\n");
+
+    if (!CheckSequentialSignatures (65536))
+	{
+	passed = FALSE;
+	}
+
+    printf ("\n%s\n", passed ? "PASSED" : "FAILED");
+
+    return passed ? 0 : 1;
+    }
@@ -87,13 +87,6 @@ ExecuteSrb(
     IN PSCSI_REQUEST_BLOCK Srb
     );
 
-BOOLEAN
-ResetBus(
-    IN PDEVICE_EXTENSION pDevExt,
-    IN ULONG PathId
-    );
-
-
 VOID
 FreeScatterGatherList(
     IN PDEVICE_EXTENSION DeviceExtension,
@@ -971,7 +964,7 @@ Return Value:
 
 
 VOID
-ExecuteSrb(
+StartSrb(
     IN PSCSI_REQUEST_BLOCK Srb
     )
 
@@ -979,15 +972,13 @@ ExecuteSrb(
 
 Routine Description:
 
-    This routine calls the start I/O routine an waits for the request to
-    complete.  During the wait for complete the interrupt routine is called,
-    also the timer routines are called at the appropriate times.  After the
-    request completes a check is made to determine if an request sense needs
-    to be issued.
+    This routine calls the start I/O routine and returns without waiting
+    for the request to complete.  PollSrb must be called until it reports
+    the request complete, and then CompleteSrb.
 
 Arguments:
 
-    Srb - Request to execute.
+    Srb - Request to start.
 
 Return Value:
 
@@ -996,131 +987,222 @@ Return Value:
 --*/
 
 {
-    ULONG milliSecondTime;
-    ULONG secondTime;
-    ULONG completionDelay;
-
     //
     // Show request is pending.
     //
 
     DeviceExtension->RequestPending = TRUE;
 
+    //
+    // The completion delay controls how long interrupts are serviced after
+    // a request has been completed.  This allows interrupts which occur after
+    // a completion to be serviced.
+    //
+
+    DeviceExtension->CompletionDelay = COMPLETION_DELAY;
+    DeviceExtension->PollIterations = 0;
+
     //
     // Start the request.
     //
 
     StartIo(Srb);
+}
+
+
+BOOLEAN
+ServiceMiniport(
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    This routine does the work of one pass of the polling loop besides
+    calling the interrupt routine: it makes the calls the miniport asked
+    for, stalls for PD_INTERLOOP_STALL microseconds and runs the miniport
+    timer.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE once a second, when the caller should run its timeouts.
+
+--*/
+
+{
+    if (DeviceExtension->Flags & PD_ENABLE_CALL_REQUEST) {
+
+        //
+        // Call the miniport requested routine.
+        //
+
+        DeviceExtension->Flags &= ~PD_ENABLE_CALL_REQUEST;
+        DeviceExtension->HwRequestInterrupt(DeviceExtension->HwDeviceExtension);
+
+        if (DeviceExtension->Flags & PD_DISABLE_CALL_REQUEST) {
+
+            DeviceExtension->Flags &= ~(PD_DISABLE_INTERRUPTS | PD_DISABLE_CALL_REQUEST);
+            DeviceExtension->HwRequestInterrupt(DeviceExtension->HwDeviceExtension);
+        }
+    }
+
+    if (DeviceExtension->Flags & PD_CALL_DMA_STARTED) {
+
+        DeviceExtension->Flags &= ~PD_CALL_DMA_STARTED;
+
+        //
+        // Notify the miniport driver that the DMA has been
+        // started.
+        //
+
+        if (DeviceExtension->HwDmaStarted) {
+                DeviceExtension->HwDmaStarted(
+                DeviceExtension->HwDeviceExtension
+                );
+        }
+    }
 
     //
-    // The completion delay controls how long interrupts are serviced after
-    // a request has been completed.  This allows interrupts which occur after
-    // a completion to be serviced.
+    // This enforces the delay between calls to the interrupt routine.
     //
 
-    completionDelay = COMPLETION_DELAY;
+    DeviceExtension->StallRoutine(PD_INTERLOOP_STALL);
 
     //
-    // Wait for the SRB to complete.
+    // Check the miniport timer.
     //
 
-    while (DeviceExtension->RequestPending) {
+    if (DeviceExtension->TimerValue != 0) {
 
-        //
-        // Wait 1 second then call the scsi port timer routine.
-        //
+        DeviceExtension->TimerValue--;
 
-        for (secondTime = 0; secondTime < 1000/ 250; secondTime++) {
+        if (DeviceExtension->TimerValue == 0) {
 
-            for (milliSecondTime = 0; milliSecondTime < (250 * 1000 / PD_INTERLOOP_STALL); milliSecondTime++) {
+            //
+            // The timer timed out so called requested timer routine.
+            //
 
-                if (!(DeviceExtension->Flags & PD_DISABLE_INTERRUPTS)) {
+            DeviceExtension->HwTimerRequest(DeviceExtension->HwDeviceExtension);
+        }
+    }
 
-                    //
-                    // Call miniport driver's interrupt routine.
-                    //
+    if (++DeviceExtension->PollIterations == 1000 * 1000 / PD_INTERLOOP_STALL) {
+        DeviceExtension->PollIterations = 0;
+        return TRUE;
+    }
 
-                    if (DeviceExtension->HwInterrupt != NULL) {
-                        DeviceExtension->HwInterrupt(DeviceExtension->HwDeviceExtension);
-                    }
-                }
+    return FALSE;
+}
 
-                //
-                // If the request is complete, call the interrupt routine
-                // a few more times to clean up any extra interrupts.
-                //
 
-                if (!DeviceExtension->RequestPending) {
-                    if (completionDelay-- == 0) {
-                        goto done;
-                    }
-                }
+BOOLEAN
+PollSrb(
+    IN PSCSI_REQUEST_BLOCK Srb,
+    IN ULONG MaximumIterations
+    )
 
-                if (DeviceExtension->Flags & PD_ENABLE_CALL_REQUEST) {
+/*++
 
-                    //
-                    // Call the miniport requested routine.
-                    //
+Routine Description:
 
-                    DeviceExtension->Flags &= ~PD_ENABLE_CALL_REQUEST;
-                    DeviceExtension->HwRequestInterrupt(DeviceExtension->HwDeviceExtension);
+    This routine waits for a request started by StartSrb to complete.  The
+    interrupt routine is called every PD_INTERLOOP_STALL microseconds and
+    the timer routines are called at the appropriate times.  Where the wait
+    left off is kept in the device extension, so the wait can be split over
+    several calls.
 
-                    if (DeviceExtension->Flags & PD_DISABLE_CALL_REQUEST) {
+Arguments:
 
-                        DeviceExtension->Flags &= ~(PD_DISABLE_INTERRUPTS | PD_DISABLE_CALL_REQUEST);
-                        DeviceExtension->HwRequestInterrupt(DeviceExtension->HwDeviceExtension);
-                    }
-                }
+    Srb - Request being executed.
 
-                if (DeviceExtension->Flags & PD_CALL_DMA_STARTED) {
+    MaximumIterations - Supplies the number of times to call the interrupt
+        routine before giving up, or PD_POLL_UNTIL_COMPLETE.
 
-                    DeviceExtension->Flags &= ~PD_CALL_DMA_STARTED;
+Return Value:
 
-                    //
-                    // Notify the miniport driver that the DMA has been
-                    // started.
-                    //
+    TRUE if the request is complete, FALSE if MaximumIterations ran out
+    first.
 
-                    if (DeviceExtension->HwDmaStarted) {
-                            DeviceExtension->HwDmaStarted(
-                            DeviceExtension->HwDeviceExtension
-                            );
-                    }
-                }
+--*/
 
-                //
-                // This enforces the delay between calls to the interrupt routine.
-                //
-                
-                DeviceExtension->StallRoutine(PD_INTERLOOP_STALL);
+{
+    ULONG iteration;
 
-                //
-                // Check the miniport timer.
-                //
+    for (iteration = 0;
+         MaximumIterations == PD_POLL_UNTIL_COMPLETE ||
+         iteration < MaximumIterations;
+         iteration++) {
 
-                if (DeviceExtension->TimerValue != 0) {
+        if (!(DeviceExtension->Flags & PD_DISABLE_INTERRUPTS)) {
 
-                    DeviceExtension->TimerValue--;
+            //
+            // Call miniport driver's interrupt routine.
+            //
 
-                    if (DeviceExtension->TimerValue == 0) {
+            if (DeviceExtension->HwInterrupt != NULL) {
+                DeviceExtension->HwInterrupt(DeviceExtension->HwDeviceExtension);
+            }
+        }
 
-                        //
-                        // The timer timed out so called requested timer routine.
-                        //
+        //
+        // If the request is complete, call the interrupt routine
+        // a few more times to clean up any extra interrupts.
+        //
 
-                        DeviceExtension->HwTimerRequest(DeviceExtension->HwDeviceExtension);
-                    }
-                }
+        if (!DeviceExtension->RequestPending) {
+            if (DeviceExtension->CompletionDelay-- == 0) {
+                return TRUE;
             }
         }
 
-        TickHandler(Srb);
+        //
+        // Call the scsi port timer routine once a second.
+        //
+
+        if (ServiceMiniport()) {
 
-        DebugPrint((1,"ExecuteSrb: Waiting for SRB request to complete (~3 sec)\n"));
+            TickHandler(Srb);
+
+            if (!DeviceExtension->RequestPending) {
+                return TRUE;
+            }
+
+            DebugPrint((1,"ExecuteSrb: Waiting for SRB request to complete (~3 sec)\n"));
+        }
     }
 
-done:
+    return FALSE;
+}
+
 
+VOID
+CompleteSrb(
+    IN PSCSI_REQUEST_BLOCK Srb
+    )
+
+/*++
+
+Routine Description:
+
+    This routine is called once PollSrb reports a request complete.  A
+    check is made to determine if a request sense needs to be issued.
+
+Arguments:
+
+    Srb - Request that completed.
+
+Return Value:
+
+    Nothing.
+
+--*/
+
+{
     if (Srb == &DeviceExtension->Srb &&
         Srb->SrbStatus != SRB_STATUS_SUCCESS) {
 
@@ -1144,9 +1226,39 @@ done:
     }
 }
 
+
+VOID
+ExecuteSrb(
+    IN PSCSI_REQUEST_BLOCK Srb
+    )
+
+/*++
+
+Routine Description:
+
+    This routine calls the start I/O routine an waits for the request to
+    complete.  After the request completes a check is made to determine if
+    an request sense needs to be issued.
+
+Arguments:
+
+    Srb - Request to execute.
+
+Return Value:
+
+    Nothing.
+
+--*/
+
+{
+    StartSrb(Srb);
+    PollSrb(Srb, PD_POLL_UNTIL_COMPLETE);
+    CompleteSrb(Srb);
+}
+
 
-NTSTATUS
-DiskDumpWrite(
+VOID
+PrepareWriteSrb(
     IN PLARGE_INTEGER DiskByteOffset,
     IN PMDL Mdl
     )
@@ -1155,7 +1267,8 @@ DiskDumpWrite(
 
 Routine Description:
 
-    This is the entry point for write requests to the diskdump driver.
+    This routine builds the write SRB for a dump write request in the
+    device extension.
 
 Arguments:
 
@@ -1165,7 +1278,7 @@ Arguments:
 
 Return Value:
 
-    Status of write operation.
+    None.
 
 --*/
 
@@ -1174,31 +1287,6 @@ Return Value:
     PCDB cdb = (PCDB)&srb->Cdb;
     ULONG blockOffset;
     ULONG blockCount;
-    ULONG retryCount = 0;
-
-    //
-    // ISSUE - 2000/02/29 - math:
-    //
-    // This is here until the StartVa is page aligned in the dump code
-    // (MmMapPhysicalMdl).
-    //
-    
-    Mdl->StartVa = PAGE_ALIGN( Mdl->StartVa );
-
-    DebugPrint((2,
-               "Write memory at %x for %x bytes\n",
-               Mdl->StartVa,
-               Mdl->ByteCount));
-
-
-writeRetry:
-    if (retryCount) {
-        //
-        // Remap the Mdl for dump data if IssueRequestSense() is called
-        // in ExecuteSrb() due to a write error.
-        //
-        MmMapMemoryDumpMdl(Mdl);
-    }
 
     //
     // Zero SRB.
@@ -1280,6 +1368,69 @@ writeRetry:
 
     cdb->CDB10.TransferBlocksMsb = ((PFOUR_BYTE)&blockCount)->Byte1;
     cdb->CDB10.TransferBlocksLsb = ((PFOUR_BYTE)&blockCount)->Byte0;
+}
+
+
+NTSTATUS
+DiskDumpWrite(
+    IN PLARGE_INTEGER DiskByteOffset,
+    IN PMDL Mdl
+    )
+
+/*++
+
+Routine Description:
+
+    This is the entry point for write requests to the diskdump driver.
+
+Arguments:
+
+    DiskByteOffset - Byte offset relative to beginning of partition.
+
+    Mdl - Memory descriptor list that defines this request.
+
+Return Value:
+
+    Status of write operation.
+
+--*/
+
+{
+    PSCSI_REQUEST_BLOCK srb = &DeviceExtension->Srb;
+    ULONG retryCount = 0;
+
+    //
+    // ISSUE - 2000/02/29 - math:
+    //
+    // This is here until the StartVa is page aligned in the dump code
+    // (MmMapPhysicalMdl).
+    //
+    
+    Mdl->StartVa = PAGE_ALIGN( Mdl->StartVa );
+
+    DebugPrint((2,
+               "Write memory at %x for %x bytes\n",
+               Mdl->StartVa,
+               Mdl->ByteCount));
+
+    //
+    // Crash dump writes are queued if the queued writer is set up.
+    //
+
+    if (DeviceExtension->WriteQueue != NULL) {
+        return QueueDumpWrite(DiskByteOffset, Mdl);
+    }
+
+writeRetry:
+    if (retryCount) {
+        //
+        // Remap the Mdl for dump data if IssueRequestSense() is called
+        // in ExecuteSrb() due to a write error.
+        //
+        MmMapMemoryDumpMdl(Mdl);
+    }
+
+    PrepareWriteSrb(DiskByteOffset, Mdl);
 
     //
     // Send SRB to miniport driver.
@@ -1342,6 +1493,12 @@ Return Value:
     PCDB cdb = (PCDB)&srb->Cdb;
     ULONG retryCount = 0;
 
+    //
+    // Wait for any queued crash dump writes.
+    //
+
+    FlushWriteQueue();
+
     //
     // No data will be transfered with these two requests.  So set up
     // our extension so that we don't try to flush any buffers.
@@ -1524,6 +1681,7 @@ Return Value:
 
     DeviceExtension->StallRoutine = context->StallRoutine;
     DeviceExtension->CommonBufferSize = context->CommonBufferSize;
+    DeviceExtension->CrashDump = context->CrashDump;
     TargetAddress = context->TargetAddress;
     
     //
@@ -1606,6 +1764,7 @@ Return Value:
 
     context->OpenRoutine = DiskDumpOpen;
     context->WriteRoutine = DiskDumpWrite;
+    context->WritePendingRoutine = DiskDumpWritePending;
     context->FinishRoutine = DiskDumpFinish;
     context->MaximumTransferSize = GetDeviceTransferSize(context->PortConfiguration);
 
@@ -1963,6 +2122,7 @@ Return Value:
     UCHAR dumpString[] = "dump=1;";
     UCHAR crashDump[32];
     PINQUIRYDATA inquiryData;
+    BOOLEAN commandQueue;
     BOOLEAN allocatedConfigInfo;
 
 
@@ -2502,6 +2662,11 @@ Return Value:
         (LONG) inquiryData->DeviceTypeModifier,
         inquiryData->RemovableMedia ? "Removable" : "Non-Removable"));
 
+    //
+    // The inquiry data is overwritten by the read capacity data.
+    //
+
+    commandQueue = (BOOLEAN) inquiryData->CommandQueue;
     
     //
     // Reset the bus.
@@ -2548,6 +2713,12 @@ Return Value:
     // wrong TargetId, Lun, which it should never do.
     //
 
+    //
+    // Set up the queued crash dump writer, if it is built in.
+    //
+
+    InitializeWriteQueue(HwInitializationData, commandQueue);
+
     DeviceExtension->FoundBootDevice = TRUE;
     status = STATUS_SUCCESS;
 
@@ -2636,9 +2807,15 @@ Return Value:
     // The first is the data buffer passed in an SRB.
     //
     // The second is an address within the common buffer which is
-    // the noncached extension or SRB extensions.
+    // the noncached extension or SRB extensions.  Queued crash dump writes
+    // are done from common buffer 1, so their data buffers are the second
+    // type.
     //
 
+    if (Srb != NULL && IsQueuedWriteSrb(Srb)) {
+        Srb = NULL;
+    }
+
     if (Srb) {
 
         //
@@ -2945,6 +3122,19 @@ ScsiPortNotification(
     switch (NotificationType) {
 
         case NextLuRequest:
+
+            //
+            // The miniport can take another request for the disk.  Only the
+            // queued crash dump writer gives it one before the last has
+            // completed.
+            //
+
+            DeviceExtension->InterruptFlags |= PD_READY_FOR_NEXT_LU_REQUEST;
+
+            //
+            // Fall through.
+            //
+
         case NextRequest:
 
             //
@@ -2981,6 +3171,10 @@ ScsiPortNotification(
                 //
 
                 RequestSenseCompletion();
+
+            } else {
+
+                CompleteQueuedWrite(srb);
             }
 
             break;
@@ -3252,6 +3446,12 @@ Return Value:
     PSCSI_REQUEST_BLOCK srb = &DeviceExtension->Srb;
     PSCSI_REQUEST_BLOCK failingSrb;
 
+    //
+    // Complete any queued crash dump writes.
+    //
+
+    CompleteAllQueuedWrites(SrbStatus);
+
     //
     // Check if a request is outstanding.
     //
@@ -4128,6 +4328,15 @@ Return Value:
 
 {
     if (DeviceExtension->NonCachedExtensionSize >= NumberOfBytes) {
+
+        //
+        // The queued crash dump writer uses what the miniport does not.
+        //
+
+        if (DeviceExtension->NonCachedExtensionUsed < NumberOfBytes) {
+            DeviceExtension->NonCachedExtensionUsed = NumberOfBytes;
+        }
+
         return DeviceExtension->NonCachedExtension;
     } else {
         DebugPrint((0,
@@ -4234,7 +4443,7 @@ Return Value:
     if (DeviceExtension->RequestPending) {
         srb = &DeviceExtension->Srb;
     } else {
-        srb = NULL;
+        srb = GetQueuedWriteSrb(QueueTag);
     }
 
     return srb;
@@ -4617,8 +4826,16 @@ StorPortGetScatterGatherList(
     IN PSCSI_REQUEST_BLOCK Srb
     )
 {
+    PVOID scatterGatherList;
+
     // NB: Check that SG list count is correct
 
+    scatterGatherList = GetQueuedWriteScatterGatherList(Srb);
+
+    if (scatterGatherList != NULL) {
+        return (PSTOR_SCATTER_GATHER_LIST)scatterGatherList;
+    }
+
     return (PSTOR_SCATTER_GATHER_LIST)&DeviceExtension->ScatterGatherList;
 }
 
@@ -5632,6 +5849,11 @@ StorPortSetDeviceQueueDepth(
     IN ULONG Depth
     )
 {
+    //
+    // Keep the depth for the queued crash dump writer.
+    //
+
+    DeviceExtension->QueueDepth = Depth;
     return TRUE;
 }
 
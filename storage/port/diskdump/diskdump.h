@@ -330,6 +330,38 @@ typedef struct _DEVICE_EXTENSION {
     // The common buffer size is saved during initialization
     //
     ULONG CommonBufferSize;
+
+    //
+    // Where PollSrb left off waiting for the current request: the number
+    // of interrupt routine calls left after completion, and the number of
+    // calls since the last call to the timer routine.
+    //
+
+    ULONG CompletionDelay;
+    ULONG PollIterations;
+
+    //
+    // TRUE if the driver was loaded to write a crash dump rather than a
+    // hibernation file.
+    //
+
+    BOOLEAN CrashDump;
+
+    //
+    // The most of the noncached extension the miniport has asked for, and
+    // the queue depth it set for the disk, if it set one.  The queued
+    // crash dump writer sizes itself from these.
+    //
+
+    ULONG NonCachedExtensionUsed;
+    ULONG QueueDepth;
+
+    //
+    // The queued crash dump writer, or NULL if crash dump writes are done
+    // one at a time.
+    //
+
+    struct _DUMP_WRITE_QUEUE *WriteQueue;
 } DEVICE_EXTENSION, *PDEVICE_EXTENSION;
 
 #define DEVICE_EXTENSION_SIZE sizeof(DEVICE_EXTENSION)
@@ -344,6 +376,7 @@ typedef struct _DEVICE_EXTENSION {
 #define PD_READY_FOR_NEXT_REQUEST    0X0008
 #define PD_FLUSH_ADAPTER_BUFFERS     0X0010
 #define PD_MAP_TRANSFER              0X0020
+#define PD_READY_FOR_NEXT_LU_REQUEST 0X0040
 #define PD_CALL_DMA_STARTED          0X01000
 #define PD_DISABLE_CALL_REQUEST      0X02000
 #define PD_DISABLE_INTERRUPTS        0X04000
@@ -373,6 +406,20 @@ typedef struct _DEVICE_EXTENSION {
 
 #define COMPLETION_DELAY 10
 
+//
+// Tell PollSrb to wait for as long as the request takes.
+//
+
+#define PD_POLL_UNTIL_COMPLETE ((ULONG)-1)
+
+//
+// The number of times to call the interrupt routine for each resume of a
+// pending dump write.  This is enough to see a completed request through
+// its completion delay in a single resume.
+//
+
+#define PD_RESUME_POLL_ITERATIONS (COMPLETION_DELAY + 1)
+
 //
 // Define global data structures
 //
@@ -386,3 +433,110 @@ extern ULONG ScsiPortCount;
 #if defined(i386) || defined(_AMD64_)
 #define HalFlushIoBuffers
 #endif
+
+//
+// Request execution, shared by the synchronous and pending write paths.
+//
+
+VOID
+StartSrb(
+    IN PSCSI_REQUEST_BLOCK Srb
+    );
+
+BOOLEAN
+PollSrb(
+    IN PSCSI_REQUEST_BLOCK Srb,
+    IN ULONG MaximumIterations
+    );
+
+VOID
+CompleteSrb(
+    IN PSCSI_REQUEST_BLOCK Srb
+    );
+
+BOOLEAN
+ServiceMiniport(
+    VOID
+    );
+
+BOOLEAN
+ResetBus(
+    IN PDEVICE_EXTENSION pDevExt,
+    IN ULONG PathId
+    );
+
+PVOID
+AllocatePool(
+    IN ULONG Size
+    );
+
+VOID
+FreePool(
+    IN PVOID Ptr
+    );
+
+VOID
+PrepareWriteSrb(
+    IN PLARGE_INTEGER DiskByteOffset,
+    IN PMDL Mdl
+    );
+
+NTSTATUS
+DiskDumpWrite(
+    IN PLARGE_INTEGER DiskByteOffset,
+    IN PMDL Mdl
+    );
+
+NTSTATUS
+DiskDumpWritePending(
+    IN LONG Action,
+    IN PLARGE_INTEGER DiskByteOffset,
+    IN PMDL Mdl,
+    IN PVOID LocalData
+    );
+
+//
+// The queued crash dump writer.
+//
+
+VOID
+InitializeWriteQueue(
+    IN struct _HW_INITIALIZATION_DATA *HwInitializationData,
+    IN BOOLEAN CommandQueue
+    );
+
+NTSTATUS
+QueueDumpWrite(
+    IN PLARGE_INTEGER DiskByteOffset,
+    IN PMDL Mdl
+    );
+
+VOID
+FlushWriteQueue(
+    VOID
+    );
+
+BOOLEAN
+IsQueuedWriteSrb(
+    IN PSCSI_REQUEST_BLOCK Srb
+    );
+
+VOID
+CompleteQueuedWrite(
+    IN PSCSI_REQUEST_BLOCK Srb
+    );
+
+VOID
+CompleteAllQueuedWrites(
+    IN UCHAR SrbStatus
+    );
+
+PSCSI_REQUEST_BLOCK
+GetQueuedWriteSrb(
+    IN LONG QueueTag
+    );
+
+PVOID
+GetQueuedWriteScatterGatherList(
+    IN PSCSI_REQUEST_BLOCK Srb
+    );
@@ -0,0 +1,119 @@
+//
+// Expands a crash dump written by a diskdump driver built with
+// DUMP_COMPRESSION, so that the debugger can read it.
+//
+// The dump is walked from the start as dumpfmt.h describes.  Each chunk is
+// expanded in place of the block it stands for, and everything else is
+// copied, so the output has the layout of an ordinary dump.
+//
+// Usage:
+//
+//     dumpexp input output
+//
+
+#include <nt.h>
+#include <ntrtl.h>
+#include <nturtl.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dumplz.c"
+
+//
+// The walk looks at up to DUMP_CHUNK_MAX_LENGTH bytes at a time, so the
+// input is read into a buffer twice that size and refilled when less than
+// that is left in it.
+//
+
+UCHAR Input[2 * DUMP_CHUNK_MAX_LENGTH];
+UCHAR Output[DUMP_CHUNK_MAX_LENGTH];
+
+int __cdecl
+main(
+    int argc,
+    char** argv
+    )
+{
+    DUMP_EXPAND_CONTEXT context;
+    FILE*       input;
+    FILE*       output;
+    ULONGLONG   offset = 0;
+    ULONG       position = 0;
+    ULONG       valid = 0;
+    ULONG       length;
+    size_t      read;
+    BOOLEAN     end = FALSE;
+
+    if (argc != 3) {
+        printf("usage: dumpexp input output\n");
+        return 2;
+    }
+
+    input = fopen(argv[1], "rb");
+    if (!input) {
+        printf("dumpexp: cannot open %s\n", argv[1]);
+        return 1;
+    }
+
+    output = fopen(argv[2], "wb");
+    if (!output) {
+        printf("dumpexp: cannot create %s\n", argv[2]);
+        return 1;
+    }
+
+    memset(&context, 0, sizeof(context));
+
+    for (;;) {
+
+        if (valid - position < DUMP_CHUNK_MAX_LENGTH && !end) {
+
+            memmove(Input, Input + position, valid - position);
+            valid -= position;
+            position = 0;
+
+            read = fread(Input + valid, 1, sizeof(Input) - valid, input);
+            valid += (ULONG) read;
+
+            if (read == 0) {
+                end = TRUE;
+            }
+
+            continue;
+        }
+
+        if (position == valid) {
+            break;
+        }
+
+        length = DumpExpandBlock(&context,
+                                 Input + position,
+                                 valid - position,
+                                 Output);
+        if (length == 0) {
+            printf("dumpexp: chunk at %I64x is corrupt\n", offset);
+            return 1;
+        }
+
+        if (fwrite(Output, 1, length, output) != length) {
+            printf("dumpexp: cannot write %s\n", argv[2]);
+            return 1;
+        }
+
+        position += length;
+        offset += length;
+    }
+
+    if (ferror(input) || fclose(output)) {
+        printf("dumpexp: cannot copy %s to %s\n", argv[1], argv[2]);
+        return 1;
+    }
+
+    if (context.Chunks == 0) {
+        printf("dumpexp: %s is not compressed; copied it\n", argv[1]);
+    } else {
+        printf("dumpexp: expanded %d chunks, %I64u bytes\n", context.Chunks, offset);
+    }
+
+    return 0;
+}
@@ -0,0 +1,158 @@
+/*++
+
+Copyright (c) 2003  Microsoft Corporation
+
+Module Name:
+
+    dumpfmt.h
+
+Abstract:
+
+    This file defines the compressed crash dump format that the diskdump
+    driver writes when it is built with DUMP_COMPRESSION, and the codec
+    that the driver, dumpexp and the compression test share.
+
+    The driver writes every block at the offset the system asked for, so
+    the dump keeps its layout.  A write that begins with the dump header
+    signature is written as is.  Any other write is replaced by a chunk: a
+    DUMP_CHUNK_HEADER followed by the compressed data, padded to a whole
+    sector.  The sectors after the chunk are not written, and hold
+    whatever was on the disk before.  A chunk is only used if it saves at
+    least a sector; otherwise the block is written as is.
+
+    Pages that are all zero are left out of the compressed data, and the
+    rest are compressed as one LZ stream.  The stream is a series of
+    sequences.  Each begins with a token byte: the high nibble is the
+    number of literal bytes that follow and the low nibble the length of
+    the match after them, less DUMP_LZ_MIN_MATCH.  A nibble of 15 is
+    followed by more length bytes, which are added to it until one is
+    less than 255.  The literals come next, then a two byte little endian
+    offset back to the match, then the extra match length bytes.  The
+    last sequence of a run of pages has no match.
+
+    To expand a dump, walk it from the start in DUMP_CHUNK_ALIGNMENT steps.
+    Where a valid header is found, expand the chunk and skip the length it
+    stands for; copy anything else.  The chunk sequence numbers go up in
+    the order they were written, which keeps a copy of a header inside
+    the dumped memory from being taken for a chunk.
+
+Revision History:
+
+--*/
+
+#define DUMP_CHUNK_SIGNATURE        'KCDD'
+#define DUMP_CHUNK_VERSION          1
+
+//
+// The first ULONG of the dump header, DUMP_SIGNATURE.  A write that begins
+// with it is never compressed.
+//
+
+#define DUMP_HEADER_SIGNATURE       'EGAP'
+
+//
+// Chunks begin on a sector boundary, and stand for at most
+// DUMP_CHUNK_MAX_PAGES pages and DUMP_CHUNK_MAX_LENGTH bytes.
+//
+
+#define DUMP_CHUNK_ALIGNMENT        0x200
+#define DUMP_CHUNK_MAX_PAGES        32
+#define DUMP_CHUNK_MAX_LENGTH       0x10000
+
+typedef struct _DUMP_CHUNK_HEADER {
+
+    ULONG Signature;
+    USHORT Version;
+    USHORT HeaderSize;
+
+    //
+    // Chosen when the dump is written, and the same in every chunk.
+    //
+
+    ULONG DumpId;
+    ULONG Sequence;
+
+    //
+    // The number of bytes of dump the chunk stands for, and the number of
+    // bytes of compressed data after the header.
+    //
+
+    ULONG Length;
+    ULONG CompressedLength;
+
+    //
+    // The chunk is split into pages of 1 << PageShift bytes, the last of
+    // which may be short.  A set bit in ZeroPages marks a page of zeros
+    // that is not in the compressed data.
+    //
+
+    ULONG PageShift;
+    ULONG ZeroPages;
+
+    //
+    // DumpChecksum of the compressed data, and of the header with
+    // HeaderChecksum zero.
+    //
+
+    ULONG DataChecksum;
+    ULONG HeaderChecksum;
+
+    ULONG Reserved[2];
+
+} DUMP_CHUNK_HEADER, *PDUMP_CHUNK_HEADER;
+
+#define DUMP_LZ_MIN_MATCH           4
+#define DUMP_LZ_HASH_BITS           11
+
+#define DUMP_COMPRESS_WORKSPACE_SIZE ((1 << DUMP_LZ_HASH_BITS) * sizeof(USHORT))
+
+//
+// Where a walk over a dump has got to.  Zero it before the first call of
+// DumpExpandBlock.
+//
+
+typedef struct _DUMP_EXPAND_CONTEXT {
+    ULONG DumpId;
+    ULONG Sequence;
+    ULONG Chunks;
+} DUMP_EXPAND_CONTEXT, *PDUMP_EXPAND_CONTEXT;
+
+ULONG
+DumpChecksum(
+    IN ULONG Checksum,
+    IN PVOID Buffer,
+    IN ULONG Length
+    );
+
+BOOLEAN
+DumpBuildChunk(
+    IN PUCHAR Source,
+    IN ULONG Length,
+    IN ULONG PageShift,
+    IN ULONG DumpId,
+    IN ULONG Sequence,
+    OUT PUCHAR Chunk,
+    IN ULONG ChunkLength,
+    IN PVOID Workspace,
+    OUT PULONG BytesUsed
+    );
+
+BOOLEAN
+DumpCheckChunkHeader(
+    IN PDUMP_CHUNK_HEADER Header,
+    IN ULONG Length
+    );
+
+BOOLEAN
+DumpExpandChunk(
+    IN PDUMP_CHUNK_HEADER Header,
+    OUT PUCHAR Output
+    );
+
+ULONG
+DumpExpandBlock(
+    IN OUT PDUMP_EXPAND_CONTEXT Context,
+    IN PUCHAR Input,
+    IN ULONG InputLength,
+    OUT PUCHAR Output
+    );
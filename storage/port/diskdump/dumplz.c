@@ -0,0 +1,784 @@
+/*++
+
+Copyright (c) 2003  Microsoft Corporation
+
+Module Name:
+
+    dumplz.c
+
+Abstract:
+
+    This file contains the codec for the compressed crash dump format
+    described in dumpfmt.h.  The driver builds chunks with it, and dumpexp
+    expands them.
+
+    The compressor keeps one candidate match per hash of four bytes, and
+    takes bigger steps through data that does not match, so that it keeps
+    up with the disk on the single processor left running after a crash.
+
+Environment:
+
+    Kernel mode, at HIGH_LEVEL, and user mode.
+
+Notes:
+
+    This file is also built into dumpexp and the user mode compression
+    test, with UTEST defined.
+
+Revision History:
+
+--*/
+
+#ifndef UTEST
+
+#include "ntosp.h"
+
+#endif
+
+#include "dumpfmt.h"
+
+#define DUMP_LZ_MAX_OFFSET          0xFFFF
+#define DUMP_LZ_HASH(Value)         (((Value) * 2654435761U) >> (32 - DUMP_LZ_HASH_BITS))
+
+//
+// The largest number that Adler-32 can sum before the sums must be
+// reduced.
+//
+
+#define DUMP_CHECKSUM_BASE          65521
+#define DUMP_CHECKSUM_RUN           5552
+
+
+ULONG
+DumpChecksum(
+    IN ULONG Checksum,
+    IN PVOID Buffer,
+    IN ULONG Length
+    )
+
+/*++
+
+Routine Description:
+
+    This routine computes the Adler-32 checksum of a buffer.
+
+Arguments:
+
+    Checksum - Supplies the checksum of the data before the buffer, or 1.
+
+    Buffer - Supplies the data.
+
+    Length - Supplies the length of the data in bytes.
+
+Return Value:
+
+    The checksum of the data up to the end of the buffer.
+
+--*/
+
+{
+    PUCHAR data = Buffer;
+    ULONG low = Checksum & 0xFFFF;
+    ULONG high = Checksum >> 16;
+    ULONG run;
+
+    while (Length != 0) {
+
+        run = Length < DUMP_CHECKSUM_RUN ? Length : DUMP_CHECKSUM_RUN;
+        Length -= run;
+
+        while (run-- != 0) {
+            low += *data++;
+            high += low;
+        }
+
+        low %= DUMP_CHECKSUM_BASE;
+        high %= DUMP_CHECKSUM_BASE;
+    }
+
+    return (high << 16) | low;
+}
+
+
+BOOLEAN
+DumpIsZero(
+    IN PUCHAR Buffer,
+    IN ULONG Length
+    )
+{
+    ULONG_PTR UNALIGNED *word = (ULONG_PTR UNALIGNED *) Buffer;
+    ULONG i;
+
+    for (i = 0; i < Length / sizeof(ULONG_PTR); i++) {
+        if (word[i] != 0) {
+            return FALSE;
+        }
+    }
+
+    for (i *= sizeof(ULONG_PTR); i < Length; i++) {
+        if (Buffer[i] != 0) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+BOOLEAN
+DumpLzPutLength(
+    IN OUT PUCHAR *Output,
+    IN PUCHAR OutputEnd,
+    IN ULONG Length
+    )
+
+/*++
+
+Routine Description:
+
+    This routine writes the extra length bytes of a token nibble of 15.
+
+--*/
+
+{
+    PUCHAR output = *Output;
+
+    for (;;) {
+
+        if (output == OutputEnd) {
+            return FALSE;
+        }
+
+        if (Length < 255) {
+            break;
+        }
+
+        *output++ = 255;
+        Length -= 255;
+    }
+
+    *output++ = (UCHAR) Length;
+    *Output = output;
+
+    return TRUE;
+}
+
+
+BOOLEAN
+DumpLzPutSequence(
+    IN OUT PUCHAR *Output,
+    IN PUCHAR OutputEnd,
+    IN PUCHAR Literals,
+    IN ULONG LiteralLength,
+    IN ULONG Offset,
+    IN ULONG MatchLength
+    )
+
+/*++
+
+Routine Description:
+
+    This routine writes one sequence of the LZ stream.  A MatchLength of
+    zero writes the last sequence of a run of pages, which has no match.
+
+Return Value:
+
+    FALSE if the sequence does not fit.
+
+--*/
+
+{
+    PUCHAR output = *Output;
+    PUCHAR token;
+    ULONG matchCode;
+
+    if (output == OutputEnd) {
+        return FALSE;
+    }
+
+    token = output++;
+    *token = (UCHAR) ((LiteralLength < 15 ? LiteralLength : 15) << 4);
+
+    if (LiteralLength >= 15 &&
+        !DumpLzPutLength(&output, OutputEnd, LiteralLength - 15)) {
+
+        return FALSE;
+    }
+
+    if ((ULONG) (OutputEnd - output) < LiteralLength) {
+        return FALSE;
+    }
+
+    RtlCopyMemory(output, Literals, LiteralLength);
+    output += LiteralLength;
+
+    if (MatchLength != 0) {
+
+        if (OutputEnd - output < 2) {
+            return FALSE;
+        }
+
+        *output++ = (UCHAR) Offset;
+        *output++ = (UCHAR) (Offset >> 8);
+
+        matchCode = MatchLength - DUMP_LZ_MIN_MATCH;
+        *token |= (UCHAR) (matchCode < 15 ? matchCode : 15);
+
+        if (matchCode >= 15 &&
+            !DumpLzPutLength(&output, OutputEnd, matchCode - 15)) {
+
+            return FALSE;
+        }
+    }
+
+    *Output = output;
+
+    return TRUE;
+}
+
+
+BOOLEAN
+DumpLzGetLength(
+    IN OUT PUCHAR *Input,
+    IN PUCHAR InputEnd,
+    IN OUT PULONG Length
+    )
+{
+    PUCHAR input = *Input;
+    UCHAR next;
+
+    do {
+
+        if (input == InputEnd || *Length > DUMP_CHUNK_MAX_LENGTH) {
+            return FALSE;
+        }
+
+        next = *input++;
+        *Length += next;
+
+    } while (next == 255);
+
+    *Input = input;
+
+    return TRUE;
+}
+
+
+BOOLEAN
+DumpLzCompressRun(
+    IN PUCHAR Source,
+    IN ULONG Start,
+    IN ULONG End,
+    IN OUT PUCHAR *Output,
+    IN PUCHAR OutputEnd,
+    IN PUSHORT HashTable
+    )
+
+/*++
+
+Routine Description:
+
+    This routine compresses a run of pages that are not zero.  Matches
+    may reach back into earlier runs and the zero pages between them,
+    since those are in place when the run is expanded.
+
+Arguments:
+
+    Source - Supplies the whole chunk.
+
+    Start, End - Supply the byte range of the run.
+
+    Output - Supplies where the sequences go, and returns their end.
+
+    OutputEnd - Supplies the end of the output buffer.
+
+    HashTable - Supplies the position last seen for each hash.
+
+Return Value:
+
+    FALSE if the output does not fit.
+
+--*/
+
+{
+    ULONG position = Start;
+    ULONG anchor = Start;
+    ULONG candidate;
+    ULONG value;
+    ULONG hash;
+    ULONG matchLength;
+
+    while (position + DUMP_LZ_MIN_MATCH <= End) {
+
+        value = *(ULONG UNALIGNED *) (Source + position);
+        hash = DUMP_LZ_HASH(value);
+        candidate = HashTable[hash];
+        HashTable[hash] = (USHORT) position;
+
+        if (candidate < position &&
+            position - candidate <= DUMP_LZ_MAX_OFFSET &&
+            *(ULONG UNALIGNED *) (Source + candidate) == value) {
+
+            matchLength = DUMP_LZ_MIN_MATCH;
+
+            while (position + matchLength < End &&
+                   Source[candidate + matchLength] == Source[position + matchLength]) {
+
+                matchLength++;
+            }
+
+            if (!DumpLzPutSequence(Output,
+                                   OutputEnd,
+                                   Source + anchor,
+                                   position - anchor,
+                                   position - candidate,
+                                   matchLength)) {
+
+                return FALSE;
+            }
+
+            position += matchLength;
+            anchor = position;
+
+        } else {
+
+            //
+            // Step faster the longer nothing has matched.
+            //
+
+            position += 1 + ((position - anchor) >> 6);
+        }
+    }
+
+    if (anchor < End) {
+        return DumpLzPutSequence(Output,
+                                 OutputEnd,
+                                 Source + anchor,
+                                 End - anchor,
+                                 0,
+                                 0);
+    }
+
+    return TRUE;
+}
+
+
+BOOLEAN
+DumpLzExpandRun(
+    IN OUT PUCHAR *Input,
+    IN PUCHAR InputEnd,
+    OUT PUCHAR Output,
+    IN ULONG Start,
+    IN ULONG End
+    )
+
+/*++
+
+Routine Description:
+
+    This routine expands the sequences of one run of pages.  Everything
+    before the run in the output must already be in place.
+
+Return Value:
+
+    FALSE if the sequences are not valid.
+
+--*/
+
+{
+    PUCHAR input = *Input;
+    ULONG position = Start;
+    ULONG literalLength;
+    ULONG matchLength;
+    ULONG offset;
+    UCHAR token;
+
+    while (position < End) {
+
+        if (input == InputEnd) {
+            return FALSE;
+        }
+
+        token = *input++;
+
+        literalLength = token >> 4;
+
+        if (literalLength == 15 &&
+            !DumpLzGetLength(&input, InputEnd, &literalLength)) {
+
+            return FALSE;
+        }
+
+        if (literalLength > End - position ||
+            literalLength > (ULONG) (InputEnd - input)) {
+
+            return FALSE;
+        }
+
+        RtlCopyMemory(Output + position, input, literalLength);
+        input += literalLength;
+        position += literalLength;
+
+        if (position == End) {
+            break;
+        }
+
+        if (InputEnd - input < 2) {
+            return FALSE;
+        }
+
+        offset = input[0] | (input[1] << 8);
+        input += 2;
+
+        matchLength = token & 15;
+
+        if (matchLength == 15 &&
+            !DumpLzGetLength(&input, InputEnd, &matchLength)) {
+
+            return FALSE;
+        }
+
+        matchLength += DUMP_LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > position ||
+            matchLength > End - position) {
+
+            return FALSE;
+        }
+
+        //
+        // The match may overlap the bytes it produces, so copy it a byte
+        // at a time.
+        //
+
+        while (matchLength-- != 0) {
+            Output[position] = Output[position - offset];
+            position++;
+        }
+    }
+
+    *Input = input;
+
+    return TRUE;
+}
+
+
+BOOLEAN
+DumpBuildChunk(
+    IN PUCHAR Source,
+    IN ULONG Length,
+    IN ULONG PageShift,
+    IN ULONG DumpId,
+    IN ULONG Sequence,
+    OUT PUCHAR Chunk,
+    IN ULONG ChunkLength,
+    IN PVOID Workspace,
+    OUT PULONG BytesUsed
+    )
+
+/*++
+
+Routine Description:
+
+    This routine builds the chunk for a block of the dump.
+
+Arguments:
+
+    Source - Supplies the block.
+
+    Length - Supplies the length of the block in bytes.
+
+    PageShift - Supplies the log2 of the page size.
+
+    DumpId, Sequence - Supply the values for the chunk header.
+
+    Chunk - Supplies the buffer for the chunk.
+
+    ChunkLength - Supplies the size of that buffer.  The chunk is not built
+        if it would be larger.
+
+    Workspace - Supplies DUMP_COMPRESS_WORKSPACE_SIZE bytes of memory.
+
+    BytesUsed - Returns the length of the chunk.
+
+Return Value:
+
+    TRUE if the chunk fits in ChunkLength bytes.
+
+--*/
+
+{
+    PDUMP_CHUNK_HEADER header = (PDUMP_CHUNK_HEADER) Chunk;
+    ULONG pageSize = 1 << PageShift;
+    ULONG pages = (Length + pageSize - 1) >> PageShift;
+    ULONG zeroPages = 0;
+    ULONG page;
+    ULONG start;
+    ULONG end;
+    PUCHAR output;
+
+    if (Length == 0 ||
+        Length > DUMP_CHUNK_MAX_LENGTH ||
+        pages > DUMP_CHUNK_MAX_PAGES ||
+        ChunkLength < sizeof(DUMP_CHUNK_HEADER)) {
+
+        return FALSE;
+    }
+
+    for (page = 0; page < pages; page++) {
+
+        start = page << PageShift;
+        end = start + pageSize < Length ? start + pageSize : Length;
+
+        if (DumpIsZero(Source + start, end - start)) {
+            zeroPages |= (ULONG) 1 << page;
+        }
+    }
+
+    RtlZeroMemory(Workspace, DUMP_COMPRESS_WORKSPACE_SIZE);
+
+    output = (PUCHAR) (header + 1);
+    page = 0;
+
+    while (page < pages) {
+
+        if (zeroPages & ((ULONG) 1 << page)) {
+            page++;
+            continue;
+        }
+
+        start = page << PageShift;
+
+        while (page < pages && !(zeroPages & ((ULONG) 1 << page))) {
+            page++;
+        }
+
+        end = page << PageShift;
+
+        if (end > Length) {
+            end = Length;
+        }
+
+        if (!DumpLzCompressRun(Source,
+                               start,
+                               end,
+                               &output,
+                               Chunk + ChunkLength,
+                               Workspace)) {
+
+            return FALSE;
+        }
+    }
+
+    header->Signature = DUMP_CHUNK_SIGNATURE;
+    header->Version = DUMP_CHUNK_VERSION;
+    header->HeaderSize = sizeof(DUMP_CHUNK_HEADER);
+    header->DumpId = DumpId;
+    header->Sequence = Sequence;
+    header->Length = Length;
+    header->CompressedLength = (ULONG) (output - (PUCHAR) (header + 1));
+    header->PageShift = PageShift;
+    header->ZeroPages = zeroPages;
+    header->DataChecksum = DumpChecksum(1, header + 1, header->CompressedLength);
+    header->Reserved[0] = 0;
+    header->Reserved[1] = 0;
+    header->HeaderChecksum = 0;
+    header->HeaderChecksum = DumpChecksum(1, header, sizeof(DUMP_CHUNK_HEADER));
+
+    *BytesUsed = (ULONG) (output - Chunk);
+
+    return TRUE;
+}
+
+
+BOOLEAN
+DumpCheckChunkHeader(
+    IN PDUMP_CHUNK_HEADER Header,
+    IN ULONG Length
+    )
+
+/*++
+
+Routine Description:
+
+    This routine checks whether a chunk header is valid.
+
+Arguments:
+
+    Header - Supplies the header.
+
+    Length - Supplies the number of bytes of the dump from the header on.
+
+Return Value:
+
+    TRUE if the header is valid and its chunk fits in Length bytes.
+
+--*/
+
+{
+    DUMP_CHUNK_HEADER header;
+
+    if (Length < sizeof(DUMP_CHUNK_HEADER) ||
+        Header->Signature != DUMP_CHUNK_SIGNATURE) {
+
+        return FALSE;
+    }
+
+    header = *Header;
+    header.HeaderChecksum = 0;
+
+    if (DumpChecksum(1, &header, sizeof(header)) != Header->HeaderChecksum) {
+        return FALSE;
+    }
+
+    if (header.Version != DUMP_CHUNK_VERSION ||
+        header.HeaderSize != sizeof(DUMP_CHUNK_HEADER) ||
+        header.PageShift < 9 || header.PageShift > 16 ||
+        header.Length == 0 ||
+        header.Length > DUMP_CHUNK_MAX_LENGTH ||
+        header.Length > Length ||
+        ((header.Length - 1) >> header.PageShift) >= DUMP_CHUNK_MAX_PAGES ||
+        header.CompressedLength > header.Length - sizeof(DUMP_CHUNK_HEADER)) {
+
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+BOOLEAN
+DumpExpandChunk(
+    IN PDUMP_CHUNK_HEADER Header,
+    OUT PUCHAR Output
+    )
+
+/*++
+
+Routine Description:
+
+    This routine expands a chunk whose header has been checked.
+
+Arguments:
+
+    Header - Supplies the chunk.
+
+    Output - Supplies Header->Length bytes for the block.
+
+Return Value:
+
+    FALSE if the compressed data is not valid.
+
+--*/
+
+{
+    PUCHAR input = (PUCHAR) (Header + 1);
+    PUCHAR inputEnd = input + Header->CompressedLength;
+    ULONG pageSize = 1 << Header->PageShift;
+    ULONG pages = (Header->Length + pageSize - 1) >> Header->PageShift;
+    ULONG page;
+    ULONG start;
+    ULONG end;
+
+    if (DumpChecksum(1, input, Header->CompressedLength) != Header->DataChecksum) {
+        return FALSE;
+    }
+
+    page = 0;
+
+    while (page < pages) {
+
+        start = page << Header->PageShift;
+
+        if (Header->ZeroPages & ((ULONG) 1 << page)) {
+
+            page++;
+            end = page << Header->PageShift;
+
+            if (end > Header->Length) {
+                end = Header->Length;
+            }
+
+            RtlZeroMemory(Output + start, end - start);
+            continue;
+        }
+
+        while (page < pages && !(Header->ZeroPages & ((ULONG) 1 << page))) {
+            page++;
+        }
+
+        end = page << Header->PageShift;
+
+        if (end > Header->Length) {
+            end = Header->Length;
+        }
+
+        if (!DumpLzExpandRun(&input, inputEnd, Output, start, end)) {
+            return FALSE;
+        }
+    }
+
+    return input == inputEnd;
+}
+
+
+ULONG
+DumpExpandBlock(
+    IN OUT PDUMP_EXPAND_CONTEXT Context,
+    IN PUCHAR Input,
+    IN ULONG InputLength,
+    OUT PUCHAR Output
+    )
+
+/*++
+
+Routine Description:
+
+    This routine takes the next step of a walk over a dump.  If a chunk
+    begins at Input, it is expanded; otherwise DUMP_CHUNK_ALIGNMENT bytes
+    are copied.
+
+Arguments:
+
+    Context - Supplies where the walk has got to.
+
+    Input - Supplies the dump at the current offset, which is a multiple
+        of DUMP_CHUNK_ALIGNMENT.
+
+    InputLength - Supplies the number of bytes of the dump from the current
+        offset on.  Only the first DUMP_CHUNK_MAX_LENGTH are looked at.
+
+    Output - Supplies room for as many bytes.
+
+Return Value:
+
+    The number of bytes of the dump the step covered, or zero if a chunk
+    is corrupt.
+
+--*/
+
+{
+    PDUMP_CHUNK_HEADER header = (PDUMP_CHUNK_HEADER) Input;
+    ULONG length;
+
+    if (DumpCheckChunkHeader(header, InputLength) &&
+        header->Sequence >= Context->Sequence &&
+        (Context->Chunks == 0 || header->DumpId == Context->DumpId)) {
+
+        if (!DumpExpandChunk(header, Output)) {
+            return 0;
+        }
+
+        Context->DumpId = header->DumpId;
+        Context->Sequence = header->Sequence + 1;
+        Context->Chunks++;
+
+        return header->Length;
+    }
+
+    length = InputLength < DUMP_CHUNK_ALIGNMENT ? InputLength : DUMP_CHUNK_ALIGNMENT;
+
+    RtlCopyMemory(Output, Input, length);
+
+    return length;
+}
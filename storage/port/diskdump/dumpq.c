@@ -0,0 +1,1190 @@
+/*++
+
+Copyright (c) 2003  Microsoft Corporation
+
+Module Name:
+
+    dumpq.c
+
+Abstract:
+
+    This file contains the queued crash dump writer of the diskdump driver.
+
+    When the driver is built with DUMP_COMPRESSION, DiskDumpWrite hands
+    each crash dump write to QueueDumpWrite.  The block is compressed into
+    a chunk in common buffer 1, as described in dumpfmt.h, and the write of
+    the chunk is queued to the miniport.  The routine returns while the
+    write is in progress, so the next block is compressed while the disk
+    works.  If the miniport and the disk support tagged queuing, up to
+    DUMP_MAX_QUEUED_WRITES writes are given to the miniport at once;
+    otherwise one is.  DiskDumpFinish waits for them all.
+
+    The writes are done from common buffer 1 rather than from the memory
+    the system passes in, so they do not use map registers and need no
+    scatter/gather list of their own beyond one element.  The SRB
+    extensions come from the part of common buffer 0 that the miniport did
+    not take for its noncached extension.  If there is no room for them,
+    or anything else is missing, the queue is not set up and crash dumps
+    are written as before.
+
+    A write that fails is retried from the chunk, which is still in common
+    buffer 1.  A failure is returned by the next call, since the write that
+    failed has already been reported as done; the dump header is then
+    overwritten so that the dump is not taken for a good one.
+
+Environment:
+
+    Kernel mode, at HIGH_LEVEL, with no other processor running.
+
+Notes:
+
+    This file is also built into the user mode compression test, with
+    UTEST defined.
+
+Revision History:
+
+--*/
+
+#ifndef UTEST
+
+#include "ntosp.h"
+#include "stdarg.h"
+#include "stdio.h"
+#include "storport.h"
+#include "ntdddisk.h"
+#include "diskdump.h"
+#include "dumpfmt.h"
+
+#if DBG
+#undef DebugPrint
+#define DebugPrint(x) ScsiDebugPrint x
+#endif
+
+#endif
+
+extern PDEVICE_EXTENSION DeviceExtension;
+
+//
+// Crash dumps are only compressed if the driver is built with
+// DUMP_COMPRESSION defined, since the debugger cannot read the result
+// until dumpexp has expanded it.
+//
+
+#ifdef DUMP_COMPRESSION
+BOOLEAN DiskDumpCompression = TRUE;
+#else
+BOOLEAN DiskDumpCompression = FALSE;
+#endif
+
+#define DUMP_MAX_QUEUED_WRITES      16
+
+//
+// Retries of a write that fails, and of a write the disk is too busy for,
+// as DiskDumpWrite and WorkHorseDpc do.
+//
+
+#define DUMP_WRITE_RETRIES          2
+#define DUMP_WRITE_BUSY_RETRIES     20
+
+C_ASSERT((MAXIMUM_TRANSFER_SIZE >> PAGE_SHIFT) <= DUMP_CHUNK_MAX_PAGES);
+
+typedef struct _QUEUED_WRITE_SCATTER_GATHER_LIST {
+    ULONG NumberOfElements;
+    ULONG_PTR Reserved;
+    SCATTER_GATHER_ELEMENT Elements[1];
+} QUEUED_WRITE_SCATTER_GATHER_LIST, *PQUEUED_WRITE_SCATTER_GATHER_LIST;
+
+C_ASSERT (FIELD_OFFSET (QUEUED_WRITE_SCATTER_GATHER_LIST, Elements) ==
+          FIELD_OFFSET (SCATTER_GATHER_LIST, Elements));
+
+typedef enum _QUEUED_WRITE_STATE {
+    QueuedWriteFree,
+    QueuedWriteWaiting,         // not yet given to the miniport
+    QueuedWriteStarted,         // with the miniport
+    QueuedWriteBusy,            // to be started again on the next tick
+    QueuedWriteComplete,        // completed by the miniport
+    QueuedWriteDone             // finished with, and not yet released
+} QUEUED_WRITE_STATE;
+
+typedef struct _QUEUED_WRITE {
+    SCSI_REQUEST_BLOCK Srb;
+    QUEUED_WRITE_SCATTER_GATHER_LIST ScatterGatherList;
+    QUEUED_WRITE_STATE State;
+
+    //
+    // Where the chunk is in common buffer 1.
+    //
+
+    ULONG RingOffset;
+    ULONG RingLength;
+
+    LONG TimeoutCounter;
+    ULONG RetryCount;
+    ULONG BusyCount;
+} QUEUED_WRITE, *PQUEUED_WRITE;
+
+//
+// The writes are used in turn, and released in the same order, so the
+// chunks they hold are released from common buffer 1 in the order they
+// were put there.
+//
+
+typedef struct _DUMP_WRITE_QUEUE {
+
+    //
+    // The number of writes, and the most that are given to the miniport
+    // at once.  The limit is lowered if the disk reports its queue full.
+    //
+
+    ULONG Depth;
+    ULONG Limit;
+
+    //
+    // The next write to use, the oldest one in use, the number in use,
+    // and the number with the miniport.
+    //
+
+    ULONG Head;
+    ULONG Tail;
+    ULONG Count;
+    ULONG Started;
+
+    //
+    // Common buffer 1, and the offset just past the newest chunk in it.
+    //
+
+    PUCHAR Ring;
+    ULONG RingSize;
+    ULONG RingHead;
+
+    //
+    // The largest block that is put in a single chunk.
+    //
+
+    ULONG ChunkLength;
+
+    ULONG DumpId;
+    ULONG Sequence;
+
+    //
+    // Where the dump header was written, so it can be overwritten if a
+    // write fails.
+    //
+
+    BOOLEAN HeaderWritten;
+    BOOLEAN HeaderInvalidated;
+    LARGE_INTEGER HeaderOffset;
+
+    NTSTATUS Status;
+
+    PVOID Workspace;
+
+    QUEUED_WRITE Writes[1];
+
+} DUMP_WRITE_QUEUE, *PDUMP_WRITE_QUEUE;
+
+
+PQUEUED_WRITE
+GetQueuedWrite(
+    IN PSCSI_REQUEST_BLOCK Srb
+    )
+
+/*++
+
+Routine Description:
+
+    This routine returns the queued write an SRB belongs to.
+
+Return Value:
+
+    The queued write, or NULL if the SRB is not one of them.
+
+--*/
+
+{
+    PDUMP_WRITE_QUEUE queue = DeviceExtension->WriteQueue;
+    ULONG_PTR offset;
+
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    offset = (PUCHAR) Srb - (PUCHAR) queue->Writes;
+
+    if (offset >= queue->Depth * sizeof(QUEUED_WRITE) ||
+        offset % sizeof(QUEUED_WRITE) != FIELD_OFFSET(QUEUED_WRITE, Srb)) {
+
+        return NULL;
+    }
+
+    return CONTAINING_RECORD(Srb, QUEUED_WRITE, Srb);
+}
+
+
+BOOLEAN
+IsQueuedWriteSrb(
+    IN PSCSI_REQUEST_BLOCK Srb
+    )
+{
+    return GetQueuedWrite(Srb) != NULL;
+}
+
+
+PVOID
+GetQueuedWriteScatterGatherList(
+    IN PSCSI_REQUEST_BLOCK Srb
+    )
+{
+    PQUEUED_WRITE write = GetQueuedWrite(Srb);
+
+    return write != NULL ? &write->ScatterGatherList : NULL;
+}
+
+
+PSCSI_REQUEST_BLOCK
+GetQueuedWriteSrb(
+    IN LONG QueueTag
+    )
+
+/*++
+
+Routine Description:
+
+    This routine returns the queued write the miniport has with a queue
+    tag, for ScsiPortGetSrb.
+
+Arguments:
+
+    QueueTag - Supplies the tag, or SP_UNTAGGED.  Writes are only untagged
+        if one is queued at a time.
+
+Return Value:
+
+    The SRB, or NULL if the miniport has no such write.
+
+--*/
+
+{
+    PDUMP_WRITE_QUEUE queue = DeviceExtension->WriteQueue;
+    PQUEUED_WRITE write;
+
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    if (queue->Depth == 1) {
+        write = &queue->Writes[0];
+    } else if (QueueTag >= 1 && (ULONG) QueueTag <= queue->Depth) {
+        write = &queue->Writes[QueueTag - 1];
+    } else {
+        return NULL;
+    }
+
+    return write->State == QueuedWriteStarted ? &write->Srb : NULL;
+}
+
+
+VOID
+CompleteQueuedWrite(
+    IN PSCSI_REQUEST_BLOCK Srb
+    )
+
+/*++
+
+Routine Description:
+
+    This routine is called when the miniport completes a queued write.  The
+    status is looked at the next time the queue is polled.
+
+--*/
+
+{
+    PDUMP_WRITE_QUEUE queue = DeviceExtension->WriteQueue;
+    PQUEUED_WRITE write = GetQueuedWrite(Srb);
+
+    if (write == NULL || write->State != QueuedWriteStarted) {
+        return;
+    }
+
+    write->State = QueuedWriteComplete;
+    write->TimeoutCounter = -1;
+    queue->Started--;
+}
+
+
+VOID
+CompleteAllQueuedWrites(
+    IN UCHAR SrbStatus
+    )
+
+/*++
+
+Routine Description:
+
+    This routine completes every write the miniport has, for
+    ScsiPortCompleteRequest.
+
+--*/
+
+{
+    PDUMP_WRITE_QUEUE queue = DeviceExtension->WriteQueue;
+    ULONG i;
+
+    if (queue == NULL) {
+        return;
+    }
+
+    for (i = 0; i < queue->Depth; i++) {
+
+        if (queue->Writes[i].State == QueuedWriteStarted) {
+
+            queue->Writes[i].Srb.SrbStatus = SrbStatus;
+            queue->Writes[i].Srb.DataTransferLength = 0;
+            CompleteQueuedWrite(&queue->Writes[i].Srb);
+        }
+    }
+}
+
+
+VOID
+InitializeWriteQueue(
+    IN PHW_INITIALIZATION_DATA HwInitializationData,
+    IN BOOLEAN CommandQueue
+    )
+
+/*++
+
+Routine Description:
+
+    This routine sets up the queued writer, once the miniport has been
+    initialized and the sector size is known.  If it cannot be set up,
+    crash dumps are written synchronously as before.
+
+Arguments:
+
+    HwInitializationData - Supplies the miniport initialization structure.
+
+    CommandQueue - Supplies whether the disk supports tagged queuing.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PDUMP_WRITE_QUEUE queue;
+    PVOID workspace;
+    PUCHAR srbExtension;
+    ULONG extensionSize;
+    ULONG available;
+    ULONG depth;
+    ULONG used;
+    ULONG i;
+
+    if (!DiskDumpCompression || !DeviceExtension->CrashDump ||
+        DeviceExtension->BytesPerSector == 0 ||
+        DeviceExtension->BytesPerSector > DUMP_CHUNK_MAX_LENGTH / 4) {
+
+        return;
+    }
+
+    //
+    // System DMA transfers are mapped from the request's MDL, which the
+    // queued writes do not have.
+    //
+
+    if (DeviceExtension->DmaAdapterObject != NULL &&
+        !DeviceExtension->MasterWithAdapter) {
+
+        return;
+    }
+
+    //
+    // Only give the miniport more than one write if it can queue them, and
+    // then only as many as it said it would take.
+    //
+
+    depth = 1;
+
+    if (HwInitializationData->TaggedQueuing && CommandQueue &&
+        (HwInitializationData->MultipleRequestPerLu ||
+         DeviceExtension->PortType == StorPort)) {
+
+        depth = DUMP_MAX_QUEUED_WRITES;
+
+        if (DeviceExtension->QueueDepth != 0 &&
+            DeviceExtension->QueueDepth < depth) {
+
+            depth = DeviceExtension->QueueDepth;
+        }
+    }
+
+    //
+    // Each write needs its own SRB extension.  Take them from the end of
+    // common buffer 0, after the part the miniport is using.
+    //
+
+    extensionSize = (DeviceExtension->SrbExtensionSize + 7) & ~7;
+    used = (DeviceExtension->NonCachedExtensionUsed + 7) & ~7;
+    srbExtension = (PUCHAR) DeviceExtension->NonCachedExtension + used;
+
+    if (extensionSize != 0) {
+
+        available = DeviceExtension->NonCachedExtensionSize > used ?
+                        DeviceExtension->NonCachedExtensionSize - used : 0;
+
+        if (available / extensionSize < depth) {
+            depth = available / extensionSize;
+        }
+    }
+
+    if (depth == 0) {
+        DebugPrint((1, "InitializeWriteQueue: No room for SRB extensions\n"));
+        return;
+    }
+
+    queue = AllocatePool(FIELD_OFFSET(DUMP_WRITE_QUEUE, Writes) +
+                         depth * sizeof(QUEUED_WRITE));
+    workspace = AllocatePool(DUMP_COMPRESS_WORKSPACE_SIZE);
+
+    if (queue == NULL || workspace == NULL) {
+
+        DebugPrint((1, "InitializeWriteQueue: Out of memory\n"));
+
+        if (queue != NULL) {
+            FreePool(queue);
+        }
+
+        if (workspace != NULL) {
+            FreePool(workspace);
+        }
+
+        return;
+    }
+
+    RtlZeroMemory(queue, FIELD_OFFSET(DUMP_WRITE_QUEUE, Writes) +
+                         depth * sizeof(QUEUED_WRITE));
+
+    queue->Depth = depth;
+    queue->Limit = depth;
+    queue->Workspace = workspace;
+    queue->Status = STATUS_SUCCESS;
+
+    for (i = 0; i < depth; i++) {
+
+        if (extensionSize != 0) {
+            queue->Writes[i].Srb.SrbExtension = srbExtension + i * extensionSize;
+        }
+
+        queue->Writes[i].TimeoutCounter = -1;
+    }
+
+    //
+    // Common buffer 1 is only used for the inquiry and read capacity data
+    // before the dump is written, so the chunks can have all of it.  Its
+    // logical address stays good because DiskDumpWrite no longer maps
+    // the dump data with the map registers it shares.
+    //
+
+    queue->Ring = DeviceExtension->CommonBuffer[1];
+    queue->RingSize = DeviceExtension->CommonBufferSize &
+                          ~(DeviceExtension->BytesPerSector - 1);
+
+    queue->ChunkLength = queue->RingSize < DUMP_CHUNK_MAX_LENGTH ?
+                             queue->RingSize : DUMP_CHUNK_MAX_LENGTH;
+
+    if (queue->ChunkLength > DUMP_CHUNK_MAX_PAGES << PAGE_SHIFT) {
+        queue->ChunkLength = DUMP_CHUNK_MAX_PAGES << PAGE_SHIFT;
+    }
+
+    queue->ChunkLength &= ~(DeviceExtension->BytesPerSector - 1);
+
+    queue->DumpId = KeQueryPerformanceCounter(NULL).LowPart;
+
+    DebugPrint((1,
+               "InitializeWriteQueue: %d writes, %x byte ring\n",
+               depth,
+               queue->RingSize));
+
+    DeviceExtension->WriteQueue = queue;
+}
+
+
+VOID
+StartQueuedWrite(
+    IN PDUMP_WRITE_QUEUE Queue,
+    IN PQUEUED_WRITE Write
+    )
+{
+    PSCSI_REQUEST_BLOCK srb = &Write->Srb;
+
+    srb->SrbStatus = srb->ScsiStatus = 0;
+    srb->DataTransferLength = Write->RingLength;
+
+    Write->State = QueuedWriteStarted;
+    Write->TimeoutCounter = srb->TimeOutValue;
+    Queue->Started++;
+
+    //
+    // Wait for the miniport to ask for the next request before giving it
+    // another.
+    //
+
+    DeviceExtension->InterruptFlags &= ~(PD_READY_FOR_NEXT_REQUEST |
+                                         PD_READY_FOR_NEXT_LU_REQUEST);
+
+    if (DeviceExtension->PortType == StorPort &&
+        DeviceExtension->HwBuildIo != NULL) {
+
+        DeviceExtension->HwBuildIo(DeviceExtension->HwDeviceExtension, srb);
+    }
+
+    DeviceExtension->HwStartIo(DeviceExtension->HwDeviceExtension, srb);
+}
+
+
+VOID
+StartQueuedWrites(
+    IN PDUMP_WRITE_QUEUE Queue
+    )
+
+/*++
+
+Routine Description:
+
+    This routine gives the miniport as many of the waiting writes, oldest
+    first, as it will take.
+
+--*/
+
+{
+    PQUEUED_WRITE write;
+    ULONG i;
+
+    for (i = 0; i < Queue->Count; i++) {
+
+        write = &Queue->Writes[(Queue->Tail + i) % Queue->Depth];
+
+        if (write->State != QueuedWriteWaiting) {
+            continue;
+        }
+
+        if (Queue->Started >= Queue->Limit) {
+            break;
+        }
+
+        //
+        // A SCSIPORT miniport takes another request for the disk once it
+        // has asked for one.  STORPORT miniports take them until they say
+        // they are busy.
+        //
+
+        if (Queue->Started != 0 &&
+            DeviceExtension->PortType != StorPort &&
+            !(DeviceExtension->InterruptFlags & PD_READY_FOR_NEXT_LU_REQUEST)) {
+
+            break;
+        }
+
+        StartQueuedWrite(Queue, write);
+    }
+}
+
+
+VOID
+ProcessQueuedWrites(
+    IN PDUMP_WRITE_QUEUE Queue
+    )
+
+/*++
+
+Routine Description:
+
+    This routine looks at the writes the miniport has completed, retries
+    those that failed, and releases the chunks of the oldest writes that
+    are done.
+
+--*/
+
+{
+    PQUEUED_WRITE write;
+    PSCSI_REQUEST_BLOCK srb;
+    ULONG i;
+
+    for (i = 0; i < Queue->Count; i++) {
+
+        write = &Queue->Writes[(Queue->Tail + i) % Queue->Depth];
+        srb = &write->Srb;
+
+        if (write->State != QueuedWriteComplete) {
+            continue;
+        }
+
+        if (SRB_STATUS(srb->SrbStatus) == SRB_STATUS_SUCCESS) {
+
+            write->State = QueuedWriteDone;
+
+        } else if ((srb->ScsiStatus == SCSISTAT_QUEUE_FULL) &&
+                   write->BusyCount++ < DUMP_WRITE_BUSY_RETRIES) {
+
+            //
+            // Give the disk no more writes than it has now, and start this
+            // one again when one of those completes.
+            //
+
+            if (Queue->Started != 0) {
+                Queue->Limit = Queue->Started;
+            }
+
+            write->State = Queue->Started != 0 ? QueuedWriteWaiting :
+                                                 QueuedWriteBusy;
+
+        } else if ((srb->ScsiStatus == SCSISTAT_BUSY ||
+                    SRB_STATUS(srb->SrbStatus) == SRB_STATUS_BUSY) &&
+                   write->BusyCount++ < DUMP_WRITE_BUSY_RETRIES) {
+
+            write->State = QueuedWriteBusy;
+
+        } else if (write->RetryCount++ < DUMP_WRITE_RETRIES) {
+
+            DebugPrint((0,
+                       "ProcessQueuedWrites: Write request failed with SRB status %x, retrying\n",
+                       srb->SrbStatus));
+
+            write->State = QueuedWriteWaiting;
+
+        } else {
+
+            DebugPrint((0,
+                       "ProcessQueuedWrites: Write request failed with SRB status %x\n",
+                       srb->SrbStatus));
+
+            Queue->Status = STATUS_UNSUCCESSFUL;
+            write->State = QueuedWriteDone;
+        }
+    }
+
+    while (Queue->Count != 0 &&
+           Queue->Writes[Queue->Tail].State == QueuedWriteDone) {
+
+        Queue->Writes[Queue->Tail].State = QueuedWriteFree;
+        Queue->Tail = (Queue->Tail + 1) % Queue->Depth;
+        Queue->Count--;
+    }
+}
+
+
+VOID
+TickQueuedWrites(
+    IN PDUMP_WRITE_QUEUE Queue
+    )
+
+/*++
+
+Routine Description:
+
+    This routine is called once a second while the queue is polled.  It
+    starts busy writes again, and resets the bus if a write times out.
+
+--*/
+
+{
+    PQUEUED_WRITE write;
+    BOOLEAN timedOut = FALSE;
+    ULONG i;
+
+    for (i = 0; i < Queue->Depth; i++) {
+
+        write = &Queue->Writes[i];
+
+        if (write->State == QueuedWriteBusy) {
+
+            write->State = QueuedWriteWaiting;
+
+        } else if (write->State == QueuedWriteStarted) {
+
+            if (write->TimeoutCounter == 0) {
+                timedOut = TRUE;
+            } else if (write->TimeoutCounter != -1) {
+                write->TimeoutCounter--;
+            }
+        }
+    }
+
+    if (!timedOut) {
+        return;
+    }
+
+    DebugPrint((1, "TickQueuedWrites: Request timed out\n"));
+
+    if (!ResetBus(DeviceExtension, DeviceExtension->PathId)) {
+        DebugPrint((1, "Reset SCSI bus failed\n"));
+    }
+
+    //
+    // The miniport should have completed its writes when the bus was
+    // reset.  Fail any it did not, so that they are retried.
+    //
+
+    for (i = 0; i < Queue->Depth; i++) {
+
+        write = &Queue->Writes[i];
+
+        if (write->State == QueuedWriteStarted) {
+            write->Srb.SrbStatus = SRB_STATUS_TIMEOUT;
+            CompleteQueuedWrite(&write->Srb);
+        }
+    }
+}
+
+
+VOID
+WaitForQueuedWrites(
+    IN PDUMP_WRITE_QUEUE Queue,
+    IN ULONG Count
+    )
+
+/*++
+
+Routine Description:
+
+    This routine polls the miniport until no more than Count writes are
+    in use.
+
+--*/
+
+{
+    while (Queue->Count > Count) {
+
+        StartQueuedWrites(Queue);
+
+        if (!(DeviceExtension->Flags & PD_DISABLE_INTERRUPTS) &&
+            DeviceExtension->HwInterrupt != NULL) {
+
+            DeviceExtension->HwInterrupt(DeviceExtension->HwDeviceExtension);
+        }
+
+        ProcessQueuedWrites(Queue);
+
+        if (ServiceMiniport()) {
+            TickQueuedWrites(Queue);
+        }
+    }
+}
+
+
+ULONG
+GetRingSpace(
+    IN PDUMP_WRITE_QUEUE Queue,
+    OUT PULONG Available
+    )
+
+/*++
+
+Routine Description:
+
+    This routine finds where the next chunk can go in common buffer 1.
+
+Arguments:
+
+    Available - Returns the number of bytes free there.
+
+Return Value:
+
+    The offset of the free space.
+
+--*/
+
+{
+    ULONG tail;
+
+    if (Queue->Count == 0) {
+        Queue->RingHead = 0;
+        *Available = Queue->RingSize;
+        return 0;
+    }
+
+    tail = Queue->Writes[Queue->Tail].RingOffset;
+
+    if (Queue->RingHead > tail) {
+
+        //
+        // The chunks have not wrapped.  Use the end of the buffer or the
+        // start, whichever has more room.
+        //
+
+        if (Queue->RingSize - Queue->RingHead >= tail) {
+            *Available = Queue->RingSize - Queue->RingHead;
+            return Queue->RingHead;
+        }
+
+        *Available = tail;
+        return 0;
+    }
+
+    *Available = tail - Queue->RingHead;
+    return Queue->RingHead;
+}
+
+
+VOID
+QueueRingWrite(
+    IN PDUMP_WRITE_QUEUE Queue,
+    IN PLARGE_INTEGER DiskByteOffset,
+    IN ULONG RingOffset,
+    IN ULONG Length
+    )
+
+/*++
+
+Routine Description:
+
+    This routine queues the write of a chunk in common buffer 1.
+
+Arguments:
+
+    DiskByteOffset - Byte offset relative to beginning of partition.
+
+    RingOffset - Supplies where the chunk is in common buffer 1.
+
+    Length - Supplies the length of the chunk, a multiple of the sector
+        size.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PQUEUED_WRITE write = &Queue->Writes[Queue->Head];
+    PSCSI_REQUEST_BLOCK srb = &write->Srb;
+    PCDB cdb = (PCDB) &srb->Cdb;
+    PVOID srbExtension = srb->SrbExtension;
+    ULONG blockOffset;
+    ULONG blockCount;
+
+    ASSERT(write->State == QueuedWriteFree);
+
+    write->RingOffset = RingOffset;
+    write->RingLength = Length;
+    write->RetryCount = 0;
+    write->BusyCount = 0;
+
+    write->ScatterGatherList.NumberOfElements = 1;
+    write->ScatterGatherList.Elements[0].Address.QuadPart =
+        DeviceExtension->LogicalAddress[1].QuadPart + RingOffset;
+    write->ScatterGatherList.Elements[0].Length = Length;
+
+    RtlZeroMemory(srb, sizeof(SCSI_REQUEST_BLOCK));
+
+    srb->Length = sizeof(SCSI_REQUEST_BLOCK);
+    srb->PathId = DeviceExtension->PathId;
+    srb->TargetId = DeviceExtension->TargetId;
+    srb->Lun = DeviceExtension->Lun;
+    srb->Function = SRB_FUNCTION_EXECUTE_SCSI;
+    srb->SrbExtension = srbExtension;
+    srb->DataBuffer = Queue->Ring + RingOffset;
+    srb->DataTransferLength = Length;
+    srb->TimeOutValue = 10;
+    srb->CdbLength = 10;
+
+    //
+    // Tagged writes must be allowed to disconnect, or the disk cannot
+    // queue them.
+    //
+
+    if (Queue->Depth > 1) {
+
+        srb->SrbFlags = SRB_FLAGS_DATA_OUT |
+                        SRB_FLAGS_QUEUE_ACTION_ENABLE |
+                        SRB_FLAGS_DISABLE_AUTOSENSE;
+        srb->QueueAction = SRB_SIMPLE_TAG_REQUEST;
+        srb->QueueTag = (UCHAR) (Queue->Head + 1);
+
+    } else {
+
+        srb->SrbFlags = SRB_FLAGS_DATA_OUT |
+                        SRB_FLAGS_DISABLE_SYNCH_TRANSFER |
+                        SRB_FLAGS_DISABLE_DISCONNECT |
+                        SRB_FLAGS_DISABLE_AUTOSENSE;
+        srb->QueueTag = SP_UNTAGGED;
+    }
+
+    cdb->CDB10.OperationCode = SCSIOP_WRITE;
+
+    blockOffset = (ULONG)((DeviceExtension->PartitionOffset.QuadPart +
+                           DiskByteOffset->QuadPart) /
+                          DeviceExtension->BytesPerSector);
+
+    cdb->CDB10.LogicalBlockByte0 = ((PFOUR_BYTE)&blockOffset)->Byte3;
+    cdb->CDB10.LogicalBlockByte1 = ((PFOUR_BYTE)&blockOffset)->Byte2;
+    cdb->CDB10.LogicalBlockByte2 = ((PFOUR_BYTE)&blockOffset)->Byte1;
+    cdb->CDB10.LogicalBlockByte3 = ((PFOUR_BYTE)&blockOffset)->Byte0;
+
+    blockCount = Length >> DeviceExtension->SectorShift;
+
+    cdb->CDB10.TransferBlocksMsb = ((PFOUR_BYTE)&blockCount)->Byte1;
+    cdb->CDB10.TransferBlocksLsb = ((PFOUR_BYTE)&blockCount)->Byte0;
+
+    write->State = QueuedWriteWaiting;
+
+    Queue->Head = (Queue->Head + 1) % Queue->Depth;
+    Queue->Count++;
+    Queue->RingHead = RingOffset + Length;
+
+    StartQueuedWrites(Queue);
+}
+
+
+VOID
+QueueChunk(
+    IN PDUMP_WRITE_QUEUE Queue,
+    IN PLARGE_INTEGER DiskByteOffset,
+    IN PUCHAR Source,
+    IN ULONG Length,
+    IN BOOLEAN Compress
+    )
+
+/*++
+
+Routine Description:
+
+    This routine puts a block in common buffer 1, as a chunk if that saves
+    at least a sector and as is otherwise, and queues its write.
+
+Arguments:
+
+    DiskByteOffset - Byte offset relative to beginning of partition.
+
+    Source - Supplies the block.
+
+    Length - Supplies the length of the block, a multiple of the sector
+        size no larger than the ring.
+
+    Compress - Supplies FALSE if the block must be written as is.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    ULONG bytesPerSector = DeviceExtension->BytesPerSector;
+    ULONG ringOffset;
+    ULONG available;
+    ULONG limit;
+    ULONG used;
+
+    //
+    // Wait for a free write.
+    //
+
+    WaitForQueuedWrites(Queue, Queue->Depth - 1);
+
+    if (Length <= bytesPerSector) {
+        Compress = FALSE;
+    }
+
+    while (Compress) {
+
+        ringOffset = GetRingSpace(Queue, &available);
+        limit = Length - bytesPerSector;
+
+        if (DumpBuildChunk(Source,
+                           Length,
+                           PAGE_SHIFT,
+                           Queue->DumpId,
+                           Queue->Sequence,
+                           Queue->Ring + ringOffset,
+                           available < limit ? available : limit,
+                           Queue->Workspace,
+                           &used)) {
+
+            Queue->Sequence++;
+
+            //
+            // Pad the chunk to a whole sector.
+            //
+
+            Length = (used + bytesPerSector - 1) & ~(bytesPerSector - 1);
+            RtlZeroMemory(Queue->Ring + ringOffset + used, Length - used);
+
+            QueueRingWrite(Queue, DiskByteOffset, ringOffset, Length);
+            return;
+        }
+
+        //
+        // If the chunk had all the room it could use, the block does not
+        // compress.  Otherwise wait for the oldest chunk to be released
+        // and try again.
+        //
+
+        if (available >= limit) {
+            break;
+        }
+
+        WaitForQueuedWrites(Queue, Queue->Count - 1);
+    }
+
+    for (;;) {
+
+        ringOffset = GetRingSpace(Queue, &available);
+
+        if (available >= Length) {
+            break;
+        }
+
+        WaitForQueuedWrites(Queue, Queue->Count - 1);
+    }
+
+    RtlCopyMemory(Queue->Ring + ringOffset, Source, Length);
+
+    QueueRingWrite(Queue, DiskByteOffset, ringOffset, Length);
+}
+
+
+VOID
+InvalidateDumpHeader(
+    IN PDUMP_WRITE_QUEUE Queue
+    )
+
+/*++
+
+Routine Description:
+
+    This routine overwrites the first sector of the dump header after a
+    write has failed, so that the dump is not taken for a good one.
+
+--*/
+
+{
+    if (!Queue->HeaderWritten || Queue->HeaderInvalidated) {
+        return;
+    }
+
+    Queue->HeaderInvalidated = TRUE;
+
+    WaitForQueuedWrites(Queue, 0);
+
+    RtlZeroMemory(Queue->Ring, DeviceExtension->BytesPerSector);
+    QueueRingWrite(Queue,
+                   &Queue->HeaderOffset,
+                   0,
+                   DeviceExtension->BytesPerSector);
+
+    WaitForQueuedWrites(Queue, 0);
+}
+
+
+NTSTATUS
+QueueDumpWrite(
+    IN PLARGE_INTEGER DiskByteOffset,
+    IN PMDL Mdl
+    )
+
+/*++
+
+Routine Description:
+
+    This routine queues a crash dump write.  It returns as soon as the data
+    has been copied or compressed into common buffer 1.
+
+Arguments:
+
+    DiskByteOffset - Byte offset relative to beginning of partition.
+
+    Mdl - Memory descriptor list that defines this request.  It must be
+        mapped with MmMapMemoryDumpMdl.
+
+Return Value:
+
+    STATUS_SUCCESS, or STATUS_UNSUCCESSFUL if this or an earlier write
+    failed.
+
+--*/
+
+{
+    PDUMP_WRITE_QUEUE queue = DeviceExtension->WriteQueue;
+    PUCHAR source = Mdl->MappedSystemVa;
+    ULONG length = Mdl->ByteCount;
+    LARGE_INTEGER offset = *DiskByteOffset;
+    BOOLEAN compress = TRUE;
+    ULONG chunk;
+
+    if (NT_SUCCESS(queue->Status) &&
+        length >= sizeof(ULONG) &&
+        *(PULONG) source == DUMP_HEADER_SIGNATURE) {
+
+        compress = FALSE;
+
+        if (!queue->HeaderWritten) {
+            queue->HeaderWritten = TRUE;
+            queue->HeaderOffset = offset;
+        }
+    }
+
+    while (length != 0 && NT_SUCCESS(queue->Status)) {
+
+        chunk = length < queue->ChunkLength ? length : queue->ChunkLength;
+
+        QueueChunk(queue, &offset, source, chunk, compress);
+
+        source += chunk;
+        offset.QuadPart += chunk;
+        length -= chunk;
+    }
+
+    if (!NT_SUCCESS(queue->Status)) {
+        InvalidateDumpHeader(queue);
+    }
+
+    return queue->Status;
+}
+
+
+VOID
+FlushWriteQueue(
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    This routine waits for the queued writes to complete, for
+    DiskDumpFinish.
+
+--*/
+
+{
+    PDUMP_WRITE_QUEUE queue = DeviceExtension->WriteQueue;
+    ULONG i;
+
+    if (queue == NULL) {
+        return;
+    }
+
+    WaitForQueuedWrites(queue, 0);
+
+    if (!NT_SUCCESS(queue->Status)) {
+        InvalidateDumpHeader(queue);
+    }
+
+    //
+    // Clean up any extra interrupts, as PollSrb does after a request.
+    //
+
+    for (i = 0; i < COMPLETION_DELAY; i++) {
+
+        if (!(DeviceExtension->Flags & PD_DISABLE_INTERRUPTS) &&
+            DeviceExtension->HwInterrupt != NULL) {
+
+            DeviceExtension->HwInterrupt(DeviceExtension->HwDeviceExtension);
+        }
+
+        ServiceMiniport();
+    }
+}
@@ -0,0 +1,227 @@
+/*++
+
+Copyright (c) 2003  Microsoft Corporation
+
+Module Name:
+
+    dumpwp.c
+
+Abstract:
+
+    This file contains the pending write routine of the diskdump driver.
+    The system writes the hibernation file through it so that the write
+    of one block overlaps compressing the next, instead of the processor
+    sitting in the polling loop for every transfer.
+
+    There is a single SRB, so only one write is ever outstanding.  Crash
+    dumps do not use this routine.  They are written by DiskDumpWrite, or
+    by the queued writer in dumpq.c if the driver is built with
+    DUMP_COMPRESSION.
+
+Environment:
+
+    Kernel mode, at HIGH_LEVEL, with no other processor running.
+
+Notes:
+
+    This file is also built into the user mode pending write test, with
+    UTEST defined.
+
+Revision History:
+
+--*/
+
+#ifndef UTEST
+
+#include "ntosp.h"
+#include "stdarg.h"
+#include "stdio.h"
+#include "storport.h"
+#include "ntdddisk.h"
+#include "diskdump.h"
+
+#if DBG
+#undef DebugPrint
+#define DebugPrint(x) ScsiDebugPrint x
+#endif
+
+#endif
+
+extern PDEVICE_EXTENSION DeviceExtension;
+
+#define DUMP_WRITE_MAGIC 'WDSD'
+
+typedef enum _DUMP_WRITE_STATE {
+    DumpWriteReady,
+    DumpWritePending
+} DUMP_WRITE_STATE;
+
+//
+// What is kept in the caller's local data between the calls that make up
+// one write.
+//
+
+typedef struct _DUMP_WRITE_LOCALS {
+    ULONG Magic;
+    DUMP_WRITE_STATE State;
+    LARGE_INTEGER DiskByteOffset;
+    PMDL Mdl;
+} DUMP_WRITE_LOCALS, *PDUMP_WRITE_LOCALS;
+
+C_ASSERT(sizeof(DUMP_WRITE_LOCALS) <= IO_DUMP_WRITE_DATA_SIZE);
+
+
+NTSTATUS
+DiskDumpWritePending(
+    IN LONG Action,
+    IN PLARGE_INTEGER DiskByteOffset,
+    IN PMDL Mdl,
+    IN PVOID LocalData
+    )
+
+/*++
+
+Routine Description:
+
+    This is the entry point for pending write requests to the diskdump
+    driver.
+
+    A write is started with IO_DUMP_WRITE_START, which returns as soon as
+    the request is with the miniport.  Each IO_DUMP_WRITE_RESUME polls the
+    miniport for a short while, and IO_DUMP_WRITE_FINISH waits for the
+    write to complete.  IO_DUMP_WRITE_FULFILL starts a write and waits for
+    it.
+
+    The caller must not change the MDL or the memory it describes until
+    the write has completed.
+
+Arguments:
+
+    Action - Supplies one of the IO_DUMP_WRITE_XXX actions.
+
+    DiskByteOffset - Byte offset relative to beginning of partition.  Only
+        used when starting a write.
+
+    Mdl - Memory descriptor list that defines the write.  Only used when
+        starting a write.
+
+    LocalData - Supplies page aligned memory of IO_DUMP_WRITE_DATA_SIZE
+        bytes that is the same for every call.
+
+Return Value:
+
+    STATUS_SUCCESS - The write is complete.
+
+    STATUS_PENDING - The write has been started and is not complete yet.
+
+    STATUS_INVALID_PARAMETER - The local data was not initialized, or a
+        write was started before the previous one completed.
+
+    Otherwise the status of the write.
+
+--*/
+
+{
+    PDUMP_WRITE_LOCALS locals = LocalData;
+    PSCSI_REQUEST_BLOCK srb = &DeviceExtension->Srb;
+    BOOLEAN complete;
+
+    switch (Action) {
+
+        case IO_DUMP_WRITE_INIT:
+
+            locals->Magic = 0;
+            locals->State = DumpWriteReady;
+
+            if ((ULONG_PTR)locals & (PAGE_SIZE - 1)) {
+
+                DebugPrint((0,
+                           "DiskDumpWritePending: misaligned local data %p\n",
+                           locals));
+
+                return STATUS_UNSUCCESSFUL;
+            }
+
+            locals->Magic = DUMP_WRITE_MAGIC;
+
+            return STATUS_SUCCESS;
+
+        case IO_DUMP_WRITE_START:
+        case IO_DUMP_WRITE_FULFILL:
+
+            if (locals->Magic != DUMP_WRITE_MAGIC ||
+                locals->State != DumpWriteReady) {
+
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            locals->DiskByteOffset = *DiskByteOffset;
+            locals->Mdl = Mdl;
+
+            //
+            // See DiskDumpWrite.
+            //
+
+            Mdl->StartVa = PAGE_ALIGN( Mdl->StartVa );
+
+            PrepareWriteSrb(&locals->DiskByteOffset, Mdl);
+            StartSrb(srb);
+
+            locals->State = DumpWritePending;
+
+            break;
+
+        case IO_DUMP_WRITE_RESUME:
+        case IO_DUMP_WRITE_FINISH:
+
+            if (locals->Magic != DUMP_WRITE_MAGIC) {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            if (locals->State == DumpWriteReady) {
+                return STATUS_SUCCESS;
+            }
+
+            break;
+
+        default:
+
+            return STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    // The write is with the miniport.  Only wait for it to complete if the
+    // caller has nothing else to do.
+    //
+
+    if (Action == IO_DUMP_WRITE_START || Action == IO_DUMP_WRITE_RESUME) {
+        complete = PollSrb(srb, PD_RESUME_POLL_ITERATIONS);
+    } else {
+        complete = PollSrb(srb, PD_POLL_UNTIL_COMPLETE);
+    }
+
+    if (!complete) {
+        return STATUS_PENDING;
+    }
+
+    CompleteSrb(srb);
+
+    locals->State = DumpWriteReady;
+
+    if (SRB_STATUS(srb->SrbStatus) == SRB_STATUS_SUCCESS) {
+        return STATUS_SUCCESS;
+    }
+
+    DebugPrint((0,
+               "DiskDumpWritePending: Write request failed with SRB status %x\n",
+               srb->SrbStatus));
+
+    //
+    // Retry the write the way DiskDumpWrite does.  A request sense may
+    // have taken over the dump mapping, so map the data again first.
+    //
+
+    MmMapMemoryDumpMdl(locals->Mdl);
+
+    return DiskDumpWrite(&locals->DiskByteOffset, locals->Mdl);
+}
@@ -0,0 +1,1240 @@
+//
+// Test and benchmark for the diskdump compressed crash dump writer.
+//
+// The codec is checked on its own first: blocks of every kind of page are
+// built into chunks and expanded again, and damaged chunks and chunks
+// that do not fit must be refused.
+//
+// Then a crash dump is written through the queued writer to a simulated
+// disk.  The simulated miniport takes tagged writes up to a device queue
+// depth, reports the queue full beyond it, and completes the writes it
+// has in the order their data is transferred, which is not the order they
+// were started in.  Each write takes a random latency, which overlaps the
+// other writes, and a transfer time, which does not.  Each call of the
+// interrupt routine takes one unit of time, and the caller spends a fixed
+// time on each block between its writes.
+//
+// The disk is filled with random bytes first, so the sectors a chunk
+// leaves unwritten hold garbage, as they would on a real disk.  Every run
+// expands the dump with DumpExpandBlock and checks that it matches the
+// image.  Runs have a write fail, the disk report busy, a write get lost
+// so that the bus is reset, and the writes fail for good, which must
+// leave the dump header invalid.
+//
+// The simulated time and the bytes written are reported for the queue
+// depths given, in units of PD_INTERLOOP_STALL, along with the speed of
+// the compressor on this machine.
+//
+// Usage:
+//
+//     tcompress [-b blocks] [-r ring size] [-c block time] [-l latency]
+//
+
+#include <nt.h>
+#include <ntrtl.h>
+#include <nturtl.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 0x1000
+#endif
+
+#ifndef PAGE_SHIFT
+#define PAGE_SHIFT 12
+#endif
+
+#ifndef ASSERT
+#define ASSERT(x)
+#endif
+
+#ifndef C_ASSERT
+#define C_ASSERT(e) typedef char __C_ASSERT__[(e)?1:-1]
+#endif
+
+#define MAXIMUM_TRANSFER_SIZE 0x10000
+
+#define DebugPrint(x)
+
+typedef struct _MDL {
+    PVOID MappedSystemVa;
+    ULONG ByteCount;
+} MDL, *PMDL;
+
+//
+// The parts of the SRB, the CDB, the scatter/gather list and the device
+// extension the writer uses.
+//
+
+typedef struct _SCSI_REQUEST_BLOCK {
+    USHORT Length;
+    UCHAR Function;
+    UCHAR SrbStatus;
+    UCHAR ScsiStatus;
+    UCHAR PathId;
+    UCHAR TargetId;
+    UCHAR Lun;
+    UCHAR QueueTag;
+    UCHAR QueueAction;
+    UCHAR CdbLength;
+    ULONG SrbFlags;
+    ULONG DataTransferLength;
+    ULONG TimeOutValue;
+    PVOID DataBuffer;
+    PVOID SrbExtension;
+    UCHAR Cdb[16];
+} SCSI_REQUEST_BLOCK, *PSCSI_REQUEST_BLOCK;
+
+typedef union _CDB {
+    struct _CDB10 {
+        UCHAR OperationCode;
+        UCHAR Reserved1;
+        UCHAR LogicalBlockByte0;
+        UCHAR LogicalBlockByte1;
+        UCHAR LogicalBlockByte2;
+        UCHAR LogicalBlockByte3;
+        UCHAR Reserved2;
+        UCHAR TransferBlocksMsb;
+        UCHAR TransferBlocksLsb;
+        UCHAR Control;
+    } CDB10;
+} CDB, *PCDB;
+
+typedef struct _FOUR_BYTE {
+    UCHAR Byte0;
+    UCHAR Byte1;
+    UCHAR Byte2;
+    UCHAR Byte3;
+} FOUR_BYTE, *PFOUR_BYTE;
+
+typedef struct _SCATTER_GATHER_ELEMENT {
+    PHYSICAL_ADDRESS Address;
+    ULONG Length;
+    ULONG_PTR Reserved;
+} SCATTER_GATHER_ELEMENT, *PSCATTER_GATHER_ELEMENT;
+
+typedef struct _SCATTER_GATHER_LIST {
+    ULONG NumberOfElements;
+    ULONG_PTR Reserved;
+    SCATTER_GATHER_ELEMENT Elements[1];
+} SCATTER_GATHER_LIST, *PSCATTER_GATHER_LIST;
+
+#define SRB_FUNCTION_EXECUTE_SCSI           0x00
+#define SRB_STATUS_SUCCESS                  0x01
+#define SRB_STATUS_BUSY                     0x05
+#define SRB_STATUS_ERROR                    0x04
+#define SRB_STATUS_TIMEOUT                  0x09
+#define SRB_STATUS_BUS_RESET                0x0E
+#define SRB_STATUS(Status)                  ((Status) & 0x3F)
+#define SRB_FLAGS_QUEUE_ACTION_ENABLE       0x00000002
+#define SRB_FLAGS_DISABLE_DISCONNECT        0x00000004
+#define SRB_FLAGS_DISABLE_SYNCH_TRANSFER    0x00000008
+#define SRB_FLAGS_DISABLE_AUTOSENSE         0x00000020
+#define SRB_FLAGS_DATA_OUT                  0x00000080
+#define SRB_SIMPLE_TAG_REQUEST              0x20
+#define SP_UNTAGGED                         ((UCHAR) ~0)
+#define SCSIOP_WRITE                        0x2A
+#define SCSISTAT_BUSY                       0x08
+#define SCSISTAT_QUEUE_FULL                 0x28
+
+typedef struct _HW_INITIALIZATION_DATA {
+    BOOLEAN TaggedQueuing;
+    BOOLEAN MultipleRequestPerLu;
+} HW_INITIALIZATION_DATA, *PHW_INITIALIZATION_DATA;
+
+typedef enum _PORT_TYPE {
+    ScsiPort = 1,
+    StorPort = 2
+} PORT_TYPE;
+
+typedef BOOLEAN (*PHW_STARTIO)(PVOID, PSCSI_REQUEST_BLOCK);
+typedef BOOLEAN (*PHW_INTERRUPT)(PVOID);
+
+typedef struct _DEVICE_EXTENSION {
+    PORT_TYPE PortType;
+    PVOID HwDeviceExtension;
+    PHW_STARTIO HwStartIo;
+    PHW_STARTIO HwBuildIo;
+    PHW_INTERRUPT HwInterrupt;
+    PVOID DmaAdapterObject;
+    BOOLEAN MasterWithAdapter;
+    UCHAR PathId;
+    UCHAR TargetId;
+    UCHAR Lun;
+    ULONG Flags;
+    ULONG InterruptFlags;
+    ULONG BytesPerSector;
+    ULONG SectorShift;
+    LARGE_INTEGER PartitionOffset;
+    PVOID CommonBuffer[2];
+    PHYSICAL_ADDRESS LogicalAddress[2];
+    ULONG CommonBufferSize;
+    PVOID NonCachedExtension;
+    ULONG NonCachedExtensionSize;
+    ULONG SrbExtensionSize;
+    BOOLEAN CrashDump;
+    ULONG NonCachedExtensionUsed;
+    ULONG QueueDepth;
+    struct _DUMP_WRITE_QUEUE *WriteQueue;
+} DEVICE_EXTENSION, *PDEVICE_EXTENSION;
+
+#define PD_READY_FOR_NEXT_REQUEST    0X0008
+#define PD_READY_FOR_NEXT_LU_REQUEST 0X0040
+#define PD_DISABLE_INTERRUPTS        0X04000
+
+#define PD_INTERLOOP_STALL 5
+#define COMPLETION_DELAY 10
+#define TICKS_PER_SECOND (1000 * 1000 / PD_INTERLOOP_STALL)
+
+DEVICE_EXTENSION TestExtension;
+PDEVICE_EXTENSION DeviceExtension = &TestExtension;
+
+//
+// The simulated clock.
+//
+
+ULONGLONG Clock;
+ULONG Resets;
+
+BOOLEAN
+ServiceMiniport(
+    VOID
+    )
+{
+    Clock++;
+    return (Clock % TICKS_PER_SECOND) == 0;
+}
+
+BOOLEAN
+ResetBus(
+    IN PDEVICE_EXTENSION pDevExt,
+    IN ULONG PathId
+    );
+
+PVOID
+AllocatePool(
+    IN ULONG Size
+    )
+{
+    return malloc(Size);
+}
+
+VOID
+FreePool(
+    IN PVOID Ptr
+    )
+{
+    free(Ptr);
+}
+
+LARGE_INTEGER
+KeQueryPerformanceCounter(
+    IN PLARGE_INTEGER Frequency
+    )
+{
+    LARGE_INTEGER counter;
+
+    counter.QuadPart = 0x5EED1234;
+    return counter;
+}
+
+#include "dumplz.c"
+#include "dumpq.c"
+
+#define SECTOR_SIZE         0x200
+#define BLOCK_SIZE          0x10000
+#define HEADER_SIZE         0x2000
+#define PARTITION_OFFSET    0x7E00
+#define MAX_DEVICE_DEPTH    32
+#define RING_ADDRESS        0x40000000
+
+PUCHAR Image;
+ULONG ImageLength;
+PUCHAR Disk;
+ULONG DiskLength;
+PUCHAR Staging;
+PUCHAR Expanded;
+ULONG Failures;
+
+//
+// The simulated disk.  Each write waits out a latency, which overlaps the
+// other writes, and then transfers its data, one write at a time.
+//
+
+typedef struct _DEVICE_COMMAND {
+    PSCSI_REQUEST_BLOCK Srb;
+    ULONG Start;
+    ULONGLONG ReadyTime;
+    ULONGLONG TransferEnd;
+    BOOLEAN Transferring;
+} DEVICE_COMMAND, *PDEVICE_COMMAND;
+
+DEVICE_COMMAND Commands[MAX_DEVICE_DEPTH];
+ULONG CommandCount;
+ULONG DeviceDepth = MAX_DEVICE_DEPTH;
+ULONGLONG ChannelFreeAt;
+ULONG Latency = 800;
+ULONG BytesPerTick = 256;
+
+ULONG Starts;
+ULONG QueueFulls;
+ULONG OutOfOrder;
+ULONG LastCompleted;
+ULONGLONG BytesWritten;
+
+//
+// Faults to inject, by the number of the start.
+//
+
+ULONG FailStart = (ULONG) -1;
+ULONG BusyStart = (ULONG) -1;
+ULONG LoseStart = (ULONG) -1;
+ULONG FailFrom = (ULONG) -1;
+
+ULONG
+GetLogicalBlock(
+    IN PSCSI_REQUEST_BLOCK Srb
+    )
+{
+    PCDB cdb = (PCDB) Srb->Cdb;
+
+    return ((ULONG) cdb->CDB10.LogicalBlockByte0 << 24) |
+           ((ULONG) cdb->CDB10.LogicalBlockByte1 << 16) |
+           ((ULONG) cdb->CDB10.LogicalBlockByte2 << 8) |
+           cdb->CDB10.LogicalBlockByte3;
+}
+
+VOID
+NotifyComplete(
+    IN PSCSI_REQUEST_BLOCK Srb
+    )
+
+/*++
+
+Routine Description:
+
+    This routine stands in for ScsiPortNotification(RequestComplete).  The
+    miniport finds the SRB from its tag first, as miniports do.
+
+--*/
+
+{
+    LONG tag = (Srb->SrbFlags & SRB_FLAGS_QUEUE_ACTION_ENABLE) ?
+                   Srb->QueueTag : SP_UNTAGGED;
+
+    if (GetQueuedWriteSrb(tag) != Srb) {
+        printf("tag %d does not find its SRB\n", tag);
+        Failures++;
+    }
+
+    CompleteQueuedWrite(Srb);
+}
+
+BOOLEAN
+TestStartIo(
+    IN PVOID HwDeviceExtension,
+    IN PSCSI_REQUEST_BLOCK Srb
+    )
+{
+    PSCATTER_GATHER_LIST sgList = GetQueuedWriteScatterGatherList(Srb);
+    PCDB cdb = (PCDB) Srb->Cdb;
+    ULONG blocks;
+    PDEVICE_COMMAND command;
+
+    Starts++;
+
+    blocks = (cdb->CDB10.TransferBlocksMsb << 8) | cdb->CDB10.TransferBlocksLsb;
+
+    if (Srb->Function != SRB_FUNCTION_EXECUTE_SCSI ||
+        cdb->CDB10.OperationCode != SCSIOP_WRITE ||
+        !(Srb->SrbFlags & SRB_FLAGS_DATA_OUT) ||
+        Srb->DataTransferLength != blocks * SECTOR_SIZE ||
+        sgList == NULL ||
+        sgList->NumberOfElements != 1 ||
+        sgList->Elements[0].Length != Srb->DataTransferLength ||
+        (PUCHAR) DeviceExtension->CommonBuffer[1] +
+            (sgList->Elements[0].Address.QuadPart - RING_ADDRESS) !=
+            Srb->DataBuffer) {
+
+        printf("start %d is not a valid write\n", Starts);
+        Failures++;
+    }
+
+    if (!(Srb->SrbFlags & SRB_FLAGS_QUEUE_ACTION_ENABLE) && CommandCount != 0) {
+        printf("untagged write started with %d outstanding\n", CommandCount);
+        Failures++;
+    }
+
+    //
+    // The miniport can take another write.
+    //
+
+    DeviceExtension->InterruptFlags |= PD_READY_FOR_NEXT_LU_REQUEST;
+
+    if (Starts == LoseStart) {
+        return TRUE;
+    }
+
+    if (CommandCount == DeviceDepth) {
+        QueueFulls++;
+        Srb->SrbStatus = SRB_STATUS_ERROR;
+        Srb->ScsiStatus = SCSISTAT_QUEUE_FULL;
+        NotifyComplete(Srb);
+        return TRUE;
+    }
+
+    if (Starts == BusyStart) {
+        Srb->SrbStatus = SRB_STATUS_BUSY;
+        NotifyComplete(Srb);
+        return TRUE;
+    }
+
+    command = &Commands[CommandCount++];
+    command->Srb = Srb;
+    command->Start = Starts;
+    command->ReadyTime = Clock + Latency/2 + rand() % (Latency + 1);
+    command->Transferring = FALSE;
+
+    return TRUE;
+}
+
+BOOLEAN
+TestInterrupt(
+    IN PVOID HwDeviceExtension
+    )
+
+/*++
+
+Routine Description:
+
+    This routine completes the write whose transfer is done, and starts the
+    transfer of the write that has been ready longest.
+
+--*/
+
+{
+    PDEVICE_COMMAND command;
+    PSCSI_REQUEST_BLOCK srb;
+    ULONG offset;
+    ULONG best;
+    ULONG i;
+
+    for (i = 0; i < CommandCount; i++) {
+
+        command = &Commands[i];
+
+        if (!command->Transferring || command->TransferEnd > Clock) {
+            continue;
+        }
+
+        srb = command->Srb;
+        offset = GetLogicalBlock(srb) * SECTOR_SIZE;
+
+        if (command->Start < LastCompleted) {
+            OutOfOrder++;
+        }
+
+        LastCompleted = command->Start;
+
+        if (offset < PARTITION_OFFSET ||
+            offset + srb->DataTransferLength > DiskLength) {
+
+            printf("write to %x is off the disk\n", offset);
+            Failures++;
+            srb->SrbStatus = SRB_STATUS_ERROR;
+
+        } else if (command->Start == FailStart ||
+                   (command->Start >= FailFrom &&
+                    offset != PARTITION_OFFSET)) {
+
+            srb->SrbStatus = SRB_STATUS_ERROR;
+
+        } else {
+
+            memcpy(Disk + offset, srb->DataBuffer, srb->DataTransferLength);
+            BytesWritten += srb->DataTransferLength;
+            srb->SrbStatus = SRB_STATUS_SUCCESS;
+        }
+
+        *command = Commands[--CommandCount];
+        NotifyComplete(srb);
+
+        break;
+    }
+
+    if (ChannelFreeAt > Clock) {
+        return TRUE;
+    }
+
+    best = CommandCount;
+
+    for (i = 0; i < CommandCount; i++) {
+
+        command = &Commands[i];
+
+        if (!command->Transferring && command->ReadyTime <= Clock &&
+            (best == CommandCount ||
+             command->ReadyTime < Commands[best].ReadyTime)) {
+
+            best = i;
+        }
+    }
+
+    if (best != CommandCount) {
+        command = &Commands[best];
+        command->Transferring = TRUE;
+        command->TransferEnd = Clock + 1 +
+            command->Srb->DataTransferLength / BytesPerTick;
+        ChannelFreeAt = command->TransferEnd;
+    }
+
+    return TRUE;
+}
+
+BOOLEAN
+ResetBus(
+    IN PDEVICE_EXTENSION pDevExt,
+    IN ULONG PathId
+    )
+
+/*++
+
+Routine Description:
+
+    This routine drops what the disk has, and completes it as a miniport
+    does on a reset.
+
+--*/
+
+{
+    Resets++;
+    CommandCount = 0;
+    ChannelFreeAt = 0;
+    CompleteAllQueuedWrites(SRB_STATUS_BUS_RESET);
+
+    return TRUE;
+}
+
+VOID
+FillPage(
+    IN PUCHAR Page,
+    IN ULONG Kind
+    )
+
+/*++
+
+Routine Description:
+
+    This routine fills a page of the image with zeros, with something
+    compressible, or with random bytes.
+
+--*/
+
+{
+    ULONG i;
+
+    switch (Kind) {
+
+        case 0:
+            memset(Page, 0, PAGE_SIZE);
+            break;
+
+        case 1:
+            for (i = 0; i < PAGE_SIZE/sizeof(ULONG); i++) {
+                ((PULONG) Page)[i] = (i & ~7) * 0x10 + (rand() % 4 == 0 ? rand() % 8 : 0);
+            }
+            break;
+
+        case 2:
+            for (i = 0; i < PAGE_SIZE; i++) {
+                Page[i] = "kernel pool page "[i % 17];
+            }
+            Page[rand() % PAGE_SIZE] = (UCHAR) rand();
+            break;
+
+        default:
+            for (i = 0; i < PAGE_SIZE; i++) {
+                Page[i] = (UCHAR) rand();
+            }
+            break;
+    }
+}
+
+VOID
+BuildImage(
+    IN ULONG Blocks
+    )
+
+/*++
+
+Routine Description:
+
+    This routine builds a dump image: a header, then pages of every kind.
+    One block of random pages holds a valid chunk from another dump, which
+    the expansion must copy rather than expand.
+
+--*/
+
+{
+    UCHAR workspace[DUMP_COMPRESS_WORKSPACE_SIZE];
+    ULONG stale = Blocks / 2;
+    ULONG used;
+    ULONG page;
+
+    srand(2);
+
+    for (page = 0; page < ImageLength / PAGE_SIZE; page++) {
+        FillPage(Image + page * PAGE_SIZE, rand() % 4);
+    }
+
+    for (page = 0; page < BLOCK_SIZE / PAGE_SIZE; page++) {
+        FillPage(Image + HEADER_SIZE + stale * BLOCK_SIZE + page * PAGE_SIZE, 3);
+    }
+
+    memset(Expanded, 0, BLOCK_SIZE);
+
+    if (!DumpBuildChunk(Expanded,
+                        BLOCK_SIZE,
+                        PAGE_SHIFT,
+                        0x1234,
+                        0,
+                        Image + HEADER_SIZE + stale * BLOCK_SIZE + 0x600,
+                        0x1000,
+                        workspace,
+                        &used)) {
+
+        printf("stale chunk not built\n");
+        Failures++;
+    }
+
+    memset(Image, 0, HEADER_SIZE);
+    *(PULONG) Image = DUMP_HEADER_SIGNATURE;
+    *(PULONG) (Image + 4) = 'PMUD';
+}
+
+BOOLEAN
+ExpandDump(
+    OUT PULONG Chunks
+    )
+
+/*++
+
+Routine Description:
+
+    This routine expands the dump on the disk, as dumpexp does.
+
+Return Value:
+
+    TRUE if the expanded dump matches the image.
+
+--*/
+
+{
+    DUMP_EXPAND_CONTEXT context;
+    PUCHAR input = Disk + PARTITION_OFFSET;
+    ULONG offset = 0;
+    ULONG length;
+
+    memset(&context, 0, sizeof(context));
+
+    while (offset < ImageLength) {
+
+        length = DumpExpandBlock(&context,
+                                 input + offset,
+                                 ImageLength - offset,
+                                 Expanded + offset);
+        if (length == 0) {
+            printf("chunk at %x is corrupt\n", offset);
+            return FALSE;
+        }
+
+        offset += length;
+    }
+
+    *Chunks = context.Chunks;
+
+    return memcmp(Expanded, Image, ImageLength) == 0;
+}
+
+ULONGLONG
+RunDump(
+    IN ULONG Depth,
+    IN ULONG RingSize,
+    IN ULONG BlockTime,
+    IN BOOLEAN ExpectFailure
+    )
+
+/*++
+
+Routine Description:
+
+    This routine writes the image through the queued writer, in writes of
+    varying size, and checks the result.
+
+Return Value:
+
+    The simulated time the dump took.
+
+--*/
+
+{
+    HW_INITIALIZATION_DATA hwInitializationData;
+    static UCHAR nonCachedExtension[0x2000];
+    LARGE_INTEGER offset;
+    NTSTATUS status = STATUS_SUCCESS;
+    MDL mdl;
+    ULONG length;
+    ULONG chunks;
+    ULONG i;
+
+    for (i = 0; i < DiskLength; i++) {
+        Disk[i] = (UCHAR) rand();
+    }
+
+    memset(DeviceExtension, 0, sizeof(DEVICE_EXTENSION));
+    DeviceExtension->PortType = ScsiPort;
+    DeviceExtension->HwStartIo = TestStartIo;
+    DeviceExtension->HwInterrupt = TestInterrupt;
+    DeviceExtension->MasterWithAdapter = TRUE;
+    DeviceExtension->DmaAdapterObject = DeviceExtension;
+    DeviceExtension->BytesPerSector = SECTOR_SIZE;
+    DeviceExtension->SectorShift = 9;
+    DeviceExtension->PartitionOffset.QuadPart = PARTITION_OFFSET;
+    DeviceExtension->CommonBuffer[1] = Staging + BLOCK_SIZE;
+    DeviceExtension->LogicalAddress[1].QuadPart = RING_ADDRESS;
+    DeviceExtension->CommonBufferSize = RingSize;
+    DeviceExtension->NonCachedExtension = nonCachedExtension;
+    DeviceExtension->NonCachedExtensionSize = sizeof(nonCachedExtension);
+    DeviceExtension->NonCachedExtensionUsed = 0x100;
+    DeviceExtension->SrbExtensionSize = 0x40;
+    DeviceExtension->CrashDump = TRUE;
+
+    hwInitializationData.TaggedQueuing = Depth > 1;
+    hwInitializationData.MultipleRequestPerLu = Depth > 1;
+    DeviceExtension->QueueDepth = Depth;
+
+    InitializeWriteQueue(&hwInitializationData, TRUE);
+
+    if (DeviceExtension->WriteQueue == NULL ||
+        DeviceExtension->WriteQueue->Depth != Depth) {
+
+        printf("queue of depth %d not set up\n", Depth);
+        Failures++;
+        return 0;
+    }
+
+    Clock = 0;
+    ChannelFreeAt = 0;
+    CommandCount = 0;
+    Starts = 0;
+    Resets = 0;
+    QueueFulls = 0;
+    OutOfOrder = 0;
+    LastCompleted = 0;
+    BytesWritten = 0;
+
+    //
+    // Write the header, then the rest in writes of 1 to 16 pages.  The
+    // data is passed in one buffer, which is trashed once each write
+    // returns, as the system reuses it.
+    //
+
+    for (offset.QuadPart = 0;
+         offset.QuadPart < ImageLength;
+         offset.QuadPart += length) {
+
+        if (offset.QuadPart == 0) {
+            length = HEADER_SIZE;
+        } else {
+            length = (1 + rand() % (MAXIMUM_TRANSFER_SIZE / PAGE_SIZE)) * PAGE_SIZE;
+        }
+
+        if (length > ImageLength - offset.QuadPart) {
+            length = ImageLength - (ULONG) offset.QuadPart;
+        }
+
+        memcpy(Staging, Image + offset.QuadPart, length);
+        mdl.MappedSystemVa = Staging;
+        mdl.ByteCount = length;
+
+        status = QueueDumpWrite(&offset, &mdl);
+
+        memset(Staging, 0xCC, length);
+
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        Clock += BlockTime * length / BLOCK_SIZE;
+    }
+
+    FlushWriteQueue();
+
+    if (NT_SUCCESS(status)) {
+        status = DeviceExtension->WriteQueue->Status;
+    }
+
+    if (CommandCount != 0 || DeviceExtension->WriteQueue->Count != 0) {
+        printf("writes left over after the flush\n");
+        Failures++;
+    }
+
+    if (ExpectFailure) {
+
+        if (NT_SUCCESS(status)) {
+            printf("failed writes were not reported\n");
+            Failures++;
+        }
+
+        for (i = 0; i < SECTOR_SIZE; i++) {
+            if (Disk[PARTITION_OFFSET + i] != 0) {
+                printf("dump header was not invalidated\n");
+                Failures++;
+                break;
+            }
+        }
+
+    } else {
+
+        if (!NT_SUCCESS(status)) {
+            printf("dump of depth %d failed: %x\n", Depth, status);
+            Failures++;
+        }
+
+        if (!ExpandDump(&chunks)) {
+            printf("dump of depth %d does not expand to the image\n", Depth);
+            Failures++;
+        }
+    }
+
+    FreePool(DeviceExtension->WriteQueue->Workspace);
+    FreePool(DeviceExtension->WriteQueue);
+    DeviceExtension->WriteQueue = NULL;
+
+    return Clock;
+}
+
+VOID
+CheckCodec(
+    VOID
+    )
+{
+    UCHAR workspace[DUMP_COMPRESS_WORKSPACE_SIZE];
+    UCHAR block[0x8000];
+    UCHAR chunk[0x9000];
+    UCHAR output[0x8000];
+    PDUMP_CHUNK_HEADER header = (PDUMP_CHUNK_HEADER) chunk;
+    UCHAR text[] = "Wikipedia";
+    ULONG lengths[] = { 0x200, 0x1200, 0x4000, 0x8000 };
+    ULONG shifts[] = { 9, 12 };
+    ULONG used;
+    ULONG kind;
+    ULONG i, j, k;
+
+    if (DumpChecksum(1, text, 9) != 0x11E60398) {
+        printf("checksum is wrong\n");
+        Failures++;
+    }
+
+    srand(1);
+
+    for (i = 0; i < sizeof(lengths)/sizeof(lengths[0]); i++) {
+        for (j = 0; j < sizeof(shifts)/sizeof(shifts[0]); j++) {
+            for (kind = 0; kind < 5; kind++) {
+
+                for (k = 0; k < sizeof(block) / PAGE_SIZE; k++) {
+                    FillPage(block + k * PAGE_SIZE, kind < 4 ? kind : rand() % 4);
+                }
+
+                //
+                // A chunk stands for no more than DUMP_CHUNK_MAX_PAGES pages.
+                //
+
+                if ((lengths[i] >> shifts[j]) > DUMP_CHUNK_MAX_PAGES) {
+
+                    if (DumpBuildChunk(block, lengths[i], shifts[j], 1, 7,
+                                       chunk, sizeof(chunk), workspace, &used)) {
+
+                        printf("chunk of %x pages built\n", lengths[i] >> shifts[j]);
+                        Failures++;
+                    }
+
+                    continue;
+                }
+
+                if (!DumpBuildChunk(block, lengths[i], shifts[j], 1, 7,
+                                    chunk, sizeof(chunk), workspace, &used) ||
+                    used != sizeof(DUMP_CHUNK_HEADER) + header->CompressedLength) {
+
+                    printf("chunk of %x bytes of kind %d, shift %d not built\n",
+                           lengths[i], kind, shifts[j]);
+                    Failures++;
+                    continue;
+                }
+
+                //
+                // A chunk no smaller than its block is never written, so it
+                // is not valid.  Only random pages make one.
+                //
+
+                if (header->CompressedLength >
+                    lengths[i] - sizeof(DUMP_CHUNK_HEADER)) {
+
+                    if (kind != 3 || DumpCheckChunkHeader(header, lengths[i])) {
+                        printf("chunk of %x bytes of kind %d grew to %x\n",
+                               lengths[i], kind, used);
+                        Failures++;
+                    }
+
+                    continue;
+                }
+
+                if (!DumpCheckChunkHeader(header, lengths[i]) ||
+                    !DumpCheckChunkHeader(header, lengths[i]) ||
+                    !DumpExpandChunk(header, output) ||
+                    memcmp(output, block, lengths[i])) {
+
+                    printf("round trip of %x bytes of kind %d, shift %d failed\n",
+                           lengths[i], kind, shifts[j]);
+                    Failures++;
+                    continue;
+                }
+
+                if (kind == 0 && header->CompressedLength != 0) {
+                    printf("zero pages were compressed\n");
+                    Failures++;
+                }
+            }
+        }
+    }
+
+    //
+    // A chunk must fit the room given, and the compressed data must fit
+    // the chunk.
+    //
+
+    FillPage(block, 3);
+
+    if (DumpBuildChunk(block, PAGE_SIZE, PAGE_SHIFT, 1, 0,
+                       chunk, PAGE_SIZE - SECTOR_SIZE, workspace, &used) ||
+        DumpBuildChunk(block, PAGE_SIZE, PAGE_SHIFT, 1, 0,
+                       chunk, sizeof(DUMP_CHUNK_HEADER) - 1, workspace, &used)) {
+
+        printf("chunk built in too little room\n");
+        Failures++;
+    }
+
+    FillPage(block, 2);
+    DumpBuildChunk(block, PAGE_SIZE, PAGE_SHIFT, 1, 0,
+                   chunk, sizeof(chunk), workspace, &used);
+
+    if (DumpCheckChunkHeader(header, PAGE_SIZE - 1)) {
+        printf("chunk longer than the dump accepted\n");
+        Failures++;
+    }
+
+    //
+    // Damage must be caught by the checksums, and damage the checksums
+    // miss must not take the expansion outside the block.
+    //
+
+    chunk[sizeof(DUMP_CHUNK_HEADER) + 1] ^= 1;
+    if (DumpExpandChunk(header, output)) {
+        printf("damaged data accepted\n");
+        Failures++;
+    }
+    chunk[sizeof(DUMP_CHUNK_HEADER) + 1] ^= 1;
+
+    header->Length ^= 0x100;
+    if (DumpCheckChunkHeader(header, PAGE_SIZE)) {
+        printf("damaged header accepted\n");
+        Failures++;
+    }
+    header->Length ^= 0x100;
+
+    for (i = 0; i < 10000; i++) {
+
+        k = sizeof(DUMP_CHUNK_HEADER) + rand() % header->CompressedLength;
+        chunk[k] = (UCHAR) rand();
+        header->DataChecksum = DumpChecksum(1, header + 1, header->CompressedLength);
+
+        DumpExpandChunk(header, output);
+    }
+}
+
+VOID
+MeasureCompressor(
+    VOID
+    )
+{
+    UCHAR workspace[DUMP_COMPRESS_WORKSPACE_SIZE];
+    LARGE_INTEGER start, end, frequency;
+    PUCHAR chunk = malloc(BLOCK_SIZE);
+    ULONGLONG compressed = 0;
+    ULONG offset;
+    ULONG used;
+    double seconds;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    for (offset = HEADER_SIZE; offset < ImageLength; offset += BLOCK_SIZE) {
+
+        if (DumpBuildChunk(Image + offset, BLOCK_SIZE, PAGE_SHIFT, 1, 0,
+                           chunk, BLOCK_SIZE, workspace, &used)) {
+            compressed += used;
+        } else {
+            compressed += BLOCK_SIZE;
+        }
+    }
+
+    QueryPerformanceCounter(&end);
+
+    seconds = (double) (end.QuadPart - start.QuadPart) / frequency.QuadPart;
+
+    printf("compressor: %d KB to %I64u KB, %.0f MB/s\n\n",
+           (ImageLength - HEADER_SIZE) / 1024,
+           compressed / 1024,
+           seconds ? (ImageLength - HEADER_SIZE) / seconds / (1024 * 1024) : 0);
+
+    free(chunk);
+}
+
+VOID
+CheckSetup(
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    This routine checks that the queue is only set up when it should be.
+
+--*/
+
+{
+    HW_INITIALIZATION_DATA hwInitializationData;
+    static UCHAR nonCachedExtension[0x400];
+    UCHAR notSrb[sizeof(SCSI_REQUEST_BLOCK)];
+
+    memset(DeviceExtension, 0, sizeof(DEVICE_EXTENSION));
+    DeviceExtension->BytesPerSector = SECTOR_SIZE;
+    DeviceExtension->CommonBuffer[1] = Staging + BLOCK_SIZE;
+    DeviceExtension->CommonBufferSize = BLOCK_SIZE;
+    DeviceExtension->NonCachedExtension = nonCachedExtension;
+    DeviceExtension->NonCachedExtensionSize = sizeof(nonCachedExtension);
+    DeviceExtension->NonCachedExtensionUsed = 0x100;
+    DeviceExtension->SrbExtensionSize = 0x40;
+    DeviceExtension->PortType = ScsiPort;
+
+    hwInitializationData.TaggedQueuing = TRUE;
+    hwInitializationData.MultipleRequestPerLu = TRUE;
+
+    //
+    // Not for hibernation, nor for system DMA.
+    //
+
+    InitializeWriteQueue(&hwInitializationData, TRUE);
+    if (DeviceExtension->WriteQueue != NULL) {
+        printf("queue set up for hibernation\n");
+        Failures++;
+    }
+
+    DeviceExtension->CrashDump = TRUE;
+    DeviceExtension->DmaAdapterObject = DeviceExtension;
+
+    InitializeWriteQueue(&hwInitializationData, TRUE);
+    if (DeviceExtension->WriteQueue != NULL) {
+        printf("queue set up for system DMA\n");
+        Failures++;
+    }
+
+    DeviceExtension->MasterWithAdapter = TRUE;
+
+    //
+    // Untagged disks get one write at a time, and the depth is limited by
+    // the room for SRB extensions.
+    //
+
+    InitializeWriteQueue(&hwInitializationData, FALSE);
+    if (DeviceExtension->WriteQueue == NULL ||
+        DeviceExtension->WriteQueue->Depth != 1) {
+
+        printf("untagged queue not set up with depth 1\n");
+        Failures++;
+        return;
+    }
+
+    if (IsQueuedWriteSrb((PSCSI_REQUEST_BLOCK) notSrb) ||
+        !IsQueuedWriteSrb(&DeviceExtension->WriteQueue->Writes[0].Srb) ||
+        GetQueuedWriteSrb(SP_UNTAGGED) != NULL) {
+
+        printf("queued SRBs not told apart\n");
+        Failures++;
+    }
+
+    FreePool(DeviceExtension->WriteQueue->Workspace);
+    FreePool(DeviceExtension->WriteQueue);
+    DeviceExtension->WriteQueue = NULL;
+
+    InitializeWriteQueue(&hwInitializationData, TRUE);
+    if (DeviceExtension->WriteQueue == NULL ||
+        DeviceExtension->WriteQueue->Depth != (0x400 - 0x100) / 0x40) {
+
+        printf("tagged queue not limited by the SRB extensions\n");
+        Failures++;
+        return;
+    }
+
+    FreePool(DeviceExtension->WriteQueue->Workspace);
+    FreePool(DeviceExtension->WriteQueue);
+    DeviceExtension->WriteQueue = NULL;
+
+    DeviceExtension->NonCachedExtensionUsed = sizeof(nonCachedExtension);
+
+    InitializeWriteQueue(&hwInitializationData, TRUE);
+    if (DeviceExtension->WriteQueue != NULL) {
+        printf("queue set up with no room for SRB extensions\n");
+        Failures++;
+    }
+}
+
+int __cdecl
+main(
+    int argc,
+    char** argv
+    )
+{
+    ULONG       blocks = 64;
+    ULONG       ringSize = BLOCK_SIZE;
+    ULONG       blockTime = 40;
+    ULONG       depths[] = { 1, 4, 16 };
+    ULONGLONG   time;
+    ULONG       i;
+
+    for (i = 1; i < (ULONG) argc; i++) {
+        if (argv[i][0] != '-' || argv[i][2] || i + 1 == (ULONG) argc) {
+            goto Usage;
+        }
+
+        switch (argv[i][1]) {
+            case 'b':
+                blocks = atoi(argv[++i]);
+                break;
+
+            case 'r':
+                ringSize = atoi(argv[++i]);
+                break;
+
+            case 'c':
+                blockTime = atoi(argv[++i]);
+                break;
+
+            case 'l':
+                Latency = atoi(argv[++i]);
+                break;
+
+            default:
+                goto Usage;
+        }
+    }
+
+    if (blocks < 4 || ringSize < 4 * SECTOR_SIZE || ringSize > BLOCK_SIZE ||
+        (ringSize & (SECTOR_SIZE - 1))) {
+
+        goto Usage;
+    }
+
+    DiskDumpCompression = TRUE;
+
+    ImageLength = HEADER_SIZE + blocks * BLOCK_SIZE;
+    DiskLength = PARTITION_OFFSET + ImageLength + BLOCK_SIZE;
+    Image = malloc(ImageLength);
+    Disk = malloc(DiskLength);
+    Expanded = malloc(ImageLength);
+    Staging = malloc(2 * BLOCK_SIZE);
+
+    if (!Image || !Disk || !Expanded || !Staging) {
+        printf("Failed to allocate the image!\n");
+        return 1;
+    }
+
+    BuildImage(blocks);
+    CheckCodec();
+    CheckSetup();
+
+    //
+    // A small ring, so that writes are split and the ring wraps.
+    //
+
+    RunDump(16, 0x3000, blockTime, FALSE);
+
+    //
+    // A write that fails once and a disk that is busy once are retried.
+    //
+
+    FailStart = 20;
+    BusyStart = 30;
+    RunDump(16, ringSize, blockTime, FALSE);
+    FailStart = BusyStart = (ULONG) -1;
+
+    //
+    // A disk with a shorter queue than the writer.
+    //
+
+    DeviceDepth = 4;
+    RunDump(16, ringSize, blockTime, FALSE);
+    if (QueueFulls == 0) {
+        printf("queue full was not seen\n");
+        Failures++;
+    }
+    DeviceDepth = MAX_DEVICE_DEPTH;
+
+    //
+    // A lost write times out, and is retried after a bus reset.
+    //
+
+    LoseStart = 40;
+    RunDump(4, ringSize, blockTime, FALSE);
+    if (Resets != 1) {
+        printf("lost write caused %d resets\n", Resets);
+        Failures++;
+    }
+    LoseStart = (ULONG) -1;
+
+    //
+    // Writes that keep failing fail the dump.
+    //
+
+    FailFrom = 50;
+    RunDump(16, ringSize, blockTime, TRUE);
+    FailFrom = (ULONG) -1;
+
+    printf("%d KB image, %d KB ring, %d units per block, latency %d\n\n",
+           ImageLength / 1024, ringSize / 1024, blockTime, Latency);
+
+    MeasureCompressor();
+
+    printf("depth       time   KB written  out of order\n");
+
+    for (i = 0; i < sizeof(depths)/sizeof(depths[0]); i++) {
+
+        time = RunDump(depths[i], ringSize, blockTime, FALSE);
+
+        printf("%5d %10I64u %12I64u %13d\n", depths[i], time,
+               BytesWritten / 1024, OutOfOrder);
+    }
+
+    if (Failures) {
+        printf("FAILED\n");
+        return 1;
+    }
+
+    return 0;
+
+Usage:
+    printf("usage: tcompress [-b blocks] [-r ring size] [-c block time] [-l latency]\n");
+    return 2;
+}
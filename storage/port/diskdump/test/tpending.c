@@ -0,0 +1,506 @@
+//
+// Test and benchmark for the diskdump pending write routine.
+//
+// A simulated miniport completes each write a fixed time after it was
+// started, and copies the data to a simulated disk.  Each call of the
+// interrupt routine takes one unit of time.  The hibernation writer is
+// modelled on top: it compresses a block into one of two staging buffers
+// while the other one is being written, resuming the pending write
+// between chunks of work, and then finishes the pending write and starts
+// the next one.
+//
+// Every run checks that the disk ends up holding the image.  One run has
+// a write fail, to check that it is retried synchronously.  The simulated
+// time of the whole image is reported for the synchronous writes the
+// driver did before, and for the pending writes, in units of
+// PD_INTERLOOP_STALL.
+//
+// Usage:
+//
+//     tpending [-b blocks] [-w write time]
+//
+
+#include <nt.h>
+#include <ntrtl.h>
+#include <nturtl.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 0x1000
+#endif
+
+#ifndef PAGE_ALIGN
+#define PAGE_ALIGN(Va) ((PVOID)((ULONG_PTR)(Va) & ~(PAGE_SIZE - 1)))
+#endif
+
+#define IO_DUMP_WRITE_FULFILL   0
+#define IO_DUMP_WRITE_START     1
+#define IO_DUMP_WRITE_RESUME    2
+#define IO_DUMP_WRITE_FINISH    3
+#define IO_DUMP_WRITE_INIT      4
+#define IO_DUMP_WRITE_DATA_SIZE (2*PAGE_SIZE)
+
+#define DebugPrint(x)
+
+typedef struct _MDL {
+    PVOID StartVa;
+    ULONG ByteCount;
+    ULONG ByteOffset;
+} MDL, *PMDL;
+
+//
+// The part of the SRB and of the device extension the routine uses.
+//
+
+typedef struct _SCSI_REQUEST_BLOCK {
+    UCHAR SrbStatus;
+} SCSI_REQUEST_BLOCK, *PSCSI_REQUEST_BLOCK;
+
+#define SRB_STATUS_SUCCESS  0x01
+#define SRB_STATUS_ERROR    0x04
+#define SRB_STATUS(Status)  ((Status) & 0x3F)
+
+typedef struct _DEVICE_EXTENSION {
+    SCSI_REQUEST_BLOCK Srb;
+    ULONG CompletionDelay;
+} DEVICE_EXTENSION, *PDEVICE_EXTENSION;
+
+#define COMPLETION_DELAY 10
+#define PD_POLL_UNTIL_COMPLETE ((ULONG)-1)
+#define PD_RESUME_POLL_ITERATIONS (COMPLETION_DELAY + 1)
+
+DEVICE_EXTENSION TestExtension;
+PDEVICE_EXTENSION DeviceExtension = &TestExtension;
+
+#define BLOCK_SIZE 0x10000
+
+//
+// The simulated clock, and the disk.
+//
+
+ULONGLONG Clock;
+PUCHAR Disk;
+ULONG WriteTime = 4000;
+
+//
+// The write the miniport has, and the time it completes at.
+//
+
+LARGE_INTEGER CurrentOffset;
+PMDL CurrentMdl;
+ULONGLONG CurrentCompletion;
+BOOLEAN CurrentPending;
+ULONG FailWrite = (ULONG) -1;
+ULONG WritesStarted;
+ULONG SynchronousWrites;
+ULONG Remaps;
+ULONG Failures;
+
+VOID
+StartSrb(
+    IN PSCSI_REQUEST_BLOCK Srb
+    )
+{
+    CurrentPending = TRUE;
+    CurrentCompletion = Clock + WriteTime;
+    DeviceExtension->CompletionDelay = COMPLETION_DELAY;
+    Srb->SrbStatus = 0;
+    WritesStarted++;
+}
+
+BOOLEAN
+PollSrb(
+    IN PSCSI_REQUEST_BLOCK Srb,
+    IN ULONG MaximumIterations
+    )
+{
+    ULONG iteration;
+
+    for (iteration = 0;
+         MaximumIterations == PD_POLL_UNTIL_COMPLETE ||
+         iteration < MaximumIterations;
+         iteration++) {
+
+        Clock++;
+
+        if (CurrentPending && Clock >= CurrentCompletion) {
+
+            CurrentPending = FALSE;
+
+            if (WritesStarted == FailWrite) {
+                Srb->SrbStatus = SRB_STATUS_ERROR;
+            } else {
+                memcpy(Disk + CurrentOffset.QuadPart,
+                       (PUCHAR) CurrentMdl->StartVa + CurrentMdl->ByteOffset,
+                       CurrentMdl->ByteCount);
+                Srb->SrbStatus = SRB_STATUS_SUCCESS;
+            }
+        }
+
+        if (!CurrentPending) {
+            if (DeviceExtension->CompletionDelay-- == 0) {
+                return TRUE;
+            }
+        }
+    }
+
+    return FALSE;
+}
+
+VOID
+CompleteSrb(
+    IN PSCSI_REQUEST_BLOCK Srb
+    )
+{
+}
+
+VOID
+PrepareWriteSrb(
+    IN PLARGE_INTEGER DiskByteOffset,
+    IN PMDL Mdl
+    )
+{
+    CurrentOffset = *DiskByteOffset;
+    CurrentMdl = Mdl;
+}
+
+VOID
+MmMapMemoryDumpMdl(
+    IN PMDL Mdl
+    )
+{
+    Remaps++;
+}
+
+NTSTATUS
+DiskDumpWrite(
+    IN PLARGE_INTEGER DiskByteOffset,
+    IN PMDL Mdl
+    )
+{
+    PSCSI_REQUEST_BLOCK srb = &DeviceExtension->Srb;
+    ULONG retryCount;
+
+    SynchronousWrites++;
+
+    for (retryCount = 0; retryCount < 3; retryCount++) {
+
+        PrepareWriteSrb(DiskByteOffset, Mdl);
+        StartSrb(srb);
+        PollSrb(srb, PD_POLL_UNTIL_COMPLETE);
+        CompleteSrb(srb);
+
+        if (SRB_STATUS(srb->SrbStatus) == SRB_STATUS_SUCCESS) {
+            return STATUS_SUCCESS;
+        }
+    }
+
+    return STATUS_UNSUCCESSFUL;
+}
+
+#include "dumpwp.c"
+
+PUCHAR Image;
+PUCHAR Staging[2];
+PVOID LocalData;
+
+VOID
+Compress(
+    IN  ULONG   Block,
+    IN  PUCHAR  Buffer,
+    IN  ULONG   CompressTime,
+    IN  BOOLEAN Overlapped
+    )
+
+/*++
+
+Routine Description:
+
+    This routine stands in for the compression of a block by the
+    hibernation writer.  The work is done in chunks, and a pending write
+    is resumed after every chunk.
+
+--*/
+
+{
+    ULONG   chunk, chunks = 16;
+
+    for (chunk = 0; chunk < chunks; chunk++) {
+
+        memcpy(Buffer + chunk*(BLOCK_SIZE/chunks),
+               Image + Block*BLOCK_SIZE + chunk*(BLOCK_SIZE/chunks),
+               BLOCK_SIZE/chunks);
+
+        Clock += CompressTime/chunks;
+
+        if (Overlapped) {
+            DiskDumpWritePending(IO_DUMP_WRITE_RESUME, NULL, NULL, LocalData);
+        }
+    }
+}
+
+ULONGLONG
+RunImage(
+    IN  ULONG   Blocks,
+    IN  ULONG   CompressTime,
+    IN  BOOLEAN Overlapped
+    )
+
+/*++
+
+Routine Description:
+
+    This routine writes the image to the disk and checks the result.
+
+Return Value:
+
+    The simulated time the image took.
+
+--*/
+
+{
+    MDL             mdl[2];
+    LARGE_INTEGER   offset;
+    ULONG           block;
+    NTSTATUS        status;
+    PMDL            m;
+
+    memset(Disk, 0, Blocks*BLOCK_SIZE);
+    Clock = 0;
+    WritesStarted = 0;
+
+    if (Overlapped) {
+        status = DiskDumpWritePending(IO_DUMP_WRITE_INIT, NULL, NULL,
+                                      LocalData);
+        if (status != STATUS_SUCCESS) {
+            printf("init failed: %x\n", status);
+            Failures++;
+            return 0;
+        }
+    }
+
+    for (block = 0; block < Blocks; block++) {
+
+        m = &mdl[block&1];
+        m->StartVa = Staging[block&1];
+        m->ByteOffset = 0;
+        m->ByteCount = BLOCK_SIZE;
+        offset.QuadPart = (LONGLONG) block*BLOCK_SIZE;
+
+        Compress(block, Staging[block&1], CompressTime, Overlapped);
+
+        if (!Overlapped) {
+            status = DiskDumpWrite(&offset, m);
+        } else {
+
+            status = DiskDumpWritePending(IO_DUMP_WRITE_FINISH, NULL, NULL,
+                                          LocalData);
+            if (status == STATUS_SUCCESS) {
+                status = DiskDumpWritePending(IO_DUMP_WRITE_START, &offset,
+                                              m, LocalData);
+            }
+
+            if (status == STATUS_PENDING && block == Blocks/2) {
+                status = DiskDumpWritePending(IO_DUMP_WRITE_START, &offset,
+                                              m, LocalData);
+                if (status != STATUS_INVALID_PARAMETER) {
+                    printf("second start returned %x\n", status);
+                    Failures++;
+                }
+                status = STATUS_PENDING;
+            }
+        }
+
+        if (status != STATUS_SUCCESS && status != STATUS_PENDING) {
+            printf("write of block %d failed: %x\n", block, status);
+            Failures++;
+            return 0;
+        }
+    }
+
+    if (Overlapped) {
+        status = DiskDumpWritePending(IO_DUMP_WRITE_FINISH, NULL, NULL,
+                                      LocalData);
+        if (status != STATUS_SUCCESS) {
+            printf("last write failed: %x\n", status);
+            Failures++;
+        }
+    }
+
+    if (memcmp(Disk, Image, Blocks*BLOCK_SIZE)) {
+        printf("disk does not hold the image\n");
+        Failures++;
+    }
+
+    return Clock;
+}
+
+VOID
+CheckProtocol(
+    VOID
+    )
+{
+    MDL             mdl;
+    LARGE_INTEGER   offset;
+    NTSTATUS        status;
+    ULONG           i;
+
+    status = DiskDumpWritePending(IO_DUMP_WRITE_INIT, NULL, NULL,
+                                  (PUCHAR) LocalData + 8);
+    if (status != STATUS_UNSUCCESSFUL) {
+        printf("init with misaligned data returned %x\n", status);
+        Failures++;
+    }
+
+    memset(LocalData, 0, IO_DUMP_WRITE_DATA_SIZE);
+    status = DiskDumpWritePending(IO_DUMP_WRITE_RESUME, NULL, NULL,
+                                  LocalData);
+    if (status != STATUS_INVALID_PARAMETER) {
+        printf("resume before init returned %x\n", status);
+        Failures++;
+    }
+
+    DiskDumpWritePending(IO_DUMP_WRITE_INIT, NULL, NULL, LocalData);
+
+    //
+    // A fulfilled write is complete when it returns.
+    //
+
+    memcpy(Staging[0], Image, BLOCK_SIZE);
+    mdl.StartVa = Staging[0];
+    mdl.ByteOffset = 0;
+    mdl.ByteCount = BLOCK_SIZE;
+    offset.QuadPart = 0;
+
+    status = DiskDumpWritePending(IO_DUMP_WRITE_FULFILL, &offset, &mdl,
+                                  LocalData);
+    if (status != STATUS_SUCCESS || memcmp(Disk, Image, BLOCK_SIZE)) {
+        printf("fulfill returned %x\n", status);
+        Failures++;
+    }
+
+    //
+    // A started write completes after enough resumes.
+    //
+
+    status = DiskDumpWritePending(IO_DUMP_WRITE_START, &offset, &mdl,
+                                  LocalData);
+    for (i = 0; status == STATUS_PENDING; i++) {
+        status = DiskDumpWritePending(IO_DUMP_WRITE_RESUME, NULL, NULL,
+                                      LocalData);
+    }
+
+    //
+    // The write takes WriteTime calls of the interrupt routine, and the
+    // completion delay after that.  The start makes the first of them.
+    //
+
+    if (status != STATUS_SUCCESS ||
+        i != (WriteTime + COMPLETION_DELAY + PD_RESUME_POLL_ITERATIONS - 1)/
+             PD_RESUME_POLL_ITERATIONS - 1) {
+
+        printf("write took %d resumes, status %x\n", i, status);
+        Failures++;
+    }
+
+    status = DiskDumpWritePending(IO_DUMP_WRITE_FINISH, NULL, NULL,
+                                  LocalData);
+    if (status != STATUS_SUCCESS) {
+        printf("finish with no write returned %x\n", status);
+        Failures++;
+    }
+}
+
+int __cdecl
+main(
+    int argc,
+    char** argv
+    )
+{
+    ULONG       blocks = 256;
+    ULONG       compressTimes[] = { 0, 1000, 4000, 8000 };
+    ULONGLONG   synchronous, overlapped;
+    ULONG       i;
+
+    for (i = 1; i < (ULONG) argc; i++) {
+        if (argv[i][0] != '-' || argv[i][2] || i + 1 == (ULONG) argc) {
+            goto Usage;
+        }
+
+        switch (argv[i][1]) {
+            case 'b':
+                blocks = atoi(argv[++i]);
+                break;
+
+            case 'w':
+                WriteTime = atoi(argv[++i]);
+                break;
+
+            default:
+                goto Usage;
+        }
+    }
+
+    if (blocks < 2 || !WriteTime) {
+        goto Usage;
+    }
+
+    Image = malloc(blocks*BLOCK_SIZE);
+    Disk = malloc(blocks*BLOCK_SIZE);
+    Staging[0] = VirtualAlloc(NULL, BLOCK_SIZE, MEM_COMMIT, PAGE_READWRITE);
+    Staging[1] = VirtualAlloc(NULL, BLOCK_SIZE, MEM_COMMIT, PAGE_READWRITE);
+    LocalData = VirtualAlloc(NULL, IO_DUMP_WRITE_DATA_SIZE, MEM_COMMIT,
+                             PAGE_READWRITE);
+    if (!Image || !Disk || !Staging[0] || !Staging[1] || !LocalData) {
+        printf("Failed to allocate the image!\n");
+        return 1;
+    }
+
+    srand(1);
+    for (i = 0; i < blocks*BLOCK_SIZE; i++) {
+        Image[i] = (UCHAR) rand();
+    }
+
+    CheckProtocol();
+
+    //
+    // A failed pending write is retried synchronously, after mapping the
+    // data again.
+    //
+
+    FailWrite = 10;
+    SynchronousWrites = Remaps = 0;
+    RunImage(blocks, 1000, TRUE);
+    if (SynchronousWrites != 1 || Remaps != 1) {
+        printf("failed write retried %d times with %d remaps\n",
+               SynchronousWrites, Remaps);
+        Failures++;
+    }
+    FailWrite = (ULONG) -1;
+
+    printf("%d blocks of %d KB, %d units per write\n\n", blocks,
+           BLOCK_SIZE/1024, WriteTime);
+    printf("compress   synchronous    pending  speedup\n");
+
+    for (i = 0; i < sizeof(compressTimes)/sizeof(compressTimes[0]); i++) {
+
+        synchronous = RunImage(blocks, compressTimes[i], FALSE);
+        overlapped = RunImage(blocks, compressTimes[i], TRUE);
+
+        printf("%8d  %12I64u %10I64u  %6.2f\n", compressTimes[i], synchronous,
+               overlapped, overlapped ? (double) synchronous/overlapped : 0);
+    }
+
+    if (Failures) {
+        printf("FAILED\n");
+        return 1;
+    }
+
+    return 0;
+
+Usage:
+    printf("usage: tpending [-b blocks] [-w write time]\n");
+    return 2;
+}
@@ -0,0 +1,612 @@
+/*++
+
+Copyright (c) 2002  Microsoft Corporation
+
+Module Name:
+
+    tagalloc.c
+
+Abstract:
+
+    Queue tag allocator shared by the port drivers.
+
+    Free tags are kept in a two level bitmap. Each bit of FreeMap is set
+    when the corresponding tag is free, and bit n of Summary is set when
+    FreeMap[n] may contain a free tag. Finding a free tag is two
+    find-first-set operations, one on Summary and one on the chosen
+    FreeMap word, independent of how many tags are outstanding.
+
+    Tags are claimed and released with interlocked operations on the
+    FreeMap word; no lock is taken. Summary is only a hint: a bit may be
+    set for a word that has just become full, and is then cleared by the
+    next allocation that finds the word empty. A word with a free tag
+    always has its Summary bit set once the routine that freed the tag
+    returns.
+
+    Each processor starts its search at the word it last allocated from,
+    and processors start out at different words, so processors tend to
+    work on different FreeMap words.
+
+Author:
+
+Revision History:
+
+--*/
+
+#if !defined (UTEST)
+#include "precomp.h"
+#include "utils.h"
+#endif
+
+
+//
+// Definitions
+//
+
+#define PORT_TAG_MAP_TAG    ('mTlP')
+
+#define TAG_WORD(Tag)       ((Tag) / 32)
+#define TAG_BIT(Tag)        (1UL << ((Tag) % 32))
+
+//
+// Prototypes
+//
+
+ULONG
+PortpClaimTagInWord(
+    IN PPORT_TAG_ALLOCATOR Allocator,
+    IN ULONG Word
+    );
+
+VOID
+PortpMarkTagWordFull(
+    IN PPORT_TAG_ALLOCATOR Allocator,
+    IN ULONG Word
+    );
+
+LONG
+PortpRebuildTagSummary(
+    IN PPORT_TAG_ALLOCATOR Allocator
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, PortInitializeTagAllocator)
+#pragma alloc_text(PAGE, PortDeleteTagAllocator)
+#endif // ALLOC_PRAGMA
+
+
+//
+// Interlocked helpers.
+//
+
+LONG
+INLINE
+PortpInterlockedOr(
+    IN PLONG Target,
+    IN LONG Set
+    )
+/*++
+
+Routine Description:
+
+    Atomically OR bits into a LONG.
+
+Return Value:
+
+    The value of Target before the operation.
+
+--*/
+{
+    LONG Old;
+    LONG Current;
+
+    Current = *(volatile LONG *)Target;
+
+    do {
+        Old = Current;
+        Current = InterlockedCompareExchange (Target, Old | Set, Old);
+    } while (Current != Old);
+
+    return Old;
+}
+
+LONG
+INLINE
+PortpInterlockedAnd(
+    IN PLONG Target,
+    IN LONG Mask
+    )
+/*++
+
+Routine Description:
+
+    Atomically AND a mask into a LONG.
+
+Return Value:
+
+    The value of Target before the operation.
+
+--*/
+{
+    LONG Old;
+    LONG Current;
+
+    Current = *(volatile LONG *)Target;
+
+    do {
+        Old = Current;
+        Current = InterlockedCompareExchange (Target, Old & Mask, Old);
+    } while (Current != Old);
+
+    return Old;
+}
+
+
+//
+// Implementation
+//
+
+VOID
+PortCreateTagAllocator(
+    OUT PPORT_TAG_ALLOCATOR Allocator
+    )
+/*++
+
+Routine Description:
+
+    Create an empty tag allocator. The allocator must be initialized with
+    PortInitializeTagAllocator before tags can be allocated from it.
+
+Arguments:
+
+    Allocator - Supplies the allocator to create.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    RtlZeroMemory (Allocator, sizeof (PORT_TAG_ALLOCATOR));
+}
+
+
+NTSTATUS
+PortInitializeTagAllocator(
+    IN OUT PPORT_TAG_ALLOCATOR Allocator,
+    IN ULONG TagCount
+    )
+/*++
+
+Routine Description:
+
+    Initialize a tag allocator with all tags free.
+
+Arguments:
+
+    Allocator - Supplies the allocator to initialize.
+
+    TagCount - Supplies the number of tags. Tags will be allocated in the
+        range 0 - TagCount - 1 inclusive. At most PORT_MAXIMUM_TAGS tags
+        are supported.
+
+Return Value:
+
+    NTSTATUS code.
+
+--*/
+{
+    ULONG i;
+    ULONG WordCount;
+    ULONG HintCount;
+    PLONG FreeMap;
+
+    PAGED_CODE();
+
+    ASSERT (Allocator->FreeMap == NULL);
+
+    if (TagCount == 0 || TagCount > PORT_MAXIMUM_TAGS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    WordCount = (TagCount + 31) / 32;
+    HintCount = KeNumberProcessors;
+
+    //
+    // The per-processor hints follow the free map in the same allocation.
+    //
+
+    FreeMap = ExAllocatePoolWithTag (NonPagedPool,
+                                     (WordCount * sizeof (LONG)) +
+                                     (HintCount * sizeof (ULONG)),
+                                     PORT_TAG_MAP_TAG);
+
+    if (FreeMap == NULL) {
+        return STATUS_NO_MEMORY;
+    }
+
+    Allocator->Count = TagCount;
+    Allocator->WordCount = WordCount;
+    Allocator->FreeMap = FreeMap;
+    Allocator->Hints = (PULONG)(FreeMap + WordCount);
+    Allocator->HintCount = HintCount;
+    Allocator->OutstandingTags = 0;
+    Allocator->HighWaterMark = 0;
+    Allocator->Summary = 0;
+
+    for (i = 0; i < WordCount; i++) {
+        if (TagCount - (i * 32) >= 32) {
+            FreeMap[i] = (LONG)~0UL;
+        } else {
+            FreeMap[i] = (LONG)((1UL << (TagCount - (i * 32))) - 1);
+        }
+        Allocator->Summary |= (1UL << i);
+    }
+
+    //
+    // Spread the processors' starting points over the map.
+    //
+
+    for (i = 0; i < HintCount; i++) {
+        Allocator->Hints[i] = (i * WordCount) / HintCount;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+PortDeleteTagAllocator(
+    IN PPORT_TAG_ALLOCATOR Allocator
+    )
+/*++
+
+Routine Description:
+
+    Free the resources held by a tag allocator. The allocator may be
+    initialized again afterwards.
+
+Arguments:
+
+    Allocator - Supplies the allocator to delete.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAGED_CODE();
+
+    if (Allocator->FreeMap != NULL) {
+        ExFreePoolWithTag (Allocator->FreeMap, PORT_TAG_MAP_TAG);
+    }
+
+    RtlZeroMemory (Allocator, sizeof (PORT_TAG_ALLOCATOR));
+}
+
+
+ULONG
+PortAllocateTag(
+    IN PPORT_TAG_ALLOCATOR Allocator
+    )
+/*++
+
+Routine Description:
+
+    Allocate any free tag. This routine may be called at any IRQL up to
+    and including DIRQL.
+
+Arguments:
+
+    Allocator - Supplies the allocator to allocate from.
+
+Return Value:
+
+    The allocated tag, or PORT_INVALID_TAG if all tags are outstanding.
+
+--*/
+{
+    ULONG Processor;
+    ULONG HintWord;
+    ULONG Word;
+    ULONG Tag;
+    LONG Summary;
+    LONG Candidates;
+    LONG Outstanding;
+
+    Processor = KeGetCurrentProcessorNumber ();
+
+    //
+    // Processors added after the allocator was initialized share the
+    // first hint.
+    //
+
+    if (Processor >= Allocator->HintCount) {
+        Processor = 0;
+    }
+
+    HintWord = Allocator->Hints[Processor];
+
+    for (;;) {
+
+        Summary = *(volatile LONG *)&Allocator->Summary;
+
+        //
+        // Summary is only a hint; before failing, check the map itself.
+        // This only happens when (nearly) all tags are outstanding.
+        //
+
+        if (Summary == 0) {
+            Summary = PortpRebuildTagSummary (Allocator);
+            if (Summary == 0) {
+                return PORT_INVALID_TAG;
+            }
+        }
+
+        //
+        // Prefer the first word at or after this processor's hint.
+        //
+
+        Candidates = Summary & ~((1UL << HintWord) - 1);
+
+        if (Candidates == 0) {
+            Candidates = Summary;
+        }
+
+        Word = RtlFindLeastSignificantBit ((ULONG)Candidates);
+        Tag = PortpClaimTagInWord (Allocator, Word);
+
+        if (Tag != PORT_INVALID_TAG) {
+            break;
+        }
+    }
+
+    if (HintWord != Word) {
+        Allocator->Hints[Processor] = Word;
+    }
+
+    //
+    // The high water mark is a statistic; a lost update is harmless.
+    //
+
+    Outstanding = InterlockedIncrement (&Allocator->OutstandingTags);
+
+    if (Outstanding > Allocator->HighWaterMark) {
+        Allocator->HighWaterMark = Outstanding;
+    }
+
+    return Tag;
+}
+
+
+BOOLEAN
+PortAllocateSpecificTag(
+    IN PPORT_TAG_ALLOCATOR Allocator,
+    IN ULONG Tag
+    )
+/*++
+
+Routine Description:
+
+    Allocate a specific tag.
+
+Arguments:
+
+    Allocator - Supplies the allocator to allocate from.
+
+    Tag - Supplies the tag to allocate.
+
+Return Value:
+
+    TRUE if the tag was allocated, FALSE if it was already outstanding.
+
+--*/
+{
+    PLONG Target;
+    LONG Free;
+    LONG Old;
+    LONG Bit;
+
+    ASSERT (Tag < Allocator->Count);
+
+    Target = &Allocator->FreeMap[TAG_WORD (Tag)];
+    Bit = (LONG)TAG_BIT (Tag);
+    Free = *(volatile LONG *)Target;
+
+    while ((Free & Bit) != 0) {
+        Old = InterlockedCompareExchange (Target, Free & ~Bit, Free);
+        if (Old == Free) {
+            if ((Free & ~Bit) == 0) {
+                PortpMarkTagWordFull (Allocator, TAG_WORD (Tag));
+            }
+            InterlockedIncrement (&Allocator->OutstandingTags);
+            return TRUE;
+        }
+        Free = Old;
+    }
+
+    return FALSE;
+}
+
+
+VOID
+PortFreeTag(
+    IN PPORT_TAG_ALLOCATOR Allocator,
+    IN ULONG Tag
+    )
+/*++
+
+Routine Description:
+
+    Free a tag allocated by PortAllocateTag or PortAllocateSpecificTag.
+    This routine may be called at any IRQL up to and including DIRQL.
+
+Arguments:
+
+    Allocator - Supplies the allocator the tag was allocated from.
+
+    Tag - Supplies the tag to free.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG Word;
+    LONG Old;
+
+    ASSERT (Tag < Allocator->Count);
+
+    Word = TAG_WORD (Tag);
+    Old = PortpInterlockedOr (&Allocator->FreeMap[Word], (LONG)TAG_BIT (Tag));
+
+    //
+    // We should never free a tag that is not outstanding.
+    //
+
+    ASSERT ((Old & (LONG)TAG_BIT (Tag)) == 0);
+
+    //
+    // If the word was full its summary bit may be clear; set it.
+    //
+
+    if (Old == 0) {
+        PortpInterlockedOr (&Allocator->Summary, (LONG)(1UL << Word));
+    }
+
+    ASSERT (Allocator->OutstandingTags != 0);
+    InterlockedDecrement (&Allocator->OutstandingTags);
+}
+
+
+ULONG
+PortpClaimTagInWord(
+    IN PPORT_TAG_ALLOCATOR Allocator,
+    IN ULONG Word
+    )
+/*++
+
+Routine Description:
+
+    Claim the lowest free tag in a FreeMap word.
+
+Arguments:
+
+    Allocator - Supplies the allocator.
+
+    Word - Supplies the index of the FreeMap word.
+
+Return Value:
+
+    The claimed tag, or PORT_INVALID_TAG if the word had no free tags. In
+    that case the word's summary bit has been cleared.
+
+--*/
+{
+    PLONG Target;
+    LONG Free;
+    LONG Old;
+    LONG Bit;
+    ULONG Index;
+
+    Target = &Allocator->FreeMap[Word];
+    Free = *(volatile LONG *)Target;
+
+    while (Free != 0) {
+        Index = RtlFindLeastSignificantBit ((ULONG)Free);
+        Bit = (LONG)(1UL << Index);
+        Old = InterlockedCompareExchange (Target, Free & ~Bit, Free);
+
+        if (Old == Free) {
+            if ((Free & ~Bit) == 0) {
+                PortpMarkTagWordFull (Allocator, Word);
+            }
+            return ((Word * 32) + Index);
+        }
+
+        Free = Old;
+    }
+
+    PortpMarkTagWordFull (Allocator, Word);
+
+    return PORT_INVALID_TAG;
+}
+
+
+VOID
+PortpMarkTagWordFull(
+    IN PPORT_TAG_ALLOCATOR Allocator,
+    IN ULONG Word
+    )
+/*++
+
+Routine Description:
+
+    Clear the summary bit for a FreeMap word that was found to be full.
+
+    A tag in the word may be freed while this is happening. The freeing
+    processor sets the FreeMap bit before the summary bit, so checking
+    the word again after clearing the summary bit catches that case.
+
+Arguments:
+
+    Allocator - Supplies the allocator.
+
+    Word - Supplies the index of the full FreeMap word.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LONG Bit;
+
+    Bit = (LONG)(1UL << Word);
+    PortpInterlockedAnd (&Allocator->Summary, ~Bit);
+
+    if (*(volatile LONG *)&Allocator->FreeMap[Word] != 0) {
+        PortpInterlockedOr (&Allocator->Summary, Bit);
+    }
+}
+
+
+LONG
+PortpRebuildTagSummary(
+    IN PPORT_TAG_ALLOCATOR Allocator
+    )
+/*++
+
+Routine Description:
+
+    Set the summary bit of every FreeMap word that has a free tag.
+
+Arguments:
+
+    Allocator - Supplies the allocator.
+
+Return Value:
+
+    The summary bits that were found to be set.
+
+--*/
+{
+    ULONG i;
+    LONG Found;
+
+    Found = 0;
+
+    for (i = 0; i < Allocator->WordCount; i++) {
+        if (*(volatile LONG *)&Allocator->FreeMap[i] != 0) {
+            Found |= (LONG)(1UL << i);
+        }
+    }
+
+    if (Found != 0) {
+        PortpInterlockedOr (&Allocator->Summary, Found);
+    }
+
+    return Found;
+}
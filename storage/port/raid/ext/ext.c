@@ -747,6 +747,58 @@ GetAdapterExtension(
 	return 0;
 }
 
+VOID
+DumpCompletionQueues(
+	IN ULONG64 AdapterPtr
+	)
+{
+	ULONG i;
+	ULONG Count;
+	ULONG QueueSize;
+	ULONG DpcCount;
+	ULONG Completions;
+	ULONG64 Queues;
+
+	//
+	//  CompletionQueues: 4
+	//    CPU  DPCs      Completions Avg/DPC Max  Remote
+	//      0  1024      4096        4       17   12
+	//
+
+	InitTypeRead (AdapterPtr, raidport!RAID_ADAPTER_EXTENSION);
+	Queues = ReadField (CompletionQueues);
+	Count = (ULONG)ReadField (CompletionQueueCount);
+
+	if (Queues == 0) {
+		dprintf ("  CompletionQueues: none (adapter DPC)\n");
+		return;
+	}
+
+	QueueSize = GetTypeSize ("raidport!RAID_COMPLETION_QUEUE");
+
+	dprintf ("  CompletionQueues: %d\n", Count);
+	dprintf ("    CPU  DPCs      Completions Avg/DPC Max  Remote\n");
+
+	for (i = 0; i < Count; i++) {
+
+		if (CheckControlC ()) {
+			return;
+		}
+
+		InitTypeRead (Queues + i * QueueSize, raidport!RAID_COMPLETION_QUEUE);
+		DpcCount = (ULONG)ReadField (DpcCount);
+		Completions = (ULONG)ReadField (Completions);
+
+		dprintf ("    %3d  %-8d  %-10d  %-6d  %-4d %d\n",
+				 i,
+				 DpcCount,
+				 Completions,
+				 DpcCount ? Completions / DpcCount : 0,
+				 (ULONG)ReadField (MaxBatch),
+				 (ULONG)ReadField (RemoteCompletions));
+	}
+}
+
 VOID
 DumpMiniport(
 	IN ULONG64 AdapterPtr
@@ -914,6 +966,7 @@ ADAPTER f0345600
 					ReadField (AdapterQueue->HighWaterMark));
 
 		DumpMiniport (AdapterPtr);
+		DumpCompletionQueues (AdapterPtr);
 		
 					
 	}
@@ -15,6 +15,15 @@ Abstract:
 
 	The dictionary does not provide automatic synchronization.
 
+	Two table layouts are supported. The default layout is a chained hash
+	table whose size is chosen by the caller and only changes through
+	StorAdjustDictionarySize. A dictionary created with the
+	STOR_DICTIONARY_OPEN_ADDRESSING flag instead keeps pointers to its
+	entries in a single array of slots (open addressing with linear
+	probing), and grows and shrinks the array as entries are inserted and
+	removed. Lookups in this mode touch one or two cache lines instead of
+	walking a list of entries.
+
 Author:
 
 	Matthew D Hendel (math) 8-Feb-2001
@@ -63,15 +72,51 @@ typedef ULONG
 	IN PVOID Key
 	);
 
+//
+// Flags for StorCreateDictionaryEx.
+//
+
+#define STOR_DICTIONARY_OPEN_ADDRESSING	(0x00000001)
+
+//
+// Slot in an open-addressing dictionary. The hash of the entry's key is
+// kept with the entry so probing and resizing do not need to call back
+// into the GetKey and Hash routines.
+//
+
+typedef struct _STOR_DICTIONARY_SLOT {
+	ULONG Hash;
+	PSTOR_DICTIONARY_ENTRY Entry;
+} STOR_DICTIONARY_SLOT, *PSTOR_DICTIONARY_SLOT;
+
 //
 // Dictionary sstructure.
 //
 
 typedef struct _STOR_DICTIONARY {
 	ULONG EntryCount;
+
+	//
+	// For a chained dictionary, the number of lists in Entries. For an
+	// open-addressing dictionary, the number of slots in Slots; this is
+	// always a power of two.
+	//
+	
 	ULONG MaxEntryCount;
+	ULONG Flags;
+
+	//
+	// Open-addressing only: the smallest size the table will shrink to,
+	// and log2 (MaxEntryCount).
+	//
+	
+	ULONG MinEntryCount;
+	ULONG Shift;
 	POOL_TYPE PoolType;
-	PSTOR_DICTIONARY_ENTRY Entries;
+	union {
+		PSTOR_DICTIONARY_ENTRY Entries;
+		PSTOR_DICTIONARY_SLOT Slots;
+	};
 	STOR_DICTIONARY_GET_KEY_ROUTINE GetKeyRoutine;
 	STOR_DICTIONARY_COMPARE_KEY_ROUTINE CompareKeyRoutine;
 	STOR_DICTIONARY_HASH_KEY_ROUTINE HashKeyRoutine;
@@ -124,6 +169,28 @@ StorCreateDictionary(
 	IN STOR_DICTIONARY_HASH_KEY_ROUTINE HashKeyRoutine OPTIONAL
 	);
 
+NTSTATUS
+StorCreateDictionaryEx(
+	IN PSTOR_DICTIONARY Dictionary,
+	IN ULONG EntryCount,
+	IN POOL_TYPE PoolType,
+	IN ULONG Flags,
+	IN STOR_DICTIONARY_GET_KEY_ROUTINE GetKeyRoutine,
+	IN STOR_DICTIONARY_COMPARE_KEY_ROUTINE CompareKeyRoutine, OPTIONAL
+	IN STOR_DICTIONARY_HASH_KEY_ROUTINE HashKeyRoutine OPTIONAL
+	);
+
+NTSTATUS
+StorDeleteDictionary(
+	IN PSTOR_DICTIONARY Dictionary
+	);
+
+NTSTATUS
+StorAdjustDictionarySize(
+	IN PSTOR_DICTIONARY Dictionary,
+	IN ULONG MaxEntryCount
+	);
+
 NTSTATUS
 StorInsertDictionary(
 	IN PSTOR_DICTIONARY Dictionary,
@@ -177,12 +244,15 @@ StorGetDictionaryFullness(
 
 Routine Description:
 
-	Return the 'fullness' of the dictionary. As a general rule, when the
-	dictionary reaches XXX % full, it should be expanded to 
+	Return the 'fullness' of the dictionary. As a general rule, when a
+	chained dictionary reaches 100% full, it should be expanded using
+	StorAdjustDictionarySize. Open-addressing dictionaries resize
+	themselves and are always between 12% and 75% full once they have
+	grown past their initial size.
 
 Arguments:
 
-	Dictionary - 
+	Dictionary - Supplies the dictionary.
 
 Return Value:
 
@@ -191,7 +261,7 @@ Return Value:
 
 --*/
 {
-	return ((Dictionary->MaxEntryCount * 100) / Dictionary->EntryCount);
+	return ((Dictionary->EntryCount * 100) / Dictionary->MaxEntryCount);
 }
 
 
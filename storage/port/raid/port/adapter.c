@@ -47,6 +47,8 @@ Environment:
 #pragma alloc_text(PAGE, RaidAdapterStorageQueryPropertyIoctl)
 #pragma alloc_text(PAGE, RaidGetStorageAdapterProperty)
 #pragma alloc_text(PAGE, RaidAdapterPassThrough)
+#pragma alloc_text(PAGE, RaidpAdapterCreateCompletionQueues)
+#pragma alloc_text(PAGE, RaidpAdapterDeleteCompletionQueues)
 #endif // ALLOC_PRAGMA
 
 
@@ -223,6 +225,7 @@ Return Value:
 
     RaidDeleteDeferredQueue (&Adapter->DeferredQueue);
     RaidDeleteDeferredQueue (&Adapter->WmiDeferredQueue);
+    RaidpAdapterDeleteCompletionQueues (Adapter);
 
     Adapter->ObjectType = RaidUnknownObject;
 
@@ -769,6 +772,221 @@ Return Value:
 }
 
 
+VOID
+RaidpAdapterCompletionQueueDpcRoutine(
+    IN PKDPC Dpc,
+    IN PVOID Context,
+    IN PVOID Unused1,
+    IN PVOID Unused2
+    )
+/*++
+
+Routine Description:
+
+    DPC routine for a per-processor completion queue. The DPC runs on
+    the processor that owns the queue, and completes the whole batch of
+    XRBs that were queued before it started.
+
+    Unlike the adapter DPC there is no need to bound the loop: XRBs that
+    are completed while the batch is being processed go to the list
+    that was just emptied, and queue the (medium importance) local DPC
+    behind any other DPCs already queued to this processor.
+
+Arguments:
+
+    Dpc - Unreferenced.
+
+    Context - Completion queue this DPC is for.
+
+    Unused1 - Unreferenced.
+
+    Unused2 - Unreferenced.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PRAID_COMPLETION_QUEUE Queue;
+    PSLIST_ENTRY Entry;
+    PSLIST_ENTRY Next;
+    PSLIST_ENTRY Batch;
+    PEXTENDED_REQUEST_BLOCK Xrb;
+    ULONG Count;
+
+    UNREFERENCED_PARAMETER (Dpc);
+    UNREFERENCED_PARAMETER (Unused1);
+    UNREFERENCED_PARAMETER (Unused2);
+
+    VERIFY_DISPATCH_LEVEL();
+
+    Queue = (PRAID_COMPLETION_QUEUE)Context;
+
+    //
+    // Take the whole list in one interlocked operation. The list is in
+    // LIFO order, so reverse it to complete requests in the order the
+    // miniport completed them.
+    //
+    
+    Entry = InterlockedFlushSList (&Queue->CompletedList);
+    Batch = NULL;
+
+    while (Entry != NULL) {
+        Next = Entry->Next;
+        Entry->Next = Batch;
+        Batch = Entry;
+        Entry = Next;
+    }
+
+    Count = 0;
+    
+    for (Entry = Batch; Entry != NULL; Entry = Next) {
+
+        //
+        // The completion routine may free or reuse the XRB, so pick up
+        // the next link first.
+        //
+        
+        Next = Entry->Next;
+        Xrb = CONTAINING_RECORD (Entry,
+                                 EXTENDED_REQUEST_BLOCK,
+                                 CompletedLink);
+        ASSERT_XRB (Xrb);
+        Xrb->CompletionRoutine (Xrb);
+        Count++;
+    }
+
+    Queue->DpcCount++;
+    Queue->Completions += Count;
+
+    if (Count > Queue->MaxBatch) {
+        Queue->MaxBatch = Count;
+    }
+}
+
+
+VOID
+RaidpAdapterCreateCompletionQueues(
+    IN PRAID_ADAPTER_EXTENSION Adapter
+    )
+/*++
+
+Routine Description:
+
+    Allocate and initialize a completion queue for each processor. Failure
+    is not fatal; completions then go through the adapter DPC.
+
+Arguments:
+
+    Adapter - Supplies the adapter to create completion queues for.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG Count;
+    ULONG i;
+    PRAID_COMPLETION_QUEUE Queues;
+    PRAID_COMPLETION_QUEUE Queue;
+
+    PAGED_CODE();
+
+    if (Adapter->CompletionQueues != NULL) {
+        return;
+    }
+
+    //
+    // There is nothing to gain from a single queue.
+    //
+    
+    Count = KeNumberProcessors;
+
+    if (Count == 1) {
+        return;
+    }
+    
+    Queues = RaidAllocatePool (NonPagedPool,
+                               Count * sizeof (RAID_COMPLETION_QUEUE),
+                               COMPLETION_QUEUE_TAG,
+                               Adapter->DeviceObject);
+
+    if (Queues == NULL) {
+        return;
+    }
+
+    RtlZeroMemory (Queues, Count * sizeof (RAID_COMPLETION_QUEUE));
+
+    for (i = 0; i < Count; i++) {
+
+        Queue = &Queues[i];
+        InitializeSListHead (&Queue->CompletedList);
+        Queue->Adapter = Adapter;
+        
+        KeInitializeDpc (&Queue->Dpc,
+                         RaidpAdapterCompletionQueueDpcRoutine,
+                         Queue);
+        KeSetTargetProcessorDpc (&Queue->Dpc, (CCHAR)i);
+
+        //
+        // A medium importance DPC queued to another processor may not run
+        // until that processor's next clock tick. Completions cannot wait
+        // that long, so remote completions use a high importance DPC.
+        //
+        
+        KeInitializeDpc (&Queue->RemoteDpc,
+                         RaidpAdapterCompletionQueueDpcRoutine,
+                         Queue);
+        KeSetTargetProcessorDpc (&Queue->RemoteDpc, (CCHAR)i);
+        KeSetImportanceDpc (&Queue->RemoteDpc, HighImportance);
+    }
+
+    Adapter->CompletionQueueCount = Count;
+    Adapter->CompletionQueues = Queues;
+}
+
+
+VOID
+RaidpAdapterDeleteCompletionQueues(
+    IN PRAID_ADAPTER_EXTENSION Adapter
+    )
+/*++
+
+Routine Description:
+
+    Free the per-processor completion queues, if any, for an adapter.
+
+Arguments:
+
+    Adapter - Supplies the adapter to free the completion queues for.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAGED_CODE();
+
+    if (Adapter->CompletionQueues == NULL) {
+        return;
+    }
+
+    //
+    // No requests are outstanding by the time the adapter is deleted,
+    // but a completion DPC may still be finishing on another processor.
+    //
+    
+    KeFlushQueuedDpcs ();
+
+    RaidFreePool (Adapter->CompletionQueues, COMPLETION_QUEUE_TAG);
+    Adapter->CompletionQueues = NULL;
+    Adapter->CompletionQueueCount = 0;
+}
+
+
 
 ULONG
 RaidpAdapterQueryBusNumber(
@@ -1480,6 +1698,8 @@ Return Value:
                      RaidCompletionDpcRoutine,
                      Adapter->DeviceObject);
 
+    RaidpAdapterCreateCompletionQueues (Adapter);
+
     KeInitializeDpc (&Adapter->ResetHoldDpc,
                      RaidResetHoldDpcRoutine,
                      Adapter->DeviceObject);
@@ -3174,6 +3394,8 @@ Return Value:
 {
     PSCSI_REQUEST_BLOCK Srb;
     PEXTENDED_REQUEST_BLOCK Next;
+    PRAID_COMPLETION_QUEUE Queue;
+    ULONG Processor;
 
     DbgLogRequest (LogMiniportCompletion,
                    Xrb->Irp,
@@ -3195,6 +3417,32 @@ Return Value:
         RaidSetIrpState (Xrb->Irp, RaidPendingCompletionIrp);
     }
     RaidSetXrbState (Xrb, XrbPendingCompletion);
+
+    //
+    // Queue the request to the completion queue of the processor that
+    // submitted it. KeInsertQueueDpc does nothing if the queue's DPC is
+    // already pending, so a burst of completions is handled by a single
+    // DPC.
+    //
+
+    if (Adapter->CompletionQueues != NULL) {
+
+        Processor = Xrb->SubmitProcessor;
+        ASSERT (Processor < Adapter->CompletionQueueCount);
+        Queue = &Adapter->CompletionQueues[Processor];
+
+        InterlockedPushEntrySList (&Queue->CompletedList,
+                                   &Xrb->CompletedLink);
+
+        if (Processor == KeGetCurrentProcessorNumber ()) {
+            KeInsertQueueDpc (&Queue->Dpc, NULL, NULL);
+        } else {
+            InterlockedIncrement (&Queue->RemoteCompletions);
+            KeInsertQueueDpc (&Queue->RemoteDpc, NULL, NULL);
+        }
+        
+        return;
+    }
     
     //
     // Put the request on the completing list.
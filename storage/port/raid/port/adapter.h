@@ -162,6 +162,62 @@ typedef struct _RAID_ADAPTER_PARAMETERS {
 
 } RAID_ADAPTER_PARAMETERS, *PRAID_ADAPTER_PARAMETERS;
 
+
+//
+// Per-processor completion queue. A completed XRB is queued to the
+// processor that submitted it and the queue's DPC, which is targeted at
+// that processor, completes everything on the queue in one pass.
+//
+
+typedef struct _RAID_COMPLETION_QUEUE {
+
+    //
+    // XRBs completed by the miniport that have not yet been processed.
+    //
+    // Protected by: Interlocked access.
+    //
+    
+    SLIST_HEADER CompletedList;
+
+    //
+    // DPCs targeted at the processor that owns this queue. Dpc is queued
+    // for completions on the owning processor. RemoteDpc is queued for
+    // completions on other processors, and is high importance so the
+    // owning processor is interrupted to run it.
+    //
+    
+    KDPC Dpc;
+    KDPC RemoteDpc;
+
+    //
+    // Adapter the queue belongs to.
+    //
+    
+    PRAID_ADAPTER_EXTENSION Adapter;
+
+    //
+    // Number of times the DPC has run and number of XRBs it has
+    // completed. Completions / DpcCount is the average batch size.
+    //
+    // Protected by: Only modified by the queue's DPC.
+    //
+    
+    ULONG DpcCount;
+    ULONG Completions;
+    ULONG MaxBatch;
+
+    //
+    // Number of XRBs that were completed by the miniport on a processor
+    // other than the one that submitted them, and had to be sent back
+    // to this queue.
+    //
+    // Protected by: Interlocked access.
+    //
+    
+    LONG RemoteCompletions;
+    
+} RAID_COMPLETION_QUEUE, *PRAID_COMPLETION_QUEUE;
+
     
 //
 // The adapter extension contains everything necessary about
@@ -350,6 +406,17 @@ typedef struct _RAID_ADAPTER_EXTENSION {
     
     SLIST_HEADER CompletedList;
 
+    //
+    // Per-processor completion queues, indexed by the processor an XRB
+    // was submitted on. If the queues could not be allocated, completed
+    // XRBs go to CompletedList and are processed by the adapter DPC.
+    //
+    // Protected by: Read only after the adapter is started.
+    //
+
+    PRAID_COMPLETION_QUEUE CompletionQueues;
+    ULONG CompletionQueueCount;
+
     //
     // Fields specific to PnP Device Removal.
     //
@@ -1063,6 +1130,24 @@ RaidpAdapterDpcRoutine(
     IN PVOID Context
     );
 
+VOID
+RaidpAdapterCreateCompletionQueues(
+    IN PRAID_ADAPTER_EXTENSION Adapter
+    );
+
+VOID
+RaidpAdapterDeleteCompletionQueues(
+    IN PRAID_ADAPTER_EXTENSION Adapter
+    );
+
+VOID
+RaidpAdapterCompletionQueueDpcRoutine(
+    IN PKDPC Dpc,
+    IN PVOID Context,
+    IN PVOID Unused1,
+    IN PVOID Unused2
+    );
+
 VOID
 RaidPauseTimerDpcRoutine(
     IN PKDPC Dpc,
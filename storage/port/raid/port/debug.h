@@ -98,6 +98,7 @@ StorDebugScsi(
 #define INQUIRY_TAG             ('21aR')    // Ra12
 #define MAPPED_ADDRESS_TAG      ('MAaR')    // RaAM
 #define CRASHDUMP_TAG           ('DCaR')    // RaCD
+#define COMPLETION_QUEUE_TAG    ('QCaR')    // RaCQ
 #define ID_TAG                  ('IDaR')    // RaDI
 #define DEFERRED_ITEM_TAG       ('fDaR')    // RaDf
 #define STRING_TAG              ('SDaR')    // RaDS
@@ -37,6 +37,21 @@ Operations:
                 queue but not be busy. This function "reinserts" elements
                 into the queue until either the queue is busy again or
                 the queue is empty.
+
+Ready Path:
+
+        Most requests arrive at a queue that is neither busy nor frozen
+        and has nothing pending, and most completions leave it in that
+        state. For these cases the queue does not acquire its spinlock:
+        the outstanding count is claimed or released with a single
+        compare-exchange against the ReadyState word, which also carries
+        the ready gate. Any operation that takes the spinlock closes the
+        gate for as long as the lock is held, and the gate stays closed
+        on release while entries are pending, the queue is busied or a
+        solitary request is waiting or outstanding. While the gate is
+        closed the outstanding count is owned by the lock holder, so the
+        locked paths below see exactly the state they always have.
+
 Author:
 
     Matthew D Hendel (math) 15-June-2000
@@ -45,7 +60,21 @@ Revision History:
 
 --*/
 
+#if !defined (UTEST)
 #include "precomp.h"
+#endif
+
+//
+// Bits of the ReadyGate field. The remaining bits are a sequence number
+// that is advanced every time the lock is released, so a ready path
+// compare-exchange cannot succeed against a stale snapshot (for
+// example, one taken before the depth was changed).
+//
+
+#define EXQ_GATE_LOCKED     (0x00000001)
+#define EXQ_GATE_CLOSED     (0x00000002)
+#define EXQ_GATE_FLAGS      (EXQ_GATE_LOCKED | EXQ_GATE_CLOSED)
+#define EXQ_GATE_SEQUENCE   (0x00000004)
 
 #if DBG
 VOID
@@ -310,6 +339,175 @@ NotifyCompleteItem(
 }
 
 
+LONGLONG
+INLINE
+RaidpExQueueReadReadyState(
+    IN PEXTENDED_DEVICE_QUEUE DeviceQueue
+    )
+{
+    //
+    // On 32-bit platforms this read may be torn. That is harmless: the
+    // snapshot is only ever used as the comperand of a compare-exchange,
+    // which will fail and be retried.
+    //
+    
+    return *((volatile LONGLONG *)&DeviceQueue->ReadyState);
+}
+
+BOOLEAN
+INLINE
+RaidpExQueueCompareExchangeReadyState(
+    IN PEXTENDED_DEVICE_QUEUE DeviceQueue,
+    IN PEXQ_READY_STATE NewState,
+    IN PEXQ_READY_STATE OldState
+    )
+{
+    LONGLONG Exchange;
+    LONGLONG Comperand;
+
+    Exchange = NewState->AsLongLong;
+    Comperand = OldState->AsLongLong;
+    
+    return (InterlockedCompareExchange64 (&DeviceQueue->ReadyState,
+                                          Exchange,
+                                          Comperand) == Comperand);
+}
+
+BOOLEAN
+INLINE
+IsReadyPathBlocked(
+    IN PEXTENDED_DEVICE_QUEUE DeviceQueue
+    )
+/*++
+
+Routine Description:
+
+    Check whether the current state of the queue requires that requests
+    be inserted and removed under the queue lock. Must be called with
+    the queue lock held.
+
+Arguments:
+
+    DeviceQueue - Supplies the device queue to check.
+
+Return Value:
+
+    TRUE - If the ready gate must stay closed.
+
+    FALSE - If the ready gate may be opened.
+
+--*/
+{
+    return (DeviceQueue->DeviceRequests != 0 ||
+            DeviceQueue->ByPassRequests != 0 ||
+            DeviceQueue->BusyCount != 0 ||
+            DeviceQueue->InternalFreezeCount != 0 ||
+            DeviceQueue->Flags.SolitaryReady ||
+            DeviceQueue->Flags.SolitaryOutstanding);
+}
+
+LOGICAL
+RaidpExQueueTryReadyInsert(
+    IN PEXTENDED_DEVICE_QUEUE DeviceQueue
+    )
+/*++
+
+Routine Description:
+
+    Attempt to claim an outstanding request slot without acquiring the
+    queue lock. This succeeds only when the ready gate is open, the queue
+    is not frozen and the outstanding count is below the queue depth;
+    i.e. exactly the case where the locked insert path would make the
+    request outstanding.
+
+Arguments:
+
+    DeviceQueue - Supplies the device queue to claim a slot on.
+
+Return Value:
+
+    TRUE - If a slot was claimed. The caller owns one count of
+            OutstandingRequests.
+
+    FALSE - If the request must go through the locked path.
+
+--*/
+{
+    EXQ_READY_STATE OldState;
+    EXQ_READY_STATE NewState;
+
+    for (;;) {
+
+        OldState.AsLongLong = RaidpExQueueReadReadyState (DeviceQueue);
+
+        if ((OldState.ReadyGate & EXQ_GATE_FLAGS) != 0 ||
+            IsDeviceQueueFrozen (DeviceQueue) ||
+            OldState.OutstandingRequests >= DeviceQueue->Depth) {
+
+            return FALSE;
+        }
+
+        NewState = OldState;
+        NewState.OutstandingRequests++;
+
+        if (RaidpExQueueCompareExchangeReadyState (DeviceQueue,
+                                                   &NewState,
+                                                   &OldState)) {
+            return TRUE;
+        }
+    }
+}
+
+LOGICAL
+RaidpExQueueTryReadyRemove(
+    IN PEXTENDED_DEVICE_QUEUE DeviceQueue
+    )
+/*++
+
+Routine Description:
+
+    Attempt to retire an outstanding request without acquiring the queue
+    lock. While the ready gate is open there are no pending device or
+    bypass entries, no busy count and no solitary request, so retiring
+    the outstanding request is the only thing RaidRemoveExDeviceQueue
+    could do.
+
+Arguments:
+
+    DeviceQueue - Supplies the device queue the request is retired from.
+
+Return Value:
+
+    TRUE - If the outstanding count was decremented.
+
+    FALSE - If the request must go through the locked path.
+
+--*/
+{
+    EXQ_READY_STATE OldState;
+    EXQ_READY_STATE NewState;
+
+    for (;;) {
+
+        OldState.AsLongLong = RaidpExQueueReadReadyState (DeviceQueue);
+
+        if ((OldState.ReadyGate & EXQ_GATE_FLAGS) != 0) {
+            return FALSE;
+        }
+
+        ASSERT (OldState.OutstandingRequests > 0);
+        NewState = OldState;
+        NewState.OutstandingRequests--;
+
+        if (RaidpExQueueCompareExchangeReadyState (DeviceQueue,
+                                                   &NewState,
+                                                   &OldState)) {
+            return TRUE;
+        }
+    }
+}
+
+
 VOID
 RaidInitializeExDeviceQueue(
     OUT PEXTENDED_DEVICE_QUEUE DeviceQueue,
@@ -412,13 +610,45 @@ Return Value:
     BOOLEAN Busy;
     LOGICAL ByPass;
     LOGICAL Solitary;
+    LOGICAL Claimed;
     KLOCK_QUEUE_HANDLE LockHandle;
     PEX_DEVICE_QUEUE_ENTRY Entry;
 
     Entry = (PEX_DEVICE_QUEUE_ENTRY)KEntry;
 
+    //
+    // Ready path: an ordinary request to a queue that is not busy, not
+    // frozen and has nothing pending can be made outstanding without
+    // taking the queue lock.
+    //
+
+    Claimed = FALSE;
+    
+    if (!TEST_FLAG (Flags, EXQ_BYPASS_REQUEST | EXQ_SOLITARY_REQUEST) &&
+        RaidpExQueueTryReadyInsert (DeviceQueue)) {
+
+        if (QuerySubmitItem (DeviceQueue)) {
+            Entry->Inserted = FALSE;
+            return FALSE;
+        }
+
+        Claimed = TRUE;
+    }
+    
     RaidAcquireExDeviceQueueSpinLock (DeviceQueue, &LockHandle);
 
+    //
+    // If the gateway refused a request that claimed a slot on the ready
+    // path, give the slot back and make the decision again under the
+    // lock. Asking the gateway again while holding the lock guarantees
+    // that if it is still busy, the restart it issues when it drains
+    // will find this entry on the queue.
+    //
+    
+    if (Claimed) {
+        DeviceQueue->OutstandingRequests--;
+    }
+
     //
     // If this is a solitary request we need to do some special processing.
     //
@@ -576,6 +806,18 @@ Return Value:
     BOOLEAN BusyFrozen;
     BOOLEAN Device;
     BOOLEAN ByPass;
+    EXQ_READY_STATE State;
+
+    //
+    // If the ready gate is open, both lists are empty and there is
+    // nothing to normalize.
+    //
+    
+    State.AsLongLong = RaidpExQueueReadReadyState (DeviceQueue);
+
+    if ((State.ReadyGate & EXQ_GATE_FLAGS) == 0) {
+        return NULL;
+    }
     
     RaidAcquireExDeviceQueueSpinLock (DeviceQueue, &LockHandle);
 
@@ -626,6 +868,7 @@ Return Value:
         //
     
     } else if (!BusyFrozen && !ByPass && Device &&
+               !DeviceQueue->Flags.SolitaryReady &&
                !DeviceQueue->Flags.SolitaryOutstanding) {
 
         //
@@ -682,7 +925,8 @@ Return Value:
         // There are no extra entries.
         //
 
-        ASSERT ((!BusyFrozen && !ByPass && !Device) || BusyFrozen);
+        ASSERT ((!BusyFrozen && !ByPass && !Device) || BusyFrozen ||
+                DeviceQueue->Flags.SolitaryReady);
         DeviceEntry = NULL;
     }
 
@@ -741,6 +985,17 @@ Return Value:
     ASSERT (RestartQueue != NULL);
     VERIFY_DISPATCH_LEVEL();
 
+    //
+    // With the ready gate open, the only possible action from the table
+    // above is to remove the outstanding request, which can be done
+    // without the lock.
+    //
+    
+    if (RaidpExQueueTryReadyRemove (DeviceQueue)) {
+        *RestartQueue = NotifyCompleteItem (DeviceQueue);
+        return NULL;
+    }
+
     RaidAcquireExDeviceQueueSpinLock (DeviceQueue, &LockHandle);
 
     
@@ -796,6 +1051,17 @@ Return Value:
         }
     }
 
+    //
+    // A solitary request at the head of the device queue must wait until
+    // it can be issued by itself, so the device queue is unavailable to
+    // this completion; the solitary request is issued above once the
+    // outstanding count drains to one.
+    //
+
+    if (DeviceQueue->Flags.SolitaryReady) {
+        Device = FALSE;
+    }
+
     if ( (!BusyFrozen && !ByPass && !Device) ||
          ( BusyFrozen && !ByPass && !Device) ||
          ( BusyFrozen && !ByPass &&  Device) ) {
@@ -1088,8 +1354,8 @@ Return Value:
     KLOCK_QUEUE_HANDLE LockHandle;
 
     //
-    // It would be nice to perform this using interlocked operations
-    // instead of holding a spinlock.
+    // Holding the lock also advances the ready gate sequence, so a ready
+    // path insert that sampled the old depth cannot complete.
     //
     
     RaidAcquireExDeviceQueueSpinLock (DeviceQueue, &LockHandle);
@@ -1185,7 +1451,9 @@ RaidAcquireExDeviceQueueSpinLock(
 
 Routine Description:
 
-    Acquire the device queue spinlock.
+    Acquire the device queue spinlock and close the ready gate. Once the
+    gate is closed no ready path insert or remove can modify the
+    outstanding count until the lock is released.
 
 Arguments:
 
@@ -1200,7 +1468,20 @@ Return Value:
 
 --*/
 {
+    LONG Gate;
+    
     KeAcquireInStackQueuedSpinLockAtDpcLevel (&DeviceQueue->Lock, LockHandle);
+
+    //
+    // Only the lock holder writes ReadyGate, so a plain read followed by
+    // an interlocked exchange is sufficient. The exchange fails any ready
+    // path compare-exchange that was built on the open gate.
+    //
+    
+    Gate = DeviceQueue->ReadyGate;
+    ASSERT (!(Gate & EXQ_GATE_LOCKED));
+    InterlockedExchange (&DeviceQueue->ReadyGate, Gate | EXQ_GATE_LOCKED);
+    
     ASSERT_EXQ (DeviceQueue);
 }
 
@@ -1213,7 +1494,8 @@ RaidReleaseExDeviceQueueSpinLock(
 
 Routine Description:
 
-    Release the device queue spinlock.
+    Release the device queue spinlock. The ready gate is reopened unless
+    the queue is left in a state that requires the locked path.
 
 Arguments:
 
@@ -1229,7 +1511,20 @@ Return Value:
 
 --*/
 {
+    ULONG Gate;
+    
     ASSERT_EXQ (DeviceQueue);
+
+    Gate = (ULONG)DeviceQueue->ReadyGate;
+    ASSERT (Gate & EXQ_GATE_LOCKED);
+    Gate = (Gate & ~EXQ_GATE_FLAGS) + EXQ_GATE_SEQUENCE;
+
+    if (IsReadyPathBlocked (DeviceQueue)) {
+        Gate |= EXQ_GATE_CLOSED;
+    }
+
+    InterlockedExchange (&DeviceQueue->ReadyGate, (LONG)Gate);
+    
     KeReleaseInStackQueuedSpinLockFromDpcLevel (LockHandle);
 }
 
@@ -1259,10 +1554,10 @@ Return Value:
     KLOCK_QUEUE_HANDLE LockHandle;
     LONG Count;
     
-    //
-    // It would be nice to perform this using interlocked operations
-    // instead of holding a spinlock.
-    //
+    if (RaidpExQueueTryReadyRemove (DeviceQueue)) {
+        NotifyCompleteItem (DeviceQueue);
+        return ;
+    }
 
     RaidAcquireExDeviceQueueSpinLock (DeviceQueue, &LockHandle);
 
@@ -48,7 +48,25 @@ typedef struct _EXTENDED_DEVICE_QUEUE {
     LIST_ENTRY ByPassListHead;
     KSPIN_LOCK Lock;
     LONG Depth;    
-    LONG OutstandingRequests;
+
+    //
+    // The outstanding request count and the ready gate share a single
+    // 64-bit word. While the gate is open, a request can be made
+    // outstanding (or retired) on the ready path with one compare-exchange
+    // of ReadyState, without acquiring Lock. The gate is closed whenever
+    // Lock is held and whenever the queue holds state the ready path cannot
+    // reason about: pending device or bypass entries, a busy count or a
+    // solitary request. See RaidpExQueueTryReadyInsert.
+    //
+    
+    union {
+        struct {
+            LONG OutstandingRequests;
+            LONG ReadyGate;
+        };
+        LONGLONG ReadyState;
+    };
+    
     LONG DeviceRequests;
     LONG ByPassRequests;
     LONG FreezeCount;
@@ -74,6 +92,18 @@ typedef struct _EXTENDED_DEVICE_QUEUE_PROPERTIES {
     SCHEDULING_ALGORITHM SchedulingAlgorithm;
 } EXTENDED_DEVICE_QUEUE_PROPERTIES, *PEXTENDED_DEVICE_QUEUE_PROPERTIES;
 
+//
+// Snapshot of the ReadyState word of an extended device queue.
+//
+
+typedef union _EXQ_READY_STATE {
+    struct {
+        LONG OutstandingRequests;
+        LONG ReadyGate;
+    };
+    LONGLONG AsLongLong;
+} EXQ_READY_STATE, *PEXQ_READY_STATE;
+
 //
 // Data types for exqueue callbacks.
 //
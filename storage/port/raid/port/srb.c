@@ -90,6 +90,7 @@ Environment:
     RtlZeroMemory (Xrb, sizeof (EXTENDED_REQUEST_BLOCK));
     Xrb->Signature = XRB_SIGNATURE;
     Xrb->Pool = XrbList;
+    Xrb->SubmitProcessor = KeGetCurrentProcessorNumber ();
 
     return Xrb;
 }
@@ -338,6 +339,7 @@ Environment:
     RtlZeroMemory (Xrb, sizeof (EXTENDED_REQUEST_BLOCK));
     Xrb->Signature = XRB_SIGNATURE;
     Xrb->Pool = Pool;
+    Xrb->SubmitProcessor = KeGetCurrentProcessorNumber ();
 }
 
 
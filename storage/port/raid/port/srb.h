@@ -202,6 +202,12 @@ typedef struct _EXTENDED_REQUEST_BLOCK {
     
     PRAID_UNIT_EXTENSION Unit;
 
+    //
+    // Processor the request was built on. The completion is processed
+    // on this processor's completion queue.
+    //
+    
+    ULONG SubmitProcessor;
 
     //
     // Scatter/gather list buffer.
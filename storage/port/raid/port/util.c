@@ -674,32 +674,6 @@ Return Value:
 // Implementation of the QUEUE_TAG_LIST object.
 //
 
-
-#if DBG
-VOID
-ASSERT_TAG_LIST(
-    IN PQUEUE_TAG_LIST TagList
-    )
-{
-    //
-    // The list lock should be held 
-    //
-    
-    if (TagList->OutstandingTags != RtlNumberOfSetBits (&TagList->BitMap)) {
-        DebugPrint (("OutstandingTags != NumberOfSetBits\n"));
-        DebugPrint (("Outstanding = %d, NumberOfSetBits = %d\n",
-                     TagList->OutstandingTags,
-                     RtlNumberOfSetBits (&TagList->BitMap)));
-        KdBreakPoint();
-    }
-}
-
-#else
-
-#define ASSERT_TAG_LIST(Arg)   (TRUE)
-
-#endif
-
 VOID
 RaCreateTagList(
     OUT PQUEUE_TAG_LIST TagList
@@ -721,9 +695,8 @@ Return Value:
 --*/
 {
     PAGED_CODE ();
-    
-    KeInitializeSpinLock (&TagList->Lock);
-    TagList->Buffer = NULL;
+
+    PortCreateTagAllocator (TagList);
 }
 
 VOID
@@ -733,12 +706,8 @@ RaDeleteTagList(
 {
 
     PAGED_CODE ();
-    
-    if (TagList->Buffer) {
-        RaidFreePool (TagList->Buffer, TAG_MAP_TAG);
-    }
 
-    DbgFillMemory (TagList, sizeof (*TagList), DBG_DEALLOCATED_FILL);
+    PortDeleteTagAllocator (TagList);
 }
     
 
@@ -761,36 +730,19 @@ Arguments:
     Count - Number of tags to allocate in the tag list. Elements will be
             allocated in the range 0 - Count - 1 inclusive.
 
+    DeviceObject - Unreferenced.
+
 Return Value:
 
     NTSTATUS code.
 
 --*/
 {
-    ULONG MapSize;
-
     PAGED_CODE ();
-    
-    MapSize = ((TagCount + 1) / 8) + 1;
-    MapSize = ALIGN_UP (MapSize, ULONG);
-
-    TagList->Buffer = RaidAllocatePool (NonPagedPool,
-                                        MapSize,
-                                        TAG_MAP_TAG,
-                                        DeviceObject);
-    if (TagList->Buffer == NULL) {
-        return STATUS_NO_MEMORY;
-    }
-    
-    TagList->Count = TagCount;
-    RtlInitializeBitMap (&TagList->BitMap, TagList->Buffer, TagCount);
-    RtlClearAllBits (&TagList->BitMap);
 
-    TagList->Hint = 0;
-    TagList->HighWaterMark = 0;
-    TagList->OutstandingTags = 0;
+    UNREFERENCED_PARAMETER (DeviceObject);
 
-    return STATUS_SUCCESS;
+    return PortInitializeTagAllocator (TagList, TagCount);
 }
 
 ULONG
@@ -816,27 +768,11 @@ Return Value:
 
 --*/
 {
-    ULONG AllocatedTag;
-    KLOCK_QUEUE_HANDLE LockHandle;
-    
-    KeAcquireInStackQueuedSpinLock (&TagList->Lock, &LockHandle);
-
-    ASSERT_TAG_LIST (TagList);
-
-    //
-    // If the bit is free, set it and return.
-    //
-    
-    if (!RtlTestBit (&TagList->BitMap, SpecificTag)) {
-        RtlSetBit (&TagList->BitMap, SpecificTag);
-        AllocatedTag = SpecificTag;
-        TagList->OutstandingTags++;
-    } else {
-        AllocatedTag = -1;
+    if (!PortAllocateSpecificTag (TagList, SpecificTag)) {
+        return -1;
     }
-    KeReleaseInStackQueuedSpinLock (&LockHandle);
 
-    return AllocatedTag;
+    return SpecificTag;
 }
     
 ULONG
@@ -849,6 +785,8 @@ Routine Description:
 
     Allocate a tag from the tag list and return it. Return -1 if no tag
     is available.
+
+    No lock is taken; see the port library's tag allocator.
     
 Arguments:
 
@@ -860,85 +798,13 @@ Return Value:
 
 --*/
 {
-    ULONG QueueTag;
-    KLOCK_QUEUE_HANDLE LockHandle;
-
-    KeAcquireInStackQueuedSpinLock (&TagList->Lock, &LockHandle);
-
-    //
-    // Verify that the tag list is consistent.
-    //
-    
-    ASSERT_TAG_LIST (TagList);
-    
-    //
-    // Find the first clear tag in the tag bitmap,
-    //
-
-    //
-    // NB: RAID 150434: when the bitmap is nearly full and the HintIndex
-    // is non-zero, RtlFindClearBitsXXX can fail incorrectly. Until this
-    // is resolved use a HintIndex of zero to work-around the bug.
-    //
-    
-    QueueTag = RtlFindClearBitsAndSet (&TagList->BitMap,
-                                       1,
-                                       TagList->Hint);
-
-#if DBG
-
-    //
-    // NB: Remove this test code when RtlFindClearBitsAndSet is working
-    // properly.
-    //
-
-    if (QueueTag == -1) {
-        ULONG i;
-        
-        KdBreakPoint();
-
-        QueueTag = RtlFindClearBits(&TagList->BitMap, 1, TagList->Hint);
-        QueueTag = RtlFindClearBits(&TagList->BitMap, 1, 0);
-
-        for (i = 0; i < TagList->Count; i++) {
-            ASSERT (RtlTestBit (&TagList->BitMap, i) == FALSE);
-        }
-    }
-
-#endif
-
     //
     // In the current STORPORT usage, we will never request a queue
-    // tag unless one is available (hence, QueueTag will never be
-    // -1). This conditional protects us if this assumption changes in
-    // the future.
+    // tag unless one is available (hence, the tag will never be
+    // PORT_INVALID_TAG).
     //
     
-    if (QueueTag != -1) {
-    
-        //
-        // The Hint value is the next point in the list where we should
-        // begin our search.
-        //
-
-        TagList->Hint = (QueueTag + 1) % TagList->Count;
-
-        //
-        // Update the number of outstanding tags, and, if we're above the
-        // highwater mark for the taglist, the maximum number of outstanding
-        // tags we had pending at one time.
-        //
-
-        TagList->OutstandingTags++;
-
-        if (TagList->OutstandingTags > TagList->HighWaterMark) {
-            TagList->HighWaterMark = TagList->OutstandingTags;
-        }
-    }
-
-    KeReleaseInStackQueuedSpinLock (&LockHandle);
-
-    return QueueTag;
+    return PortAllocateTag (TagList);
 }
 
 VOID
@@ -964,27 +830,7 @@ Return Value:
 
 --*/
 {
-    KLOCK_QUEUE_HANDLE LockHandle;
-    
-    KeAcquireInStackQueuedSpinLock (&TagList->Lock, &LockHandle);
-
-    //
-    // We should never attempt to free a tag that we haven't allocated.
-    //
-    
-    ASSERT (RtlTestBit (&TagList->BitMap, QueueTag));
-    RtlClearBit (&TagList->BitMap, QueueTag);
-
-    ASSERT (TagList->OutstandingTags != 0);
-    TagList->OutstandingTags--;
-
-    //
-    // Verify the tag list's consistency.
-    //
-    
-    ASSERT_TAG_LIST (TagList);
-
-    KeReleaseInStackQueuedSpinLock (&LockHandle);
+    PortFreeTag (TagList, QueueTag);
 }
 
 #if 0
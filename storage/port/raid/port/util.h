@@ -374,55 +374,11 @@ RaidFreeFixedPoolElement(
     );
 
 //
-// A list for managing entries in the tagged queue list.
+// A list for managing entries in the tagged queue list. Tags are allocated
+// from the port library's lock-free tag allocator.
 //
 
-typedef struct _QUEUE_TAG_LIST {
-
-    //
-    // Spinlock held while accessing the queue list.
-    //
-    
-    KSPIN_LOCK Lock;
-
-    //
-    // Number of elements in the list.
-    //
-    
-    ULONG Count;
-
-    //
-    // Hint to speed up tag allocation.
-    //
-    
-    ULONG Hint;
-
-    //
-    // BitMap to hold the tag values.
-    //
-    
-    RTL_BITMAP BitMap;
-
-    //
-    // BitMap Buffer.
-    //
-
-    PULONG Buffer;
-
-    //
-    // Number of outstanding tags. This could probably be DBG only.
-    //
-
-    ULONG OutstandingTags;
-
-    //
-    // The maximum number of tags that were outstanding at one time.
-    //
-
-    ULONG HighWaterMark;
-    
-    
-} QUEUE_TAG_LIST, *PQUEUE_TAG_LIST;
+typedef PORT_TAG_ALLOCATOR QUEUE_TAG_LIST, *PQUEUE_TAG_LIST;
 
 
 VOID
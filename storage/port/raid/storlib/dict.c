@@ -15,6 +15,15 @@ Abstract:
     and delete access to the elements in the table, assuming the table is
     relativly close in size to the number of elements in the table.
 
+    By default the table is an array of lists (chaining). Dictionaries
+    created with STOR_DICTIONARY_OPEN_ADDRESSING use an array of slots
+    with linear probing instead. Each slot holds the entry and the hash
+    of its key, so a lookup usually touches a single cache line of the
+    table and one entry. The slot array is a power of two in size; it is
+    doubled when it becomes 75% full and halved when it drops below 12%
+    full. Removal shifts later entries in the probe sequence back, so
+    the table never accumulates deleted markers.
+
 Author:
 
     Matthew D Hendel (math) 9-Feb-2001
@@ -37,6 +46,364 @@ Revision History:
 #define ExFreePool(Type) ExFreePoolWithTag (Type, DICT_TAG)
 #endif
 
+//
+// Smallest slot array used by an open-addressing dictionary, as a power
+// of two.
+//
+
+#define DICT_MIN_SHIFT      (3)
+
+//
+// Multiplier used to spread hash values over the slot array (2^32 divided
+// by the golden ratio). Many keys are small sequential integers, and the
+// default hash routine returns them unchanged.
+//
+
+#define DICT_HASH_MULTIPLIER    (0x9E3779B9)
+
+#define IsOpenDictionary(Dictionary)\
+    TEST_FLAG ((Dictionary)->Flags, STOR_DICTIONARY_OPEN_ADDRESSING)
+
+//
+// Open-addressing routines.
+//
+
+ULONG
+INLINE
+StorpOpenHomeSlot(
+    IN ULONG Hash,
+    IN ULONG Shift
+    )
+{
+    return ((Hash * DICT_HASH_MULTIPLIER) >> (32 - Shift));
+}
+
+ULONG
+StorpOpenShiftForCount(
+    IN ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Return log2 of the smallest power of two slot array that has at least
+    Count slots.
+
+--*/
+{
+    ULONG Shift;
+
+    Shift = DICT_MIN_SHIFT;
+    while (Shift < 31 && (1UL << Shift) < Count) {
+        Shift++;
+    }
+
+    return Shift;
+}
+
+BOOLEAN
+StorpOpenFindSlot(
+    IN PSTOR_DICTIONARY Dictionary,
+    IN PVOID Key,
+    IN ULONG Hash,
+    OUT PULONG SlotIndex
+    )
+/*++
+
+Routine Description:
+
+    Search an open-addressing dictionary for the entry with the specified
+    key.
+
+Arguments:
+
+    Dictionary - Supplies the dictionary to search.
+
+    Key - Supplies the key to search for.
+
+    Hash - Supplies the hash of Key.
+
+    SlotIndex - Returns the slot holding the entry if found, otherwise the
+        empty slot that ended the search.
+
+Return Value:
+
+    TRUE if the entry was found, FALSE otherwise.
+
+--*/
+{
+    ULONG Index;
+    ULONG Mask;
+    PSTOR_DICTIONARY_SLOT Slot;
+    STOR_DICTIONARY_GET_KEY_ROUTINE GetKeyRoutine;
+    STOR_DICTIONARY_COMPARE_KEY_ROUTINE CompareRoutine;
+
+    GetKeyRoutine = Dictionary->GetKeyRoutine;
+    CompareRoutine = Dictionary->CompareKeyRoutine;
+    Mask = Dictionary->MaxEntryCount - 1;
+    Index = StorpOpenHomeSlot (Hash, Dictionary->Shift);
+
+    //
+    // There is always at least one empty slot, so this terminates.
+    //
+    
+    for (;;) {
+        Slot = &Dictionary->Slots[Index];
+
+        if (Slot->Entry == NULL) {
+            *SlotIndex = Index;
+            return FALSE;
+        }
+
+        if (Slot->Hash == Hash &&
+            CompareRoutine (GetKeyRoutine (Slot->Entry), Key) == 0) {
+            *SlotIndex = Index;
+            return TRUE;
+        }
+
+        Index = (Index + 1) & Mask;
+    }
+}
+
+VOID
+StorpOpenPlaceEntry(
+    IN PSTOR_DICTIONARY_SLOT Slots,
+    IN ULONG Shift,
+    IN ULONG Hash,
+    IN PSTOR_DICTIONARY_ENTRY Entry
+    )
+/*++
+
+Routine Description:
+
+    Store an entry in the first empty slot of its probe sequence. The
+    caller has already checked the key is not in the table.
+
+--*/
+{
+    ULONG Index;
+    ULONG Mask;
+
+    Mask = (1UL << Shift) - 1;
+    Index = StorpOpenHomeSlot (Hash, Shift);
+
+    while (Slots[Index].Entry != NULL) {
+        Index = (Index + 1) & Mask;
+    }
+
+    Slots[Index].Hash = Hash;
+    Slots[Index].Entry = Entry;
+}
+
+NTSTATUS
+StorpOpenResize(
+    IN PSTOR_DICTIONARY Dictionary,
+    IN ULONG Shift
+    )
+/*++
+
+Routine Description:
+
+    Move the entries of an open-addressing dictionary to a new slot array
+    of 2^Shift slots.
+
+Arguments:
+
+    Dictionary - Supplies the dictionary to resize.
+
+    Shift - Supplies log2 of the new slot array size. The new array must
+        be large enough to hold all of the entries with at least one slot
+        left empty.
+
+Return Value:
+
+    NTSTATUS code. On failure the dictionary is unchanged.
+
+--*/
+{
+    ULONG i;
+    ULONG Count;
+    PSTOR_DICTIONARY_SLOT Slots;
+    PSTOR_DICTIONARY_SLOT OldSlots;
+
+    Count = 1UL << Shift;
+    ASSERT (Count > Dictionary->EntryCount);
+
+    Slots = ExAllocatePool (Dictionary->PoolType,
+                            Count * sizeof (STOR_DICTIONARY_SLOT));
+
+    if (Slots == NULL) {
+        return STATUS_NO_MEMORY;
+    }
+
+    RtlZeroMemory (Slots, Count * sizeof (STOR_DICTIONARY_SLOT));
+
+    OldSlots = Dictionary->Slots;
+
+    if (OldSlots != NULL) {
+        for (i = 0; i < Dictionary->MaxEntryCount; i++) {
+            if (OldSlots[i].Entry != NULL) {
+                StorpOpenPlaceEntry (Slots,
+                                     Shift,
+                                     OldSlots[i].Hash,
+                                     OldSlots[i].Entry);
+            }
+        }
+
+        ExFreePool (OldSlots);
+    }
+
+    Dictionary->Slots = Slots;
+    Dictionary->MaxEntryCount = Count;
+    Dictionary->Shift = Shift;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+StorpOpenInsert(
+    IN PSTOR_DICTIONARY Dictionary,
+    IN PSTOR_DICTIONARY_ENTRY Entry
+    )
+/*++
+
+Routine Description:
+
+    Insert an entry into an open-addressing dictionary, growing the slot
+    array first if it would be more than 75% full.
+
+Arguments:
+
+    Dictionary - Supplies the dictionary to insert into.
+
+    Entry - Supplies the entry to insert.
+
+Return Value:
+
+    NTSTATUS code.
+
+--*/
+{
+    NTSTATUS Status;
+    PVOID Key;
+    ULONG Hash;
+    ULONG Index;
+
+    Key = Dictionary->GetKeyRoutine (Entry);
+    Hash = Dictionary->HashKeyRoutine (Key);
+
+    if (StorpOpenFindSlot (Dictionary, Key, Hash, &Index)) {
+        return STATUS_DUPLICATE_OBJECTID;
+    }
+
+    if ((Dictionary->EntryCount + 1) * 4 > Dictionary->MaxEntryCount * 3) {
+
+        Status = StorpOpenResize (Dictionary, Dictionary->Shift + 1);
+
+        //
+        // If the table could not be grown, keep filling it as long as
+        // an empty slot will remain to terminate searches.
+        //
+        
+        if (!NT_SUCCESS (Status) &&
+            Dictionary->EntryCount + 1 >= Dictionary->MaxEntryCount) {
+            return Status;
+        }
+
+        if (NT_SUCCESS (Status)) {
+            StorpOpenPlaceEntry (Dictionary->Slots,
+                                 Dictionary->Shift,
+                                 Hash,
+                                 Entry);
+            Dictionary->EntryCount++;
+            return STATUS_SUCCESS;
+        }
+    }
+
+    //
+    // The search stopped at the first empty slot in the probe sequence,
+    // which is where the entry goes.
+    //
+    
+    Dictionary->Slots[Index].Hash = Hash;
+    Dictionary->Slots[Index].Entry = Entry;
+    Dictionary->EntryCount++;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+StorpOpenRemoveSlot(
+    IN PSTOR_DICTIONARY Dictionary,
+    IN ULONG Index
+    )
+/*++
+
+Routine Description:
+
+    Remove the entry in the specified slot of an open-addressing
+    dictionary.
+
+    Rather than leaving a deleted marker, entries later in the same run of
+    occupied slots are moved back into the hole whenever the hole lies
+    between their home slot and their current slot. This keeps every
+    entry reachable from its home slot without passing an empty slot.
+
+Arguments:
+
+    Dictionary - Supplies the dictionary.
+
+    Index - Supplies the slot to empty.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG Mask;
+    ULONG Next;
+    ULONG Home;
+    PSTOR_DICTIONARY_SLOT Slots;
+
+    Slots = Dictionary->Slots;
+    Mask = Dictionary->MaxEntryCount - 1;
+    Next = Index;
+
+    for (;;) {
+        Next = (Next + 1) & Mask;
+
+        if (Slots[Next].Entry == NULL) {
+            break;
+        }
+
+        Home = StorpOpenHomeSlot (Slots[Next].Hash, Dictionary->Shift);
+
+        //
+        // The entry in Next may move to Index unless its home slot lies
+        // cyclically in (Index, Next].
+        //
+        
+        if (((Next - Home) & Mask) >= ((Next - Index) & Mask)) {
+            Slots[Index] = Slots[Next];
+            Index = Next;
+        }
+    }
+
+    Slots[Index].Entry = NULL;
+    Slots[Index].Hash = 0;
+    Dictionary->EntryCount--;
+
+    //
+    // Shrink the table once it is less than 1/8 full. Failure is harmless.
+    //
+    
+    if (Dictionary->MaxEntryCount > Dictionary->MinEntryCount &&
+        Dictionary->EntryCount * 8 < Dictionary->MaxEntryCount) {
+        StorpOpenResize (Dictionary, Dictionary->Shift - 1);
+    }
+}
+
 
 NTSTATUS
 StorCreateDictionary(
@@ -49,6 +416,33 @@ StorCreateDictionary(
     )
 /*++
 
+Routine Description:
+
+    Initialize a chained dictionary object. See StorCreateDictionaryEx.
+
+--*/
+{
+    return StorCreateDictionaryEx (Dictionary,
+                                   EntryCount,
+                                   PoolType,
+                                   0,
+                                   GetKeyRoutine,
+                                   CompareKeyRoutine,
+                                   HashKeyRoutine);
+}
+
+NTSTATUS
+StorCreateDictionaryEx(
+    IN PSTOR_DICTIONARY Dictionary,
+    IN ULONG EntryCount,
+    IN POOL_TYPE PoolType,
+    IN ULONG Flags,
+    IN STOR_DICTIONARY_GET_KEY_ROUTINE GetKeyRoutine,
+    IN STOR_DICTIONARY_COMPARE_KEY_ROUTINE CompareKeyRoutine, OPTIONAL
+    IN STOR_DICTIONARY_HASH_KEY_ROUTINE HashKeyRoutine OPTIONAL
+    )
+/*++
+
 Routine Description:
 
     Initialize a dictionary object.
@@ -58,10 +452,18 @@ Arguments:
     Dictionary - Supplies the dictionary object to initialize.
 
     EntryCount - Supplies the initial number of empty slots in the dictioanry
-        table. This number can increase via a call to StorSetElementCount.
+        table. This number can increase via a call to StorAdjustDictionarySize.
+        For an open-addressing dictionary it is rounded up to a power of
+        two, and is also the smallest size the table will shrink to.
 
     PoolType - Pool type of memory to be used.
 
+    Flags - Supplies zero for a chained dictionary, or
+        STOR_DICTIONARY_OPEN_ADDRESSING for a dictionary that uses open
+        addressing and resizes itself.
+        Inserting into or removing from such a dictionary may allocate
+        or free pool, so it must be done at or below DISPATCH_LEVEL.
+
     GetKeyRoutine - User-supplied routine to get a key from a specific
         element.
 
@@ -81,10 +483,16 @@ Return Value:
 --*/
 {
     ULONG i;
+    ULONG Shift;
+    NTSTATUS Status;
     PLIST_ENTRY Entries;
 
     Dictionary->MaxEntryCount = EntryCount;
     Dictionary->EntryCount = 0;
+    Dictionary->Flags = Flags;
+    Dictionary->MinEntryCount = 0;
+    Dictionary->Shift = 0;
+    Dictionary->Entries = NULL;
     Dictionary->PoolType = PoolType;
     Dictionary->GetKeyRoutine = GetKeyRoutine;
 
@@ -100,6 +508,16 @@ Return Value:
         Dictionary->HashKeyRoutine = StorHashUlongKey;
     }
 
+    if (IsOpenDictionary (Dictionary)) {
+        Shift = StorpOpenShiftForCount (EntryCount);
+        Dictionary->MaxEntryCount = 0;
+        Status = StorpOpenResize (Dictionary, Shift);
+        if (NT_SUCCESS (Status)) {
+            Dictionary->MinEntryCount = Dictionary->MaxEntryCount;
+        }
+        return Status;
+    }
+
     Entries = ExAllocatePool (PoolType,
                               EntryCount * sizeof (LIST_ENTRY));
 
@@ -155,6 +573,7 @@ Return Value:
 
     ASSERT (Dictionary->Entries != NULL);
     ExFreePool (Dictionary->Entries);
+    Dictionary->Entries = NULL;
 
     return STATUS_SUCCESS;
 }
@@ -195,6 +614,10 @@ Return Value:
     GetKeyRoutine = Dictionary->GetKeyRoutine;
     CompareRoutine = Dictionary->CompareKeyRoutine;
     HashRoutine = Dictionary->HashKeyRoutine;
+
+    if (IsOpenDictionary (Dictionary)) {
+        return StorpOpenInsert (Dictionary, Entry);
+    }
     
     Index = (HashRoutine (GetKeyRoutine (Entry)) % Dictionary->MaxEntryCount);
     ListHead = &Dictionary->Entries[Index];
@@ -309,6 +732,23 @@ Return Value:
     GetKeyRoutine = Dictionary->GetKeyRoutine;
     CompareRoutine = Dictionary->CompareKeyRoutine;
     HashRoutine = Dictionary->HashKeyRoutine;
+
+    if (IsOpenDictionary (Dictionary)) {
+
+        if (StorpOpenFindSlot (Dictionary, Key, HashRoutine (Key), &Index)) {
+            Status = STATUS_SUCCESS;
+            NextEntry = Dictionary->Slots[Index].Entry;
+        } else {
+            Status = STATUS_NOT_FOUND;
+            NextEntry = NULL;
+        }
+
+        if (EntryBuffer) {
+            *EntryBuffer = NextEntry;
+        }
+
+        return Status;
+    }
     
     Index = HashRoutine (Key) % Dictionary->MaxEntryCount;
     ListHead = &Dictionary->Entries[Index];
@@ -394,8 +834,30 @@ Return Value:
 --*/
 {
     NTSTATUS Status;
+    ULONG Index;
     PSTOR_DICTIONARY_ENTRY Entry;
 
+    if (IsOpenDictionary (Dictionary)) {
+
+        Entry = NULL;
+        Status = STATUS_NOT_FOUND;
+        
+        if (StorpOpenFindSlot (Dictionary,
+                               Key,
+                               Dictionary->HashKeyRoutine (Key),
+                               &Index)) {
+            Entry = Dictionary->Slots[Index].Entry;
+            StorpOpenRemoveSlot (Dictionary, Index);
+            Status = STATUS_SUCCESS;
+        }
+
+        if (EntryBuffer) {
+            *EntryBuffer = Entry;
+        }
+
+        return Status;
+    }
+
     Entry = NULL;
     Status = StorFindDictionary (Dictionary, Key, &Entry);
 
@@ -429,6 +891,10 @@ Routine Description:
     takes about the same amount of time to adjust the dictionary size as
     it does to delete the dictionary and create a new one.
 
+    Open-addressing dictionaries size themselves. For them MaxEntryCount
+    is rounded up to a power of two and becomes the smallest size the
+    table will shrink to.
+
 Arguments:
 
     Dictionary - Supplies the dictionary whose size is to be adjusted.
@@ -451,7 +917,26 @@ Return Value:
     PLIST_ENTRY Entries;
     PLIST_ENTRY Head;
     PLIST_ENTRY Entry;
+    ULONG Shift;
+
+
+    if (IsOpenDictionary (Dictionary)) {
+
+        Shift = StorpOpenShiftForCount (MaxEntryCount);
+
+        while ((Dictionary->EntryCount + 1) * 4 > (1UL << Shift) * 3) {
+            Shift++;
+        }
+
+        Status = StorpOpenResize (Dictionary, Shift);
+
+        if (NT_SUCCESS (Status)) {
+            Shift = StorpOpenShiftForCount (MaxEntryCount);
+            Dictionary->MinEntryCount = 1UL << Shift;
+        }
 
+        return Status;
+    }
 
     OldEntries = Dictionary->Entries;
     OldMaxEntryCount = Dictionary->MaxEntryCount;
@@ -482,8 +967,11 @@ Return Value:
     Dictionary->MaxEntryCount = MaxEntryCount;
 
     //
-    // Remove all the old entries, placing them in the new dictioanry
+    // Remove all the old entries, placing them in the new dictioanry.
+    // StorInsertDictionary counts them again.
     //
+
+    Dictionary->EntryCount = 0;
     
     for (i = 0; i < OldMaxEntryCount; i++) {
         Head = &OldEntries[i];
@@ -494,7 +982,7 @@ Return Value:
         }
     }
 
-    ExFreePool (Entries);
+    ExFreePool (OldEntries);
 
     return STATUS_SUCCESS;
 }
@@ -539,6 +1027,19 @@ Return Value:
 
     REVIEW();
 
+    if (IsOpenDictionary (Dictionary)) {
+        for (i = 0; i < Dictionary->MaxEntryCount; i++) {
+            NextEntry = Dictionary->Slots[i].Entry;
+            if (NextEntry != NULL) {
+                Continue = Enumerator->EnumerateEntry (Enumerator, NextEntry);
+                if (!Continue) {
+                    return ;
+                }
+            }
+        }
+        return ;
+    }
+
     for (i = 0; i < Dictionary->MaxEntryCount; i++) {
         ListHead = &Dictionary->Entries[i];
         for (NextEntry = ListHead->Flink;
@@ -1,5 +1,4 @@
 
-
 #include <nt.h>
 #include <ntrtl.h>
 #include <nturtl.h>
@@ -10,8 +9,8 @@
 
 #define POOL_TYPE ULONG
 
-#include "defs.h"
-#include "dict.h"
+#include "sldefs.h"
+#include "sldict.h"
 
 
 typedef struct _TEST_ENTRY {
@@ -20,16 +19,88 @@ typedef struct _TEST_ENTRY {
     STOR_DICTIONARY_ENTRY Link;
 } TEST_ENTRY, *PTEST_ENTRY;
 
+typedef struct _TEST_ENUMERATOR {
+    STOR_DICTIONARY_ENUMERATOR Enumerator;
+    ULONG Count;
+} TEST_ENUMERATOR, *PTEST_ENUMERATOR;
+
+//
+// Load factors, in percent, used for the benchmarks. An open-addressing
+// dictionary grows before it reaches 75% full, so the higher loads only
+// apply to chained dictionaries; for open addressing they just set the
+// initial size of the table.
+//
+
+ULONG LoadFactors[] = { 25, 50, 75, 100, 200, 400 };
+
+#define BENCHMARK_ENTRIES       (16 * 1024)
+#define BENCHMARK_LOOKUPS       (4 * 1024 * 1024)
+
+//
+// Multiplying by an odd constant is a permutation of the 32-bit integers,
+// so this gives distinct, well scattered keys.
+//
+
+#define TEST_KEY(i) ((ULONG)((ULONG)(i) * 2654435761UL))
+
 PVOID
 WINAPI
 TestGetKey(
     IN PSTOR_DICTIONARY_ENTRY Entry
     )
 {
-    return (PVOID)(CONTAINING_RECORD (Entry, TEST_ENTRY, Link)->Key);
+    return (PVOID)(ULONG_PTR)(CONTAINING_RECORD (Entry, TEST_ENTRY, Link)->Key);
 }
 
-void __cdecl main()
+BOOLEAN
+TestEnumerateEntry(
+    IN PSTOR_DICTIONARY_ENUMERATOR Enumerator,
+    IN PLIST_ENTRY Entry
+    )
+{
+    PTEST_ENUMERATOR TestEnumerator;
+
+    UNREFERENCED_PARAMETER (Entry);
+
+    TestEnumerator = CONTAINING_RECORD (Enumerator,
+                                        TEST_ENUMERATOR,
+                                        Enumerator);
+    TestEnumerator->Count++;
+    return TRUE;
+}
+
+ULONG
+TestEnumerateCount(
+    IN PSTOR_DICTIONARY Dict
+    )
+{
+    TEST_ENUMERATOR Enumerator;
+
+    Enumerator.Enumerator.Context = NULL;
+    Enumerator.Enumerator.EnumerateEntry = TestEnumerateEntry;
+    Enumerator.Count = 0;
+
+    StorEnumerateDictionary (Dict, &Enumerator.Enumerator);
+
+    return Enumerator.Count;
+}
+
+PCSTR
+TestModeName(
+    IN ULONG Flags
+    )
+{
+    if (TEST_FLAG (Flags, STOR_DICTIONARY_OPEN_ADDRESSING)) {
+        return "open";
+    } else {
+        return "chained";
+    }
+}
+
+VOID
+TestDictionary(
+    IN ULONG Flags
+    )
 {
     STOR_DICTIONARY Dict;
     PTEST_ENTRY Entry;
@@ -37,12 +108,13 @@ void __cdecl main()
     NTSTATUS Status;
     PSTOR_DICTIONARY_ENTRY Link;
 
-    Status = StorCreateDictionary (&Dict,
-                                   1,
-                                   0,
-                                   TestGetKey,
-                                   NULL,
-                                   NULL);
+    Status = StorCreateDictionaryEx (&Dict,
+                                     1,
+                                     0,
+                                     Flags,
+                                     TestGetKey,
+                                     NULL,
+                                     NULL);
 
     if (!NT_SUCCESS (Status)) {
         printf ("Failed to create dictionary!\n");
@@ -53,7 +125,7 @@ void __cdecl main()
     // Insert 1000 elements, verifying they were successfully
     // inserted.
     //
-    
+
     for (i = 0; i < 1000; i++) {
         Entry = malloc (sizeof (TEST_ENTRY));
         RtlZeroMemory (Entry, sizeof (TEST_ENTRY));
@@ -61,15 +133,17 @@ void __cdecl main()
         Entry->Key = i;
         Status = StorInsertDictionary (&Dict, &Entry->Link);
         ASSERT (Status == STATUS_SUCCESS);
-        
+
         Status = StorFindDictionary (&Dict, (PVOID)i, NULL);
         ASSERT (Status == STATUS_SUCCESS);
     }
 
+    ASSERT (TestEnumerateCount (&Dict) == 1000);
+
     //
     // Test that they we cannot insert any more items with the same key.
     //
-    
+
     for (i = 0; i < 1000; i++) {
         Entry = malloc (sizeof (TEST_ENTRY));
         RtlZeroMemory (Entry, sizeof (TEST_ENTRY));
@@ -83,23 +157,242 @@ void __cdecl main()
     }
 
     //
-    // Remove all items, one at a time.
+    // Keys that were never inserted are not found.
+    //
+
+    for (i = 1000; i < 2000; i++) {
+        Status = StorFindDictionary (&Dict, (PVOID)i, &Link);
+        ASSERT (Status == STATUS_NOT_FOUND);
+    }
+
+    //
+    // Remove the odd items, then check the even ones are still there.
+    // For open addressing this exercises moving entries back over the
+    // removed ones.
+    //
+
+    for (i = 1; i < 1000; i += 2) {
+        Status = StorRemoveDictionary (&Dict, (PVOID)i, &Link);
+        ASSERT (Status == STATUS_SUCCESS);
+        Entry = CONTAINING_RECORD (Link, TEST_ENTRY, Link);
+        ASSERT (Entry->Key == (ULONG)i);
+        free (Entry);
+    }
+
+    for (i = 0; i < 1000; i++) {
+        Status = StorFindDictionary (&Dict, (PVOID)i, NULL);
+        ASSERT ((i % 2) == 0 ? NT_SUCCESS (Status) : !NT_SUCCESS (Status));
+    }
+
+    ASSERT (TestEnumerateCount (&Dict) == 500);
+
+    //
+    // Remove the remaining items, one at a time.
     //
-    
-    for (i = 999; i >= 0; i--) {
+
+    for (i = 998; i >= 0; i -= 2) {
 
         Status = StorRemoveDictionary (&Dict, (PVOID)i, &Link);
         ASSERT (Status == STATUS_SUCCESS);
         Entry = CONTAINING_RECORD (Link, TEST_ENTRY, Link);
-        ASSERT (Entry->Key == i);
+        ASSERT (Entry->Key == (ULONG)i);
         free (Entry);
     }
 
     //
-    // Verify that there are no more items.
+    // Verify that there are no more items, and that an open-addressing
+    // dictionary has shrunk back to its initial size.
     //
-    
+
     ASSERT (StorGetDictionaryCount (&Dict) == 0);
+    ASSERT (TestEnumerateCount (&Dict) == 0);
+
+    if (TEST_FLAG (Flags, STOR_DICTIONARY_OPEN_ADDRESSING)) {
+        ASSERT (StorGetDictionaryMaxCount (&Dict) == Dict.MinEntryCount);
+    }
+
+    Status = StorDeleteDictionary (&Dict);
+    ASSERT (NT_SUCCESS (Status));
+
+    printf ("%-8s dictionary tests passed\n", TestModeName (Flags));
+}
+
+double
+TestElapsedNs(
+    IN LARGE_INTEGER Start,
+    IN LARGE_INTEGER End,
+    IN LARGE_INTEGER Frequency,
+    IN ULONG Operations
+    )
+{
+    return ((double)(End.QuadPart - Start.QuadPart) * 1e9) /
+           ((double)Frequency.QuadPart * Operations);
 }
 
+VOID
+BenchmarkDictionary(
+    IN ULONG Flags,
+    IN ULONG LoadFactor,
+    IN PTEST_ENTRY Entries,
+    IN ULONG EntryCount,
+    IN ULONG Lookups
+    )
+/*++
+
+Routine Description:
 
+    Measure insert, successful lookup and failed lookup times for a
+    dictionary of EntryCount entries created with enough slots for the
+    specified load factor.
+
+--*/
+{
+    STOR_DICTIONARY Dict;
+    NTSTATUS Status;
+    ULONG i;
+    ULONG Found;
+    LARGE_INTEGER Frequency;
+    LARGE_INTEGER Start;
+    LARGE_INTEGER End;
+    double InsertNs;
+    double HitNs;
+    double MissNs;
+
+    QueryPerformanceFrequency (&Frequency);
+
+    Status = StorCreateDictionaryEx (&Dict,
+                                     (EntryCount * 100) / LoadFactor,
+                                     0,
+                                     Flags,
+                                     TestGetKey,
+                                     NULL,
+                                     NULL);
+
+    if (!NT_SUCCESS (Status)) {
+        printf ("Failed to create dictionary!\n");
+        exit (1);
+    }
+
+    QueryPerformanceCounter (&Start);
+    for (i = 0; i < EntryCount; i++) {
+        Status = StorInsertDictionary (&Dict, &Entries[i].Link);
+        ASSERT (NT_SUCCESS (Status));
+    }
+    QueryPerformanceCounter (&End);
+    InsertNs = TestElapsedNs (Start, End, Frequency, EntryCount);
+
+    //
+    // Look up existing keys in a different order from the one they were
+    // inserted in.
+    //
+
+    Found = 0;
+    QueryPerformanceCounter (&Start);
+    for (i = 0; i < Lookups; i++) {
+        Status = StorFindDictionary (&Dict,
+                                     (PVOID)(ULONG_PTR)TEST_KEY ((i * 7) % EntryCount),
+                                     NULL);
+        Found += NT_SUCCESS (Status);
+    }
+    QueryPerformanceCounter (&End);
+    HitNs = TestElapsedNs (Start, End, Frequency, Lookups);
+    ASSERT (Found == Lookups);
+
+    Found = 0;
+    QueryPerformanceCounter (&Start);
+    for (i = 0; i < Lookups; i++) {
+        Status = StorFindDictionary (&Dict,
+                                     (PVOID)(ULONG_PTR)TEST_KEY (EntryCount + i),
+                                     NULL);
+        Found += NT_SUCCESS (Status);
+    }
+    QueryPerformanceCounter (&End);
+    MissNs = TestElapsedNs (Start, End, Frequency, Lookups);
+    ASSERT (Found == 0);
+
+    printf ("%-8s %5d%%   %6d  %6d%%  %8.1f  %8.1f  %8.1f\n",
+            TestModeName (Flags),
+            LoadFactor,
+            StorGetDictionaryMaxCount (&Dict),
+            StorGetDictionaryFullness (&Dict),
+            InsertNs,
+            HitNs,
+            MissNs);
+
+    for (i = 0; i < EntryCount; i++) {
+        Status = StorRemoveDictionary (&Dict,
+                                       (PVOID)(ULONG_PTR)Entries[i].Key,
+                                       NULL);
+        ASSERT (NT_SUCCESS (Status));
+    }
+
+    StorDeleteDictionary (&Dict);
+}
+
+VOID
+Benchmark(
+    IN ULONG EntryCount,
+    IN ULONG Lookups
+    )
+{
+    PTEST_ENTRY Entries;
+    ULONG i;
+    ULONG j;
+
+    Entries = malloc (EntryCount * sizeof (TEST_ENTRY));
+
+    if (Entries == NULL) {
+        printf ("Failed to allocate entries!\n");
+        exit (1);
+    }
+
+    RtlZeroMemory (Entries, EntryCount * sizeof (TEST_ENTRY));
+
+    for (i = 0; i < EntryCount; i++) {
+        Entries[i].Key = TEST_KEY (i);
+    }
+
+    printf ("\n%d entries, %d lookups, times in ns per operation\n\n",
+            EntryCount,
+            Lookups);
+    printf ("mode      load    slots    full    insert       hit      miss\n");
+
+    for (i = 0; i < ARRAY_COUNT (LoadFactors); i++) {
+        for (j = 0; j < 2; j++) {
+            BenchmarkDictionary (j == 0 ? 0 : STOR_DICTIONARY_OPEN_ADDRESSING,
+                                 LoadFactors[i],
+                                 Entries,
+                                 EntryCount,
+                                 Lookups);
+        }
+    }
+
+    free (Entries);
+}
+
+void __cdecl main(int argc, char** argv)
+{
+    ULONG EntryCount;
+    ULONG Lookups;
+
+    EntryCount = BENCHMARK_ENTRIES;
+    Lookups = BENCHMARK_LOOKUPS;
+
+    if (argc > 1) {
+        EntryCount = atoi (argv[1]);
+    }
+
+    if (argc > 2) {
+        Lookups = atoi (argv[2]);
+    }
+
+    if (EntryCount == 0 || Lookups == 0) {
+        printf ("usage: tdict [entries [lookups]]\n");
+        exit (1);
+    }
+
+    TestDictionary (0);
+    TestDictionary (STOR_DICTIONARY_OPEN_ADDRESSING);
+
+    Benchmark (EntryCount, Lookups);
+}
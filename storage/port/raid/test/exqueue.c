@@ -1,3 +1,4 @@
 
 #include "raidport.h"
+#include "exqueue.h"
 #include "..\port\exqueue.c"
@@ -36,6 +36,127 @@ typedef struct _KDEVICE_QUEUE_ENTRY {
 		DebugBreak();										 \
 	} while (0)
 
+typedef struct _EX_DEVICE_QUEUE_ENTRY {
+    LIST_ENTRY DeviceListEntry;
+    ULONG SortKey;
+    BOOLEAN Inserted;
+    UCHAR State;
+    struct {
+        UCHAR Solitary : 1;
+        UCHAR reserved0 : 7;
+    };
+    UCHAR reserved1;
+} EX_DEVICE_QUEUE_ENTRY, *PEX_DEVICE_QUEUE_ENTRY;
+
+#define TEST_FLAG(Flags, Bit)	(((Flags) & (Bit)) != 0)
+#define VERIFY_DISPATCH_LEVEL()
+#define DebugWarn(arg)
+
+#if !defined (InterlockedCompareExchange64)
+#pragma intrinsic (_InterlockedCompareExchange64)
+#define InterlockedCompareExchange64 _InterlockedCompareExchange64
+#endif
+
+//
+// Minimal user-mode stand in for the storlib IO gateway. It keeps the
+// same high/low water behavior so the simulator exercises the gateway
+// refusal paths of the device queue.
+//
+
+typedef struct _STOR_IO_GATEWAY {
+	CRITICAL_SECTION Lock;
+	LONG HighWaterMark;
+	LONG LowWaterMark;
+	LONG Outstanding;
+	LONG BusyCount;
+	LONG PauseCount;
+} STOR_IO_GATEWAY, *PSTOR_IO_GATEWAY;
+
+VOID
+INLINE
+StorCreateIoGateway(
+	OUT PSTOR_IO_GATEWAY Gateway,
+	IN LONG HighWaterMark,
+	IN LONG LowWaterMark
+	)
+{
+	ZeroMemory (Gateway, sizeof (*Gateway));
+	InitializeCriticalSection (&Gateway->Lock);
+	Gateway->HighWaterMark = HighWaterMark;
+	Gateway->LowWaterMark = LowWaterMark;
+}
+
+BOOLEAN
+INLINE
+StorSubmitIoGatewayItem(
+	IN PSTOR_IO_GATEWAY Gateway
+	)
+{
+	BOOLEAN Ready;
+
+	EnterCriticalSection (&Gateway->Lock);
+
+	if (Gateway->BusyCount > 0 ||
+		Gateway->PauseCount > 0 ||
+		Gateway->Outstanding >= Gateway->HighWaterMark) {
+		Ready = FALSE;
+	} else {
+		Gateway->Outstanding++;
+		if (Gateway->Outstanding >= Gateway->HighWaterMark) {
+			Gateway->BusyCount = TRUE;
+		}
+		Ready = TRUE;
+	}
+
+	LeaveCriticalSection (&Gateway->Lock);
+
+	return Ready;
+}
+
+BOOLEAN
+INLINE
+StorRemoveIoGatewayItem(
+	IN PSTOR_IO_GATEWAY Gateway
+	)
+{
+	BOOLEAN Restart;
+
+	EnterCriticalSection (&Gateway->Lock);
+
+	Gateway->Outstanding--;
+	ASSERT (Gateway->Outstanding >= 0);
+
+	if (Gateway->BusyCount > 0 &&
+		Gateway->Outstanding <= Gateway->LowWaterMark) {
+		Gateway->BusyCount = FALSE;
+		Restart = TRUE;
+	} else {
+		Restart = FALSE;
+	}
+
+	LeaveCriticalSection (&Gateway->Lock);
+
+	return Restart;
+}
+
+BOOLEAN
+INLINE
+StorIsIoGatewayBusy(
+	IN PSTOR_IO_GATEWAY Gateway
+	)
+{
+	return (Gateway != NULL && Gateway->BusyCount >= 1);
+}
+
+BOOLEAN
+INLINE
+StorIsIoGatewayPaused(
+	IN PSTOR_IO_GATEWAY Gateway
+	)
+{
+	return (Gateway != NULL && Gateway->PauseCount > 0);
+}
+
 #endif
 
 
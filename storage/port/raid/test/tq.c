@@ -1,83 +1,141 @@
-
 //
-// Test/simulation program for the extended device queue
+// Stress and throughput test for the extended device queue.
+//
+// A set of producer threads submit items to a single device queue while
+// a set of completion ("DPC") threads retire started items, remove the
+// next entry from the queue and normalize it, the same way the unit IO
+// queue drives the device queue in the port driver. Optionally, a control
+// thread freezes and resumes the queue and changes its depth while the
+// test is running.
+//
+// The following invariants are checked for every item:
+//
+//     Depth - The number of started, uncompleted items never exceeds
+//             the depth of the queue.
+//
+//     Freeze - A non-bypass item submitted after the queue was frozen is
+//             not started until the queue has been resumed.
+//
+//     Solitary - A solitary item is only started when no other ordinary
+//             item is outstanding, and nothing but bypass items start
+//             while it is outstanding.
+//
+//     Order - With FIFO scheduling, an item leaves the device queue only
+//             after every item queued before it by the same producer.
+//
+//     Drain - Once the producers stop, every queued item is eventually
+//             started and completed (no lost restarts).
+//
+// Usage:
+//
+//     tq [-p producers] [-c dpcthreads] [-d depth] [-t seconds]
+//        [-g highwater] [-b bypassrate] [-o solitaryrate] [-s] [-x] [-q]
 //
 
 #include "raidport.h"
 #include "exqueue.h"
+#include <stdarg.h>
+#include <ctype.h>
+
+#define SECONDS (1000)
+#define MAX_REPORTED_VIOLATIONS (20)
 
-#define	SECONDS (1000)
+typedef struct _TQ_PRODUCER TQ_PRODUCER, *PTQ_PRODUCER;
 
 typedef struct _TQ_ITEM {
-	ULONG Thread;
-	ULONG64 Data;
-	ULONG64 Sequence;
+	PTQ_PRODUCER Producer;
+	ULONG Sequence;
+	LONG Generation;
+	BOOLEAN ByPass;
+	BOOLEAN Solitary;
+	volatile BOOLEAN InUse;
 	KDEVICE_QUEUE_ENTRY DeviceEntry;
 	LIST_ENTRY DpcEntry;
 } TQ_ITEM, *PTQ_ITEM;
 
+struct _TQ_PRODUCER {
+	ULONG Index;
+	HANDLE Thread;
+	HANDLE FreeCount;
+	CRITICAL_SECTION FreeLock;
+	LIST_ENTRY FreeList;
+	ULONG NextSequence;
+	ULONG PoolSize;
+	PTQ_ITEM Pool;
+	volatile LONG Submitted;
+};
 
 typedef struct _DPC_QUEUE {
 	HANDLE Available;
-	HANDLE Mutex;
+	CRITICAL_SECTION Lock;
 	LIST_ENTRY Queue;
 	ULONG Count;
 } DPC_QUEUE, *PDPC_QUEUE;
 
+//
+// Test parameters.
+//
+
+ULONG ProducerThreads = 8;
+ULONG DpcThreads = 2;
+ULONG Depth = 16;
+ULONG Duration = 10;
+ULONG HighWaterMark = 0;
+ULONG ByPassRate = 0;
+ULONG SolitaryRate = 0;
+SCHEDULING_ALGORITHM SchedulingAlgorithm = FifoScheduling;
+BOOL ChangeQueue = FALSE;
+BOOL CheckOrder = TRUE;
+
+//
+// Test state.
+//
 
-BOOL Verbose = FALSE;
-BOOL Cerbose = TRUE;
-DPC_QUEUE DpcQueue;
 EXTENDED_DEVICE_QUEUE DeviceQueue;
-BOOLEAN Pause = FALSE;
-BOOLEAN PauseProducer = FALSE;
-ULONG64 GlobalSequence = 0;
-DWORD Owner = 0;
-BOOL Available = FALSE;
+STOR_IO_GATEWAY Gateway;
+DPC_QUEUE DpcQueue;
+PTQ_PRODUCER Producers;
+volatile BOOL Stop = FALSE;
+volatile BOOL StopControl = FALSE;
+volatile LONG FreezeGeneration = 0;
+volatile LONG DepthLimit;
+volatile LONG InFlight = 0;
+volatile LONG OrderedInFlight = 0;
+volatile LONG MaxInFlight = 0;
+volatile LONG SolitaryActive = FALSE;
+volatile LONG Completed = 0;
+volatile LONG StartedFromQueue = 0;
+volatile LONG Violations = 0;
 
 
 VOID
-GetNext(
-	OUT PULONG64 Sequence,
-	OUT PULONG Data
+Violation(
+	IN PCSTR Format,
+	...
 	)
 {
-	*Sequence = ++GlobalSequence;
-	*Data = (ULONG)rand();
-}
+	va_list Args;
+	LONG Count;
 
-#pragma warning (disable:4715)
-
-BOOL
-WINAPI
-UpdateThread(
-	PVOID Unused
-	)
-{
-	for (;;) {
+	Count = InterlockedIncrement (&Violations);
 
-		while (Pause) {
-			Sleep (500);
-		}
-		
-		printf ("Seq: %I64d, dev %d bypass %d dpc %d                       \r",
-				 GlobalSequence,
-				 DeviceQueue.DeviceRequests,
-				 DeviceQueue.ByPassRequests,
-				 DpcQueue.Count);
-		Sleep (2000);
+	if (Count <= MAX_REPORTED_VIOLATIONS) {
+		va_start (Args, Format);
+		printf ("VIOLATION: ");
+		vprintf (Format, Args);
+		printf ("\n");
+		va_end (Args);
 	}
-
-	return FALSE;
 }
 
+
 VOID
 CreateDpcQueue(
 	PDPC_QUEUE DpcQueue
 	)
 {
-	DpcQueue->Available = CreateEvent (NULL, FALSE, FALSE, NULL);
-	DpcQueue->Mutex = CreateMutex (NULL, FALSE, NULL);
+	DpcQueue->Available = CreateSemaphore (NULL, 0, MAXLONG, NULL);
+	InitializeCriticalSection (&DpcQueue->Lock);
 	InitializeListHead (&DpcQueue->Queue);
 	DpcQueue->Count = 0;
 }
@@ -89,550 +147,583 @@ InsertDpcItem(
 	IN PLIST_ENTRY Entry
 	)
 {
-	WaitForSingleObject (DpcQueue->Mutex, INFINITE);
+	EnterCriticalSection (&DpcQueue->Lock);
 	InsertTailList (&DpcQueue->Queue, Entry);
 	DpcQueue->Count++;
-	Owner = GetCurrentThreadId ();
-	Available = TRUE;
-	SetEvent (DpcQueue->Available);
-	ReleaseMutex (DpcQueue->Mutex);
+	LeaveCriticalSection (&DpcQueue->Lock);
+	ReleaseSemaphore (DpcQueue->Available, 1, NULL);
 }
 
+
 PLIST_ENTRY
 RemoveDpcItem(
 	IN PDPC_QUEUE DpcQueue
 	)
 {
 	PLIST_ENTRY Entry;
-	HANDLE Tuple[2];
 
-	Tuple[0] = DpcQueue->Mutex;
-	Tuple[1] = DpcQueue->Available;
+	WaitForSingleObject (DpcQueue->Available, INFINITE);
 
-	WaitForMultipleObjects (2, Tuple, TRUE, INFINITE);
-	Available = FALSE;
-	Owner = GetCurrentThreadId ();
+	EnterCriticalSection (&DpcQueue->Lock);
 	ASSERT (!IsListEmpty (&DpcQueue->Queue));
 	Entry = RemoveHeadList (&DpcQueue->Queue);
 	DpcQueue->Count--;
-	if (!IsListEmpty (&DpcQueue->Queue)) {
-		Available = TRUE;
-		SetEvent (DpcQueue->Available);
-	}
-	ReleaseMutex (DpcQueue->Mutex);
+	LeaveCriticalSection (&DpcQueue->Lock);
 
 	return Entry;
 }
 
 
-BOOL
-WINAPI
-ProducerThread(
-	PVOID Unused
+VOID
+CheckQueueOrder(
+	IN PTQ_ITEM Item
 	)
+/*++
+
+Routine Description:
+
+	Verify that no earlier ordinary item of the same producer is still
+	sitting on the device queue when Item is removed from it. The queue
+	clears the Inserted field of an entry under its lock when the entry
+	is removed, so the check is free of races with respect to the
+	queue.
+
+--*/
 {
-	BOOLEAN Inserted;
-	PTQ_ITEM Item;
-	ULONG Data;
-	ULONG64 Sequence;
+	ULONG i;
+	PTQ_ITEM Other;
+	PTQ_PRODUCER Producer;
 
-	srand (GetCurrentThreadId());
-	
-	for (;;) {
+	Producer = Item->Producer;
 
-		Sleep (10);
+	for (i = 0; i < Producer->PoolSize; i++) {
 
-		while (Pause) {
-			Sleep (100);
-		}
+		Other = &Producer->Pool[i];
 
-		while (PauseProducer) {
-			Sleep (100);
+		if (Other == Item ||
+			!Other->DeviceEntry.Inserted ||
+			!Other->InUse ||
+			Other->ByPass) {
+			continue;
 		}
-			
-		Item = malloc (sizeof (TQ_ITEM));
-		ZeroMemory (Item, sizeof (*Item));
-		
-		GetNext (&Sequence, &Data);
-		Item->Thread = GetCurrentThreadId ();
-		Item->Sequence = Sequence;
-		Item->Data = Data;
 
-		Inserted = RaidInsertExDeviceQueue (&DeviceQueue,
-										    &Item->DeviceEntry,
-										    FALSE,
-											(ULONG)Item->Data);
+		if ((LONG)(Other->Sequence - Item->Sequence) < 0) {
+			Violation ("producer %d item %d left the queue before item %d",
+					   Producer->Index,
+					   Item->Sequence,
+					   Other->Sequence);
+		}
+	}
+}
 
-		if (!Inserted) {
 
-			if (Verbose) {
-				printf ("started %x.%I64d\n", Item->Thread, Item->Data);
-			}
+VOID
+StartItem(
+	IN PTQ_ITEM Item,
+	IN BOOLEAN FromQueue
+	)
+{
+	LONG Count;
+	LONG Max;
 
-			InsertDpcItem (&DpcQueue, &Item->DpcEntry);
+	if (FromQueue) {
+		InterlockedIncrement (&StartedFromQueue);
 
-		} else {
-			if (Verbose) {
-				printf ("queued %x.%I64d\n", Item->Thread, Item->Data);
-			}
+		if (CheckOrder &&
+			SchedulingAlgorithm == FifoScheduling &&
+			!Item->ByPass) {
+			CheckQueueOrder (Item);
 		}
 	}
 
-	return FALSE;
-}
+	//
+	// A non-bypass item that was submitted while the queue was frozen
+	// (odd generation) must not start until the generation changes,
+	// which happens just before the queue is resumed.
+	//
 
-BOOL
-WINAPI
-ProducerThread100(
-	PVOID Unused
-	)
-{
-	BOOLEAN Inserted;
-	PTQ_ITEM Item;
-	ULONG Data;
-	ULONG64 Sequence;
+	if (!Item->ByPass &&
+		(Item->Generation & 1) &&
+		Item->Generation == FreezeGeneration) {
 
-	srand (GetCurrentThreadId());
-	
-	for (;;) {
+		Violation ("producer %d item %d started while the queue was frozen",
+				   Item->Producer->Index,
+				   Item->Sequence);
+	}
 
-		Sleep (0);
+	if (!Item->ByPass) {
 
-		while (Pause) {
-			Sleep (100);
+		if (SolitaryActive) {
+			Violation ("producer %d item %d started while a solitary item "
+					   "was outstanding",
+					   Item->Producer->Index,
+					   Item->Sequence);
 		}
 
-		while (PauseProducer) {
-			Sleep (100);
+		if (Item->Solitary) {
+			if (OrderedInFlight != 0) {
+				Violation ("solitary item started with %d items outstanding",
+						   OrderedInFlight);
+			}
+			InterlockedExchange (&SolitaryActive, TRUE);
 		}
-			
-		Item = malloc (sizeof (TQ_ITEM));
-		ZeroMemory (Item, sizeof (*Item));
-		
-		GetNext (&Sequence, &Data);
-		Item->Thread = GetCurrentThreadId ();
-		Item->Sequence = Sequence;
-		Item->Data = 100;
 
-		Inserted = RaidInsertExDeviceQueue (&DeviceQueue,
-										    &Item->DeviceEntry,
-										    FALSE,
-											(ULONG)Item->Data);
+		InterlockedIncrement (&OrderedInFlight);
+	}
 
-		if (!Inserted) {
+	Count = InterlockedIncrement (&InFlight);
 
-			if (Verbose) {
-				printf ("started %x.%I64d\n", Item->Thread, Item->Data);
-			}
+	if (Count > DepthLimit) {
+		Violation ("%d items outstanding on a queue of depth %d",
+				   Count,
+				   DepthLimit);
+	}
 
-			InsertDpcItem (&DpcQueue, &Item->DpcEntry);
+	do {
+		Max = MaxInFlight;
+	} while (Count > Max &&
+			 InterlockedCompareExchange (&MaxInFlight, Count, Max) != Max);
 
-		} else {
-			if (Verbose) {
-				printf ("queued %x.%I64d\n", Item->Thread, Item->Data);
-			}
-		}
+	InsertDpcItem (&DpcQueue, &Item->DpcEntry);
+}
+
+
+VOID
+NormalizeQueue(
+	)
+{
+	PKDEVICE_QUEUE_ENTRY Entry;
+
+	for (Entry = RaidNormalizeExDeviceQueue (&DeviceQueue);
+		 Entry != NULL;
+		 Entry = RaidNormalizeExDeviceQueue (&DeviceQueue)) {
+
+		StartItem (CONTAINING_RECORD (Entry, TQ_ITEM, DeviceEntry), TRUE);
 	}
+}
+
+
+VOID
+FreeItem(
+	IN PTQ_ITEM Item
+	)
+{
+	PTQ_PRODUCER Producer;
 
-	return FALSE;
+	Producer = Item->Producer;
+	Item->InUse = FALSE;
+
+	EnterCriticalSection (&Producer->FreeLock);
+	InsertTailList (&Producer->FreeList, &Item->DpcEntry);
+	LeaveCriticalSection (&Producer->FreeLock);
+
+	ReleaseSemaphore (Producer->FreeCount, 1, NULL);
 }
 
-BOOL
+
+DWORD
 WINAPI
-ErrorProducerThread(
-	PVOID Unused
+ProducerThread(
+	PVOID Context
 	)
 {
-	BOOLEAN Inserted;
+	PTQ_PRODUCER Producer;
 	PTQ_ITEM Item;
-	ULONG64 Sequence;
-	ULONG Data;
+	PLIST_ENTRY NextEntry;
+	BOOLEAN Inserted;
+	ULONG Flags;
 
-	for (;;) {
+	Producer = (PTQ_PRODUCER)Context;
 
-		Sleep (500);
-		
-		while (Pause) {
-			Sleep (10);
-		}
-			
-		Item = malloc (sizeof (TQ_ITEM));
-		ZeroMemory (Item, sizeof (*Item));
-
-		GetNext (&Sequence, &Data);
-		Item->Thread = GetCurrentThreadId ();
-		Item->Sequence = Sequence;
-		Item->Data = Data;
-		
-		Inserted = RaidInsertExDeviceQueue (&DeviceQueue,
-										    &Item->DeviceEntry,
-										    TRUE,
-											(ULONG)Item->Data);
+	while (!Stop) {
 
-		if (!Inserted) {
+		if (WaitForSingleObject (Producer->FreeCount, 10) != WAIT_OBJECT_0) {
+			continue;
+		}
 
-			if (Verbose) {
-				printf ("started %x.%I64d\n", Item->Thread, Item->Data);
-			}
+		EnterCriticalSection (&Producer->FreeLock);
+		ASSERT (!IsListEmpty (&Producer->FreeList));
+		NextEntry = RemoveHeadList (&Producer->FreeList);
+		LeaveCriticalSection (&Producer->FreeLock);
+
+		Item = CONTAINING_RECORD (NextEntry, TQ_ITEM, DpcEntry);
+		ZeroMemory (&Item->DeviceEntry, sizeof (Item->DeviceEntry));
+
+		Item->Sequence = ++Producer->NextSequence;
+		Item->ByPass = (ByPassRate != 0 &&
+						(Item->Sequence % ByPassRate) == 0);
+		Item->Solitary = (!Item->ByPass && SolitaryRate != 0 &&
+						  (Item->Sequence % SolitaryRate) == 0);
+		Item->Generation = FreezeGeneration;
+		Item->InUse = TRUE;
+
+		Flags = 0;
+		if (Item->ByPass) {
+			Flags |= EXQ_BYPASS_REQUEST;
+		}
+		if (Item->Solitary) {
+			Flags |= EXQ_SOLITARY_REQUEST;
+		}
 
-			InsertDpcItem (&DpcQueue, &Item->DpcEntry);
+		Inserted = RaidInsertExDeviceQueue (&DeviceQueue,
+											&Item->DeviceEntry,
+											Flags,
+											Item->Sequence * 2654435761);
+		InterlockedIncrement (&Producer->Submitted);
 
-		} else {
-			if (Verbose) {
-				printf ("queued %x.%I64d\n", Item->Thread, Item->Data);
-			}
+		if (!Inserted) {
+			StartItem (Item, FALSE);
 		}
 	}
 
-	return FALSE;
+	return 0;
 }
 
+
 VOID
 DpcRoutine(
 	IN PTQ_ITEM Item
 	)
 {
 	BOOLEAN RestartQueue;
+	BOOLEAN RestartLun;
 	PKDEVICE_QUEUE_ENTRY Entry;
 
-	if (Verbose || Cerbose) {
-		printf ("completed %x.%I64d\n", Item->Thread, Item->Data);
+	if (!Item->ByPass) {
+		if (Item->Solitary) {
+			InterlockedExchange (&SolitaryActive, FALSE);
+		}
+		InterlockedDecrement (&OrderedInFlight);
 	}
+	InterlockedDecrement (&InFlight);
 
-	free (Item);
+	FreeItem (Item);
+	InterlockedIncrement (&Completed);
 
-	Entry = RaidRemoveExDeviceQueue (&DeviceQueue, &RestartQueue);
+	RestartQueue = FALSE;
+	RestartLun = FALSE;
+	Entry = RaidRemoveExDeviceQueue (&DeviceQueue,
+									 &RestartQueue,
+									 &RestartLun);
 
 	if (Entry) {
-		Item = CONTAINING_RECORD (Entry, TQ_ITEM, DeviceEntry);
-		InsertDpcItem (&DpcQueue, &Item->DpcEntry);
-		if (Verbose) {
-			printf ("dpc started %x.%I64d\n", Item->Thread, Item->Data);
-		}
-
-		//
-		// NB: in the port driver, we actually only do this when necessary.
-		// The only problem with doing this always is a speed issue, and
-		// we're not measuring speed in the simulation program.
-		//
-		
-		for (Entry = RaidNormalizeExDeviceQueue (&DeviceQueue);
-			 Entry != NULL;
-			 Entry = RaidNormalizeExDeviceQueue (&DeviceQueue)) {
-
-			Item = CONTAINING_RECORD (Entry, TQ_ITEM, DeviceEntry);
-			InsertDpcItem (&DpcQueue, &Item->DpcEntry);
-		}
-		
-		
+		StartItem (CONTAINING_RECORD (Entry, TQ_ITEM, DeviceEntry), TRUE);
 	}
+
+	//
+	// NB: the port driver only normalizes when the queue has changed or
+	// the gateway asks for a restart. Normalizing after every completion
+	// is cheap when nothing is queued, and keeps the simulation from
+	// depending on those notifications.
+	//
+
+	NormalizeQueue ();
 }
 
 
-BOOL
+DWORD
 WINAPI
 DpcThread(
 	PVOID Unused
 	)
 {
 	PLIST_ENTRY Entry;
-	PTQ_ITEM Item;
-
-#if 1
-	SetThreadPriority (GetCurrentThread (),
-					   THREAD_PRIORITY_ABOVE_NORMAL);
-#endif
 
 	for (;;) {
-
-		while (Pause) {
-			Sleep (10);
-		}
-
-		//
-		// Wait for DPC queue to have an item in it
-		//
-
 		Entry = RemoveDpcItem (&DpcQueue);
-		Item = CONTAINING_RECORD (Entry, TQ_ITEM, DpcEntry);
-
-		DpcRoutine (Item);
+		DpcRoutine (CONTAINING_RECORD (Entry, TQ_ITEM, DpcEntry));
 	}
 
-	return FALSE;
+	return 0;
 }
 
-enum {
-	NoControl = 0,
-	FreezeQueue,
-	ResumeQueue
-};
-
-volatile ULONG Control = NoControl;
 
-BOOL
+DWORD
 WINAPI
 ControlThread(
 	PVOID Unused
 	)
 {
-	for (;;) {
+	ULONG Iteration;
 
-		Sleep (500);
+	for (Iteration = 0; !StopControl; Iteration++) {
 
-		switch (Control) {
-			case FreezeQueue:
-				RaidFreezeExDeviceQueue (&DeviceQueue);
-				Control = NoControl;
-				break;
+		Sleep (20);
 
-			case ResumeQueue:
-				RaidResumeExDeviceQueue (&DeviceQueue);
-				Control = NoControl;
-				break;
+		if (Iteration & 1) {
 
-			case NoControl:
-				break;
+			//
+			// Freeze the queue for a short time. The generation is odd
+			// while the queue is frozen.
+			//
 
-			default:
-				ASSERT (FALSE);
-		}
-	}
+			RaidFreezeExDeviceQueue (&DeviceQueue);
+			InterlockedIncrement (&FreezeGeneration);
+			Sleep (5);
+			InterlockedIncrement (&FreezeGeneration);
+			RaidResumeExDeviceQueue (&DeviceQueue);
+			NormalizeQueue ();
 
-	return FALSE;
-}
-	
+		} else if (Depth > 1) {
 
-BOOL
-WINAPI
-ControlHandler(
-	DWORD Val
-	)
-{
-	PLIST_ENTRY NextEntry;
-	PTQ_ITEM Item;
-	int ch;
+			//
+			// Alternate between the full and half depth. Lowering the
+			// depth does not preempt outstanding items, so the depth
+			// check is made against the full depth.
+			//
 
-	if (Val != CTRL_C_EVENT) {
-		return FALSE;
+			if (DeviceQueue.Depth == (LONG)Depth) {
+				RaidSetExDeviceQueueDepth (&DeviceQueue, Depth / 2);
+			} else {
+				RaidSetExDeviceQueueDepth (&DeviceQueue, Depth);
+				NormalizeQueue ();
+			}
+		}
 	}
 
-	Pause = TRUE;
-	Sleep (1000);
-	printf ("\n");
-
-	do {
-		printf ("tq> ");
-		ch = getchar ();
-		printf (" %c\n", ch);
-
-		switch (tolower (ch)) {
+	RaidSetExDeviceQueueDepth (&DeviceQueue, Depth);
+	NormalizeQueue ();
 
-			case 'd':
+	return 0;
+}
 
-				printf ("Dump of DeviceQueue: %p\n", &DeviceQueue);
-				printf ("    Depth %d\n", DeviceQueue.Depth);
-				printf ("    Outstanding %d\n", DeviceQueue.OutstandingRequests);
-				printf ("    Device %d\n", DeviceQueue.DeviceRequests);
-				printf ("    ByPass %d\n", DeviceQueue.ByPassRequests);
-				printf ("    Frozen %d\n", DeviceQueue.Frozen);
-				break;
 
-			case 'l':
-				__try {
+VOID
+Usage(
+	)
+{
+	printf ("usage: tq [-p producers] [-c dpcthreads] [-d depth] [-t seconds]\n"
+			"          [-g highwater] [-b bypassrate] [-o solitaryrate]\n"
+			"          [-s] [-x] [-q]\n"
+			"\n"
+			"    -g  use an IO gateway with the specified high water mark\n"
+			"    -b  submit every Nth item as a bypass request\n"
+			"    -o  submit every Nth item as a solitary request (not with -b)\n"
+			"    -s  use C-SCAN instead of FIFO scheduling\n"
+			"    -x  freeze/resume and resize the queue while running\n"
+			"    -q  skip the per-item ordering check (throughput runs)\n");
+	exit (2);
+}
 
-					ULONG Count;
 
-					Count = 0;
-					for ( NextEntry  = DeviceQueue.DeviceListHead.Flink;
-						NextEntry != &DeviceQueue.DeviceListHead;
-						NextEntry = NextEntry->Flink ) {
-						Count++;
+VOID
+ParseArguments(
+	IN int argc,
+	IN char* argv[]
+	)
+{
+	int i;
 
-						Item = CONTAINING_RECORD (NextEntry, TQ_ITEM, DeviceEntry);
-						printf ("    item %d.%I64d [seq=%d]\n",
-								 Item->Thread,
-								 Item->Data,
-								 Item->Sequence);
-					}
+	for (i = 1; i < argc; i++) {
 
-					printf ("DeviceList: %d entries\n", Count);
-				}
+		if (argv[i][0] != '-' && argv[i][0] != '/') {
+			Usage ();
+		}
 
-				__except (EXCEPTION_EXECUTE_HANDLER) {
-					printf ("ERROR: Inconsistent device list!\n");
-				}
-				break;
+		switch (tolower (argv[i][1])) {
 
-			case 'r':
-				Control = ResumeQueue;
-				break;
+			case 's':
+				SchedulingAlgorithm = CScanScheduling;
+				continue;
 
-			case 'f':
-				Control = FreezeQueue;
-				break;
+			case 'x':
+				ChangeQueue = TRUE;
+				continue;
 
 			case 'q':
-				exit (0);
-				break;
-
-			case 'c':
-			case 'g':
-				break;
-
-			case 'p':
-				if (PauseProducer) {
-					printf ("unpausing producers\n");
-					PauseProducer = FALSE;
-				} else {
-					printf ("unpausing producers\n");
-					PauseProducer = TRUE;
-				}
-				break;
-
-			case 'v':
-				if (Verbose) {
-					Verbose = FALSE;
-					printf ("verbose mode off\n");
-				} else {
-					Verbose = TRUE;
-					printf ("verbose mode enabled\n");
-				}
-
-			case 'x': {
-				ULONG NewDepth;
-				printf ("depth> ");
-				scanf ("%d", &NewDepth);
-				RaidSetExDeviceQueueDepth (&DeviceQueue, NewDepth);
-				printf ("stack depth set to %d\n", NewDepth);
-				break;
-			}
+				CheckOrder = FALSE;
+				continue;
+		}
+
+		if (i + 1 >= argc) {
+			Usage ();
+		}
 
-			case '?':
-				printf ("    d - dump queue\n");
-				printf ("    f - freeze queue\n");
-				printf ("    r - resume queue\n");
-				printf ("    p - toggle pause of producer threads\n");
-				printf ("    u - resume producer threads\n");
-				printf ("    g - go\n");
-				printf ("    x - set stack depth to new value\n");
-				printf ("    v - toggle verbose mode\n");
-				printf ("    q - stop\n");
-				break;
-				
+		switch (tolower (argv[i][1])) {
+			case 'p': ProducerThreads = atoi (argv[++i]); break;
+			case 'c': DpcThreads = atoi (argv[++i]); break;
+			case 'd': Depth = atoi (argv[++i]); break;
+			case 't': Duration = atoi (argv[++i]); break;
+			case 'g': HighWaterMark = atoi (argv[++i]); break;
+			case 'b': ByPassRate = atoi (argv[++i]); break;
+			case 'o': SolitaryRate = atoi (argv[++i]); break;
 			default:
-				printf ("unrecognized operation '%c'\n", ch);
+				Usage ();
 		}
+	}
 
-	} while (ch != 'c' && ch != 'g');
-				
+	//
+	// NB: the queue lets a bypass request through while a solitary request
+	// is outstanding, so the two are not exercised together.
+	//
 
-	Pause = FALSE;
-	return TRUE;
+	if (ProducerThreads == 0 || DpcThreads == 0 || Depth == 0 ||
+		(ByPassRate != 0 && SolitaryRate != 0)) {
+		Usage ();
+	}
 }
 
 
-VOID
+int
 __cdecl
 main(
+	int argc,
+	char* argv[]
 	)
 {
-	DWORD ThreadId;
-	ULONG Depth;
-	ULONG ProducerThreads;
-	ULONG DpcThreads;
 	ULONG i;
-	SCHEDULING_ALGORITHM SchedulingAlgorithm;
-	RAID_ADAPTER_QUEUE AdapterQueue;
-	QUEUING_MODEL QueuingModel;
+	ULONG j;
+	LONG Submitted;
+	LONG LastCompleted;
+	ULONG Stalled;
+	HANDLE Control;
+	LARGE_INTEGER Frequency;
+	LARGE_INTEGER StartTime;
+	LARGE_INTEGER EndTime;
+	double Seconds;
+	EXTENDED_DEVICE_QUEUE_PROPERTIES Properties;
+
+	ParseArguments (argc, argv);
+
+	DepthLimit = Depth;
+
+	printf ("DeviceQueue Test: %s Depth %d Producers %d DPC Threads %d "
+			"Gateway %d ByPass 1/%d Solitary 1/%d%s\n",
+			 (SchedulingAlgorithm == FifoScheduling) ? "FIFO" : "CSCAN",
+			 Depth,
+			 ProducerThreads,
+			 DpcThreads,
+			 HighWaterMark,
+			 ByPassRate,
+			 SolitaryRate,
+			 ChangeQueue ? " Freeze/Resize" : "");
 
-	//
-	// Generic adapter queue.
-	// 
+	CreateDpcQueue (&DpcQueue);
 
-	QueuingModel.Algorithm = BackOffFullQueue;
-	QueuingModel.BackOff.HighWaterPercent = 120;
-	QueuingModel.BackOff.LowWaterPercent = 40;
+	if (HighWaterMark != 0) {
+		StorCreateIoGateway (&Gateway,
+							 HighWaterMark,
+							 max ((2 * HighWaterMark) / 5, 1));
+	}
+
+	RaidInitializeExDeviceQueue (&DeviceQueue,
+								 (HighWaterMark != 0) ? &Gateway : NULL,
+								 Depth,
+								 SchedulingAlgorithm);
 
-	RaidCreateAdapterQueue (&AdapterQueue, &QueuingModel);
-	
 	//
-	// NB: these should all be parameters
+	// Give each producer twice its share of the queue depth so the queue
+	// runs busy and the device list is exercised.
 	//
-	
-	Depth = 1;
-	ProducerThreads = 8;
-	DpcThreads = 1;
-	SchedulingAlgorithm = CScanScheduling;
 
-	printf ("DeviceQueue Test: Depth %d Producers %d DPC Threads %d\n",
-			 Depth,
-			 ProducerThreads,
-			 DpcThreads);
+	Producers = calloc (ProducerThreads, sizeof (TQ_PRODUCER));
 
-	if (Verbose) {
-		printf ("Verbose\n");
+	for (i = 0; i < ProducerThreads; i++) {
+
+		Producers[i].Index = i;
+		Producers[i].PoolSize = max ((2 * Depth) / ProducerThreads, 2);
+		Producers[i].Pool = calloc (Producers[i].PoolSize, sizeof (TQ_ITEM));
+		Producers[i].FreeCount = CreateSemaphore (NULL,
+												  Producers[i].PoolSize,
+												  MAXLONG,
+												  NULL);
+		InitializeCriticalSection (&Producers[i].FreeLock);
+		InitializeListHead (&Producers[i].FreeList);
+
+		for (j = 0; j < Producers[i].PoolSize; j++) {
+			Producers[i].Pool[j].Producer = &Producers[i];
+			InsertTailList (&Producers[i].FreeList,
+							&Producers[i].Pool[j].DpcEntry);
+		}
 	}
-	printf ("\n");
-	
-	CreateDpcQueue (&DpcQueue);
-	RaidInitializeExDeviceQueue (&DeviceQueue,
-								 &AdapterQueue,
-								 Depth,
-								 SchedulingAlgorithm);
 
-	SetConsoleCtrlHandler (ControlHandler, TRUE);
-	
 	for (i = 0; i < DpcThreads; i++) {
-		CreateThread (NULL,
-					  0,
-					  DpcThread,
-					  0,
-					  0,
-					  &ThreadId);
+		CreateThread (NULL, 0, DpcThread, NULL, 0, NULL);
 	}
-				  
+
+	QueryPerformanceFrequency (&Frequency);
+	QueryPerformanceCounter (&StartTime);
+
 	for (i = 0; i < ProducerThreads; i++) {
+		Producers[i].Thread = CreateThread (NULL,
+											0,
+											ProducerThread,
+											&Producers[i],
+											0,
+											NULL);
+	}
 
-		CreateThread (NULL,
-					  0,
-					  ProducerThread,
-					  0,
-					  0,
-					  &ThreadId);
+	Control = NULL;
+	if (ChangeQueue) {
+		Control = CreateThread (NULL, 0, ControlThread, NULL, 0, NULL);
 	}
 
-	CreateThread (NULL,
-				  0,
-				  ControlThread,
-				  0,
-				  0,
-				  &ThreadId);
-
-
-	CreateThread (NULL,
-				 0,
-				 ProducerThread100,
-				 0,
-				 0,
-				 &ThreadId);
-#if 0
-	CreateThread (NULL,
-				  0,
-				  ErrorProducerThread,
-				  0,
-				  0,
-				  &ThreadId);
-
-	CreateThread (NULL,
-				  0,
-				  UpdateThread,
-				  0,
-				  0,
-				  &ThreadId);
-				 
-#endif
-	Sleep (INFINITE);
-}
+	Sleep (Duration * SECONDS);
+
+	//
+	// Stop the producers and the control thread, then wait for everything
+	// that was submitted to complete. If no progress is made for a few
+	// seconds, entries have been stranded on the queue.
+	//
+
+	Stop = TRUE;
+	for (i = 0; i < ProducerThreads; i++) {
+		WaitForSingleObject (Producers[i].Thread, INFINITE);
+	}
+
+	if (Control != NULL) {
+		StopControl = TRUE;
+		WaitForSingleObject (Control, INFINITE);
+	}
+
+	QueryPerformanceCounter (&EndTime);
+
+	Submitted = 0;
+	for (i = 0; i < ProducerThreads; i++) {
+		Submitted += Producers[i].Submitted;
+	}
+
+	LastCompleted = -1;
+	for (Stalled = 0; Completed != Submitted && Stalled < 50; ) {
+		if (Completed == LastCompleted) {
+			Stalled++;
+		} else {
+			Stalled = 0;
+		}
+		LastCompleted = Completed;
+		Sleep (100);
+	}
+
+	if (Completed != Submitted) {
+		Violation ("queue did not drain: %d of %d items completed",
+				   Completed,
+				   Submitted);
+	}
 
+	RaidGetExDeviceQueueProperties (&DeviceQueue, &Properties);
 
+	if (Properties.OutstandingRequests != 0 ||
+		Properties.DeviceRequests != 0 ||
+		Properties.ByPassRequests != 0) {
+
+		Violation ("queue not empty: outstanding %d device %d bypass %d",
+				   Properties.OutstandingRequests,
+				   Properties.DeviceRequests,
+				   Properties.ByPassRequests);
+	}
+
+	Seconds = (double)(EndTime.QuadPart - StartTime.QuadPart) /
+			  (double)Frequency.QuadPart;
+
+	printf ("\n");
+	printf ("    Items completed     %d\n", Completed);
+	printf ("    Started from queue  %d (%.1f%%)\n",
+			StartedFromQueue,
+			Completed ? (100.0 * StartedFromQueue) / Completed : 0.0);
+	printf ("    Max outstanding     %d\n", MaxInFlight);
+	printf ("    Throughput          %.0f items/sec\n",
+			Seconds ? Completed / Seconds : 0.0);
+	printf ("    Violations          %d\n", Violations);
+
+	return (Violations == 0) ? 0 : 1;
+}
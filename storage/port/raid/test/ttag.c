@@ -0,0 +1,424 @@
+//
+// Allocate/free rate benchmark for the port library queue tag allocator.
+//
+// A set of threads, each bound to its own processor, allocate tags until
+// they hold a fixed number, then free them oldest first, the way queue
+// tags are held for the lifetime of an outstanding request. The same
+// workload is run against the tag allocator and against a spinlock
+// (critical section) protected RTL_BITMAP searched from a rotating hint,
+// which is how the port drivers allocated tags before.
+//
+// Every allocation is checked: a tag must not be handed to two threads
+// at once, and must be in range.
+//
+// Usage:
+//
+//     ttag [-p threads] [-n tags] [-h held] [-t seconds] [-a | -l]
+//
+
+#include "raidport.h"
+#include "porttag.h"
+#include <stdarg.h>
+#include <ctype.h>
+
+#define SECONDS (1000)
+#define MAX_REPORTED_VIOLATIONS (20)
+
+//
+// Kernel services used by the tag allocator.
+//
+
+#define PAGED_CODE()
+#define NonPagedPool (0)
+#define ExAllocatePoolWithTag(Type, Size, Tag) malloc (Size)
+#define ExFreePoolWithTag(Buffer, Tag) free (Buffer)
+#define KeNumberProcessors (TestProcessors)
+#define KeGetCurrentProcessorNumber() (TestProcessor)
+
+ULONG TestProcessors;
+__declspec(thread) ULONG TestProcessor;
+
+#include "..\..\lib\tagalloc.c"
+
+typedef enum _TEST_ALLOCATOR {
+	TagAllocator,
+	LockedBitmap
+} TEST_ALLOCATOR;
+
+typedef struct _TEST_THREAD {
+	ULONG Index;
+	HANDLE Thread;
+	PULONG Held;
+	volatile LONG Operations;
+	LONG Failures;
+} TEST_THREAD, *PTEST_THREAD;
+
+//
+// Test parameters.
+//
+
+ULONG Threads = 0;
+ULONG TagCount = 256;
+ULONG HeldPerThread = 0;
+ULONG Duration = 5;
+BOOL RunTagAllocator = TRUE;
+BOOL RunLockedBitmap = TRUE;
+
+//
+// Test state.
+//
+
+TEST_ALLOCATOR Allocator;
+PORT_TAG_ALLOCATOR Tags;
+CRITICAL_SECTION BitMapLock;
+RTL_BITMAP BitMap;
+ULONG BitMapBuffer [PORT_MAXIMUM_TAGS / 32];
+ULONG BitMapHint;
+volatile LONG Owner [PORT_MAXIMUM_TAGS];
+volatile BOOL Stop;
+volatile LONG Violations;
+
+
+VOID
+Violation(
+	IN PCSTR Format,
+	...
+	)
+{
+	va_list Args;
+	LONG Count;
+
+	Count = InterlockedIncrement (&Violations);
+
+	if (Count <= MAX_REPORTED_VIOLATIONS) {
+		va_start (Args, Format);
+		printf ("VIOLATION: ");
+		vprintf (Format, Args);
+		printf ("\n");
+		va_end (Args);
+	}
+}
+
+
+ULONG
+AllocateTag(
+	)
+{
+	ULONG Tag;
+
+	if (Allocator == TagAllocator) {
+		return PortAllocateTag (&Tags);
+	}
+
+	EnterCriticalSection (&BitMapLock);
+	Tag = RtlFindClearBitsAndSet (&BitMap, 1, BitMapHint);
+	if (Tag != -1) {
+		BitMapHint = (Tag + 1) % TagCount;
+	}
+	LeaveCriticalSection (&BitMapLock);
+
+	return Tag;
+}
+
+
+VOID
+FreeTag(
+	IN ULONG Tag
+	)
+{
+	if (Allocator == TagAllocator) {
+		PortFreeTag (&Tags, Tag);
+		return;
+	}
+
+	EnterCriticalSection (&BitMapLock);
+	RtlClearBits (&BitMap, Tag, 1);
+	LeaveCriticalSection (&BitMapLock);
+}
+
+
+DWORD
+WINAPI
+TestThread(
+	IN PVOID Context
+	)
+{
+	PTEST_THREAD Thread;
+	ULONG Count;
+	ULONG Tag;
+	ULONG i;
+	LONG Previous;
+
+	Thread = (PTEST_THREAD)Context;
+	TestProcessor = Thread->Index % TestProcessors;
+	SetThreadAffinityMask (GetCurrentThread (), 1 << TestProcessor);
+
+	while (!Stop) {
+
+		//
+		// Fill up to the number of tags this thread holds.
+		//
+
+		for (Count = 0; Count < HeldPerThread; Count++) {
+			Tag = AllocateTag ();
+			if (Tag == -1) {
+				Thread->Failures++;
+				break;
+			}
+
+			if (Tag >= TagCount) {
+				Violation ("thread %d got tag %d of %d",
+						   Thread->Index,
+						   Tag,
+						   TagCount);
+				break;
+			}
+
+			Previous = InterlockedExchange (&Owner[Tag], Thread->Index + 1);
+			if (Previous != 0) {
+				Violation ("tag %d given to thread %d while held by thread %d",
+						   Tag,
+						   Thread->Index,
+						   Previous - 1);
+			}
+
+			Thread->Held[Count] = Tag;
+		}
+
+		//
+		// And release them, oldest first.
+		//
+
+		for (i = 0; i < Count; i++) {
+			Tag = Thread->Held[i];
+			Previous = InterlockedExchange (&Owner[Tag], 0);
+			if (Previous != (LONG)Thread->Index + 1) {
+				Violation ("thread %d freed tag %d owned by thread %d",
+						   Thread->Index,
+						   Tag,
+						   Previous - 1);
+			}
+			FreeTag (Tag);
+		}
+
+		InterlockedExchangeAdd (&Thread->Operations, Count);
+	}
+
+	return 0;
+}
+
+
+VOID
+RunTest(
+	IN TEST_ALLOCATOR TestAllocator,
+	IN PCSTR Name
+	)
+{
+	PTEST_THREAD ThreadArray;
+	PHANDLE Handles;
+	LARGE_INTEGER Frequency;
+	LARGE_INTEGER StartTime;
+	LARGE_INTEGER EndTime;
+	LONGLONG Operations;
+	LONG Failures;
+	double Seconds;
+	NTSTATUS Status;
+	ULONG i;
+
+	Allocator = TestAllocator;
+	Stop = FALSE;
+	ZeroMemory ((PVOID)Owner, sizeof (Owner));
+
+	if (Allocator == TagAllocator) {
+		PortCreateTagAllocator (&Tags);
+		Status = PortInitializeTagAllocator (&Tags, TagCount);
+		if (!NT_SUCCESS (Status)) {
+			printf ("Failed to initialize tag allocator, %08x\n", Status);
+			exit (1);
+		}
+	} else {
+		InitializeCriticalSection (&BitMapLock);
+		RtlInitializeBitMap (&BitMap, BitMapBuffer, TagCount);
+		RtlClearAllBits (&BitMap);
+		BitMapHint = 0;
+	}
+
+	ThreadArray = malloc (Threads * sizeof (TEST_THREAD));
+	Handles = malloc (Threads * sizeof (HANDLE));
+	ZeroMemory (ThreadArray, Threads * sizeof (TEST_THREAD));
+
+	QueryPerformanceFrequency (&Frequency);
+	QueryPerformanceCounter (&StartTime);
+
+	for (i = 0; i < Threads; i++) {
+		ThreadArray[i].Index = i;
+		ThreadArray[i].Held = malloc (HeldPerThread * sizeof (ULONG));
+		ThreadArray[i].Thread = CreateThread (NULL,
+											  0,
+											  TestThread,
+											  &ThreadArray[i],
+											  0,
+											  NULL);
+		Handles[i] = ThreadArray[i].Thread;
+	}
+
+	Sleep (Duration * SECONDS);
+	Stop = TRUE;
+
+	WaitForMultipleObjects (Threads, Handles, TRUE, INFINITE);
+	QueryPerformanceCounter (&EndTime);
+
+	Operations = 0;
+	Failures = 0;
+
+	for (i = 0; i < Threads; i++) {
+		Operations += ThreadArray[i].Operations;
+		Failures += ThreadArray[i].Failures;
+		CloseHandle (ThreadArray[i].Thread);
+		free (ThreadArray[i].Held);
+	}
+
+	Seconds = (double)(EndTime.QuadPart - StartTime.QuadPart) /
+			  (double)Frequency.QuadPart;
+
+	//
+	// Everything must have been freed.
+	//
+
+	if (Allocator == TagAllocator) {
+		if (Tags.OutstandingTags != 0) {
+			Violation ("%d tags outstanding at end of test",
+					   Tags.OutstandingTags);
+		}
+		for (i = 0; i < TagCount; i++) {
+			if (!PortAllocateSpecificTag (&Tags, i)) {
+				Violation ("tag %d was not freed", i);
+			}
+		}
+		PortDeleteTagAllocator (&Tags);
+	} else {
+		if (RtlNumberOfSetBits (&BitMap) != 0) {
+			Violation ("%d tags outstanding at end of test",
+					   RtlNumberOfSetBits (&BitMap));
+		}
+		DeleteCriticalSection (&BitMapLock);
+	}
+
+	printf ("%-16s %10.0f allocate/free pairs per second, %d failed allocations\n",
+			Name,
+			(double)Operations / Seconds,
+			Failures);
+
+	free (Handles);
+	free (ThreadArray);
+}
+
+
+VOID
+Usage(
+	)
+{
+	printf ("usage: ttag [-p threads] [-n tags] [-h held] [-t seconds] [-a | -l]\n"
+			"\n"
+			"    -p  number of threads, one per processor by default\n"
+			"    -n  number of tags, at most %d (default 256)\n"
+			"    -h  tags each thread holds before freeing them\n"
+			"        (default: half the tags, shared between the threads)\n"
+			"    -t  seconds to run each allocator (default 5)\n"
+			"    -a  only run the tag allocator\n"
+			"    -l  only run the locked bitmap\n",
+			PORT_MAXIMUM_TAGS);
+	exit (2);
+}
+
+
+VOID
+ParseArguments(
+	IN int argc,
+	IN char* argv[]
+	)
+{
+	int i;
+
+	for (i = 1; i < argc; i++) {
+
+		if (argv[i][0] != '-' && argv[i][0] != '/') {
+			Usage ();
+		}
+
+		switch (tolower (argv[i][1])) {
+
+			case 'a':
+				RunLockedBitmap = FALSE;
+				continue;
+
+			case 'l':
+				RunTagAllocator = FALSE;
+				continue;
+		}
+
+		if (i + 1 >= argc) {
+			Usage ();
+		}
+
+		switch (tolower (argv[i][1])) {
+			case 'p': Threads = atoi (argv[++i]); break;
+			case 'n': TagCount = atoi (argv[++i]); break;
+			case 'h': HeldPerThread = atoi (argv[++i]); break;
+			case 't': Duration = atoi (argv[++i]); break;
+			default:
+				Usage ();
+		}
+	}
+
+	if (TagCount == 0 || TagCount > PORT_MAXIMUM_TAGS ||
+		(!RunTagAllocator && !RunLockedBitmap)) {
+		Usage ();
+	}
+}
+
+
+int
+__cdecl
+main(
+	int argc,
+	char* argv[]
+	)
+{
+	SYSTEM_INFO SystemInfo;
+
+	ParseArguments (argc, argv);
+
+	GetSystemInfo (&SystemInfo);
+	TestProcessors = SystemInfo.dwNumberOfProcessors;
+
+	if (Threads == 0) {
+		Threads = TestProcessors;
+	}
+
+	if (HeldPerThread == 0) {
+		HeldPerThread = max (1, TagCount / (2 * Threads));
+	}
+
+	printf ("%d threads, %d processors, %d tags, %d held per thread, %d seconds\n",
+			Threads,
+			TestProcessors,
+			TagCount,
+			HeldPerThread,
+			Duration);
+
+	if (RunTagAllocator) {
+		RunTest (TagAllocator, "tag allocator");
+	}
+
+	if (RunLockedBitmap) {
+		RunTest (LockedBitmap, "locked bitmap");
+	}
+
+	if (Violations != 0) {
+		printf ("FAILED: %d violations\n", Violations);
+		return 1;
+	}
+
+	return 0;
+}
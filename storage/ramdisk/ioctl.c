@@ -278,8 +278,8 @@ Return Value:
                     queryOutput->Options = diskExtension->Options;
                     queryOutput->DiskLength = diskExtension->DiskLength;
                     queryOutput->DiskOffset = diskExtension->DiskOffset;
-                    queryOutput->ViewCount = diskExtension->ViewCount;
-                    queryOutput->ViewLength = diskExtension->ViewLength;
+                    queryOutput->ViewCount = diskExtension->ViewCache.ViewCount;
+                    queryOutput->ViewLength = diskExtension->ViewCache.ViewLength;
 
                     if ( diskExtension->DiskType == RAMDISK_TYPE_BOOT_DISK ) {
 
@@ -698,12 +698,12 @@ Return Value:
             } else {
 
                 //
-                // If the RAM disk is file-backed, we must send this off to
+                // If the RAM disk has a backing file, we must send this off to
                 // the thread for processing, because it requires reading
                 // from the disk image.
                 //
 
-                if ( !RAMDISK_IS_FILE_BACKED(diskExtension->DiskType) ) {
+                if ( !RAMDISK_USES_VIEWS(diskExtension) ) {
     
                     status = RamdiskGetDriveLayout( Irp, diskExtension );
                     info = Irp->IoStatus.Information;
@@ -728,12 +728,12 @@ Return Value:
             } else {
     
                 //
-                // If the RAM disk is file-backed, we must send this off to
+                // If the RAM disk has a backing file, we must send this off to
                 // the thread for processing, because it requires reading
                 // from the disk image.
                 //
 
-                if ( !RAMDISK_IS_FILE_BACKED(diskExtension->DiskType) ) {
+                if ( !RAMDISK_USES_VIEWS(diskExtension) ) {
     
                     status = RamdiskGetPartitionInfo( Irp, diskExtension );
                     info = Irp->IoStatus.Information;
@@ -819,12 +819,12 @@ Return Value:
             } else {
     
                 //
-                // If the RAM disk is file-backed, we must send this off to
+                // If the RAM disk has a backing file, we must send this off to
                 // the thread for processing, because it requires writing
                 // to the disk image.
                 //
 
-                if ( !RAMDISK_IS_FILE_BACKED(diskExtension->DiskType) ) {
+                if ( !RAMDISK_USES_VIEWS(diskExtension) ) {
     
                     status = RamdiskSetPartitionInfo( Irp, diskExtension );
                     info = Irp->IoStatus.Information;
@@ -1343,7 +1343,10 @@ Return Value:
     IO_STATUS_BLOCK iosb;
     UNICODE_STRING dosSymLink;
     FILE_STANDARD_INFORMATION fileInfo;
-    PVIEW viewDescriptors = NULL;
+    PVOID viewCacheBuffer = NULL;
+    PVOID chunkDirectory;
+    ULONG minimumViewCount;
+    ULONG maximumViewCount;
     HRESULT result;
 
 #if SUPPORT_DISK_NUMBERS
@@ -1363,7 +1366,10 @@ Return Value:
     fileHandle = NULL;
     sectionHandle = NULL;
     sectionObject = NULL;
-    viewDescriptors = NULL;
+    viewCacheBuffer = NULL;
+    chunkDirectory = NULL;
+    minimumViewCount = 0;
+    maximumViewCount = 0;
     guidString.Buffer = NULL;
     realDeviceName.Buffer = NULL;
     dosSymLink.Buffer = NULL;
@@ -1411,7 +1417,67 @@ Return Value:
     basePage = 0;
     baseAddress = NULL;
 
-    if ( RAMDISK_IS_FILE_BACKED(CreateInput->DiskType) ) {
+    if ( RAMDISK_IS_FILE_BACKED(CreateInput->DiskType) &&
+         (CreateInput->FileName[0] == 0) ) {
+
+        //
+        // This is a memory-backed RAM disk: a file-backed disk or volume
+        // without a backing file. Its image is kept in nonpaged memory, so
+        // the caller must be allowed to lock memory.
+        //
+
+        if ( AccessCheckOnly &&
+             !SeSinglePrivilegeCheck( SeExports->SeLockMemoryPrivilege, UserMode ) ) {
+
+            DBGPRINT( DBG_IOCTL, DBG_ERROR,
+                        ("%s", "RamdiskCreateDiskDevice: caller can't lock memory\n") );
+
+            status = STATUS_PRIVILEGE_NOT_HELD;
+            goto exit;
+        }
+
+        //
+        // The image starts at the start of the memory store. The chunk
+        // directory must be addressable.
+        //
+
+        if ( (CreateInput->DiskLength == 0) ||
+             (CreateInput->DiskOffset != 0) ||
+             ((CreateInput->DiskLength >> MEMORY_STORE_CHUNK_SHIFT) >=
+                                                (MAXULONG / sizeof(PVOID))) ) {
+
+            DBGPRINT( DBG_IOCTL, DBG_ERROR,
+                        ("RamdiskCreateDiskDevice: bad length or offset for memory-backed disk:"
+                         " 0x%x + 0x%I64x\n",
+                         CreateInput->DiskOffset, CreateInput->DiskLength) );
+
+            status = STATUS_INVALID_PARAMETER;
+            goto exit;
+        }
+
+        if ( !AccessCheckOnly ) {
+
+            //
+            // Allocate the chunk directory. The chunks themselves are
+            // allocated as they are written.
+            //
+
+            chunkDirectory = ALLOCATE_POOL(
+                                NonPagedPool,
+                                RamdiskMemoryStoreAllocationSize( CreateInput->DiskLength ),
+                                TRUE );
+
+            if ( chunkDirectory == NULL ) {
+
+                DBGPRINT( DBG_IOCTL, DBG_ERROR,
+                            ("%s", "RamdiskCreateDiskDevice: Can't allocate pool for chunk directory\n") );
+
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                goto exit;
+            }
+        }
+
+    } else if ( RAMDISK_IS_FILE_BACKED(CreateInput->DiskType) ) {
 
         //
         // This is a file-backed RAM disk. Open the backing file. Note that
@@ -1645,12 +1711,33 @@ Return Value:
             }
         }
             
-        viewDescriptors = ALLOCATE_POOL(
+        //
+        // The view count is only the starting point. The view cache grows
+        // the pool when the hit rate is low and shrinks it when views go
+        // unused, between the configured minimum and as many views as fit
+        // in the maximum per-disk view length (but never more than the
+        // configured maximum).
+        //
+
+        minimumViewCount = MinimumViewCount;
+        if ( minimumViewCount > CreateInput->ViewCount ) {
+            minimumViewCount = CreateInput->ViewCount;
+        }
+
+        maximumViewCount = MaximumPerDiskViewLength / CreateInput->ViewLength;
+        if ( maximumViewCount > MaximumViewCount ) {
+            maximumViewCount = MaximumViewCount;
+        }
+        if ( maximumViewCount < CreateInput->ViewCount ) {
+            maximumViewCount = CreateInput->ViewCount;
+        }
+
+        viewCacheBuffer = ALLOCATE_POOL(
                             PagedPool,
-                            CreateInput->ViewCount * sizeof(VIEW),
+                            RamdiskViewCacheAllocationSize( maximumViewCount ),
                             TRUE );
 
-        if ( viewDescriptors == NULL ) {
+        if ( viewCacheBuffer == NULL ) {
 
             DBGPRINT( DBG_IOCTL, DBG_ERROR,
                         ("%s", "RamdiskCreateDiskDevice: Can't allocate pool for view descriptors\n") );
@@ -1659,8 +1746,6 @@ Return Value:
             goto exit;
         }
 
-        RtlZeroMemory( viewDescriptors, CreateInput->ViewCount * sizeof(VIEW) );
-
     } else if ( CreateInput->DiskType == RAMDISK_TYPE_BOOT_DISK ) {
 
         //
@@ -1727,7 +1812,8 @@ Return Value:
         goto exit;
     }
 
-    ASSERT( (basePage != 0) || (sectionObject != NULL) || (baseAddress != NULL) );
+    ASSERT( (basePage != 0) || (sectionObject != NULL) || (baseAddress != NULL) ||
+            (chunkDirectory != NULL) );
 
     //
     // Create a name for the disk, based on the disk GUID. For all disk types
@@ -1993,43 +2079,42 @@ Return Value:
     // replacement algorithm will keep the first sector mapped when necessary.
     //
 
-    if ( viewDescriptors != NULL ) {
-
-        PVIEW view;
+    if ( viewCacheBuffer != NULL ) {
 
         //
-        // Initialize windowing fields in the disk extension.
+        // Initialize the view cache. Every view starts out unmapped.
         //
 
-        diskExtension->ViewCount = CreateInput->ViewCount;
-        diskExtension->ViewLength = CreateInput->ViewLength;
-        diskExtension->ViewDescriptors = viewDescriptors;
-        KeInitializeSemaphore( &diskExtension->ViewSemaphore, 0, MAXLONG );
-        diskExtension->ViewWaiterCount = 0;
-
-        //
-        // Initialize the view lists, then insert in each view descriptor
-        // in order. The result is a list of descriptors, each unmapped
-        // (offset and length both 0).
-        //
-
-        InitializeListHead( &diskExtension->ViewsByOffset );
-        InitializeListHead( &diskExtension->ViewsByMru );
-
-        view = viewDescriptors;
+        RamdiskInitializeViewCache(
+            &diskExtension->ViewCache,
+            viewCacheBuffer,
+            diskExtension->SectionObject,
+            CreateInput->DiskOffset + CreateInput->DiskLength,
+            CreateInput->ViewLength,
+            CreateInput->ViewCount,
+            minimumViewCount,
+            maximumViewCount
+            );
+
+        viewCacheBuffer = NULL;
+    }
 
-        for ( i = 0; i < diskExtension->ViewCount; i++ ) {
+    //
+    // For a memory-backed disk image, set up the memory store. It starts
+    // out empty.
+    //
 
-            InsertTailList( &diskExtension->ViewsByOffset, &view->ByOffsetListEntry );
-            InsertTailList( &diskExtension->ViewsByMru, &view->ByMruListEntry );
+    if ( chunkDirectory != NULL ) {
 
-            view++;
-        }
+        RamdiskInitializeMemoryStore(
+            &diskExtension->MemoryStore,
+            chunkDirectory,
+            CreateInput->DiskLength
+            );
 
-        viewDescriptors = NULL;
+        chunkDirectory = NULL;
     }
 
-
     diskExtension->DiskLength = CreateInput->DiskLength;
     diskExtension->DiskOffset = CreateInput->DiskOffset;
     diskExtension->FileRelativeEndOfDisk = diskExtension->DiskOffset + diskExtension->DiskLength;
@@ -2152,9 +2237,14 @@ exit:
         guidString.Buffer = NULL;
     }
 
-    if ( viewDescriptors != NULL ) {
-        FREE_POOL( viewDescriptors, TRUE );
-        viewDescriptors = NULL;
+    if ( viewCacheBuffer != NULL ) {
+        FREE_POOL( viewCacheBuffer, TRUE );
+        viewCacheBuffer = NULL;
+    }
+
+    if ( chunkDirectory != NULL ) {
+        FREE_POOL( chunkDirectory, TRUE );
+        chunkDirectory = NULL;
     }
 
     if ( sectionObject != NULL ) {
@@ -2194,7 +2284,8 @@ exit_exit:
     ASSERT( fileHandle == NULL );
     ASSERT( sectionHandle == NULL );
     ASSERT( sectionObject == NULL );
-    ASSERT( viewDescriptors == NULL );
+    ASSERT( viewCacheBuffer == NULL );
+    ASSERT( chunkDirectory == NULL );
     ASSERT( guidString.Buffer == NULL );
     ASSERT( realDeviceName.Buffer == NULL );
     ASSERT( dosSymLink.Buffer == NULL );
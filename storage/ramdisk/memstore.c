@@ -0,0 +1,815 @@
+/*++
+
+Copyright (c) 2001  Microsoft Corporation
+
+Module Name:
+
+    memstore.c
+
+Abstract:
+
+    This file contains the memory store that holds the image of a
+    memory-backed RAM disk.
+
+Environment:
+
+    Kernel mode only.
+
+Notes:
+
+Revision History:
+
+--*/
+
+#include "precomp.h"
+#pragma hdrstop
+
+//
+// Local functions.
+//
+
+VOID
+RamdiskEnterMemoryStore (
+    IN PMEMORY_STORE MemoryStore
+    );
+
+VOID
+RamdiskLeaveMemoryStore (
+    IN PMEMORY_STORE MemoryStore
+    );
+
+PSTORE_CHUNK
+RamdiskAllocateStoreChunk (
+    IN PMEMORY_STORE MemoryStore,
+    IN ULONG ChunkIndex
+    );
+
+VOID
+RamdiskFreeStoreChunk (
+    IN PSTORE_CHUNK Chunk
+    );
+
+//
+// Declare pageable routines.
+//
+
+#ifdef ALLOC_PRAGMA
+
+#pragma alloc_text( PAGE, RamdiskMemoryStoreAllocationSize )
+#pragma alloc_text( PAGE, RamdiskInitializeMemoryStore )
+#pragma alloc_text( PAGE, RamdiskDeleteMemoryStore )
+#pragma alloc_text( PAGE, RamdiskTrimMemoryStore )
+#pragma alloc_text( PAGE, RamdiskFreeStoreChunk )
+
+#endif // ALLOC_PRAGMA
+
+SIZE_T
+RamdiskMemoryStoreAllocationSize (
+    IN ULONGLONG Length
+    )
+
+/*++
+
+Routine Description:
+
+    This routine returns the size of the buffer that must be passed to
+    RamdiskInitializeMemoryStore. The buffer holds the chunk directory. It
+    must be allocated from nonpaged pool.
+
+Arguments:
+
+    Length - the length of the disk image
+
+Return Value:
+
+    SIZE_T - the size of the buffer, in bytes
+
+--*/
+
+{
+    PAGED_CODE();
+
+    return (SIZE_T)((Length + MEMORY_STORE_CHUNK_SIZE - 1) >> MEMORY_STORE_CHUNK_SHIFT) *
+                                                                sizeof(PSTORE_CHUNK);
+
+} // RamdiskMemoryStoreAllocationSize
+
+VOID
+RamdiskInitializeMemoryStore (
+    OUT PMEMORY_STORE MemoryStore,
+    IN PVOID Buffer,
+    IN ULONGLONG Length
+    )
+
+/*++
+
+Routine Description:
+
+    This routine initializes a memory store. No chunks are allocated; the
+    whole image reads as zeros.
+
+Arguments:
+
+    MemoryStore - a pointer to the memory store to initialize
+
+    Buffer - a pointer to RamdiskMemoryStoreAllocationSize( Length ) bytes
+        of nonpaged pool. The buffer belongs to the memory store until
+        RamdiskDeleteMemoryStore is called; the caller frees it after that.
+
+    Length - the length of the disk image
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PAGED_CODE();
+
+    RtlZeroMemory( MemoryStore, sizeof(MEMORY_STORE) );
+
+    MemoryStore->Length = Length;
+    MemoryStore->ChunkCount =
+        (ULONG)((Length + MEMORY_STORE_CHUNK_SIZE - 1) >> MEMORY_STORE_CHUNK_SHIFT);
+
+    MemoryStore->Chunks = Buffer;
+    RtlZeroMemory( MemoryStore->Chunks, MemoryStore->ChunkCount * sizeof(PSTORE_CHUNK) );
+
+    ExInitializeFastMutex( &MemoryStore->AllocationMutex );
+    ExInitializeFastMutex( &MemoryStore->FreezeMutex );
+    KeInitializeEvent( &MemoryStore->DrainEvent, SynchronizationEvent, FALSE );
+    KeInitializeEvent( &MemoryStore->ThawEvent, NotificationEvent, TRUE );
+
+    return;
+
+} // RamdiskInitializeMemoryStore
+
+VOID
+RamdiskDeleteMemoryStore (
+    IN PMEMORY_STORE MemoryStore
+    )
+
+/*++
+
+Routine Description:
+
+    This routine frees every chunk in a memory store. It does not free the
+    chunk directory, MemoryStore->Chunks.
+
+Arguments:
+
+    MemoryStore - a pointer to the memory store
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    ASSERT( MemoryStore->ActiveCount == 0 );
+
+    for ( i = 0; i < MemoryStore->ChunkCount; i++ ) {
+
+        if ( MemoryStore->Chunks[i] != NULL ) {
+
+            RamdiskFreeStoreChunk( MemoryStore->Chunks[i] );
+            MemoryStore->Chunks[i] = NULL;
+        }
+    }
+
+    DBGPRINT( DBG_WINDOW, DBG_INFO,
+                ("RamdiskDeleteMemoryStore: chunks %d, contiguous %d, mdl %d, "
+                 "failed %d, freed %d\n",
+                    MemoryStore->AllocatedChunks, MemoryStore->ContiguousAllocations,
+                    MemoryStore->MdlAllocations, MemoryStore->AllocationFailures,
+                    MemoryStore->ChunksFreed) );
+
+    return;
+
+} // RamdiskDeleteMemoryStore
+
+VOID
+RamdiskEnterMemoryStore (
+    IN PMEMORY_STORE MemoryStore
+    )
+
+/*++
+
+Routine Description:
+
+    This routine marks the start of an operation that uses the chunks of a
+    memory store. If the store is frozen, it waits for the store to thaw.
+
+Arguments:
+
+    MemoryStore - a pointer to the memory store
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    ASSERT( KeGetCurrentIrql() <= APC_LEVEL );
+
+    while ( TRUE ) {
+
+        InterlockedIncrement( &MemoryStore->ActiveCount );
+
+        if ( *(volatile LONG *)&MemoryStore->Freezing == 0 ) {
+            break;
+        }
+
+        //
+        // A freeze is in progress. Back out and wait for it to finish.
+        //
+
+        RamdiskLeaveMemoryStore( MemoryStore );
+
+        KeWaitForSingleObject(
+            &MemoryStore->ThawEvent,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL
+            );
+    }
+
+    return;
+
+} // RamdiskEnterMemoryStore
+
+VOID
+RamdiskLeaveMemoryStore (
+    IN PMEMORY_STORE MemoryStore
+    )
+
+/*++
+
+Routine Description:
+
+    This routine marks the end of an operation that used the chunks of a
+    memory store. If the store is being frozen and this was the last
+    operation, it wakes the thread that is freezing the store.
+
+Arguments:
+
+    MemoryStore - a pointer to the memory store
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    if ( (InterlockedDecrement( &MemoryStore->ActiveCount ) == 0) &&
+         (*(volatile LONG *)&MemoryStore->Freezing != 0) ) {
+
+        KeSetEvent( &MemoryStore->DrainEvent, 0, FALSE );
+    }
+
+    return;
+
+} // RamdiskLeaveMemoryStore
+
+PSTORE_CHUNK
+RamdiskAllocateStoreChunk (
+    IN PMEMORY_STORE MemoryStore,
+    IN ULONG ChunkIndex
+    )
+
+/*++
+
+Routine Description:
+
+    This routine allocates a zeroed chunk and installs it in the chunk
+    directory, unless another thread got there first.
+
+    A physically contiguous chunk is tried first, because the memory
+    manager can map it with a large page. If there isn't enough contiguous
+    memory, the chunk is built from individual pages and mapped through an
+    MDL.
+
+    This routine must be called with the memory store entered.
+
+Arguments:
+
+    MemoryStore - a pointer to the memory store
+
+    ChunkIndex - the index of the chunk in the chunk directory
+
+Return Value:
+
+    PSTORE_CHUNK - a pointer to the chunk; NULL if there isn't enough memory
+
+--*/
+
+{
+    PSTORE_CHUNK chunk;
+    PHYSICAL_ADDRESS lowAddress;
+    PHYSICAL_ADDRESS highAddress;
+    PHYSICAL_ADDRESS boundary;
+    PHYSICAL_ADDRESS skipBytes;
+    PUCHAR address;
+    PMDL mdl;
+
+    ExAcquireFastMutex( &MemoryStore->AllocationMutex );
+
+    chunk = MemoryStore->Chunks[ChunkIndex];
+
+    if ( chunk != NULL ) {
+
+        ExReleaseFastMutex( &MemoryStore->AllocationMutex );
+
+        return chunk;
+    }
+
+    chunk = ALLOCATE_POOL( NonPagedPool, sizeof(STORE_CHUNK), TRUE );
+
+    if ( chunk == NULL ) {
+
+        goto fail;
+    }
+
+    lowAddress.QuadPart = 0;
+    highAddress.QuadPart = -1;
+    boundary.QuadPart = 0;
+    skipBytes.QuadPart = 0;
+
+    mdl = NULL;
+
+    address = MmAllocateContiguousMemorySpecifyCache(
+                MEMORY_STORE_CHUNK_SIZE,
+                lowAddress,
+                highAddress,
+                boundary,
+                MmCached
+                );
+
+    if ( address != NULL ) {
+
+        RtlZeroMemory( address, MEMORY_STORE_CHUNK_SIZE );
+
+        MemoryStore->ContiguousAllocations++;
+
+    } else {
+
+        //
+        // The pages returned by MmAllocatePagesForMdl are already zeroed.
+        // It may return fewer pages than were asked for.
+        //
+
+        mdl = MmAllocatePagesForMdl( lowAddress, highAddress, skipBytes, MEMORY_STORE_CHUNK_SIZE );
+
+        if ( mdl == NULL ) {
+
+            FREE_POOL( chunk, TRUE );
+            goto fail;
+        }
+
+        if ( MmGetMdlByteCount( mdl ) == MEMORY_STORE_CHUNK_SIZE ) {
+
+            address = MmMapLockedPagesSpecifyCache(
+                        mdl,
+                        KernelMode,
+                        MmCached,
+                        NULL,
+                        FALSE,
+                        NormalPagePriority
+                        );
+        }
+
+        if ( address == NULL ) {
+
+            MmFreePagesFromMdl( mdl );
+            ExFreePool( mdl );
+            FREE_POOL( chunk, TRUE );
+            goto fail;
+        }
+
+        MemoryStore->MdlAllocations++;
+    }
+
+    chunk->Address = address;
+    chunk->Mdl = mdl;
+    chunk->NextFree = NULL;
+
+    //
+    // Readers look at the directory without taking the mutex. The exchange
+    // makes sure that they see the zeroed chunk once they see the pointer.
+    //
+
+    InterlockedExchangePointer( &MemoryStore->Chunks[ChunkIndex], chunk );
+    InterlockedIncrement( &MemoryStore->AllocatedChunks );
+
+    ExReleaseFastMutex( &MemoryStore->AllocationMutex );
+
+    DBGPRINT( DBG_WINDOW, DBG_VERBOSE,
+                ("RamdiskAllocateStoreChunk: chunk %x at %p%s\n",
+                    ChunkIndex, address, (mdl == NULL) ? " (contiguous)" : "") );
+
+    return chunk;
+
+fail:
+
+    MemoryStore->AllocationFailures++;
+
+    ExReleaseFastMutex( &MemoryStore->AllocationMutex );
+
+    DBGPRINT( DBG_WINDOW, DBG_ERROR,
+                ("RamdiskAllocateStoreChunk: can't allocate chunk %x\n", ChunkIndex) );
+
+    return NULL;
+
+} // RamdiskAllocateStoreChunk
+
+VOID
+RamdiskFreeStoreChunk (
+    IN PSTORE_CHUNK Chunk
+    )
+
+/*++
+
+Routine Description:
+
+    This routine gives the memory of a chunk back to the system. It must
+    be called at PASSIVE_LEVEL, after the chunk has been removed from the
+    chunk directory and no operation can be using it.
+
+Arguments:
+
+    Chunk - a pointer to the chunk
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PAGED_CODE();
+
+    if ( Chunk->Mdl == NULL ) {
+
+        MmFreeContiguousMemorySpecifyCache( Chunk->Address, MEMORY_STORE_CHUNK_SIZE, MmCached );
+
+    } else {
+
+        MmUnmapLockedPages( Chunk->Address, Chunk->Mdl );
+        MmFreePagesFromMdl( Chunk->Mdl );
+        ExFreePool( Chunk->Mdl );
+    }
+
+    FREE_POOL( Chunk, TRUE );
+
+    return;
+
+} // RamdiskFreeStoreChunk
+
+NTSTATUS
+RamdiskCopyMemoryStore (
+    IN PMEMORY_STORE MemoryStore,
+    IN ULONGLONG Offset,
+    IN PUCHAR Buffer,
+    IN ULONG Length,
+    IN BOOLEAN Write
+    )
+
+/*++
+
+Routine Description:
+
+    This routine copies data between a memory store and a buffer. Chunks
+    are allocated as they are written. Chunks that have never been written
+    read as zeros.
+
+    This routine must be called at IRQL <= APC_LEVEL.
+
+Arguments:
+
+    MemoryStore - a pointer to the memory store
+
+    Offset - the offset into the disk image at which the copy is to start
+
+    Buffer - a pointer to the buffer
+
+    Length - the number of bytes to copy
+
+    Write - TRUE to copy from the buffer to the store; FALSE to copy from
+        the store to the buffer
+
+Return Value:
+
+    NTSTATUS - the status of the operation
+
+--*/
+
+{
+    NTSTATUS status;
+    PSTORE_CHUNK chunk;
+    ULONG chunkIndex;
+    ULONG chunkOffset;
+    ULONG segmentLength;
+
+    ASSERT( (Offset + Length) <= MemoryStore->Length );
+
+    status = STATUS_SUCCESS;
+
+    RamdiskEnterMemoryStore( MemoryStore );
+
+    while ( Length != 0 ) {
+
+        chunkIndex = (ULONG)(Offset >> MEMORY_STORE_CHUNK_SHIFT);
+        chunkOffset = (ULONG)Offset & (MEMORY_STORE_CHUNK_SIZE - 1);
+
+        segmentLength = MEMORY_STORE_CHUNK_SIZE - chunkOffset;
+        if ( segmentLength > Length ) {
+            segmentLength = Length;
+        }
+
+        chunk = MemoryStore->Chunks[chunkIndex];
+
+        if ( Write ) {
+
+            if ( chunk == NULL ) {
+
+                chunk = RamdiskAllocateStoreChunk( MemoryStore, chunkIndex );
+
+                if ( chunk == NULL ) {
+
+                    status = STATUS_INSUFFICIENT_RESOURCES;
+                    break;
+                }
+            }
+
+            RtlCopyMemory( chunk->Address + chunkOffset, Buffer, segmentLength );
+
+        } else if ( chunk != NULL ) {
+
+            RtlCopyMemory( Buffer, chunk->Address + chunkOffset, segmentLength );
+
+        } else {
+
+            RtlZeroMemory( Buffer, segmentLength );
+        }
+
+        Offset += segmentLength;
+        Buffer += segmentLength;
+        Length -= segmentLength;
+    }
+
+    RamdiskLeaveMemoryStore( MemoryStore );
+
+    return status;
+
+} // RamdiskCopyMemoryStore
+
+PUCHAR
+RamdiskMapMemoryStore (
+    IN PMEMORY_STORE MemoryStore,
+    IN ULONGLONG Offset,
+    IN ULONG RequestedLength,
+    OUT PULONG ActualLength
+    )
+
+/*++
+
+Routine Description:
+
+    This routine returns the address of a range of a memory store, for
+    RamdiskMapPages. The chunk that holds the range is allocated if it
+    hasn't been, because the caller may write to it. The caller must call
+    RamdiskUnmapMemoryStore when it is done with the range.
+
+    This routine must be called at IRQL <= APC_LEVEL.
+
+Arguments:
+
+    MemoryStore - a pointer to the memory store
+
+    Offset - the offset into the disk image of the start of the range
+
+    RequestedLength - the desired length of the range
+
+    ActualLength - returns the length of the range that is in the chunk.
+        This is less than RequestedLength if the range crosses a chunk
+        boundary.
+
+Return Value:
+
+    PUCHAR - the address of the range; NULL if the chunk couldn't be
+        allocated
+
+--*/
+
+{
+    PSTORE_CHUNK chunk;
+    ULONG chunkIndex;
+    ULONG chunkOffset;
+
+    ASSERT( Offset < MemoryStore->Length );
+
+    chunkIndex = (ULONG)(Offset >> MEMORY_STORE_CHUNK_SHIFT);
+    chunkOffset = (ULONG)Offset & (MEMORY_STORE_CHUNK_SIZE - 1);
+
+    *ActualLength = MEMORY_STORE_CHUNK_SIZE - chunkOffset;
+    if ( *ActualLength > RequestedLength ) {
+        *ActualLength = RequestedLength;
+    }
+
+    RamdiskEnterMemoryStore( MemoryStore );
+
+    chunk = MemoryStore->Chunks[chunkIndex];
+
+    if ( chunk == NULL ) {
+
+        chunk = RamdiskAllocateStoreChunk( MemoryStore, chunkIndex );
+
+        if ( chunk == NULL ) {
+
+            RamdiskLeaveMemoryStore( MemoryStore );
+
+            return NULL;
+        }
+    }
+
+    return chunk->Address + chunkOffset;
+
+} // RamdiskMapMemoryStore
+
+VOID
+RamdiskUnmapMemoryStore (
+    IN PMEMORY_STORE MemoryStore
+    )
+
+/*++
+
+Routine Description:
+
+    This routine releases a range returned by RamdiskMapMemoryStore.
+
+Arguments:
+
+    MemoryStore - a pointer to the memory store
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    RamdiskLeaveMemoryStore( MemoryStore );
+
+    return;
+
+} // RamdiskUnmapMemoryStore
+
+VOID
+RamdiskTrimMemoryStore (
+    IN PMEMORY_STORE MemoryStore,
+    IN ULONGLONG Offset,
+    IN ULONGLONG Length
+    )
+
+/*++
+
+Routine Description:
+
+    This routine discards the data in a range of a memory store. Chunks
+    that the range covers completely are freed. The rest of the range is
+    zeroed, so that the whole range reads as zeros afterward.
+
+    The store is frozen while the directory is updated, so no operation
+    can be using a chunk when it is removed. The chunks are freed after
+    the store thaws.
+
+    This routine must be called at PASSIVE_LEVEL.
+
+Arguments:
+
+    MemoryStore - a pointer to the memory store
+
+    Offset - the offset into the disk image of the start of the range
+
+    Length - the length of the range
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PSTORE_CHUNK chunk;
+    PSTORE_CHUNK freeList;
+    ULONG chunkIndex;
+    ULONG chunkOffset;
+    ULONGLONG segmentLength;
+
+    PAGED_CODE();
+
+    if ( Offset >= MemoryStore->Length ) {
+        return;
+    }
+
+    if ( Length > (MemoryStore->Length - Offset) ) {
+        Length = MemoryStore->Length - Offset;
+    }
+
+    freeList = NULL;
+
+    //
+    // Freeze the store: stop new operations from starting, then wait for
+    // the active ones to finish.
+    //
+
+    ExAcquireFastMutex( &MemoryStore->FreezeMutex );
+
+    KeClearEvent( &MemoryStore->ThawEvent );
+    InterlockedExchange( &MemoryStore->Freezing, 1 );
+
+    while ( *(volatile LONG *)&MemoryStore->ActiveCount != 0 ) {
+
+        KeWaitForSingleObject(
+            &MemoryStore->DrainEvent,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL
+            );
+    }
+
+    while ( Length != 0 ) {
+
+        chunkIndex = (ULONG)(Offset >> MEMORY_STORE_CHUNK_SHIFT);
+        chunkOffset = (ULONG)Offset & (MEMORY_STORE_CHUNK_SIZE - 1);
+
+        segmentLength = MEMORY_STORE_CHUNK_SIZE - chunkOffset;
+        if ( segmentLength > Length ) {
+            segmentLength = Length;
+        }
+
+        chunk = MemoryStore->Chunks[chunkIndex];
+
+        if ( chunk != NULL ) {
+
+            //
+            // The last chunk may extend past the end of the disk. A range
+            // that runs from its start to the end of the disk covers it.
+            //
+
+            if ( (chunkOffset == 0) &&
+                 ((segmentLength == MEMORY_STORE_CHUNK_SIZE) ||
+                  ((Offset + segmentLength) == MemoryStore->Length)) ) {
+
+                MemoryStore->Chunks[chunkIndex] = NULL;
+
+                chunk->NextFree = freeList;
+                freeList = chunk;
+
+            } else {
+
+                RtlZeroMemory( chunk->Address + chunkOffset, (SIZE_T)segmentLength );
+            }
+        }
+
+        Offset += segmentLength;
+        Length -= segmentLength;
+    }
+
+    //
+    // Thaw the store.
+    //
+
+    InterlockedExchange( &MemoryStore->Freezing, 0 );
+    KeSetEvent( &MemoryStore->ThawEvent, 0, FALSE );
+
+    ExReleaseFastMutex( &MemoryStore->FreezeMutex );
+
+    //
+    // Give the removed chunks back to the system.
+    //
+
+    while ( freeList != NULL ) {
+
+        chunk = freeList;
+        freeList = chunk->NextFree;
+
+        RamdiskFreeStoreChunk( chunk );
+
+        InterlockedDecrement( &MemoryStore->AllocatedChunks );
+        MemoryStore->ChunksFreed++;
+    }
+
+    return;
+
+} // RamdiskTrimMemoryStore
@@ -0,0 +1,157 @@
+/*++
+
+Copyright (c) 2001  Microsoft Corporation
+
+Module Name:
+
+    memstore.h
+
+Abstract:
+
+    This file declares the memory store that holds the image of a
+    memory-backed RAM disk.
+
+    A memory-backed RAM disk is a scratch disk with no backing file. Its
+    image is kept in chunks of memory allocated by the driver. Each chunk is
+    the size of a large page and stays mapped from when it is allocated
+    until it is freed, so finding the memory for an offset is an index into
+    the chunk directory.
+
+    Chunks are allocated on the first write to them. Reading a chunk that
+    has never been written returns zeros. When a range is unmapped (SCSI
+    UNMAP), chunks that it covers completely are freed and the rest of the
+    range is zeroed.
+
+Environment:
+
+    Kernel mode only.
+
+Notes:
+
+Revision History:
+
+--*/
+
+#ifndef _MEMSTORE_H_
+#define _MEMSTORE_H_
+
+//
+// The chunk size is the large page size on PAE and 64-bit systems.
+//
+
+#define MEMORY_STORE_CHUNK_SHIFT 21
+#define MEMORY_STORE_CHUNK_SIZE (1 << MEMORY_STORE_CHUNK_SHIFT)
+
+typedef struct _STORE_CHUNK {
+
+    //
+    // Address is the system virtual address of the chunk.
+    //
+    // Mdl describes the pages of the chunk if they were not allocated
+    // physically contiguous. Mdl is NULL for a contiguous chunk.
+    //
+    // NextFree links chunks that have been removed from the directory and
+    // are waiting to be freed.
+    //
+
+    PUCHAR Address;
+    PMDL Mdl;
+
+    struct _STORE_CHUNK *NextFree;
+
+} STORE_CHUNK, *PSTORE_CHUNK;
+
+typedef struct _MEMORY_STORE {
+
+    //
+    // Length is the length of the disk image. Chunks points to ChunkCount
+    // entries, one for each chunk of the image. An entry is NULL if the
+    // chunk has not been allocated.
+    //
+
+    ULONGLONG Length;
+    ULONG ChunkCount;
+
+    PSTORE_CHUNK *Chunks;
+
+    //
+    // AllocationMutex serializes the allocation of chunks.
+    //
+
+    FAST_MUTEX AllocationMutex;
+
+    //
+    // Chunks are only freed while no operation is using the store.
+    //
+    // ActiveCount is the number of operations using the store. When
+    // Freezing is set, operations wait on ThawEvent instead of starting,
+    // and the last active operation to finish sets DrainEvent. FreezeMutex
+    // serializes the threads that freeze the store.
+    //
+
+    LONG ActiveCount;
+    LONG Freezing;
+
+    FAST_MUTEX FreezeMutex;
+    KEVENT DrainEvent;
+    KEVENT ThawEvent;
+
+    //
+    // Statistics, for the debugger.
+    //
+
+    LONG AllocatedChunks;
+    ULONG ContiguousAllocations;
+    ULONG MdlAllocations;
+    ULONG AllocationFailures;
+    ULONG ChunksFreed;
+
+} MEMORY_STORE, *PMEMORY_STORE;
+
+SIZE_T
+RamdiskMemoryStoreAllocationSize (
+    IN ULONGLONG Length
+    );
+
+VOID
+RamdiskInitializeMemoryStore (
+    OUT PMEMORY_STORE MemoryStore,
+    IN PVOID Buffer,
+    IN ULONGLONG Length
+    );
+
+VOID
+RamdiskDeleteMemoryStore (
+    IN PMEMORY_STORE MemoryStore
+    );
+
+NTSTATUS
+RamdiskCopyMemoryStore (
+    IN PMEMORY_STORE MemoryStore,
+    IN ULONGLONG Offset,
+    IN PUCHAR Buffer,
+    IN ULONG Length,
+    IN BOOLEAN Write
+    );
+
+PUCHAR
+RamdiskMapMemoryStore (
+    IN PMEMORY_STORE MemoryStore,
+    IN ULONGLONG Offset,
+    IN ULONG RequestedLength,
+    OUT PULONG ActualLength
+    );
+
+VOID
+RamdiskUnmapMemoryStore (
+    IN PMEMORY_STORE MemoryStore
+    );
+
+VOID
+RamdiskTrimMemoryStore (
+    IN PMEMORY_STORE MemoryStore,
+    IN ULONGLONG Offset,
+    IN ULONGLONG Length
+    );
+
+#endif // _MEMSTORE_H_
@@ -1589,41 +1589,29 @@ Return Value:
 
     if ( diskExtension->SectionObject != NULL ) {
 
-        if ( diskExtension->ViewDescriptors != NULL ) {
+        if ( diskExtension->ViewCache.ViewDescriptors != NULL ) {
 
             //
             // Clean up the mapped views.
             //
 
-            PVIEW view;
+            RamdiskDeleteViewCache( &diskExtension->ViewCache );
 
-            ASSERT( diskExtension->ViewWaiterCount == 0 );
-
-            while ( !IsListEmpty( &diskExtension->ViewsByOffset ) ) {
-
-                listEntry = RemoveHeadList( &diskExtension->ViewsByOffset );
-                view = CONTAINING_RECORD( listEntry, VIEW, ByOffsetListEntry );
-
-                RemoveEntryList( &view->ByMruListEntry );
-
-                ASSERT( view->ReferenceCount == 0 );
-
-                if ( view->Address != NULL ) {
+            FREE_POOL( diskExtension->ViewCache.ViewDescriptors, TRUE );
+        }
 
-                    DBGPRINT( DBG_WINDOW, DBG_VERBOSE,
-                                ("RamdiskDeleteDiskDevice: unmapping view %p; addr %p\n",
-                                    view, view->Address) );
+        ObDereferenceObject( diskExtension->SectionObject );
+    }
 
-                    MmUnmapViewOfSection( PsGetCurrentProcess(), view->Address );
-                }
-            }
+    //
+    // Free the memory holding the image of a memory-backed RAM disk.
+    //
 
-            ASSERT( IsListEmpty( &diskExtension->ViewsByMru ) );
+    if ( RAMDISK_IS_MEMORY_BACKED(diskExtension) ) {
 
-            FREE_POOL( diskExtension->ViewDescriptors, TRUE );
-        }
+        RamdiskDeleteMemoryStore( &diskExtension->MemoryStore );
 
-        ObDereferenceObject( diskExtension->SectionObject );
+        FREE_POOL( diskExtension->MemoryStore.Chunks, TRUE );
     }
 
     if ( !diskExtension->Options.NoDosDevice ) {
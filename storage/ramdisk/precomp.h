@@ -17,6 +17,8 @@
 #include <ntddramd.h>
 //#include <xip.h>
 
+#include "viewcache.h"
+#include "memstore.h"
 #include "ramdisk.h"
 #include "debug.h"
 
@@ -419,12 +419,12 @@ Return Value:
     PAGED_CODE();
 
     //
-    // If the target RAM disk is not file-backed, there's nothing to do. If it
-    // is file-backed, we need to do the work in a thread.
+    // If the target RAM disk is not mapped through views of a backing file,
+    // there's nothing to do. If it is, we need to do the work in a thread.
     //
 
     if ( (diskExtension->DeviceType != RamdiskDeviceTypeDiskPdo) ||
-         !RAMDISK_IS_FILE_BACKED(diskExtension->DiskType) ) {
+         !RAMDISK_USES_VIEWS(diskExtension) ) {
 
         COMPLETE_REQUEST( STATUS_SUCCESS, 0, Irp );
 
@@ -468,6 +468,16 @@ Return Value:
 {
     PAGED_CODE();
 
+    //
+    // Only views of a backing file have anything to flush. (SCSI flush and
+    // shutdown requests get here for every type of RAM disk.)
+    //
+
+    if ( !RAMDISK_USES_VIEWS(DiskExtension) ) {
+
+        return STATUS_SUCCESS;
+    }
+
     //
     // Flush the virtual memory associated with the RAM disk.
     //
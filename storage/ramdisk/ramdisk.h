@@ -144,55 +144,19 @@ extern ULONG DefaultViewLength;
 extern ULONG MaximumViewLength;
 extern ULONG MaximumPerDiskViewLength;
 
-typedef struct _VIEW {
-
-    //
-    // Views are kept in two lists.
-    //
-    // The by-offset list is sorted in ascending order by the base offset of
-    // the view. (Unmapped views have offset and length both 0 and are always
-    // at the front of the by-offset list.)
-    //
-    // The MRU list is sorted with the most recently used views at the front.
-    // When we need to unmap a view and remap a new view, we take a free view
-    // from the back of the MRU list.
-    //
-
-    LIST_ENTRY ByOffsetListEntry;
-    LIST_ENTRY ByMruListEntry;
-
-    //
-    // Address is the virtual address at which the view is mapped.
-    //
-    // Offset is the offset from the start of the file that backs the RAM disk.
-    //
-    // Length if the length of the view. Normally this is the same as the
-    // ViewLength field in the disk extension, but it can be less for the
-    // view at the end of the disk image. (If we permanently map the first
-    // few pages of the disk image [to keep the boot sector mapped], then the
-    // first view will also be "short".
-    //
-
-    PUCHAR Address;
-
-    ULONGLONG Offset;
-    ULONG Length;
-
-    //
-    // ReferenceCount indicates how many active operations are using the view.
-    // When ReferenceCount is 0, the view is a candidate for replacement.
-    //
-    // Permanent indicates whether the view is to remain mapped permanently.
-    // If Permanent is TRUE, the ReferenceCount field is not used. (Permanent
-    // is intended to be used to keep a view permanently mapped to the boot
-    // sector. Currently we don't implement any permanent views.)
-    //
-
-    ULONG ReferenceCount;
+//
+// A file-backed RAM disk created with an empty file name is memory-backed:
+// it has no backing file, and its image is kept in memory allocated by the
+// driver. A memory-backed RAM disk is accessed directly, like a boot disk or
+// a virtual floppy. RAMDISK_USES_VIEWS is TRUE for RAM disks whose image must
+// be mapped through the view cache, which needs thread context.
+//
 
-    BOOLEAN Permanent;
+#define RAMDISK_IS_MEMORY_BACKED( _ext ) ((_ext)->MemoryStore.Chunks != NULL)
 
-} VIEW, *PVIEW;
+#define RAMDISK_USES_VIEWS( _ext )                  \
+    (RAMDISK_IS_FILE_BACKED((_ext)->DiskType) &&    \
+     !RAMDISK_IS_MEMORY_BACKED(_ext))
 
 //
 // The device extensions for BusFdo and DiskPdo devices have a common header.
@@ -382,39 +346,18 @@ typedef struct  _DISK_EXTENSION {
     BOOLEAN MarkedForDeletion;
 
     //
-    // Mapped image windowing.
-    //
-    // ViewCount is the number of views that are available. ViewLength is
-    // length of each view.
+    // Mapped image windowing. For file-backed RAM disks, ViewCache maps
+    // views of the backing file on demand. (See viewcache.h.)
     //
 
-    ULONG ViewCount;
-    ULONG ViewLength;
+    VIEW_CACHE ViewCache;
 
     //
-    // ViewDescriptors points to an array of view descriptors allocated when
-    // the disk was created.
-    //
-
-    PVIEW ViewDescriptors;
-
-    //
-    // ViewsByOffset and ViewsByMru are lists of view descriptors (see the
-    // description of the VIEW struct).
-    //
-
-    LIST_ENTRY ViewsByOffset;
-    LIST_ENTRY ViewsByMru;
-
-    //
-    // ViewSemaphore is used to wake up threads that are waiting for a free
-    // view (so they can remap a new view). ViewWaiterCount is the number of
-    // threads that are currently waiting for a free view. The semaphore is
-    // "kicked" by this amount when a view is freed.
+    // For memory-backed RAM disks, MemoryStore holds the disk image. (See
+    // memstore.h.)
     //
 
-    KSEMAPHORE ViewSemaphore;
-    ULONG ViewWaiterCount;
+    MEMORY_STORE MemoryStore;
 
     //
     // ISSUE: Do we really need XIP_BOOT_PARAMETERS?
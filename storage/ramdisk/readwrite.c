@@ -132,10 +132,13 @@ Return Value:
     // If the RAM disk is not file-backed, then the disk image is in memory,
     // and we can do the operation regardless of what context we're in. If the
     // RAM disk is file-backed, we need to be in thread context to do the
-    // operation.
+    // operation. A memory-backed RAM disk may have to wait for its memory
+    // store or allocate memory, so we can do the operation here unless we're
+    // at DISPATCH_LEVEL.
     //
 
-    if ( RAMDISK_IS_FILE_BACKED(diskExtension->DiskType) ) {
+    if ( RAMDISK_USES_VIEWS(diskExtension) ||
+         (RAMDISK_IS_MEMORY_BACKED(diskExtension) && (KeGetCurrentIrql() > APC_LEVEL)) ) {
 
         status = SendIrpToThread( DeviceObject, Irp );
         if ( status != STATUS_PENDING ) {
@@ -225,6 +228,28 @@ Return Value:
 
     Irp->IoStatus.Information = 0;
 
+    //
+    // The image of a memory-backed RAM disk is always mapped. Copy straight
+    // between it and the caller's buffer.
+    //
+
+    if ( RAMDISK_IS_MEMORY_BACKED(DiskExtension) ) {
+
+        status = RamdiskCopyMemoryStore(
+                    &DiskExtension->MemoryStore,
+                    ioOffset,
+                    bufferAddress,
+                    ioLength,
+                    (BOOLEAN)(irpSp->MajorFunction == IRP_MJ_WRITE)
+                    );
+
+        if ( NT_SUCCESS(status) ) {
+            Irp->IoStatus.Information = ioLength;
+        }
+
+        return status;
+    }
+
     while ( ioLength != 0 ) {
     
         //
@@ -27,6 +27,19 @@ Revision History:
 #include "precomp.h"
 #pragma hdrstop
 
+//
+// UNMAP is not in scsi.h. (It shares its operation code with the CD-ROM
+// command READ SUB-CHANNEL.) The UNMAP parameter list is an 8-byte header
+// followed by 16-byte block descriptors.
+//
+
+#if !defined( SCSIOP_UNMAP )
+#define SCSIOP_UNMAP 0x42
+#endif
+
+#define UNMAP_PARAMETER_HEADER_LENGTH 8
+#define UNMAP_BLOCK_DESCRIPTOR_LENGTH 16
+
 //
 // Local functions.
 //
@@ -50,6 +63,12 @@ Do12ByteCdbCommand (
     IN OUT PSCSI_REQUEST_BLOCK Srb
     );
 
+NTSTATUS
+DoUnmapCommand (
+    IN PDEVICE_OBJECT DeviceObject,
+    IN OUT PSCSI_REQUEST_BLOCK Srb
+    );
+
 NTSTATUS
 BuildInquiryData (
     IN PDEVICE_OBJECT DeviceObject,
@@ -73,6 +92,7 @@ BuildModeSenseInfo (
 #pragma alloc_text( PAGE, Do6ByteCdbCommand )
 #pragma alloc_text( PAGE, Do10ByteCdbCommand )
 #pragma alloc_text( PAGE, Do12ByteCdbCommand )
+#pragma alloc_text( PAGE, DoUnmapCommand )
 #pragma alloc_text( PAGE, BuildInquiryData )
 #pragma alloc_text( PAGE, BuildModeSenseInfo )
 
@@ -740,6 +760,28 @@ Return Value:
 
         dataBuffer = Srb->DataBuffer;
 
+        //
+        // The image of a memory-backed RAM disk is always mapped. Copy
+        // straight between it and the data buffer.
+        //
+
+        if ( RAMDISK_IS_MEMORY_BACKED(diskExtension) ) {
+
+            status = RamdiskCopyMemoryStore(
+                        &diskExtension->MemoryStore,
+                        offset,
+                        dataBuffer,
+                        dataSize,
+                        (BOOLEAN)(cdb->CDB10.OperationCode == SCSIOP_WRITE)
+                        );
+
+            if ( !NT_SUCCESS(status) ) {
+                Srb->SrbStatus = SRB_STATUS_ERROR;
+            }
+
+            break;
+        }
+
         while ( dataSize != 0 ) {
 
             //
@@ -795,6 +837,16 @@ Return Value:
 
         break;
 
+    case SCSIOP_UNMAP:
+
+        //
+        // Discard the data in the specified ranges.
+        //
+
+        status = DoUnmapCommand( DeviceObject, Srb );
+
+        break;
+
     //case SCSIOP_SEEK:
     //case SCSIOP_WRITE_VERIFY:
     //case SCSIOP_READ_FORMATTED_CAPACITY:
@@ -809,7 +861,6 @@ Return Value:
     //case SCSIOP_WRITE_DATA_BUFF:
     //case SCSIOP_READ_DATA_BUFF:
     //case SCSIOP_CHANGE_DEFINITION:
-    //case SCSIOP_READ_SUB_CHANNEL:
     //case SCSIOP_READ_TOC:
     //case SCSIOP_READ_HEADER:
     //case SCSIOP_PLAY_AUDIO:
@@ -944,6 +995,146 @@ Return Value:
 
 } // Do12ByteCdbCommand
 
+NTSTATUS
+DoUnmapCommand (
+    IN PDEVICE_OBJECT DeviceObject,
+    IN OUT PSCSI_REQUEST_BLOCK Srb
+    )
+
+/*++
+
+Routine Description:
+
+    This routine handles the UNMAP command. Only memory-backed RAM disks
+    support it. The memory behind the unmapped ranges is given back to the
+    system, and the ranges read as zeros afterward.
+
+Arguments:
+
+    DeviceObject - a pointer to the object that represents the device on which
+        I/O is to be performed
+
+    Srb - the SRB associated with the I/O request
+
+Return Value:
+
+    NTSTATUS - the status of the operation
+
+--*/
+
+{
+    PDISK_EXTENSION diskExtension;
+    PCDB cdb;
+    PUCHAR parameterList;
+    PUCHAR descriptor;
+    ULONG parameterListLength;
+    ULONG descriptorsLength;
+    ULONG i;
+    ULONGLONG diskBlocks;
+    ULONGLONG startingBlock;
+    ULONG blockCount;
+
+    PAGED_CODE();
+
+    diskExtension = DeviceObject->DeviceExtension;
+    cdb = (PCDB)Srb->Cdb;
+
+    if ( !RAMDISK_IS_MEMORY_BACKED(diskExtension) ) {
+
+        DBGPRINT( DBG_SRB, DBG_VERBOSE, ("%s", "DoUnmapCommand: not a memory-backed disk\n") );
+
+        Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    if ( diskExtension->Options.Readonly ) {
+
+        Srb->SrbStatus = SRB_STATUS_ERROR;
+        return STATUS_MEDIA_WRITE_PROTECTED;
+    }
+
+    //
+    // The parameter list length is in the bytes that hold the transfer
+    // length in a READ(10) CDB. If it is greater than the SRB length, use
+    // the SRB length. The block descriptor data length (big-endian) is in
+    // bytes 2 and 3 of the parameter list header.
+    //
+
+    parameterListLength = (cdb->CDB10.TransferBlocksMsb << 8) | cdb->CDB10.TransferBlocksLsb;
+
+    if ( parameterListLength > Srb->DataTransferLength ) {
+        parameterListLength = Srb->DataTransferLength;
+    }
+
+    if ( parameterListLength < UNMAP_PARAMETER_HEADER_LENGTH ) {
+
+        //
+        // No descriptors. There is nothing to do.
+        //
+
+        return STATUS_SUCCESS;
+    }
+
+    parameterList = Srb->DataBuffer;
+
+    descriptorsLength = (parameterList[2] << 8) | parameterList[3];
+
+    if ( descriptorsLength > (parameterListLength - UNMAP_PARAMETER_HEADER_LENGTH) ) {
+        descriptorsLength = parameterListLength - UNMAP_PARAMETER_HEADER_LENGTH;
+    }
+
+    descriptorsLength -= descriptorsLength % UNMAP_BLOCK_DESCRIPTOR_LENGTH;
+
+    //
+    // Check every descriptor before unmapping anything. Each descriptor has
+    // the starting block (8 bytes, big-endian) and the block count (4 bytes,
+    // big-endian).
+    //
+
+    diskBlocks = diskExtension->DiskLength / diskExtension->BytesPerSector;
+
+    for ( i = 0; i < descriptorsLength; i += UNMAP_BLOCK_DESCRIPTOR_LENGTH ) {
+
+        descriptor = parameterList + UNMAP_PARAMETER_HEADER_LENGTH + i;
+
+        startingBlock = _byteswap_uint64( *(ULONGLONG UNALIGNED *)descriptor );
+        blockCount = _byteswap_ulong( *(ULONG UNALIGNED *)(descriptor + 8) );
+
+        if ( (startingBlock > diskBlocks) || (blockCount > (diskBlocks - startingBlock)) ) {
+
+            DBGPRINT( DBG_SRB, DBG_ERROR,
+                        ("DoUnmapCommand: range %I64x + %x is beyond the end of the disk\n",
+                        startingBlock, blockCount) );
+
+            Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+            return STATUS_INVALID_DEVICE_REQUEST;
+        }
+    }
+
+    for ( i = 0; i < descriptorsLength; i += UNMAP_BLOCK_DESCRIPTOR_LENGTH ) {
+
+        descriptor = parameterList + UNMAP_PARAMETER_HEADER_LENGTH + i;
+
+        startingBlock = _byteswap_uint64( *(ULONGLONG UNALIGNED *)descriptor );
+        blockCount = _byteswap_ulong( *(ULONG UNALIGNED *)(descriptor + 8) );
+
+        DBGPRINT( DBG_SRB, DBG_VERBOSE,
+                    ("DoUnmapCommand: unmapping %I64x + %x\n", startingBlock, blockCount) );
+
+        if ( blockCount != 0 ) {
+
+            RamdiskTrimMemoryStore(
+                &diskExtension->MemoryStore,
+                startingBlock * diskExtension->BytesPerSector,
+                (ULONGLONG)blockCount * diskExtension->BytesPerSector
+                );
+        }
+    }
+
+    return STATUS_SUCCESS;
+
+} // DoUnmapCommand
+
 NTSTATUS
 BuildInquiryData (
     IN PDEVICE_OBJECT DeviceObject,
@@ -0,0 +1,485 @@
+//
+// Benchmark for the RAM disk view cache.
+//
+// A page file backed section stands in for the file behind a file-backed
+// RAM disk. 4KB reads are run through the view cache the way
+// RamdiskReadWriteReal does them (map, copy, unmap), with sequential,
+// uniformly random and skewed random offsets. The skewed pattern sends 9
+// of every 10 reads to the first sixteenth of the disk.
+//
+// Each pattern is run for a range of view counts, once with the pool fixed
+// at that count and once with it free to grow and shrink, and the read
+// rate, hit rate and final view count are reported.
+//
+// Before timing, every page is stamped with its offset through the cache
+// and read back to check the mappings.
+//
+// Usage:
+//
+//     tviews [-d megabytes] [-l view kilobytes] [-t milliseconds]
+//
+
+#include <nt.h>
+#include <ntrtl.h>
+#include <nturtl.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+//
+// Kernel services used by the view cache.
+//
+
+typedef CRITICAL_SECTION FAST_MUTEX, *PFAST_MUTEX;
+typedef HANDLE KSEMAPHORE, *PKSEMAPHORE;
+
+#define ExInitializeFastMutex(Mutex) InitializeCriticalSection (Mutex)
+#define ExAcquireFastMutex(Mutex) EnterCriticalSection (Mutex)
+#define ExReleaseFastMutex(Mutex) LeaveCriticalSection (Mutex)
+#define KeEnterCriticalRegion()
+#define KeLeaveCriticalRegion()
+
+#define KeInitializeSemaphore(Semaphore, Count, Limit) \
+		(*(Semaphore) = CreateSemaphore (NULL, (Count), (Limit), NULL))
+#define KeReleaseSemaphore(Semaphore, Increment, Adjustment, Wait) \
+		ReleaseSemaphore (*(Semaphore), (Adjustment), NULL)
+#define KeWaitForSingleObject(Object, Reason, Mode, Alertable, Timeout) \
+		WaitForSingleObject (*(Object), INFINITE)
+
+#define PsGetCurrentProcess() NULL
+#define MmMapViewOfSection(Section, Process, Base, ZeroBits, CommitSize, Offset, Size, Inherit, AllocationType, Protect) \
+		TestMapViewOfSection ((Section), (Base), (Offset), (Size))
+#define MmUnmapViewOfSection(Process, Base) UnmapViewOfFile (Base)
+#define ZwFlushVirtualMemory(Process, Base, Size, IoStatus) \
+		TestFlushVirtualMemory (*(Base), *(Size), (IoStatus))
+
+#define PAGED_CODE()
+#define DBGPRINT(Component, Level, Format)
+
+NTSTATUS
+TestMapViewOfSection(
+	IN PVOID Section,
+	OUT PVOID *Base,
+	IN PLARGE_INTEGER Offset,
+	IN PSIZE_T Size
+	);
+
+NTSTATUS
+TestFlushVirtualMemory(
+	IN PVOID Base,
+	IN SIZE_T Size,
+	OUT PIO_STATUS_BLOCK IoStatus
+	);
+
+#include "..\viewcache.c"
+
+//
+// Same as in ramdisk.h.
+//
+
+#define MINIMUM_MINIMUM_VIEW_COUNT   2
+#define MAXIMUM_MAXIMUM_VIEW_COUNT 256
+
+#define DEFAULT_MAXIMUM_PER_DISK_VIEW_LENGTH (256 * 1024 * 1024)
+
+#define IO_SIZE 4096
+
+typedef enum _TEST_PATTERN {
+	Sequential,
+	Random,
+	Skewed,
+	PatternCount
+} TEST_PATTERN;
+
+PCSTR PatternNames [] = { "sequential", "random", "skewed" };
+
+ULONG ViewCounts [] = { 2, 4, 8, 16, 32, 64, 128, 256 };
+
+typedef struct _TEST_RESULT {
+	double ReadsPerSecond;
+	double HitRate;
+	ULONG FinalViewCount;
+} TEST_RESULT, *PTEST_RESULT;
+
+//
+// Test parameters.
+//
+
+ULONG DiskMegabytes = 512;
+ULONG ViewKilobytes = 1024;
+ULONG Duration = 1000;
+
+HANDLE Section;
+ULONGLONG DiskLength;
+ULONG MaximumViewCount;
+PVOID CacheBuffer;
+ULONG Failures;
+ULONGLONG RandomState = 0x9e3779b97f4a7c15;
+
+
+NTSTATUS
+TestMapViewOfSection(
+	IN PVOID Section,
+	OUT PVOID *Base,
+	IN PLARGE_INTEGER Offset,
+	IN PSIZE_T Size
+	)
+{
+	*Base = MapViewOfFile ((HANDLE)Section,
+						   FILE_MAP_WRITE,
+						   Offset->HighPart,
+						   Offset->LowPart,
+						   *Size);
+
+	return (*Base != NULL) ? STATUS_SUCCESS : STATUS_NO_MEMORY;
+}
+
+
+NTSTATUS
+TestFlushVirtualMemory(
+	IN PVOID Base,
+	IN SIZE_T Size,
+	OUT PIO_STATUS_BLOCK IoStatus
+	)
+{
+	IoStatus->Status = STATUS_SUCCESS;
+	IoStatus->Information = 0;
+
+	return FlushViewOfFile (Base, Size) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
+
+
+ULONGLONG
+Random64(
+	VOID
+	)
+{
+	RandomState ^= RandomState << 13;
+	RandomState ^= RandomState >> 7;
+	RandomState ^= RandomState << 17;
+
+	return RandomState;
+}
+
+
+ULONGLONG
+NextOffset(
+	IN TEST_PATTERN Pattern,
+	IN OUT PULONGLONG Sequence
+	)
+{
+	ULONGLONG Pages;
+	ULONGLONG Value;
+
+	Pages = DiskLength / IO_SIZE;
+
+	switch (Pattern) {
+
+	case Sequential:
+		Value = *Sequence;
+		*Sequence = (*Sequence + IO_SIZE) % DiskLength;
+		return Value;
+
+	case Random:
+		return (Random64 () % Pages) * IO_SIZE;
+
+	default:
+		Value = Random64 ();
+		if (Value % 10 != 0) {
+			Pages /= 16;
+		}
+		return ((Value >> 8) % Pages) * IO_SIZE;
+	}
+}
+
+
+VOID
+InitializeCache(
+	IN PVIEW_CACHE Cache,
+	IN ULONG ViewCount,
+	IN BOOLEAN Adaptive
+	)
+{
+	RamdiskInitializeViewCache (Cache,
+								CacheBuffer,
+								Section,
+								DiskLength,
+								ViewKilobytes * 1024,
+								ViewCount,
+								Adaptive ? MINIMUM_MINIMUM_VIEW_COUNT : ViewCount,
+								Adaptive ? MaximumViewCount : ViewCount);
+}
+
+
+VOID
+DeleteCache(
+	IN PVIEW_CACHE Cache
+	)
+{
+	RamdiskDeleteViewCache (Cache);
+	DeleteCriticalSection (&Cache->Mutex);
+	CloseHandle (Cache->ViewSemaphore);
+}
+
+
+VOID
+TestCache(
+	VOID
+	)
+{
+	VIEW_CACHE Cache;
+	ULONGLONG Offset;
+	ULONGLONG Sequence;
+	ULONG Length;
+	ULONG Errors;
+	ULONG i;
+	PUCHAR Va;
+
+	Errors = 0;
+
+	InitializeCache (&Cache, 8, TRUE);
+
+	//
+	// Stamp every page with its offset.
+	//
+
+	for (Offset = 0; Offset < DiskLength; Offset += IO_SIZE) {
+		Va = RamdiskMapView (&Cache, Offset, IO_SIZE, &Length);
+		if (Va == NULL || Length != IO_SIZE) {
+			if (Errors++ < 10) {
+				printf ("map %I64x failed\n", Offset);
+			}
+			continue;
+		}
+		*(PULONGLONG)Va = Offset;
+		RamdiskUnmapView (&Cache, Offset, Length);
+	}
+
+	//
+	// Read the pages back in each pattern.
+	//
+
+	Sequence = 0;
+
+	for (i = 0; i < PatternCount * 100000; i++) {
+		Offset = NextOffset ((TEST_PATTERN)(i % PatternCount), &Sequence);
+		Va = RamdiskMapView (&Cache, Offset, IO_SIZE, &Length);
+		if (Va == NULL || *(PULONGLONG)Va != Offset) {
+			if (Errors++ < 10) {
+				printf ("page %I64x read back wrong\n", Offset);
+			}
+		}
+		if (Va != NULL) {
+			RamdiskUnmapView (&Cache, Offset, Length);
+		}
+	}
+
+	//
+	// A range that crosses a view boundary is cut at the boundary.
+	//
+
+	Offset = (ULONGLONG)ViewKilobytes * 1024 - IO_SIZE;
+	Va = RamdiskMapView (&Cache, Offset, 2 * IO_SIZE, &Length);
+	if (Va == NULL || Length != IO_SIZE) {
+		printf ("range across a view boundary mapped %d bytes\n", Length);
+		Errors++;
+	}
+	if (Va != NULL) {
+		RamdiskUnmapView (&Cache, Offset, Length);
+	}
+
+	for (i = 0; i < Cache.MaximumViewCount; i++) {
+		if (Cache.ViewDescriptors[i].ReferenceCount != 0) {
+			printf ("view %d left referenced\n", i);
+			Errors++;
+		}
+	}
+
+	if (!NT_SUCCESS (RamdiskFlushViewCache (&Cache))) {
+		printf ("flush failed\n");
+		Errors++;
+	}
+
+	DeleteCache (&Cache);
+
+	if (Errors != 0) {
+		printf ("view cache FAILED, %d errors\n\n", Errors);
+		Failures++;
+	} else {
+		printf ("view cache maps every page correctly\n\n");
+	}
+}
+
+
+VOID
+BenchmarkCache(
+	IN ULONG ViewCount,
+	IN BOOLEAN Adaptive,
+	IN TEST_PATTERN Pattern,
+	OUT PTEST_RESULT Result
+	)
+{
+	VIEW_CACHE Cache;
+	LARGE_INTEGER Frequency;
+	LARGE_INTEGER Start;
+	LARGE_INTEGER Now;
+	LONGLONG End;
+	ULONGLONG Reads;
+	ULONGLONG Offset;
+	ULONGLONG Sequence;
+	ULONG Length;
+	ULONG i;
+	PUCHAR Va;
+	UCHAR Buffer [IO_SIZE];
+
+	InitializeCache (&Cache, ViewCount, Adaptive);
+
+	QueryPerformanceFrequency (&Frequency);
+	QueryPerformanceCounter (&Start);
+	End = Start.QuadPart + Frequency.QuadPart * Duration / 1000;
+
+	Reads = 0;
+	Sequence = 0;
+
+	do {
+		for (i = 0; i < 1024; i++) {
+			Offset = NextOffset (Pattern, &Sequence);
+			Va = RamdiskMapView (&Cache, Offset, IO_SIZE, &Length);
+			if (Va == NULL) {
+				printf ("map %I64x failed\n", Offset);
+				Failures++;
+				break;
+			}
+			CopyMemory (Buffer, Va, Length);
+			RamdiskUnmapView (&Cache, Offset, Length);
+		}
+		Reads += i;
+		QueryPerformanceCounter (&Now);
+	} while (Now.QuadPart < End && i == 1024);
+
+	Result->ReadsPerSecond = (double)Reads /
+		((double)(Now.QuadPart - Start.QuadPart) / (double)Frequency.QuadPart);
+	Result->HitRate = 100.0 * (double)Cache.Hits /
+		(double)(Cache.Hits + Cache.Misses);
+	Result->FinalViewCount = Cache.ViewCount;
+
+	DeleteCache (&Cache);
+}
+
+
+int
+__cdecl
+main(
+	int argc,
+	char* argv[]
+	)
+{
+	TEST_RESULT Fixed;
+	TEST_RESULT Adaptive;
+	ULONG Pattern;
+	ULONG i;
+	int arg;
+
+	for (arg = 1; arg < argc; arg++) {
+		if ((argv[arg][0] != '-' && argv[arg][0] != '/') || arg + 1 == argc) {
+			goto Usage;
+		}
+		switch (argv[arg][1]) {
+		case 'd':
+			DiskMegabytes = atoi (argv[++arg]);
+			break;
+		case 'l':
+			ViewKilobytes = atoi (argv[++arg]);
+			break;
+		case 't':
+			Duration = atoi (argv[++arg]);
+			break;
+		default:
+			goto Usage;
+		}
+	}
+
+	if (DiskMegabytes == 0 ||
+		ViewKilobytes < 64 ||
+		(ViewKilobytes & (ViewKilobytes - 1)) != 0) {
+		goto Usage;
+	}
+
+	DiskLength = (ULONGLONG)DiskMegabytes * 1024 * 1024;
+
+	//
+	// As many views as fit in the default per-disk view length.
+	//
+
+	MaximumViewCount = DEFAULT_MAXIMUM_PER_DISK_VIEW_LENGTH / (ViewKilobytes * 1024);
+	if (MaximumViewCount > MAXIMUM_MAXIMUM_VIEW_COUNT) {
+		MaximumViewCount = MAXIMUM_MAXIMUM_VIEW_COUNT;
+	}
+	if (MaximumViewCount < MINIMUM_MINIMUM_VIEW_COUNT) {
+		MaximumViewCount = MINIMUM_MINIMUM_VIEW_COUNT;
+	}
+
+	Section = CreateFileMapping (INVALID_HANDLE_VALUE,
+								 NULL,
+								 PAGE_READWRITE,
+								 (ULONG)(DiskLength >> 32),
+								 (ULONG)DiskLength,
+								 NULL);
+	if (Section == NULL) {
+		printf ("Failed to create a %d MB section: %d\n", DiskMegabytes, GetLastError ());
+		return 1;
+	}
+
+	CacheBuffer = malloc (RamdiskViewCacheAllocationSize (MAXIMUM_MAXIMUM_VIEW_COUNT));
+	if (CacheBuffer == NULL) {
+		printf ("Failed to allocate the view descriptors!\n");
+		return 1;
+	}
+
+	printf ("%d MB disk, %d KB views, adaptive pool of %d to %d views\n\n",
+			DiskMegabytes,
+			ViewKilobytes,
+			MINIMUM_MINIMUM_VIEW_COUNT,
+			MaximumViewCount);
+
+	TestCache ();
+
+	printf ("4KB reads per second\n\n");
+	printf ("pattern     views     fixed   hit%%    adaptive   hit%%  views\n");
+
+	for (Pattern = 0; Pattern < PatternCount; Pattern++) {
+		for (i = 0; i < sizeof (ViewCounts) / sizeof (ViewCounts[0]); i++) {
+
+			if (ViewCounts[i] > MaximumViewCount) {
+				break;
+			}
+
+			BenchmarkCache (ViewCounts[i], FALSE, (TEST_PATTERN)Pattern, &Fixed);
+			BenchmarkCache (ViewCounts[i], TRUE, (TEST_PATTERN)Pattern, &Adaptive);
+
+			printf ("%-10s  %5d  %8.0f  %5.1f    %8.0f  %5.1f  %5d\n",
+					PatternNames[Pattern],
+					ViewCounts[i],
+					Fixed.ReadsPerSecond,
+					Fixed.HitRate,
+					Adaptive.ReadsPerSecond,
+					Adaptive.HitRate,
+					Adaptive.FinalViewCount);
+		}
+		printf ("\n");
+	}
+
+	free (CacheBuffer);
+	CloseHandle (Section);
+
+	if (Failures != 0) {
+		printf ("FAILED\n");
+		return 1;
+	}
+
+	return 0;
+
+Usage:
+	printf ("usage: tviews [-d megabytes] [-l view kilobytes] [-t milliseconds]\n");
+	return 2;
+}
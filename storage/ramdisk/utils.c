@@ -127,11 +127,9 @@ Return Value:
 --*/
 
 {
-    NTSTATUS status;
     PUCHAR va;
     ULONGLONG diskRelativeOffset;
     ULONGLONG fileRelativeOffset;
-    ULONG viewRelativeOffset;
 
     DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
                 ("RamdiskMapPages: offset %I64x, length %x\n", Offset, RequestedLength) );
@@ -146,365 +144,33 @@ Return Value:
     diskRelativeOffset = Offset;
     fileRelativeOffset = DiskExtension->DiskOffset + diskRelativeOffset;
 
-    if ( RAMDISK_IS_FILE_BACKED(DiskExtension->DiskType) ) {
+    if ( RAMDISK_IS_MEMORY_BACKED(DiskExtension) ) {
 
         //
-        // For a file-backed RAM disk, we need to map the range into memory.
+        // For a memory-backed RAM disk, the range is already mapped. The
+        // memory store returns the part of it that is in one chunk.
         //
 
-        while ( TRUE ) {
-        
-            PLIST_ENTRY listEntry;
-            PVIEW view;
-    
-            //
-            // Lock the list of view descriptors.
-            //
-    
-            KeEnterCriticalRegion();
-            ExAcquireFastMutex( &DiskExtension->Mutex );
-    
-            //
-            // Walk the list of view descriptors. Look for one that includes the
-            // start of the range we're mapping.
-            //
-    
-            DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                        ("RamdiskMapPages: looking for matching view; file offset %I64x\n",
-                        fileRelativeOffset) );
-
-            listEntry = DiskExtension->ViewsByOffset.Flink;
-    
-            while ( listEntry != &DiskExtension->ViewsByOffset ) {
-    
-                view = CONTAINING_RECORD( listEntry, VIEW, ByOffsetListEntry );
-    
-                DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                            ("RamdiskMapPages: view %p; offset %I64x, length %x\n",
-                                view, view->Offset, view->Length) );
+        va = RamdiskMapMemoryStore(
+                &DiskExtension->MemoryStore,
+                diskRelativeOffset,
+                RequestedLength,
+                ActualLength
+                );
 
-                ASSERT( (view->Offset + view->Length) >= view->Offset );
+    } else if ( RAMDISK_IS_FILE_BACKED(DiskExtension->DiskType) ) {
 
-                if ( (view->Offset <= fileRelativeOffset) &&
-                     (view->Offset + view->Length) > fileRelativeOffset ) {
-    
-                    //
-                    // This view includes the start of our range. Reference it.
-                    //
-    
-                    DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                                ("RamdiskMapPages: choosing existing view %p; offset %I64x, length %x\n",
-                                    view, view->Offset, view->Length) );
-    
-                    if ( !view->Permanent ) {
-                    
-                        view->ReferenceCount++;
-
-                        DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                                    ("RamdiskMapPages: view %p; new refcount %x\n",
-                                        view, view->ReferenceCount) );
-        
-                    } else {
-
-                        DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                                    ("RamdiskMapPages: view %p is permanent\n", view) );
-                    }
-
-                    //
-                    // Move the view to the front of the MRU list.
-                    //
-    
-                    RemoveEntryList( &view->ByMruListEntry );
-                    InsertHeadList( &DiskExtension->ViewsByMru, &view->ByMruListEntry );
-    
-                    ExReleaseFastMutex( &DiskExtension->Mutex );
-                    KeLeaveCriticalRegion();
-
-                    //
-                    // Calculate the amount of data that the caller can look
-                    // at in this range. Usually this will be the requested
-                    // amount, but if the caller's offset is close to the end
-                    // of a view, the caller will only be able to look at data
-                    // up to the end of the view.
-                    //
-
-                    viewRelativeOffset = (ULONG)(fileRelativeOffset - view->Offset);
-
-                    *ActualLength = view->Length - viewRelativeOffset;
-                    if ( *ActualLength > RequestedLength ) {
-                        *ActualLength = RequestedLength;
-                    }
-
-                    DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                                ("RamdiskMapPages: requested length %x; mapped length %x\n",
-                                    RequestedLength, *ActualLength) );
-                    DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                                ("RamdiskMapPages: view base %p; returned VA %p\n",
-                                    view->Address,
-                                    view->Address + viewRelativeOffset) );
-
-                    //
-                    // Return the virtual address corresponding to the caller's
-                    // specified offset, which will usually be offset from the
-                    // base of the view.
-                    //
-
-                    return view->Address + viewRelativeOffset;
-                }
-    
-                //
-                // This view does not include the start of our range. If the view
-                // starts above the start of our range, then our range is not
-                // currently mapped.
-                //
-    
-                if ( view->Offset > fileRelativeOffset ) {
-    
-                    DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                                ("%s", "RamdiskMapPages: view too high; our range not mapped\n") );
-
-                    break;
-                }
-    
-                //
-                // Check the next view in the list.
-                //
-    
-                listEntry = listEntry->Flink;
-            }
-    
-            //
-            // We didn't find a view that maps the start of our range. Look for a
-            // free view descriptor.
-            //
+        //
+        // For a file-backed RAM disk, we need to map the range into memory.
+        // The view cache does this.
+        //
 
-            DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                        ("%s", "RamdiskMapPages: looking for free view\n") );
-
-            listEntry = DiskExtension->ViewsByMru.Blink;
-      
-            while ( listEntry != &DiskExtension->ViewsByMru ) {
-      
-                view = CONTAINING_RECORD( listEntry, VIEW, ByMruListEntry );
-      
-                DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                            ("RamdiskMapPages: view %p; permanent %x, refcount %x\n",
-                                view, view->Permanent, view->ReferenceCount) );
-
-                if ( !view->Permanent && (view->ReferenceCount == 0) ) {
-      
-                    //
-                    // This view descriptor is free. If it's currently mapped,
-                    // unmap it.
-                    //
-      
-                    PVOID mappedAddress;
-                    ULONGLONG mappedOffset;
-                    SIZE_T mappedLength;
-      
-                    DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                                ("RamdiskMapPages: view %p is free\n", view) );
-
-                    if ( view->Address != NULL ) {
-      
-                        DBGPRINT( DBG_WINDOW, DBG_VERBOSE,
-                                    ("RamdiskMapPages: unmapping view %p; offset %I64x, "
-                                     "length %x, addr %p\n", view, view->Offset,
-                                     view->Length, view->Address) );
-
-                        MmUnmapViewOfSection( PsGetCurrentProcess(), view->Address );
-
-                        //
-                        // Reset the view descriptor and move it to the tail of
-                        // the MRU list and the head of the by-offset list. We
-                        // do this here in case we have to bail later (because
-                        // mapping a new view fails).
-                        //
-
-                        view->Offset = 0;
-                        view->Length = 0;
-                        view->Address = NULL;
-      
-                        RemoveEntryList( listEntry );
-                        InsertTailList( &DiskExtension->ViewsByMru, listEntry );
-
-                        RemoveEntryList( &view->ByOffsetListEntry );
-                        InsertHeadList( &DiskExtension->ViewsByOffset, &view->ByOffsetListEntry );
-                    }
-      
-                    //
-                    // Map a view to include the start of our range. Round the
-                    // caller's offset down to the start of a view range.
-                    //
-      
-                    mappedOffset = fileRelativeOffset & ~(ULONGLONG)(DiskExtension->ViewLength - 1);
-                    mappedLength = DiskExtension->ViewLength;
-                    if ( (mappedOffset + mappedLength) > DiskExtension->FileRelativeEndOfDisk) {
-                        mappedLength = (SIZE_T)(DiskExtension->FileRelativeEndOfDisk - mappedOffset);
-                    }
-                    mappedAddress = NULL;
-      
-                    DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                                ("RamdiskMapPages: remapping view %p; offset %I64x, "
-                                 "length %x\n", view, mappedOffset, mappedLength) );
-
-                    status = MmMapViewOfSection(
-                                DiskExtension->SectionObject,
-                                PsGetCurrentProcess(),
-                                &mappedAddress,
-                                0,
-                                0,
-                                (PLARGE_INTEGER)&mappedOffset,
-                                &mappedLength,
-                                ViewUnmap,
-                                0,
-                                PAGE_READWRITE
-                                );
-      
-                    if ( !NT_SUCCESS(status) ) {
-      
-                        //
-                        // Unable to map the range. Inform the caller by returning
-                        // NULL.
-                        //
-                        // ISSUE: Think about unmapping another region to see if
-                        // mapping will then succeed.
-                        //
-      
-                        DBGPRINT( DBG_WINDOW, DBG_ERROR,
-                                    ("RamdiskMapPages: unable to map view: %x\n", status) );
-    
-                        ExReleaseFastMutex( &DiskExtension->Mutex );
-                        KeLeaveCriticalRegion();
-        
-                        return NULL;
-                    }
-      
-                    DBGPRINT( DBG_WINDOW, DBG_VERBOSE,
-                                ("RamdiskMapPages: remapped view %p; offset %I64x, "
-                                 "length %x, addr %p\n", view, mappedOffset, mappedLength,
-                                 mappedAddress) );
-
-                    //
-                    // Capture the mapped range information into the view
-                    // descriptor. Set the reference count to 1. Insert the
-                    // view at the front of the MRU list, and at the
-                    // appropriate point in the by-offset list.
-                    //
-
-                    view->Offset = mappedOffset;
-                    view->Length = (ULONG)mappedLength;
-                    view->Address = mappedAddress;
-      
-                    ASSERT( (view->Offset + view->Length) >= view->Offset );
-
-                    view->ReferenceCount = 1;
-      
-                    RemoveEntryList( &view->ByMruListEntry );
-                    InsertHeadList( &DiskExtension->ViewsByMru, &view->ByMruListEntry );
-
-                    //
-                    // Remove the view descriptor from its current point in
-                    // the by-offset list (at or near the front, because it's
-                    // currently unmapped). Scan from the tail of the by-offset
-                    // list (highest offset down), looking for the first view
-                    // that has an offset less than or equal to the new view.
-                    // Insert the new view after that view. (If there are no
-                    // views with an offset <= this one, it goes at the front
-                    // of the list.)
-                    //
-
-                    RemoveEntryList( &view->ByOffsetListEntry );
-
-                    listEntry = DiskExtension->ViewsByOffset.Blink;
-            
-                    while ( listEntry != &DiskExtension->ViewsByOffset ) {
-            
-                        PVIEW view2 = CONTAINING_RECORD( listEntry, VIEW, ByOffsetListEntry );
-            
-                        if ( view2->Offset <= view->Offset ) {
-
-                            break;
-                        }
-            
-                        listEntry = listEntry->Blink;
-                    }
-
-                    InsertHeadList( listEntry, &view->ByOffsetListEntry );
-
-                    ExReleaseFastMutex( &DiskExtension->Mutex );
-                    KeLeaveCriticalRegion();
-      
-                    //
-                    // Calculate the amount of data that the caller can look
-                    // at in this range. Usually this will be the requested
-                    // amount, but if the caller's offset is close to the end
-                    // of a view, the caller will only be able to look at data
-                    // up to the end of the view.
-                    //
-
-                    viewRelativeOffset = (ULONG)(fileRelativeOffset - view->Offset);
-
-                    *ActualLength = view->Length - viewRelativeOffset;
-                    if ( *ActualLength > RequestedLength ) {
-                        *ActualLength = RequestedLength;
-                    }
-      
-                    DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                                ("RamdiskMapPages: requested length %x; mapped length %x\n",
-                                    RequestedLength, *ActualLength) );
-                    DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                                ("RamdiskMapPages: view base %p; returned VA %p\n",
-                                    view->Address,
-                                    view->Address + viewRelativeOffset) );
-    
-                    //
-                    // Return the virtual address corresponding to the caller's
-                    // specified offset, which will usually be offset from the
-                    // base of the view.
-                    //
-
-                    return view->Address + viewRelativeOffset;
-                }
-      
-                //
-                // This view is not free. Try the previous view in the MRU list.
-                //
-      
-                listEntry = listEntry->Blink;
-            }
-      
-            //
-            // We were unable to find a free view descriptor. Wait for one to
-            // become available and start over.
-            //
-            // Before leaving the critical section, increment the count of
-            // waiters. Then leave the critical section and wait on the
-            // semaphore. The unmap code uses the waiter count to determine
-            // how many times to release the semaphore. In this way, all
-            // threads that are waiting or have decided to wait when the
-            // unmap code runs will be awakened.
-            //
-      
-            DiskExtension->ViewWaiterCount++;
-      
-            DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                        ("RamdiskMapPages: can't find free view, so waiting; new waiter count %x\n",
-                            DiskExtension->ViewWaiterCount) );
-
-            ExReleaseFastMutex( &DiskExtension->Mutex );
-            KeLeaveCriticalRegion();
-            
-            status = KeWaitForSingleObject(
-                        &DiskExtension->ViewSemaphore,
-                        Executive,
-                        KernelMode,
-                        FALSE,
-                        NULL );
-
-            DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                        ("%s", "RamdiskMapPages: done waiting for free view\n") );
-        }
+        va = RamdiskMapView(
+                &DiskExtension->ViewCache,
+                fileRelativeOffset,
+                RequestedLength,
+                ActualLength
+                );
 
     } else if ( DiskExtension->DiskType == RAMDISK_TYPE_BOOT_DISK ) {
 
@@ -602,7 +268,6 @@ Return Value:
 {
     ULONGLONG diskRelativeOffset;
     ULONGLONG fileRelativeOffset;
-    ULONG viewRelativeOffset;
 
     //
     // The input Offset is relative to the start of the disk image, which
@@ -614,156 +279,23 @@ Return Value:
     diskRelativeOffset = Offset;
     fileRelativeOffset = DiskExtension->DiskOffset + diskRelativeOffset;
 
-    if ( RAMDISK_IS_FILE_BACKED(DiskExtension->DiskType) ) {
+    if ( RAMDISK_IS_MEMORY_BACKED(DiskExtension) ) {
 
         //
-        // For a file-backed RAM disk, we need to decrement the reference
-        // count on all views that cover the specified range.
-        //
-        // Note: In the current implementation, no caller ever maps more
-        // than one range at a time, and therefore no call to this routine
-        // will need to dereference more than one view. But this routine
-        // is written to allow for ranges that cover multiple views.
+        // For a memory-backed RAM disk, let the memory store know that we
+        // are done with the range.
         //
 
-        PLIST_ENTRY listEntry;
-        PVIEW view;
-        ULONGLONG rangeStart = fileRelativeOffset;
-        ULONGLONG rangeEnd = fileRelativeOffset + Length;
-        BOOLEAN wakeWaiters = FALSE;
-
-        //
-        // Lock the list of view descriptors.
-        //
+        RamdiskUnmapMemoryStore( &DiskExtension->MemoryStore );
 
-        KeEnterCriticalRegion();
-        ExAcquireFastMutex( &DiskExtension->Mutex );
+    } else if ( RAMDISK_IS_FILE_BACKED(DiskExtension->DiskType) ) {
 
         //
-        // Walk the list of view descriptors. For each one that includes the
-        // range that we're unmapping, decrement the reference count.
-        //
-
-        listEntry = DiskExtension->ViewsByOffset.Flink;
-
-        while ( Length != 0 ) {
-
-            ASSERT( listEntry != &DiskExtension->ViewsByOffset );
-
-            view = CONTAINING_RECORD( listEntry, VIEW, ByOffsetListEntry );
-
-            DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                        ("RamdiskUnmapPages: view %p; offset %I64x, length %x\n",
-                            view, view->Offset, view->Length) );
-
-            if ( (view->Offset + view->Length) <= rangeStart ) {
-
-                //
-                // This view lies entirely below our range. Move on.
-                //
-
-                DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                            ("%s", "RamdiskMapPages: view too low; skipping\n") );
-
-                listEntry = listEntry->Flink;
-
-                ASSERT( listEntry != &DiskExtension->ViewsByOffset );
-
-                continue;
-            }
-
-            //
-            // This view does not lie below our range. Since the view list
-            // is ordered by offset, and we have length left to unmap, this
-            // view must NOT lie entirely ABOVE our range.
-            //
-
-            ASSERT( view->Offset < rangeEnd );
-
-            //
-            // Decrement the reference count for this view. If the count goes
-            // to zero, we need to inform any waiters that at least one free
-            // view is available.
-            //
-            // ISSUE: Note that unreferenced views remain mapped indefinitely.
-            // We only unmap a view when we need to map a different view. If
-            // a RAM disk goes idle, its views remain mapped, using up virtual
-            // address space in the system process. With the current default
-            // view count and length, this is 8 MB of VA. This is probably
-            // not enough to make it worthwhile to implement a timer to unmap
-            // idle views.
-            //
-
-            DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                        ("RamdiskUnmapPages: dereferencing view %p; offset %I64x, length %x\n",
-                            view, view->Offset, view->Length) );
-
-            if ( !view->Permanent ) {
-
-                view->ReferenceCount--;
-
-                if ( view->ReferenceCount == 0 ) {
-                    wakeWaiters = TRUE;
-                }
-
-                DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                            ("RamdiskUnmapPages: view %p; new refcount %x\n",
-                                view, view->ReferenceCount) );
-
-            } else {
-
-                DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                            ("RamdiskUnmapPages: view %p is permanent\n", view) );
-            }
-
-            //
-            // Subtract the length of this view from the amount we're
-            // unmapping. If the view fully encompasses our range, we're done.
-            //
-
-            if ( (view->Offset + view->Length) >= rangeEnd ) {
-
-                Length = 0;
-
-            } else {
-
-                viewRelativeOffset = (ULONG)(fileRelativeOffset - view->Offset);
-                Length -= view->Length - viewRelativeOffset;
-                Offset = view->Offset + view->Length;
-
-                ASSERT( Length != 0 );
-
-                //
-                // Move to the next view.
-                //
-
-                listEntry = listEntry->Flink;
-            }
-        }
-
-        //
-        // If one or more views are now free, and there are threads waiting,
-        // wake them up now.
+        // For a file-backed RAM disk, we need to decrement the reference
+        // count on all views that cover the specified range.
         //
 
-        if ( wakeWaiters && (DiskExtension->ViewWaiterCount != 0) ) {
-
-            DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                        ("RamdiskUnmapPages: waking %x waiters\n",
-                            DiskExtension->ViewWaiterCount) );
-
-            KeReleaseSemaphore(
-                &DiskExtension->ViewSemaphore,
-                0,
-                DiskExtension->ViewWaiterCount,
-                FALSE
-                );
-
-            DiskExtension->ViewWaiterCount = 0;
-        }
-
-        ExReleaseFastMutex( &DiskExtension->Mutex );
-        KeLeaveCriticalRegion();
+        RamdiskUnmapView( &DiskExtension->ViewCache, fileRelativeOffset, Length );
 
     } else if ( DiskExtension->DiskType == RAMDISK_TYPE_BOOT_DISK ) {
 
@@ -796,87 +328,17 @@ RamdiskFlushViews (
     IN PDISK_EXTENSION DiskExtension
     )
 {
-    NTSTATUS status;
-    NTSTATUS returnStatus;
-    IO_STATUS_BLOCK iosb;
-    PLIST_ENTRY listEntry;
-    PVIEW view;
-    SIZE_T viewLength;
-
     PAGED_CODE();
 
     DBGPRINT( DBG_WINDOW, DBG_PAINFUL, ("%s", "RamdiskFlushViews\n") );
 
-    ASSERT( RAMDISK_IS_FILE_BACKED(DiskExtension->DiskType) );
-
-    //
-    // Lock the list of view descriptors.
-    //
+    ASSERT( RAMDISK_USES_VIEWS(DiskExtension) );
 
     //
-    // Walk the list of view descriptors. For each one that is currently
-    // mapped, flush its virtual memory to the backing file.
+    // Flush every mapped view to the backing file.
     //
 
-    returnStatus = STATUS_SUCCESS;
-
-    KeEnterCriticalRegion();
-    ExAcquireFastMutex( &DiskExtension->Mutex );
-
-    listEntry = DiskExtension->ViewsByOffset.Flink;
-
-    while ( listEntry != &DiskExtension->ViewsByOffset ) {
-
-        view = CONTAINING_RECORD( listEntry, VIEW, ByOffsetListEntry );
-
-        DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                    ("RamdiskFlushViews: view %p; addr %p, offset %I64x, length %x\n",
-                        view, view->Address, view->Offset, view->Length) );
-
-        if ( view->Address != NULL ) {
-
-            //
-            // This view is mapped. Flush it.
-            //
-
-            DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
-                        ("%s", "RamdiskMapPages: view mapped; flushing\n") );
-
-            viewLength = view->Length;
-
-            status = ZwFlushVirtualMemory(
-                        NtCurrentProcess(),
-                        &view->Address,
-                        &viewLength,
-                        &iosb
-                        );
-
-            if ( NT_SUCCESS(status) ) {
-                status = iosb.Status;
-            }
-
-            if ( !NT_SUCCESS(status) ) {
-
-                DBGPRINT( DBG_WINDOW, DBG_ERROR,
-                            ("RamdiskFlushViews: ZwFlushVirtualMemory failed: %x\n", status) );
-
-                if ( returnStatus == STATUS_SUCCESS ) {
-                    returnStatus = status;
-                }
-            }
-        }
-
-        //
-        // Move to the next view.
-        //
-
-        listEntry = listEntry->Flink;
-    }
-
-    ExReleaseFastMutex( &DiskExtension->Mutex );
-    KeLeaveCriticalRegion();
-
-    return returnStatus;
+    return RamdiskFlushViewCache( &DiskExtension->ViewCache );
 
 } // RamdiskFlushViews
 
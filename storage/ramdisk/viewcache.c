@@ -0,0 +1,1141 @@
+/*++
+
+Copyright (c) 2001  Microsoft Corporation
+
+Module Name:
+
+    viewcache.c
+
+Abstract:
+
+    This file contains the view cache used to window the image of a
+    file-backed RAM disk into the system process.
+
+Environment:
+
+    Kernel mode only.
+
+Notes:
+
+    This file is also built into the user mode view cache benchmark, with
+    UTEST defined.
+
+Revision History:
+
+--*/
+
+#if !defined( UTEST )
+#include "precomp.h"
+#pragma hdrstop
+#else
+#include "viewcache.h"
+#endif
+
+//
+// Local functions.
+//
+
+ULONG
+RamdiskViewCacheBucketCount (
+    IN ULONG MaximumViewCount
+    );
+
+PVIEW
+RamdiskLookupView (
+    IN PVIEW_CACHE ViewCache,
+    IN ULONGLONG ViewNumber
+    );
+
+PVIEW
+RamdiskFindFreeView (
+    IN PVIEW_CACHE ViewCache
+    );
+
+VOID
+RamdiskReleaseViewMapping (
+    IN PVIEW_CACHE ViewCache,
+    IN PVIEW View
+    );
+
+ULONG
+RamdiskGrowViewPool (
+    IN PVIEW_CACHE ViewCache,
+    IN ULONG Count
+    );
+
+VOID
+RamdiskSizeViewPool (
+    IN PVIEW_CACHE ViewCache
+    );
+
+VOID
+RamdiskWakeViewWaiters (
+    IN PVIEW_CACHE ViewCache
+    );
+
+ULONG
+RamdiskViewCacheBucketCount (
+    IN ULONG MaximumViewCount
+    )
+
+/*++
+
+Routine Description:
+
+    This routine returns the number of hash buckets to use for a view cache.
+    This is the smallest power of two that is at least twice the number of
+    views, so that the chains stay short.
+
+Arguments:
+
+    MaximumViewCount - the largest number of views the cache may map
+
+Return Value:
+
+    ULONG - the number of hash buckets
+
+--*/
+
+{
+    ULONG bucketCount;
+
+    bucketCount = 1;
+
+    while ( bucketCount < (2 * MaximumViewCount) ) {
+        bucketCount <<= 1;
+    }
+
+    return bucketCount;
+
+} // RamdiskViewCacheBucketCount
+
+SIZE_T
+RamdiskViewCacheAllocationSize (
+    IN ULONG MaximumViewCount
+    )
+
+/*++
+
+Routine Description:
+
+    This routine returns the size of the buffer that must be passed to
+    RamdiskInitializeViewCache. The buffer holds the view descriptors and
+    the hash buckets.
+
+Arguments:
+
+    MaximumViewCount - the largest number of views the cache may map
+
+Return Value:
+
+    SIZE_T - the size of the buffer, in bytes
+
+--*/
+
+{
+    return (MaximumViewCount * sizeof(VIEW)) +
+           (RamdiskViewCacheBucketCount( MaximumViewCount ) * sizeof(LIST_ENTRY));
+
+} // RamdiskViewCacheAllocationSize
+
+VOID
+RamdiskInitializeViewCache (
+    OUT PVIEW_CACHE ViewCache,
+    IN PVOID Buffer,
+    IN PVOID SectionObject,
+    IN ULONGLONG EndOffset,
+    IN ULONG ViewLength,
+    IN ULONG ViewCount,
+    IN ULONG MinimumViewCount,
+    IN ULONG MaximumViewCount
+    )
+
+/*++
+
+Routine Description:
+
+    This routine initializes a view cache. Every view starts out unmapped.
+
+Arguments:
+
+    ViewCache - a pointer to the view cache to initialize
+
+    Buffer - a pointer to RamdiskViewCacheAllocationSize( MaximumViewCount )
+        bytes of paged pool. The view cache owns the buffer until
+        RamdiskDeleteViewCache is called; the caller frees it after that.
+
+    SectionObject - a referenced pointer to the section for the backing file
+
+    EndOffset - the file-relative offset of the end of the disk image
+
+    ViewLength - the length of each view. This is rounded down to a power
+        of two.
+
+    ViewCount - the initial number of views in the pool
+
+    MinimumViewCount - the smallest number of views the pool may shrink to
+
+    MaximumViewCount - the largest number of views the pool may grow to
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    ULONG i;
+    ULONG bucketCount;
+    PVIEW view;
+
+    ASSERT( MinimumViewCount != 0 );
+    ASSERT( MinimumViewCount <= ViewCount );
+    ASSERT( ViewCount <= MaximumViewCount );
+
+    RtlZeroMemory( ViewCache, sizeof(VIEW_CACHE) );
+
+    ExInitializeFastMutex( &ViewCache->Mutex );
+    KeInitializeSemaphore( &ViewCache->ViewSemaphore, 0, MAXLONG );
+
+    ViewCache->SectionObject = SectionObject;
+    ViewCache->EndOffset = EndOffset;
+
+    //
+    // Views are aligned to their length, so the length must be a power of
+    // two.
+    //
+
+    ViewCache->ViewShift = 0;
+
+    while ( ((ULONGLONG)2 << ViewCache->ViewShift) <= ViewLength ) {
+        ViewCache->ViewShift++;
+    }
+
+    ViewCache->ViewLength = 1 << ViewCache->ViewShift;
+
+    ViewCache->ViewCount = ViewCount;
+    ViewCache->MinimumViewCount = MinimumViewCount;
+    ViewCache->MaximumViewCount = MaximumViewCount;
+
+    //
+    // Carve the buffer into the view descriptors and the hash buckets.
+    //
+
+    bucketCount = RamdiskViewCacheBucketCount( MaximumViewCount );
+
+    ViewCache->ViewDescriptors = Buffer;
+    ViewCache->ViewsByHash = (PLIST_ENTRY)(ViewCache->ViewDescriptors + MaximumViewCount);
+    ViewCache->HashMask = bucketCount - 1;
+
+    RtlZeroMemory( ViewCache->ViewDescriptors, MaximumViewCount * sizeof(VIEW) );
+
+    for ( i = 0; i < bucketCount; i++ ) {
+        InitializeListHead( &ViewCache->ViewsByHash[i] );
+    }
+
+    //
+    // Put the first ViewCount descriptors in the pool and park the rest.
+    // Window numbers start at 1, so views that have never been used look
+    // idle.
+    //
+
+    InitializeListHead( &ViewCache->ViewsByMru );
+    InitializeListHead( &ViewCache->IdleViews );
+
+    ViewCache->Window = 1;
+
+    view = ViewCache->ViewDescriptors;
+
+    for ( i = 0; i < MaximumViewCount; i++ ) {
+
+        InitializeListHead( &view->ByHashListEntry );
+
+        if ( i < ViewCount ) {
+            InsertTailList( &ViewCache->ViewsByMru, &view->ByMruListEntry );
+        } else {
+            InsertTailList( &ViewCache->IdleViews, &view->ByMruListEntry );
+        }
+
+        view++;
+    }
+
+    return;
+
+} // RamdiskInitializeViewCache
+
+VOID
+RamdiskDeleteViewCache (
+    IN PVIEW_CACHE ViewCache
+    )
+
+/*++
+
+Routine Description:
+
+    This routine unmaps all of the views in a view cache. The caller then
+    frees the buffer passed to RamdiskInitializeViewCache, which is
+    ViewCache->ViewDescriptors.
+
+Arguments:
+
+    ViewCache - a pointer to the view cache
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    ULONG i;
+    PVIEW view;
+
+    ASSERT( ViewCache->ViewWaiterCount == 0 );
+
+    view = ViewCache->ViewDescriptors;
+
+    for ( i = 0; i < ViewCache->MaximumViewCount; i++ ) {
+
+        ASSERT( view->ReferenceCount == 0 );
+
+        if ( view->Address != NULL ) {
+
+            DBGPRINT( DBG_WINDOW, DBG_VERBOSE,
+                        ("RamdiskDeleteViewCache: unmapping view %p; addr %p\n",
+                            view, view->Address) );
+
+            MmUnmapViewOfSection( PsGetCurrentProcess(), view->Address );
+            view->Address = NULL;
+        }
+
+        view++;
+    }
+
+    DBGPRINT( DBG_WINDOW, DBG_INFO,
+                ("RamdiskDeleteViewCache: hits %I64d, misses %I64d, waits %d, "
+                 "grows %d, shrinks %d, final view count %d\n",
+                    ViewCache->Hits, ViewCache->Misses, ViewCache->Waits,
+                    ViewCache->Grows, ViewCache->Shrinks, ViewCache->ViewCount) );
+
+    return;
+
+} // RamdiskDeleteViewCache
+
+PVIEW
+RamdiskLookupView (
+    IN PVIEW_CACHE ViewCache,
+    IN ULONGLONG ViewNumber
+    )
+
+/*++
+
+Routine Description:
+
+    This routine finds the mapped view with the given view number. The
+    caller must hold the view cache mutex.
+
+Arguments:
+
+    ViewCache - a pointer to the view cache
+
+    ViewNumber - the file-relative offset of the view divided by the view
+        length
+
+Return Value:
+
+    PVIEW - a pointer to the view; NULL if the view is not mapped
+
+--*/
+
+{
+    PLIST_ENTRY listHead;
+    PLIST_ENTRY listEntry;
+    PVIEW view;
+    ULONGLONG viewOffset;
+
+    viewOffset = ViewNumber << ViewCache->ViewShift;
+
+    //
+    // Try the most recently used view first. Sequential I/O and I/O
+    // split across a view boundary usually find their view here.
+    //
+
+    view = CONTAINING_RECORD( ViewCache->ViewsByMru.Flink, VIEW, ByMruListEntry );
+
+    if ( (view->Address != NULL) && (view->Offset == viewOffset) ) {
+        return view;
+    }
+
+    //
+    // Search the hash chain.
+    //
+
+    listHead = &ViewCache->ViewsByHash[(ULONG)ViewNumber & ViewCache->HashMask];
+
+    for ( listEntry = listHead->Flink; listEntry != listHead; listEntry = listEntry->Flink ) {
+
+        view = CONTAINING_RECORD( listEntry, VIEW, ByHashListEntry );
+
+        ASSERT( view->Address != NULL );
+
+        if ( view->Offset == viewOffset ) {
+            return view;
+        }
+    }
+
+    return NULL;
+
+} // RamdiskLookupView
+
+PVIEW
+RamdiskFindFreeView (
+    IN PVIEW_CACHE ViewCache
+    )
+
+/*++
+
+Routine Description:
+
+    This routine finds the least recently used view in the pool that is
+    not in use. The caller must hold the view cache mutex.
+
+Arguments:
+
+    ViewCache - a pointer to the view cache
+
+Return Value:
+
+    PVIEW - a pointer to the view; NULL if every view is in use
+
+--*/
+
+{
+    PLIST_ENTRY listEntry;
+    PVIEW view;
+
+    listEntry = ViewCache->ViewsByMru.Blink;
+
+    while ( listEntry != &ViewCache->ViewsByMru ) {
+
+        view = CONTAINING_RECORD( listEntry, VIEW, ByMruListEntry );
+
+        if ( !view->Permanent && (view->ReferenceCount == 0) ) {
+            return view;
+        }
+
+        listEntry = listEntry->Blink;
+    }
+
+    return NULL;
+
+} // RamdiskFindFreeView
+
+VOID
+RamdiskReleaseViewMapping (
+    IN PVIEW_CACHE ViewCache,
+    IN PVIEW View
+    )
+
+/*++
+
+Routine Description:
+
+    This routine unmaps a free view and removes it from the hash index. The
+    caller must hold the view cache mutex.
+
+Arguments:
+
+    ViewCache - a pointer to the view cache
+
+    View - a pointer to the view
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    ASSERT( !View->Permanent && (View->ReferenceCount == 0) );
+    ASSERT( View->Address != NULL );
+
+    DBGPRINT( DBG_WINDOW, DBG_VERBOSE,
+                ("RamdiskReleaseViewMapping: unmapping view %p; offset %I64x, "
+                 "length %x, addr %p\n", View, View->Offset,
+                 View->Length, View->Address) );
+
+    MmUnmapViewOfSection( PsGetCurrentProcess(), View->Address );
+
+    RemoveEntryList( &View->ByHashListEntry );
+    InitializeListHead( &View->ByHashListEntry );
+
+    View->Offset = 0;
+    View->Length = 0;
+    View->Address = NULL;
+
+    UNREFERENCED_PARAMETER( ViewCache );
+
+    return;
+
+} // RamdiskReleaseViewMapping
+
+VOID
+RamdiskWakeViewWaiters (
+    IN PVIEW_CACHE ViewCache
+    )
+
+/*++
+
+Routine Description:
+
+    This routine wakes all threads that are waiting for a free view. The
+    caller must hold the view cache mutex.
+
+Arguments:
+
+    ViewCache - a pointer to the view cache
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    if ( ViewCache->ViewWaiterCount != 0 ) {
+
+        DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
+                    ("RamdiskWakeViewWaiters: waking %x waiters\n",
+                        ViewCache->ViewWaiterCount) );
+
+        KeReleaseSemaphore(
+            &ViewCache->ViewSemaphore,
+            0,
+            ViewCache->ViewWaiterCount,
+            FALSE
+            );
+
+        ViewCache->ViewWaiterCount = 0;
+    }
+
+    return;
+
+} // RamdiskWakeViewWaiters
+
+ULONG
+RamdiskGrowViewPool (
+    IN PVIEW_CACHE ViewCache,
+    IN ULONG Count
+    )
+
+/*++
+
+Routine Description:
+
+    This routine moves idle view descriptors into the pool. The new views
+    are unmapped and go at the back of the MRU list, so they are the first
+    to be taken for a new mapping. The caller must hold the view cache
+    mutex.
+
+Arguments:
+
+    ViewCache - a pointer to the view cache
+
+    Count - the number of views to add
+
+Return Value:
+
+    ULONG - the number of views added. This is less than Count if the pool
+        reaches MaximumViewCount.
+
+--*/
+
+{
+    PLIST_ENTRY listEntry;
+    PVIEW view;
+    ULONG added;
+
+    added = 0;
+
+    while ( (added < Count) && (ViewCache->ViewCount < ViewCache->MaximumViewCount) ) {
+
+        ASSERT( !IsListEmpty( &ViewCache->IdleViews ) );
+
+        listEntry = RemoveHeadList( &ViewCache->IdleViews );
+        view = CONTAINING_RECORD( listEntry, VIEW, ByMruListEntry );
+
+        ASSERT( view->Address == NULL );
+
+        view->LastUsedWindow = ViewCache->Window;
+        InsertTailList( &ViewCache->ViewsByMru, &view->ByMruListEntry );
+
+        ViewCache->ViewCount++;
+        added++;
+    }
+
+    if ( added != 0 ) {
+
+        ViewCache->Grows++;
+
+        DBGPRINT( DBG_WINDOW, DBG_VERBOSE,
+                    ("RamdiskGrowViewPool: added %d views; new view count %d\n",
+                        added, ViewCache->ViewCount) );
+
+        RamdiskWakeViewWaiters( ViewCache );
+    }
+
+    return added;
+
+} // RamdiskGrowViewPool
+
+VOID
+RamdiskSizeViewPool (
+    IN PVIEW_CACHE ViewCache
+    )
+
+/*++
+
+Routine Description:
+
+    This routine is called at the end of each sizing window to grow or
+    shrink the view pool based on the hit rate during the window. The
+    caller must hold the view cache mutex.
+
+    If too many lookups missed, the working set is bigger than the pool,
+    and the pool grows by a quarter. If nearly every lookup hit, views that
+    were not used at all during the window are unmapped and parked, which
+    gives back their system VA. Views that were used are left alone even
+    when the hit rate is high, so the pool does not shrink below the working
+    set and start to thrash.
+
+Arguments:
+
+    ViewCache - a pointer to the view cache
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PLIST_ENTRY listEntry;
+    PVIEW view;
+    ULONG count;
+
+    if ( (ViewCache->WindowMisses * VIEW_CACHE_GROW_MISS_RATIO) >
+                                                    ViewCache->WindowLookups ) {
+
+        count = ViewCache->ViewCount / 4;
+        if ( count == 0 ) {
+            count = 1;
+        }
+
+        RamdiskGrowViewPool( ViewCache, count );
+
+    } else if ( (ViewCache->WindowMisses * VIEW_CACHE_SHRINK_MISS_RATIO) <=
+                                                    ViewCache->WindowLookups ) {
+
+        count = ViewCache->ViewCount / 8;
+        if ( count == 0 ) {
+            count = 1;
+        }
+
+        //
+        // Walk the MRU list from the back. Once we reach a view that was
+        // used during this window, every view in front of it was too.
+        //
+
+        listEntry = ViewCache->ViewsByMru.Blink;
+
+        while ( (count != 0) &&
+                (ViewCache->ViewCount > ViewCache->MinimumViewCount) &&
+                (listEntry != &ViewCache->ViewsByMru) ) {
+
+            view = CONTAINING_RECORD( listEntry, VIEW, ByMruListEntry );
+            listEntry = listEntry->Blink;
+
+            if ( view->LastUsedWindow == ViewCache->Window ) {
+                break;
+            }
+
+            if ( view->Permanent || (view->ReferenceCount != 0) ) {
+                continue;
+            }
+
+            if ( view->Address != NULL ) {
+                RamdiskReleaseViewMapping( ViewCache, view );
+            }
+
+            RemoveEntryList( &view->ByMruListEntry );
+            InsertHeadList( &ViewCache->IdleViews, &view->ByMruListEntry );
+
+            ViewCache->ViewCount--;
+            count--;
+
+            ViewCache->Shrinks++;
+        }
+
+        DBGPRINT( DBG_WINDOW, DBG_VERBOSE,
+                    ("RamdiskSizeViewPool: view count %d\n", ViewCache->ViewCount) );
+    }
+
+    ViewCache->Window++;
+    ViewCache->WindowLookups = 0;
+    ViewCache->WindowMisses = 0;
+
+    return;
+
+} // RamdiskSizeViewPool
+
+PUCHAR
+RamdiskMapView (
+    IN PVIEW_CACHE ViewCache,
+    IN ULONGLONG Offset,
+    IN ULONG RequestedLength,
+    OUT PULONG ActualLength
+    )
+
+/*++
+
+Routine Description:
+
+    This routine maps pages of a file-backed RAM disk image into the system
+    process, using a view from the view cache.
+
+Arguments:
+
+    ViewCache - a pointer to the view cache
+
+    Offset - the offset into the backing file at which the mapping is to
+        start
+
+    RequestedLength - the desired length of the mapping
+
+    ActualLength - returns the actual length of the mapping. This will be less
+        than or equal to RequestedLength. If less than, the caller will need
+        to call again to get the remainder of the desired range mapped.
+        Because the number of available ranges may be limited, the caller
+        should execute the required operation on one segment of the range and
+        unmap it before mapping the next segment.
+
+Return Value:
+
+    PUCHAR - a pointer to the mapped space; NULL if the mapping failed
+
+--*/
+
+{
+    NTSTATUS status;
+    PVIEW view;
+    ULONGLONG viewNumber;
+    ULONG viewRelativeOffset;
+
+    viewNumber = Offset >> ViewCache->ViewShift;
+
+    //
+    // Lock the view cache.
+    //
+
+    KeEnterCriticalRegion();
+    ExAcquireFastMutex( &ViewCache->Mutex );
+
+    while ( TRUE ) {
+
+        PVOID mappedAddress;
+        ULONGLONG mappedOffset;
+        SIZE_T mappedLength;
+
+        //
+        // Look for a view that includes the start of the range we're
+        // mapping.
+        //
+
+        view = RamdiskLookupView( ViewCache, viewNumber );
+
+        if ( view != NULL ) {
+
+            DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
+                        ("RamdiskMapView: choosing existing view %p; offset %I64x, length %x\n",
+                            view, view->Offset, view->Length) );
+
+            ViewCache->Hits++;
+
+            break;
+        }
+
+        //
+        // Our range is not mapped. Look for a free view descriptor. If
+        // every view is in use and the pool can grow, add a view rather than
+        // wait for one.
+        //
+
+        view = RamdiskFindFreeView( ViewCache );
+
+        if ( (view == NULL) && (RamdiskGrowViewPool( ViewCache, 1 ) != 0) ) {
+
+            view = CONTAINING_RECORD( ViewCache->ViewsByMru.Blink, VIEW, ByMruListEntry );
+        }
+
+        if ( view == NULL ) {
+
+            //
+            // We were unable to find a free view descriptor. Wait for one to
+            // become available and start over.
+            //
+            // Before leaving the critical section, increment the count of
+            // waiters. Then leave the critical section and wait on the
+            // semaphore. The unmap code uses the waiter count to determine
+            // how many times to release the semaphore. In this way, all
+            // threads that are waiting or have decided to wait when the
+            // unmap code runs will be awakened.
+            //
+
+            ViewCache->ViewWaiterCount++;
+            ViewCache->Waits++;
+
+            DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
+                        ("RamdiskMapView: can't find free view, so waiting; new waiter count %x\n",
+                            ViewCache->ViewWaiterCount) );
+
+            ExReleaseFastMutex( &ViewCache->Mutex );
+            KeLeaveCriticalRegion();
+
+            status = KeWaitForSingleObject(
+                        &ViewCache->ViewSemaphore,
+                        Executive,
+                        KernelMode,
+                        FALSE,
+                        NULL );
+
+            KeEnterCriticalRegion();
+            ExAcquireFastMutex( &ViewCache->Mutex );
+
+            continue;
+        }
+
+        //
+        // This view descriptor is free. If it's currently mapped, unmap it.
+        // We do this here in case we have to bail later (because mapping a
+        // new view fails).
+        //
+
+        if ( view->Address != NULL ) {
+            RamdiskReleaseViewMapping( ViewCache, view );
+        }
+
+        //
+        // Map a view to include the start of our range.
+        //
+
+        mappedOffset = viewNumber << ViewCache->ViewShift;
+        mappedLength = ViewCache->ViewLength;
+        if ( (mappedOffset + mappedLength) > ViewCache->EndOffset ) {
+            mappedLength = (SIZE_T)(ViewCache->EndOffset - mappedOffset);
+        }
+        mappedAddress = NULL;
+
+        status = MmMapViewOfSection(
+                    ViewCache->SectionObject,
+                    PsGetCurrentProcess(),
+                    &mappedAddress,
+                    0,
+                    0,
+                    (PLARGE_INTEGER)&mappedOffset,
+                    &mappedLength,
+                    ViewUnmap,
+                    0,
+                    PAGE_READWRITE
+                    );
+
+        if ( !NT_SUCCESS(status) ) {
+
+            //
+            // Unable to map the range. Inform the caller by returning
+            // NULL.
+            //
+            // ISSUE: Think about unmapping another region to see if
+            // mapping will then succeed.
+            //
+
+            DBGPRINT( DBG_WINDOW, DBG_ERROR,
+                        ("RamdiskMapView: unable to map view: %x\n", status) );
+
+            ExReleaseFastMutex( &ViewCache->Mutex );
+            KeLeaveCriticalRegion();
+
+            return NULL;
+        }
+
+        DBGPRINT( DBG_WINDOW, DBG_VERBOSE,
+                    ("RamdiskMapView: remapped view %p; offset %I64x, "
+                     "length %x, addr %p\n", view, mappedOffset, mappedLength,
+                     mappedAddress) );
+
+        //
+        // Capture the mapped range information into the view descriptor
+        // and index it.
+        //
+
+        view->Offset = mappedOffset;
+        view->Length = (ULONG)mappedLength;
+        view->Address = mappedAddress;
+
+        ASSERT( (view->Offset + view->Length) >= view->Offset );
+
+        InsertHeadList(
+            &ViewCache->ViewsByHash[(ULONG)viewNumber & ViewCache->HashMask],
+            &view->ByHashListEntry
+            );
+
+        ViewCache->Misses++;
+        ViewCache->WindowMisses++;
+
+        break;
+    }
+
+    //
+    // Reference the view and move it to the front of the MRU list.
+    //
+
+    if ( !view->Permanent ) {
+        view->ReferenceCount++;
+    }
+
+    view->LastUsedWindow = ViewCache->Window;
+
+    if ( ViewCache->ViewsByMru.Flink != &view->ByMruListEntry ) {
+        RemoveEntryList( &view->ByMruListEntry );
+        InsertHeadList( &ViewCache->ViewsByMru, &view->ByMruListEntry );
+    }
+
+    //
+    // At the end of each window, resize the pool.
+    //
+
+    ViewCache->WindowLookups++;
+
+    if ( ViewCache->WindowLookups >= VIEW_CACHE_WINDOW ) {
+        RamdiskSizeViewPool( ViewCache );
+    }
+
+    ExReleaseFastMutex( &ViewCache->Mutex );
+    KeLeaveCriticalRegion();
+
+    //
+    // Calculate the amount of data that the caller can look at in this
+    // range. Usually this will be the requested amount, but if the caller's
+    // offset is close to the end of a view, the caller will only be able to
+    // look at data up to the end of the view.
+    //
+
+    viewRelativeOffset = (ULONG)(Offset - view->Offset);
+
+    *ActualLength = view->Length - viewRelativeOffset;
+    if ( *ActualLength > RequestedLength ) {
+        *ActualLength = RequestedLength;
+    }
+
+    DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
+                ("RamdiskMapView: requested length %x; mapped length %x; VA %p\n",
+                    RequestedLength, *ActualLength,
+                    view->Address + viewRelativeOffset) );
+
+    //
+    // Return the virtual address corresponding to the caller's specified
+    // offset, which will usually be offset from the base of the view.
+    //
+
+    return view->Address + viewRelativeOffset;
+
+} // RamdiskMapView
+
+VOID
+RamdiskUnmapView (
+    IN PVIEW_CACHE ViewCache,
+    IN ULONGLONG Offset,
+    IN ULONG Length
+    )
+
+/*++
+
+Routine Description:
+
+    This routine dereferences the views that cover a range previously
+    mapped by RamdiskMapView.
+
+    Unreferenced views remain mapped until they are needed for another
+    range, or until the pool shrinks.
+
+Arguments:
+
+    ViewCache - a pointer to the view cache
+
+    Offset - the offset into the backing file at which the mapping starts
+
+    Length - the length of the mapping
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PVIEW view;
+    ULONGLONG viewNumber;
+    ULONGLONG rangeEnd;
+    BOOLEAN wakeWaiters = FALSE;
+
+    ASSERT( Length != 0 );
+
+    viewNumber = Offset >> ViewCache->ViewShift;
+    rangeEnd = Offset + Length;
+
+    //
+    // Lock the view cache.
+    //
+
+    KeEnterCriticalRegion();
+    ExAcquireFastMutex( &ViewCache->Mutex );
+
+    //
+    // Dereference each view that includes part of the range. In the
+    // current implementation no caller maps more than one view at a time,
+    // but this allows for ranges that cover several views.
+    //
+
+    while ( TRUE ) {
+
+        view = RamdiskLookupView( ViewCache, viewNumber );
+
+        ASSERT( view != NULL );
+
+        DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
+                    ("RamdiskUnmapView: dereferencing view %p; offset %I64x, length %x\n",
+                        view, view->Offset, view->Length) );
+
+        if ( !view->Permanent ) {
+
+            ASSERT( view->ReferenceCount != 0 );
+
+            view->ReferenceCount--;
+
+            if ( view->ReferenceCount == 0 ) {
+                wakeWaiters = TRUE;
+            }
+        }
+
+        if ( (view->Offset + view->Length) >= rangeEnd ) {
+            break;
+        }
+
+        viewNumber++;
+    }
+
+    //
+    // If one or more views are now free, wake up any threads that are
+    // waiting.
+    //
+
+    if ( wakeWaiters ) {
+        RamdiskWakeViewWaiters( ViewCache );
+    }
+
+    ExReleaseFastMutex( &ViewCache->Mutex );
+    KeLeaveCriticalRegion();
+
+    return;
+
+} // RamdiskUnmapView
+
+NTSTATUS
+RamdiskFlushViewCache (
+    IN PVIEW_CACHE ViewCache
+    )
+
+/*++
+
+Routine Description:
+
+    This routine flushes every mapped view to the backing file.
+
+Arguments:
+
+    ViewCache - a pointer to the view cache
+
+Return Value:
+
+    NTSTATUS - the status of the first flush that failed, or STATUS_SUCCESS
+
+--*/
+
+{
+    NTSTATUS status;
+    NTSTATUS returnStatus;
+    IO_STATUS_BLOCK iosb;
+    PLIST_ENTRY listEntry;
+    PVIEW view;
+    SIZE_T viewLength;
+
+    PAGED_CODE();
+
+    returnStatus = STATUS_SUCCESS;
+
+    //
+    // Lock the view cache.
+    //
+
+    KeEnterCriticalRegion();
+    ExAcquireFastMutex( &ViewCache->Mutex );
+
+    //
+    // Walk the pool. For each view that is currently mapped, flush its
+    // virtual memory to the backing file. (Idle views are never mapped.)
+    //
+
+    listEntry = ViewCache->ViewsByMru.Flink;
+
+    while ( listEntry != &ViewCache->ViewsByMru ) {
+
+        view = CONTAINING_RECORD( listEntry, VIEW, ByMruListEntry );
+
+        if ( view->Address != NULL ) {
+
+            DBGPRINT( DBG_WINDOW, DBG_PAINFUL,
+                        ("RamdiskFlushViewCache: flushing view %p; addr %p, offset %I64x, length %x\n",
+                            view, view->Address, view->Offset, view->Length) );
+
+            viewLength = view->Length;
+
+            status = ZwFlushVirtualMemory(
+                        NtCurrentProcess(),
+                        &view->Address,
+                        &viewLength,
+                        &iosb
+                        );
+
+            if ( NT_SUCCESS(status) ) {
+                status = iosb.Status;
+            }
+
+            if ( !NT_SUCCESS(status) ) {
+
+                DBGPRINT( DBG_WINDOW, DBG_ERROR,
+                            ("RamdiskFlushViewCache: ZwFlushVirtualMemory failed: %x\n", status) );
+
+                if ( returnStatus == STATUS_SUCCESS ) {
+                    returnStatus = status;
+                }
+            }
+        }
+
+        listEntry = listEntry->Flink;
+    }
+
+    ExReleaseFastMutex( &ViewCache->Mutex );
+    KeLeaveCriticalRegion();
+
+    return returnStatus;
+
+} // RamdiskFlushViewCache
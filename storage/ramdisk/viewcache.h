@@ -0,0 +1,234 @@
+/*++
+
+Copyright (c) 2001  Microsoft Corporation
+
+Module Name:
+
+    viewcache.h
+
+Abstract:
+
+    This file declares the view cache used to window the image of a
+    file-backed RAM disk into the system process.
+
+    Mapped views are aligned to the view length, so the view that covers a
+    file offset is identified by its view number (offset / view length).
+    Mapped views are indexed by a hash of the view number. Every view in
+    use is also on an MRU list, and the head of that list is checked before
+    the hash, because most I/Os land in the view used by the I/O before
+    them.
+
+    The number of views in use is adjusted from the hit rate. Descriptors
+    are allocated for the largest pool the disk may use. Those that are not
+    in use are parked on an idle list, unmapped.
+
+Environment:
+
+    Kernel mode only.
+
+Notes:
+
+    This file is also built into the user mode view cache benchmark, with
+    UTEST defined.
+
+Revision History:
+
+--*/
+
+#ifndef _VIEWCACHE_H_
+#define _VIEWCACHE_H_
+
+//
+// The view pool is reconsidered every VIEW_CACHE_WINDOW lookups.
+//
+// If more than 1 in VIEW_CACHE_GROW_MISS_RATIO lookups in a window missed,
+// the pool grows by a quarter. If no more than 1 in
+// VIEW_CACHE_SHRINK_MISS_RATIO lookups missed, views that were not used at
+// all during the window are unmapped and parked, up to an eighth of the
+// pool at a time.
+//
+
+#define VIEW_CACHE_WINDOW               1024
+#define VIEW_CACHE_GROW_MISS_RATIO         8
+#define VIEW_CACHE_SHRINK_MISS_RATIO      64
+
+typedef struct _VIEW {
+
+    //
+    // A mapped view is in the hash bucket for its view number. An unmapped
+    // view is in no bucket; its hash list entry points to itself.
+    //
+    // Every view in the pool is on the MRU list, sorted with the most
+    // recently used views at the front. When we need to unmap a view and
+    // remap a new view, we take a free view from the back of the MRU list.
+    // Views not in the pool are on the idle list instead.
+    //
+
+    LIST_ENTRY ByHashListEntry;
+    LIST_ENTRY ByMruListEntry;
+
+    //
+    // Address is the virtual address at which the view is mapped.
+    //
+    // Offset is the offset from the start of the file that backs the RAM disk.
+    //
+    // Length if the length of the view. Normally this is the same as the
+    // ViewLength field in the view cache, but it can be less for the view
+    // at the end of the disk image.
+    //
+
+    PUCHAR Address;
+
+    ULONGLONG Offset;
+    ULONG Length;
+
+    //
+    // ReferenceCount indicates how many active operations are using the view.
+    // When ReferenceCount is 0, the view is a candidate for replacement.
+    //
+    // Permanent indicates whether the view is to remain mapped permanently.
+    // If Permanent is TRUE, the ReferenceCount field is not used. (Permanent
+    // is intended to be used to keep a view permanently mapped to the boot
+    // sector. Currently we don't implement any permanent views.)
+    //
+
+    ULONG ReferenceCount;
+
+    //
+    // LastUsedWindow is the number of the sizing window in which the view
+    // was last referenced.
+    //
+
+    ULONG LastUsedWindow;
+
+    BOOLEAN Permanent;
+
+} VIEW, *PVIEW;
+
+typedef struct _VIEW_CACHE {
+
+    //
+    // Mutex protects the view cache.
+    //
+
+    FAST_MUTEX Mutex;
+
+    //
+    // SectionObject is a referenced pointer to the section for the backing
+    // file. (The reference belongs to the disk extension.) EndOffset is the
+    // file-relative offset of the end of the disk image.
+    //
+
+    PVOID SectionObject;
+    ULONGLONG EndOffset;
+
+    //
+    // ViewLength is the length of each view, a power of two. ViewShift is
+    // its base 2 logarithm.
+    //
+
+    ULONG ViewLength;
+    ULONG ViewShift;
+
+    //
+    // ViewCount is the number of views currently in the pool. It stays
+    // between MinimumViewCount and MaximumViewCount. ViewDescriptors points
+    // to MaximumViewCount descriptors.
+    //
+
+    ULONG ViewCount;
+    ULONG MinimumViewCount;
+    ULONG MaximumViewCount;
+
+    PVIEW ViewDescriptors;
+
+    //
+    // ViewsByMru is the list of views in the pool. IdleViews is the list of
+    // views that are not.
+    //
+
+    LIST_ENTRY ViewsByMru;
+    LIST_ENTRY IdleViews;
+
+    //
+    // ViewsByHash points to HashMask + 1 buckets of mapped views.
+    //
+
+    PLIST_ENTRY ViewsByHash;
+    ULONG HashMask;
+
+    //
+    // ViewSemaphore is used to wake up threads that are waiting for a free
+    // view (so they can remap a new view). ViewWaiterCount is the number of
+    // threads that are currently waiting for a free view. The semaphore is
+    // "kicked" by this amount when a view is freed.
+    //
+
+    KSEMAPHORE ViewSemaphore;
+    ULONG ViewWaiterCount;
+
+    //
+    // Pool sizing. Window is the number of the current sizing window.
+    // WindowLookups and WindowMisses count the lookups in that window and
+    // the ones that had to map a view.
+    //
+
+    ULONG Window;
+    ULONG WindowLookups;
+    ULONG WindowMisses;
+
+    //
+    // Statistics, for the debugger.
+    //
+
+    ULONGLONG Hits;
+    ULONGLONG Misses;
+    ULONG Waits;
+    ULONG Grows;
+    ULONG Shrinks;
+
+} VIEW_CACHE, *PVIEW_CACHE;
+
+SIZE_T
+RamdiskViewCacheAllocationSize (
+    IN ULONG MaximumViewCount
+    );
+
+VOID
+RamdiskInitializeViewCache (
+    OUT PVIEW_CACHE ViewCache,
+    IN PVOID Buffer,
+    IN PVOID SectionObject,
+    IN ULONGLONG EndOffset,
+    IN ULONG ViewLength,
+    IN ULONG ViewCount,
+    IN ULONG MinimumViewCount,
+    IN ULONG MaximumViewCount
+    );
+
+VOID
+RamdiskDeleteViewCache (
+    IN PVIEW_CACHE ViewCache
+    );
+
+PUCHAR
+RamdiskMapView (
+    IN PVIEW_CACHE ViewCache,
+    IN ULONGLONG Offset,
+    IN ULONG RequestedLength,
+    OUT PULONG ActualLength
+    );
+
+VOID
+RamdiskUnmapView (
+    IN PVIEW_CACHE ViewCache,
+    IN ULONGLONG Offset,
+    IN ULONG Length
+    );
+
+NTSTATUS
+RamdiskFlushViewCache (
+    IN PVIEW_CACHE ViewCache
+    );
+
+#endif // _VIEWCACHE_H_
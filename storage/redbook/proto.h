@@ -446,6 +446,28 @@ AddWmiStats(
     PREDBOOK_COMPLETION_CONTEXT Context
     );
 
+VOID
+RedBookReadAhead(
+    PREDBOOK_DEVICE_EXTENSION DeviceExtension
+    );
+
+ULONG
+RedBookReadAheadTarget(
+    PREDBOOK_DEVICE_EXTENSION DeviceExtension
+    );
+
+VOID
+RedBookSetReadAheadDepth(
+    PREDBOOK_DEVICE_EXTENSION DeviceExtension,
+    ULONG Depth
+    );
+
+VOID
+RedBookUpdateReadAhead(
+    PREDBOOK_DEVICE_EXTENSION DeviceExtension,
+    PREDBOOK_COMPLETION_CONTEXT Context
+    );
+
 VOID
 RedBookCheckForDiscChangeAndFreeResources(
     PREDBOOK_DEVICE_EXTENSION DeviceExtension
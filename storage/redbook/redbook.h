@@ -99,7 +99,7 @@
 
 #define REDBOOK_MAX_CONSECUTIVE_ERRORS 10
 
-#define REDBOOK_WMI_BUFFERS_MAX        30 // must be at least 3 due to
+#define REDBOOK_WMI_BUFFERS_MAX        60 // must be at least 3 due to
 #define REDBOOK_WMI_BUFFERS_MIN         4 // method used to reduce stuttering
 
 #define REDBOOK_WMI_SECTORS_MAX        27 // 64k per read -- 1/3 sec.
@@ -220,6 +220,20 @@ typedef struct _REDBOOK_BUFFER_DATA {
     ULONG   IndexToRead;
     ULONG   IndexToStream;
 
+    //
+    // the ring holds WmiData.NumberOfBuffers buffers, but only
+    // ReadAheadDepth of them are kept reading or streaming at once.
+    // the depth follows the measured read latency of the drive, so
+    // a slow drive reads further ahead and a fast one stops sooner.
+    //
+
+    ULONG   ReadAheadDepth;
+    ULONG   BuffersInUse;           // reading, read or streaming
+    ULONG   ReadsSinceShrink;       // depth only shrinks slowly
+    LARGE_INTEGER LastReadDone;     // ticks, to leave out queueing time
+    LONGLONG ReadLatency;           // 100ns units, scaled by 8
+    LONGLONG ReadJitter;            // 100ns units, scaled by 4
+
     union {
         struct {
             UCHAR   MaxIrpStack;    // allows cleaner IoInitializeIrp
@@ -41,6 +41,13 @@ Revision History:
 #define REDBOOK_THREAD_SYSAUDIO_CACHE_SECONDS  2
 #define REDBOOK_PERFORM_STUTTER_CONTROL        0
 
+//
+// buffers kept busy beyond those needed to cover a slow read:
+// one being played by sysaudio and one being read.
+//
+
+#define REDBOOK_READ_AHEAD_SLACK               2
+
 #if DBG
 
     //
@@ -61,6 +68,8 @@ Revision History:
     #pragma alloc_text(PAGE,   RedBookSystemThread               )
     #pragma alloc_text(PAGE,   RedBookCheckForAudioDeviceRemoval )
     #pragma alloc_text(PAGE,   RedBookThreadDigitalHandler       )
+    #pragma alloc_text(PAGE,   RedBookReadAhead                  )
+    #pragma alloc_text(PAGE,   RedBookReadAheadTarget            )
 
 /*
     but last two CANNOT be unlocked when playing,
@@ -938,8 +947,8 @@ Return Value:
         SetNextDeviceState(DeviceExtension, KSSTATE_PAUSE);
 
     } else if (DeviceExtension->Buffer.Paused == 1 &&
-               DeviceExtension->Thread.PendingStream ==
-               DeviceExtension->WmiData.NumberOfBuffers ) {
+               DeviceExtension->Thread.PendingStream >=
+               DeviceExtension->Buffer.ReadAheadDepth ) {
 
         ULONG i;
 
@@ -950,7 +959,7 @@ Return Value:
 
         KdPrintEx((DPFLTR_REDBOOK_ID, RedbookDebugDigitalS, "[redbook] "
                    "Stream => Resuming, %d buffers pending\n",
-                   DeviceExtension->WmiData.NumberOfBuffers));
+                   DeviceExtension->Thread.PendingStream));
         DeviceExtension->Buffer.Paused = 0;
 
         //
@@ -1201,6 +1210,22 @@ SetCdromState(
         DeviceExtension->Buffer.FirstPause    = 1;
         DeviceExtension->Buffer.IndexToRead   = 0;
         DeviceExtension->Buffer.IndexToStream = 0;
+        DeviceExtension->Buffer.BuffersInUse  = 0;
+        DeviceExtension->Buffer.ReadsSinceShrink = 0;
+        DeviceExtension->Buffer.LastReadDone.QuadPart = 0;
+
+        //
+        // until a read has been timed, use the whole ring
+        //
+
+        if (DeviceExtension->Buffer.ReadLatency == 0 &&
+            DeviceExtension->Buffer.ReadJitter  == 0) {
+            RedBookSetReadAheadDepth(DeviceExtension,
+                                     DeviceExtension->WmiData.NumberOfBuffers);
+        } else {
+            RedBookSetReadAheadDepth(DeviceExtension,
+                                     RedBookReadAheadTarget(DeviceExtension));
+        }
 
         //
         // reset the buffer state
@@ -1422,6 +1447,13 @@ RedBookAllocatePlayResources(
 
     bufSize =  RAW_SECTOR_SIZE * numSectors;
 
+    //
+    // the read times measured so far were for the old buffer size
+    //
+
+    DeviceExtension->Buffer.ReadLatency = 0;
+    DeviceExtension->Buffer.ReadJitter  = 0;
+
     TRY {
 
         ASSERT(DeviceExtension->Stream.MixerPinId != -1);
@@ -1833,6 +1865,7 @@ RedBookThreadDigitalHandler(
 
         } else {
             DeviceExtension->CDRom.ReadErrors = 0;
+            RedBookUpdateReadAhead(DeviceExtension, Context);
         }
 
         DeviceExtension->Thread.PendingRead--;
@@ -1863,8 +1896,29 @@ RedBookThreadDigitalHandler(
         }
 
         DeviceExtension->Thread.PendingStream--;
+        DeviceExtension->Buffer.BuffersInUse--;
         Context->Reason = REDBOOK_CC_READ;
 
+        //
+        // nothing left for sysaudio to play, so the reads are not
+        // far enough ahead.  read further ahead from now on.
+        //
+
+        if (DeviceExtension->Thread.PendingStream == 0 &&
+            !TEST_FLAG(state, CD_MASK_TEMP) &&
+            DeviceExtension->CDRom.NextToStream <
+            DeviceExtension->CDRom.EndPlay) {
+
+            KdPrintEx((DPFLTR_REDBOOK_ID, RedbookDebugThread, "[redbook] "
+                       "Digital => Stream underrun at depth %x\n",
+                       DeviceExtension->Buffer.ReadAheadDepth));
+
+            InterlockedIncrement(&DeviceExtension->WmiPerf.StreamUnderrunCount);
+            RedBookSetReadAheadDepth(DeviceExtension,
+                                     DeviceExtension->Buffer.ReadAheadDepth +
+                                     REDBOOK_READ_AHEAD_SLACK);
+        }
+
     }
 
     if (DeviceExtension->CDRom.StreamErrors >= REDBOOK_MAX_CONSECUTIVE_ERRORS &&
@@ -1971,36 +2025,14 @@ RedBookThreadDigitalHandler(
             if (index != DeviceExtension->Buffer.IndexToRead) {
                 KdPrintEx((DPFLTR_REDBOOK_ID, RedbookDebugThread, "[redbook] "
                            "Digital => Delaying read, index %x\n", index));
-                return;
             }
 
-            if (DeviceExtension->CDRom.NextToRead >
-                DeviceExtension->CDRom.EndPlay) {
-                KdPrintEx((DPFLTR_REDBOOK_ID, RedbookDebugThread, "[redbook] "
-                           "Digital => End of Play\n"));
-                return;
-            }
-
-            for (index = Context->Index;
-                 DeviceExtension->Buffer.ReadOk_X[index] != 0;
-                 index = (index + 1) % mod) {
-
-                // mark this buffer as in use BEFORE attempting to read
-                DeviceExtension->Buffer.ReadOk_X[index] = 0;
-                DeviceExtension->Thread.PendingRead++;
-
-                RedBookReadRaw(DeviceExtension,
-                               &DeviceExtension->Buffer.Contexts[index]);
-
-                // increment where reading from AFTER attempting to read
-                DeviceExtension->CDRom.NextToRead +=
-                    DeviceExtension->WmiData.SectorsPerRead;
-
-                // inc/mod the index AFTER attempting to read
-                DeviceExtension->Buffer.IndexToRead++;
-                DeviceExtension->Buffer.IndexToRead %= mod;
-            }
+            //
+            // this may also send buffers that were left waiting
+            // because the read ahead depth was reached
+            //
 
+            RedBookReadAhead(DeviceExtension);
             break;
         }
 
@@ -2036,6 +2068,11 @@ RedBookThreadDigitalHandler(
                 DeviceExtension->Buffer.IndexToStream %= mod;
             }
 
+            //
+            // the read that just completed may have raised the depth
+            //
+
+            RedBookReadAhead(DeviceExtension);
             break;
         }
 
@@ -2093,6 +2130,250 @@ AddWmiStats(
     KeReleaseSpinLock( &DeviceExtension->WmiPerfLock, oldIrql );
     return;
 }
+
+
+VOID
+RedBookReadAhead(
+    PREDBOOK_DEVICE_EXTENSION DeviceExtension
+    )
+/*++
+
+Routine Description:
+
+    Sends reads for the free buffers of the ring, in order, until
+    ReadAheadDepth buffers are reading or streaming.  Buffers past
+    the depth stay marked free, and are sent when a stream completes
+    or the depth grows.
+
+Arguments:
+
+    DeviceExtension - the device being played
+
+Return Value:
+
+    None
+
+--*/
+{
+    PREDBOOK_BUFFER_DATA buffer = &DeviceExtension->Buffer;
+    ULONG index;
+    ULONG mod;
+
+    PAGED_CODE();
+    VerifyCalledByThread(DeviceExtension);
+
+    mod = DeviceExtension->WmiData.NumberOfBuffers;
+
+    for (index = buffer->IndexToRead;
+         buffer->ReadOk_X[index] != 0 &&
+         buffer->BuffersInUse < buffer->ReadAheadDepth &&
+         DeviceExtension->CDRom.NextToRead < DeviceExtension->CDRom.EndPlay;
+         index = (index + 1) % mod) {
+
+        // mark this buffer as in use BEFORE attempting to read
+        buffer->ReadOk_X[index] = 0;
+        buffer->BuffersInUse++;
+        DeviceExtension->Thread.PendingRead++;
+
+        RedBookReadRaw(DeviceExtension, &buffer->Contexts[index]);
+
+        // increment where reading from AFTER attempting to read
+        DeviceExtension->CDRom.NextToRead +=
+            DeviceExtension->WmiData.SectorsPerRead;
+
+        // inc/mod the index AFTER attempting to read
+        buffer->IndexToRead++;
+        buffer->IndexToRead %= mod;
+    }
+    return;
+}
+
+
+ULONG
+RedBookReadAheadTarget(
+    PREDBOOK_DEVICE_EXTENSION DeviceExtension
+    )
+/*++
+
+Routine Description:
+
+    Returns how many buffers must be kept busy so that the audio
+    already read covers a read taking the average latency plus four
+    times its average deviation.
+
+Arguments:
+
+    DeviceExtension - the device being played
+
+Return Value:
+
+    The depth, between REDBOOK_WMI_BUFFERS_MIN and the size of the ring
+
+--*/
+{
+    LONGLONG bufferTime;
+    LONGLONG needed;
+    ULONG target;
+
+    PAGED_CODE();
+
+    //
+    // each sector holds 1/75th of a second of audio.
+    // ReadJitter is scaled by four, so is already four deviations.
+    //
+
+    bufferTime = (LONGLONG)DeviceExtension->WmiData.SectorsPerRead *
+        10000000 / 75;
+    needed = (DeviceExtension->Buffer.ReadLatency >> 3) +
+        DeviceExtension->Buffer.ReadJitter;
+
+    needed = (needed + bufferTime - 1) / bufferTime;
+
+    if (needed >= DeviceExtension->WmiData.NumberOfBuffers) {
+        return DeviceExtension->WmiData.NumberOfBuffers;
+    }
+
+    target = (ULONG)needed + REDBOOK_READ_AHEAD_SLACK;
+
+    if (target < REDBOOK_WMI_BUFFERS_MIN) {
+        target = REDBOOK_WMI_BUFFERS_MIN;
+    }
+    if (target > DeviceExtension->WmiData.NumberOfBuffers) {
+        target = DeviceExtension->WmiData.NumberOfBuffers;
+    }
+    return target;
+}
+
+
+VOID
+RedBookSetReadAheadDepth(
+    PREDBOOK_DEVICE_EXTENSION DeviceExtension,
+    ULONG Depth
+    )
+//
+// sets the depth, no larger than the ring, and publishes it with
+// the read times.  not paged due to the spinlock.
+//
+{
+    KIRQL oldIrql;
+
+    if (Depth > DeviceExtension->WmiData.NumberOfBuffers) {
+        Depth = DeviceExtension->WmiData.NumberOfBuffers;
+    }
+
+    if (Depth != DeviceExtension->Buffer.ReadAheadDepth) {
+        KdPrintEx((DPFLTR_REDBOOK_ID, RedbookDebugThread, "[redbook] "
+                   "ReadAhead => Depth %x -> %x\n",
+                   DeviceExtension->Buffer.ReadAheadDepth, Depth));
+    }
+
+    DeviceExtension->Buffer.ReadAheadDepth = Depth;
+    DeviceExtension->Buffer.ReadsSinceShrink = 0;
+
+    KeAcquireSpinLock(&DeviceExtension->WmiPerfLock, &oldIrql);
+
+    DeviceExtension->WmiPerf.ReadLatency =
+        DeviceExtension->Buffer.ReadLatency >> 3;
+    DeviceExtension->WmiPerf.ReadJitter =
+        DeviceExtension->Buffer.ReadJitter >> 2;
+    DeviceExtension->WmiPerf.ReadAheadDepth = Depth;
+
+    KeReleaseSpinLock(&DeviceExtension->WmiPerfLock, oldIrql);
+    return;
+}
+
+
+VOID
+RedBookUpdateReadAhead(
+    PREDBOOK_DEVICE_EXTENSION DeviceExtension,
+    PREDBOOK_COMPLETION_CONTEXT Context
+    )
+/*++
+
+Routine Description:
+
+    Adds the time the drive took for one successful read to the
+    latency and jitter averages, and moves the read ahead depth
+    toward what they call for.  The depth grows at once, but only
+    shrinks by one buffer for each ring's worth of reads.
+
+    The reads are queued at the drive behind each other, so the time
+    is counted from when the previous read completed if that was
+    after this one was sent.
+
+Arguments:
+
+    DeviceExtension - the device being played
+
+    Context - the completed read
+
+Return Value:
+
+    None
+
+--*/
+{
+    PREDBOOK_BUFFER_DATA buffer = &DeviceExtension->Buffer;
+    LARGE_INTEGER started;
+    LONGLONG sample;
+    LONGLONG error;
+    ULONG target;
+
+    VerifyCalledByThread(DeviceExtension);
+
+    if (Context->TimeReadSent.QuadPart == 0) {
+        return;
+    }
+
+    started = Context->TimeReadSent;
+    if (buffer->LastReadDone.QuadPart > started.QuadPart) {
+        started = buffer->LastReadDone;
+    }
+    if (Context->TimeStreamReady.QuadPart > buffer->LastReadDone.QuadPart) {
+        buffer->LastReadDone = Context->TimeStreamReady;
+    }
+
+    sample = (Context->TimeStreamReady.QuadPart - started.QuadPart) *
+        KeQueryTimeIncrement();
+    if (sample < 0) {
+        sample = 0;
+    }
+
+    //
+    // same averages as tcp uses for round trip times:
+    // latency gains 1/8 of the error, deviation 1/4.
+    //
+
+    if (buffer->ReadLatency == 0 && buffer->ReadJitter == 0) {
+
+        buffer->ReadLatency = sample << 3;
+        buffer->ReadJitter  = sample << 1;
+
+    } else {
+
+        error = sample - (buffer->ReadLatency >> 3);
+        buffer->ReadLatency += error;
+        if (error < 0) {
+            error = -error;
+        }
+        buffer->ReadJitter += error - (buffer->ReadJitter >> 2);
+
+    }
+
+    target = RedBookReadAheadTarget(DeviceExtension);
+
+    if (target >= buffer->ReadAheadDepth) {
+
+        RedBookSetReadAheadDepth(DeviceExtension, target);
+
+    } else if (++buffer->ReadsSinceShrink >=
+               DeviceExtension->WmiData.NumberOfBuffers) {
+
+        RedBookSetReadAheadDepth(DeviceExtension, buffer->ReadAheadDepth - 1);
+
+    }
+    return;
+}
 ////////////////////////////////////////////////////////////////////////////////
 
 
@@ -894,6 +894,8 @@ RedBookWmiCopyPerfInfo(
 
     Out->StreamPausedCount =
         InterlockedCompareExchange(&DeviceExtension->WmiPerf.StreamPausedCount,0,0);
+    Out->StreamUnderrunCount =
+        InterlockedCompareExchange(&DeviceExtension->WmiPerf.StreamUnderrunCount,0,0);
 
     //
     // finished.
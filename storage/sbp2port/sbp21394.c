@@ -2471,6 +2471,14 @@ Return Value:
 
     RemoveEntryList (&orbContext->OrbList);
 
+    deviceExtension->OrbsCompleted++;
+    deviceExtension->BytesTransferred += requestIrp->IoStatus.Information;
+
+    if (orbContext->Srb->SrbStatus == SRB_STATUS_SUCCESS) {
+
+        deviceExtension->OrbsSinceDepthCut++;
+    }
+
     if (cancelledTimer) {
 
         //
@@ -3327,13 +3335,18 @@ Return Value:
             CLEAR_FLAG(deviceExtension->DeviceFlags,DEVICE_FLAG_STOPPED);
         }
 
+        KeReleaseSpinLockFromDpcLevel(&deviceExtension->ExtensionDataSpinLock);
+
         //
         // decrease number of possible outstanding requests.
         //
 
+        KeAcquireSpinLockAtDpcLevel(&deviceExtension->OrbListSpinLock);
+
         deviceExtension->MaxOrbListDepth = max(MIN_ORB_LIST_DEPTH,deviceExtension->MaxOrbListDepth/2);
+        deviceExtension->OrbsSinceDepthCut = 0;
 
-        KeReleaseSpinLockFromDpcLevel(&deviceExtension->ExtensionDataSpinLock);
+        KeReleaseSpinLockFromDpcLevel(&deviceExtension->OrbListSpinLock);
 
         CleanupOrbList(deviceExtension,STATUS_REQUEST_ABORTED);
 
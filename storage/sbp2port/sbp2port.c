@@ -2377,10 +2377,16 @@ Sbp2DeviceManagementTimeoutDpc(
             KeAcquireSpinLockAtDpcLevel(&DeviceExtension->ExtensionDataSpinLock);
 
             SET_FLAG(DeviceExtension->DeviceFlags, DEVICE_FLAG_STOPPED);
-            DeviceExtension->MaxOrbListDepth = max(MIN_ORB_LIST_DEPTH,DeviceExtension->MaxOrbListDepth/2);
 
             KeReleaseSpinLockFromDpcLevel(&DeviceExtension->ExtensionDataSpinLock);
 
+            KeAcquireSpinLockAtDpcLevel(&DeviceExtension->OrbListSpinLock);
+
+            DeviceExtension->MaxOrbListDepth = max(MIN_ORB_LIST_DEPTH,DeviceExtension->MaxOrbListDepth/2);
+            DeviceExtension->OrbsSinceDepthCut = 0;
+
+            KeReleaseSpinLockFromDpcLevel(&DeviceExtension->OrbListSpinLock);
+
             CleanupOrbList(DeviceExtension,STATUS_REQUEST_ABORTED);
 
             //
@@ -88,9 +88,17 @@ extern ULONG Sbp2DebugLevel;
 // with the current pointer into the continious pool
 //
 
-#define MAX_ORB_LIST_DEPTH 8
+#define MAX_ORB_LIST_DEPTH 32
 #define MIN_ORB_LIST_DEPTH 5
 
+//
+// After a reset has cut MaxOrbListDepth, it is doubled again (up to
+// MAX_ORB_LIST_DEPTH) once this many requests have completed without
+// error, the next time the ORB list is empty
+//
+
+#define ORB_LIST_DEPTH_REGROW_COUNT 1024
+
 
 
 typedef struct _IRBIRP {
@@ -254,6 +262,8 @@ typedef struct _COMMON_BUFFER_DATA {
 
 } COMMON_BUFFER_DATA, *PCOMMON_BUFFER_DATA;
 
+C_ASSERT (sizeof (COMMON_BUFFER_DATA) <= PAGE_SIZE);
+
 
 typedef struct _DEVICE_EXTENSION {
 
@@ -264,13 +274,28 @@ typedef struct _DEVICE_EXTENSION {
 
     PDEVICE_OBJECT      BusFdo;
     PDEVICE_INFORMATION DeviceInfo;
-    ULONG               MaxOrbListDepth;
+    ULONG               MaxOrbListDepth;    // changed under OrbListSpinLock
     KSPIN_LOCK          OrbListSpinLock;
 
     LIST_ENTRY          PendingOrbList;
     ULONG               OrbListDepth;
     ULONG               CurrentKey;
 
+    //
+    // ORB pool statistics, displayed by the sbp2kdx extension.  The
+    // average number of ORBs on the list when one is appended is
+    // OrbListDepthTotal / OrbsSubmitted.  All are protected by the
+    // OrbListSpinLock, except OrbPoolEmptyCount which is interlocked.
+    //
+
+    ULONG               OrbsSinceDepthCut;  // protected by OrbListSpinLock
+    ULONG               OrbListDepthPeak;
+    ULONG               OrbPoolEmptyCount;
+    ULONG               OrbsSubmitted;
+    ULONG               OrbsCompleted;
+    ULONGLONG           OrbListDepthTotal;
+    ULONGLONG           BytesTransferred;
+
     STATUS_FIFO_BLOCK   LastStatusBlock;
 
     PASYNC_REQUEST_CONTEXT  NextContextToFree;
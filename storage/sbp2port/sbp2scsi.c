@@ -881,6 +881,8 @@ Return Value:
             DeviceExtension
             ));
 
+        InterlockedIncrement (&DeviceExtension->OrbPoolEmptyCount);
+
         status = STATUS_INSUFFICIENT_RESOURCES;
         Srb->SrbStatus = SRB_STATUS_INTERNAL_ERROR;
         Srb->InternalStatus = STATUS_INSUFFICIENT_RESOURCES;
@@ -903,6 +905,31 @@ Return Value:
         &DeviceExtension->OrbListDepth
         );
 
+    //
+    // If a reset cut the max depth and requests have been completing
+    // fine since, raise it again.  Only do it when this is the only
+    // request outstanding, so no earlier request has been appended at
+    // the old max without starting the next packet.
+    //
+
+    if ((callbackContext->OrbListDepth == 1) &&
+        (DeviceExtension->MaxOrbListDepth < MAX_ORB_LIST_DEPTH) &&
+        (DeviceExtension->OrbsSinceDepthCut >= ORB_LIST_DEPTH_REGROW_COUNT)) {
+
+        DeviceExtension->MaxOrbListDepth = min(
+            MAX_ORB_LIST_DEPTH,
+            DeviceExtension->MaxOrbListDepth * 2
+            );
+
+        DeviceExtension->OrbsSinceDepthCut = 0;
+
+        DEBUGPRINT2((
+            "Sbp2Port: Create1394XactForSrb: ext=x%p, max depth now %d\n",
+            DeviceExtension,
+            DeviceExtension->MaxOrbListDepth
+            ));
+    }
+
     KeReleaseSpinLockFromDpcLevel (&DeviceExtension->OrbListSpinLock);
 
 
@@ -1617,6 +1644,14 @@ Sbp2InsertTailList(
 
     DeviceExtension->CurrentKey = Context->Srb->QueueSortKey+1;
 
+    DeviceExtension->OrbsSubmitted++;
+    DeviceExtension->OrbListDepthTotal += DeviceExtension->OrbListDepth;
+
+    if (DeviceExtension->OrbListDepth > DeviceExtension->OrbListDepthPeak) {
+
+        DeviceExtension->OrbListDepthPeak = DeviceExtension->OrbListDepth;
+    }
+
     if (IsListEmpty (&DeviceExtension->PendingOrbList)) {
 
         //
@@ -1601,21 +1601,13 @@ struct _ADAPTER_EXTENSION {
     PVOID SrbExtensionListHeader;
 
     //
-    // A bitmap for keeping track of which queue tags are in use.
+    // Allocator keeping track of which queue tags are in use.
     //
 
-    KSPIN_LOCK QueueTagSpinLock;
-    PRTL_BITMAP QueueTagBitMap;
+    PORT_TAG_ALLOCATOR QueueTags;
 
     UCHAR MaxQueueTag;
 
-    //
-    // Hint for allocating queue tags.  Value will be the last queue
-    // tag allocated + 1.
-    //
-
-    ULONG QueueTagHint;
-
     //
     // Logical Unit Extensions
     //
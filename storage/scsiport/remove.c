@@ -453,6 +453,17 @@ SpDestroyAdapter(
     )
 {
     SpReleaseAdapterResources(Adapter, FALSE, Surprise);
+
+    //
+    // SRB_DATA blocks, and their queue tags, may still be freed after a
+    // surprise removal. Like the SRB_DATA lookaside list, the queue tag
+    // allocator is only freed on a regular removal.
+    //
+
+    if(!Surprise) {
+        PortDeleteTagAllocator(&(Adapter->QueueTags));
+    }
+
     SpAdapterCleanup(Adapter);
     return;
 }
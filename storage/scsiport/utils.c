@@ -1753,13 +1753,12 @@ SpAllocateTagBitMap(
     )
 
 {
-    ULONG size;         // number of bits
-    PRTL_BITMAP bitMap;
+    NTSTATUS status;
 
     PAGED_CODE();
 
     //
-    // Initialize the queue tag bitMap.
+    // Initialize the queue tag allocator.
     //
 
     if(Adapter->MaxQueueTag == 0) {
@@ -1780,46 +1779,28 @@ SpAllocateTagBitMap(
                  Adapter->NumberOfRequests);
     }
 
-    DebugPrint((1, "SpAllocateAdapterResources: %d bits in queue tag "
-                   "bitMap\n",
+    DebugPrint((1, "SpAllocateAdapterResources: %d queue tags\n",
                 Adapter->MaxQueueTag));
 
-    size = (Adapter->MaxQueueTag + 1);
-    size /= 8;
-    size += 1;
-    size *= sizeof(UCHAR);
-    size += sizeof(RTL_BITMAP);
-
-    bitMap = SpAllocatePool(NonPagedPool,
-                            size,
-                            SCSIPORT_TAG_QUEUE_BITMAP,
-                            Adapter->DeviceObject->DriverObject);
-
-    if(bitMap == NULL) {
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-
-    RtlInitializeBitMap(bitMap,
-                        (PULONG) (bitMap + 1),
-                        Adapter->MaxQueueTag);
-
-    RtlClearAllBits(bitMap);
-
     //
-    // Queue tag 0 is invalid and should never be returned by the allocator.
+    // The tag allocator may still hold the tags from before the adapter
+    // was last stopped.
     //
 
-    RtlSetBits(bitMap, 0, 1);
+    PortDeleteTagAllocator(&(Adapter->QueueTags));
 
-    Adapter->QueueTagBitMap = bitMap;
-    Adapter->QueueTagHint = 1;
+    status = PortInitializeTagAllocator(&(Adapter->QueueTags),
+                                        Adapter->MaxQueueTag);
+
+    if(!NT_SUCCESS(status)) {
+        return status;
+    }
 
     //
-    // Create a spinlock to protect our queue tag bitmap.  There's no reason
-    // for this to contend with the regular port spinlock.
+    // Queue tag 0 is invalid and should never be returned by the allocator.
     //
 
-    KeInitializeSpinLock(&(Adapter->QueueTagSpinLock));
+    PortAllocateSpecificTag(&(Adapter->QueueTags), 0);
 
     return STATUS_SUCCESS;
 }
@@ -1829,37 +1810,21 @@ SpAllocateQueueTag(
     IN PADAPTER_EXTENSION Adapter
     )
 {
-    KIRQL oldIrql;
     ULONG tagValue;
 
     ASSERT_FDO(Adapter->DeviceObject);
 
-    KeAcquireSpinLock(&(Adapter->QueueTagSpinLock), &oldIrql);
-
     //
-    // Find an available queue tag.
+    // Find an available queue tag.  The tag allocator does not need to be
+    // synchronized.
     //
 
-    tagValue = RtlFindClearBitsAndSet(Adapter->QueueTagBitMap,
-                                      1,
-                                      Adapter->QueueTagHint);
-
-    KeReleaseSpinLock(&(Adapter->QueueTagSpinLock), oldIrql);
+    tagValue = PortAllocateTag(&(Adapter->QueueTags));
 
-    ASSERT(Adapter->QueueTagHint < Adapter->MaxQueueTag);
     ASSERT(tagValue != 0);
 
-    if(tagValue != -1) {
-
-        ASSERT(tagValue <= Adapter->MaxQueueTag);
-
-        //
-        // This we can do unsynchronized.  if we nuke the hint accidentally it
-        // will just increase the cost of the next lookup which should
-        // hopefully occur rarely.
-        //
-
-        Adapter->QueueTagHint = (tagValue + 1) % Adapter->MaxQueueTag;
+    if(tagValue != PORT_INVALID_TAG) {
+        ASSERT(tagValue < Adapter->MaxQueueTag);
     }
 
     return tagValue;
@@ -1871,13 +1836,7 @@ SpReleaseQueueTag(
     IN ULONG QueueTag
     )
 {
-    KIRQL oldIrql;
-
-    KeAcquireSpinLock(&(Adapter->QueueTagSpinLock), &oldIrql);
-    RtlClearBits(Adapter->QueueTagBitMap,
-                 QueueTag,
-                 1);
-    KeReleaseSpinLock(&(Adapter->QueueTagSpinLock), oldIrql);
+    PortFreeTag(&(Adapter->QueueTags), QueueTag);
     return;
 }
 
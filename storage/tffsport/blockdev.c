@@ -2999,6 +2999,9 @@ FLStatus NAMING_CONVENTION bdCall(FLFunctionNo functionNo, IOreq FAR2 *ioreq)
            ( functionNo != FL_CHECK_VOLUME      ) &&
 #ifndef FL_READ_ONLY
            ( functionNo != FL_DEFRAGMENT_VOLUME ) &&
+#if (!defined(FILES) || FILES == 0)
+           ( functionNo != FL_FLUSH_BUFFER      ) &&
+#endif /* FILES == 0 */
 #endif  /* FL_READ_ONLY */
 #ifdef ABS_READ_WRITE
            ( functionNo != FL_ABS_READ          ) &&
@@ -3036,6 +3039,9 @@ FLStatus NAMING_CONVENTION bdCall(FLFunctionNo functionNo, IOreq FAR2 *ioreq)
 #ifndef FL_READ_ONLY
     case FL_FLUSH_BUFFER:
       status = flushBuffer(&vol);
+      if ((status == flOK) && (vol.flags & VOLUME_ABS_MOUNTED) &&
+          (vol.tl.flush != NULL))
+        status = vol.tl.flush(vol.tl.rec);
       break;
 #endif /* FL_READ_ONLY  */
     case FL_OPEN_FILE:
@@ -3106,6 +3112,14 @@ FLStatus NAMING_CONVENTION bdCall(FLFunctionNo functionNo, IOreq FAR2 *ioreq)
 #endif /* FL_READ_ONLY */
 #endif /* FILES > 0 */
 
+#if (!defined(FILES) || FILES == 0)
+#ifndef FL_READ_ONLY
+    case FL_FLUSH_BUFFER:      /* Write back the sector cache, if any */
+      status = (vol.tl.flush != NULL) ? vol.tl.flush(vol.tl.rec) : flOK;
+      break;
+#endif /* FL_READ_ONLY */
+#endif /* FILES == 0 */
+
     case FL_MOUNT_VOLUME:
       status = mountVolume(&vol,&(ioreq->irFlags));
       break;
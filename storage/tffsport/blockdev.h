@@ -150,13 +150,14 @@
 /*        FLStatus   : 0 on success, otherwise failed                   */
 /*----------------------------------------------------------------------*/
 
-#if FILES > 0
 #ifndef FL_READ_ONLY
 /*----------------------------------------------------------------------*/
 /*                     f l F l u s h B u f f e r                        */
 /*                                                                      */
 /* If there is relevant data in the RAM buffer then writes it on        */
-/*   the flash memory.                                                  */
+/*   the flash memory. Dirty sectors of the sector cache (SECTOR_CACHE) */
+/*   are written as well. Without files, only the sector cache is       */
+/*   written, and the volume need not be mounted, only abs mounted.     */
 /*                                                                      */
 /* Parameters:                                                          */
 /*        irHandle  : Drive number (0, 1, ...)                          */
@@ -170,6 +171,8 @@
 #define flFlushBuffer(ioreq)        bdCall(FL_FLUSH_BUFFER,ioreq)
 
 #endif                                  /* READ_ONLY */
+
+#if FILES > 0
 /*----------------------------------------------------------------------*/
 /*                      f l O p e n F i l e                             */
 /*                                                                      */
@@ -0,0 +1,798 @@
+/*
+
+Module Name:
+
+    flcache.c
+
+Abstract:
+
+    Write-back sector cache. It is registered as a block device filter
+    translation layer, so flMount places it in front of the translation
+    layer of each volume (INFTL on the DiskOnChip).
+
+    Every sector INFTL writes goes to the next free page of its virtual
+    unit chain, and a chain that gets too long, or running out of free
+    units, makes INFTL fold a chain into a single unit and erase the
+    rest.  Small writes that come one by one each add to the chain.  The
+    cache keeps them in RAM and writes a virtual unit back in one go, in
+    sector order, so a burst of small writes to a unit costs one pass
+    over its chain instead of one per write.
+
+    A line is written back when it is needed for other sectors, together
+    with the other dirty lines of its virtual unit, when the volume is
+    flushed (flFlushBuffer) and when it is dismounted.  Reads that follow
+    each other are read ahead, up to the end of the virtual unit.
+
+Environment:
+
+    Kernel mode, called with the TrueFFS mutex held.
+
+Notes:
+
+    This file is also built into the user mode NAND simulator test, with
+    UTEST defined.
+
+--*/
+
+#ifndef UTEST
+#include "fltl.h"
+#endif /* UTEST */
+#include "flcache.h"
+
+#ifdef SECTOR_CACHE
+
+typedef struct {
+  SectorNo   sectorNo;       /* First sector of the line, or UNASSIGNED_SECTOR */
+  dword      validMask;      /* Sectors of the line that hold data             */
+  dword      dirtyMask;      /* Sectors not yet written to the TL              */
+  dword      lastUse;        /* useCount when the line was last used           */
+  byte FAR1 *data;
+} CacheLine;
+
+struct tTLrec {
+  TL         baseTL;         /* The translation layer under the cache    */
+  SectorNo   virtualSectors;
+  unsigned   unitSectorsBits;/* log2 of the sectors of a virtual unit     */
+  SectorNo   nextReadSector; /* Where a sequential read would start       */
+  dword      useCount;
+  byte FAR1 *buffer;         /* Data of all the lines                     */
+  CacheLine  lines[SECTOR_CACHE_LINES];
+};
+
+typedef TLrec SectorCache;
+
+static SectorCache cacheVols[VOLUMES];
+
+#define lineOf(sectorNo)        ((sectorNo) & ~((SectorNo)SECTOR_CACHE_LINE_SECTORS - 1))
+#define offsetInLine(sectorNo)  ((unsigned)(sectorNo) & (SECTOR_CACHE_LINE_SECTORS - 1))
+#define lineData(line,sectorNo) ((line)->data + (offsetInLine(sectorNo) << SECTOR_SIZE_BITS))
+
+
+/*----------------------------------------------------------------------*/
+/*                        r a n g e M a s k                             */
+/*                                                                      */
+/* Returns the line mask of consecutive sectors of one line.            */
+/*                                                                      */
+/* Parameters:                                                          */
+/*      sectorNo        : First sector                                  */
+/*      sectorCount     : No. of sectors, up to the end of the line     */
+/*                                                                      */
+/*----------------------------------------------------------------------*/
+
+static dword rangeMask(SectorNo sectorNo, SectorNo sectorCount)
+{
+  dword mask = (sectorCount >= 32) ? ~(dword)0 :
+               (((dword)1 << (unsigned)sectorCount) - 1);
+
+  return mask << offsetInLine(sectorNo);
+}
+
+
+/*----------------------------------------------------------------------*/
+/*                         l i n e M a s k                              */
+/*                                                                      */
+/* Returns the mask of the sectors of a line that are in the volume.    */
+/*                                                                      */
+/*----------------------------------------------------------------------*/
+
+static dword lineMask(SectorCache vol, SectorNo lineSector)
+{
+  if (lineSector + SECTOR_CACHE_LINE_SECTORS > vol.virtualSectors)
+    return rangeMask(lineSector,vol.virtualSectors - lineSector);
+
+  return rangeMask(lineSector,SECTOR_CACHE_LINE_SECTORS);
+}
+
+
+/*----------------------------------------------------------------------*/
+/*                          f i n d L i n e                             */
+/*                                                                      */
+/* Returns the line that caches a line of sectors, or NULL.             */
+/*                                                                      */
+/*----------------------------------------------------------------------*/
+
+static CacheLine *findLine(SectorCache vol, SectorNo lineSector)
+{
+  int iLine;
+
+  for (iLine = 0; iLine < SECTOR_CACHE_LINES; iLine++)
+    if (vol.lines[iLine].sectorNo == lineSector)
+      return &vol.lines[iLine];
+
+  return NULL;
+}
+
+
+/*----------------------------------------------------------------------*/
+/*                         f l u s h L i n e                            */
+/*                                                                      */
+/* Writes the dirty sectors of a line, a run of consecutive sectors at  */
+/* a time.                                                              */
+/*                                                                      */
+/* Returns:                                                             */
+/*      FLStatus        : 0 on success, failed otherwise                */
+/*----------------------------------------------------------------------*/
+
+static FLStatus flushLine(SectorCache vol, CacheLine *line)
+{
+  unsigned first, last;
+
+  for (first = 0; first < SECTOR_CACHE_LINE_SECTORS; first = last)
+  {
+    if (!(line->dirtyMask & ((dword)1 << first)))
+    {
+      last = first + 1;
+      continue;
+    }
+    for (last = first + 1; (last < SECTOR_CACHE_LINE_SECTORS) &&
+         (line->dirtyMask & ((dword)1 << last)); last++);
+
+    checkStatus(vol.baseTL.writeMultiSector(vol.baseTL.rec,
+                line->sectorNo + first,
+                line->data + (first << SECTOR_SIZE_BITS),
+                (SectorNo)(last - first)));
+    line->dirtyMask &= ~rangeMask(first,last - first);
+  }
+  return flOK;
+}
+
+
+/*----------------------------------------------------------------------*/
+/*                         f l u s h U n i t                            */
+/*                                                                      */
+/* Writes the dirty lines of a virtual unit, in sector order.           */
+/*                                                                      */
+/* Parameters:                                                          */
+/*      vol             : Pointer identifying drive                     */
+/*      unitNo          : Virtual unit no.                              */
+/*                                                                      */
+/* Returns:                                                             */
+/*      FLStatus        : 0 on success, failed otherwise                */
+/*----------------------------------------------------------------------*/
+
+static FLStatus flushUnit(SectorCache vol, SectorNo unitNo)
+{
+  CacheLine *line;
+  int        iLine;
+
+  do {
+    line = NULL;
+    for (iLine = 0; iLine < SECTOR_CACHE_LINES; iLine++)
+      if ((vol.lines[iLine].dirtyMask != 0) &&
+          ((vol.lines[iLine].sectorNo >> vol.unitSectorsBits) == unitNo) &&
+          ((line == NULL) || (vol.lines[iLine].sectorNo < line->sectorNo)))
+        line = &vol.lines[iLine];
+
+    if (line != NULL)
+      checkStatus(flushLine(&vol,line));
+  } while (line != NULL);
+
+  return flOK;
+}
+
+
+/*----------------------------------------------------------------------*/
+/*                        f l u s h C a c h e                           */
+/*                                                                      */
+/* Writes all the dirty lines, a virtual unit at a time.                */
+/*                                                                      */
+/* Returns:                                                             */
+/*      FLStatus        : 0 on success, failed otherwise                */
+/*----------------------------------------------------------------------*/
+
+static FLStatus flushCache(SectorCache vol)
+{
+  CacheLine *line;
+  int        iLine;
+
+  do {
+    line = NULL;
+    for (iLine = 0; iLine < SECTOR_CACHE_LINES; iLine++)
+      if ((vol.lines[iLine].dirtyMask != 0) &&
+          ((line == NULL) || (vol.lines[iLine].sectorNo < line->sectorNo)))
+        line = &vol.lines[iLine];
+
+    if (line != NULL)
+      checkStatus(flushUnit(&vol,line->sectorNo >> vol.unitSectorsBits));
+  } while (line != NULL);
+
+  if (vol.baseTL.flush != NULL)
+    return vol.baseTL.flush(vol.baseTL.rec);
+
+  return flOK;
+}
+
+
+/*----------------------------------------------------------------------*/
+/*                         a l l o c L i n e                            */
+/*                                                                      */
+/* Takes a free line, or the least recently used one, for a line of     */
+/* sectors. If that line is dirty, its virtual unit is written first.   */
+/*                                                                      */
+/* Parameters:                                                          */
+/*      vol             : Pointer identifying drive                     */
+/*      lineSector      : First sector of the line                      */
+/*      mayFlush        : FALSE to give up rather than write            */
+/*      linePtr         : Receives the line, NULL if given up           */
+/*                                                                      */
+/* Returns:                                                             */
+/*      FLStatus        : 0 on success, failed otherwise                */
+/*----------------------------------------------------------------------*/
+
+static FLStatus allocLine(SectorCache vol, SectorNo lineSector,
+                          FLBoolean mayFlush, CacheLine **linePtr)
+{
+  CacheLine *line = NULL;
+  int        iLine;
+
+  *linePtr = NULL;
+
+  for (iLine = 0; iLine < SECTOR_CACHE_LINES; iLine++)
+  {
+    if (vol.lines[iLine].sectorNo == UNASSIGNED_SECTOR)
+    {
+      line = &vol.lines[iLine];
+      break;
+    }
+    if ((line == NULL) ||
+        (vol.useCount - vol.lines[iLine].lastUse > vol.useCount - line->lastUse))
+      line = &vol.lines[iLine];
+  }
+
+  if (line->dirtyMask != 0)
+  {
+    if (!mayFlush)
+      return flOK;
+    checkStatus(flushUnit(&vol,line->sectorNo >> vol.unitSectorsBits));
+  }
+
+  line->sectorNo  = lineSector;
+  line->validMask = 0;
+  line->dirtyMask = 0;
+  line->lastUse   = ++vol.useCount;
+  *linePtr = line;
+
+  return flOK;
+}
+
+
+/*----------------------------------------------------------------------*/
+/*                          f i l l L i n e                             */
+/*                                                                      */
+/* Reads the sectors of a line that it does not hold yet.               */
+/*                                                                      */
+/* Parameters:                                                          */
+/*      vol             : Pointer identifying drive                     */
+/*      line            : Line to fill                                  */
+/*      mask            : Sectors of the line to read                   */
+/*                                                                      */
+/* Returns:                                                             */
+/*      FLStatus        : 0 on success, failed otherwise                */
+/*----------------------------------------------------------------------*/
+
+static FLStatus fillLine(SectorCache vol, CacheLine *line, dword mask)
+{
+  unsigned first, last;
+  FLStatus status;
+
+  mask &= ~line->validMask;
+
+  for (first = 0; first < SECTOR_CACHE_LINE_SECTORS; first = last)
+  {
+    if (!(mask & ((dword)1 << first)))
+    {
+      last = first + 1;
+      continue;
+    }
+    for (last = first + 1; (last < SECTOR_CACHE_LINE_SECTORS) &&
+         (mask & ((dword)1 << last)); last++);
+
+    status = vol.baseTL.readSectors(vol.baseTL.rec,line->sectorNo + first,
+                                    line->data + (first << SECTOR_SIZE_BITS),
+                                    (SectorNo)(last - first));
+
+    /* Unassigned sectors are read as 0's */
+    if ((status != flOK) && (status != flSectorNotFound))
+      return status;
+
+    line->validMask |= rangeMask(first,last - first);
+  }
+  return flOK;
+}
+
+
+/*----------------------------------------------------------------------*/
+/*                      d i s c a r d S e c t o r s                     */
+/*                                                                      */
+/* Drops the cached copies of consecutive sectors, dirty or not.        */
+/*                                                                      */
+/*----------------------------------------------------------------------*/
+
+static void discardSectors(SectorCache vol, SectorNo sectorNo,
+                           SectorNo sectorCount)
+{
+  SectorNo   first, last;
+  CacheLine *line;
+  dword      mask;
+  int        iLine;
+
+  for (iLine = 0; iLine < SECTOR_CACHE_LINES; iLine++)
+  {
+    line = &vol.lines[iLine];
+    if ((line->sectorNo == UNASSIGNED_SECTOR) ||
+        (line->sectorNo + SECTOR_CACHE_LINE_SECTORS <= sectorNo) ||
+        (line->sectorNo >= sectorNo + sectorCount))
+      continue;
+
+    first = (line->sectorNo > sectorNo) ? line->sectorNo : sectorNo;
+    last  = line->sectorNo + SECTOR_CACHE_LINE_SECTORS;
+    if (last > sectorNo + sectorCount)
+      last = sectorNo + sectorCount;
+
+    mask = rangeMask(first,last - first);
+    line->validMask &= ~mask;
+    line->dirtyMask &= ~mask;
+  }
+}
+
+
+/*----------------------------------------------------------------------*/
+/*                         r e a d A h e a d                            */
+/*                                                                      */
+/* Reads the lines that follow a sequential read, up to the end of its  */
+/* virtual unit. Read ahead only takes lines that are clean.            */
+/*                                                                      */
+/* Parameters:                                                          */
+/*      vol             : Pointer identifying drive                     */
+/*      sectorNo        : Sector after the end of the read              */
+/*                                                                      */
+/*----------------------------------------------------------------------*/
+
+static void readAhead(SectorCache vol, SectorNo sectorNo)
+{
+  SectorNo   lineSector = lineOf(sectorNo);
+  SectorNo   unitNo     = (sectorNo - 1) >> vol.unitSectorsBits;
+  CacheLine *line;
+  int        iLine;
+
+  for (iLine = 0; iLine < SECTOR_CACHE_READ_AHEAD;
+       iLine++, lineSector += SECTOR_CACHE_LINE_SECTORS)
+  {
+    if ((lineSector >= vol.virtualSectors) ||
+        ((lineSector >> vol.unitSectorsBits) != unitNo))
+      break;
+
+    line = findLine(&vol,lineSector);
+    if (line == NULL)
+    {
+      if ((allocLine(&vol,lineSector,FALSE,&line) != flOK) || (line == NULL))
+        break;
+    }
+    if (fillLine(&vol,line,lineMask(&vol,lineSector)) != flOK)
+      break;
+  }
+}
+
+
+/*----------------------------------------------------------------------*/
+/*                   c a c h e R e a d S e c t o r s                    */
+/*                                                                      */
+/* Read content of a set of consecutive sectors.                        */
+/*                                                                      */
+/* Reads that bypass the cache take the dirty sectors from the cache,   */
+/* since the TL does not have them yet.                                 */
+/*                                                                      */
+/* Parameters:                                                          */
+/*      vol            : Pointer identifying drive                      */
+/*      sectorNo       : Sector no. to read                             */
+/*      dest           : pointer to buffer to read                      */
+/*      sectorCount    : # of sectors to read                           */
+/*                                                                      */
+/* Returns:                                                             */
+/*      status of the read operaton                                     */
+/*----------------------------------------------------------------------*/
+
+static FLStatus cacheReadSectors(SectorCache vol, SectorNo sectorNo,
+                                 void FAR1 *dest, SectorNo sectorCount)
+{
+  byte FAR1 *curDest    = (byte FAR1 *)dest;
+  SectorNo   endSector  = sectorNo + sectorCount;
+  FLBoolean  sequential = (FLBoolean)(sectorNo == vol.nextReadSector);
+  SectorNo   lineSector, count, iSector;
+  CacheLine *line;
+  FLStatus   status;
+  dword      need;
+  int        iLine;
+
+  if (endSector > vol.virtualSectors)
+    return flSectorNotFound;        /* Out of bounds */
+
+  vol.nextReadSector = endSector;
+
+  if (sectorCount >= SECTOR_CACHE_MAX_TRANSFER)
+  {
+    status = vol.baseTL.readSectors(vol.baseTL.rec,sectorNo,dest,sectorCount);
+    if ((status != flOK) && (status != flSectorNotFound))
+      return status;
+
+    for (iLine = 0; iLine < SECTOR_CACHE_LINES; iLine++)
+    {
+      line = &vol.lines[iLine];
+      if ((line->dirtyMask == 0) ||
+          (line->sectorNo + SECTOR_CACHE_LINE_SECTORS <= sectorNo) ||
+          (line->sectorNo >= endSector))
+        continue;
+
+      for (iSector = line->sectorNo;
+           iSector < line->sectorNo + SECTOR_CACHE_LINE_SECTORS; iSector++)
+        if ((iSector >= sectorNo) && (iSector < endSector) &&
+            (line->dirtyMask & ((dword)1 << offsetInLine(iSector))))
+          tffscpy(curDest + ((iSector - sectorNo) << SECTOR_SIZE_BITS),
+                  lineData(line,iSector),SECTOR_SIZE);
+    }
+    return status;
+  }
+
+  while (sectorNo < endSector)
+  {
+    lineSector = lineOf(sectorNo);
+    count = lineSector + SECTOR_CACHE_LINE_SECTORS - sectorNo;
+    if (count > endSector - sectorNo)
+      count = endSector - sectorNo;
+    need = rangeMask(sectorNo,count);
+
+    line = findLine(&vol,lineSector);
+    if (line == NULL)
+      checkStatus(allocLine(&vol,lineSector,TRUE,&line));
+
+    /* A sequential read fills the whole line */
+    if ((line->validMask & need) != need)
+      checkStatus(fillLine(&vol,line,sequential ? lineMask(&vol,lineSector) : need));
+
+    line->lastUse = ++vol.useCount;
+    tffscpy(curDest,lineData(line,sectorNo),(unsigned)count << SECTOR_SIZE_BITS);
+    curDest  += count << SECTOR_SIZE_BITS;
+    sectorNo += count;
+  }
+
+  if (sequential)
+    readAhead(&vol,endSector);
+
+  return flOK;
+}
+
+
+/*----------------------------------------------------------------------*/
+/*                 c a c h e W r i t e M u l t i S e c t o r            */
+/*                                                                      */
+/* Write set of consecutive sectors                                     */
+/*                                                                      */
+/* Small writes are only copied to the cache. Large ones go to the TL,  */
+/* and the cached copies of their sectors are dropped.                  */
+/*                                                                      */
+/* Parameters:                                                          */
+/*      vol             : Pointer identifying drive                     */
+/*      sectorNo        : Sector no. to write                           */
+/*      fromAddress     : pointer to buffer to write                    */
+/*      sectorCount     : # of sectors to write                         */
+/*                                                                      */
+/* Returns:                                                             */
+/*      status of the write operaton                                    */
+/*----------------------------------------------------------------------*/
+
+static FLStatus cacheWriteMultiSector(SectorCache vol, SectorNo sectorNo,
+                                      void FAR1 *fromAddress,SectorNo sectorCount)
+{
+  byte FAR1 *curAddr   = (byte FAR1 *)fromAddress;
+  SectorNo   endSector = sectorNo + sectorCount;
+  SectorNo   lineSector, count;
+  CacheLine *line;
+  dword      mask;
+
+  if (endSector > vol.virtualSectors)
+    return flSectorNotFound;
+
+  if (sectorCount >= SECTOR_CACHE_MAX_TRANSFER)
+  {
+    discardSectors(&vol,sectorNo,sectorCount);
+    return vol.baseTL.writeMultiSector(vol.baseTL.rec,sectorNo,fromAddress,
+                                       sectorCount);
+  }
+
+  while (sectorNo < endSector)
+  {
+    lineSector = lineOf(sectorNo);
+    count = lineSector + SECTOR_CACHE_LINE_SECTORS - sectorNo;
+    if (count > endSector - sectorNo)
+      count = endSector - sectorNo;
+    mask = rangeMask(sectorNo,count);
+
+    line = findLine(&vol,lineSector);
+    if (line == NULL)
+      checkStatus(allocLine(&vol,lineSector,TRUE,&line));
+
+    tffscpy(lineData(line,sectorNo),curAddr,(unsigned)count << SECTOR_SIZE_BITS);
+    line->validMask |= mask;
+    line->dirtyMask |= mask;
+    line->lastUse = ++vol.useCount;
+
+    curAddr  += count << SECTOR_SIZE_BITS;
+    sectorNo += count;
+  }
+  return flOK;
+}
+
+
+/*----------------------------------------------------------------------*/
+/*                     c a c h e W r i t e S e c t o r                  */
+/*                                                                      */
+/* Writes a sector.                                                     */
+/*                                                                      */
+/*----------------------------------------------------------------------*/
+
+static FLStatus cacheWriteSector(SectorCache vol, SectorNo sectorNo,
+                                 void FAR1 *fromAddress)
+{
+  return cacheWriteMultiSector(&vol,sectorNo,fromAddress,1);
+}
+
+
+/*----------------------------------------------------------------------*/
+/*                    c a c h e D e l e t e S e c t o r                 */
+/*                                                                      */
+/* Marks contiguous sectors as deleted.                                 */
+/*                                                                      */
+/*----------------------------------------------------------------------*/
+
+static FLStatus cacheDeleteSector(SectorCache vol, SectorNo sectorNo,
+                                  SectorNo noOfSectors)
+{
+  discardSectors(&vol,sectorNo,noOfSectors);
+  return vol.baseTL.deleteSector(vol.baseTL.rec,sectorNo,noOfSectors);
+}
+
+
+/*----------------------------------------------------------------------*/
+/*                      c a c h e M a p S e c t o r                     */
+/*                                                                      */
+/* Maps a sector of the TL. A dirty sector is written first, so that    */
+/* the TL has the data the caller expects.                              */
+/*                                                                      */
+/*----------------------------------------------------------------------*/
+
+static const void FAR0 *cacheMapSector(SectorCache vol, SectorNo sectorNo,
+                                       CardAddress *physAddr)
+{
+  CacheLine *line = findLine(&vol,lineOf(sectorNo));
+
+  if ((line != NULL) &&
+      (line->dirtyMask & ((dword)1 << offsetInLine(sectorNo))))
+  {
+    if (flushLine(&vol,line) != flOK)
+      return dataErrorToken;
+  }
+  return vol.baseTL.mapSector(vol.baseTL.rec,sectorNo,physAddr);
+}
+
+
+/*----------------------------------------------------------------------*/
+/*         Routines that only pass the call on to the TL                */
+/*----------------------------------------------------------------------*/
+
+static FLStatus cacheSetBusy(SectorCache vol, FLBoolean state)
+{
+  return vol.baseTL.tlSetBusy(vol.baseTL.rec,state);
+}
+
+static SectorNo cacheSectorsInVolume(SectorCache vol)
+{
+  return vol.baseTL.sectorsInVolume(vol.baseTL.rec);
+}
+
+static FLStatus cacheGetTLInfo(SectorCache vol, TLInfo *tlInfo)
+{
+  return vol.baseTL.getTLInfo(vol.baseTL.rec,tlInfo);
+}
+
+static void cacheRecommendedClusterInfo(SectorCache vol, int *sectorsPerCluster,
+                                        SectorNo *clusterAlignment)
+{
+  vol.baseTL.recommendedClusterInfo(vol.baseTL.rec,sectorsPerCluster,
+                                    clusterAlignment);
+}
+
+#ifndef NO_READ_BBT_CODE
+static FLStatus cacheReadBBT(SectorCache vol, CardAddress FAR1 * buf,
+                             long FAR2 * mediaSize, unsigned FAR2 * noOfBB)
+{
+  return vol.baseTL.readBBT(vol.baseTL.rec,buf,mediaSize,noOfBB);
+}
+#endif /* NO_READ_BBT_CODE */
+
+/*----------------------------------------------------------------------*/
+/*      Routines that look at the media as a whole write back first     */
+/*----------------------------------------------------------------------*/
+
+#ifdef DEFRAGMENT_VOLUME
+static FLStatus cacheDefragment(SectorCache vol, long FAR2 *bytesNeeded)
+{
+  checkStatus(flushCache(&vol));
+  return vol.baseTL.defragment(vol.baseTL.rec,bytesNeeded);
+}
+#endif /* DEFRAGMENT_VOLUME */
+
+#if (defined(VERIFY_VOLUME) || defined(VERIFY_WRITE) || defined(VERIFY_ERASED_SECTOR))
+static FLStatus cacheCheckVolume(SectorCache vol)
+{
+  checkStatus(flushCache(&vol));
+  return vol.baseTL.checkVolume(vol.baseTL.rec);
+}
+#endif /* VERIFY_VOLUME || VERIFY_WRITE || VERIFY_ERASED_SECTOR */
+
+
+/*----------------------------------------------------------------------*/
+/*                  d i s m o u n t S e c t o r C a c h e               */
+/*                                                                      */
+/* Writes back the cache and dismounts the TL under it.                 */
+/*                                                                      */
+/* Parameters:                                                          */
+/*      vol             : Pointer identifying drive                     */
+/*                                                                      */
+/*----------------------------------------------------------------------*/
+
+static void dismountSectorCache(SectorCache vol)
+{
+  if (flushCache(&vol) != flOK)
+  {
+    DEBUG_PRINT(("Debug: failed writing back the sector cache on dismount.\r\n"));
+  }
+
+  vol.baseTL.dismount(vol.baseTL.rec);
+
+  if (vol.buffer != NULL)
+  {
+    FL_FREE(vol.buffer);
+    vol.buffer = NULL;
+  }
+}
+
+
+/*----------------------------------------------------------------------*/
+/*                    m o u n t S e c t o r C a c h e                   */
+/*                                                                      */
+/* Places the cache in front of a mounted translation layer.            */
+/*                                                                      */
+/* Parameters:                                                          */
+/*      volNo           : Volume no.                                    */
+/*      tl              : Mounted translation layer, replaced by the    */
+/*                        cache                                         */
+/*      flash           : Not used by a filter                          */
+/*      volForCallback  : Not used by a filter                          */
+/*                                                                      */
+/* Returns:                                                             */
+/*      FLStatus        : 0 on success, failed otherwise                */
+/*----------------------------------------------------------------------*/
+
+static FLStatus mountSectorCache(unsigned volNo, TL *tl, FLFlash *flash,
+                                 FLFlash **volForCallback)
+{
+  SectorCache vol = &cacheVols[volNo];
+  TLInfo      tlInfo;
+  int         iLine;
+
+  /* Only TLs that read and write several sectors at a time are cached */
+  if ((tl->readSectors == NULL) || (tl->writeMultiSector == NULL) ||
+      (tl->deleteSector == NULL))
+    return flFeatureNotSupported;
+
+  checkStatus(tl->getTLInfo(tl->rec,&tlInfo));
+  if (tlInfo.tlUnitBits < SECTOR_CACHE_LINE_BITS + SECTOR_SIZE_BITS)
+    return flFeatureNotSupported;
+
+  /* The buffer is kept if the volume was not dismounted */
+  if (vol.buffer == NULL)
+  {
+    vol.buffer = (byte FAR1 *)FL_MALLOC((dword)SECTOR_CACHE_LINES <<
+                                        (SECTOR_CACHE_LINE_BITS + SECTOR_SIZE_BITS));
+    if (vol.buffer == NULL)
+    {
+      DEBUG_PRINT(("Debug: failed allocating the sector cache.\r\n"));
+      return flNotEnoughMemory;
+    }
+  }
+
+  vol.baseTL          = *tl;
+  vol.virtualSectors  = tl->sectorsInVolume(tl->rec);
+  vol.unitSectorsBits = (unsigned)tlInfo.tlUnitBits - SECTOR_SIZE_BITS;
+  vol.nextReadSector  = UNASSIGNED_SECTOR;
+  vol.useCount        = 0;
+
+  for (iLine = 0; iLine < SECTOR_CACHE_LINES; iLine++)
+  {
+    vol.lines[iLine].sectorNo  = UNASSIGNED_SECTOR;
+    vol.lines[iLine].validMask = 0;
+    vol.lines[iLine].dirtyMask = 0;
+    vol.lines[iLine].lastUse   = 0;
+    vol.lines[iLine].data      = vol.buffer +
+      (iLine << (SECTOR_CACHE_LINE_BITS + SECTOR_SIZE_BITS));
+  }
+
+  tl->rec              = &vol;
+  tl->mapSector        = cacheMapSector;
+  tl->writeSector      = cacheWriteSector;
+  tl->writeMultiSector = cacheWriteMultiSector;
+  tl->readSectors      = cacheReadSectors;
+  tl->deleteSector     = cacheDeleteSector;
+  tl->tlSetBusy        = cacheSetBusy;
+  tl->dismount         = dismountSectorCache;
+  tl->flush            = flushCache;
+  tl->sectorsInVolume  = cacheSectorsInVolume;
+  tl->getTLInfo        = cacheGetTLInfo;
+  if (vol.baseTL.recommendedClusterInfo != NULL)
+    tl->recommendedClusterInfo = cacheRecommendedClusterInfo;
+#ifndef NO_READ_BBT_CODE
+  if (vol.baseTL.readBBT != NULL)
+    tl->readBBT        = cacheReadBBT;
+#endif /* NO_READ_BBT_CODE */
+#ifdef DEFRAGMENT_VOLUME
+  if (vol.baseTL.defragment != NULL)
+    tl->defragment     = cacheDefragment;
+#endif /* DEFRAGMENT_VOLUME */
+#if (defined(VERIFY_VOLUME) || defined(VERIFY_WRITE) || defined(VERIFY_ERASED_SECTOR))
+  if (vol.baseTL.checkVolume != NULL)
+    tl->checkVolume    = cacheCheckVolume;
+#endif /* VERIFY_VOLUME || VERIFY_WRITE || VERIFY_ERASED_SECTOR */
+
+  DEBUG_PRINT(("Debug: sector cache mounted.\r\n"));
+  return flOK;
+}
+
+
+/*----------------------------------------------------------------------*/
+/*                f l R e g i s t e r S e c t o r C a c h e             */
+/*                                                                      */
+/* Register this block device filter for use                            */
+/*                                                                      */
+/* Returns:                                                             */
+/*      FLStatus        : 0 on success, otherwise failure               */
+/*----------------------------------------------------------------------*/
+
+FLStatus flRegisterSectorCache(void)
+{
+  int volNo;
+
+  if (noOfTLs >= TLS)
+    return flTooManyComponents;
+
+  tlTable[noOfTLs].mountRoutine    = mountSectorCache;
+  tlTable[noOfTLs].preMountRoutine = NULL;
+  tlTable[noOfTLs].formatRoutine   = NULL;  /* block-device filter */
+  noOfTLs++;
+
+  for (volNo = 0; volNo < VOLUMES; volNo++)
+    cacheVols[volNo].buffer = NULL;
+
+  return flOK;
+}
+
+#endif /* SECTOR_CACHE */
@@ -0,0 +1,42 @@
+/*
+
+Module Name:
+
+    flcache.h
+
+Abstract:
+
+    Geometry of the write-back sector cache (see flcache.c).
+
+--*/
+
+#ifndef FLCACHE_H
+#define FLCACHE_H
+
+#ifdef SECTOR_CACHE
+
+/* Number of cache lines of each mounted volume. May be set in flcustom.h */
+
+#ifndef SECTOR_CACHE_LINES
+#define SECTOR_CACHE_LINES          16
+#endif /* SECTOR_CACHE_LINES */
+
+/* Sectors in a cache line (at most 32). Lines start on a multiple of   */
+/* their size, so a line is never split between two virtual units and  */
+/* INFTL writes it in pairs of sectors.                                 */
+
+#define SECTOR_CACHE_LINE_BITS      3
+#define SECTOR_CACHE_LINE_SECTORS   (1 << SECTOR_CACHE_LINE_BITS)
+
+/* Transfers of this many sectors or more bypass the cache */
+
+#define SECTOR_CACHE_MAX_TRANSFER   ((SECTOR_CACHE_LINES << SECTOR_CACHE_LINE_BITS) >> 1)
+
+/* Lines read ahead of a sequential read. Read ahead stops at the end   */
+/* of the virtual unit, whose chain the read has just walked.           */
+
+#define SECTOR_CACHE_READ_AHEAD     2
+
+#endif /* SECTOR_CACHE */
+
+#endif /* FLCACHE_H */
@@ -148,6 +148,17 @@
 #define FL_FAR_FREE FL_FREE 
 #endif /* FL_MALLOC && ! FL_FAR_MALLOC */
 
+/* Validity check for SECTOR_CACHE
+ * The sector cache needs memory allocation and writes back through the
+ * translation layer.
+ */
+
+#ifdef SECTOR_CACHE
+#if (defined(FL_READ_ONLY) || !defined(FL_MALLOC) || defined(SCATTER_GATHER))
+#undef SECTOR_CACHE
+#endif /* FL_READ_ONLY || !FL_MALLOC || SCATTER_GATHER */
+#endif /* SECTOR_CACHE */
+
 /* Validity check for BDK_ACCESS */
 
 #if (defined (WRITE_EXB_IMAGE) && !defined (BDK_ACCESS))
@@ -82,5 +82,9 @@ flRegisterComponents(void)
     checkStatus(flRegisterNFTL());
     checkStatus(flRegisterFTL());
 
+#ifdef SECTOR_CACHE
+    checkStatus(flRegisterSectorCache());   /* Filter in front of the TLs */
+#endif /* SECTOR_CACHE */
+
     return flOK;
 }
@@ -347,7 +347,25 @@
 
 #define MTDS	10	/* Up to 5 MTD's */
 
-#define	TLS	3	/* Up to 3 Translation Layers */
+#define	TLS	4	/* Up to 3 Translation Layers and the sector cache */
+
+
+
+/* Sector cache
+ *
+ * Keeps recently used sectors in RAM in front of the translation layer
+ * and writes them back a virtual unit at a time (see flcache.c). Small
+ * writes then cost INFTL fewer chain folds and erases, and sequential
+ * reads are read ahead.
+ *
+ * The cache takes SECTOR_CACHE_LINES (flcache.h) lines of 4KB of RAM for
+ * each mounted volume. Sectors written are only on the media after the
+ * next flFlushBuffer or dismount, so the driver must flush on shutdown
+ * and before power is removed.
+ *
+ */
+
+#define SECTOR_CACHE
 
 
 
@@ -434,6 +434,7 @@ FLStatus flMount(unsigned volNo, unsigned socketNo,TL *tl,
   tl->recommendedClusterInfo = NULL;
   tl->writeMultiSector       = NULL;
   tl->readSectors            = NULL;
+  tl->flush                  = NULL;
 #ifndef NO_READ_BBT_CODE
   tl->readBBT                = NULL;
 #endif 
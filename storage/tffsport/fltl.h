@@ -82,6 +82,7 @@ struct tTL {
   FLStatus       (*deleteSector)(TLrec *, SectorNo sectorNo, SectorNo noOfSectors);
   FLStatus       (*tlSetBusy)(TLrec *, FLBoolean);
   void           (*dismount)(TLrec *);
+  FLStatus       (*flush)(TLrec *);      /* Writes back cached data, may be NULL */
 
 #ifdef DEFRAGMENT_VOLUME
   FLStatus       (*defragment)(TLrec *, long FAR2 *bytesNeeded);
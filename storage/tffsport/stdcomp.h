@@ -88,6 +88,12 @@ FLStatus    flRegisterSSFDC(void);                    /* see SSFDC.C    */
 FLStatus    flRegisterATAtl(void);                    /* see atatl.c    */
 FLStatus    flRegisterZIP(void);		      /* see ZIP.C	*/
 
+/************************************************************************/
+/* Sector cache: a block device filter placed in front of the TL	*/
+/************************************************************************/
+
+FLStatus    flRegisterSectorCache(void);              /* see FLCACHE.C  */
+
 /************************************************************************/
 /* Multi-TL also known as Multi-DOC: Combine different devices into a   */
 /* single big device allowing each of the devices to be formatted with  */
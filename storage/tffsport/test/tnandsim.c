@@ -0,0 +1,724 @@
+//
+// NAND simulator for the TrueFFS sector cache.
+//
+// The simulated translation layer keeps the data of each virtual unit in a
+// chain of physical units the way INFTL does: a sector is written to the
+// last unit of the chain if its page there is still free, otherwise a new
+// unit is added to the chain.  A chain is folded into a single unit when
+// it reaches MAX_UNIT_CHAIN units, and the longest chain is folded when
+// fewer than two units are free.  Folding copies the newest copy of each
+// sector to a free unit and erases the units of the chain.
+//
+// The same host workload - small writes to a hot area, small sequential
+// writes, reads, and large writes - is run on the translation layer alone
+// and with the sector cache mounted in front of it, flushing the cache as
+// often as the driver thread would.  Every read is checked against a
+// shadow copy of the volume, and so is the media after the last flush.
+// Folds, erases and page programs are reported per host write.
+//
+// Usage:
+//
+//     tnandsim [-o operations] [-s seed]
+//
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// The part of TrueFFS the sector cache uses.
+//
+
+typedef unsigned char byte;
+typedef unsigned long dword;
+typedef unsigned long SectorNo;
+typedef unsigned long CardAddress;
+typedef int FLBoolean;
+
+#define FAR0
+#define FAR1
+#define FAR2
+
+typedef enum {
+    flOK                  = 0,
+    flSectorNotFound      = 27,
+    flGeneralFailure      = 31,
+    flNotEnoughMemory     = 63,
+    flTooManyComponents   = 102,
+    flFeatureNotSupported = 106
+} FLStatus;
+
+#define SECTOR_SIZE_BITS    9
+#define SECTOR_SIZE         (1 << SECTOR_SIZE_BITS)
+#define UNASSIGNED_SECTOR   0xffffffffl
+
+#define checkStatus(exp) { FLStatus fl__status = (exp); if (fl__status != flOK) return fl__status; }
+#define DEBUG_PRINT(str)
+#define tffscpy memcpy
+#define FL_MALLOC malloc
+#define FL_FREE free
+
+#define NO_READ_BBT_CODE
+
+#define vol (*pVol)
+
+typedef struct {
+    int unused;
+} FLFlash;
+
+typedef struct {
+    SectorNo sectorsInVolume;
+    unsigned long bootAreaSize;
+    unsigned long eraseCycles;
+    unsigned long tlUnitBits;
+} TLInfo;
+
+typedef struct tTL TL;
+typedef struct tTLrec TLrec;
+
+struct tTL {
+    TLrec *rec;
+    byte partitionNo;
+    byte socketNo;
+
+    const void FAR0 *(*mapSector)(TLrec *, SectorNo sectorNo, CardAddress *physAddr);
+    FLStatus (*writeSector)(TLrec *, SectorNo sectorNo, void FAR1 *fromAddress);
+    FLStatus (*writeMultiSector)(TLrec *, SectorNo sectorNo, void FAR1 *fromAddress, SectorNo sectorCount);
+    FLStatus (*readSectors)(TLrec *, SectorNo sectorNo, void FAR1 *dest, SectorNo sectorCount);
+    FLStatus (*deleteSector)(TLrec *, SectorNo sectorNo, SectorNo noOfSectors);
+    FLStatus (*tlSetBusy)(TLrec *, FLBoolean);
+    void (*dismount)(TLrec *);
+    FLStatus (*flush)(TLrec *);
+    SectorNo (*sectorsInVolume)(TLrec *);
+    FLStatus (*getTLInfo)(TLrec *, TLInfo *tlInfo);
+    void (*recommendedClusterInfo)(TLrec *, int *sectorsPerCluster, SectorNo *clusterAlignment);
+};
+
+typedef struct {
+    FLStatus (*mountRoutine)(unsigned volNo, TL *tl, FLFlash *flash, FLFlash **volForCallback);
+    FLStatus (*formatRoutine)(unsigned volNo, void *deviceFormatParams, FLFlash *flash);
+    FLStatus (*preMountRoutine)(int callType, void *ioreq, FLFlash *flash, FLStatus *status);
+} TLentry;
+
+#define VOLUMES 1
+#define TLS     1
+
+TLentry tlTable[TLS];
+int noOfTLs;
+
+static byte dataErrorObject;
+#define dataErrorToken ((void FAR0 *) &dataErrorObject)
+
+#define SECTOR_CACHE
+
+#include "flcache.c"
+
+//
+// The simulated media and translation layer.
+//
+
+#define UNIT_SECTOR_BITS    5
+#define UNIT_SECTORS        (1 << UNIT_SECTOR_BITS)
+#define VIRTUAL_UNITS       64
+#define PHYSICAL_UNITS      (VIRTUAL_UNITS + 6)
+#define VIRTUAL_SECTORS     (VIRTUAL_UNITS * UNIT_SECTORS)
+#define MAX_UNIT_CHAIN      20
+#define NO_UNIT             0xffff
+
+typedef struct _PHYSICAL_UNIT {
+    USHORT Owner;                       // virtual unit, or NO_UNIT if free
+    ULONG Programmed;                   // pages written since the erase
+    ULONG Deleted;                      // pages whose sector was deleted
+    byte Data[UNIT_SECTORS][SECTOR_SIZE];
+} PHYSICAL_UNIT;
+
+typedef struct _NAND_COUNTERS {
+    ULONG Folds;
+    ULONG Erases;
+    ULONG Programs;
+    ULONG PageReads;
+    ULONG Writes;                       // write calls made to the layer
+} NAND_COUNTERS;
+
+PHYSICAL_UNIT Units[PHYSICAL_UNITS];
+USHORT Chain[VIRTUAL_UNITS][MAX_UNIT_CHAIN];
+ULONG ChainLength[VIRTUAL_UNITS];
+ULONG FreeUnits;
+NAND_COUNTERS Nand;
+
+//
+// The shadow copy of the volume, and the host counters.
+//
+
+byte Shadow[VIRTUAL_SECTORS][SECTOR_SIZE];
+ULONG HostWrites;
+ULONG HostReads;
+ULONG Failures;
+ULONG Seed;
+
+ULONG
+Random(
+    ULONG Range
+    )
+{
+    Seed = Seed * 1103515245 + 12345;
+    return (Seed >> 16) % Range;
+}
+
+VOID
+FormatMedia(
+    VOID
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < PHYSICAL_UNITS; i++) {
+        Units[i].Owner = NO_UNIT;
+        Units[i].Programmed = 0;
+        Units[i].Deleted = 0;
+    }
+    for (i = 0; i < VIRTUAL_UNITS; i++) {
+        ChainLength[i] = 0;
+    }
+    FreeUnits = PHYSICAL_UNITS;
+    memset(&Nand, 0, sizeof(Nand));
+    memset(Shadow, 0, sizeof(Shadow));
+}
+
+VOID
+EraseUnit(
+    USHORT unit
+    )
+{
+    Units[unit].Owner = NO_UNIT;
+    Units[unit].Programmed = 0;
+    Units[unit].Deleted = 0;
+    FreeUnits++;
+    Nand.Erases++;
+}
+
+USHORT
+TakeFreeUnit(
+    USHORT virtualUnit
+    )
+{
+    USHORT unit;
+
+    for (unit = 0; unit < PHYSICAL_UNITS; unit++) {
+        if (Units[unit].Owner == NO_UNIT) {
+            Units[unit].Owner = virtualUnit;
+            FreeUnits--;
+            return unit;
+        }
+    }
+    return NO_UNIT;
+}
+
+//
+// Returns the newest unit of the chain that holds the sector, or NO_UNIT.
+//
+
+USHORT
+FindSector(
+    ULONG virtualUnit,
+    ULONG page
+    )
+{
+    ULONG i;
+    USHORT unit;
+
+    for (i = ChainLength[virtualUnit]; i-- > 0; ) {
+        unit = Chain[virtualUnit][i];
+        if (Units[unit].Programmed & ((ULONG)1 << page)) {
+            return (Units[unit].Deleted & ((ULONG)1 << page)) ? NO_UNIT : unit;
+        }
+    }
+    return NO_UNIT;
+}
+
+VOID
+FoldChain(
+    ULONG virtualUnit
+    )
+{
+    USHORT target, unit;
+    ULONG page, i;
+
+    target = TakeFreeUnit((USHORT) virtualUnit);
+    for (page = 0; page < UNIT_SECTORS; page++) {
+        unit = FindSector(virtualUnit, page);
+        if (unit != NO_UNIT) {
+            memcpy(Units[target].Data[page], Units[unit].Data[page], SECTOR_SIZE);
+            Units[target].Programmed |= (ULONG)1 << page;
+            Nand.Programs++;
+        }
+    }
+    for (i = 0; i < ChainLength[virtualUnit]; i++) {
+        EraseUnit(Chain[virtualUnit][i]);
+    }
+    Chain[virtualUnit][0] = target;
+    ChainLength[virtualUnit] = 1;
+    Nand.Folds++;
+}
+
+//
+// Adds a unit to the chain of a virtual unit, folding to make room.
+//
+
+VOID
+ExtendChain(
+    ULONG virtualUnit
+    )
+{
+    ULONG longest, i;
+
+    if (ChainLength[virtualUnit] == MAX_UNIT_CHAIN) {
+        FoldChain(virtualUnit);
+    }
+
+    while (FreeUnits < 2) {
+        longest = 0;
+        for (i = 1; i < VIRTUAL_UNITS; i++) {
+            if (ChainLength[i] > ChainLength[longest]) {
+                longest = i;
+            }
+        }
+        FoldChain(longest);
+    }
+
+    Chain[virtualUnit][ChainLength[virtualUnit]++] = TakeFreeUnit((USHORT) virtualUnit);
+}
+
+FLStatus
+NandWriteMultiSector(
+    TLrec *rec,
+    SectorNo sectorNo,
+    void FAR1 *fromAddress,
+    SectorNo sectorCount
+    )
+{
+    byte *data = fromAddress;
+    ULONG virtualUnit, page;
+    USHORT unit;
+
+    if (sectorNo + sectorCount > VIRTUAL_SECTORS) {
+        return flSectorNotFound;
+    }
+
+    Nand.Writes++;
+
+    for (; sectorCount; sectorCount--, sectorNo++, data += SECTOR_SIZE) {
+        virtualUnit = sectorNo >> UNIT_SECTOR_BITS;
+        page = sectorNo & (UNIT_SECTORS - 1);
+
+        if (ChainLength[virtualUnit] == 0 ||
+            (Units[Chain[virtualUnit][ChainLength[virtualUnit] - 1]].Programmed & ((ULONG)1 << page))) {
+            ExtendChain(virtualUnit);
+        }
+
+        unit = Chain[virtualUnit][ChainLength[virtualUnit] - 1];
+        memcpy(Units[unit].Data[page], data, SECTOR_SIZE);
+        Units[unit].Programmed |= (ULONG)1 << page;
+        Nand.Programs++;
+    }
+    return flOK;
+}
+
+FLStatus
+NandWriteSector(
+    TLrec *rec,
+    SectorNo sectorNo,
+    void FAR1 *fromAddress
+    )
+{
+    return NandWriteMultiSector(rec, sectorNo, fromAddress, 1);
+}
+
+FLStatus
+NandReadSectors(
+    TLrec *rec,
+    SectorNo sectorNo,
+    void FAR1 *dest,
+    SectorNo sectorCount
+    )
+{
+    byte *data = dest;
+    FLStatus status = flOK;
+    USHORT unit;
+
+    if (sectorNo + sectorCount > VIRTUAL_SECTORS) {
+        return flSectorNotFound;
+    }
+
+    for (; sectorCount; sectorCount--, sectorNo++, data += SECTOR_SIZE) {
+        unit = FindSector(sectorNo >> UNIT_SECTOR_BITS, sectorNo & (UNIT_SECTORS - 1));
+        if (unit == NO_UNIT) {
+            memset(data, 0, SECTOR_SIZE);
+            status = flSectorNotFound;
+        } else {
+            memcpy(data, Units[unit].Data[sectorNo & (UNIT_SECTORS - 1)], SECTOR_SIZE);
+            Nand.PageReads++;
+        }
+    }
+    return status;
+}
+
+FLStatus
+NandDeleteSector(
+    TLrec *rec,
+    SectorNo sectorNo,
+    SectorNo noOfSectors
+    )
+{
+    USHORT unit;
+    ULONG page;
+
+    if (sectorNo + noOfSectors > VIRTUAL_SECTORS) {
+        return flSectorNotFound;
+    }
+
+    for (; noOfSectors; noOfSectors--, sectorNo++) {
+        page = sectorNo & (UNIT_SECTORS - 1);
+        unit = FindSector(sectorNo >> UNIT_SECTOR_BITS, page);
+        if (unit != NO_UNIT) {
+            Units[unit].Deleted |= (ULONG)1 << page;
+        }
+    }
+    return flOK;
+}
+
+const void FAR0 *
+NandMapSector(
+    TLrec *rec,
+    SectorNo sectorNo,
+    CardAddress *physAddr
+    )
+{
+    USHORT unit;
+
+    if (sectorNo >= VIRTUAL_SECTORS) {
+        return NULL;
+    }
+    unit = FindSector(sectorNo >> UNIT_SECTOR_BITS, sectorNo & (UNIT_SECTORS - 1));
+    return (unit == NO_UNIT) ? NULL : Units[unit].Data[sectorNo & (UNIT_SECTORS - 1)];
+}
+
+FLStatus
+NandSetBusy(
+    TLrec *rec,
+    FLBoolean state
+    )
+{
+    return flOK;
+}
+
+VOID
+NandDismount(
+    TLrec *rec
+    )
+{
+}
+
+SectorNo
+NandSectorsInVolume(
+    TLrec *rec
+    )
+{
+    return VIRTUAL_SECTORS;
+}
+
+FLStatus
+NandGetTLInfo(
+    TLrec *rec,
+    TLInfo *tlInfo
+    )
+{
+    tlInfo->sectorsInVolume = VIRTUAL_SECTORS;
+    tlInfo->bootAreaSize = 0;
+    tlInfo->eraseCycles = 0;
+    tlInfo->tlUnitBits = UNIT_SECTOR_BITS + SECTOR_SIZE_BITS;
+    return flOK;
+}
+
+//
+// Mounts the simulated layer the way flMount mounts INFTL, and the sector
+// cache in front of it the way flMount mounts a block device filter.
+//
+
+BOOLEAN
+MountVolume(
+    TL *tl,
+    BOOLEAN useCache
+    )
+{
+    memset(tl, 0, sizeof(*tl));
+    tl->mapSector = NandMapSector;
+    tl->writeSector = NandWriteSector;
+    tl->writeMultiSector = NandWriteMultiSector;
+    tl->readSectors = NandReadSectors;
+    tl->deleteSector = NandDeleteSector;
+    tl->tlSetBusy = NandSetBusy;
+    tl->dismount = NandDismount;
+    tl->sectorsInVolume = NandSectorsInVolume;
+    tl->getTLInfo = NandGetTLInfo;
+
+    if (useCache && tlTable[0].mountRoutine(0, tl, NULL, NULL) != flOK) {
+        printf("failed to mount the sector cache\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+//
+// Host requests, checked against the shadow copy.
+//
+
+VOID
+HostWrite(
+    TL *tl,
+    ULONG sectorNo,
+    ULONG count
+    )
+{
+    static byte buffer[128 * SECTOR_SIZE];
+    ULONG i;
+    FLStatus status;
+
+    if (sectorNo + count > VIRTUAL_SECTORS) {
+        count = VIRTUAL_SECTORS - sectorNo;
+    }
+
+    for (i = 0; i < count * SECTOR_SIZE; i++) {
+        buffer[i] = (byte) Random(256);
+    }
+
+    status = tl->writeMultiSector(tl->rec, sectorNo, buffer, count);
+    if (status != flOK) {
+        printf("write of %lu sectors at %lu failed: %d\n", count, sectorNo, status);
+        Failures++;
+        return;
+    }
+    memcpy(Shadow[sectorNo], buffer, count * SECTOR_SIZE);
+    HostWrites++;
+}
+
+VOID
+HostRead(
+    TL *tl,
+    ULONG sectorNo,
+    ULONG count
+    )
+{
+    static byte buffer[128 * SECTOR_SIZE];
+    FLStatus status;
+
+    if (sectorNo + count > VIRTUAL_SECTORS) {
+        count = VIRTUAL_SECTORS - sectorNo;
+    }
+
+    status = tl->readSectors(tl->rec, sectorNo, buffer, count);
+    if (status != flOK && status != flSectorNotFound) {
+        printf("read of %lu sectors at %lu failed: %d\n", count, sectorNo, status);
+        Failures++;
+        return;
+    }
+    if (memcmp(buffer, Shadow[sectorNo], count * SECTOR_SIZE)) {
+        printf("read of %lu sectors at %lu returned stale data\n", count, sectorNo);
+        Failures++;
+    }
+    HostReads++;
+}
+
+//
+// Runs the workload and checks the media.  The host workload only depends
+// on the seed, so both runs see the same requests.
+//
+
+VOID
+RunWorkload(
+    ULONG operations,
+    ULONG seed,
+    BOOLEAN useCache,
+    NAND_COUNTERS *counters
+    )
+{
+    static byte buffer[SECTOR_SIZE];
+    TL tl;
+    ULONG op, kind, sectorNo;
+    ULONG writeStream = VIRTUAL_SECTORS / 2;
+    ULONG readStream = 0;
+
+    FormatMedia();
+    HostWrites = HostReads = 0;
+    Seed = seed;
+
+    if (!MountVolume(&tl, useCache)) {
+        Failures++;
+        return;
+    }
+
+    for (op = 0; op < operations; op++) {
+
+        kind = Random(100);
+
+        if (kind < 40) {
+
+            //
+            // The FAT and directories: one or two sectors near the start.
+            //
+
+            HostWrite(&tl, Random(64), 1 + Random(2));
+
+        } else if (kind < 65) {
+
+            //
+            // A file being appended to, 4KB or less at a time.
+            //
+
+            sectorNo = writeStream;
+            writeStream += 1 + Random(8);
+            if (writeStream >= VIRTUAL_SECTORS) {
+                writeStream = VIRTUAL_SECTORS / 2;
+            }
+            HostWrite(&tl, sectorNo, writeStream > sectorNo ? writeStream - sectorNo : 1);
+
+        } else if (kind < 80) {
+
+            //
+            // A file being read.
+            //
+
+            sectorNo = readStream;
+            readStream += 1 + Random(8);
+            if (readStream >= VIRTUAL_SECTORS) {
+                readStream = 0;
+            }
+            HostRead(&tl, sectorNo, readStream > sectorNo ? readStream - sectorNo : 1);
+
+        } else if (kind < 92) {
+
+            //
+            // Random reads, a few of them large enough to go around the
+            // cache.
+            //
+
+            HostRead(&tl, Random(VIRTUAL_SECTORS), kind < 90 ? 1 + Random(4) : 64 + Random(64));
+
+        } else {
+
+            //
+            // A large write, which goes around the cache.
+            //
+
+            HostWrite(&tl, Random(VIRTUAL_SECTORS / 64) * 64, 64 + Random(64));
+        }
+
+        //
+        // The driver thread flushes about this often under load.
+        //
+
+        if (tl.flush != NULL && (op % 500) == 499) {
+            if (tl.flush(tl.rec) != flOK) {
+                printf("flush failed\n");
+                Failures++;
+            }
+        }
+    }
+
+    if (tl.flush != NULL && tl.flush(tl.rec) != flOK) {
+        printf("last flush failed\n");
+        Failures++;
+    }
+
+    *counters = Nand;
+
+    //
+    // Everything the host wrote must be on the media now.
+    //
+
+    for (sectorNo = 0; sectorNo < VIRTUAL_SECTORS; sectorNo++) {
+        NandReadSectors(NULL, sectorNo, buffer, 1);
+        if (memcmp(buffer, Shadow[sectorNo], SECTOR_SIZE)) {
+            printf("sector %lu is not on the media after the flush\n", sectorNo);
+            Failures++;
+            break;
+        }
+    }
+
+    tl.dismount(tl.rec);
+}
+
+VOID
+PrintCounters(
+    char *name,
+    NAND_COUNTERS *counters
+    )
+{
+    printf("%-10s %8lu %8lu %8lu %8lu %8.3f %8.3f %8.2f\n", name,
+           counters->Writes, counters->Folds, counters->Erases,
+           counters->PageReads,
+           (double) counters->Folds / HostWrites,
+           (double) counters->Erases / HostWrites,
+           (double) counters->Programs / HostWrites);
+}
+
+int __cdecl
+main(
+    int argc,
+    char** argv
+    )
+{
+    ULONG operations = 20000;
+    ULONG seed = 1;
+    NAND_COUNTERS direct, cached;
+    ULONG i;
+
+    for (i = 1; i < (ULONG) argc; i++) {
+        if (argv[i][0] != '-' || argv[i][2] || i + 1 == (ULONG) argc) {
+            goto Usage;
+        }
+
+        switch (argv[i][1]) {
+            case 'o':
+                operations = atoi(argv[++i]);
+                break;
+
+            case 's':
+                seed = atoi(argv[++i]);
+                break;
+
+            default:
+                goto Usage;
+        }
+    }
+
+    if (!operations) {
+        goto Usage;
+    }
+
+    if (flRegisterSectorCache() != flOK) {
+        printf("failed to register the sector cache\n");
+        return 1;
+    }
+
+    RunWorkload(operations, seed, FALSE, &direct);
+    RunWorkload(operations, seed, TRUE, &cached);
+
+    printf("%lu host writes, %lu host reads, %d units of %d sectors\n\n",
+           HostWrites, HostReads, VIRTUAL_UNITS, UNIT_SECTORS);
+    printf("           TL writes    folds   erases    reads  folds/w erases/w   prog/w\n");
+    PrintCounters("direct", &direct);
+    PrintCounters("cached", &cached);
+
+    if (Failures) {
+        printf("FAILED\n");
+        return 1;
+    }
+
+    return 0;
+
+Usage:
+    printf("usage: tnandsim [-o operations] [-s seed]\n");
+    return 2;
+}
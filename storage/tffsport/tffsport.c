@@ -165,6 +165,7 @@ Return Value:
     DriverObject->MajorFunction[IRP_MJ_CLOSE] = TrueffsCreateClose;
     DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = TrueffsDeviceControl;
     DriverObject->MajorFunction[IRP_MJ_SCSI] = TrueffsScsiRequests;
+    DriverObject->MajorFunction[IRP_MJ_SHUTDOWN] = TrueffsShutdown;
 
     DriverObject->DriverExtension->AddDevice = TrueffsAddDevice;
     DriverObject->MajorFunction[IRP_MJ_PNP] = TrueffsPnpDeviceControl;
@@ -439,6 +440,11 @@ TrueffsCrashDumpWrite (
         tffsStatus = flAbsWrite(&ioreq);
         TffsDebugPrint((TFFS_DEB_INFO,"Trueffs: CrashDumpWrite: Write status %Xh\n", tffsStatus));
 
+        // Nothing will flush the sector cache after a crash
+        if (tffsStatus == flOK) {
+            tffsStatus = flFlushBuffer(&ioreq);
+        }
+
         if (tffsStatus == flOK) {
             status = STATUS_SUCCESS;
             bytesWritten += blockSize;
@@ -1074,6 +1080,7 @@ TrueffsDetectDiskOnChip(
         if (!NT_SUCCESS (status)) {
             // go through the remove sequence
             if (fdoExtensions[deviceNo]) {
+                IoUnregisterShutdownNotification(fdoExtensions[deviceNo]->DeviceObject);
                 IoDetachDevice(fdoExtensions[deviceNo]->LowerDeviceObject);
                 IoDeleteDevice(fdoExtensions[deviceNo]->DeviceObject);
             }
@@ -1149,6 +1156,7 @@ TrueffsDetectDiskOnChip(
                     if (!NT_SUCCESS (status)) {
                     // go through the remove sequence
                         if (fdoExtension) {
+                            IoUnregisterShutdownNotification(fdoExtension->DeviceObject);
                             IoDetachDevice(fdoExtension->LowerDeviceObject);
                             IoDeleteDevice(fdoExtension->DeviceObject);
                         }
@@ -1439,6 +1447,12 @@ Return Value:
     deviceExtension->MainPdo = Pdo;
     deviceExtension->DriverObject = DriverObject;
     deviceObject->AlignmentRequirement = FILE_WORD_ALIGNMENT;
+
+    // The sector cache is written back when the system shuts down
+    if (!NT_SUCCESS(IoRegisterShutdownNotification(deviceObject))) {
+        TffsDebugPrint((TFFS_DEB_WARN,"Trueffs: CreateDevObject: no shutdown notification\n"));
+    }
+
     deviceObject->Flags &=~DO_DEVICE_INITIALIZING;
     deviceExtension->DeviceFlags |= DEVICE_FLAG_STOPPED;
 
@@ -2895,6 +2909,103 @@ Return Value:
 }
 
 
+NTSTATUS
+TrueffsShutdown(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp
+    )
+
+/*++
+
+Routine Description:
+
+    Shutdown routine.  The I/O system calls it for every FDO, since each
+    registers for shutdown notification, before the system is shut down.
+
+Arguments:
+
+    DeviceObject - Pointer to device object
+    Irp - IRP involved.
+
+Return Value:
+
+    STATUS_SUCCESS, or STATUS_UNSUCCESSFUL if the sector cache could not
+    be written back.
+
+--*/
+
+{
+    PDEVICE_EXTENSION_HEADER devExtension = DeviceObject->DeviceExtension;
+    PDEVICE_EXTENSION deviceExtension;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    TffsDebugPrint((TFFS_DEB_INFO,"Trueffs: Shutdown\n"));
+
+    if (IS_FDO(devExtension)) {
+        deviceExtension = DeviceObject->DeviceExtension;
+    }
+    else {
+        deviceExtension = ((PPDO_EXTENSION) DeviceObject->DeviceExtension)->Pext;
+    }
+
+    if (TrueffsFlushCache(deviceExtension) != flOK) {
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    Irp->IoStatus.Status = status;
+    IoCompleteRequest( Irp, IO_NO_INCREMENT );
+    return status;
+}
+
+
+FLStatus
+TrueffsFlushCache(
+    IN PDEVICE_EXTENSION deviceExtension
+    )
+
+/*++
+
+Routine Description:
+
+    Writes the sectors that the TrueFFS sector cache holds for the device
+    to the media.  Nothing is written if the device is not started.
+
+Arguments:
+
+    deviceExtension - Supplies the FDO extension of the device.
+
+Return Value:
+
+    The TrueFFS status of the flush.
+
+--*/
+
+{
+    IOreq ioreq;
+    FLStatus tffsStatus;
+
+    deviceExtension->CacheFlushTime = KeQueryInterruptTime();
+
+    if (!(deviceExtension->DeviceFlags & DEVICE_FLAG_STARTED) ||
+        (deviceExtension->DeviceFlags & DEVICE_FLAG_REMOVED)) {
+        return flOK;
+    }
+
+    ioreq.irHandle = deviceExtension->UnitNumber;
+    tffsStatus = flFlushBuffer(&ioreq);
+
+    // A volume that is not mounted has nothing cached
+    if (tffsStatus == flNotMounted) {
+        tffsStatus = flOK;
+    }
+
+    if (tffsStatus != flOK) {
+        TffsDebugPrint((TFFS_DEB_ERROR,"Trueffs: FlushCache: failed with status %Xh\n", tffsStatus));
+    }
+    return tffsStatus;
+}
+
+
 NTSTATUS
 TrueffsPnpDeviceControl(
     PDEVICE_OBJECT DeviceObject,
@@ -3272,6 +3383,7 @@ TrueffsPnpDeviceControl(
             }
 
             TrueffsDeleteSymblicLinks(deviceExtension);
+            IoUnregisterShutdownNotification(DeviceObject);
             IoDetachDevice(deviceExtension->LowerDeviceObject);
             IoDeleteDevice(DeviceObject);
         }
@@ -4183,6 +4295,9 @@ TrueffsSetPdoDevicePowerState( IN PDEVICE_OBJECT Pdo,
               if (deviceExtension->TffsportThreadObject) {
                 KeWaitForSingleObject(&pdoExtension->Pext->PendingIRPEvent, Executive, KernelMode, FALSE, NULL);
               }
+
+              // Write back the sector cache before the power goes
+              TrueffsFlushCache(pdoExtension->Pext);
           }
       }
    }
@@ -4698,9 +4813,9 @@ TrueffsScsiRequests(
 
     }
 
-    if ((srb->Function == SRB_FUNCTION_FLUSH_QUEUE) || (srb->Function == SRB_FUNCTION_FLUSH))
+    if (srb->Function == SRB_FUNCTION_FLUSH_QUEUE)
     {
-        TffsDebugPrint((TFFS_DEB_INFO,"Trueffs: ScsiRequests: Flush or FlushQueue\n"));
+        TffsDebugPrint((TFFS_DEB_INFO,"Trueffs: ScsiRequests: FlushQueue\n"));
 
         srb->SrbStatus = SRB_STATUS_SUCCESS;
         status = STATUS_SUCCESS;
@@ -4724,7 +4839,11 @@ TrueffsScsiRequests(
         return status;
     }
 
-    if (srb->Function != SRB_FUNCTION_EXECUTE_SCSI)
+    // Flush and shutdown write back the sector cache, in order with the
+    // writes queued before them.
+    if ((srb->Function != SRB_FUNCTION_EXECUTE_SCSI) &&
+        (srb->Function != SRB_FUNCTION_FLUSH) &&
+        (srb->Function != SRB_FUNCTION_SHUTDOWN))
     {
         TffsDebugPrint((TFFS_DEB_WARN,"Trueffs: ScsiRequests: unsupported function\n"));
 
@@ -4926,8 +5045,15 @@ Return Value:
             PsTerminateSystemThread( STATUS_SUCCESS );
         }
     }
-    else
+    else {
+        // Idle: write back the sector cache
+        if (waitStatus == STATUS_TIMEOUT && !(deviceExtension->DeviceFlags & DEVICE_FLAG_QUERY_STOP_REMOVE)
+                                         && !(deviceExtension->DeviceFlags & DEVICE_FLAG_HOLD_IRPS)) {
+            KeClearEvent(&deviceExtension->PendingIRPEvent);
+            TrueffsFlushCache(deviceExtension);
+        }
         continue;
+    }
 
     while (request = ExInterlockedRemoveHeadList(&deviceExtension->listEntry,&deviceExtension->listSpinLock)) {
 
@@ -6046,8 +6172,10 @@ Return Value:
 
                                 cdb = (PCDB) Srb->Cdb;
 
-                if ((cdb->MODE_SENSE.PageCode           != MODE_SENSE_RETURN_ALL) ||
-                    (cdb->MODE_SENSE.AllocationLength   != MODE_DATA_SIZE )) {
+                if (((cdb->MODE_SENSE.PageCode          != MODE_SENSE_RETURN_ALL) ||
+                     (cdb->MODE_SENSE.AllocationLength  != MODE_DATA_SIZE)) &&
+                    ((cdb->MODE_SENSE.PageCode          != MODE_PAGE_CACHING) ||
+                     (cdb->MODE_SENSE.AllocationLength  <  MODE_CACHING_DATA_SIZE))) {
 
                     status = SRB_STATUS_INVALID_REQUEST;
                     break;
@@ -6068,6 +6196,24 @@ Return Value:
 
                 pageData += parameterHeaderLength + blockDescriptorLength;
 
+                // MODE_PAGE_CACHING data.  The sector cache holds writes back,
+                // so report the write cache as enabled.  DISK class driver then
+                // sends SYNCHRONIZE CACHE and FUA writes, which flush it.
+                RtlZeroMemory(pageData, sizeof(MODE_CACHING_PAGE));
+                ((PMODE_CACHING_PAGE) pageData)->PageCode         = MODE_PAGE_CACHING;
+                ((PMODE_CACHING_PAGE) pageData)->PageLength       = sizeof(MODE_CACHING_PAGE) - 2;
+                ((PMODE_CACHING_PAGE) pageData)->WriteCacheEnable = 1;
+
+                if (cdb->MODE_SENSE.PageCode == MODE_PAGE_CACHING) {
+                    ((PMODE_PARAMETER_HEADER) Srb->DataBuffer)->ModeDataLength = MODE_CACHING_DATA_SIZE - 1;
+                    Srb->DataTransferLength = MODE_CACHING_DATA_SIZE;
+                    status = SRB_STATUS_SUCCESS;
+                    break;
+                }
+
+                // Advance to the next page.
+                pageData += ((PMODE_CACHING_PAGE) pageData)->PageLength + 2;
+
                 // MODE_PAGE_ERROR_RECOVERY data.
                 ((PMODE_DISCONNECT_PAGE) pageData)->PageCode    = MODE_PAGE_ERROR_RECOVERY;
                 ((PMODE_DISCONNECT_PAGE) pageData)->PageLength  = 0x6;
@@ -6225,6 +6371,10 @@ Return Value:
                             }
                             else
                                 {
+                                // A write-through (FUA) write must be on the media before it completes
+                                if ((tffsStatus == flOK) && ((PCDB)Srb->Cdb)->CDB10.ForceUnitAccess) {
+                                    tffsStatus = TrueffsFlushCache(deviceExtension);
+                                }
                                 //status = (UCHAR)(tffsStatus == flOK) ? SRB_STATUS_SUCCESS : SRB_STATUS_ERROR;
                                 if(tffsStatus==flOK)
                                     status = SRB_STATUS_SUCCESS;
@@ -6244,6 +6394,13 @@ Return Value:
                 status = SRB_STATUS_SUCCESS;
                 break;
 
+              case SCSIOP_SYNCHRONIZE_CACHE:
+
+                TffsDebugPrint((TFFS_DEB_INFO,"Trueffs: StartIo: SynchronizeCache\n"));
+                tffsStatus = TrueffsFlushCache(deviceExtension);
+                status = (tffsStatus == flOK) ? SRB_STATUS_SUCCESS : SRB_STATUS_ERROR;
+                break;
+
               case SCSIOP_REQUEST_SENSE:
 
                 TffsDebugPrint((TFFS_DEB_INFO,"Trueffs: StartIo: RequestSense\n"));
@@ -6262,6 +6419,14 @@ Return Value:
 
             break;
 
+          case SRB_FUNCTION_FLUSH:
+          case SRB_FUNCTION_SHUTDOWN:
+
+            TffsDebugPrint((TFFS_DEB_INFO,"Trueffs: StartIo: Flush or Shutdown\n"));
+            tffsStatus = TrueffsFlushCache(deviceExtension);
+            status = (tffsStatus == flOK) ? SRB_STATUS_SUCCESS : SRB_STATUS_ERROR;
+            break;
+
           case SRB_FUNCTION_ABORT_COMMAND:
 
             TffsDebugPrint((TFFS_DEB_INFO,"Trueffs: StartIo: AbortCommand\n"));
@@ -6314,6 +6479,11 @@ Return Value:
 
     } // while there's packets to process
 
+    // Don't let a steady stream of requests keep the sector cache dirty
+    if (KeQueryInterruptTime() - deviceExtension->CacheFlushTime >= TFFS_CACHE_FLUSH_INTERVAL) {
+        TrueffsFlushCache(deviceExtension);
+    }
+
     } while ( TRUE );
 }
 
@@ -29,9 +29,16 @@
 #define MAX_TRANSFER_SIZE_PER_SRB   (0x10000)
 #define MODE_DATA_SIZE              192
 
+// MODE SENSE of the caching page alone: header, block descriptor and page.
+#define MODE_CACHING_DATA_SIZE      (sizeof(MODE_PARAMETER_HEADER) + 8 + sizeof(MODE_CACHING_PAGE))
+
 #define DEVICE_DEFAULT_IDLE_TIMEOUT   0xffffffff
 #define DEVICE_VERY_LONG_IDLE_TIMEOUT 0xfffffffe
 
+// The thread writes back the sector cache when it has been busy this long
+// (in 100ns units) without a flush.
+#define TFFS_CACHE_FLUSH_INTERVAL   (3 * 1000 * 10000)
+
 // Device state flags
 #define DEVICE_FLAG_STOPPED                 0x00000001
 #define DEVICE_FLAG_REMOVED                 0x00000002
@@ -217,6 +224,7 @@ typedef struct _DEVICE_EXTENSION {
         BOOLEAN  IsWriteProtected;
         UCHAR        PartitonTable[0x200];
         BOOLEAN  IsSWWriteProtected;
+    ULONGLONG CacheFlushTime;     // interrupt time of the last cache flush
 
 } DEVICE_EXTENSION, *PDEVICE_EXTENSION;
 
@@ -427,6 +435,17 @@ TrueffsCreateClose(
     IN PIRP Irp
     );
 
+NTSTATUS
+TrueffsShutdown(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp
+    );
+
+FLStatus
+TrueffsFlushCache(
+    IN PDEVICE_EXTENSION deviceExtension
+    );
+
 NTSTATUS
 TrueffsPnpDeviceControl(
     PDEVICE_OBJECT DeviceObject,
@@ -0,0 +1,695 @@
+/*++
+
+Copyright (c) 2002  Microsoft Corporation
+
+Module Name:
+
+    blockmap.cxx
+
+Abstract:
+
+    This module implements the block map, a radix tree keyed by block
+    number that the volume snapshot driver uses for its volume block and
+    copy back pointer tables.
+
+    A lookup is one bitmap test and one population count per level, reads
+    a handful of cache lines and, unlike a splay tree, writes nothing.
+
+Environment:
+
+    kernel mode only
+
+Notes:
+
+    This file is also built into the user mode block map benchmark, with
+    UTEST defined.
+
+Revision History:
+
+--*/
+
+#if !defined (UTEST)
+extern "C" {
+#include <ntosp.h>
+}
+#endif
+
+#include "blockmap.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma code_seg("PAGELK")
+#endif
+
+#define VSP_BLOCK_MAP_NODE_SIZE(Class) \
+        (FIELD_OFFSET(VSP_BLOCK_MAP_NODE, Children) + \
+         (2<<(Class))*sizeof(PVOID))
+
+#define VSP_BLOCK_MAP_BIT(Index)    (((ULONGLONG) 1)<<(Index))
+
+ULONGLONG
+VspBlockMapKey(
+    IN  PVSP_BLOCK_MAP  BlockMap,
+    IN  PVOID           Entry
+    )
+
+{
+    return ((ULONGLONG) *((PLONGLONG) Entry))>>BlockMap->BlockShift;
+}
+
+ULONG
+VspBlockMapPopulation(
+    IN  ULONGLONG   Bits
+    )
+
+{
+    Bits = Bits - ((Bits>>1)&0x5555555555555555);
+    Bits = (Bits&0x3333333333333333) + ((Bits>>2)&0x3333333333333333);
+    Bits = (Bits + (Bits>>4))&0x0F0F0F0F0F0F0F0F;
+
+    return (ULONG) ((Bits*0x0101010101010101)>>56);
+}
+
+ULONG
+VspBlockMapIndex(
+    IN  ULONGLONG   Key,
+    IN  ULONG       Level
+    )
+
+{
+    return (ULONG) (Key>>(Level*VSP_BLOCK_MAP_FANOUT_SHIFT))&
+           (VSP_BLOCK_MAP_FANOUT - 1);
+}
+
+ULONG
+VspBlockMapRank(
+    IN  PVSP_BLOCK_MAP_NODE Node,
+    IN  ULONG               Index
+    )
+
+/*++
+
+Routine Description:
+
+    This routine returns the position in 'Children' of the given child,
+    which is the number of children present before it.
+
+--*/
+
+{
+    return VspBlockMapPopulation(Node->Present&
+                                 (VSP_BLOCK_MAP_BIT(Index) - 1));
+}
+
+BOOLEAN
+VspBlockMapFits(
+    IN  ULONG       Height,
+    IN  ULONGLONG   Key
+    )
+
+{
+    if (Height*VSP_BLOCK_MAP_FANOUT_SHIFT >= 64) {
+        return TRUE;
+    }
+
+    return (Key>>(Height*VSP_BLOCK_MAP_FANOUT_SHIFT)) ? FALSE : TRUE;
+}
+
+PVOID
+VspBlockMapAllocate(
+    IN  PVSP_BLOCK_MAP  BlockMap,
+    IN  PVOID*          FreeList,
+    IN  CLONG           Size
+    )
+
+{
+    PVOID   p;
+
+    p = *FreeList;
+    if (p) {
+        *FreeList = *((PVOID*) p);
+        return p;
+    }
+
+    p = BlockMap->AllocateRoutine(BlockMap, Size);
+    if (p) {
+        BlockMap->AllocatedSize += Size;
+    }
+
+    return p;
+}
+
+VOID
+VspBlockMapFree(
+    IN  PVOID*  FreeList,
+    IN  PVOID   Buffer
+    )
+
+{
+    *((PVOID*) Buffer) = *FreeList;
+    *FreeList = Buffer;
+}
+
+PVSP_BLOCK_MAP_NODE
+VspBlockMapAllocateNode(
+    IN  PVSP_BLOCK_MAP  BlockMap,
+    IN  ULONG           Class
+    )
+
+{
+    PVSP_BLOCK_MAP_NODE node;
+
+    ASSERT(Class < VSP_BLOCK_MAP_NODE_CLASSES);
+
+    node = (PVSP_BLOCK_MAP_NODE)
+           VspBlockMapAllocate(BlockMap, &BlockMap->FreeNodes[Class],
+                               VSP_BLOCK_MAP_NODE_SIZE(Class));
+    if (!node) {
+        return NULL;
+    }
+
+    node->Present = 0;
+    node->Class = Class;
+    node->Reserved = 0;
+
+    return node;
+}
+
+BOOLEAN
+VspBlockMapInsertChild(
+    IN      PVSP_BLOCK_MAP          BlockMap,
+    IN OUT  PVSP_BLOCK_MAP_NODE*    Node,
+    IN      ULONG                   Index,
+    IN      PVOID                   Child
+    )
+
+/*++
+
+Routine Description:
+
+    This routine adds a child to a node, moving the node to the next larger
+    class if it is full.
+
+Arguments:
+
+    BlockMap    - Supplies the block map.
+
+    Node        - Supplies the pointer to the node, which is updated if
+                    the node moves.
+
+    Index       - Supplies the index of the child, which must not be
+                    present.
+
+    Child       - Supplies the child.
+
+Return Value:
+
+    FALSE   - The node was full and a larger one could not be allocated.
+
+--*/
+
+{
+    PVSP_BLOCK_MAP_NODE node = *Node;
+    PVSP_BLOCK_MAP_NODE larger;
+    ULONG               count, rank;
+
+    ASSERT(!(node->Present&VSP_BLOCK_MAP_BIT(Index)));
+
+    count = VspBlockMapPopulation(node->Present);
+    rank = VspBlockMapRank(node, Index);
+
+    if (count == (ULONG) (2<<node->Class)) {
+
+        larger = VspBlockMapAllocateNode(BlockMap, node->Class + 1);
+        if (!larger) {
+            return FALSE;
+        }
+
+        larger->Present = node->Present;
+        RtlCopyMemory(larger->Children, node->Children,
+                      count*sizeof(PVOID));
+
+        *Node = larger;
+        VspBlockMapFree(&BlockMap->FreeNodes[node->Class], node);
+        node = larger;
+    }
+
+    RtlMoveMemory(&node->Children[rank + 1], &node->Children[rank],
+                  (count - rank)*sizeof(PVOID));
+    node->Children[rank] = Child;
+    node->Present |= VSP_BLOCK_MAP_BIT(Index);
+
+    return TRUE;
+}
+
+VOID
+VspBlockMapRemoveChild(
+    IN  PVSP_BLOCK_MAP_NODE Node,
+    IN  ULONG               Index
+    )
+
+{
+    ULONG   count, rank;
+
+    ASSERT(Node->Present&VSP_BLOCK_MAP_BIT(Index));
+
+    count = VspBlockMapPopulation(Node->Present);
+    rank = VspBlockMapRank(Node, Index);
+
+    RtlMoveMemory(&Node->Children[rank], &Node->Children[rank + 1],
+                  (count - rank - 1)*sizeof(PVOID));
+    Node->Present &= ~VSP_BLOCK_MAP_BIT(Index);
+}
+
+VOID
+VspBlockMapPrune(
+    IN  PVSP_BLOCK_MAP  BlockMap,
+    IN  ULONGLONG       Key
+    )
+
+/*++
+
+Routine Description:
+
+    This routine frees the empty nodes on the path to the given key, from
+    the bottom up, and takes them out of their parents.
+
+--*/
+
+{
+    PVSP_BLOCK_MAP_NODE*    path[VSP_BLOCK_MAP_MAXIMUM_HEIGHT];
+    PVSP_BLOCK_MAP_NODE*    slot;
+    PVSP_BLOCK_MAP_NODE     node;
+    ULONG                   level, index;
+
+    if (!BlockMap->Root) {
+        return;
+    }
+
+    slot = &BlockMap->Root;
+    for (level = BlockMap->Height - 1; ; level--) {
+
+        path[level] = slot;
+        node = *slot;
+
+        index = VspBlockMapIndex(Key, level);
+        if (!level || !(node->Present&VSP_BLOCK_MAP_BIT(index))) {
+            break;
+        }
+
+        slot = (PVSP_BLOCK_MAP_NODE*)
+               &node->Children[VspBlockMapRank(node, index)];
+    }
+
+    for (; level < BlockMap->Height; level++) {
+
+        node = *path[level];
+        if (node->Present) {
+            return;
+        }
+
+        VspBlockMapFree(&BlockMap->FreeNodes[node->Class], node);
+
+        if (level + 1 < BlockMap->Height) {
+            VspBlockMapRemoveChild(*path[level + 1],
+                                   VspBlockMapIndex(Key, level + 1));
+        }
+    }
+
+    BlockMap->Root = NULL;
+    BlockMap->Height = 0;
+}
+
+PVOID
+VspBlockMapFindNext(
+    IN  PVSP_BLOCK_MAP_NODE Node,
+    IN  ULONG               Level,
+    IN  ULONGLONG           Key
+    )
+
+/*++
+
+Routine Description:
+
+    This routine returns the entry with the lowest key at or above the
+    given key under the given node.
+
+--*/
+
+{
+    ULONG       index, i;
+    ULONGLONG   present;
+    PVOID       child, r;
+
+    index = VspBlockMapIndex(Key, Level);
+    present = Node->Present&(~((ULONGLONG) 0)<<index);
+
+    while (present) {
+
+        i = VspBlockMapPopulation((present&(~present + 1)) - 1);
+        child = Node->Children[VspBlockMapRank(Node, i)];
+
+        if (!Level) {
+            return child;
+        }
+
+        r = VspBlockMapFindNext((PVSP_BLOCK_MAP_NODE) child, Level - 1,
+                                i == index ? Key : 0);
+        if (r) {
+            return r;
+        }
+
+        present &= present - 1;
+    }
+
+    return NULL;
+}
+
+VOID
+VspInitializeBlockMap(
+    IN  PVSP_BLOCK_MAP                  BlockMap,
+    IN  ULONG                           BlockShift,
+    IN  CLONG                           EntrySize,
+    IN  PVSP_BLOCK_MAP_ALLOCATE_ROUTINE AllocateRoutine,
+    IN  PVOID                           TableContext
+    )
+
+/*++
+
+Routine Description:
+
+    This routine initializes an empty block map.
+
+Arguments:
+
+    BlockMap        - Supplies the block map.
+
+    BlockShift      - Supplies the log2 of the block size.  Keys are
+                        block aligned volume offsets.
+
+    EntrySize       - Supplies the size of an entry, which starts with its
+                        LONGLONG key.
+
+    AllocateRoutine - Supplies the routine to allocate memory for nodes and
+                        entries.
+
+    TableContext    - Supplies the context for the allocate routine.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    ASSERT(EntrySize >= sizeof(LONGLONG) && EntrySize >= sizeof(PVOID));
+
+    RtlZeroMemory(BlockMap, sizeof(VSP_BLOCK_MAP));
+    BlockMap->BlockShift = BlockShift;
+    BlockMap->EntrySize = EntrySize;
+    BlockMap->AllocateRoutine = AllocateRoutine;
+    BlockMap->TableContext = TableContext;
+}
+
+PVOID
+VspLookupBlockMap(
+    IN  PVSP_BLOCK_MAP  BlockMap,
+    IN  PVOID           Key
+    )
+
+/*++
+
+Routine Description:
+
+    This routine looks up an entry in the block map.
+
+Arguments:
+
+    BlockMap    - Supplies the block map.
+
+    Key         - Supplies a buffer starting with the LONGLONG key.
+
+Return Value:
+
+    The entry or NULL if there is no entry with this key.
+
+--*/
+
+{
+    ULONGLONG           key = VspBlockMapKey(BlockMap, Key);
+    PVSP_BLOCK_MAP_NODE node;
+    ULONG               level, index;
+
+    node = BlockMap->Root;
+    if (!node || !VspBlockMapFits(BlockMap->Height, key)) {
+        return NULL;
+    }
+
+    for (level = BlockMap->Height - 1; ; level--) {
+
+        index = VspBlockMapIndex(key, level);
+        if (!(node->Present&VSP_BLOCK_MAP_BIT(index))) {
+            return NULL;
+        }
+
+        if (!level) {
+            return node->Children[VspBlockMapRank(node, index)];
+        }
+
+        node = (PVSP_BLOCK_MAP_NODE)
+               node->Children[VspBlockMapRank(node, index)];
+    }
+}
+
+PVOID
+VspInsertBlockMap(
+    IN  PVSP_BLOCK_MAP  BlockMap,
+    IN  PVOID           Buffer,
+    OUT PBOOLEAN        NewElement
+    )
+
+/*++
+
+Routine Description:
+
+    This routine inserts a copy of the given entry into the block map,
+    unless there already is an entry with the same key.
+
+    If an allocation fails part way through, the nodes that were added on
+    the way down are freed again.
+
+Arguments:
+
+    BlockMap    - Supplies the block map.
+
+    Buffer      - Supplies the entry to insert.
+
+    NewElement  - Returns whether or not a new entry was inserted.
+                    Optional.
+
+Return Value:
+
+    The new or existing entry, or NULL if memory could not be allocated.
+
+--*/
+
+{
+    ULONGLONG               key = VspBlockMapKey(BlockMap, Buffer);
+    PVOID                   entry;
+    PVSP_BLOCK_MAP_NODE     node, child;
+    PVSP_BLOCK_MAP_NODE*    slot;
+    ULONG                   level, index;
+
+    if (NewElement) {
+        *NewElement = FALSE;
+    }
+
+    entry = VspLookupBlockMap(BlockMap, Buffer);
+    if (entry) {
+        return entry;
+    }
+
+    entry = VspBlockMapAllocate(BlockMap, &BlockMap->FreeEntries,
+                                BlockMap->EntrySize);
+    if (!entry) {
+        return NULL;
+    }
+
+    if (!BlockMap->Root) {
+        node = VspBlockMapAllocateNode(BlockMap, 0);
+        if (!node) {
+            goto Failure;
+        }
+        BlockMap->Root = node;
+        BlockMap->Height = 1;
+        while (!VspBlockMapFits(BlockMap->Height, key)) {
+            BlockMap->Height++;
+        }
+    }
+
+    while (!VspBlockMapFits(BlockMap->Height, key)) {
+        node = VspBlockMapAllocateNode(BlockMap, 0);
+        if (!node) {
+            goto Failure;
+        }
+        node->Present = VSP_BLOCK_MAP_BIT(0);
+        node->Children[0] = BlockMap->Root;
+        BlockMap->Root = node;
+        BlockMap->Height++;
+    }
+
+    slot = &BlockMap->Root;
+    for (level = BlockMap->Height - 1; level; level--) {
+
+        index = VspBlockMapIndex(key, level);
+
+        if (!((*slot)->Present&VSP_BLOCK_MAP_BIT(index))) {
+            child = VspBlockMapAllocateNode(BlockMap, 0);
+            if (!child) {
+                goto Failure;
+            }
+            if (!VspBlockMapInsertChild(BlockMap, slot, index, child)) {
+                VspBlockMapFree(&BlockMap->FreeNodes[0], child);
+                goto Failure;
+            }
+        }
+
+        node = *slot;
+        slot = (PVSP_BLOCK_MAP_NODE*)
+               &node->Children[VspBlockMapRank(node, index)];
+    }
+
+    RtlCopyMemory(entry, Buffer, BlockMap->EntrySize);
+
+    if (!VspBlockMapInsertChild(BlockMap, slot, VspBlockMapIndex(key, 0),
+                                entry)) {
+        goto Failure;
+    }
+
+    BlockMap->NumberOfElements++;
+
+    if (NewElement) {
+        *NewElement = TRUE;
+    }
+
+    return entry;
+
+Failure:
+    VspBlockMapPrune(BlockMap, key);
+    VspBlockMapFree(&BlockMap->FreeEntries, entry);
+    return NULL;
+}
+
+BOOLEAN
+VspDeleteBlockMap(
+    IN  PVSP_BLOCK_MAP  BlockMap,
+    IN  PVOID           Key
+    )
+
+/*++
+
+Routine Description:
+
+    This routine deletes an entry from the block map.  Nodes left empty
+    are freed.
+
+Arguments:
+
+    BlockMap    - Supplies the block map.
+
+    Key         - Supplies a buffer starting with the LONGLONG key.  This
+                    may be the entry itself.
+
+Return Value:
+
+    FALSE   - There is no entry with this key.
+
+--*/
+
+{
+    ULONGLONG           key = VspBlockMapKey(BlockMap, Key);
+    PVSP_BLOCK_MAP_NODE node;
+    PVOID               entry;
+    ULONG               level, index;
+
+    node = BlockMap->Root;
+    if (!node || !VspBlockMapFits(BlockMap->Height, key)) {
+        return FALSE;
+    }
+
+    for (level = BlockMap->Height - 1; ; level--) {
+
+        index = VspBlockMapIndex(key, level);
+        if (!(node->Present&VSP_BLOCK_MAP_BIT(index))) {
+            return FALSE;
+        }
+
+        if (!level) {
+            break;
+        }
+
+        node = (PVSP_BLOCK_MAP_NODE)
+               node->Children[VspBlockMapRank(node, index)];
+    }
+
+    entry = node->Children[VspBlockMapRank(node, index)];
+
+    VspBlockMapRemoveChild(node, index);
+    VspBlockMapPrune(BlockMap, key);
+
+    VspBlockMapFree(&BlockMap->FreeEntries, entry);
+    BlockMap->NumberOfElements--;
+
+    return TRUE;
+}
+
+PVOID
+VspEnumerateBlockMap(
+    IN  PVSP_BLOCK_MAP  BlockMap,
+    IN  BOOLEAN         Restart
+    )
+
+/*++
+
+Routine Description:
+
+    This routine enumerates the entries of the block map in key order, in
+    the manner of 'RtlEnumerateGenericTable'.  Entries may be deleted in
+    the middle of an enumeration.
+
+Arguments:
+
+    BlockMap    - Supplies the block map.
+
+    Restart     - Supplies whether to start again from the lowest key.
+
+Return Value:
+
+    The next entry or NULL if there are no more.
+
+--*/
+
+{
+    PVOID   entry;
+
+    if (Restart) {
+        BlockMap->EnumerateKey = 0;
+    }
+
+    if (!BlockMap->Root ||
+        !VspBlockMapFits(BlockMap->Height, BlockMap->EnumerateKey)) {
+
+        return NULL;
+    }
+
+    entry = VspBlockMapFindNext(BlockMap->Root, BlockMap->Height - 1,
+                                BlockMap->EnumerateKey);
+    if (entry) {
+        BlockMap->EnumerateKey = VspBlockMapKey(BlockMap, entry) + 1;
+    }
+
+    return entry;
+}
+
+#ifdef ALLOC_PRAGMA
+#pragma code_seg()
+#endif
@@ -0,0 +1,157 @@
+/*++
+
+Copyright (c) 2002  Microsoft Corporation
+
+Module Name:
+
+    blockmap.h
+
+Abstract:
+
+    This file provides the block map used by the volume snapshot driver to
+    translate volume offsets to backing store offsets.
+
+    A block map is a radix tree keyed by block number.  Each node covers 64
+    children and keeps a bitmap of the children present along with a packed
+    array of pointers to just those children, so a node only takes up as
+    much space as the children it has.  The leaves point to the entries.
+    The tree grows in height as higher blocks are inserted.
+
+    Entries are fixed size and start with the LONGLONG volume offset that
+    is their key.  Pointers to entries stay valid until the entry is
+    deleted.  Memory comes from an allocate routine supplied by the owner
+    and is never given back to it; freed nodes and entries are kept on free
+    lists in the map and reused.
+
+Environment:
+
+    kernel mode only
+
+Notes:
+
+    This file is also built into the user mode block map benchmark, with
+    UTEST defined.
+
+Revision History:
+
+--*/
+
+#ifndef _BLOCKMAP_H_
+#define _BLOCKMAP_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VSP_BLOCK_MAP_FANOUT_SHIFT  (6)
+#define VSP_BLOCK_MAP_FANOUT        (1<<VSP_BLOCK_MAP_FANOUT_SHIFT)
+#define VSP_BLOCK_MAP_NODE_CLASSES  (6)
+#define VSP_BLOCK_MAP_MAXIMUM_HEIGHT \
+        ((64 + VSP_BLOCK_MAP_FANOUT_SHIFT - 1)/VSP_BLOCK_MAP_FANOUT_SHIFT)
+
+//
+// A generous estimate of the node space used per entry, for sizing the
+// memory handed to a block map.
+//
+
+#define VSP_BLOCK_MAP_ENTRY_OVERHEAD    (4*sizeof(PVOID))
+
+struct _VSP_BLOCK_MAP;
+typedef struct _VSP_BLOCK_MAP VSP_BLOCK_MAP, *PVSP_BLOCK_MAP;
+
+typedef
+PVOID
+(*PVSP_BLOCK_MAP_ALLOCATE_ROUTINE) (
+    IN  PVSP_BLOCK_MAP  BlockMap,
+    IN  CLONG           Size
+    );
+
+//
+// A node with room for '2<<Class' children.  'Present' has a bit set for
+// each child present and 'Children' holds them in bit order.
+//
+
+typedef struct _VSP_BLOCK_MAP_NODE {
+    ULONGLONG   Present;
+    ULONG       Class;
+    ULONG       Reserved;
+    PVOID       Children[1];
+} VSP_BLOCK_MAP_NODE, *PVSP_BLOCK_MAP_NODE;
+
+struct _VSP_BLOCK_MAP {
+
+    //
+    // The root covers block numbers below
+    // 1<<(Height*VSP_BLOCK_MAP_FANOUT_SHIFT).
+    //
+
+    PVSP_BLOCK_MAP_NODE             Root;
+    ULONG                           Height;
+
+    ULONG                           BlockShift;
+    CLONG                           EntrySize;
+    ULONG                           NumberOfElements;
+
+    //
+    // The next block number to return from 'VspEnumerateBlockMap'.
+    //
+
+    ULONGLONG                       EnumerateKey;
+
+    //
+    // Free entries and free nodes of each class, linked through their
+    // first pointer.
+    //
+
+    PVOID                           FreeEntries;
+    PVOID                           FreeNodes[VSP_BLOCK_MAP_NODE_CLASSES];
+
+    //
+    // Total bytes obtained from 'AllocateRoutine'.
+    //
+
+    ULONGLONG                       AllocatedSize;
+
+    PVSP_BLOCK_MAP_ALLOCATE_ROUTINE AllocateRoutine;
+    PVOID                           TableContext;
+};
+
+VOID
+VspInitializeBlockMap(
+    IN  PVSP_BLOCK_MAP                  BlockMap,
+    IN  ULONG                           BlockShift,
+    IN  CLONG                           EntrySize,
+    IN  PVSP_BLOCK_MAP_ALLOCATE_ROUTINE AllocateRoutine,
+    IN  PVOID                           TableContext
+    );
+
+PVOID
+VspLookupBlockMap(
+    IN  PVSP_BLOCK_MAP  BlockMap,
+    IN  PVOID           Key
+    );
+
+PVOID
+VspInsertBlockMap(
+    IN  PVSP_BLOCK_MAP  BlockMap,
+    IN  PVOID           Buffer,
+    OUT PBOOLEAN        NewElement
+    );
+
+BOOLEAN
+VspDeleteBlockMap(
+    IN  PVSP_BLOCK_MAP  BlockMap,
+    IN  PVOID           Key
+    );
+
+PVOID
+VspEnumerateBlockMap(
+    IN  PVSP_BLOCK_MAP  BlockMap,
+    IN  BOOLEAN         Restart
+    );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _BLOCKMAP_H_
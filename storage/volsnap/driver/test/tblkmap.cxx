@@ -0,0 +1,617 @@
+//
+// Benchmark for the volume snapshot block map.
+//
+// A write trace is replayed against a set of snapshots of a volume, the
+// way the snapshot driver sees it. The trace is cut into as many pieces as
+// there are snapshots and a new snapshot is taken at the start of each
+// piece. Every block written is looked up in the newest snapshot's volume
+// block table and, the first time it is written, copied and inserted.
+// Then every block of the trace is read through the oldest snapshot,
+// which looks it up in each snapshot from the oldest to the newest until
+// it is found.
+//
+// The same replay is run against the block map and against the RTL splay
+// table the driver used before, allocating from a heap the same way the
+// driver does. Both must return the same translations.
+//
+// The trace is either a dptrace capture of a disk (only the writes are
+// used) or a synthetic mix of random and sequential writes.
+//
+// Usage:
+//
+//     tblkmap [-n snapshots] [-w writes] [-v gigabytes] [-s sequential%]
+//             [trace]
+//
+
+#include <nt.h>
+#include <ntrtl.h>
+#include <nturtl.h>
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "..\blockmap.cxx"
+#include "..\..\..\diskperf\dptrace.h"
+
+//
+// Same as in volsnap.h.
+//
+
+#define BLOCK_SIZE  (0x4000)
+#define BLOCK_SHIFT (14)
+
+typedef struct _TRANSLATION_TABLE_ENTRY {
+	LONGLONG VolumeOffset;
+	PDEVICE_OBJECT TargetObject;
+	ULONG Flags;
+	LONGLONG TargetOffset;
+} TRANSLATION_TABLE_ENTRY, *PTRANSLATION_TABLE_ENTRY;
+
+#define HEAP_CHUNK_SIZE (16 * 1024 * 1024)
+#define MAX_SNAPSHOTS   (64)
+
+typedef struct _TEST_WRITE {
+	LONGLONG Offset;
+	ULONG Length;
+} TEST_WRITE, *PTEST_WRITE;
+
+typedef struct _TEST_HEAP {
+	PUCHAR Base;
+	SIZE_T Size;
+	SIZE_T Used;
+	SIZE_T Total;
+} TEST_HEAP, *PTEST_HEAP;
+
+typedef struct _TEST_SNAPSHOT {
+	TEST_HEAP Heap;
+	RTL_GENERIC_TABLE Table;
+	VSP_BLOCK_MAP BlockMap;
+	LONGLONG NextTarget;
+} TEST_SNAPSHOT, *PTEST_SNAPSHOT;
+
+typedef enum _TEST_INDEX {
+	SplayTable,
+	BlockMap
+} TEST_INDEX;
+
+PCSTR IndexNames [] = { "splay table", "block map" };
+
+//
+// Test parameters.
+//
+
+ULONG Snapshots = 8;
+ULONG SyntheticWrites = 2000000;
+ULONG VolumeGigabytes = 2048;
+ULONG SequentialPercent = 20;
+PCSTR TraceFile;
+
+PTEST_WRITE Writes;
+ULONG WriteCount;
+ULONGLONG BlockCount;
+
+TEST_SNAPSHOT Snapshot [MAX_SNAPSHOTS];
+
+
+PVOID
+HeapAllocate(
+	IN PTEST_HEAP Heap,
+	IN SIZE_T Size
+	)
+{
+	PVOID Buffer;
+
+	Size = (Size + 7) & ~7;
+
+	if (Heap->Used + Size > Heap->Size) {
+		Heap->Base = (PUCHAR)malloc (HEAP_CHUNK_SIZE);
+		if (Heap->Base == NULL) {
+			printf ("Out of memory!\n");
+			exit (1);
+		}
+		Heap->Size = HEAP_CHUNK_SIZE;
+		Heap->Used = 0;
+	}
+
+	Buffer = Heap->Base + Heap->Used;
+	Heap->Used += Size;
+	Heap->Total += Size;
+
+	return Buffer;
+}
+
+
+RTL_GENERIC_COMPARE_RESULTS
+NTAPI
+TableCompareRoutine(
+	IN PRTL_GENERIC_TABLE Table,
+	IN PVOID First,
+	IN PVOID Second
+	)
+{
+	PTRANSLATION_TABLE_ENTRY first = (PTRANSLATION_TABLE_ENTRY)First;
+	PTRANSLATION_TABLE_ENTRY second = (PTRANSLATION_TABLE_ENTRY)Second;
+
+	if (first->VolumeOffset < second->VolumeOffset) {
+		return GenericLessThan;
+	} else if (first->VolumeOffset > second->VolumeOffset) {
+		return GenericGreaterThan;
+	}
+
+	return GenericEqual;
+}
+
+
+PVOID
+NTAPI
+TableAllocateRoutine(
+	IN PRTL_GENERIC_TABLE Table,
+	IN CLONG Size
+	)
+{
+	return HeapAllocate (&((PTEST_SNAPSHOT)Table->TableContext)->Heap, Size);
+}
+
+
+VOID
+NTAPI
+TableFreeRoutine(
+	IN PRTL_GENERIC_TABLE Table,
+	IN PVOID Buffer
+	)
+{
+}
+
+
+PVOID
+BlockMapAllocateRoutine(
+	IN PVSP_BLOCK_MAP BlockMap,
+	IN CLONG Size
+	)
+{
+	return HeapAllocate (&((PTEST_SNAPSHOT)BlockMap->TableContext)->Heap, Size);
+}
+
+
+VOID
+InitializeSnapshot(
+	IN TEST_INDEX Index,
+	IN PTEST_SNAPSHOT Snap
+	)
+{
+	ZeroMemory (Snap, sizeof (*Snap));
+
+	if (Index == SplayTable) {
+		RtlInitializeGenericTable (&Snap->Table,
+								   TableCompareRoutine,
+								   TableAllocateRoutine,
+								   TableFreeRoutine,
+								   Snap);
+	} else {
+		VspInitializeBlockMap (&Snap->BlockMap,
+							   BLOCK_SHIFT,
+							   sizeof (TRANSLATION_TABLE_ENTRY),
+							   BlockMapAllocateRoutine,
+							   Snap);
+	}
+}
+
+
+PTRANSLATION_TABLE_ENTRY
+Lookup(
+	IN TEST_INDEX Index,
+	IN PTEST_SNAPSHOT Snap,
+	IN PTRANSLATION_TABLE_ENTRY Key
+	)
+{
+	if (Index == SplayTable) {
+		return (PTRANSLATION_TABLE_ENTRY)
+			RtlLookupElementGenericTable (&Snap->Table, Key);
+	}
+
+	return (PTRANSLATION_TABLE_ENTRY)VspLookupBlockMap (&Snap->BlockMap, Key);
+}
+
+
+VOID
+CopyOnWrite(
+	IN TEST_INDEX Index,
+	IN PTEST_SNAPSHOT Snap,
+	IN LONGLONG VolumeOffset
+	)
+/*++
+
+Routine Description:
+
+	Look up a block being written in the newest snapshot and insert it if
+	this is the first write to it, the way VspWriteVolumePhase4 does.
+
+--*/
+{
+	TRANSLATION_TABLE_ENTRY Key;
+	PVOID NodeOrParent;
+	TABLE_SEARCH_RESULT SearchResult;
+	PVOID Entry;
+
+	ZeroMemory (&Key, sizeof (Key));
+	Key.VolumeOffset = VolumeOffset;
+	Key.TargetOffset = Snap->NextTarget;
+
+	if (Index == SplayTable) {
+		Entry = RtlLookupElementGenericTableFull (&Snap->Table,
+												  &Key,
+												  &NodeOrParent,
+												  &SearchResult);
+		if (Entry == NULL) {
+			Entry = RtlInsertElementGenericTableFull (&Snap->Table,
+													  &Key,
+													  sizeof (Key),
+													  NULL,
+													  NodeOrParent,
+													  SearchResult);
+			Snap->NextTarget += BLOCK_SIZE;
+		}
+	} else {
+		Entry = VspLookupBlockMap (&Snap->BlockMap, &Key);
+		if (Entry == NULL) {
+			Entry = VspInsertBlockMap (&Snap->BlockMap, &Key, NULL);
+			Snap->NextTarget += BLOCK_SIZE;
+		}
+	}
+
+	if (Entry == NULL) {
+		printf ("Insert failed!\n");
+		exit (1);
+	}
+}
+
+
+ULONG
+Random(
+	VOID
+	)
+{
+	static ULONGLONG State = 0x9e3779b97f4a7c15;
+
+	State ^= State << 13;
+	State ^= State >> 7;
+	State ^= State << 17;
+
+	return (ULONG)(State >> 32);
+}
+
+
+VOID
+SynthesizeTrace(
+	VOID
+	)
+/*++
+
+Routine Description:
+
+	Make up a trace of 4K to 64K writes, mostly scattered over the volume
+	with some sequential streams.
+
+--*/
+{
+	ULONGLONG VolumeSize;
+	LONGLONG Stream;
+	ULONG i;
+
+	VolumeSize = (ULONGLONG)VolumeGigabytes << 30;
+	Stream = 0;
+
+	Writes = (PTEST_WRITE)malloc (SyntheticWrites * sizeof (TEST_WRITE));
+	if (Writes == NULL) {
+		printf ("Out of memory!\n");
+		exit (1);
+	}
+
+	for (i = 0; i < SyntheticWrites; i++) {
+
+		Writes[i].Length = 4096 << (Random () % 5);
+
+		if (Random () % 100 < SequentialPercent) {
+			if (Stream + Writes[i].Length > (LONGLONG)VolumeSize) {
+				Stream = 0;
+			}
+			Writes[i].Offset = Stream;
+			Stream += Writes[i].Length;
+		} else {
+			Writes[i].Offset =
+				((((ULONGLONG)Random () << 32) | Random ()) %
+				 (VolumeSize - Writes[i].Length)) & ~4095;
+		}
+	}
+
+	WriteCount = SyntheticWrites;
+}
+
+
+VOID
+ReadTrace(
+	IN PCSTR FileName
+	)
+{
+	FILE* File;
+	DISKPERF_TRACE_FILE_HEADER Header;
+	DISKPERF_TRACE_RECORD Record;
+	ULONGLONG i;
+
+	File = fopen (FileName, "rb");
+	if (File == NULL) {
+		printf ("Cannot open %s\n", FileName);
+		exit (1);
+	}
+
+	if (fread (&Header, sizeof (Header), 1, File) != 1 ||
+		Header.Signature != DISKPERF_TRACE_SIGNATURE ||
+		Header.RecordSize != sizeof (DISKPERF_TRACE_RECORD)) {
+		printf ("%s is not a dptrace file\n", FileName);
+		exit (1);
+	}
+
+	fseek (File, Header.HeaderSize, SEEK_SET);
+
+	Writes = (PTEST_WRITE)malloc ((SIZE_T)Header.RecordCount * sizeof (TEST_WRITE));
+	if (Writes == NULL) {
+		printf ("Out of memory!\n");
+		exit (1);
+	}
+
+	for (i = 0; i < Header.RecordCount; i++) {
+		if (fread (&Record, sizeof (Record), 1, File) != 1) {
+			break;
+		}
+		if (Record.Direction == DISKPERF_TRACE_WRITE &&
+			!(Record.Flags & DISKPERF_TRACE_FAILED) &&
+			Record.Length != 0) {
+			Writes[WriteCount].Offset = Record.ByteOffset.QuadPart;
+			Writes[WriteCount].Length = Record.Length;
+			WriteCount++;
+		}
+	}
+
+	fclose (File);
+}
+
+
+double
+Seconds(
+	IN LARGE_INTEGER Start,
+	IN LARGE_INTEGER End
+	)
+{
+	LARGE_INTEGER Frequency;
+
+	QueryPerformanceFrequency (&Frequency);
+	return (double)(End.QuadPart - Start.QuadPart) / (double)Frequency.QuadPart;
+}
+
+
+ULONGLONG
+RunTest(
+	IN TEST_INDEX Index
+	)
+/*++
+
+Return Value:
+
+	A checksum of the translations read through the oldest snapshot.
+
+--*/
+{
+	LARGE_INTEGER Start;
+	LARGE_INTEGER End;
+	TRANSLATION_TABLE_ENTRY Key;
+	PTRANSLATION_TABLE_ENTRY Entry;
+	LONGLONG Offset;
+	LONGLONG Last;
+	ULONGLONG Checksum;
+	ULONGLONG Lookups;
+	ULONGLONG Entries;
+	SIZE_T Bytes;
+	ULONG Current;
+	ULONG i;
+	ULONG j;
+
+	for (j = 0; j < Snapshots; j++) {
+		InitializeSnapshot (Index, &Snapshot[j]);
+	}
+
+	//
+	// Write phase.
+	//
+
+	Current = 0;
+	BlockCount = 0;
+	QueryPerformanceCounter (&Start);
+
+	for (i = 0; i < WriteCount; i++) {
+
+		while (Current + 1 < Snapshots &&
+			   i >= (ULONGLONG)WriteCount * (Current + 1) / Snapshots) {
+			Current++;
+		}
+
+		Offset = Writes[i].Offset & ~(BLOCK_SIZE - 1);
+		Last = (Writes[i].Offset + Writes[i].Length - 1) & ~(BLOCK_SIZE - 1);
+
+		for (; Offset <= Last; Offset += BLOCK_SIZE) {
+			CopyOnWrite (Index, &Snapshot[Current], Offset);
+			BlockCount++;
+		}
+	}
+
+	QueryPerformanceCounter (&End);
+
+	Entries = 0;
+	Bytes = 0;
+	for (j = 0; j < Snapshots; j++) {
+		Bytes += Snapshot[j].Heap.Total;
+		if (Index == SplayTable) {
+			Entries += RtlNumberGenericTableElements (&Snapshot[j].Table);
+		} else {
+			Entries += Snapshot[j].BlockMap.NumberOfElements;
+		}
+	}
+
+	printf ("%-12s  write %7.1f ns/block  %9I64u entries  %6.1f bytes/entry",
+			IndexNames[Index],
+			Seconds (Start, End) * 1e9 / (double)BlockCount,
+			Entries,
+			Entries ? (double)Bytes / (double)Entries : 0.0);
+
+	//
+	// Read phase, through the oldest snapshot.
+	//
+
+	Checksum = 0;
+	Lookups = 0;
+	ZeroMemory (&Key, sizeof (Key));
+	QueryPerformanceCounter (&Start);
+
+	for (i = 0; i < WriteCount; i++) {
+
+		Offset = Writes[i].Offset & ~(BLOCK_SIZE - 1);
+		Last = (Writes[i].Offset + Writes[i].Length - 1) & ~(BLOCK_SIZE - 1);
+
+		for (; Offset <= Last; Offset += BLOCK_SIZE) {
+			Key.VolumeOffset = Offset;
+			for (j = 0; j < Snapshots; j++) {
+				Lookups++;
+				Entry = Lookup (Index, &Snapshot[j], &Key);
+				if (Entry != NULL) {
+					Checksum = Checksum * 31 + Entry->TargetOffset + j;
+					break;
+				}
+			}
+		}
+	}
+
+	QueryPerformanceCounter (&End);
+
+	printf ("  read %7.1f ns/lookup\n",
+			Seconds (Start, End) * 1e9 / (double)Lookups);
+
+	return Checksum;
+}
+
+
+BOOLEAN
+CheckBlockMapOrder(
+	VOID
+	)
+{
+	PTRANSLATION_TABLE_ENTRY Entry;
+	LONGLONG Previous;
+	ULONG Count;
+	ULONG j;
+
+	for (j = 0; j < Snapshots; j++) {
+
+		Previous = -1;
+		Count = 0;
+
+		Entry = (PTRANSLATION_TABLE_ENTRY)
+			VspEnumerateBlockMap (&Snapshot[j].BlockMap, TRUE);
+
+		while (Entry != NULL) {
+			if (Entry->VolumeOffset <= Previous) {
+				return FALSE;
+			}
+			Previous = Entry->VolumeOffset;
+			Count++;
+			Entry = (PTRANSLATION_TABLE_ENTRY)
+				VspEnumerateBlockMap (&Snapshot[j].BlockMap, FALSE);
+		}
+
+		if (Count != Snapshot[j].BlockMap.NumberOfElements) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+
+VOID
+Usage(
+	VOID
+	)
+{
+	printf ("usage: tblkmap [-n snapshots] [-w writes] [-v gigabytes] "
+			"[-s sequential%%] [trace]\n");
+	exit (2);
+}
+
+
+int
+__cdecl
+main(
+	int argc,
+	char* argv[]
+	)
+{
+	ULONGLONG SplayChecksum;
+	ULONGLONG BlockMapChecksum;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+
+		if (argv[i][0] != '-' && argv[i][0] != '/') {
+			if (TraceFile != NULL) {
+				Usage ();
+			}
+			TraceFile = argv[i];
+			continue;
+		}
+
+		if (i + 1 >= argc) {
+			Usage ();
+		}
+
+		switch (tolower (argv[i][1])) {
+			case 'n': Snapshots = atoi (argv[++i]); break;
+			case 'w': SyntheticWrites = atoi (argv[++i]); break;
+			case 'v': VolumeGigabytes = atoi (argv[++i]); break;
+			case 's': SequentialPercent = atoi (argv[++i]); break;
+			default:
+				Usage ();
+		}
+	}
+
+	if (Snapshots == 0 || Snapshots > MAX_SNAPSHOTS || VolumeGigabytes == 0) {
+		Usage ();
+	}
+
+	if (TraceFile != NULL) {
+		ReadTrace (TraceFile);
+		printf ("%s: %d writes, %d snapshots\n\n", TraceFile, WriteCount, Snapshots);
+	} else {
+		SynthesizeTrace ();
+		printf ("synthetic: %d writes, %d%% sequential, %d GB volume, "
+				"%d snapshots\n\n",
+				WriteCount,
+				SequentialPercent,
+				VolumeGigabytes,
+				Snapshots);
+	}
+
+	SplayChecksum = RunTest (SplayTable);
+	BlockMapChecksum = RunTest (BlockMap);
+
+	if (BlockMapChecksum != SplayChecksum) {
+		printf ("\nFAILED: the block map returned different translations\n");
+		return 1;
+	}
+
+	if (!CheckBlockMapOrder ()) {
+		printf ("\nFAILED: the block map does not enumerate in order\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -102,6 +102,44 @@ VspWriteVolumePhase1(
     IN  PVOID   TableEntry
     );
 
+VOID
+VspStartCopyRun(
+    IN  PTEMP_TRANSLATION_TABLE_ENTRY   TableEntry
+    );
+
+NTSTATUS
+VspPrecomputeFreeSpace(
+    IN  PVOLUME_EXTENSION   Extension
+    );
+
+VOID
+VspDiscardPreCommitFreeBitmap(
+    IN  PFILTER_EXTENSION   Filter,
+    IN  PVOLUME_EXTENSION   Extension
+    );
+
+VOID
+VspClearBitsForWrite(
+    IN  PRTL_BITMAP Bitmap,
+    IN  PIRP        Irp
+    );
+
+VOID
+VspInitializeReadCache(
+    IN  PFILTER_EXTENSION   Filter
+    );
+
+VOID
+VspInvalidateReadCache(
+    IN  PFILTER_EXTENSION   Filter,
+    IN  PVOLUME_EXTENSION   Owner
+    );
+
+VOID
+VspDeleteReadCache(
+    IN  PFILTER_EXTENSION   Filter
+    );
+
 VOID
 VspFreeCopyIrp(
     IN  PVOLUME_EXTENSION   Extension,
@@ -860,6 +898,96 @@ VspLogError(
 }
 
 VOID
+VspLogCommitTimes(
+    IN  PVOLUME_EXTENSION   Extension
+    )
+
+/*++
+
+Routine Description:
+
+    This routine writes an informational event log entry giving the time
+    taken by each phase of creating the given snapshot.
+
+Arguments:
+
+    Extension   - Supplies the volume extension.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PFILTER_EXTENSION       filter = Extension->Filter;
+    PVSP_COMMIT_TIMES       times = &Extension->CommitTimes;
+    ULONGLONG               values[5];
+    WCHAR                   numbers[5][24];
+    USHORT                  numberLengths[5];
+    UNICODE_STRING          filterDosName;
+    NTSTATUS                status;
+    ULONG                   size, i;
+    PIO_ERROR_LOG_PACKET    errorLogPacket;
+    PWCHAR                  p;
+
+    values[0] = times->PreCommitScan;
+    values[1] = times->HoldToCommit;
+    values[2] = times->Commit;
+    values[3] = times->WritesHeld;
+    values[4] = times->FreeSpaceScan;
+
+    size = sizeof(IO_ERROR_LOG_PACKET);
+    for (i = 0; i < 5; i++) {
+        swprintf(numbers[i], L"%I64u", values[i]/(10*1000));
+        numberLengths[i] = (USHORT) ((wcslen(numbers[i]) + 1)*sizeof(WCHAR));
+        size += numberLengths[i];
+    }
+
+    status = IoVolumeDeviceToDosName(filter->DeviceObject, &filterDosName);
+    if (!NT_SUCCESS(status)) {
+        return;
+    }
+
+    size += filterDosName.Length + sizeof(WCHAR);
+    if (size > ERROR_LOG_MAXIMUM_SIZE) {
+        ExFreePool(filterDosName.Buffer);
+        return;
+    }
+
+    errorLogPacket = (PIO_ERROR_LOG_PACKET)
+                     IoAllocateErrorLogEntry(Extension->DeviceObject,
+                                             (UCHAR) size);
+    if (!errorLogPacket) {
+        ExFreePool(filterDosName.Buffer);
+        return;
+    }
+
+    errorLogPacket->ErrorCode = VS_SNAPSHOT_COMMIT_TIMES;
+    errorLogPacket->SequenceNumber = VsErrorLogSequence++;
+    errorLogPacket->FinalStatus = STATUS_SUCCESS;
+    errorLogPacket->UniqueErrorValue = 0;
+    errorLogPacket->DumpDataSize = 0;
+    errorLogPacket->RetryCount = 0;
+
+    errorLogPacket->NumberOfStrings = 6;
+    errorLogPacket->StringOffset = sizeof(IO_ERROR_LOG_PACKET);
+    p = (PWCHAR) ((PCHAR) errorLogPacket + sizeof(IO_ERROR_LOG_PACKET));
+    RtlCopyMemory(p, filterDosName.Buffer, filterDosName.Length);
+    p[filterDosName.Length/sizeof(WCHAR)] = 0;
+    p = (PWCHAR) ((PCHAR) p + filterDosName.Length + sizeof(WCHAR));
+
+    for (i = 0; i < 5; i++) {
+        RtlCopyMemory(p, numbers[i], numberLengths[i]);
+        p = (PWCHAR) ((PCHAR) p + numberLengths[i]);
+    }
+
+    IoWriteErrorLogEntry(errorLogPacket);
+
+    ExFreePool(filterDosName.Buffer);
+}
+
+VOID
 VspWaitForWorkerThreadsToExit(
     IN  PDO_EXTENSION   RootExtension
     )
@@ -3155,6 +3283,8 @@ Notes:
 
     VspResumeVolumeIo(filter);
 
+    VspInvalidateReadCache(filter, extension);
+
     VspCleanupVolumeSnapshot(extension, ListOfDiffAreaFilesToClose,
                              KeepOnDisk);
 
@@ -3462,8 +3592,6 @@ Return Value:
     TRANSLATION_TABLE_ENTRY         keyTableEntry;
     PTRANSLATION_TABLE_ENTRY        backPointer, finalTableEntry;
     PVOID                           r;
-    PVOID                           nodeOrParent;
-    TABLE_SEARCH_RESULT             searchResult;
     KIRQL                           irql;
 
     RtlZeroMemory(&keyTableEntry, sizeof(TRANSLATION_TABLE_ENTRY));
@@ -3474,23 +3602,20 @@ Return Value:
     _try {
 
         backPointer = (PTRANSLATION_TABLE_ENTRY)
-            RtlLookupElementGenericTable(&extension->CopyBackPointerTable,
-                                         &keyTableEntry);
+            VspLookupBlockMap(&extension->CopyBackPointerTable,
+                              &keyTableEntry);
 
         if (backPointer) {
             keyTableEntry.VolumeOffset = backPointer->TargetOffset;
         }
 
-        r = RtlLookupElementGenericTableFull(&extension->VolumeBlockTable,
-                                             &keyTableEntry, &nodeOrParent,
-                                             &searchResult);
+        r = VspLookupBlockMap(&extension->VolumeBlockTable, &keyTableEntry);
 
         ASSERT(!backPointer || r);
 
         if (r) {
             ASSERT(backPointer);
-            RtlDeleteElementGenericTable(&extension->CopyBackPointerTable,
-                                         backPointer);
+            VspDeleteBlockMap(&extension->CopyBackPointerTable, backPointer);
             finalTableEntry = (PTRANSLATION_TABLE_ENTRY) r;
             ASSERT(finalTableEntry->Flags&
                    VSP_TRANSLATION_TABLE_ENTRY_FLAG_COPY_ENTRY);
@@ -3499,10 +3624,8 @@ Return Value:
                     ~VSP_TRANSLATION_TABLE_ENTRY_FLAG_COPY_ENTRY;
             finalTableEntry->TargetOffset = tableEntry->TargetOffset;
         } else {
-            r = RtlInsertElementGenericTableFull(
-                &extension->VolumeBlockTable, &keyTableEntry,
-                sizeof(TRANSLATION_TABLE_ENTRY), NULL, nodeOrParent,
-                searchResult);
+            r = VspInsertBlockMap(&extension->VolumeBlockTable,
+                                  &keyTableEntry, NULL);
         }
     } _except (EXCEPTION_EXECUTE_HANDLER) {
         r = NULL;
@@ -4626,688 +4749,586 @@ Return Value:
 }
 
 VOID
-VspUnmapNextDiffAreaFileMap(
-    IN  PVOID   Context
+VspAbortCopyRun(
+    IN  PTEMP_TRANSLATION_TABLE_ENTRY   TableEntry
     )
 
-{
-    PVSP_CONTEXT        context = (PVSP_CONTEXT) Context;
-    PVOLUME_EXTENSION   extension = context->Extension.Extension;
-    NTSTATUS            status;
+/*++
 
-    ASSERT(context->Type == VSP_CONTEXT_TYPE_EXTENSION);
+Routine Description:
 
-    VspFreeContext(extension->Root, context);
+    This routine aborts all of the table entries of a run after the copy
+    of the run failed.
 
-    if (extension->NextDiffAreaFileMap) {
-        status = ZwUnmapViewOfSection(extension->DiffAreaFileMapProcess,
-                                      extension->NextDiffAreaFileMap);
-        ASSERT(NT_SUCCESS(status));
-        extension->NextDiffAreaFileMap = NULL;
+Arguments:
+
+    TableEntry  - Supplies the table entry that owns the copy irp of the run.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PFILTER_EXTENSION               filter = TableEntry->Extension->Filter;
+    PLIST_ENTRY                     l;
+    PTEMP_TRANSLATION_TABLE_ENTRY   tableEntry;
+
+    while (!IsListEmpty(&TableEntry->CopyRunListEntry)) {
+        l = RemoveHeadList(&TableEntry->CopyRunListEntry);
+        tableEntry = CONTAINING_RECORD(l, TEMP_TRANSLATION_TABLE_ENTRY,
+                                       CopyRunListEntry);
+        VspDestroyAllSnapshots(filter, tableEntry, FALSE, FALSE);
     }
 
-    VspReleasePagedResource(extension);
-    ObDereferenceObject(extension->Filter->DeviceObject);
-    ObDereferenceObject(extension->DeviceObject);
+    VspDestroyAllSnapshots(filter, TableEntry, FALSE, FALSE);
 }
 
 NTSTATUS
-VspTruncatePreviousDiffArea(
-    IN  PVOLUME_EXTENSION   Extension
+VspWriteVolumeRunPhase3(
+    IN  PDEVICE_OBJECT  DeviceObject,
+    IN  PIRP            Irp,
+    IN  PVOID           TableEntry
     )
 
 /*++
 
 Routine Description:
 
-    This routine takes the snapshot that occurred before this one and
-    truncates its diff area file to the current used size since diff
-    area files can't grow after a new snapshot is added on top.
+    This routine is the completion for a write of a run of blocks to the
+    diff area file.  For a persistent snapshot the table entries of the
+    whole run are queued together so that they go out in one table update.
 
 Arguments:
 
-    Extension   - Supplies the volume extension.
+    TableEntry  - Supplies the table entry that owns the copy irp of the run.
 
 Return Value:
 
-    NTSTATUS
+    STATUS_MORE_PROCESSING_REQUIRED
 
 --*/
 
 {
-    PFILTER_EXTENSION           filter = Extension->Filter;
-    PLIST_ENTRY                 l, ll;
-    PVOLUME_EXTENSION           extension;
-    PVSP_DIFF_AREA_FILE         diffAreaFile;
-    NTSTATUS                    status;
-    LONGLONG                    diff;
-    KIRQL                       irql;
-    PDIFF_AREA_FILE_ALLOCATION  diffAreaFileAllocation;
-    PVSP_CONTEXT                context;
+    PTEMP_TRANSLATION_TABLE_ENTRY   tableEntry = (PTEMP_TRANSLATION_TABLE_ENTRY) TableEntry;
+    PVOLUME_EXTENSION               extension = tableEntry->Extension;
+    PFILTER_EXTENSION               filter = extension->Filter;
+    NTSTATUS                        status = Irp->IoStatus.Status;
+    PVSP_DIFF_AREA_FILE             diffAreaFile;
+    PLIST_ENTRY                     l;
+    PTEMP_TRANSLATION_TABLE_ENTRY   runEntry;
+    KIRQL                           irql;
+    BOOLEAN                         dontNeedWrite;
 
-    l = Extension->ListEntry.Blink;
-    if (l == &filter->VolumeList) {
-        return STATUS_SUCCESS;
+    if (!NT_SUCCESS(status)) {
+        if (!filter->DestroyAllSnapshotsPending) {
+            VspLogError(extension, extension->DiffAreaFile->Filter,
+                        VS_ABORT_SNAPSHOTS_IO_FAILURE, status, 10, FALSE);
+        }
+        VspAbortCopyRun(tableEntry);
+        return STATUS_MORE_PROCESSING_REQUIRED;
     }
 
-    extension = CONTAINING_RECORD(l, VOLUME_EXTENSION, ListEntry);
-
-    diffAreaFile = extension->DiffAreaFile;
-    ASSERT(diffAreaFile);
-
-    status = VspSetFileSize(diffAreaFile->FileHandle,
-                            diffAreaFile->NextAvailable);
-
-    VspAcquireNonPagedResource(extension, NULL, FALSE);
+    VspFreeCopyIrp(extension, Irp);
+    tableEntry->CopyIrp = NULL;
 
-    if (NT_SUCCESS(status)) {
-        diff = diffAreaFile->AllocatedFileSize - diffAreaFile->NextAvailable;
-        diffAreaFile->AllocatedFileSize -= diff;
-        KeAcquireSpinLock(&filter->SpinLock, &irql);
-        filter->AllocatedVolumeSpace -= diff;
-        KeReleaseSpinLock(&filter->SpinLock, irql);
-    }
+    if (extension->IsPersistent) {
 
-    while (!IsListEmpty(&diffAreaFile->UnusedAllocationList)) {
-        ll = RemoveHeadList(&diffAreaFile->UnusedAllocationList);
-        diffAreaFileAllocation = CONTAINING_RECORD(ll,
-                                 DIFF_AREA_FILE_ALLOCATION, ListEntry);
-        ExFreePool(diffAreaFileAllocation);
-    }
+        diffAreaFile = extension->DiffAreaFile;
 
-    if (diffAreaFile->TableUpdateIrp) {
-        ExFreePool(MmGetMdlVirtualAddress(
-                   diffAreaFile->TableUpdateIrp->MdlAddress));
-        IoFreeMdl(diffAreaFile->TableUpdateIrp->MdlAddress);
-        IoFreeIrp(diffAreaFile->TableUpdateIrp);
-        diffAreaFile->TableUpdateIrp = NULL;
-    }
+        KeAcquireSpinLock(&extension->SpinLock, &irql);
+        InsertTailList(&diffAreaFile->TableUpdateQueue,
+                       &tableEntry->TableUpdateListEntry);
+        tableEntry->InTableUpdateQueue = TRUE;
+        while (!IsListEmpty(&tableEntry->CopyRunListEntry)) {
+            l = RemoveHeadList(&tableEntry->CopyRunListEntry);
+            runEntry = CONTAINING_RECORD(l, TEMP_TRANSLATION_TABLE_ENTRY,
+                                         CopyRunListEntry);
+            InsertTailList(&diffAreaFile->TableUpdateQueue,
+                           &runEntry->TableUpdateListEntry);
+            runEntry->InTableUpdateQueue = TRUE;
+        }
+        dontNeedWrite = diffAreaFile->TableUpdateInProgress;
+        diffAreaFile->TableUpdateInProgress = TRUE;
+        KeReleaseSpinLock(&extension->SpinLock, irql);
 
-    VspReleaseNonPagedResource(extension);
+        if (!dontNeedWrite) {
+            VspWriteTableUpdates(diffAreaFile);
+        }
 
-    if (extension->EmergencyCopyIrp) {
-        ExFreePool(MmGetMdlVirtualAddress(
-                   extension->EmergencyCopyIrp->MdlAddress));
-        IoFreeMdl(extension->EmergencyCopyIrp->MdlAddress);
-        IoFreeIrp(extension->EmergencyCopyIrp);
-        extension->EmergencyCopyIrp = NULL;
+        return STATUS_MORE_PROCESSING_REQUIRED;
     }
 
-    context = VspAllocateContext(Extension->Root);
-    if (context) {
-        context->Type = VSP_CONTEXT_TYPE_EXTENSION;
-        context->Extension.Extension = extension;
-        ExInitializeWorkItem(&context->WorkItem, VspUnmapNextDiffAreaFileMap,
-                             context);
-        ObReferenceObject(extension->DeviceObject);
-        ObReferenceObject(extension->Filter->DeviceObject);
-        VspAcquirePagedResource(extension, &context->WorkItem);
+    while (!IsListEmpty(&tableEntry->CopyRunListEntry)) {
+        l = RemoveHeadList(&tableEntry->CopyRunListEntry);
+        runEntry = CONTAINING_RECORD(l, TEMP_TRANSLATION_TABLE_ENTRY,
+                                     CopyRunListEntry);
+        VspWriteVolumePhase35(runEntry);
     }
 
-    if (extension->IgnoreCopyDataReference) {
-        extension->IgnoreCopyDataReference = FALSE;
-        InterlockedDecrement(&filter->IgnoreCopyData);
-    }
+    VspWriteVolumePhase35(tableEntry);
 
-    return STATUS_SUCCESS;
+    return STATUS_MORE_PROCESSING_REQUIRED;
 }
 
-VOID
-VspOrBitmaps(
-    IN OUT  PRTL_BITMAP BaseBitmap,
-    IN      PRTL_BITMAP FactorBitmap
+NTSTATUS
+VspWriteVolumeRunPhase2(
+    IN  PDEVICE_OBJECT  DeviceObject,
+    IN  PIRP            Irp,
+    IN  PVOID           TableEntry
     )
 
-{
-    ULONG   n, i;
-    PULONG  p, q;
+/*++
 
-    n = (BaseBitmap->SizeOfBitMap + 8*sizeof(ULONG) - 1)/(8*sizeof(ULONG));
-    p = BaseBitmap->Buffer;
-    q = FactorBitmap->Buffer;
+Routine Description:
 
-    for (i = 0; i < n; i++) {
-        *p++ |= *q++;
-    }
-}
-
-NTSTATUS
-VspQueryFileOffset(
-    IN  PLIST_ENTRY                 ExtentList,
-    IN  LONGLONG                    VolumeOffset,
-    IN  PDIFF_AREA_FILE_ALLOCATION  StartFileAllocation,
-    IN  LONGLONG                    StartFileAllocationFileOffset,
-    OUT PLONGLONG                   ResultFileOffset,
-    OUT PDIFF_AREA_FILE_ALLOCATION* ResultFileAllocation,
-    OUT PLONGLONG                   ResultFileAllocationFileOffset,
-    OUT PLONGLONG                   Length
-    )
+    This routine is the completion for the read of a run of blocks.  The
+    run is written to its contiguous space in the diff area file.
 
-{
-    PLIST_ENTRY                 l, start;
-    LONGLONG                    fileOffset, delta;
-    PDIFF_AREA_FILE_ALLOCATION  diffAreaAllocation;
+Arguments:
 
-    ASSERT(!IsListEmpty(ExtentList));
+    TableEntry  - Supplies the table entry that owns the copy irp of the run.
 
-    if (!StartFileAllocation) {
-        StartFileAllocation = CONTAINING_RECORD(ExtentList->Flink,
-                                                DIFF_AREA_FILE_ALLOCATION,
-                                                ListEntry);
-        StartFileAllocationFileOffset = 0;
+Return Value:
+
+    STATUS_MORE_PROCESSING_REQUIRED
+
+--*/
+
+{
+    NTSTATUS                        status = Irp->IoStatus.Status;
+    PTEMP_TRANSLATION_TABLE_ENTRY   tableEntry = (PTEMP_TRANSLATION_TABLE_ENTRY) TableEntry;
+    PVOLUME_EXTENSION               extension = tableEntry->Extension;
+    PIO_STACK_LOCATION              nextSp;
+
+    if (!NT_SUCCESS(status)) {
+        if (!extension->Filter->DestroyAllSnapshotsPending) {
+            VspLogError(extension, extension->Filter,
+                        VS_ABORT_SNAPSHOTS_IO_FAILURE, status, 11, FALSE);
+        }
+        VspAbortCopyRun(tableEntry);
+        return STATUS_MORE_PROCESSING_REQUIRED;
     }
 
-    ASSERT(&StartFileAllocation->ListEntry != ExtentList);
+    Irp->Tail.Overlay.Thread = PsGetCurrentThread();
+    nextSp = IoGetNextIrpStackLocation(Irp);
+    nextSp->Parameters.Write.ByteOffset.QuadPart = tableEntry->TargetOffset;
+    nextSp->Parameters.Write.Length = tableEntry->CopyRunLength*BLOCK_SIZE;
+    nextSp->MajorFunction = IRP_MJ_WRITE;
+    nextSp->DeviceObject = tableEntry->TargetObject;
+    nextSp->Flags = SL_OVERRIDE_VERIFY_VOLUME;
 
-    start = &StartFileAllocation->ListEntry;
-    l = start;
-    fileOffset = StartFileAllocationFileOffset;
+    IoSetCompletionRoutine(Irp, VspWriteVolumeRunPhase3, tableEntry, TRUE,
+                           TRUE, TRUE);
 
-    for (;;) {
+    IoCallDriver(nextSp->DeviceObject, Irp);
 
-        diffAreaAllocation = CONTAINING_RECORD(l, DIFF_AREA_FILE_ALLOCATION,
-                                               ListEntry);
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+VOID
+VspWriteVolumeRunPhase1(
+    IN  PTEMP_TRANSLATION_TABLE_ENTRY   TableEntry
+    )
 
-        if (diffAreaAllocation->NLength <= 0) {
-            fileOffset -= diffAreaAllocation->NLength;
-        } else {
+/*++
 
-            if (diffAreaAllocation->Offset <= VolumeOffset &&
-                diffAreaAllocation->Offset + diffAreaAllocation->NLength >
-                VolumeOffset) {
+Routine Description:
 
-                delta = VolumeOffset - diffAreaAllocation->Offset;
-                *ResultFileOffset = fileOffset + delta;
-                *ResultFileAllocation = diffAreaAllocation;
-                *ResultFileAllocationFileOffset = fileOffset;
-                if (Length) {
-                    *Length = diffAreaAllocation->NLength - delta;
-                }
+    This routine starts the copy of a run of blocks to the diff area file
+    with a single read of the whole run.
 
-                return STATUS_SUCCESS;
-            }
+Arguments:
 
-            fileOffset += diffAreaAllocation->NLength;
-        }
+    TableEntry  - Supplies the table entry that owns the copy irp of the run.
 
+Return Value:
 
-        l = l->Flink;
-        if (l == ExtentList) {
-            fileOffset = 0;
-            l = l->Flink;
-        }
-        if (l == start) {
-            break;
-        }
+    None.
+
+--*/
+
+{
+    PTEMP_TRANSLATION_TABLE_ENTRY   tableEntry = TableEntry;
+    PVOLUME_EXTENSION               extension = tableEntry->Extension;
+    PFILTER_EXTENSION               filter = extension->Filter;
+    PIRP                            irp = tableEntry->CopyIrp;
+    PIO_STACK_LOCATION              nextSp;
+    LONGLONG                        runEnd;
+
+    irp->Flags &= ~(IRP_HIGH_PRIORITY_PAGING_IO | IRP_PAGING_IO);
+    irp->Flags |= (tableEntry->WriteIrp->Flags&
+                   (IRP_HIGH_PRIORITY_PAGING_IO | IRP_PAGING_IO));
+
+    runEnd = tableEntry->VolumeOffset + tableEntry->CopyRunLength*BLOCK_SIZE;
+
+    irp->Tail.Overlay.Thread = PsGetCurrentThread();
+    nextSp = IoGetNextIrpStackLocation(irp);
+    nextSp->Parameters.Read.ByteOffset.QuadPart = tableEntry->VolumeOffset;
+    nextSp->Parameters.Read.Length = tableEntry->CopyRunLength*BLOCK_SIZE;
+    nextSp->MajorFunction = IRP_MJ_READ;
+    nextSp->DeviceObject = filter->TargetObject;
+    nextSp->Flags = SL_OVERRIDE_VERIFY_VOLUME;
+
+    if (runEnd > extension->VolumeSize) {
+        nextSp->Parameters.Read.Length = (ULONG)
+                (extension->VolumeSize - tableEntry->VolumeOffset);
     }
 
-    return STATUS_INVALID_PARAMETER;
+    IoSetCompletionRoutine(irp, VspWriteVolumeRunPhase2, tableEntry, TRUE,
+                           TRUE, TRUE);
+
+    IoCallDriver(nextSp->DeviceObject, irp);
 }
 
-NTSTATUS
-VspCheckBlockChainFileOffsets(
-    IN  PFILTER_EXTENSION   Filter,
-    IN  LONGLONG            StartingVolumeOffset,
-    IN  PLIST_ENTRY         ExtentList
+VOID
+VspStartCopyRun(
+    IN  PTEMP_TRANSLATION_TABLE_ENTRY   TableEntry
     )
 
-{
-    PVSP_BLOCK_HEADER           blockHeader;
-    LONGLONG                    volumeOffset, fileOffset;
-    NTSTATUS                    status;
-    PDIFF_AREA_FILE_ALLOCATION  startFileAllocation, resultFileAllocation;
-    LONGLONG                    startFileAllocationFileOffset;
-    LONGLONG                    resultFileAllocationFileOffset;
+/*++
 
-    if (IsListEmpty(ExtentList) || !StartingVolumeOffset) {
-        return STATUS_FILE_CORRUPT_ERROR;
-    }
+Routine Description:
 
-    VspAcquireNonPagedResource(Filter, NULL, FALSE);
+    This routine allocates the copy irp and buffer for a run of table
+    entries and starts copying the run to the diff area file.  If there
+    isn't enough memory for a buffer covering the whole run then the run
+    is broken up and its blocks are copied one at a time, waiting for the
+    emergency copy irp if need be.
 
-    if (!Filter->SnapshotOnDiskIrp) {
-        VspReleaseNonPagedResource(Filter);
-        return STATUS_INVALID_PARAMETER;
-    }
+Arguments:
 
-    blockHeader = (PVSP_BLOCK_HEADER) MmGetMdlVirtualAddress(
-                  Filter->SnapshotOnDiskIrp->MdlAddress);
-    volumeOffset = StartingVolumeOffset;
-    startFileAllocation = NULL;
-    startFileAllocationFileOffset = 0;
+    TableEntry  - Supplies the first table entry of the run.
 
-    while (volumeOffset) {
+Return Value:
 
-        status = VspSynchronousIo(Filter->SnapshotOnDiskIrp,
-                                  Filter->TargetObject, IRP_MJ_READ,
-                                  volumeOffset, 0);
-        if (!NT_SUCCESS(status)) {
-            VspReleaseNonPagedResource(Filter);
-            return status;
-        }
+    None.
 
-        status = VspQueryFileOffset(ExtentList, volumeOffset,
-                                    startFileAllocation,
-                                    startFileAllocationFileOffset,
-                                    &fileOffset, &resultFileAllocation,
-                                    &resultFileAllocationFileOffset, NULL);
-        if (!NT_SUCCESS(status)) {
-            VspReleaseNonPagedResource(Filter);
-            return status;
-        }
+Notes:
 
-        if (fileOffset != blockHeader->ThisFileOffset) {
-            ASSERT(FALSE);
-            VspReleaseNonPagedResource(Filter);
-            return STATUS_FILE_CORRUPT_ERROR;
-        }
+    Callers of this routine must be holding 'NonPagedResource'.
 
-        volumeOffset = blockHeader->NextVolumeOffset;
-        startFileAllocation = resultFileAllocation;
-        startFileAllocationFileOffset = resultFileAllocationFileOffset;
-    }
+--*/
 
-    VspReleaseNonPagedResource(Filter);
+{
+    PVOLUME_EXTENSION               extension = TableEntry->Extension;
+    ULONG                           length = TableEntry->CopyRunLength*BLOCK_SIZE;
+    PIRP                            irp;
+    PVOID                           buffer;
+    PMDL                            mdl;
+    PLIST_ENTRY                     l;
+    PTEMP_TRANSLATION_TABLE_ENTRY   tableEntry;
+    KIRQL                           irql;
 
-    return status;
-}
-
-NTSTATUS
-VspCheckControlBlockFileLocation(
-    IN  PFILTER_EXTENSION   Filter
-    )
+    irp = IoAllocateIrp((CCHAR) extension->Root->StackSize, FALSE);
+    buffer = ExAllocatePoolWithTagPriority(NonPagedPool, length,
+                                           VOLSNAP_TAG_BUFFER,
+                                           LowPoolPriority);
+    mdl = IoAllocateMdl(buffer, length, FALSE, FALSE, NULL);
 
-{
-    HANDLE                      h = Filter->ControlBlockFileHandle;
-    NTSTATUS                    status;
-    LIST_ENTRY                  extentList;
-    PLIST_ENTRY                 l;
-    PDIFF_AREA_FILE_ALLOCATION  diffAreaFileAllocation;
+    if (irp && buffer && mdl) {
+        MmBuildMdlForNonPagedPool(mdl);
+        irp->MdlAddress = mdl;
+        TableEntry->CopyIrp = irp;
 
-    if (!h) {
-        return STATUS_INVALID_PARAMETER;
+        if (TableEntry->CopyRunLength == 1) {
+            VspWriteVolumePhase1(TableEntry);
+        } else {
+            VspWriteVolumeRunPhase1(TableEntry);
+        }
+        return;
     }
 
-    status = VspQueryListOfExtents(h, 0, &extentList, NULL, FALSE);
-    if (!NT_SUCCESS(status)) {
-        return status;
+    if (irp) {
+        IoFreeIrp(irp);
+    }
+    if (buffer) {
+        ExFreePool(buffer);
+    }
+    if (mdl) {
+        IoFreeMdl(mdl);
     }
 
-    status = VspCheckBlockChainFileOffsets(Filter,
-             Filter->FirstControlBlockVolumeOffset, &extentList);
+    if (TableEntry->CopyRunLength > 1) {
+        while (!IsListEmpty(&TableEntry->CopyRunListEntry)) {
+            l = RemoveHeadList(&TableEntry->CopyRunListEntry);
+            InitializeListHead(l);
+            tableEntry = CONTAINING_RECORD(l, TEMP_TRANSLATION_TABLE_ENTRY,
+                                           CopyRunListEntry);
+            tableEntry->CopyRunLength = 1;
+            VspStartCopyRun(tableEntry);
+        }
+        TableEntry->CopyRunLength = 1;
+        VspStartCopyRun(TableEntry);
+        return;
+    }
 
-    while (!IsListEmpty(&extentList)) {
-        l = RemoveHeadList(&extentList);
-        diffAreaFileAllocation = CONTAINING_RECORD(l,
-                                 DIFF_AREA_FILE_ALLOCATION, ListEntry);
-        ExFreePool(diffAreaFileAllocation);
+    KeAcquireSpinLock(&extension->SpinLock, &irql);
+    if (extension->EmergencyCopyIrpInUse) {
+        ExInitializeWorkItem(&TableEntry->WorkItem, VspWriteVolumePhase1,
+                             TableEntry);
+        InsertTailList(&extension->EmergencyCopyIrpQueue,
+                       &TableEntry->WorkItem.List);
+        KeReleaseSpinLock(&extension->SpinLock, irql);
+        return;
     }
+    extension->EmergencyCopyIrpInUse = TRUE;
+    KeReleaseSpinLock(&extension->SpinLock, irql);
 
-    return status;
+    TableEntry->CopyIrp = extension->EmergencyCopyIrp;
+
+    VspWriteVolumePhase1(TableEntry);
 }
 
 VOID
-VspWaitForVolumesSafeForWriteAccess(
-    IN  PDO_EXTENSION   RootExtension
+VspUnmapNextDiffAreaFileMap(
+    IN  PVOID   Context
     )
 
 {
-    UNICODE_STRING      volumeSafeEventName;
-    OBJECT_ATTRIBUTES   oa;
-    KEVENT              event;
-    LARGE_INTEGER       timeout;
-    ULONG               i;
+    PVSP_CONTEXT        context = (PVSP_CONTEXT) Context;
+    PVOLUME_EXTENSION   extension = context->Extension.Extension;
     NTSTATUS            status;
-    HANDLE              volumeSafeEvent;
 
-    if (RootExtension->IsSetup || RootExtension->VolumesSafeForWriteAccess) {
-        return;
-    }
+    ASSERT(context->Type == VSP_CONTEXT_TYPE_EXTENSION);
 
-    RtlInitUnicodeString(&volumeSafeEventName,
-                         L"\\Device\\VolumesSafeForWriteAccess");
-    InitializeObjectAttributes(&oa, &volumeSafeEventName,
-                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL,
-                               NULL);
-    KeInitializeEvent(&event, NotificationEvent, FALSE);
-    timeout.QuadPart = -10*1000*1000;   // 1 second
+    VspFreeContext(extension->Root, context);
 
-    for (i = 0; i < 1000; i++) {
-        status = ZwOpenEvent(&volumeSafeEvent, EVENT_ALL_ACCESS, &oa);
-        if (NT_SUCCESS(status)) {
-            break;
-        }
-        KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, &timeout);
-        if (RootExtension->VolumesSafeForWriteAccess) {
-            return;
-        }
-    }
-    if (i == 1000) {
-        return;
-    }
-
-    for (;;) {
-        status = ZwWaitForSingleObject(volumeSafeEvent, FALSE, &timeout);
-        if (status != STATUS_TIMEOUT) {
-            InterlockedExchange(&RootExtension->VolumesSafeForWriteAccess,
-                                TRUE);
-            break;
-        }
-        if (RootExtension->VolumesSafeForWriteAccess) {
-            break;
-        }
+    if (extension->NextDiffAreaFileMap) {
+        status = ZwUnmapViewOfSection(extension->DiffAreaFileMapProcess,
+                                      extension->NextDiffAreaFileMap);
+        ASSERT(NT_SUCCESS(status));
+        extension->NextDiffAreaFileMap = NULL;
     }
 
-    ZwClose(volumeSafeEvent);
+    VspReleasePagedResource(extension);
+    ObDereferenceObject(extension->Filter->DeviceObject);
+    ObDereferenceObject(extension->DeviceObject);
 }
 
 NTSTATUS
-VspOpenControlBlockFile(
-    IN  PFILTER_EXTENSION   Filter
+VspTruncatePreviousDiffArea(
+    IN  PVOLUME_EXTENSION   Extension
     )
 
-{
-    PFILTER_EXTENSION       filter = Filter;
-    NTSTATUS                status;
-    UNICODE_STRING          fileName;
-    PWCHAR                  star;
-    OBJECT_ATTRIBUTES       oa;
-    HANDLE                  h;
-    IO_STATUS_BLOCK         ioStatus;
-    PLIST_ENTRY             l;
-    PVSP_LOOKUP_TABLE_ENTRY lookupEntry;
-    GUID                    snapshotGuid;
-    ULONG                   i;
-    LARGE_INTEGER           timeout;
-    KEVENT                  event;
-
-    if (filter->ControlBlockFileHandle) {
-        return STATUS_SUCCESS;
-    }
+/*++
 
-    VspWaitForVolumesSafeForWriteAccess(filter->Root);
+Routine Description:
 
-    KeWaitForSingleObject(&filter->ControlBlockFileHandleSemaphore,
-                          Executive, KernelMode, FALSE, NULL);
+    This routine takes the snapshot that occurred before this one and
+    truncates its diff area file to the current used size since diff
+    area files can't grow after a new snapshot is added on top.
 
-    if (filter->ControlBlockFileHandle) {
-        KeReleaseSemaphore(&filter->ControlBlockFileHandleSemaphore,
-                           IO_NO_INCREMENT, 1, FALSE);
-        return STATUS_SUCCESS;
-    }
+Arguments:
 
-    VspAcquireNonPagedResource(filter, NULL, FALSE);
-    VspCreateStartBlock(filter, filter->FirstControlBlockVolumeOffset,
-                        filter->MaximumVolumeSpace);
-    VspReleaseNonPagedResource(filter);
+    Extension   - Supplies the volume extension.
 
-    status = VspCreateDiffAreaFileName(filter->TargetObject, NULL,
-                                       &fileName, FALSE, NULL);
-    if (!NT_SUCCESS(status)) {
-        KeReleaseSemaphore(&filter->ControlBlockFileHandleSemaphore,
-                           IO_NO_INCREMENT, 1, FALSE);
-        return status;
-    }
+Return Value:
 
-    star = fileName.Buffer + fileName.Length/sizeof(WCHAR) - 39;
+    NTSTATUS
 
-    RtlMoveMemory(star, star + 1, 38*sizeof(WCHAR));
-    fileName.Length -= sizeof(WCHAR);
-    fileName.Buffer[fileName.Length/sizeof(WCHAR)] = 0;
+--*/
 
-    InitializeObjectAttributes(&oa, &fileName, OBJ_CASE_INSENSITIVE |
-                               OBJ_KERNEL_HANDLE, NULL, NULL);
+{
+    PFILTER_EXTENSION           filter = Extension->Filter;
+    PLIST_ENTRY                 l, ll;
+    PVOLUME_EXTENSION           extension;
+    PVSP_DIFF_AREA_FILE         diffAreaFile;
+    NTSTATUS                    status;
+    LONGLONG                    diff;
+    KIRQL                       irql;
+    PDIFF_AREA_FILE_ALLOCATION  diffAreaFileAllocation;
+    PVSP_CONTEXT                context;
 
-    KeInitializeEvent(&event, NotificationEvent, FALSE);
-    timeout.QuadPart = -10*1000; // 1 millisecond.
+    l = Extension->ListEntry.Blink;
+    if (l == &filter->VolumeList) {
+        return STATUS_SUCCESS;
+    }
 
-    for (i = 0; i < 5000; i++) {
-        status = ZwOpenFile(&h, FILE_GENERIC_READ | FILE_GENERIC_WRITE, &oa,
-                            &ioStatus, 0, FILE_WRITE_THROUGH |
-                            FILE_SYNCHRONOUS_IO_NONALERT |
-                            FILE_NON_DIRECTORY_FILE | FILE_DELETE_ON_CLOSE |
-                            FILE_NO_COMPRESSION);
-        if (NT_SUCCESS(status)) {
-            break;
-        }
+    extension = CONTAINING_RECORD(l, VOLUME_EXTENSION, ListEntry);
 
-        // Wait for RAW to DISMOUNT or for the DISMOUNT handle to close.
+    diffAreaFile = extension->DiffAreaFile;
+    ASSERT(diffAreaFile);
 
-        if (status != STATUS_INVALID_PARAMETER &&
-            status != STATUS_ACCESS_DENIED) {
+    status = VspSetFileSize(diffAreaFile->FileHandle,
+                            diffAreaFile->NextAvailable);
 
-            break;
-        }
+    VspAcquireNonPagedResource(extension, NULL, FALSE);
 
-        KeWaitForSingleObject(&event, Executive, KernelMode, FALSE,
-                              &timeout);
-    }
-    ExFreePool(fileName.Buffer);
-    if (!NT_SUCCESS(status)) {
-        KeReleaseSemaphore(&filter->ControlBlockFileHandleSemaphore,
-                           IO_NO_INCREMENT, 1, FALSE);
-        return status;
+    if (NT_SUCCESS(status)) {
+        diff = diffAreaFile->AllocatedFileSize - diffAreaFile->NextAvailable;
+        diffAreaFile->AllocatedFileSize -= diff;
+        KeAcquireSpinLock(&filter->SpinLock, &irql);
+        filter->AllocatedVolumeSpace -= diff;
+        KeReleaseSpinLock(&filter->SpinLock, irql);
     }
 
-    ASSERT(!filter->ControlBlockFileHandle);
-    InterlockedExchangePointer(&filter->ControlBlockFileHandle, h);
-
-    VspAcquire(filter->Root);
-    if (filter->IsRemoved) {
-        VspRelease(filter->Root);
-        h = InterlockedExchangePointer(&filter->ControlBlockFileHandle,
-                                       NULL);
-        if (h) {
-            ZwClose(h);
-        }
-        KeReleaseSemaphore(&filter->ControlBlockFileHandleSemaphore,
-                           IO_NO_INCREMENT, 1, FALSE);
-        return STATUS_UNSUCCESSFUL;
+    while (!IsListEmpty(&diffAreaFile->UnusedAllocationList)) {
+        ll = RemoveHeadList(&diffAreaFile->UnusedAllocationList);
+        diffAreaFileAllocation = CONTAINING_RECORD(ll,
+                                 DIFF_AREA_FILE_ALLOCATION, ListEntry);
+        ExFreePool(diffAreaFileAllocation);
     }
-    VspRelease(filter->Root);
 
-    status = VspPinFile(filter->TargetObject, h);
-    if (!NT_SUCCESS(status)) {
-        h = InterlockedExchangePointer(&filter->ControlBlockFileHandle,
-                                       NULL);
-        if (h) {
-            ZwClose(h);
-        }
-        KeReleaseSemaphore(&filter->ControlBlockFileHandleSemaphore,
-                           IO_NO_INCREMENT, 1, FALSE);
-        return status;
+    if (diffAreaFile->TableUpdateIrp) {
+        ExFreePool(MmGetMdlVirtualAddress(
+                   diffAreaFile->TableUpdateIrp->MdlAddress));
+        IoFreeMdl(diffAreaFile->TableUpdateIrp->MdlAddress);
+        IoFreeIrp(diffAreaFile->TableUpdateIrp);
+        diffAreaFile->TableUpdateIrp = NULL;
     }
 
-    status = VspCheckControlBlockFileLocation(filter);
-    if (!NT_SUCCESS(status)) {
-        h = InterlockedExchangePointer(&filter->ControlBlockFileHandle,
-                                       NULL);
-        if (h) {
-            ZwClose(h);
-        }
-        KeReleaseSemaphore(&filter->ControlBlockFileHandleSemaphore,
-                           IO_NO_INCREMENT, 1, FALSE);
-        return status;
+    VspReleaseNonPagedResource(extension);
+
+    if (extension->EmergencyCopyIrp) {
+        ExFreePool(MmGetMdlVirtualAddress(
+                   extension->EmergencyCopyIrp->MdlAddress));
+        IoFreeMdl(extension->EmergencyCopyIrp->MdlAddress);
+        IoFreeIrp(extension->EmergencyCopyIrp);
+        extension->EmergencyCopyIrp = NULL;
     }
 
-    VspAcquireNonPagedResource(filter, NULL, FALSE);
-    if (!filter->FirstControlBlockVolumeOffset) {
-        h = InterlockedExchangePointer(&filter->ControlBlockFileHandle,
-                                       NULL);
-        VspReleaseNonPagedResource(filter);
-        if (h) {
-            ZwClose(h);
-        }
-        KeReleaseSemaphore(&filter->ControlBlockFileHandleSemaphore,
-                           IO_NO_INCREMENT, 1, FALSE);
-        return STATUS_UNSUCCESSFUL;
+    context = VspAllocateContext(Extension->Root);
+    if (context) {
+        context->Type = VSP_CONTEXT_TYPE_EXTENSION;
+        context->Extension.Extension = extension;
+        ExInitializeWorkItem(&context->WorkItem, VspUnmapNextDiffAreaFileMap,
+                             context);
+        ObReferenceObject(extension->DeviceObject);
+        ObReferenceObject(extension->Filter->DeviceObject);
+        VspAcquirePagedResource(extension, &context->WorkItem);
     }
-    VspReleaseNonPagedResource(filter);
 
-    KeReleaseSemaphore(&filter->ControlBlockFileHandleSemaphore,
-                       IO_NO_INCREMENT, 1, FALSE);
+    if (extension->IgnoreCopyDataReference) {
+        extension->IgnoreCopyDataReference = FALSE;
+        InterlockedDecrement(&filter->IgnoreCopyData);
+    }
 
     return STATUS_SUCCESS;
 }
+
 VOID
-VspOpenControlBlockFileWorker(
-    IN  PVOID   Context
+VspOrBitmaps(
+    IN OUT  PRTL_BITMAP BaseBitmap,
+    IN      PRTL_BITMAP FactorBitmap
     )
 
 {
-    PVSP_CONTEXT        context = (PVSP_CONTEXT) Context;
-    PFILTER_EXTENSION   filter = context->Filter.Filter;
-    NTSTATUS            status;
-
-    ASSERT(context->Type == VSP_CONTEXT_TYPE_FILTER);
+    ULONG   n, i;
+    PULONG  p, q;
 
-    KeWaitForSingleObject(&filter->Root->PastBootReinit, Executive,
-                          KernelMode, FALSE, NULL);
+    n = (BaseBitmap->SizeOfBitMap + 8*sizeof(ULONG) - 1)/(8*sizeof(ULONG));
+    p = BaseBitmap->Buffer;
+    q = FactorBitmap->Buffer;
 
-    status = VspOpenControlBlockFile(filter);
-    if (!NT_SUCCESS(status)) {
-        VspAcquireNonPagedResource(filter, NULL, FALSE);
-        VspCreateStartBlock(filter, 0, filter->MaximumVolumeSpace);
-        filter->FirstControlBlockVolumeOffset = 0;
-        VspReleaseNonPagedResource(filter);
+    for (i = 0; i < n; i++) {
+        *p++ |= *q++;
     }
-
-    VspFreeContext(filter->Root, context);
-    ObDereferenceObject(filter->TargetObject);
-    ObDereferenceObject(filter->DeviceObject);
 }
 
 NTSTATUS
-VspCheckDiffAreaFileLocation(
-    IN  PFILTER_EXTENSION   Filter,
-    IN  HANDLE              FileHandle,
-    IN  LONGLONG            ApplicationInfoOffset,
-    IN  LONGLONG            FirstDiffAreaBlockOffset,
-    IN  LONGLONG            LocationOffset,
-    IN  LONGLONG            InitialBitmapOffset,
-    IN  BOOLEAN             CheckUnused
+VspQueryFileOffset(
+    IN  PLIST_ENTRY                 ExtentList,
+    IN  LONGLONG                    VolumeOffset,
+    IN  PDIFF_AREA_FILE_ALLOCATION  StartFileAllocation,
+    IN  LONGLONG                    StartFileAllocationFileOffset,
+    OUT PLONGLONG                   ResultFileOffset,
+    OUT PDIFF_AREA_FILE_ALLOCATION* ResultFileAllocation,
+    OUT PLONGLONG                   ResultFileAllocationFileOffset,
+    OUT PLONGLONG                   Length
     )
 
 {
-    NTSTATUS                            status;
-    LIST_ENTRY                          extentList;
-    PLIST_ENTRY                         l;
-    PDIFF_AREA_FILE_ALLOCATION          diffAreaFileAllocation;
-    PVSP_BLOCK_HEADER                   blockHeader;
-    LONGLONG                            volumeOffset, fileOffset;
-    PDIFF_AREA_FILE_ALLOCATION          startFileAllocation, resultFileAllocation;
-    LONGLONG                            startFileAllocationFileOffset;
-    LONGLONG                            resultFileAllocationFileOffset;
-    PVSP_BLOCK_DIFF_AREA_TABLE_ENTRY    diffAreaTableEntry;
-    ULONG                               blockOffset;
-    PVSP_DIFF_AREA_LOCATION_DESCRIPTOR  locationDescriptor;
-    LONGLONG                            length;
+    PLIST_ENTRY                 l, start;
+    LONGLONG                    fileOffset, delta;
+    PDIFF_AREA_FILE_ALLOCATION  diffAreaAllocation;
 
-    if (!FileHandle) {
-        return STATUS_INVALID_PARAMETER;
-    }
+    ASSERT(!IsListEmpty(ExtentList));
 
-    status = VspQueryListOfExtents(FileHandle, 0, &extentList, NULL, FALSE);
-    if (!NT_SUCCESS(status)) {
-        ASSERT(FALSE);
-        return status;
+    if (!StartFileAllocation) {
+        StartFileAllocation = CONTAINING_RECORD(ExtentList->Flink,
+                                                DIFF_AREA_FILE_ALLOCATION,
+                                                ListEntry);
+        StartFileAllocationFileOffset = 0;
     }
 
-    status = VspCheckBlockChainFileOffsets(Filter, ApplicationInfoOffset,
-                                           &extentList);
-    if (!NT_SUCCESS(status)) {
-        goto Finish;
-    }
+    ASSERT(&StartFileAllocation->ListEntry != ExtentList);
 
-    status = VspCheckBlockChainFileOffsets(Filter, FirstDiffAreaBlockOffset,
-                                           &extentList);
-    if (!NT_SUCCESS(status)) {
-        goto Finish;
-    }
+    start = &StartFileAllocation->ListEntry;
+    l = start;
+    fileOffset = StartFileAllocationFileOffset;
 
-    status = VspCheckBlockChainFileOffsets(Filter, LocationOffset,
-                                           &extentList);
-    if (!NT_SUCCESS(status)) {
-        goto Finish;
-    }
+    for (;;) {
 
-    if (InitialBitmapOffset) {
-        status = VspCheckBlockChainFileOffsets(Filter, InitialBitmapOffset,
-                                               &extentList);
-        if (!NT_SUCCESS(status)) {
-            goto Finish;
-        }
-    }
+        diffAreaAllocation = CONTAINING_RECORD(l, DIFF_AREA_FILE_ALLOCATION,
+                                               ListEntry);
 
-    VspAcquireNonPagedResource(Filter, NULL, FALSE);
+        if (diffAreaAllocation->NLength <= 0) {
+            fileOffset -= diffAreaAllocation->NLength;
+        } else {
 
-    if (!Filter->SnapshotOnDiskIrp) {
-        VspReleaseNonPagedResource(Filter);
-        status = STATUS_INVALID_PARAMETER;
-        goto Finish;
-    }
+            if (diffAreaAllocation->Offset <= VolumeOffset &&
+                diffAreaAllocation->Offset + diffAreaAllocation->NLength >
+                VolumeOffset) {
 
-    blockHeader = (PVSP_BLOCK_HEADER) MmGetMdlVirtualAddress(
-                  Filter->SnapshotOnDiskIrp->MdlAddress);
-    volumeOffset = FirstDiffAreaBlockOffset;
-    startFileAllocation = NULL;
-    startFileAllocationFileOffset = 0;
+                delta = VolumeOffset - diffAreaAllocation->Offset;
+                *ResultFileOffset = fileOffset + delta;
+                *ResultFileAllocation = diffAreaAllocation;
+                *ResultFileAllocationFileOffset = fileOffset;
+                if (Length) {
+                    *Length = diffAreaAllocation->NLength - delta;
+                }
 
-    while (volumeOffset) {
+                return STATUS_SUCCESS;
+            }
 
-        status = VspSynchronousIo(Filter->SnapshotOnDiskIrp,
-                                  Filter->TargetObject, IRP_MJ_READ,
-                                  volumeOffset, 0);
-        if (!NT_SUCCESS(status)) {
-            VspReleaseNonPagedResource(Filter);
-            goto Finish;
+            fileOffset += diffAreaAllocation->NLength;
         }
 
-        for (blockOffset = VSP_OFFSET_TO_FIRST_TABLE_ENTRY;
-             blockOffset + sizeof(VSP_BLOCK_DIFF_AREA_TABLE_ENTRY) <=
-             BLOCK_SIZE;
-             blockOffset += sizeof(VSP_BLOCK_DIFF_AREA_TABLE_ENTRY)) {
-
-            diffAreaTableEntry = (PVSP_BLOCK_DIFF_AREA_TABLE_ENTRY)
-                                 ((PCHAR) blockHeader + blockOffset);
-
-            if (!diffAreaTableEntry->DiffAreaVolumeOffset) {
-                continue;
-            }
 
-            status = VspQueryFileOffset(
-                     &extentList, diffAreaTableEntry->DiffAreaVolumeOffset,
-                     startFileAllocation, startFileAllocationFileOffset,
-                     &fileOffset, &resultFileAllocation,
-                     &resultFileAllocationFileOffset, NULL);
-            if (!NT_SUCCESS(status)) {
-                VspReleaseNonPagedResource(Filter);
-                goto Finish;
-            }
+        l = l->Flink;
+        if (l == ExtentList) {
+            fileOffset = 0;
+            l = l->Flink;
+        }
+        if (l == start) {
+            break;
+        }
+    }
 
-            if (fileOffset != diffAreaTableEntry->DiffAreaFileOffset) {
-                status = STATUS_FILE_CORRUPT_ERROR;
-                ASSERT(FALSE);
-                VspReleaseNonPagedResource(Filter);
-                goto Finish;
-            }
+    return STATUS_INVALID_PARAMETER;
+}
+
+NTSTATUS
+VspCheckBlockChainFileOffsets(
+    IN  PFILTER_EXTENSION   Filter,
+    IN  LONGLONG            StartingVolumeOffset,
+    IN  PLIST_ENTRY         ExtentList
+    )
 
-            startFileAllocation = resultFileAllocation;
-            startFileAllocationFileOffset =
-                    resultFileAllocationFileOffset;
-        }
+{
+    PVSP_BLOCK_HEADER           blockHeader;
+    LONGLONG                    volumeOffset, fileOffset;
+    NTSTATUS                    status;
+    PDIFF_AREA_FILE_ALLOCATION  startFileAllocation, resultFileAllocation;
+    LONGLONG                    startFileAllocationFileOffset;
+    LONGLONG                    resultFileAllocationFileOffset;
 
-        volumeOffset = blockHeader->NextVolumeOffset;
+    if (IsListEmpty(ExtentList) || !StartingVolumeOffset) {
+        return STATUS_FILE_CORRUPT_ERROR;
     }
 
-    if (!CheckUnused) {
+    VspAcquireNonPagedResource(Filter, NULL, FALSE);
+
+    if (!Filter->SnapshotOnDiskIrp) {
         VspReleaseNonPagedResource(Filter);
-        goto Finish;
+        return STATUS_INVALID_PARAMETER;
     }
 
     blockHeader = (PVSP_BLOCK_HEADER) MmGetMdlVirtualAddress(
                   Filter->SnapshotOnDiskIrp->MdlAddress);
-    volumeOffset = LocationOffset;
+    volumeOffset = StartingVolumeOffset;
     startFileAllocation = NULL;
     startFileAllocationFileOffset = 0;
 
@@ -5318,51 +5339,59 @@ VspCheckDiffAreaFileLocation(
                                   volumeOffset, 0);
         if (!NT_SUCCESS(status)) {
             VspReleaseNonPagedResource(Filter);
-            goto Finish;
+            return status;
         }
 
-        for (blockOffset = VSP_OFFSET_TO_FIRST_LOCATION_DESCRIPTOR;
-             blockOffset + sizeof(VSP_DIFF_AREA_LOCATION_DESCRIPTOR) <=
-             BLOCK_SIZE;
-             blockOffset += sizeof(VSP_DIFF_AREA_LOCATION_DESCRIPTOR)) {
+        status = VspQueryFileOffset(ExtentList, volumeOffset,
+                                    startFileAllocation,
+                                    startFileAllocationFileOffset,
+                                    &fileOffset, &resultFileAllocation,
+                                    &resultFileAllocationFileOffset, NULL);
+        if (!NT_SUCCESS(status)) {
+            VspReleaseNonPagedResource(Filter);
+            return status;
+        }
 
-            locationDescriptor = (PVSP_DIFF_AREA_LOCATION_DESCRIPTOR)
-                                 ((PCHAR) blockHeader + blockOffset);
+        if (fileOffset != blockHeader->ThisFileOffset) {
+            ASSERT(FALSE);
+            VspReleaseNonPagedResource(Filter);
+            return STATUS_FILE_CORRUPT_ERROR;
+        }
 
-            if (!locationDescriptor->VolumeOffset) {
-                continue;
-            }
+        volumeOffset = blockHeader->NextVolumeOffset;
+        startFileAllocation = resultFileAllocation;
+        startFileAllocationFileOffset = resultFileAllocationFileOffset;
+    }
 
-            status = VspQueryFileOffset(
-                     &extentList, locationDescriptor->VolumeOffset,
-                     startFileAllocation, startFileAllocationFileOffset,
-                     &fileOffset, &resultFileAllocation,
-                     &resultFileAllocationFileOffset, &length);
-            if (!NT_SUCCESS(status)) {
-                VspReleaseNonPagedResource(Filter);
-                goto Finish;
-            }
+    VspReleaseNonPagedResource(Filter);
 
-            if (fileOffset != locationDescriptor->FileOffset ||
-                length < locationDescriptor->Length) {
+    return status;
+}
+
+NTSTATUS
+VspCheckControlBlockFileLocation(
+    IN  PFILTER_EXTENSION   Filter
+    )
 
-                status = STATUS_FILE_CORRUPT_ERROR;
-                ASSERT(FALSE);
-                VspReleaseNonPagedResource(Filter);
-                goto Finish;
-            }
+{
+    HANDLE                      h = Filter->ControlBlockFileHandle;
+    NTSTATUS                    status;
+    LIST_ENTRY                  extentList;
+    PLIST_ENTRY                 l;
+    PDIFF_AREA_FILE_ALLOCATION  diffAreaFileAllocation;
 
-            startFileAllocation = resultFileAllocation;
-            startFileAllocationFileOffset =
-                    resultFileAllocationFileOffset;
-        }
+    if (!h) {
+        return STATUS_INVALID_PARAMETER;
+    }
 
-        volumeOffset = blockHeader->NextVolumeOffset;
+    status = VspQueryListOfExtents(h, 0, &extentList, NULL, FALSE);
+    if (!NT_SUCCESS(status)) {
+        return status;
     }
 
-    VspReleaseNonPagedResource(Filter);
+    status = VspCheckBlockChainFileOffsets(Filter,
+             Filter->FirstControlBlockVolumeOffset, &extentList);
 
-Finish:
     while (!IsListEmpty(&extentList)) {
         l = RemoveHeadList(&extentList);
         diffAreaFileAllocation = CONTAINING_RECORD(l,
@@ -5373,1451 +5402,2343 @@ Finish:
     return status;
 }
 
-NTSTATUS
-VspOpenFilesAndValidateSnapshots(
-    IN  PFILTER_EXTENSION   Filter
+VOID
+VspWaitForVolumesSafeForWriteAccess(
+    IN  PDO_EXTENSION   RootExtension
     )
 
 {
-    NTSTATUS            status;
-    PLIST_ENTRY         l;
-    UNICODE_STRING      fileName;
+    UNICODE_STRING      volumeSafeEventName;
     OBJECT_ATTRIBUTES   oa;
-    HANDLE              h;
-    IO_STATUS_BLOCK     ioStatus;
-    PVOLUME_EXTENSION   extension;
-    PFILTER_EXTENSION   diffAreaFilter;
-    LONGLONG            appInfoOffset, firstDiffAreaBlockOffset, locationOffset, initialBitmapOffset;
-    BOOLEAN             checkUnused;
-    ULONG               i;
-    LARGE_INTEGER       timeout;
     KEVENT              event;
+    LARGE_INTEGER       timeout;
+    ULONG               i;
+    NTSTATUS            status;
+    HANDLE              volumeSafeEvent;
 
-    status = VspOpenControlBlockFile(Filter);
-    if (!NT_SUCCESS(status)) {
-        VspLogError(NULL, Filter, VS_FAILURE_TO_OPEN_CRITICAL_FILE,
-                    status, 1, FALSE);
-        return status;
+    if (RootExtension->IsSetup || RootExtension->VolumesSafeForWriteAccess) {
+        return;
     }
 
-    status = STATUS_SUCCESS;
-    for (;;) {
-
-        VspAcquire(Filter->Root);
-        for (l = Filter->VolumeList.Flink; l != &Filter->VolumeList;
-             l = l->Flink) {
-
-            extension = CONTAINING_RECORD(l, VOLUME_EXTENSION, ListEntry);
-
-            if (extension->DiffAreaFile &&
-                !extension->DiffAreaFile->FileHandle) {
+    RtlInitUnicodeString(&volumeSafeEventName,
+                         L"\\Device\\VolumesSafeForWriteAccess");
+    InitializeObjectAttributes(&oa, &volumeSafeEventName,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL,
+                               NULL);
+    KeInitializeEvent(&event, NotificationEvent, FALSE);
+    timeout.QuadPart = -10*1000*1000;   // 1 second
 
-                break;
-            }
+    for (i = 0; i < 1000; i++) {
+        status = ZwOpenEvent(&volumeSafeEvent, EVENT_ALL_ACCESS, &oa);
+        if (NT_SUCCESS(status)) {
+            break;
+        }
+        KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, &timeout);
+        if (RootExtension->VolumesSafeForWriteAccess) {
+            return;
         }
+    }
+    if (i == 1000) {
+        return;
+    }
 
-        if (l == &Filter->VolumeList) {
-            VspRelease(Filter->Root);
+    for (;;) {
+        status = ZwWaitForSingleObject(volumeSafeEvent, FALSE, &timeout);
+        if (status != STATUS_TIMEOUT) {
+            InterlockedExchange(&RootExtension->VolumesSafeForWriteAccess,
+                                TRUE);
+            break;
+        }
+        if (RootExtension->VolumesSafeForWriteAccess) {
             break;
         }
+    }
 
-        diffAreaFilter = extension->DiffAreaFile->Filter;
-        appInfoOffset = extension->DiffAreaFile->ApplicationInfoTargetOffset;
-        locationOffset =
-            extension->DiffAreaFile->DiffAreaLocationDescriptionTargetOffset;
-        firstDiffAreaBlockOffset =
-                extension->DiffAreaFile->FirstTableTargetOffset;
-        initialBitmapOffset =
-                extension->DiffAreaFile->InitialBitmapVolumeOffset;
-        ObReferenceObject(extension->DeviceObject);
-        ObReferenceObject(diffAreaFilter->DeviceObject);
-        ObReferenceObject(diffAreaFilter->TargetObject);
+    ZwClose(volumeSafeEvent);
+}
+
+NTSTATUS
+VspOpenControlBlockFile(
+    IN  PFILTER_EXTENSION   Filter
+    )
 
-        VspRelease(Filter->Root);
+{
+    PFILTER_EXTENSION       filter = Filter;
+    NTSTATUS                status;
+    UNICODE_STRING          fileName;
+    PWCHAR                  star;
+    OBJECT_ATTRIBUTES       oa;
+    HANDLE                  h;
+    IO_STATUS_BLOCK         ioStatus;
+    PLIST_ENTRY             l;
+    PVSP_LOOKUP_TABLE_ENTRY lookupEntry;
+    GUID                    snapshotGuid;
+    ULONG                   i;
+    LARGE_INTEGER           timeout;
+    KEVENT                  event;
 
-        status = VspCreateDiffAreaFileName(
-                 diffAreaFilter->TargetObject, extension, &fileName, FALSE,
-                 NULL);
+    if (filter->ControlBlockFileHandle) {
+        return STATUS_SUCCESS;
+    }
 
-        if (!NT_SUCCESS(status)) {
-            VspLogError(NULL, Filter, VS_FAILURE_TO_OPEN_CRITICAL_FILE,
-                        status, 2, FALSE);
-            ObDereferenceObject(diffAreaFilter->TargetObject);
-            ObDereferenceObject(diffAreaFilter->DeviceObject);
-            ObDereferenceObject(extension->DeviceObject);
-            break;
-        }
+    VspWaitForVolumesSafeForWriteAccess(filter->Root);
 
-        InitializeObjectAttributes(&oa, &fileName, OBJ_CASE_INSENSITIVE |
-                                   OBJ_KERNEL_HANDLE, NULL, NULL);
+    KeWaitForSingleObject(&filter->ControlBlockFileHandleSemaphore,
+                          Executive, KernelMode, FALSE, NULL);
 
-        KeInitializeEvent(&event, NotificationEvent, FALSE);
-        timeout.QuadPart = -10*1000; // 1 millisecond.
+    if (filter->ControlBlockFileHandle) {
+        KeReleaseSemaphore(&filter->ControlBlockFileHandleSemaphore,
+                           IO_NO_INCREMENT, 1, FALSE);
+        return STATUS_SUCCESS;
+    }
 
-        for (i = 0; i < 5000; i++) {
+    VspAcquireNonPagedResource(filter, NULL, FALSE);
+    VspCreateStartBlock(filter, filter->FirstControlBlockVolumeOffset,
+                        filter->MaximumVolumeSpace);
+    VspReleaseNonPagedResource(filter);
 
-            status = ZwOpenFile(&h, FILE_GENERIC_READ | FILE_GENERIC_WRITE, &oa,
-                                &ioStatus, 0, FILE_WRITE_THROUGH |
-                                FILE_SYNCHRONOUS_IO_NONALERT |
-                                FILE_NON_DIRECTORY_FILE | FILE_DELETE_ON_CLOSE |
-                                FILE_NO_COMPRESSION);
-            if (NT_SUCCESS(status)) {
-                break;
-            }
+    status = VspCreateDiffAreaFileName(filter->TargetObject, NULL,
+                                       &fileName, FALSE, NULL);
+    if (!NT_SUCCESS(status)) {
+        KeReleaseSemaphore(&filter->ControlBlockFileHandleSemaphore,
+                           IO_NO_INCREMENT, 1, FALSE);
+        return status;
+    }
 
-            if (status != STATUS_ACCESS_DENIED &&
-                status != STATUS_INVALID_PARAMETER) {
+    star = fileName.Buffer + fileName.Length/sizeof(WCHAR) - 39;
 
-                break;
-            }
+    RtlMoveMemory(star, star + 1, 38*sizeof(WCHAR));
+    fileName.Length -= sizeof(WCHAR);
+    fileName.Buffer[fileName.Length/sizeof(WCHAR)] = 0;
 
-            KeWaitForSingleObject(&event, Executive, KernelMode, FALSE,
-                                  &timeout);
-        }
+    InitializeObjectAttributes(&oa, &fileName, OBJ_CASE_INSENSITIVE |
+                               OBJ_KERNEL_HANDLE, NULL, NULL);
 
-        ExFreePool(fileName.Buffer);
+    KeInitializeEvent(&event, NotificationEvent, FALSE);
+    timeout.QuadPart = -10*1000; // 1 millisecond.
 
-        if (!NT_SUCCESS(status)) {
-            VspLogError(NULL, Filter, VS_FAILURE_TO_OPEN_CRITICAL_FILE,
-                        status, 3, FALSE);
-            ObDereferenceObject(diffAreaFilter->TargetObject);
-            ObDereferenceObject(diffAreaFilter->DeviceObject);
-            ObDereferenceObject(extension->DeviceObject);
+    for (i = 0; i < 5000; i++) {
+        status = ZwOpenFile(&h, FILE_GENERIC_READ | FILE_GENERIC_WRITE, &oa,
+                            &ioStatus, 0, FILE_WRITE_THROUGH |
+                            FILE_SYNCHRONOUS_IO_NONALERT |
+                            FILE_NON_DIRECTORY_FILE | FILE_DELETE_ON_CLOSE |
+                            FILE_NO_COMPRESSION);
+        if (NT_SUCCESS(status)) {
             break;
         }
 
-        status = VspPinFile(diffAreaFilter->TargetObject, h);
+        // Wait for RAW to DISMOUNT or for the DISMOUNT handle to close.
+
+        if (status != STATUS_INVALID_PARAMETER &&
+            status != STATUS_ACCESS_DENIED) {
 
-        if (!NT_SUCCESS(status)) {
-            VspLogError(NULL, Filter, VS_FAILURE_TO_OPEN_CRITICAL_FILE,
-                        status, 4, FALSE);
-            ZwClose(h);
-            ObDereferenceObject(diffAreaFilter->TargetObject);
-            ObDereferenceObject(diffAreaFilter->DeviceObject);
-            ObDereferenceObject(extension->DeviceObject);
             break;
         }
 
-        if (extension->ListEntry.Flink == &Filter->VolumeList) {
-            checkUnused = TRUE;
-        } else {
-            checkUnused = FALSE;
-        }
+        KeWaitForSingleObject(&event, Executive, KernelMode, FALSE,
+                              &timeout);
+    }
+    ExFreePool(fileName.Buffer);
+    if (!NT_SUCCESS(status)) {
+        KeReleaseSemaphore(&filter->ControlBlockFileHandleSemaphore,
+                           IO_NO_INCREMENT, 1, FALSE);
+        return status;
+    }
 
-        status = VspCheckDiffAreaFileLocation(diffAreaFilter, h,
-                                              appInfoOffset,
-                                              firstDiffAreaBlockOffset,
-                                              locationOffset,
-                                              initialBitmapOffset,
-                                              checkUnused);
-        if (!NT_SUCCESS(status)) {
-            VspLogError(NULL, Filter, VS_FAILURE_TO_OPEN_CRITICAL_FILE,
-                        status, 5, FALSE);
+    ASSERT(!filter->ControlBlockFileHandle);
+    InterlockedExchangePointer(&filter->ControlBlockFileHandle, h);
+
+    VspAcquire(filter->Root);
+    if (filter->IsRemoved) {
+        VspRelease(filter->Root);
+        h = InterlockedExchangePointer(&filter->ControlBlockFileHandle,
+                                       NULL);
+        if (h) {
             ZwClose(h);
-            ObDereferenceObject(diffAreaFilter->TargetObject);
-            ObDereferenceObject(diffAreaFilter->DeviceObject);
-            ObDereferenceObject(extension->DeviceObject);
-            break;
         }
+        KeReleaseSemaphore(&filter->ControlBlockFileHandleSemaphore,
+                           IO_NO_INCREMENT, 1, FALSE);
+        return STATUS_UNSUCCESSFUL;
+    }
+    VspRelease(filter->Root);
 
-        VspAcquire(Filter->Root);
-        if (extension->IsDead || !extension->DiffAreaFile) {
-            VspRelease(Filter->Root);
+    status = VspPinFile(filter->TargetObject, h);
+    if (!NT_SUCCESS(status)) {
+        h = InterlockedExchangePointer(&filter->ControlBlockFileHandle,
+                                       NULL);
+        if (h) {
             ZwClose(h);
-            ObDereferenceObject(diffAreaFilter->TargetObject);
-            ObDereferenceObject(diffAreaFilter->DeviceObject);
-            ObDereferenceObject(extension->DeviceObject);
-            continue;
         }
+        KeReleaseSemaphore(&filter->ControlBlockFileHandleSemaphore,
+                           IO_NO_INCREMENT, 1, FALSE);
+        return status;
+    }
 
-        ASSERT(!extension->DiffAreaFile->FileHandle);
-        extension->DiffAreaFile->FileHandle = h;
-        VspRelease(Filter->Root);
-
-        ObDereferenceObject(diffAreaFilter->TargetObject);
-        ObDereferenceObject(diffAreaFilter->DeviceObject);
-        ObDereferenceObject(extension->DeviceObject);
+    status = VspCheckControlBlockFileLocation(filter);
+    if (!NT_SUCCESS(status)) {
+        h = InterlockedExchangePointer(&filter->ControlBlockFileHandle,
+                                       NULL);
+        if (h) {
+            ZwClose(h);
+        }
+        KeReleaseSemaphore(&filter->ControlBlockFileHandleSemaphore,
+                           IO_NO_INCREMENT, 1, FALSE);
+        return status;
     }
 
-    return status;
-}
-
-VOID
-VspCallDriver(
-    IN  PVOID   Context
-    )
-
-{
-    PVSP_CONTEXT    context = (PVSP_CONTEXT) Context;
-
-    ASSERT(context->Type == VSP_CONTEXT_TYPE_COPY_EXTENTS);
+    VspAcquireNonPagedResource(filter, NULL, FALSE);
+    if (!filter->FirstControlBlockVolumeOffset) {
+        h = InterlockedExchangePointer(&filter->ControlBlockFileHandle,
+                                       NULL);
+        VspReleaseNonPagedResource(filter);
+        if (h) {
+            ZwClose(h);
+        }
+        KeReleaseSemaphore(&filter->ControlBlockFileHandleSemaphore,
+                           IO_NO_INCREMENT, 1, FALSE);
+        return STATUS_UNSUCCESSFUL;
+    }
+    VspReleaseNonPagedResource(filter);
 
-    IoCallDriver(context->CopyExtents.Extension->Filter->DeviceObject,
-                 context->CopyExtents.Irp);
-}
-
-DECLSPEC_NOINLINE
-VOID
-VspClearDirtyCrashdumpFlag(
-    IN  PVSP_CONTROL_ITEM_SNAPSHOT  SnapshotControlItem
-    )
+    KeReleaseSemaphore(&filter->ControlBlockFileHandleSemaphore,
+                       IO_NO_INCREMENT, 1, FALSE);
 
-{
-    SnapshotControlItem->SnapshotControlItemFlags &=
-            ~VSP_SNAPSHOT_CONTROL_ITEM_FLAG_DIRTY_CRASHDUMP;
+    return STATUS_SUCCESS;
 }
-
 VOID
-VspMarkCrashdumpClean(
+VspOpenControlBlockFileWorker(
     IN  PVOID   Context
     )
 
 {
-    PVSP_CONTEXT                context = (PVSP_CONTEXT) Context;
-    PVOLUME_EXTENSION           extension = context->CopyExtents.Extension;
-    PFILTER_EXTENSION           filter = extension->Filter;
-    BOOLEAN                     hiberfile = context->CopyExtents.HiberfileIncluded;
-    BOOLEAN                     pagefile = context->CopyExtents.PagefileIncluded;
-    UCHAR                       controlItemBuffer[VSP_BYTES_PER_CONTROL_ITEM];
-    PVSP_CONTROL_ITEM_SNAPSHOT  snapshotControlItem;
-    NTSTATUS                    status;
-    LONG                        hibernate;
+    PVSP_CONTEXT        context = (PVSP_CONTEXT) Context;
+    PFILTER_EXTENSION   filter = context->Filter.Filter;
+    NTSTATUS            status;
 
-    ASSERT(context->Type == VSP_CONTEXT_TYPE_COPY_EXTENTS);
+    ASSERT(context->Type == VSP_CONTEXT_TYPE_FILTER);
 
-    VspFreeContext(filter->Root, context);
+    KeWaitForSingleObject(&filter->Root->PastBootReinit, Executive,
+                          KernelMode, FALSE, NULL);
 
-    VspAcquire(filter->Root);
-    if (IsListEmpty(&filter->VolumeList)) {
-        VspRelease(filter->Root);
-        if (hiberfile) {
-            InterlockedExchange(&filter->HibernatePending, FALSE);
-        }
-        ObDereferenceObject(filter->DeviceObject);
-        ObDereferenceObject(extension->DeviceObject);
-        return;
+    status = VspOpenControlBlockFile(filter);
+    if (!NT_SUCCESS(status)) {
+        VspAcquireNonPagedResource(filter, NULL, FALSE);
+        VspCreateStartBlock(filter, 0, filter->MaximumVolumeSpace);
+        filter->FirstControlBlockVolumeOffset = 0;
+        VspReleaseNonPagedResource(filter);
     }
 
-    if (!extension->IsPersistent) {
-        VspRelease(filter->Root);
-        ASSERT(!pagefile);
-        if (hiberfile) {
-            InterlockedExchange(&extension->HiberFileCopied, TRUE);
-            hibernate = InterlockedExchange(&filter->HibernatePending, FALSE);
-            if (hibernate) {
-                IoRaiseInformationalHardError(STATUS_VOLSNAP_HIBERNATE_READY,
-                                              NULL, NULL);
-            }
-        }
-        ObDereferenceObject(filter->DeviceObject);
-        ObDereferenceObject(extension->DeviceObject);
-        return;
-    }
+    VspFreeContext(filter->Root, context);
+    ObDereferenceObject(filter->TargetObject);
+    ObDereferenceObject(filter->DeviceObject);
+}
+
+NTSTATUS
+VspCheckDiffAreaFileLocation(
+    IN  PFILTER_EXTENSION   Filter,
+    IN  HANDLE              FileHandle,
+    IN  LONGLONG            ApplicationInfoOffset,
+    IN  LONGLONG            FirstDiffAreaBlockOffset,
+    IN  LONGLONG            LocationOffset,
+    IN  LONGLONG            InitialBitmapOffset,
+    IN  BOOLEAN             CheckUnused
+    )
 
-    VspAcquireNonPagedResource(filter, NULL, FALSE);
+{
+    NTSTATUS                            status;
+    LIST_ENTRY                          extentList;
+    PLIST_ENTRY                         l;
+    PDIFF_AREA_FILE_ALLOCATION          diffAreaFileAllocation;
+    PVSP_BLOCK_HEADER                   blockHeader;
+    LONGLONG                            volumeOffset, fileOffset;
+    PDIFF_AREA_FILE_ALLOCATION          startFileAllocation, resultFileAllocation;
+    LONGLONG                            startFileAllocationFileOffset;
+    LONGLONG                            resultFileAllocationFileOffset;
+    PVSP_BLOCK_DIFF_AREA_TABLE_ENTRY    diffAreaTableEntry;
+    ULONG                               blockOffset;
+    PVSP_DIFF_AREA_LOCATION_DESCRIPTOR  locationDescriptor;
+    LONGLONG                            length;
 
-    status = VspIoControlItem(filter, VSP_CONTROL_ITEM_TYPE_SNAPSHOT,
-                              &extension->SnapshotGuid, FALSE,
-                              controlItemBuffer, FALSE);
-    if (!NT_SUCCESS(status)) {
-        if (!filter->DestroyAllSnapshotsPending) {
-            VspLogError(extension, filter, VS_ABORT_SNAPSHOTS_IO_FAILURE,
-                        status, 14, FALSE);
-        }
-        VspReleaseNonPagedResource(filter);
-        VspRelease(filter->Root);
-        VspDestroyAllSnapshots(filter, NULL, FALSE, FALSE);
-        if (hiberfile) {
-            InterlockedExchange(&filter->HibernatePending, FALSE);
-        }
-        ObDereferenceObject(filter->DeviceObject);
-        ObDereferenceObject(extension->DeviceObject);
-        return;
+    if (!FileHandle) {
+        return STATUS_INVALID_PARAMETER;
     }
 
-    snapshotControlItem = (PVSP_CONTROL_ITEM_SNAPSHOT) controlItemBuffer;
-    if (hiberfile) {
-        snapshotControlItem->SnapshotControlItemFlags |=
-                VSP_SNAPSHOT_CONTROL_ITEM_FLAG_HIBERFIL_COPIED;
-        InterlockedExchange(&extension->HiberFileCopied, TRUE);
+    status = VspQueryListOfExtents(FileHandle, 0, &extentList, NULL, FALSE);
+    if (!NT_SUCCESS(status)) {
+        ASSERT(FALSE);
+        return status;
     }
 
-    if (pagefile) {
-        VspClearDirtyCrashdumpFlag(snapshotControlItem);
-        snapshotControlItem->SnapshotControlItemFlags |=
-                VSP_SNAPSHOT_CONTROL_ITEM_FLAG_PAGEFILE_COPIED;
-        InterlockedExchange(&extension->PageFileCopied, TRUE);
+    status = VspCheckBlockChainFileOffsets(Filter, ApplicationInfoOffset,
+                                           &extentList);
+    if (!NT_SUCCESS(status)) {
+        goto Finish;
     }
 
-    status = VspIoControlItem(filter, VSP_CONTROL_ITEM_TYPE_SNAPSHOT,
-                              &extension->SnapshotGuid, TRUE,
-                              controlItemBuffer, FALSE);
+    status = VspCheckBlockChainFileOffsets(Filter, FirstDiffAreaBlockOffset,
+                                           &extentList);
     if (!NT_SUCCESS(status)) {
-        if (!filter->DestroyAllSnapshotsPending) {
-            VspLogError(extension, filter, VS_ABORT_SNAPSHOTS_IO_FAILURE,
-                        status, 15, FALSE);
-        }
-        VspReleaseNonPagedResource(filter);
-        VspRelease(filter->Root);
-        VspDestroyAllSnapshots(filter, NULL, FALSE, FALSE);
-        if (hiberfile) {
-            InterlockedExchange(&filter->HibernatePending, FALSE);
-        }
-        ObDereferenceObject(filter->DeviceObject);
-        ObDereferenceObject(extension->DeviceObject);
-        return;
+        goto Finish;
     }
 
-    VspReleaseNonPagedResource(filter);
-
-    VspRelease(filter->Root);
-
-    if (hiberfile) {
-        hibernate = InterlockedExchange(&filter->HibernatePending, FALSE);
+    status = VspCheckBlockChainFileOffsets(Filter, LocationOffset,
+                                           &extentList);
+    if (!NT_SUCCESS(status)) {
+        goto Finish;
+    }
 
-        if (hibernate) {
-            IoRaiseInformationalHardError(STATUS_VOLSNAP_HIBERNATE_READY, NULL,
-                                          NULL);
+    if (InitialBitmapOffset) {
+        status = VspCheckBlockChainFileOffsets(Filter, InitialBitmapOffset,
+                                               &extentList);
+        if (!NT_SUCCESS(status)) {
+            goto Finish;
         }
     }
 
-    ObDereferenceObject(filter->DeviceObject);
-    ObDereferenceObject(extension->DeviceObject);
-}
-
-NTSTATUS
-VspCopyExtentsCompletionRoutine(
-    IN  PDEVICE_OBJECT  DeviceObject,
-    IN  PIRP            Irp,
-    IN  PVOID           Context
-    )
+    VspAcquireNonPagedResource(Filter, NULL, FALSE);
 
-{
-    PVSP_CONTEXT                context = (PVSP_CONTEXT) Context;
-    PVOLUME_EXTENSION           extension = context->CopyExtents.Extension;
-    PFILTER_EXTENSION           filter = extension->Filter;
-    PIO_STACK_LOCATION          nextSp;
-    PDIFF_AREA_FILE_ALLOCATION  fileExtent;
-    LONGLONG                    offset;
-    ULONG                       length;
+    if (!Filter->SnapshotOnDiskIrp) {
+        VspReleaseNonPagedResource(Filter);
+        status = STATUS_INVALID_PARAMETER;
+        goto Finish;
+    }
 
-    ASSERT(context->Type == VSP_CONTEXT_TYPE_COPY_EXTENTS);
-    ASSERT(!IsListEmpty(&context->CopyExtents.ExtentList));
+    blockHeader = (PVSP_BLOCK_HEADER) MmGetMdlVirtualAddress(
+                  Filter->SnapshotOnDiskIrp->MdlAddress);
+    volumeOffset = FirstDiffAreaBlockOffset;
+    startFileAllocation = NULL;
+    startFileAllocationFileOffset = 0;
 
-    fileExtent = CONTAINING_RECORD(context->CopyExtents.ExtentList.Flink,
-                                   DIFF_AREA_FILE_ALLOCATION, ListEntry);
-    ASSERT(fileExtent->NLength >= 0);
+    while (volumeOffset) {
 
-    if (!fileExtent->NLength) {
-        RemoveEntryList(&fileExtent->ListEntry);
-        ExFreePool(fileExtent);
-        if (IsListEmpty(&context->CopyExtents.ExtentList)) {
-            ExInitializeWorkItem(&context->WorkItem, VspMarkCrashdumpClean,
-                                 context);
-            ExQueueWorkItem(&context->WorkItem, DelayedWorkQueue);
-            IoFreeIrp(Irp);
-            return STATUS_MORE_PROCESSING_REQUIRED;
+        status = VspSynchronousIo(Filter->SnapshotOnDiskIrp,
+                                  Filter->TargetObject, IRP_MJ_READ,
+                                  volumeOffset, 0);
+        if (!NT_SUCCESS(status)) {
+            VspReleaseNonPagedResource(Filter);
+            goto Finish;
         }
-        fileExtent = CONTAINING_RECORD(context->CopyExtents.ExtentList.Flink,
-                                       DIFF_AREA_FILE_ALLOCATION, ListEntry);
-        ASSERT(fileExtent->NLength > 0);
-    }
 
-    length = 0x80000;   // 512 KB
-    offset = fileExtent->Offset;
+        for (blockOffset = VSP_OFFSET_TO_FIRST_TABLE_ENTRY;
+             blockOffset + sizeof(VSP_BLOCK_DIFF_AREA_TABLE_ENTRY) <=
+             BLOCK_SIZE;
+             blockOffset += sizeof(VSP_BLOCK_DIFF_AREA_TABLE_ENTRY)) {
 
-    if (length > fileExtent->NLength) {
-        length = (ULONG) fileExtent->NLength;
-    }
+            diffAreaTableEntry = (PVSP_BLOCK_DIFF_AREA_TABLE_ENTRY)
+                                 ((PCHAR) blockHeader + blockOffset);
 
-    fileExtent->Offset += length;
+            if (!diffAreaTableEntry->DiffAreaVolumeOffset) {
+                continue;
+            }
+
+            status = VspQueryFileOffset(
+                     &extentList, diffAreaTableEntry->DiffAreaVolumeOffset,
+                     startFileAllocation, startFileAllocationFileOffset,
+                     &fileOffset, &resultFileAllocation,
+                     &resultFileAllocationFileOffset, NULL);
+            if (!NT_SUCCESS(status)) {
+                VspReleaseNonPagedResource(Filter);
+                goto Finish;
+            }
+
+            if (fileOffset != diffAreaTableEntry->DiffAreaFileOffset) {
+                status = STATUS_FILE_CORRUPT_ERROR;
+                ASSERT(FALSE);
+                VspReleaseNonPagedResource(Filter);
+                goto Finish;
+            }
+
+            startFileAllocation = resultFileAllocation;
+            startFileAllocationFileOffset =
+                    resultFileAllocationFileOffset;
+        }
+
+        volumeOffset = blockHeader->NextVolumeOffset;
+    }
+
+    if (!CheckUnused) {
+        VspReleaseNonPagedResource(Filter);
+        goto Finish;
+    }
+
+    blockHeader = (PVSP_BLOCK_HEADER) MmGetMdlVirtualAddress(
+                  Filter->SnapshotOnDiskIrp->MdlAddress);
+    volumeOffset = LocationOffset;
+    startFileAllocation = NULL;
+    startFileAllocationFileOffset = 0;
+
+    while (volumeOffset) {
+
+        status = VspSynchronousIo(Filter->SnapshotOnDiskIrp,
+                                  Filter->TargetObject, IRP_MJ_READ,
+                                  volumeOffset, 0);
+        if (!NT_SUCCESS(status)) {
+            VspReleaseNonPagedResource(Filter);
+            goto Finish;
+        }
+
+        for (blockOffset = VSP_OFFSET_TO_FIRST_LOCATION_DESCRIPTOR;
+             blockOffset + sizeof(VSP_DIFF_AREA_LOCATION_DESCRIPTOR) <=
+             BLOCK_SIZE;
+             blockOffset += sizeof(VSP_DIFF_AREA_LOCATION_DESCRIPTOR)) {
+
+            locationDescriptor = (PVSP_DIFF_AREA_LOCATION_DESCRIPTOR)
+                                 ((PCHAR) blockHeader + blockOffset);
+
+            if (!locationDescriptor->VolumeOffset) {
+                continue;
+            }
+
+            status = VspQueryFileOffset(
+                     &extentList, locationDescriptor->VolumeOffset,
+                     startFileAllocation, startFileAllocationFileOffset,
+                     &fileOffset, &resultFileAllocation,
+                     &resultFileAllocationFileOffset, &length);
+            if (!NT_SUCCESS(status)) {
+                VspReleaseNonPagedResource(Filter);
+                goto Finish;
+            }
+
+            if (fileOffset != locationDescriptor->FileOffset ||
+                length < locationDescriptor->Length) {
+
+                status = STATUS_FILE_CORRUPT_ERROR;
+                ASSERT(FALSE);
+                VspReleaseNonPagedResource(Filter);
+                goto Finish;
+            }
+
+            startFileAllocation = resultFileAllocation;
+            startFileAllocationFileOffset =
+                    resultFileAllocationFileOffset;
+        }
+
+        volumeOffset = blockHeader->NextVolumeOffset;
+    }
+
+    VspReleaseNonPagedResource(Filter);
+
+Finish:
+    while (!IsListEmpty(&extentList)) {
+        l = RemoveHeadList(&extentList);
+        diffAreaFileAllocation = CONTAINING_RECORD(l,
+                                 DIFF_AREA_FILE_ALLOCATION, ListEntry);
+        ExFreePool(diffAreaFileAllocation);
+    }
+
+    return status;
+}
+
+NTSTATUS
+VspOpenFilesAndValidateSnapshots(
+    IN  PFILTER_EXTENSION   Filter
+    )
+
+{
+    NTSTATUS            status;
+    PLIST_ENTRY         l;
+    UNICODE_STRING      fileName;
+    OBJECT_ATTRIBUTES   oa;
+    HANDLE              h;
+    IO_STATUS_BLOCK     ioStatus;
+    PVOLUME_EXTENSION   extension;
+    PFILTER_EXTENSION   diffAreaFilter;
+    LONGLONG            appInfoOffset, firstDiffAreaBlockOffset, locationOffset, initialBitmapOffset;
+    BOOLEAN             checkUnused;
+    ULONG               i;
+    LARGE_INTEGER       timeout;
+    KEVENT              event;
+
+    status = VspOpenControlBlockFile(Filter);
+    if (!NT_SUCCESS(status)) {
+        VspLogError(NULL, Filter, VS_FAILURE_TO_OPEN_CRITICAL_FILE,
+                    status, 1, FALSE);
+        return status;
+    }
+
+    status = STATUS_SUCCESS;
+    for (;;) {
+
+        VspAcquire(Filter->Root);
+        for (l = Filter->VolumeList.Flink; l != &Filter->VolumeList;
+             l = l->Flink) {
+
+            extension = CONTAINING_RECORD(l, VOLUME_EXTENSION, ListEntry);
+
+            if (extension->DiffAreaFile &&
+                !extension->DiffAreaFile->FileHandle) {
+
+                break;
+            }
+        }
+
+        if (l == &Filter->VolumeList) {
+            VspRelease(Filter->Root);
+            break;
+        }
+
+        diffAreaFilter = extension->DiffAreaFile->Filter;
+        appInfoOffset = extension->DiffAreaFile->ApplicationInfoTargetOffset;
+        locationOffset =
+            extension->DiffAreaFile->DiffAreaLocationDescriptionTargetOffset;
+        firstDiffAreaBlockOffset =
+                extension->DiffAreaFile->FirstTableTargetOffset;
+        initialBitmapOffset =
+                extension->DiffAreaFile->InitialBitmapVolumeOffset;
+        ObReferenceObject(extension->DeviceObject);
+        ObReferenceObject(diffAreaFilter->DeviceObject);
+        ObReferenceObject(diffAreaFilter->TargetObject);
+
+        VspRelease(Filter->Root);
+
+        status = VspCreateDiffAreaFileName(
+                 diffAreaFilter->TargetObject, extension, &fileName, FALSE,
+                 NULL);
+
+        if (!NT_SUCCESS(status)) {
+            VspLogError(NULL, Filter, VS_FAILURE_TO_OPEN_CRITICAL_FILE,
+                        status, 2, FALSE);
+            ObDereferenceObject(diffAreaFilter->TargetObject);
+            ObDereferenceObject(diffAreaFilter->DeviceObject);
+            ObDereferenceObject(extension->DeviceObject);
+            break;
+        }
+
+        InitializeObjectAttributes(&oa, &fileName, OBJ_CASE_INSENSITIVE |
+                                   OBJ_KERNEL_HANDLE, NULL, NULL);
+
+        KeInitializeEvent(&event, NotificationEvent, FALSE);
+        timeout.QuadPart = -10*1000; // 1 millisecond.
+
+        for (i = 0; i < 5000; i++) {
+
+            status = ZwOpenFile(&h, FILE_GENERIC_READ | FILE_GENERIC_WRITE, &oa,
+                                &ioStatus, 0, FILE_WRITE_THROUGH |
+                                FILE_SYNCHRONOUS_IO_NONALERT |
+                                FILE_NON_DIRECTORY_FILE | FILE_DELETE_ON_CLOSE |
+                                FILE_NO_COMPRESSION);
+            if (NT_SUCCESS(status)) {
+                break;
+            }
+
+            if (status != STATUS_ACCESS_DENIED &&
+                status != STATUS_INVALID_PARAMETER) {
+
+                break;
+            }
+
+            KeWaitForSingleObject(&event, Executive, KernelMode, FALSE,
+                                  &timeout);
+        }
+
+        ExFreePool(fileName.Buffer);
+
+        if (!NT_SUCCESS(status)) {
+            VspLogError(NULL, Filter, VS_FAILURE_TO_OPEN_CRITICAL_FILE,
+                        status, 3, FALSE);
+            ObDereferenceObject(diffAreaFilter->TargetObject);
+            ObDereferenceObject(diffAreaFilter->DeviceObject);
+            ObDereferenceObject(extension->DeviceObject);
+            break;
+        }
+
+        status = VspPinFile(diffAreaFilter->TargetObject, h);
+
+        if (!NT_SUCCESS(status)) {
+            VspLogError(NULL, Filter, VS_FAILURE_TO_OPEN_CRITICAL_FILE,
+                        status, 4, FALSE);
+            ZwClose(h);
+            ObDereferenceObject(diffAreaFilter->TargetObject);
+            ObDereferenceObject(diffAreaFilter->DeviceObject);
+            ObDereferenceObject(extension->DeviceObject);
+            break;
+        }
+
+        if (extension->ListEntry.Flink == &Filter->VolumeList) {
+            checkUnused = TRUE;
+        } else {
+            checkUnused = FALSE;
+        }
+
+        status = VspCheckDiffAreaFileLocation(diffAreaFilter, h,
+                                              appInfoOffset,
+                                              firstDiffAreaBlockOffset,
+                                              locationOffset,
+                                              initialBitmapOffset,
+                                              checkUnused);
+        if (!NT_SUCCESS(status)) {
+            VspLogError(NULL, Filter, VS_FAILURE_TO_OPEN_CRITICAL_FILE,
+                        status, 5, FALSE);
+            ZwClose(h);
+            ObDereferenceObject(diffAreaFilter->TargetObject);
+            ObDereferenceObject(diffAreaFilter->DeviceObject);
+            ObDereferenceObject(extension->DeviceObject);
+            break;
+        }
+
+        VspAcquire(Filter->Root);
+        if (extension->IsDead || !extension->DiffAreaFile) {
+            VspRelease(Filter->Root);
+            ZwClose(h);
+            ObDereferenceObject(diffAreaFilter->TargetObject);
+            ObDereferenceObject(diffAreaFilter->DeviceObject);
+            ObDereferenceObject(extension->DeviceObject);
+            continue;
+        }
+
+        ASSERT(!extension->DiffAreaFile->FileHandle);
+        extension->DiffAreaFile->FileHandle = h;
+        VspRelease(Filter->Root);
+
+        ObDereferenceObject(diffAreaFilter->TargetObject);
+        ObDereferenceObject(diffAreaFilter->DeviceObject);
+        ObDereferenceObject(extension->DeviceObject);
+    }
+
+    return status;
+}
+
+VOID
+VspCallDriver(
+    IN  PVOID   Context
+    )
+
+{
+    PVSP_CONTEXT    context = (PVSP_CONTEXT) Context;
+
+    ASSERT(context->Type == VSP_CONTEXT_TYPE_COPY_EXTENTS);
+
+    IoCallDriver(context->CopyExtents.Extension->Filter->DeviceObject,
+                 context->CopyExtents.Irp);
+}
+
+DECLSPEC_NOINLINE
+VOID
+VspClearDirtyCrashdumpFlag(
+    IN  PVSP_CONTROL_ITEM_SNAPSHOT  SnapshotControlItem
+    )
+
+{
+    SnapshotControlItem->SnapshotControlItemFlags &=
+            ~VSP_SNAPSHOT_CONTROL_ITEM_FLAG_DIRTY_CRASHDUMP;
+}
+
+VOID
+VspMarkCrashdumpClean(
+    IN  PVOID   Context
+    )
+
+{
+    PVSP_CONTEXT                context = (PVSP_CONTEXT) Context;
+    PVOLUME_EXTENSION           extension = context->CopyExtents.Extension;
+    PFILTER_EXTENSION           filter = extension->Filter;
+    BOOLEAN                     hiberfile = context->CopyExtents.HiberfileIncluded;
+    BOOLEAN                     pagefile = context->CopyExtents.PagefileIncluded;
+    UCHAR                       controlItemBuffer[VSP_BYTES_PER_CONTROL_ITEM];
+    PVSP_CONTROL_ITEM_SNAPSHOT  snapshotControlItem;
+    NTSTATUS                    status;
+    LONG                        hibernate;
+
+    ASSERT(context->Type == VSP_CONTEXT_TYPE_COPY_EXTENTS);
+
+    VspFreeContext(filter->Root, context);
+
+    VspAcquire(filter->Root);
+    if (IsListEmpty(&filter->VolumeList)) {
+        VspRelease(filter->Root);
+        if (hiberfile) {
+            InterlockedExchange(&filter->HibernatePending, FALSE);
+        }
+        ObDereferenceObject(filter->DeviceObject);
+        ObDereferenceObject(extension->DeviceObject);
+        return;
+    }
+
+    if (!extension->IsPersistent) {
+        VspRelease(filter->Root);
+        ASSERT(!pagefile);
+        if (hiberfile) {
+            InterlockedExchange(&extension->HiberFileCopied, TRUE);
+            hibernate = InterlockedExchange(&filter->HibernatePending, FALSE);
+            if (hibernate) {
+                IoRaiseInformationalHardError(STATUS_VOLSNAP_HIBERNATE_READY,
+                                              NULL, NULL);
+            }
+        }
+        ObDereferenceObject(filter->DeviceObject);
+        ObDereferenceObject(extension->DeviceObject);
+        return;
+    }
+
+    VspAcquireNonPagedResource(filter, NULL, FALSE);
+
+    status = VspIoControlItem(filter, VSP_CONTROL_ITEM_TYPE_SNAPSHOT,
+                              &extension->SnapshotGuid, FALSE,
+                              controlItemBuffer, FALSE);
+    if (!NT_SUCCESS(status)) {
+        if (!filter->DestroyAllSnapshotsPending) {
+            VspLogError(extension, filter, VS_ABORT_SNAPSHOTS_IO_FAILURE,
+                        status, 14, FALSE);
+        }
+        VspReleaseNonPagedResource(filter);
+        VspRelease(filter->Root);
+        VspDestroyAllSnapshots(filter, NULL, FALSE, FALSE);
+        if (hiberfile) {
+            InterlockedExchange(&filter->HibernatePending, FALSE);
+        }
+        ObDereferenceObject(filter->DeviceObject);
+        ObDereferenceObject(extension->DeviceObject);
+        return;
+    }
+
+    snapshotControlItem = (PVSP_CONTROL_ITEM_SNAPSHOT) controlItemBuffer;
+    if (hiberfile) {
+        snapshotControlItem->SnapshotControlItemFlags |=
+                VSP_SNAPSHOT_CONTROL_ITEM_FLAG_HIBERFIL_COPIED;
+        InterlockedExchange(&extension->HiberFileCopied, TRUE);
+    }
+
+    if (pagefile) {
+        VspClearDirtyCrashdumpFlag(snapshotControlItem);
+        snapshotControlItem->SnapshotControlItemFlags |=
+                VSP_SNAPSHOT_CONTROL_ITEM_FLAG_PAGEFILE_COPIED;
+        InterlockedExchange(&extension->PageFileCopied, TRUE);
+    }
+
+    status = VspIoControlItem(filter, VSP_CONTROL_ITEM_TYPE_SNAPSHOT,
+                              &extension->SnapshotGuid, TRUE,
+                              controlItemBuffer, FALSE);
+    if (!NT_SUCCESS(status)) {
+        if (!filter->DestroyAllSnapshotsPending) {
+            VspLogError(extension, filter, VS_ABORT_SNAPSHOTS_IO_FAILURE,
+                        status, 15, FALSE);
+        }
+        VspReleaseNonPagedResource(filter);
+        VspRelease(filter->Root);
+        VspDestroyAllSnapshots(filter, NULL, FALSE, FALSE);
+        if (hiberfile) {
+            InterlockedExchange(&filter->HibernatePending, FALSE);
+        }
+        ObDereferenceObject(filter->DeviceObject);
+        ObDereferenceObject(extension->DeviceObject);
+        return;
+    }
+
+    VspReleaseNonPagedResource(filter);
+
+    VspRelease(filter->Root);
+
+    if (hiberfile) {
+        hibernate = InterlockedExchange(&filter->HibernatePending, FALSE);
+
+        if (hibernate) {
+            IoRaiseInformationalHardError(STATUS_VOLSNAP_HIBERNATE_READY, NULL,
+                                          NULL);
+        }
+    }
+
+    ObDereferenceObject(filter->DeviceObject);
+    ObDereferenceObject(extension->DeviceObject);
+}
+
+NTSTATUS
+VspCopyExtentsCompletionRoutine(
+    IN  PDEVICE_OBJECT  DeviceObject,
+    IN  PIRP            Irp,
+    IN  PVOID           Context
+    )
+
+{
+    PVSP_CONTEXT                context = (PVSP_CONTEXT) Context;
+    PVOLUME_EXTENSION           extension = context->CopyExtents.Extension;
+    PFILTER_EXTENSION           filter = extension->Filter;
+    PIO_STACK_LOCATION          nextSp;
+    PDIFF_AREA_FILE_ALLOCATION  fileExtent;
+    LONGLONG                    offset;
+    ULONG                       length;
+
+    ASSERT(context->Type == VSP_CONTEXT_TYPE_COPY_EXTENTS);
+    ASSERT(!IsListEmpty(&context->CopyExtents.ExtentList));
+
+    fileExtent = CONTAINING_RECORD(context->CopyExtents.ExtentList.Flink,
+                                   DIFF_AREA_FILE_ALLOCATION, ListEntry);
+    ASSERT(fileExtent->NLength >= 0);
+
+    if (!fileExtent->NLength) {
+        RemoveEntryList(&fileExtent->ListEntry);
+        ExFreePool(fileExtent);
+        if (IsListEmpty(&context->CopyExtents.ExtentList)) {
+            ExInitializeWorkItem(&context->WorkItem, VspMarkCrashdumpClean,
+                                 context);
+            ExQueueWorkItem(&context->WorkItem, DelayedWorkQueue);
+            IoFreeIrp(Irp);
+            return STATUS_MORE_PROCESSING_REQUIRED;
+        }
+        fileExtent = CONTAINING_RECORD(context->CopyExtents.ExtentList.Flink,
+                                       DIFF_AREA_FILE_ALLOCATION, ListEntry);
+        ASSERT(fileExtent->NLength > 0);
+    }
+
+    length = 0x80000;   // 512 KB
+    offset = fileExtent->Offset;
+
+    if (length > fileExtent->NLength) {
+        length = (ULONG) fileExtent->NLength;
+    }
+
+    fileExtent->Offset += length;
     fileExtent->NLength -= length;
 
-    Irp->Tail.Overlay.Thread = PsGetCurrentThread();
-    nextSp = IoGetNextIrpStackLocation(Irp);
-    nextSp->Parameters.Write.ByteOffset.QuadPart = offset;
-    nextSp->Parameters.Write.Length = length;
-    nextSp->MajorFunction = IRP_MJ_WRITE;
-    nextSp->DeviceObject = filter->DeviceObject;
-    nextSp->Flags = SL_OVERRIDE_VERIFY_VOLUME;
+    Irp->Tail.Overlay.Thread = PsGetCurrentThread();
+    nextSp = IoGetNextIrpStackLocation(Irp);
+    nextSp->Parameters.Write.ByteOffset.QuadPart = offset;
+    nextSp->Parameters.Write.Length = length;
+    nextSp->MajorFunction = IRP_MJ_WRITE;
+    nextSp->DeviceObject = filter->DeviceObject;
+    nextSp->Flags = SL_OVERRIDE_VERIFY_VOLUME;
+
+    IoSetCompletionRoutine(Irp, VspCopyExtentsCompletionRoutine, context,
+                           TRUE, TRUE, TRUE);
+
+    ExQueueWorkItem(&context->WorkItem, DelayedWorkQueue);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+NTSTATUS
+VspCopyExtents(
+    IN  PVOLUME_EXTENSION   Extension,
+    IN  PLIST_ENTRY         ExtentList,
+    IN  BOOLEAN             HiberfileIncluded,
+    IN  BOOLEAN             PagefileIncluded
+    )
+
+{
+    PVSP_CONTEXT        context;
+    PIRP                irp;
+    PIO_STACK_LOCATION  nextSp;
+
+    if (IsListEmpty(ExtentList)) {
+        if (HiberfileIncluded) {
+            InterlockedExchange(&Extension->Filter->HibernatePending, FALSE);
+        }
+        return STATUS_SUCCESS;
+    }
+
+    context = VspAllocateContext(Extension->Root);
+    if (!context) {
+        if (HiberfileIncluded) {
+            InterlockedExchange(&Extension->Filter->HibernatePending, FALSE);
+        }
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    irp = IoAllocateIrp((CCHAR) Extension->Root->StackSize, FALSE);
+    if (!irp) {
+        if (HiberfileIncluded) {
+            InterlockedExchange(&Extension->Filter->HibernatePending, FALSE);
+        }
+        VspFreeContext(Extension->Root, context);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    irp->MdlAddress = NULL;
+
+    context->Type = VSP_CONTEXT_TYPE_COPY_EXTENTS;
+    ExInitializeWorkItem(&context->WorkItem, VspCallDriver, context);
+    context->CopyExtents.Extension = Extension;
+    context->CopyExtents.Irp = irp;
+    context->CopyExtents.ExtentList = *ExtentList;
+    context->CopyExtents.ExtentList.Flink->Blink =
+            &context->CopyExtents.ExtentList;
+    context->CopyExtents.ExtentList.Blink->Flink =
+            &context->CopyExtents.ExtentList;
+    context->CopyExtents.HiberfileIncluded = HiberfileIncluded;
+    context->CopyExtents.PagefileIncluded = PagefileIncluded;
+
+    ObReferenceObject(Extension->DeviceObject);
+    ObReferenceObject(Extension->Filter->DeviceObject);
+
+    VspCopyExtentsCompletionRoutine(NULL, irp, context);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+VspSystemSid(
+    IN OUT  SID*   Sid
+    )
+
+{
+    Sid->Revision = SID_REVISION;
+    Sid->SubAuthorityCount = 1;
+    Sid->IdentifierAuthority = ntAuthority;
+    Sid->SubAuthority[0] = SECURITY_LOCAL_SYSTEM_RID;
+}
+
+VOID
+VspAdminSid(
+    IN OUT  SID*   Sid
+    )
+
+{
+    Sid->Revision = SID_REVISION;
+    Sid->SubAuthorityCount = 2;
+    Sid->IdentifierAuthority = ntAuthority;
+    Sid->SubAuthority[0] = SECURITY_BUILTIN_DOMAIN_RID;
+    Sid->SubAuthority[1] = DOMAIN_ALIAS_RID_ADMINS;
+}
+
+BOOLEAN
+VspHasStrongAcl(
+    IN  HANDLE      Handle,
+    OUT PNTSTATUS   Status
+    )
+
+{
+    NTSTATUS                status;
+    ULONG                   sdLength;
+    PSECURITY_DESCRIPTOR    sd;
+    PSID                    sid;
+    BOOLEAN                 ownerDefaulted, daclPresent, daclDefaulted;
+    PACL                    acl;
+    ULONG                   i;
+    PACCESS_ALLOWED_ACE     ace;
+    PSID                    systemSid;
+    UCHAR                   sidBuffer[2*sizeof(SID)];
+    PSID                    adminSid;
+    UCHAR                   sidBuffer2[2*sizeof(SID)];
+    ULONG                   priviledgedBits;
+
+    status = ZwQuerySecurityObject(Handle, OWNER_SECURITY_INFORMATION |
+                                   DACL_SECURITY_INFORMATION, NULL, 0,
+                                   &sdLength);
+    if (status != STATUS_BUFFER_TOO_SMALL) {
+        // The file system does not support security.
+        return TRUE;
+    }
+
+    sd = ExAllocatePoolWithTag(PagedPool, sdLength, VOLSNAP_TAG_SHORT_TERM);
+    if (!sd) {
+        *Status = STATUS_INSUFFICIENT_RESOURCES;
+        return FALSE;
+    }
+
+    status = ZwQuerySecurityObject(Handle, OWNER_SECURITY_INFORMATION |
+                                   DACL_SECURITY_INFORMATION, sd, sdLength,
+                                   &sdLength);
+    if (!NT_SUCCESS(status)) {
+        ExFreePool(sd);
+        *Status = status;
+        return FALSE;
+    }
+
+    status = RtlGetDaclSecurityDescriptor(sd, &daclPresent, &acl,
+                                          &daclDefaulted);
+    if (!NT_SUCCESS(status)) {
+        ExFreePool(sd);
+        *Status = status;
+        return FALSE;
+    }
+
+    status = RtlGetOwnerSecurityDescriptor(sd, &sid, &ownerDefaulted);
+    if (!NT_SUCCESS(status)) {
+        ExFreePool(sd);
+        *Status = status;
+        return FALSE;
+    }
+
+    systemSid = (PSID) sidBuffer;
+    adminSid = (PSID) sidBuffer2;
+
+    VspSystemSid((SID*) systemSid);
+    VspAdminSid((SID*) adminSid);
+
+    if (!sid) {
+        ExFreePool(sd);
+        *Status = STATUS_NO_SECURITY_ON_OBJECT;
+        return FALSE;
+    }
+
+    if (!RtlEqualSid(sid, adminSid) && !RtlEqualSid(sid, systemSid)) {
+        ExFreePool(sd);
+        *Status = STATUS_NO_SECURITY_ON_OBJECT;
+        return FALSE;
+    }
+
+    if (!daclPresent || (daclPresent && !acl)) {
+        ExFreePool(sd);
+        *Status = STATUS_NO_SECURITY_ON_OBJECT;
+        return FALSE;
+    }
+
+    priviledgedBits = FILE_READ_DATA | WRITE_DAC | WRITE_OWNER |
+                      ACCESS_SYSTEM_SECURITY | GENERIC_ALL | GENERIC_READ;
+
+    for (i = 0; ; i++) {
+        status = RtlGetAce(acl, i, (PVOID*) &ace);
+        if (!NT_SUCCESS(status)) {
+            ace = NULL;
+        }
+        if (!ace) {
+            break;
+        }
+
+        if (ace->Header.AceType != ACCESS_ALLOWED_ACE_TYPE) {
+            continue;
+        }
+
+        sid = (PSID) &ace->SidStart;
+        if (RtlEqualSid(sid, systemSid) || RtlEqualSid(sid, adminSid)) {
+            continue;
+        }
+
+        if (ace->Mask&priviledgedBits) {
+            ExFreePool(sd);
+            *Status = STATUS_NO_SECURITY_ON_OBJECT;
+            return FALSE;
+        }
+    }
+
+    ExFreePool(sd);
+
+    return TRUE;
+}
+
+VOID
+VspAdjustBitmap(
+    IN  PVOID   Context
+    )
+
+{
+    PVSP_CONTEXT                context = (PVSP_CONTEXT) Context;
+    PVOLUME_EXTENSION           extension = context->Extension.Extension;
+    NTSTATUS                    status;
+    LIST_ENTRY                  extentList;
+    WCHAR                       nameBuffer[100];
+    UNICODE_STRING              name;
+    OBJECT_ATTRIBUTES           oa;
+    HANDLE                      h;
+    IO_STATUS_BLOCK             ioStatus;
+    KIRQL                       irql;
+    PLIST_ENTRY                 l;
+    PDIFF_AREA_FILE_ALLOCATION  diffAreaFileAllocation;
+    BOOLEAN                     isNtfs;
+    PWORK_QUEUE_ITEM            workItem;
+    PWORKER_THREAD_ROUTINE      workerRoutine;
+    PVOID                       parameter;
+    PVSP_DIFF_AREA_FILE         diffAreaFile;
+
+    ASSERT(context->Type == VSP_CONTEXT_TYPE_EXTENSION);
+
+    VspFreeContext(extension->Root, context);
+
+    KeWaitForSingleObject(&extension->Root->PastBootReinit, Executive,
+                          KernelMode, FALSE, NULL);
+
+    if (extension->IsDetected) {
+
+        status = VspOpenFilesAndValidateSnapshots(extension->Filter);
+        if (!NT_SUCCESS(status)) {
+            if (!extension->Filter->ControlBlockFileHandle) {
+                VspAcquireNonPagedResource(extension, NULL, FALSE);
+                VspCreateStartBlock(extension->Filter, 0,
+                                    extension->Filter->MaximumVolumeSpace);
+                extension->Filter->FirstControlBlockVolumeOffset = 0;
+                VspReleaseNonPagedResource(extension);
+            }
+            VspDestroyAllSnapshots(extension->Filter, NULL, FALSE, TRUE);
+            goto Finish;
+        }
+
+    } else {
+
+        if (extension->IsPersistent) {
+            VspComputeIgnorableBitmap(extension, NULL);
+        }
+
+        KeSetEvent(&extension->Filter->EndCommitProcessCompleted,
+                   IO_NO_INCREMENT, FALSE);
+
+        swprintf(nameBuffer,
+                 L"\\Device\\HarddiskVolumeShadowCopy%d\\pagefile.sys",
+                 extension->VolumeNumber);
+        RtlInitUnicodeString(&name, nameBuffer);
+        InitializeObjectAttributes(&oa, &name, OBJ_CASE_INSENSITIVE |
+                                   OBJ_KERNEL_HANDLE, NULL, NULL);
+
+        status = ZwOpenFile(&h, FILE_GENERIC_READ, &oa, &ioStatus,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE |
+                            FILE_SHARE_DELETE, FILE_SYNCHRONOUS_IO_NONALERT);
+        if (NT_SUCCESS(status)) {
+            if (!VspHasStrongAcl(h, &status)) {
+                ZwClose(h);
+            }
+        }
+        if (NT_SUCCESS(status)) {
+            VspMarkFileAllocationInBitmap(extension, h, NULL, NULL);
+
+            if (extension->ContainsCrashdumpFile) {
+                ASSERT(extension->IsPersistent);
+                status = VspQueryListOfExtents(h, 0, &extentList, NULL, TRUE);
+                if (NT_SUCCESS(status)) {
+
+                    status = VspCopyExtents(extension, &extentList, FALSE,
+                                            TRUE);
+                    if (!NT_SUCCESS(status)) {
+                        while (!IsListEmpty(&extentList)) {
+                            l = RemoveHeadList(&extentList);
+                            diffAreaFileAllocation = CONTAINING_RECORD(l,
+                                                     DIFF_AREA_FILE_ALLOCATION,
+                                                     ListEntry);
+                            ExFreePool(diffAreaFileAllocation);
+                        }
+
+                        VspLogError(NULL, extension->Filter,
+                                    VS_ABORT_COPY_ON_WRITE_CRASHDUMP_FILES,
+                                    status, 4, FALSE);
+                        VspDestroyAllSnapshots(extension->Filter, NULL, FALSE, FALSE);
+                    }
+
+                } else {
+                    VspLogError(NULL, extension->Filter,
+                                VS_ABORT_COPY_ON_WRITE_CRASHDUMP_FILES, status,
+                                1, FALSE);
+                    VspDestroyAllSnapshots(extension->Filter, NULL, FALSE, FALSE);
+                }
+            }
+
+            ZwClose(h);
+        } else if (extension->ContainsCrashdumpFile) {
+            VspLogError(NULL, extension->Filter,
+                        VS_ABORT_COPY_ON_WRITE_CRASHDUMP_FILES, status, 2,
+                        FALSE);
+            VspDestroyAllSnapshots(extension->Filter, NULL, FALSE, FALSE);
+        }
+
+        swprintf(nameBuffer,
+                 L"\\Device\\HarddiskVolumeShadowCopy%d\\hiberfil.sys",
+                 extension->VolumeNumber);
+        RtlInitUnicodeString(&name, nameBuffer);
+        InitializeObjectAttributes(&oa, &name, OBJ_CASE_INSENSITIVE |
+                                   OBJ_KERNEL_HANDLE, NULL, NULL);
+
+        status = ZwOpenFile(&h, FILE_GENERIC_READ, &oa, &ioStatus,
+                             FILE_SHARE_READ | FILE_SHARE_WRITE |
+                             FILE_SHARE_DELETE, FILE_SYNCHRONOUS_IO_NONALERT);
+        if (NT_SUCCESS(status)) {
+            if (!VspHasStrongAcl(h, &status)) {
+                ZwClose(h);
+            }
+        }
+        if (NT_SUCCESS(status)) {
+            VspMarkFileAllocationInBitmap(extension, h, NULL, NULL);
+
+            if (extension->IsPersistent) {
+                status = STATUS_SUCCESS;
+                isNtfs = TRUE;
+            } else {
+                status = VspIsNtfs(h, &isNtfs);
+            }
+
+            if (NT_SUCCESS(status) && isNtfs) {
+                status = VspQueryListOfExtents(h, 0, &extentList, NULL, TRUE);
+                if (NT_SUCCESS(status)) {
+                    status = VspCopyExtents(extension, &extentList, TRUE,
+                                            FALSE);
+                    if (!NT_SUCCESS(status)) {
+                        while (!IsListEmpty(&extentList)) {
+                            l = RemoveHeadList(&extentList);
+                            diffAreaFileAllocation = CONTAINING_RECORD(l,
+                                                     DIFF_AREA_FILE_ALLOCATION, ListEntry);
+                            ExFreePool(diffAreaFileAllocation);
+                        }
 
-    IoSetCompletionRoutine(Irp, VspCopyExtentsCompletionRoutine, context,
-                           TRUE, TRUE, TRUE);
+                        VspLogError(NULL, extension->Filter,
+                                    VS_ABORT_COPY_ON_WRITE_CRASHDUMP_FILES,
+                                    status, 14, FALSE);
+                        VspDestroyAllSnapshots(extension->Filter, NULL, FALSE, FALSE);
+                    }
+                } else {
+                    VspLogError(NULL, extension->Filter,
+                                VS_ABORT_COPY_ON_WRITE_CRASHDUMP_FILES, status,
+                                3, FALSE);
+                    VspDestroyAllSnapshots(extension->Filter, NULL, FALSE, FALSE);
+                }
+            }
 
-    ExQueueWorkItem(&context->WorkItem, DelayedWorkQueue);
+            ZwClose(h);
+        }
+    }
 
-    return STATUS_MORE_PROCESSING_REQUIRED;
-}
-
-NTSTATUS
-VspCopyExtents(
-    IN  PVOLUME_EXTENSION   Extension,
-    IN  PLIST_ENTRY         ExtentList,
-    IN  BOOLEAN             HiberfileIncluded,
-    IN  BOOLEAN             PagefileIncluded
-    )
+    status = VspComputeIgnorableProduct(extension);
 
-{
-    PVSP_CONTEXT        context;
-    PIRP                irp;
-    PIO_STACK_LOCATION  nextSp;
+    KeAcquireSpinLock(&extension->SpinLock, &irql);
+    if (extension->IgnorableProduct) {
+        if (NT_SUCCESS(status) && extension->VolumeBlockBitmap) {
+            VspOrBitmaps(extension->VolumeBlockBitmap,
+                         extension->IgnorableProduct);
 
-    if (IsListEmpty(ExtentList)) {
-        if (HiberfileIncluded) {
-            InterlockedExchange(&Extension->Filter->HibernatePending, FALSE);
+        } else if (extension->VolumeBlockBitmap && extension->IsDetected) {
+            KeReleaseSpinLock(&extension->SpinLock, irql);
+
+            if (!extension->Filter->DestroyAllSnapshotsPending) {
+                VspLogError(extension, NULL,
+                            VS_ABORT_SNAPSHOTS_FAILED_FREE_SPACE_DETECTION,
+                            status, 1, FALSE);
+            }
+
+            VspDestroyAllSnapshots(extension->Filter, NULL, FALSE, TRUE);
+
+            goto Finish;
         }
-        return STATUS_SUCCESS;
+
+        ExFreePool(extension->IgnorableProduct->Buffer);
+        ExFreePool(extension->IgnorableProduct);
+        extension->IgnorableProduct = NULL;
     }
+    KeReleaseSpinLock(&extension->SpinLock, irql);
 
-    context = VspAllocateContext(Extension->Root);
-    if (!context) {
-        if (HiberfileIncluded) {
-            InterlockedExchange(&Extension->Filter->HibernatePending, FALSE);
+    if (extension->IsDetected) {
+        InterlockedExchange(&extension->OkToGrowDiffArea, TRUE);
+
+        if (extension->DetectedNeedForGrow) {
+            context = VspAllocateContext(extension->Root);
+            if (context) {
+                KeAcquireSpinLock(&extension->SpinLock, &irql);
+                ASSERT(!extension->GrowDiffAreaFilePending);
+                ASSERT(IsListEmpty(&extension->WaitingForDiffAreaSpace));
+                extension->PastFileSystemOperations = FALSE;
+                extension->GrowDiffAreaFilePending = TRUE;
+                KeReleaseSpinLock(&extension->SpinLock, irql);
+
+                context->Type = VSP_CONTEXT_TYPE_GROW_DIFF_AREA;
+                ExInitializeWorkItem(&context->WorkItem, VspGrowDiffArea,
+                                     context);
+                context->GrowDiffArea.Extension = extension;
+                ObReferenceObject(extension->DeviceObject);
+
+                VspQueueWorkItem(extension->Root, &context->WorkItem, 0);
+            }
         }
-        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    irp = IoAllocateIrp((CCHAR) Extension->Root->StackSize, FALSE);
-    if (!irp) {
-        if (HiberfileIncluded) {
-            InterlockedExchange(&Extension->Filter->HibernatePending, FALSE);
-        }
-        VspFreeContext(Extension->Root, context);
-        return STATUS_INSUFFICIENT_RESOURCES;
+Finish:
+
+    if (extension->IsDetected) {
+        KeSetEvent(&extension->Filter->EndCommitProcessCompleted,
+                   IO_NO_INCREMENT, FALSE);
     }
 
-    irp->MdlAddress = NULL;
+    VspAcquire(extension->Root);
+    if (extension->IgnoreCopyDataReference) {
+        extension->IgnoreCopyDataReference = FALSE;
+        InterlockedDecrement(&extension->Filter->IgnoreCopyData);
+    }
+    VspRelease(extension->Root);
 
-    context->Type = VSP_CONTEXT_TYPE_COPY_EXTENTS;
-    ExInitializeWorkItem(&context->WorkItem, VspCallDriver, context);
-    context->CopyExtents.Extension = Extension;
-    context->CopyExtents.Irp = irp;
-    context->CopyExtents.ExtentList = *ExtentList;
-    context->CopyExtents.ExtentList.Flink->Blink =
-            &context->CopyExtents.ExtentList;
-    context->CopyExtents.ExtentList.Blink->Flink =
-            &context->CopyExtents.ExtentList;
-    context->CopyExtents.HiberfileIncluded = HiberfileIncluded;
-    context->CopyExtents.PagefileIncluded = PagefileIncluded;
+    KeAcquireSpinLock(&extension->Root->ESpinLock, &irql);
+    ASSERT(extension->Root->AdjustBitmapInProgress);
+    if (IsListEmpty(&extension->Root->AdjustBitmapQueue)) {
+        extension->Root->AdjustBitmapInProgress = FALSE;
+        KeReleaseSpinLock(&extension->Root->ESpinLock, irql);
+    } else {
+        l = RemoveHeadList(&extension->Root->AdjustBitmapQueue);
+        KeReleaseSpinLock(&extension->Root->ESpinLock, irql);
 
-    ObReferenceObject(Extension->DeviceObject);
-    ObReferenceObject(Extension->Filter->DeviceObject);
+        workItem = CONTAINING_RECORD(l, WORK_QUEUE_ITEM, List);
 
-    VspCopyExtentsCompletionRoutine(NULL, irp, context);
+        workerRoutine = workItem->WorkerRoutine;
+        parameter = workItem->Parameter;
+        ExInitializeWorkItem(workItem, workerRoutine, parameter);
 
-    return STATUS_SUCCESS;
+        ExQueueWorkItem(workItem, DelayedWorkQueue);
+    }
+
+    ObDereferenceObject(extension->Filter->TargetObject);
+    ObDereferenceObject(extension->Filter->DeviceObject);
+    ObDereferenceObject(extension->DeviceObject);
 }
 
 VOID
-VspSystemSid(
-    IN OUT  SID*   Sid
+VspSetIgnorableBlocksInBitmapWorker(
+    IN  PVOID   Context
     )
 
 {
-    Sid->Revision = SID_REVISION;
-    Sid->SubAuthorityCount = 1;
-    Sid->IdentifierAuthority = ntAuthority;
-    Sid->SubAuthority[0] = SECURITY_LOCAL_SYSTEM_RID;
+    PVSP_CONTEXT        context = (PVSP_CONTEXT) Context;
+    PVOLUME_EXTENSION   extension = context->Extension.Extension;
+    NTSTATUS            status;
+    KIRQL               irql;
+    ULONGLONG           startTime;
+
+    ASSERT(context->Type == VSP_CONTEXT_TYPE_EXTENSION);
+
+    if (!extension->IsDetected) {
+        startTime = KeQueryInterruptTime();
+        status = VspMarkFreeSpaceInBitmap(extension, NULL, NULL);
+        if (NT_SUCCESS(status)) {
+            extension->CommitTimes.FreeSpaceScan = KeQueryInterruptTime() -
+                                                   startTime;
+            InterlockedExchange(&extension->OkToGrowDiffArea, TRUE);
+            VspLogCommitTimes(extension);
+        } else {
+            if (!extension->Filter->DestroyAllSnapshotsPending) {
+                VspLogError(extension, NULL,
+                            VS_ABORT_SNAPSHOTS_FAILED_FREE_SPACE_DETECTION,
+                            status, 2, FALSE);
+            }
+            VspDestroyAllSnapshots(extension->Filter, NULL, FALSE, FALSE);
+        }
+    }
+
+    ExInitializeWorkItem(&context->WorkItem, VspAdjustBitmap, context);
+
+    KeAcquireSpinLock(&extension->Root->ESpinLock, &irql);
+    if (extension->Root->AdjustBitmapInProgress) {
+        InsertTailList(&extension->Root->AdjustBitmapQueue,
+                       &context->WorkItem.List);
+        KeReleaseSpinLock(&extension->Root->ESpinLock, irql);
+    } else {
+        extension->Root->AdjustBitmapInProgress = TRUE;
+        KeReleaseSpinLock(&extension->Root->ESpinLock, irql);
+        ExQueueWorkItem(&context->WorkItem, DelayedWorkQueue);
+    }
 }
 
 VOID
-VspAdminSid(
-    IN OUT  SID*   Sid
+VspFreeCopyIrp(
+    IN  PVOLUME_EXTENSION   Extension,
+    IN  PIRP                CopyIrp
     )
 
 {
-    Sid->Revision = SID_REVISION;
-    Sid->SubAuthorityCount = 2;
-    Sid->IdentifierAuthority = ntAuthority;
-    Sid->SubAuthority[0] = SECURITY_BUILTIN_DOMAIN_RID;
-    Sid->SubAuthority[1] = DOMAIN_ALIAS_RID_ADMINS;
+    KIRQL                           irql;
+    PLIST_ENTRY                     l;
+    PWORK_QUEUE_ITEM                workItem;
+    PTEMP_TRANSLATION_TABLE_ENTRY   tableEntry;
+
+    if (Extension->EmergencyCopyIrp == CopyIrp) {
+        KeAcquireSpinLock(&Extension->SpinLock, &irql);
+        if (IsListEmpty(&Extension->EmergencyCopyIrpQueue)) {
+            Extension->EmergencyCopyIrpInUse = FALSE;
+            KeReleaseSpinLock(&Extension->SpinLock, irql);
+            return;
+        }
+        l = RemoveHeadList(&Extension->EmergencyCopyIrpQueue);
+        KeReleaseSpinLock(&Extension->SpinLock, irql);
+
+        workItem = CONTAINING_RECORD(l, WORK_QUEUE_ITEM, List);
+        tableEntry = (PTEMP_TRANSLATION_TABLE_ENTRY) workItem->Parameter;
+        tableEntry->CopyIrp = CopyIrp;
+
+        workItem->WorkerRoutine(workItem->Parameter);
+        return;
+    }
+
+    if (!Extension->EmergencyCopyIrpInUse) {
+        ExFreePool(MmGetMdlVirtualAddress(CopyIrp->MdlAddress));
+        IoFreeMdl(CopyIrp->MdlAddress);
+        IoFreeIrp(CopyIrp);
+        return;
+    }
+
+    KeAcquireSpinLock(&Extension->SpinLock, &irql);
+    if (IsListEmpty(&Extension->EmergencyCopyIrpQueue)) {
+        KeReleaseSpinLock(&Extension->SpinLock, irql);
+        ExFreePool(MmGetMdlVirtualAddress(CopyIrp->MdlAddress));
+        IoFreeMdl(CopyIrp->MdlAddress);
+        IoFreeIrp(CopyIrp);
+        return;
+    }
+    l = RemoveHeadList(&Extension->EmergencyCopyIrpQueue);
+    KeReleaseSpinLock(&Extension->SpinLock, irql);
+
+    workItem = CONTAINING_RECORD(l, WORK_QUEUE_ITEM, List);
+    tableEntry = (PTEMP_TRANSLATION_TABLE_ENTRY) workItem->Parameter;
+    tableEntry->CopyIrp = CopyIrp;
+
+    workItem->WorkerRoutine(workItem->Parameter);
 }
 
-BOOLEAN
-VspHasStrongAcl(
-    IN  HANDLE      Handle,
-    OUT PNTSTATUS   Status
+VOID
+VspApplyThresholdDelta(
+    IN  PVOLUME_EXTENSION   Extension,
+    IN  ULONG               IncreaseDelta
     )
 
 {
-    NTSTATUS                status;
-    ULONG                   sdLength;
-    PSECURITY_DESCRIPTOR    sd;
-    PSID                    sid;
-    BOOLEAN                 ownerDefaulted, daclPresent, daclDefaulted;
-    PACL                    acl;
-    ULONG                   i;
-    PACCESS_ALLOWED_ACE     ace;
-    PSID                    systemSid;
-    UCHAR                   sidBuffer[2*sizeof(SID)];
-    PSID                    adminSid;
-    UCHAR                   sidBuffer2[2*sizeof(SID)];
-    ULONG                   priviledgedBits;
+    PVSP_DIFF_AREA_FILE diffAreaFile;
+    PVSP_CONTEXT        context;
+    KIRQL               irql;
 
-    status = ZwQuerySecurityObject(Handle, OWNER_SECURITY_INFORMATION |
-                                   DACL_SECURITY_INFORMATION, NULL, 0,
-                                   &sdLength);
-    if (status != STATUS_BUFFER_TOO_SMALL) {
-        // The file system does not support security.
-        return TRUE;
-    }
+    ASSERT(Extension->DiffAreaFile);
+    diffAreaFile = Extension->DiffAreaFile;
 
-    sd = ExAllocatePoolWithTag(PagedPool, sdLength, VOLSNAP_TAG_SHORT_TERM);
-    if (!sd) {
-        *Status = STATUS_INSUFFICIENT_RESOURCES;
-        return FALSE;
-    }
+    if (diffAreaFile->NextAvailable + Extension->DiffAreaFileIncrease <=
+        diffAreaFile->AllocatedFileSize) {
 
-    status = ZwQuerySecurityObject(Handle, OWNER_SECURITY_INFORMATION |
-                                   DACL_SECURITY_INFORMATION, sd, sdLength,
-                                   &sdLength);
-    if (!NT_SUCCESS(status)) {
-        ExFreePool(sd);
-        *Status = status;
-        return FALSE;
+        return;
     }
 
-    status = RtlGetDaclSecurityDescriptor(sd, &daclPresent, &acl,
-                                          &daclDefaulted);
-    if (!NT_SUCCESS(status)) {
-        ExFreePool(sd);
-        *Status = status;
-        return FALSE;
+    if (diffAreaFile->NextAvailable + Extension->DiffAreaFileIncrease -
+        IncreaseDelta > diffAreaFile->AllocatedFileSize) {
+
+        return;
     }
 
-    status = RtlGetOwnerSecurityDescriptor(sd, &sid, &ownerDefaulted);
-    if (!NT_SUCCESS(status)) {
-        ExFreePool(sd);
-        *Status = status;
-        return FALSE;
+    context = VspAllocateContext(Extension->Root);
+    if (!context) {
+        if (!Extension->OkToGrowDiffArea) {
+            VspLogError(Extension, diffAreaFile->Filter,
+                        VS_GROW_BEFORE_FREE_SPACE, STATUS_SUCCESS, 3, FALSE);
+        }
+        return;
     }
 
-    systemSid = (PSID) sidBuffer;
-    adminSid = (PSID) sidBuffer2;
+    KeAcquireSpinLock(&Extension->SpinLock, &irql);
+    ASSERT(!Extension->GrowDiffAreaFilePending);
+    ASSERT(IsListEmpty(&Extension->WaitingForDiffAreaSpace));
+    Extension->PastFileSystemOperations = FALSE;
+    Extension->GrowDiffAreaFilePending = TRUE;
+    KeReleaseSpinLock(&Extension->SpinLock, irql);
 
-    VspSystemSid((SID*) systemSid);
-    VspAdminSid((SID*) adminSid);
+    context->Type = VSP_CONTEXT_TYPE_GROW_DIFF_AREA;
+    ExInitializeWorkItem(&context->WorkItem, VspGrowDiffArea, context);
+    context->GrowDiffArea.Extension = Extension;
+    ObReferenceObject(Extension->DeviceObject);
 
-    if (!sid) {
-        ExFreePool(sd);
-        *Status = STATUS_NO_SECURITY_ON_OBJECT;
-        return FALSE;
+    if (!Extension->OkToGrowDiffArea) {
+        ObReferenceObject(Extension->Filter->DeviceObject);
+        ExInitializeWorkItem(&context->WorkItem, VspWaitForInstall, context);
+        ExQueueWorkItem(&context->WorkItem, DelayedWorkQueue);
+        return;
     }
 
-    if (!RtlEqualSid(sid, adminSid) && !RtlEqualSid(sid, systemSid)) {
-        ExFreePool(sd);
-        *Status = STATUS_NO_SECURITY_ON_OBJECT;
-        return FALSE;
-    }
+    VspQueueWorkItem(Extension->Root, &context->WorkItem, 0);
+}
+
+NTSTATUS
+VspCheckOnDiskNotCommitted(
+    IN  PVOLUME_EXTENSION   Extension
+    )
 
-    if (!daclPresent || (daclPresent && !acl)) {
-        ExFreePool(sd);
-        *Status = STATUS_NO_SECURITY_ON_OBJECT;
-        return FALSE;
+{
+    PFILTER_EXTENSION           filter = Extension->Filter;
+    NTSTATUS                    status;
+    UCHAR                       controlItemBuffer[VSP_BYTES_PER_CONTROL_ITEM];
+    PVSP_CONTROL_ITEM_SNAPSHOT  snapshotControlItem;
+
+    if (!Extension->OnDiskNotCommitted) {
+        return STATUS_SUCCESS;
     }
 
-    priviledgedBits = FILE_READ_DATA | WRITE_DAC | WRITE_OWNER |
-                      ACCESS_SYSTEM_SECURITY | GENERIC_ALL | GENERIC_READ;
+    Extension->OnDiskNotCommitted = FALSE;
 
-    for (i = 0; ; i++) {
-        status = RtlGetAce(acl, i, (PVOID*) &ace);
-        if (!NT_SUCCESS(status)) {
-            ace = NULL;
-        }
-        if (!ace) {
-            break;
+    status = VspIoControlItem(filter, VSP_CONTROL_ITEM_TYPE_SNAPSHOT,
+                              &Extension->SnapshotGuid, FALSE,
+                              controlItemBuffer, FALSE);
+    if (!NT_SUCCESS(status)) {
+        if (!filter->DestroyAllSnapshotsPending) {
+            VspLogError(Extension, filter, VS_ABORT_SNAPSHOTS_IO_FAILURE,
+                        status, 16, FALSE);
         }
+        VspDestroyAllSnapshots(filter, NULL, FALSE, FALSE);
+        return status;
+    }
 
-        if (ace->Header.AceType != ACCESS_ALLOWED_ACE_TYPE) {
-            continue;
-        }
+    snapshotControlItem = (PVSP_CONTROL_ITEM_SNAPSHOT) controlItemBuffer;
+    snapshotControlItem->SnapshotOrderNumber =
+            Extension->SnapshotOrderNumber;
+    snapshotControlItem->SnapshotTime = Extension->CommitTimeStamp;
 
-        sid = (PSID) &ace->SidStart;
-        if (RtlEqualSid(sid, systemSid) || RtlEqualSid(sid, adminSid)) {
-            continue;
-        }
+    if (Extension->ContainsCrashdumpFile) {
+        snapshotControlItem->SnapshotControlItemFlags =
+                VSP_SNAPSHOT_CONTROL_ITEM_FLAG_DIRTY_CRASHDUMP;
+    }
 
-        if (ace->Mask&priviledgedBits) {
-            ExFreePool(sd);
-            *Status = STATUS_NO_SECURITY_ON_OBJECT;
-            return FALSE;
-        }
+    if (Extension->NoDiffAreaFill) {
+        snapshotControlItem->SnapshotControlItemFlags |=
+                VSP_SNAPSHOT_CONTROL_ITEM_FLAG_NO_DIFF_AREA_FILL;
     }
 
-    ExFreePool(sd);
+    status = VspIoControlItem(filter, VSP_CONTROL_ITEM_TYPE_SNAPSHOT,
+                              &Extension->SnapshotGuid, TRUE,
+                              controlItemBuffer, FALSE);
+    if (!NT_SUCCESS(status)) {
+        if (!filter->DestroyAllSnapshotsPending) {
+            VspLogError(Extension, filter, VS_ABORT_SNAPSHOTS_IO_FAILURE,
+                        status, 17, FALSE);
+        }
+        VspDestroyAllSnapshots(filter, NULL, FALSE, FALSE);
+        return status;
+    }
 
-    return TRUE;
+    return STATUS_SUCCESS;
 }
 
 VOID
-VspAdjustBitmap(
+VspWriteVolume(
     IN  PVOID   Context
     )
 
-{
-    PVSP_CONTEXT                context = (PVSP_CONTEXT) Context;
-    PVOLUME_EXTENSION           extension = context->Extension.Extension;
-    NTSTATUS                    status;
-    LIST_ENTRY                  extentList;
-    WCHAR                       nameBuffer[100];
-    UNICODE_STRING              name;
-    OBJECT_ATTRIBUTES           oa;
-    HANDLE                      h;
-    IO_STATUS_BLOCK             ioStatus;
-    KIRQL                       irql;
-    PLIST_ENTRY                 l;
-    PDIFF_AREA_FILE_ALLOCATION  diffAreaFileAllocation;
-    BOOLEAN                     isNtfs;
-    PWORK_QUEUE_ITEM            workItem;
-    PWORKER_THREAD_ROUTINE      workerRoutine;
-    PVOID                       parameter;
-    PVSP_DIFF_AREA_FILE         diffAreaFile;
+/*++
 
-    ASSERT(context->Type == VSP_CONTEXT_TYPE_EXTENSION);
+Routine Description:
 
-    VspFreeContext(extension->Root, context);
+    This routine performs a volume write, making sure that all of the
+    parts of the volume write have an old version of the data placed
+    in the diff area for the snapshot.
 
-    KeWaitForSingleObject(&extension->Root->PastBootReinit, Executive,
-                          KernelMode, FALSE, NULL);
+Arguments:
 
-    if (extension->IsDetected) {
+    Irp - Supplies the I/O request packet.
 
-        status = VspOpenFilesAndValidateSnapshots(extension->Filter);
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PVSP_CONTEXT                    context = (PVSP_CONTEXT) Context;
+    PVOLUME_EXTENSION               extension = context->WriteVolume.Extension;
+    PIRP                            irp = (PIRP) context->WriteVolume.Irp;
+    PIO_STACK_LOCATION              irpSp = IoGetCurrentIrpStackLocation(irp);
+    PIO_STACK_LOCATION              nextSp = IoGetNextIrpStackLocation(irp);
+    PFILTER_EXTENSION               filter = extension->Filter;
+    NTSTATUS                        status;
+    PLIST_ENTRY                     l;
+    LONGLONG                        start, end, roundedStart, roundedEnd;
+    ULONG                           irpLength, increase, increaseDelta;
+    TEMP_TRANSLATION_TABLE_ENTRY    keyTableEntry;
+    PTEMP_TRANSLATION_TABLE_ENTRY   tableEntry;
+    PVOID                           nodeOrParent;
+    TABLE_SEARCH_RESULT             searchResult;
+    KIRQL                           irql;
+    CCHAR                           stackSize;
+    PVSP_DIFF_AREA_FILE             diffAreaFile;
+    PDO_EXTENSION                   rootExtension;
+    PTEMP_TRANSLATION_TABLE_ENTRY   runEntry;
+    BOOLEAN                         canCoalesce;
+
+    ASSERT(context->Type == VSP_CONTEXT_TYPE_WRITE_VOLUME);
+
+    if (extension->OnDiskNotCommitted) {
+        status = VspCheckOnDiskNotCommitted(extension);
         if (!NT_SUCCESS(status)) {
-            if (!extension->Filter->ControlBlockFileHandle) {
-                VspAcquireNonPagedResource(extension, NULL, FALSE);
-                VspCreateStartBlock(extension->Filter, 0,
-                                    extension->Filter->MaximumVolumeSpace);
-                extension->Filter->FirstControlBlockVolumeOffset = 0;
-                VspReleaseNonPagedResource(extension);
-            }
-            VspDestroyAllSnapshots(extension->Filter, NULL, FALSE, TRUE);
-            goto Finish;
+            VspFreeContext(filter->Root, context);
+            VspReleaseNonPagedResource(extension);
+            VspDecrementIrpRefCount(irp);
+            return;
         }
+    }
 
+    start = irpSp->Parameters.Read.ByteOffset.QuadPart;
+    irpLength = irpSp->Parameters.Read.Length;
+    end = start + irpLength;
+    if (context->WriteVolume.RoundedStart) {
+        roundedStart = context->WriteVolume.RoundedStart;
     } else {
+        roundedStart = start&(~(BLOCK_SIZE - 1));
+    }
+    roundedEnd = end&(~(BLOCK_SIZE - 1));
+    if (roundedEnd != end) {
+        roundedEnd += BLOCK_SIZE;
+    }
 
-        if (extension->IsPersistent) {
-            VspComputeIgnorableBitmap(extension, NULL);
-        }
-
-        KeSetEvent(&extension->Filter->EndCommitProcessCompleted,
-                   IO_NO_INCREMENT, FALSE);
+    ASSERT(extension->VolumeBlockBitmap);
 
-        swprintf(nameBuffer,
-                 L"\\Device\\HarddiskVolumeShadowCopy%d\\pagefile.sys",
-                 extension->VolumeNumber);
-        RtlInitUnicodeString(&name, nameBuffer);
-        InitializeObjectAttributes(&oa, &name, OBJ_CASE_INSENSITIVE |
-                                   OBJ_KERNEL_HANDLE, NULL, NULL);
+    //
+    // Blocks that have to be read back and checked for the diff area fill
+    // pattern before they are written are copied one at a time.  All others
+    // are gathered into runs of consecutive blocks with contiguous diff
+    // area space.
+    //
 
-        status = ZwOpenFile(&h, FILE_GENERIC_READ, &oa, &ioStatus,
-                            FILE_SHARE_READ | FILE_SHARE_WRITE |
-                            FILE_SHARE_DELETE, FILE_SYNCHRONOUS_IO_NONALERT);
-        if (NT_SUCCESS(status)) {
-            if (!VspHasStrongAcl(h, &status)) {
-                ZwClose(h);
-            }
-        }
-        if (NT_SUCCESS(status)) {
-            VspMarkFileAllocationInBitmap(extension, h, NULL, NULL);
+    runEntry = NULL;
+    canCoalesce = !(extension->IsDetected && !extension->OkToGrowDiffArea &&
+                    !extension->NoDiffAreaFill);
 
-            if (extension->ContainsCrashdumpFile) {
-                ASSERT(extension->IsPersistent);
-                status = VspQueryListOfExtents(h, 0, &extentList, NULL, TRUE);
-                if (NT_SUCCESS(status)) {
+    for (; roundedStart < roundedEnd; roundedStart += BLOCK_SIZE) {
 
-                    status = VspCopyExtents(extension, &extentList, FALSE,
-                                            TRUE);
-                    if (!NT_SUCCESS(status)) {
-                        while (!IsListEmpty(&extentList)) {
-                            l = RemoveHeadList(&extentList);
-                            diffAreaFileAllocation = CONTAINING_RECORD(l,
-                                                     DIFF_AREA_FILE_ALLOCATION,
-                                                     ListEntry);
-                            ExFreePool(diffAreaFileAllocation);
-                        }
+        if (roundedStart < 0 ||
+            roundedStart >= extension->VolumeSize) {
 
-                        VspLogError(NULL, extension->Filter,
-                                    VS_ABORT_COPY_ON_WRITE_CRASHDUMP_FILES,
-                                    status, 4, FALSE);
-                        VspDestroyAllSnapshots(extension->Filter, NULL, FALSE, FALSE);
-                    }
+            continue;
+        }
 
-                } else {
-                    VspLogError(NULL, extension->Filter,
-                                VS_ABORT_COPY_ON_WRITE_CRASHDUMP_FILES, status,
-                                1, FALSE);
-                    VspDestroyAllSnapshots(extension->Filter, NULL, FALSE, FALSE);
-                }
-            }
+        KeAcquireSpinLock(&extension->SpinLock, &irql);
+        if (RtlCheckBit(extension->VolumeBlockBitmap,
+                        (ULONG) (roundedStart>>BLOCK_SHIFT))) {
 
-            ZwClose(h);
-        } else if (extension->ContainsCrashdumpFile) {
-            VspLogError(NULL, extension->Filter,
-                        VS_ABORT_COPY_ON_WRITE_CRASHDUMP_FILES, status, 2,
-                        FALSE);
-            VspDestroyAllSnapshots(extension->Filter, NULL, FALSE, FALSE);
+            KeReleaseSpinLock(&extension->SpinLock, irql);
+            continue;
         }
+        KeReleaseSpinLock(&extension->SpinLock, irql);
 
-        swprintf(nameBuffer,
-                 L"\\Device\\HarddiskVolumeShadowCopy%d\\hiberfil.sys",
-                 extension->VolumeNumber);
-        RtlInitUnicodeString(&name, nameBuffer);
-        InitializeObjectAttributes(&oa, &name, OBJ_CASE_INSENSITIVE |
-                                   OBJ_KERNEL_HANDLE, NULL, NULL);
+        keyTableEntry.VolumeOffset = roundedStart;
 
-        status = ZwOpenFile(&h, FILE_GENERIC_READ, &oa, &ioStatus,
-                             FILE_SHARE_READ | FILE_SHARE_WRITE |
-                             FILE_SHARE_DELETE, FILE_SYNCHRONOUS_IO_NONALERT);
-        if (NT_SUCCESS(status)) {
-            if (!VspHasStrongAcl(h, &status)) {
-                ZwClose(h);
-            }
-        }
-        if (NT_SUCCESS(status)) {
-            VspMarkFileAllocationInBitmap(extension, h, NULL, NULL);
+        tableEntry = (PTEMP_TRANSLATION_TABLE_ENTRY)
+                     RtlLookupElementGenericTableFull(
+                     &extension->TempVolumeBlockTable, &keyTableEntry,
+                     &nodeOrParent, &searchResult);
 
-            if (extension->IsPersistent) {
-                status = STATUS_SUCCESS;
-                isNtfs = TRUE;
+        if (tableEntry) {
+
+            context = VspAllocateContext(extension->Root);
+            if (context) {
+                context->Type = VSP_CONTEXT_TYPE_EXTENSION;
+                context->Extension.Extension = extension;
+                context->Extension.Irp = irp;
             } else {
-                status = VspIsNtfs(h, &isNtfs);
+                context = (PVSP_CONTEXT) Context;
+                ASSERT(context->Type == VSP_CONTEXT_TYPE_WRITE_VOLUME);
+                context->WriteVolume.RoundedStart = roundedStart;
             }
+            ExInitializeWorkItem(&context->WorkItem,
+                                 VspDecrementIrpRefCountWorker, context);
 
-            if (NT_SUCCESS(status) && isNtfs) {
-                status = VspQueryListOfExtents(h, 0, &extentList, NULL, TRUE);
-                if (NT_SUCCESS(status)) {
-                    status = VspCopyExtents(extension, &extentList, TRUE,
-                                            FALSE);
-                    if (!NT_SUCCESS(status)) {
-                        while (!IsListEmpty(&extentList)) {
-                            l = RemoveHeadList(&extentList);
-                            diffAreaFileAllocation = CONTAINING_RECORD(l,
-                                                     DIFF_AREA_FILE_ALLOCATION, ListEntry);
-                            ExFreePool(diffAreaFileAllocation);
-                        }
+            KeAcquireSpinLock(&extension->SpinLock, &irql);
+            if (tableEntry->IsComplete) {
+                KeReleaseSpinLock(&extension->SpinLock, irql);
+                if (context->Type == VSP_CONTEXT_TYPE_EXTENSION) {
+                    VspFreeContext(extension->Root, context);
+                }
+                continue;
+            }
+            InterlockedIncrement((PLONG) &nextSp->Parameters.Write.Length);
+            InsertTailList(&tableEntry->WaitingQueueDpc,
+                           &context->WorkItem.List);
+            KeReleaseSpinLock(&extension->SpinLock, irql);
 
-                        VspLogError(NULL, extension->Filter,
-                                    VS_ABORT_COPY_ON_WRITE_CRASHDUMP_FILES,
-                                    status, 14, FALSE);
-                        VspDestroyAllSnapshots(extension->Filter, NULL, FALSE, FALSE);
-                    }
-                } else {
-                    VspLogError(NULL, extension->Filter,
-                                VS_ABORT_COPY_ON_WRITE_CRASHDUMP_FILES, status,
-                                3, FALSE);
-                    VspDestroyAllSnapshots(extension->Filter, NULL, FALSE, FALSE);
+            if (context == Context) {
+                if (runEntry) {
+                    VspStartCopyRun(runEntry);
                 }
+                VspReleaseNonPagedResource(extension);
+                return;
             }
 
-            ZwClose(h);
+            continue;
         }
-    }
-
-    status = VspComputeIgnorableProduct(extension);
-
-    KeAcquireSpinLock(&extension->SpinLock, &irql);
-    if (extension->IgnorableProduct) {
-        if (NT_SUCCESS(status) && extension->VolumeBlockBitmap) {
-            VspOrBitmaps(extension->VolumeBlockBitmap,
-                         extension->IgnorableProduct);
 
-        } else if (extension->VolumeBlockBitmap && extension->IsDetected) {
-            KeReleaseSpinLock(&extension->SpinLock, irql);
+        RtlZeroMemory(&keyTableEntry, sizeof(TEMP_TRANSLATION_TABLE_ENTRY));
+        keyTableEntry.VolumeOffset = roundedStart;
 
-            if (!extension->Filter->DestroyAllSnapshotsPending) {
-                VspLogError(extension, NULL,
-                            VS_ABORT_SNAPSHOTS_FAILED_FREE_SPACE_DETECTION,
-                            status, 1, FALSE);
+        ASSERT(!extension->TempTableEntry);
+        extension->TempTableEntry =
+                VspAllocateTempTableEntry(extension->Root);
+        if (!extension->TempTableEntry) {
+            rootExtension = extension->Root;
+            KeAcquireSpinLock(&rootExtension->ESpinLock, &irql);
+            if (rootExtension->EmergencyTableEntryInUse) {
+                context = (PVSP_CONTEXT) Context;
+                ASSERT(context->Type == VSP_CONTEXT_TYPE_WRITE_VOLUME);
+                context->WriteVolume.RoundedStart = roundedStart;
+                InsertTailList(&rootExtension->WorkItemWaitingList,
+                               &context->WorkItem.List);
+                if (!rootExtension->WorkItemWaitingListNeedsChecking) {
+                    InterlockedExchange(
+                            &rootExtension->WorkItemWaitingListNeedsChecking,
+                            TRUE);
+                }
+                KeReleaseSpinLock(&rootExtension->ESpinLock, irql);
+                if (runEntry) {
+                    VspStartCopyRun(runEntry);
+                }
+                VspReleaseNonPagedResource(extension);
+                return;
             }
+            rootExtension->EmergencyTableEntryInUse = TRUE;
+            KeReleaseSpinLock(&rootExtension->ESpinLock, irql);
 
-            VspDestroyAllSnapshots(extension->Filter, NULL, FALSE, TRUE);
-
-            goto Finish;
+            extension->TempTableEntry = rootExtension->EmergencyTableEntry;
         }
 
-        ExFreePool(extension->IgnorableProduct->Buffer);
-        ExFreePool(extension->IgnorableProduct);
-        extension->IgnorableProduct = NULL;
-    }
-    KeReleaseSpinLock(&extension->SpinLock, irql);
-
-    if (extension->IsDetected) {
-        InterlockedExchange(&extension->OkToGrowDiffArea, TRUE);
-
-        if (extension->DetectedNeedForGrow) {
-            context = VspAllocateContext(extension->Root);
-            if (context) {
-                KeAcquireSpinLock(&extension->SpinLock, &irql);
-                ASSERT(!extension->GrowDiffAreaFilePending);
-                ASSERT(IsListEmpty(&extension->WaitingForDiffAreaSpace));
-                extension->PastFileSystemOperations = FALSE;
-                extension->GrowDiffAreaFilePending = TRUE;
-                KeReleaseSpinLock(&extension->SpinLock, irql);
+        tableEntry = (PTEMP_TRANSLATION_TABLE_ENTRY)
+                     RtlInsertElementGenericTableFull(
+                     &extension->TempVolumeBlockTable, &keyTableEntry,
+                     sizeof(TEMP_TRANSLATION_TABLE_ENTRY), NULL,
+                     nodeOrParent, searchResult);
+        ASSERT(tableEntry);
 
-                context->Type = VSP_CONTEXT_TYPE_GROW_DIFF_AREA;
-                ExInitializeWorkItem(&context->WorkItem, VspGrowDiffArea,
-                                     context);
-                context->GrowDiffArea.Extension = extension;
-                ObReferenceObject(extension->DeviceObject);
+        if (extension->TempVolumeBlockTable.NumberGenericTableElements >
+            extension->MaximumNumberOfTempEntries) {
 
-                VspQueueWorkItem(extension->Root, &context->WorkItem, 0);
+            extension->MaximumNumberOfTempEntries =
+                    extension->TempVolumeBlockTable.NumberGenericTableElements;
+            VspQueryDiffAreaFileIncrease(extension, &increase);
+            ASSERT(increase >= extension->DiffAreaFileIncrease);
+            increaseDelta = increase - extension->DiffAreaFileIncrease;
+            if (increaseDelta) {
+                InterlockedExchange((PLONG) &extension->DiffAreaFileIncrease,
+                                    (LONG) increase);
+                VspApplyThresholdDelta(extension, increaseDelta);
             }
         }
-    }
-
-Finish:
 
-    if (extension->IsDetected) {
-        KeSetEvent(&extension->Filter->EndCommitProcessCompleted,
-                   IO_NO_INCREMENT, FALSE);
-    }
+        tableEntry->Extension = extension;
+        tableEntry->WriteIrp = irp;
+        diffAreaFile = extension->DiffAreaFile;
+        ASSERT(diffAreaFile);
+        tableEntry->TargetObject = diffAreaFile->Filter->TargetObject;
+        tableEntry->IsComplete = FALSE;
+        InitializeListHead(&tableEntry->WaitingQueueDpc);
+        InitializeListHead(&tableEntry->CopyRunListEntry);
+        tableEntry->CopyRunLength = 1;
 
-    VspAcquire(extension->Root);
-    if (extension->IgnoreCopyDataReference) {
-        extension->IgnoreCopyDataReference = FALSE;
-        InterlockedDecrement(&extension->Filter->IgnoreCopyData);
-    }
-    VspRelease(extension->Root);
+        InterlockedIncrement((PLONG) &nextSp->Parameters.Write.Length);
 
-    KeAcquireSpinLock(&extension->Root->ESpinLock, &irql);
-    ASSERT(extension->Root->AdjustBitmapInProgress);
-    if (IsListEmpty(&extension->Root->AdjustBitmapQueue)) {
-        extension->Root->AdjustBitmapInProgress = FALSE;
-        KeReleaseSpinLock(&extension->Root->ESpinLock, irql);
-    } else {
-        l = RemoveHeadList(&extension->Root->AdjustBitmapQueue);
-        KeReleaseSpinLock(&extension->Root->ESpinLock, irql);
+        VspAllocateDiffAreaSpace(extension, &tableEntry->TargetOffset,
+                                 &tableEntry->FileOffset, NULL, NULL);
 
-        workItem = CONTAINING_RECORD(l, WORK_QUEUE_ITEM, List);
+        if (runEntry) {
+            if (tableEntry->TargetOffset &&
+                runEntry->CopyRunLength < VSP_MAX_COPY_RUN_BLOCKS &&
+                tableEntry->VolumeOffset == runEntry->VolumeOffset +
+                        runEntry->CopyRunLength*BLOCK_SIZE &&
+                tableEntry->TargetOffset == runEntry->TargetOffset +
+                        runEntry->CopyRunLength*BLOCK_SIZE) {
+
+                InsertTailList(&runEntry->CopyRunListEntry,
+                               &tableEntry->CopyRunListEntry);
+                runEntry->CopyRunLength++;
+                continue;
+            }
 
-        workerRoutine = workItem->WorkerRoutine;
-        parameter = workItem->Parameter;
-        ExInitializeWorkItem(workItem, workerRoutine, parameter);
+            VspStartCopyRun(runEntry);
+            runEntry = NULL;
+        }
 
-        ExQueueWorkItem(workItem, DelayedWorkQueue);
+        if (canCoalesce && tableEntry->TargetOffset) {
+            runEntry = tableEntry;
+            continue;
+        }
+
+        VspStartCopyRun(tableEntry);
     }
 
-    ObDereferenceObject(extension->Filter->TargetObject);
-    ObDereferenceObject(extension->Filter->DeviceObject);
-    ObDereferenceObject(extension->DeviceObject);
+    if (runEntry) {
+        VspStartCopyRun(runEntry);
+    }
+
+    context = (PVSP_CONTEXT) Context;
+    VspFreeContext(filter->Root, context);
+
+    VspReleaseNonPagedResource(extension);
+    VspDecrementIrpRefCount(irp);
 }
 
 VOID
-VspSetIgnorableBlocksInBitmapWorker(
-    IN  PVOID   Context
+VspIrpsTimerDpc(
+    IN  PKDPC   TimerDpc,
+    IN  PVOID   Context,
+    IN  PVOID   SystemArgument1,
+    IN  PVOID   SystemArgument2
     )
 
 {
-    PVSP_CONTEXT        context = (PVSP_CONTEXT) Context;
-    PVOLUME_EXTENSION   extension = context->Extension.Extension;
-    NTSTATUS            status;
+    PFILTER_EXTENSION   filter = (PFILTER_EXTENSION) Context;
     KIRQL               irql;
+    LIST_ENTRY          q;
+    PLIST_ENTRY         l;
+    BOOLEAN             emptyQueue;
 
-    ASSERT(context->Type == VSP_CONTEXT_TYPE_EXTENSION);
-
-    if (!extension->IsDetected) {
-        status = VspMarkFreeSpaceInBitmap(extension, NULL, NULL);
-        if (NT_SUCCESS(status)) {
-            InterlockedExchange(&extension->OkToGrowDiffArea, TRUE);
-        } else {
-            if (!extension->Filter->DestroyAllSnapshotsPending) {
-                VspLogError(extension, NULL,
-                            VS_ABORT_SNAPSHOTS_FAILED_FREE_SPACE_DETECTION,
-                            status, 2, FALSE);
-            }
-            VspDestroyAllSnapshots(extension->Filter, NULL, FALSE, FALSE);
-        }
+    if (TimerDpc) {
+        VspLogError(NULL, filter, VS_FLUSH_AND_HOLD_IRP_TIMEOUT,
+                    STATUS_SUCCESS, 0, FALSE);
     }
 
-    ExInitializeWorkItem(&context->WorkItem, VspAdjustBitmap, context);
+    IoStopTimer(filter->DeviceObject);
 
-    KeAcquireSpinLock(&extension->Root->ESpinLock, &irql);
-    if (extension->Root->AdjustBitmapInProgress) {
-        InsertTailList(&extension->Root->AdjustBitmapQueue,
-                       &context->WorkItem.List);
-        KeReleaseSpinLock(&extension->Root->ESpinLock, irql);
+    KeAcquireSpinLock(&filter->SpinLock, &irql);
+    ASSERT(filter->ExternalWaiter);
+    filter->ExternalWaiter = FALSE;
+    InterlockedIncrement(&filter->RefCount);
+    InterlockedDecrement(&filter->HoldIncomingWrites);
+    if (filter->HoldIncomingWrites) {
+        KeReleaseSpinLock(&filter->SpinLock, irql);
+        VspDecrementRefCount(filter);
+        return;
+    }
+    filter->HoldWritesEndTime = KeQueryInterruptTime();
+    KeResetEvent(&filter->ZeroRefEvent);
+    if (IsListEmpty(&filter->HoldQueue)) {
+        emptyQueue = FALSE;
     } else {
-        extension->Root->AdjustBitmapInProgress = TRUE;
-        KeReleaseSpinLock(&extension->Root->ESpinLock, irql);
-        ExQueueWorkItem(&context->WorkItem, DelayedWorkQueue);
+        emptyQueue = TRUE;
+        q = filter->HoldQueue;
+        InitializeListHead(&filter->HoldQueue);
+    }
+    KeReleaseSpinLock(&filter->SpinLock, irql);
+
+    if (emptyQueue) {
+        q.Blink->Flink = &q;
+        q.Flink->Blink = &q;
+        VspEmptyIrpQueue(filter->Root->DriverObject, &q);
     }
 }
 
 VOID
-VspFreeCopyIrp(
-    IN  PVOLUME_EXTENSION   Extension,
-    IN  PIRP                CopyIrp
+VspEndCommitDpc(
+    IN  PKDPC   TimerDpc,
+    IN  PVOID   Context,
+    IN  PVOID   SystemArgument1,
+    IN  PVOID   SystemArgument2
     )
 
 {
-    KIRQL                           irql;
-    PLIST_ENTRY                     l;
-    PWORK_QUEUE_ITEM                workItem;
-    PTEMP_TRANSLATION_TABLE_ENTRY   tableEntry;
+    PFILTER_EXTENSION   filter = (PFILTER_EXTENSION) Context;
 
-    if (Extension->EmergencyCopyIrp == CopyIrp) {
-        KeAcquireSpinLock(&Extension->SpinLock, &irql);
-        if (IsListEmpty(&Extension->EmergencyCopyIrpQueue)) {
-            Extension->EmergencyCopyIrpInUse = FALSE;
-            KeReleaseSpinLock(&Extension->SpinLock, irql);
-            return;
-        }
-        l = RemoveHeadList(&Extension->EmergencyCopyIrpQueue);
-        KeReleaseSpinLock(&Extension->SpinLock, irql);
+    VspLogError(NULL, filter, VS_END_COMMIT_TIMEOUT, STATUS_CANCELLED, 0,
+                FALSE);
+    InterlockedExchange(&filter->HibernatePending, FALSE);
+    KeSetEvent(&filter->EndCommitProcessCompleted, IO_NO_INCREMENT, FALSE);
+    ObDereferenceObject(filter->DeviceObject);
+}
+
+NTSTATUS
+VspCheckForMemoryPressure(
+    IN  PFILTER_EXTENSION   Filter
+    )
 
-        workItem = CONTAINING_RECORD(l, WORK_QUEUE_ITEM, List);
-        tableEntry = (PTEMP_TRANSLATION_TABLE_ENTRY) workItem->Parameter;
-        tableEntry->CopyIrp = CopyIrp;
+/*++
 
-        workItem->WorkerRoutine(workItem->Parameter);
-        return;
-    }
+Routine Description:
 
-    if (!Extension->EmergencyCopyIrpInUse) {
-        ExFreePool(MmGetMdlVirtualAddress(CopyIrp->MdlAddress));
-        IoFreeMdl(CopyIrp->MdlAddress);
-        IoFreeIrp(CopyIrp);
-        return;
-    }
+    This routine will allocate 256 K of paged and non paged pool.  If these
+    allocs succeed, it indicates that the system is not under memory pressure
+    and so it is ok to hold write irps for the next second.
 
-    KeAcquireSpinLock(&Extension->SpinLock, &irql);
-    if (IsListEmpty(&Extension->EmergencyCopyIrpQueue)) {
-        KeReleaseSpinLock(&Extension->SpinLock, irql);
-        ExFreePool(MmGetMdlVirtualAddress(CopyIrp->MdlAddress));
-        IoFreeMdl(CopyIrp->MdlAddress);
-        IoFreeIrp(CopyIrp);
-        return;
-    }
-    l = RemoveHeadList(&Extension->EmergencyCopyIrpQueue);
-    KeReleaseSpinLock(&Extension->SpinLock, irql);
+Arguments:
 
-    workItem = CONTAINING_RECORD(l, WORK_QUEUE_ITEM, List);
-    tableEntry = (PTEMP_TRANSLATION_TABLE_ENTRY) workItem->Parameter;
-    tableEntry->CopyIrp = CopyIrp;
+    Filter  - Supplies the filter extension.
 
-    workItem->WorkerRoutine(workItem->Parameter);
-}
-
-VOID
-VspApplyThresholdDelta(
-    IN  PVOLUME_EXTENSION   Extension,
-    IN  ULONG               IncreaseDelta
-    )
+Return Value:
 
-{
-    PVSP_DIFF_AREA_FILE diffAreaFile;
-    PVSP_CONTEXT        context;
-    KIRQL               irql;
+    NTSTATUS
 
-    ASSERT(Extension->DiffAreaFile);
-    diffAreaFile = Extension->DiffAreaFile;
+--*/
 
-    if (diffAreaFile->NextAvailable + Extension->DiffAreaFileIncrease <=
-        diffAreaFile->AllocatedFileSize) {
+{
+    PVOID   p, np;
 
-        return;
+    p = ExAllocatePoolWithTagPriority(PagedPool,
+            MEMORY_PRESSURE_CHECK_ALLOC_SIZE, VOLSNAP_TAG_SHORT_TERM,
+            LowPoolPriority);
+    if (!p) {
+        VspLogError(NULL, Filter, VS_MEMORY_PRESSURE_DURING_LOVELACE,
+                    STATUS_INSUFFICIENT_RESOURCES, 1, FALSE);
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    if (diffAreaFile->NextAvailable + Extension->DiffAreaFileIncrease -
-        IncreaseDelta > diffAreaFile->AllocatedFileSize) {
-
-        return;
+    np = ExAllocatePoolWithTagPriority(NonPagedPool,
+            MEMORY_PRESSURE_CHECK_ALLOC_SIZE, VOLSNAP_TAG_SHORT_TERM,
+            LowPoolPriority);
+    if (!np) {
+        ExFreePool(p);
+        VspLogError(NULL, Filter, VS_MEMORY_PRESSURE_DURING_LOVELACE,
+                    STATUS_INSUFFICIENT_RESOURCES, 2, FALSE);
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    context = VspAllocateContext(Extension->Root);
-    if (!context) {
-        if (!Extension->OkToGrowDiffArea) {
-            VspLogError(Extension, diffAreaFile->Filter,
-                        VS_GROW_BEFORE_FREE_SPACE, STATUS_SUCCESS, 3, FALSE);
-        }
-        return;
-    }
+    ExFreePool(np);
+    ExFreePool(p);
 
-    KeAcquireSpinLock(&Extension->SpinLock, &irql);
-    ASSERT(!Extension->GrowDiffAreaFilePending);
-    ASSERT(IsListEmpty(&Extension->WaitingForDiffAreaSpace));
-    Extension->PastFileSystemOperations = FALSE;
-    Extension->GrowDiffAreaFilePending = TRUE;
-    KeReleaseSpinLock(&Extension->SpinLock, irql);
+    return STATUS_SUCCESS;
+}
+
+VOID
+VspOneSecondTimerWorker(
+    IN  PDEVICE_OBJECT  DeviceObject,
+    IN  PVOID           WorkItem
+    )
 
-    context->Type = VSP_CONTEXT_TYPE_GROW_DIFF_AREA;
-    ExInitializeWorkItem(&context->WorkItem, VspGrowDiffArea, context);
-    context->GrowDiffArea.Extension = Extension;
-    ObReferenceObject(Extension->DeviceObject);
+{
+    PFILTER_EXTENSION   filter = (PFILTER_EXTENSION) DeviceObject->DeviceExtension;
+    PIO_WORKITEM        workItem = (PIO_WORKITEM) WorkItem;
+    NTSTATUS            status;
 
-    if (!Extension->OkToGrowDiffArea) {
-        ObReferenceObject(Extension->Filter->DeviceObject);
-        ExInitializeWorkItem(&context->WorkItem, VspWaitForInstall, context);
-        ExQueueWorkItem(&context->WorkItem, DelayedWorkQueue);
-        return;
+    status = VspCheckForMemoryPressure(filter);
+    if (!NT_SUCCESS(status)) {
+        InterlockedExchange(&filter->LastReleaseDueToMemoryPressure, TRUE);
+        VspReleaseWrites(filter);
     }
 
-    VspQueueWorkItem(Extension->Root, &context->WorkItem, 0);
+    IoFreeWorkItem(workItem);
 }
 
-NTSTATUS
-VspCheckOnDiskNotCommitted(
-    IN  PVOLUME_EXTENSION   Extension
+VOID
+VspOneSecondTimer(
+    IN  PDEVICE_OBJECT  DeviceObject,
+    IN  PVOID           Filter
     )
 
-{
-    PFILTER_EXTENSION           filter = Extension->Filter;
-    NTSTATUS                    status;
-    UCHAR                       controlItemBuffer[VSP_BYTES_PER_CONTROL_ITEM];
-    PVSP_CONTROL_ITEM_SNAPSHOT  snapshotControlItem;
+/*++
+
+Routine Description:
+
+    This routine will get called once every second after an IoStartTimer.
+    This routine checks for memory pressure and aborts the lovelace operation
+    if any memory pressure is detected.
 
-    if (!Extension->OnDiskNotCommitted) {
-        return STATUS_SUCCESS;
-    }
+Arguments:
 
-    Extension->OnDiskNotCommitted = FALSE;
+    DeviceObject    - Supplies the device object.
 
-    status = VspIoControlItem(filter, VSP_CONTROL_ITEM_TYPE_SNAPSHOT,
-                              &Extension->SnapshotGuid, FALSE,
-                              controlItemBuffer, FALSE);
-    if (!NT_SUCCESS(status)) {
-        if (!filter->DestroyAllSnapshotsPending) {
-            VspLogError(Extension, filter, VS_ABORT_SNAPSHOTS_IO_FAILURE,
-                        status, 16, FALSE);
-        }
-        VspDestroyAllSnapshots(filter, NULL, FALSE, FALSE);
-        return status;
-    }
+    Filter          - Supplies the filter extension.
 
-    snapshotControlItem = (PVSP_CONTROL_ITEM_SNAPSHOT) controlItemBuffer;
-    snapshotControlItem->SnapshotOrderNumber =
-            Extension->SnapshotOrderNumber;
-    snapshotControlItem->SnapshotTime = Extension->CommitTimeStamp;
+Return Value:
 
-    if (Extension->ContainsCrashdumpFile) {
-        snapshotControlItem->SnapshotControlItemFlags =
-                VSP_SNAPSHOT_CONTROL_ITEM_FLAG_DIRTY_CRASHDUMP;
-    }
+    None.
 
-    if (Extension->NoDiffAreaFill) {
-        snapshotControlItem->SnapshotControlItemFlags |=
-                VSP_SNAPSHOT_CONTROL_ITEM_FLAG_NO_DIFF_AREA_FILL;
-    }
+--*/
 
-    status = VspIoControlItem(filter, VSP_CONTROL_ITEM_TYPE_SNAPSHOT,
-                              &Extension->SnapshotGuid, TRUE,
-                              controlItemBuffer, FALSE);
-    if (!NT_SUCCESS(status)) {
-        if (!filter->DestroyAllSnapshotsPending) {
-            VspLogError(Extension, filter, VS_ABORT_SNAPSHOTS_IO_FAILURE,
-                        status, 17, FALSE);
-        }
-        VspDestroyAllSnapshots(filter, NULL, FALSE, FALSE);
-        return status;
+{
+    PFILTER_EXTENSION   filter = (PFILTER_EXTENSION) Filter;
+    PIO_WORKITEM        workItem;
+
+    workItem = IoAllocateWorkItem(filter->DeviceObject);
+    if (!workItem) {
+        VspLogError(NULL, filter, VS_MEMORY_PRESSURE_DURING_LOVELACE,
+                    STATUS_INSUFFICIENT_RESOURCES, 3, FALSE);
+        VspReleaseWrites(filter);
+        return;
     }
 
-    return STATUS_SUCCESS;
+    IoQueueWorkItem(workItem, VspOneSecondTimerWorker, CriticalWorkQueue,
+                    workItem);
 }
 
-VOID
-VspWriteVolume(
-    IN  PVOID   Context
+NTSTATUS
+VolSnapAddDevice(
+    IN  PDRIVER_OBJECT  DriverObject,
+    IN  PDEVICE_OBJECT  PhysicalDeviceObject
     )
 
 /*++
 
 Routine Description:
 
-    This routine performs a volume write, making sure that all of the
-    parts of the volume write have an old version of the data placed
-    in the diff area for the snapshot.
+    This routine creates and initializes a new FILTER for the corresponding
+    volume PDO.
 
 Arguments:
 
-    Irp - Supplies the I/O request packet.
+    DriverObject            - Supplies the VOLSNAP driver object.
+
+    PhysicalDeviceObject    - Supplies the volume PDO.
 
 Return Value:
 
-    None.
+    NTSTATUS
 
 --*/
 
 {
-    PVSP_CONTEXT                    context = (PVSP_CONTEXT) Context;
-    PVOLUME_EXTENSION               extension = context->WriteVolume.Extension;
-    PIRP                            irp = (PIRP) context->WriteVolume.Irp;
-    PIO_STACK_LOCATION              irpSp = IoGetCurrentIrpStackLocation(irp);
-    PIO_STACK_LOCATION              nextSp = IoGetNextIrpStackLocation(irp);
-    PFILTER_EXTENSION               filter = extension->Filter;
-    NTSTATUS                        status;
-    PLIST_ENTRY                     l;
-    LONGLONG                        start, end, roundedStart, roundedEnd;
-    ULONG                           irpLength, increase, increaseDelta;
-    TEMP_TRANSLATION_TABLE_ENTRY    keyTableEntry;
-    PTEMP_TRANSLATION_TABLE_ENTRY   tableEntry;
-    PVOID                           nodeOrParent;
-    TABLE_SEARCH_RESULT             searchResult;
-    KIRQL                           irql;
-    CCHAR                           stackSize;
-    PVSP_DIFF_AREA_FILE             diffAreaFile;
-    PDO_EXTENSION                   rootExtension;
-    PVOID                           buffer;
-    PMDL                            mdl;
-
-    ASSERT(context->Type == VSP_CONTEXT_TYPE_WRITE_VOLUME);
+    NTSTATUS                status;
+    PDEVICE_OBJECT          deviceObject;
+    PDO_EXTENSION           rootExtension;
+    PFILTER_EXTENSION       filter;
 
-    if (extension->OnDiskNotCommitted) {
-        status = VspCheckOnDiskNotCommitted(extension);
-        if (!NT_SUCCESS(status)) {
-            VspFreeContext(filter->Root, context);
-            VspReleaseNonPagedResource(extension);
-            VspDecrementIrpRefCount(irp);
-            return;
-        }
+    status = IoCreateDevice(DriverObject, sizeof(FILTER_EXTENSION),
+                            NULL, FILE_DEVICE_UNKNOWN, 0, FALSE, &deviceObject);
+    if (!NT_SUCCESS(status)) {
+        return status;
     }
 
-    start = irpSp->Parameters.Read.ByteOffset.QuadPart;
-    irpLength = irpSp->Parameters.Read.Length;
-    end = start + irpLength;
-    if (context->WriteVolume.RoundedStart) {
-        roundedStart = context->WriteVolume.RoundedStart;
-    } else {
-        roundedStart = start&(~(BLOCK_SIZE - 1));
+    rootExtension = (PDO_EXTENSION)
+                    IoGetDriverObjectExtension(DriverObject, VolSnapAddDevice);
+    if (!rootExtension) {
+        IoDeleteDevice(deviceObject);
+        return STATUS_NO_SUCH_DEVICE;
     }
-    roundedEnd = end&(~(BLOCK_SIZE - 1));
-    if (roundedEnd != end) {
-        roundedEnd += BLOCK_SIZE;
+
+    filter = (PFILTER_EXTENSION) deviceObject->DeviceExtension;
+    RtlZeroMemory(filter, sizeof(FILTER_EXTENSION));
+    filter->DeviceObject = deviceObject;
+    filter->Root = rootExtension;
+    filter->DeviceExtensionType = DEVICE_EXTENSION_FILTER;
+    KeInitializeSpinLock(&filter->SpinLock);
+
+    filter->TargetObject =
+            IoAttachDeviceToDeviceStack(deviceObject, PhysicalDeviceObject);
+    if (!filter->TargetObject) {
+        IoDeleteDevice(deviceObject);
+        return STATUS_NO_SUCH_DEVICE;
     }
 
-    ASSERT(extension->VolumeBlockBitmap);
+    filter->Pdo = PhysicalDeviceObject;
+    KeInitializeSemaphore(&filter->ControlBlockFileHandleSemaphore, 1, 1);
+    InitializeListHead(&filter->SnapshotLookupTableEntries);
+    InitializeListHead(&filter->DiffAreaLookupTableEntries);
+    KeInitializeEvent(&filter->ControlBlockFileHandleReady, NotificationEvent,
+                      TRUE);
+    filter->RefCount = 1;
+    InitializeListHead(&filter->HoldQueue);
+    KeInitializeEvent(&filter->ZeroRefEvent, NotificationEvent, FALSE);
+    KeInitializeSemaphore(&filter->ZeroRefSemaphore, 1, 1);
+    KeInitializeTimer(&filter->HoldWritesTimer);
+    KeInitializeDpc(&filter->HoldWritesTimerDpc, VspIrpsTimerDpc, filter);
+    KeInitializeEvent(&filter->EndCommitProcessCompleted, NotificationEvent,
+                      TRUE);
+    InitializeListHead(&filter->VolumeList);
+    KeInitializeSemaphore(&filter->CriticalOperationSemaphore, 1, 1);
+    InitializeListHead(&filter->DeadVolumeList);
+    InitializeListHead(&filter->DiffAreaFilesOnThisFilter);
+    InitializeListHead(&filter->CopyOnWriteList);
+    VspInitializeReadCache(filter);
 
-    for (; roundedStart < roundedEnd; roundedStart += BLOCK_SIZE) {
+    filter->DiffAreaVolume = filter;
 
-        if (roundedStart < 0 ||
-            roundedStart >= extension->VolumeSize) {
+    KeInitializeTimer(&filter->EndCommitTimer);
+    KeInitializeDpc(&filter->EndCommitTimerDpc, VspEndCommitDpc, filter);
 
-            continue;
-        }
+    InitializeListHead(&filter->NonPagedResourceList);
+    InitializeListHead(&filter->PagedResourceList);
 
-        KeAcquireSpinLock(&extension->SpinLock, &irql);
-        if (RtlCheckBit(extension->VolumeBlockBitmap,
-                        (ULONG) (roundedStart>>BLOCK_SHIFT))) {
+    filter->EpicNumber = 1;
 
-            KeReleaseSpinLock(&extension->SpinLock, irql);
-            continue;
-        }
-        KeReleaseSpinLock(&extension->SpinLock, irql);
+    status = IoInitializeTimer(deviceObject, VspOneSecondTimer, filter);
+    if (!NT_SUCCESS(status)) {
+        IoDetachDevice(filter->TargetObject);
+        IoDeleteDevice(deviceObject);
+        return status;
+    }
 
-        keyTableEntry.VolumeOffset = roundedStart;
+    deviceObject->DeviceType = filter->TargetObject->DeviceType;
 
-        tableEntry = (PTEMP_TRANSLATION_TABLE_ENTRY)
-                     RtlLookupElementGenericTableFull(
-                     &extension->TempVolumeBlockTable, &keyTableEntry,
-                     &nodeOrParent, &searchResult);
+    deviceObject->Flags |= DO_DIRECT_IO;
+    if (filter->TargetObject->Flags & DO_POWER_PAGABLE) {
+        deviceObject->Flags |= DO_POWER_PAGABLE;
+    }
+    if (filter->TargetObject->Flags & DO_POWER_INRUSH) {
+        deviceObject->Flags |= DO_POWER_INRUSH;
+    }
 
-        if (tableEntry) {
+    deviceObject->Characteristics |=
+        (filter->Pdo->Characteristics&FILE_CHARACTERISTICS_PROPAGATED);
 
-            context = VspAllocateContext(extension->Root);
-            if (context) {
-                context->Type = VSP_CONTEXT_TYPE_EXTENSION;
-                context->Extension.Extension = extension;
-                context->Extension.Irp = irp;
-            } else {
-                context = (PVSP_CONTEXT) Context;
-                ASSERT(context->Type == VSP_CONTEXT_TYPE_WRITE_VOLUME);
-                context->WriteVolume.RoundedStart = roundedStart;
-            }
-            ExInitializeWorkItem(&context->WorkItem,
-                                 VspDecrementIrpRefCountWorker, context);
+    VspAcquire(filter->Root);
+    if (filter->TargetObject->StackSize > filter->Root->StackSize) {
+        InterlockedExchange(&filter->Root->StackSize,
+                            (LONG) filter->TargetObject->StackSize);
+    }
+    InsertTailList(&filter->Root->FilterList, &filter->ListEntry);
+    VspRelease(filter->Root);
 
-            KeAcquireSpinLock(&extension->SpinLock, &irql);
-            if (tableEntry->IsComplete) {
-                KeReleaseSpinLock(&extension->SpinLock, irql);
-                if (context->Type == VSP_CONTEXT_TYPE_EXTENSION) {
-                    VspFreeContext(extension->Root, context);
-                }
-                continue;
-            }
-            InterlockedIncrement((PLONG) &nextSp->Parameters.Write.Length);
-            InsertTailList(&tableEntry->WaitingQueueDpc,
-                           &context->WorkItem.List);
-            KeReleaseSpinLock(&extension->SpinLock, irql);
+    deviceObject->Flags &= ~DO_DEVICE_INITIALIZING;
 
-            if (context == Context) {
-                VspReleaseNonPagedResource(extension);
-                return;
-            }
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+VolSnapCreate(
+    IN  PDEVICE_OBJECT  DeviceObject,
+    IN  PIRP            Irp
+    )
+
+/*++
+
+Routine Description:
 
-            continue;
-        }
+    This routine is the dispatch for IRP_MJ_CREATE.
 
-        RtlZeroMemory(&keyTableEntry, sizeof(TEMP_TRANSLATION_TABLE_ENTRY));
-        keyTableEntry.VolumeOffset = roundedStart;
+Arguments:
 
-        ASSERT(!extension->TempTableEntry);
-        extension->TempTableEntry =
-                VspAllocateTempTableEntry(extension->Root);
-        if (!extension->TempTableEntry) {
-            rootExtension = extension->Root;
-            KeAcquireSpinLock(&rootExtension->ESpinLock, &irql);
-            if (rootExtension->EmergencyTableEntryInUse) {
-                context = (PVSP_CONTEXT) Context;
-                ASSERT(context->Type == VSP_CONTEXT_TYPE_WRITE_VOLUME);
-                context->WriteVolume.RoundedStart = roundedStart;
-                InsertTailList(&rootExtension->WorkItemWaitingList,
-                               &context->WorkItem.List);
-                if (!rootExtension->WorkItemWaitingListNeedsChecking) {
-                    InterlockedExchange(
-                            &rootExtension->WorkItemWaitingListNeedsChecking,
-                            TRUE);
-                }
-                KeReleaseSpinLock(&rootExtension->ESpinLock, irql);
-                VspReleaseNonPagedResource(extension);
-                return;
-            }
-            rootExtension->EmergencyTableEntryInUse = TRUE;
-            KeReleaseSpinLock(&rootExtension->ESpinLock, irql);
+    DeviceObject - Supplies the device object.
 
-            extension->TempTableEntry = rootExtension->EmergencyTableEntry;
-        }
+    Irp          - Supplies the IO request block.
 
-        tableEntry = (PTEMP_TRANSLATION_TABLE_ENTRY)
-                     RtlInsertElementGenericTableFull(
-                     &extension->TempVolumeBlockTable, &keyTableEntry,
-                     sizeof(TEMP_TRANSLATION_TABLE_ENTRY), NULL,
-                     nodeOrParent, searchResult);
-        ASSERT(tableEntry);
+Return Value:
 
-        if (extension->TempVolumeBlockTable.NumberGenericTableElements >
-            extension->MaximumNumberOfTempEntries) {
+    NTSTATUS
 
-            extension->MaximumNumberOfTempEntries =
-                    extension->TempVolumeBlockTable.NumberGenericTableElements;
-            VspQueryDiffAreaFileIncrease(extension, &increase);
-            ASSERT(increase >= extension->DiffAreaFileIncrease);
-            increaseDelta = increase - extension->DiffAreaFileIncrease;
-            if (increaseDelta) {
-                InterlockedExchange((PLONG) &extension->DiffAreaFileIncrease,
-                                    (LONG) increase);
-                VspApplyThresholdDelta(extension, increaseDelta);
-            }
-        }
+--*/
 
-        tableEntry->Extension = extension;
-        tableEntry->WriteIrp = irp;
-        diffAreaFile = extension->DiffAreaFile;
-        ASSERT(diffAreaFile);
-        tableEntry->TargetObject = diffAreaFile->Filter->TargetObject;
-        tableEntry->IsComplete = FALSE;
-        InitializeListHead(&tableEntry->WaitingQueueDpc);
+{
+    PFILTER_EXTENSION   filter = (PFILTER_EXTENSION) DeviceObject->DeviceExtension;
 
-        tableEntry->CopyIrp = IoAllocateIrp(
-                              (CCHAR) extension->Root->StackSize, FALSE);
-        buffer = ExAllocatePoolWithTagPriority(NonPagedPool, BLOCK_SIZE,
-                                               VOLSNAP_TAG_BUFFER,
-                                               LowPoolPriority);
-        mdl = IoAllocateMdl(buffer, BLOCK_SIZE, FALSE, FALSE, NULL);
-
-        if (!tableEntry->CopyIrp || !buffer || !mdl) {
-            if (tableEntry->CopyIrp) {
-                IoFreeIrp(tableEntry->CopyIrp);
-                tableEntry->CopyIrp = NULL;
-            }
-            if (buffer) {
-                ExFreePool(buffer);
-            }
-            if (mdl) {
-                IoFreeMdl(mdl);
-            }
-            KeAcquireSpinLock(&extension->SpinLock, &irql);
-            if (extension->EmergencyCopyIrpInUse) {
-                InterlockedIncrement((PLONG) &nextSp->Parameters.Write.Length);
-                ExInitializeWorkItem(&tableEntry->WorkItem,
-                                     VspWriteVolumePhase1, tableEntry);
-                InsertTailList(&extension->EmergencyCopyIrpQueue,
-                               &tableEntry->WorkItem.List);
-                KeReleaseSpinLock(&extension->SpinLock, irql);
-                continue;
-            }
-            extension->EmergencyCopyIrpInUse = TRUE;
-            KeReleaseSpinLock(&extension->SpinLock, irql);
+    if (filter->DeviceExtensionType == DEVICE_EXTENSION_FILTER) {
+        IoSkipCurrentIrpStackLocation(Irp);
+        return IoCallDriver(filter->TargetObject, Irp);
+    }
 
-            tableEntry->CopyIrp = extension->EmergencyCopyIrp;
+    ASSERT(filter->DeviceExtensionType == DEVICE_EXTENSION_VOLUME);
 
-        } else {
-            MmBuildMdlForNonPagedPool(mdl);
-            tableEntry->CopyIrp->MdlAddress = mdl;
-        }
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    return STATUS_SUCCESS;
+}
+
+VOID
+VspQueryReadCacheSize(
+    IN  PDO_EXTENSION   RootExtension,
+    OUT PULONG          MaximumBlocks
+    )
 
-        InterlockedIncrement((PLONG) &nextSp->Parameters.Write.Length);
+{
+    ULONG                       zero, size;
+    RTL_QUERY_REGISTRY_TABLE    queryTable[2];
+    NTSTATUS                    status;
 
-        VspAllocateDiffAreaSpace(extension, &tableEntry->TargetOffset,
-                                 &tableEntry->FileOffset, NULL, NULL);
+    zero = 0;
+
+    RtlZeroMemory(queryTable, 2*sizeof(RTL_QUERY_REGISTRY_TABLE));
+    queryTable[0].Flags = RTL_QUERY_REGISTRY_DIRECT;
+    queryTable[0].Name = L"DiffAreaReadCacheSize";
+    queryTable[0].EntryContext = &size;
+    queryTable[0].DefaultType = REG_DWORD;
+    queryTable[0].DefaultData = &zero;
+    queryTable[0].DefaultLength = sizeof(ULONG);
 
-        VspWriteVolumePhase1(tableEntry);
+    status = RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE,
+                                    RootExtension->RegistryPath.Buffer,
+                                    queryTable, NULL, NULL);
+    if (!NT_SUCCESS(status)) {
+        size = zero;
     }
 
-    context = (PVSP_CONTEXT) Context;
-    VspFreeContext(filter->Root, context);
+    if (size > 1024) {
+        size = 1024;
+    }
 
-    VspReleaseNonPagedResource(extension);
-    VspDecrementIrpRefCount(irp);
+    *MaximumBlocks = size*((1024*1024)/BLOCK_SIZE);
 }
 
 VOID
-VspIrpsTimerDpc(
-    IN  PKDPC   TimerDpc,
-    IN  PVOID   Context,
-    IN  PVOID   SystemArgument1,
-    IN  PVOID   SystemArgument2
+VspInitializeReadCache(
+    IN  PFILTER_EXTENSION   Filter
     )
 
+/*++
+
+Routine Description:
+
+    This routine initializes the diff area read cache for the given filter.
+    The size of the cache, in megabytes, comes from the
+    'DiffAreaReadCacheSize' registry value and is 0, disabling the cache,
+    by default.  The blocks themselves are allocated as they are needed.
+
+Arguments:
+
+    Filter  - Supplies the filter extension.
+
+Return Value:
+
+    None.
+
+--*/
+
 {
-    PFILTER_EXTENSION   filter = (PFILTER_EXTENSION) Context;
-    KIRQL               irql;
-    LIST_ENTRY          q;
-    PLIST_ENTRY         l;
-    BOOLEAN             emptyQueue;
+    PVSP_READ_CACHE cache = &Filter->ReadCache;
+    ULONG           maximumBlocks, numberOfLists, i;
 
-    if (TimerDpc) {
-        VspLogError(NULL, filter, VS_FLUSH_AND_HOLD_IRP_TIMEOUT,
-                    STATUS_SUCCESS, 0, FALSE);
+    KeInitializeSpinLock(&cache->SpinLock);
+    InitializeListHead(&cache->LruList);
+
+    VspQueryReadCacheSize(Filter->Root, &maximumBlocks);
+    if (!maximumBlocks) {
+        return;
     }
 
-    IoStopTimer(filter->DeviceObject);
+    for (numberOfLists = 1; numberOfLists < maximumBlocks;
+         numberOfLists <<= 1) {
+    }
 
-    KeAcquireSpinLock(&filter->SpinLock, &irql);
-    ASSERT(filter->ExternalWaiter);
-    filter->ExternalWaiter = FALSE;
-    InterlockedIncrement(&filter->RefCount);
-    InterlockedDecrement(&filter->HoldIncomingWrites);
-    if (filter->HoldIncomingWrites) {
-        KeReleaseSpinLock(&filter->SpinLock, irql);
-        VspDecrementRefCount(filter);
+    cache->HashTable = (PLIST_ENTRY)
+                       ExAllocatePoolWithTag(NonPagedPool,
+                                             numberOfLists*sizeof(LIST_ENTRY),
+                                             VOLSNAP_TAG_READ_CACHE);
+    if (!cache->HashTable) {
         return;
     }
-    KeResetEvent(&filter->ZeroRefEvent);
-    if (IsListEmpty(&filter->HoldQueue)) {
-        emptyQueue = FALSE;
-    } else {
-        emptyQueue = TRUE;
-        q = filter->HoldQueue;
-        InitializeListHead(&filter->HoldQueue);
-    }
-    KeReleaseSpinLock(&filter->SpinLock, irql);
 
-    if (emptyQueue) {
-        q.Blink->Flink = &q;
-        q.Flink->Blink = &q;
-        VspEmptyIrpQueue(filter->Root->DriverObject, &q);
+    for (i = 0; i < numberOfLists; i++) {
+        InitializeListHead(&cache->HashTable[i]);
     }
+
+    cache->HashMask = numberOfLists - 1;
+    cache->MaximumBlocks = maximumBlocks;
 }
 
-VOID
-VspEndCommitDpc(
-    IN  PKDPC   TimerDpc,
-    IN  PVOID   Context,
-    IN  PVOID   SystemArgument1,
-    IN  PVOID   SystemArgument2
+PLIST_ENTRY
+VspReadCacheHashList(
+    IN  PVSP_READ_CACHE Cache,
+    IN  PDEVICE_OBJECT  TargetObject,
+    IN  LONGLONG        TargetOffset
     )
 
 {
-    PFILTER_EXTENSION   filter = (PFILTER_EXTENSION) Context;
+    ULONG   hash;
 
-    VspLogError(NULL, filter, VS_END_COMMIT_TIMEOUT, STATUS_CANCELLED, 0,
-                FALSE);
-    InterlockedExchange(&filter->HibernatePending, FALSE);
-    KeSetEvent(&filter->EndCommitProcessCompleted, IO_NO_INCREMENT, FALSE);
-    ObDereferenceObject(filter->DeviceObject);
+    hash = ((ULONG) (TargetOffset>>BLOCK_SHIFT))*0x9E3779B1;
+    hash ^= (ULONG) (((ULONG_PTR) TargetObject)>>4);
+
+    return &Cache->HashTable[(hash ^ (hash>>16))&Cache->HashMask];
 }
 
-NTSTATUS
-VspCheckForMemoryPressure(
-    IN  PFILTER_EXTENSION   Filter
+PVSP_READ_CACHE_BLOCK
+VspLookupReadCache(
+    IN  PVSP_READ_CACHE Cache,
+    IN  PDEVICE_OBJECT  TargetObject,
+    IN  LONGLONG        TargetOffset
     )
 
 /*++
 
 Routine Description:
 
-    This routine will allocate 256 K of paged and non paged pool.  If these
-    allocs succeed, it indicates that the system is not under memory pressure
-    and so it is ok to hold write irps for the next second.
+    This routine looks up the given diff area block in the read cache.
 
 Arguments:
 
-    Filter  - Supplies the filter extension.
+    Cache           - Supplies the read cache.
+
+    TargetObject    - Supplies the diff area volume.
+
+    TargetOffset    - Supplies the offset of the block on the diff area
+                        volume.
 
 Return Value:
 
-    NTSTATUS
+    The cached block or NULL.
+
+Notes:
+
+    Callers of this routine must be holding 'Cache->SpinLock'.
 
 --*/
 
 {
-    PVOID   p, np;
+    PLIST_ENTRY             hashList;
+    PLIST_ENTRY             l;
+    PVSP_READ_CACHE_BLOCK   block;
 
-    p = ExAllocatePoolWithTagPriority(PagedPool,
-            MEMORY_PRESSURE_CHECK_ALLOC_SIZE, VOLSNAP_TAG_SHORT_TERM,
-            LowPoolPriority);
-    if (!p) {
-        VspLogError(NULL, Filter, VS_MEMORY_PRESSURE_DURING_LOVELACE,
-                    STATUS_INSUFFICIENT_RESOURCES, 1, FALSE);
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
+    hashList = VspReadCacheHashList(Cache, TargetObject, TargetOffset);
 
-    np = ExAllocatePoolWithTagPriority(NonPagedPool,
-            MEMORY_PRESSURE_CHECK_ALLOC_SIZE, VOLSNAP_TAG_SHORT_TERM,
-            LowPoolPriority);
-    if (!np) {
-        ExFreePool(p);
-        VspLogError(NULL, Filter, VS_MEMORY_PRESSURE_DURING_LOVELACE,
-                    STATUS_INSUFFICIENT_RESOURCES, 2, FALSE);
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
+    for (l = hashList->Flink; l != hashList; l = l->Flink) {
+        block = CONTAINING_RECORD(l, VSP_READ_CACHE_BLOCK, HashListEntry);
+        if (block->TargetOffset == TargetOffset &&
+            block->TargetObject == TargetObject) {
 
-    ExFreePool(np);
-    ExFreePool(p);
+            return block;
+        }
+    }
 
-    return STATUS_SUCCESS;
+    return NULL;
 }
 
 VOID
-VspOneSecondTimerWorker(
-    IN  PDEVICE_OBJECT  DeviceObject,
-    IN  PVOID           WorkItem
+VspInsertReadCache(
+    IN  PFILTER_EXTENSION   Filter,
+    IN  PVSP_CONTEXT        Context,
+    IN  PVOID               Buffer
     )
 
-{
-    PFILTER_EXTENSION   filter = (PFILTER_EXTENSION) DeviceObject->DeviceExtension;
-    PIO_WORKITEM        workItem = (PIO_WORKITEM) WorkItem;
-    NTSTATUS            status;
+/*++
+
+Routine Description:
+
+    This routine puts a diff area block that was just read for a snapshot
+    read into the read cache, evicting the least recently used block if
+    the cache is full.  The block is not cached if the cache was
+    invalidated since the read was started.
+
+Arguments:
+
+    Filter  - Supplies the filter extension.
+
+    Context - Supplies the read snapshot context of the read.
+
+    Buffer  - Supplies the data of the block.  The cache takes ownership
+                of this buffer.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PVSP_CONTEXT            context = Context;
+    PVSP_READ_CACHE         cache = &Filter->ReadCache;
+    PVSP_READ_CACHE_BLOCK   block;
+    PLIST_ENTRY             l;
+    KIRQL                   irql;
+
+    KeAcquireSpinLock(&cache->SpinLock, &irql);
+
+    if (context->ReadSnapshot.CacheGeneration != cache->Generation ||
+        VspLookupReadCache(cache, context->ReadSnapshot.TargetObject,
+                           context->ReadSnapshot.TargetOffset)) {
+
+        KeReleaseSpinLock(&cache->SpinLock, irql);
+        ExFreePool(Buffer);
+        return;
+    }
+
+    if (cache->NumberOfBlocks < cache->MaximumBlocks) {
+        block = (PVSP_READ_CACHE_BLOCK)
+                ExAllocatePoolWithTagPriority(NonPagedPool,
+                                              sizeof(VSP_READ_CACHE_BLOCK),
+                                              VOLSNAP_TAG_READ_CACHE,
+                                              LowPoolPriority);
+        if (block) {
+            cache->NumberOfBlocks++;
+        }
+    } else {
+        block = NULL;
+    }
 
-    status = VspCheckForMemoryPressure(filter);
-    if (!NT_SUCCESS(status)) {
-        InterlockedExchange(&filter->LastReleaseDueToMemoryPressure, TRUE);
-        VspReleaseWrites(filter);
+    if (!block) {
+        if (IsListEmpty(&cache->LruList)) {
+            KeReleaseSpinLock(&cache->SpinLock, irql);
+            ExFreePool(Buffer);
+            return;
+        }
+
+        l = RemoveTailList(&cache->LruList);
+        block = CONTAINING_RECORD(l, VSP_READ_CACHE_BLOCK, LruListEntry);
+        RemoveEntryList(&block->HashListEntry);
+        ExFreePool(block->Buffer);
+        cache->Evictions++;
     }
 
-    IoFreeWorkItem(workItem);
+    block->TargetObject = context->ReadSnapshot.TargetObject;
+    block->TargetOffset = context->ReadSnapshot.TargetOffset;
+    block->Owner = context->ReadSnapshot.CacheOwner;
+    block->Buffer = Buffer;
+
+    InsertHeadList(&cache->LruList, &block->LruListEntry);
+    InsertHeadList(VspReadCacheHashList(cache, block->TargetObject,
+                                        block->TargetOffset),
+                   &block->HashListEntry);
+
+    KeReleaseSpinLock(&cache->SpinLock, irql);
 }
 
 VOID
-VspOneSecondTimer(
-    IN  PDEVICE_OBJECT  DeviceObject,
-    IN  PVOID           Filter
+VspInvalidateReadCache(
+    IN  PFILTER_EXTENSION   Filter,
+    IN  PVOLUME_EXTENSION   Owner
     )
 
 /*++
 
 Routine Description:
 
-    This routine will get called once every second after an IoStartTimer.
-    This routine checks for memory pressure and aborts the lovelace operation
-    if any memory pressure is detected.
+    This routine drops all of the blocks cached for the given snapshot
+    from the read cache.  It is called when the snapshot is deleted, after
+    which its diff area space can be reused.
 
 Arguments:
 
-    DeviceObject    - Supplies the device object.
+    Filter  - Supplies the filter extension.
 
-    Filter          - Supplies the filter extension.
+    Owner   - Supplies the snapshot being deleted.
 
 Return Value:
 
@@ -6826,180 +7747,258 @@ Return Value:
 --*/
 
 {
-    PFILTER_EXTENSION   filter = (PFILTER_EXTENSION) Filter;
-    PIO_WORKITEM        workItem;
+    PVSP_READ_CACHE         cache = &Filter->ReadCache;
+    KIRQL                   irql;
+    LIST_ENTRY              q;
+    PLIST_ENTRY             l, next;
+    PVSP_READ_CACHE_BLOCK   block;
 
-    workItem = IoAllocateWorkItem(filter->DeviceObject);
-    if (!workItem) {
-        VspLogError(NULL, filter, VS_MEMORY_PRESSURE_DURING_LOVELACE,
-                    STATUS_INSUFFICIENT_RESOURCES, 3, FALSE);
-        VspReleaseWrites(filter);
+    if (!cache->MaximumBlocks) {
         return;
     }
 
-    IoQueueWorkItem(workItem, VspOneSecondTimerWorker, CriticalWorkQueue,
-                    workItem);
+    InitializeListHead(&q);
+
+    KeAcquireSpinLock(&cache->SpinLock, &irql);
+    cache->Generation++;
+    for (l = cache->LruList.Flink; l != &cache->LruList; l = next) {
+        next = l->Flink;
+        block = CONTAINING_RECORD(l, VSP_READ_CACHE_BLOCK, LruListEntry);
+        if (block->Owner != Owner) {
+            continue;
+        }
+        RemoveEntryList(&block->LruListEntry);
+        RemoveEntryList(&block->HashListEntry);
+        InsertTailList(&q, &block->LruListEntry);
+        cache->NumberOfBlocks--;
+        cache->Invalidations++;
+    }
+    KeReleaseSpinLock(&cache->SpinLock, irql);
+
+    while (!IsListEmpty(&q)) {
+        l = RemoveHeadList(&q);
+        block = CONTAINING_RECORD(l, VSP_READ_CACHE_BLOCK, LruListEntry);
+        ExFreePool(block->Buffer);
+        ExFreePool(block);
+    }
 }
 
-NTSTATUS
-VolSnapAddDevice(
-    IN  PDRIVER_OBJECT  DriverObject,
-    IN  PDEVICE_OBJECT  PhysicalDeviceObject
+VOID
+VspDeleteReadCache(
+    IN  PFILTER_EXTENSION   Filter
     )
 
 /*++
 
 Routine Description:
 
-    This routine creates and initializes a new FILTER for the corresponding
-    volume PDO.
+    This routine frees the read cache of a filter that is going away.
 
 Arguments:
 
-    DriverObject            - Supplies the VOLSNAP driver object.
-
-    PhysicalDeviceObject    - Supplies the volume PDO.
+    Filter  - Supplies the filter extension.
 
 Return Value:
 
-    NTSTATUS
+    None.
 
 --*/
 
 {
-    NTSTATUS                status;
-    PDEVICE_OBJECT          deviceObject;
-    PDO_EXTENSION           rootExtension;
-    PFILTER_EXTENSION       filter;
+    PVSP_READ_CACHE         cache = &Filter->ReadCache;
+    KIRQL                   irql;
+    PLIST_ENTRY             l, hashTable;
+    PVSP_READ_CACHE_BLOCK   block;
 
-    status = IoCreateDevice(DriverObject, sizeof(FILTER_EXTENSION),
-                            NULL, FILE_DEVICE_UNKNOWN, 0, FALSE, &deviceObject);
-    if (!NT_SUCCESS(status)) {
-        return status;
+    KeAcquireSpinLock(&cache->SpinLock, &irql);
+    hashTable = cache->HashTable;
+    cache->HashTable = NULL;
+    cache->MaximumBlocks = 0;
+    cache->Generation++;
+    KeReleaseSpinLock(&cache->SpinLock, irql);
+
+    while (!IsListEmpty(&cache->LruList)) {
+        l = RemoveHeadList(&cache->LruList);
+        block = CONTAINING_RECORD(l, VSP_READ_CACHE_BLOCK, LruListEntry);
+        ExFreePool(block->Buffer);
+        ExFreePool(block);
     }
+    cache->NumberOfBlocks = 0;
 
-    rootExtension = (PDO_EXTENSION)
-                    IoGetDriverObjectExtension(DriverObject, VolSnapAddDevice);
-    if (!rootExtension) {
-        IoDeleteDevice(deviceObject);
-        return STATUS_NO_SUCH_DEVICE;
+    if (hashTable) {
+        ExFreePool(hashTable);
     }
+}
+
+NTSTATUS
+VspReadSnapshotCacheCompletion(
+    IN  PDEVICE_OBJECT  DeviceObject,
+    IN  PIRP            Irp,
+    IN  PVOID           Context
+    )
 
-    filter = (PFILTER_EXTENSION) deviceObject->DeviceExtension;
-    RtlZeroMemory(filter, sizeof(FILTER_EXTENSION));
-    filter->DeviceObject = deviceObject;
-    filter->Root = rootExtension;
-    filter->DeviceExtensionType = DEVICE_EXTENSION_FILTER;
-    KeInitializeSpinLock(&filter->SpinLock);
+/*++
 
-    filter->TargetObject =
-            IoAttachDeviceToDeviceStack(deviceObject, PhysicalDeviceObject);
-    if (!filter->TargetObject) {
-        IoDeleteDevice(deviceObject);
-        return STATUS_NO_SUCH_DEVICE;
-    }
+Routine Description:
 
-    filter->Pdo = PhysicalDeviceObject;
-    KeInitializeSemaphore(&filter->ControlBlockFileHandleSemaphore, 1, 1);
-    InitializeListHead(&filter->SnapshotLookupTableEntries);
-    InitializeListHead(&filter->DiffAreaLookupTableEntries);
-    KeInitializeEvent(&filter->ControlBlockFileHandleReady, NotificationEvent,
-                      TRUE);
-    filter->RefCount = 1;
-    InitializeListHead(&filter->HoldQueue);
-    KeInitializeEvent(&filter->ZeroRefEvent, NotificationEvent, FALSE);
-    KeInitializeSemaphore(&filter->ZeroRefSemaphore, 1, 1);
-    KeInitializeTimer(&filter->HoldWritesTimer);
-    KeInitializeDpc(&filter->HoldWritesTimerDpc, VspIrpsTimerDpc, filter);
-    KeInitializeEvent(&filter->EndCommitProcessCompleted, NotificationEvent,
-                      TRUE);
-    InitializeListHead(&filter->VolumeList);
-    KeInitializeSemaphore(&filter->CriticalOperationSemaphore, 1, 1);
-    InitializeListHead(&filter->DeadVolumeList);
-    InitializeListHead(&filter->DiffAreaFilesOnThisFilter);
-    InitializeListHead(&filter->CopyOnWriteList);
+    This routine is the completion for a read of a whole diff area block
+    that missed in the read cache.  The part that was asked for is copied
+    to the original read and the block is put into the cache.
 
-    filter->DiffAreaVolume = filter;
+Arguments:
 
-    KeInitializeTimer(&filter->EndCommitTimer);
-    KeInitializeDpc(&filter->EndCommitTimerDpc, VspEndCommitDpc, filter);
+    Context - Supplies the context.
 
-    InitializeListHead(&filter->NonPagedResourceList);
-    InitializeListHead(&filter->PagedResourceList);
+Return Value:
 
-    filter->EpicNumber = 1;
+    STATUS_MORE_PROCESSING_REQUIRED
 
-    status = IoInitializeTimer(deviceObject, VspOneSecondTimer, filter);
-    if (!NT_SUCCESS(status)) {
-        IoDetachDevice(filter->TargetObject);
-        IoDeleteDevice(deviceObject);
-        return status;
-    }
+--*/
 
-    deviceObject->DeviceType = filter->TargetObject->DeviceType;
+{
+    PVSP_CONTEXT        context = (PVSP_CONTEXT) Context;
+    PVOLUME_EXTENSION   extension = context->ReadSnapshot.Extension;
+    PIRP                irp = context->ReadSnapshot.OriginalReadIrp;
+    PVOID               buffer = MmGetMdlVirtualAddress(Irp->MdlAddress);
+    PCHAR               vp;
 
-    deviceObject->Flags |= DO_DIRECT_IO;
-    if (filter->TargetObject->Flags & DO_POWER_PAGABLE) {
-        deviceObject->Flags |= DO_POWER_PAGABLE;
-    }
-    if (filter->TargetObject->Flags & DO_POWER_INRUSH) {
-        deviceObject->Flags |= DO_POWER_INRUSH;
-    }
+    ASSERT(context->Type == VSP_CONTEXT_TYPE_READ_SNAPSHOT);
 
-    deviceObject->Characteristics |=
-        (filter->Pdo->Characteristics&FILE_CHARACTERISTICS_PROPAGATED);
+    IoFreeMdl(Irp->MdlAddress);
 
-    VspAcquire(filter->Root);
-    if (filter->TargetObject->StackSize > filter->Root->StackSize) {
-        InterlockedExchange(&filter->Root->StackSize,
-                            (LONG) filter->TargetObject->StackSize);
+    if (!NT_SUCCESS(Irp->IoStatus.Status)) {
+        irp->IoStatus = Irp->IoStatus;
+        IoFreeIrp(Irp);
+        ExFreePool(buffer);
+        VspFreeContext(extension->Root, context);
+        VspDecrementVolumeIrpRefCount(irp);
+        return STATUS_MORE_PROCESSING_REQUIRED;
     }
-    InsertTailList(&filter->Root->FilterList, &filter->ListEntry);
-    VspRelease(filter->Root);
 
-    deviceObject->Flags &= ~DO_DEVICE_INITIALIZING;
+    IoFreeIrp(Irp);
 
-    return STATUS_SUCCESS;
+    vp = (PCHAR) MmGetSystemAddressForMdlSafe(irp->MdlAddress,
+                                              NormalPagePriority);
+    ASSERT(vp);
+    RtlCopyMemory(vp + context->ReadSnapshot.OriginalReadIrpOffset,
+                  (PCHAR) buffer + context->ReadSnapshot.BlockOffset,
+                  context->ReadSnapshot.Length);
+
+    VspInsertReadCache(extension->Filter, context, buffer);
+
+    VspFreeContext(extension->Root, context);
+    VspDecrementVolumeIrpRefCount(irp);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
 }
 
-NTSTATUS
-VolSnapCreate(
-    IN  PDEVICE_OBJECT  DeviceObject,
-    IN  PIRP            Irp
+BOOLEAN
+VspReadSnapshotFromCache(
+    IN  PVSP_CONTEXT    Context
     )
 
 /*++
 
 Routine Description:
 
-    This routine is the dispatch for IRP_MJ_CREATE.
+    This routine satisfies the diff area part of a snapshot read through
+    the read cache.  On a hit the data is copied straight out of the cache.
+    On a miss the whole diff area block is read so that it can be cached.
 
 Arguments:
 
-    DeviceObject - Supplies the device object.
-
-    Irp          - Supplies the IO request block.
+    Context - Supplies the context.
 
 Return Value:
 
-    NTSTATUS
+    FALSE   - The read was not handled and should go straight to the diff
+                area.
+
+    TRUE    - The read was handled.
 
 --*/
 
 {
-    PFILTER_EXTENSION   filter = (PFILTER_EXTENSION) DeviceObject->DeviceExtension;
+    PVSP_CONTEXT            context = Context;
+    PVOLUME_EXTENSION       extension = context->ReadSnapshot.Extension;
+    PVSP_READ_CACHE         cache = &extension->Filter->ReadCache;
+    PIRP                    originalIrp = context->ReadSnapshot.OriginalReadIrp;
+    PVSP_READ_CACHE_BLOCK   block;
+    KIRQL                   irql;
+    PCHAR                   vp;
+    PVOID                   buffer;
+    PMDL                    mdl;
+    PIRP                    irp;
+    PIO_STACK_LOCATION      nextSp;
 
-    if (filter->DeviceExtensionType == DEVICE_EXTENSION_FILTER) {
-        IoSkipCurrentIrpStackLocation(Irp);
-        return IoCallDriver(filter->TargetObject, Irp);
+    if (!cache->MaximumBlocks) {
+        return FALSE;
     }
 
-    ASSERT(filter->DeviceExtensionType == DEVICE_EXTENSION_VOLUME);
+    vp = (PCHAR) MmGetSystemAddressForMdlSafe(originalIrp->MdlAddress,
+                                              NormalPagePriority);
+    if (!vp) {
+        return FALSE;
+    }
+    vp += context->ReadSnapshot.OriginalReadIrpOffset;
 
-    Irp->IoStatus.Status = STATUS_SUCCESS;
-    Irp->IoStatus.Information = 0;
-    IoCompleteRequest(Irp, IO_NO_INCREMENT);
-    return STATUS_SUCCESS;
+    KeAcquireSpinLock(&cache->SpinLock, &irql);
+    block = VspLookupReadCache(cache, context->ReadSnapshot.TargetObject,
+                               context->ReadSnapshot.TargetOffset);
+    if (block) {
+        RemoveEntryList(&block->LruListEntry);
+        InsertHeadList(&cache->LruList, &block->LruListEntry);
+        cache->Hits++;
+        RtlCopyMemory(vp, (PCHAR) block->Buffer +
+                      context->ReadSnapshot.BlockOffset,
+                      context->ReadSnapshot.Length);
+        KeReleaseSpinLock(&cache->SpinLock, irql);
+
+        VspFreeContext(extension->Root, context);
+        VspDecrementVolumeIrpRefCount(originalIrp);
+        return TRUE;
+    }
+    cache->Misses++;
+    context->ReadSnapshot.CacheGeneration = cache->Generation;
+    KeReleaseSpinLock(&cache->SpinLock, irql);
+
+    irp = IoAllocateIrp(context->ReadSnapshot.TargetObject->StackSize, FALSE);
+    if (!irp) {
+        return FALSE;
+    }
+
+    buffer = ExAllocatePoolWithTagPriority(NonPagedPool, BLOCK_SIZE,
+                                           VOLSNAP_TAG_READ_CACHE,
+                                           LowPoolPriority);
+    if (!buffer) {
+        IoFreeIrp(irp);
+        return FALSE;
+    }
+
+    mdl = IoAllocateMdl(buffer, BLOCK_SIZE, FALSE, FALSE, NULL);
+    if (!mdl) {
+        ExFreePool(buffer);
+        IoFreeIrp(irp);
+        return FALSE;
+    }
+    MmBuildMdlForNonPagedPool(mdl);
+
+    irp->MdlAddress = mdl;
+    irp->Tail.Overlay.Thread = PsGetCurrentThread();
+    nextSp = IoGetNextIrpStackLocation(irp);
+    nextSp->Parameters.Read.ByteOffset.QuadPart =
+            context->ReadSnapshot.TargetOffset;
+    nextSp->Parameters.Read.Length = BLOCK_SIZE;
+    nextSp->MajorFunction = IRP_MJ_READ;
+    nextSp->DeviceObject = context->ReadSnapshot.TargetObject;
+    nextSp->Flags = SL_OVERRIDE_VERIFY_VOLUME;
+
+    IoSetCompletionRoutine(irp, VspReadSnapshotCacheCompletion, context,
+                           TRUE, TRUE, TRUE);
+
+    IoCallDriver(nextSp->DeviceObject, irp);
+
+    return TRUE;
 }
 
 VOID
@@ -7032,8 +8031,7 @@ VspReadSnapshotPhase3(
 
     _try {
         tableEntry = (PTRANSLATION_TABLE_ENTRY)
-                RtlLookupElementGenericTable(&e->VolumeBlockTable,
-                                             &keyTableEntry);
+                VspLookupBlockMap(&e->VolumeBlockTable, &keyTableEntry);
     } _except (EXCEPTION_EXECUTE_HANDLER) {
         status = GetExceptionCode();
         tableEntry = NULL;
@@ -7182,6 +8180,13 @@ Return Value:
         return;
     }
 
+    if (context->ReadSnapshot.CacheOwner &&
+        !context->ReadSnapshot.IsCopyTarget &&
+        VspReadSnapshotFromCache(context)) {
+
+        return;
+    }
+
     irp = IoAllocateIrp(context->ReadSnapshot.TargetObject->StackSize, FALSE);
     if (!irp) {
         irp = context->ReadSnapshot.OriginalReadIrp;
@@ -7314,8 +8319,8 @@ Return Value:
 
             _try {
                 tableEntry = (PTRANSLATION_TABLE_ENTRY)
-                        RtlLookupElementGenericTable(&e->VolumeBlockTable,
-                                                     &keyTableEntry);
+                        VspLookupBlockMap(&e->VolumeBlockTable,
+                                          &keyTableEntry);
             } _except (EXCEPTION_EXECUTE_HANDLER) {
                 status = GetExceptionCode();
                 tableEntry = NULL;
@@ -7393,6 +8398,7 @@ Return Value:
         context->ReadSnapshot.TargetObject = NULL;
         context->ReadSnapshot.IsCopyTarget = FALSE;
         context->ReadSnapshot.TargetOffset = 0;
+        context->ReadSnapshot.CacheOwner = NULL;
 
         if (!tableEntry) {
 
@@ -7442,6 +8448,7 @@ Return Value:
         context->ReadSnapshot.TargetObject = tableEntry->TargetObject;
         context->ReadSnapshot.IsCopyTarget = FALSE;
         context->ReadSnapshot.TargetOffset = tableEntry->TargetOffset;
+        context->ReadSnapshot.CacheOwner = e;
 
         InterlockedIncrement((PLONG) &nextSp->Parameters.Read.Length);
         VspReadSnapshotPhase1(context);
@@ -7593,7 +8600,7 @@ VspCreateHeap(
     increase >>= BLOCK_SHIFT;
 
     size = increase*(sizeof(TRANSLATION_TABLE_ENTRY) +
-                     sizeof(RTL_BALANCED_LINKS));
+                     VSP_BLOCK_MAP_ENTRY_OVERHEAD);
     size = (size + 0xFFFF)&(~0xFFFF);
     ASSERT(size >= MINIMUM_TABLE_HEAP_SIZE);
 
@@ -7677,10 +8684,31 @@ Finish:
 
 PVOID
 VspTableAllocateRoutine(
-    IN  PRTL_GENERIC_TABLE  Table,
-    IN  CLONG               Size
+    IN  PVSP_BLOCK_MAP  Table,
+    IN  CLONG           Size
     )
 
+/*++
+
+Routine Description:
+
+    This routine allocates memory for the nodes and entries of the volume
+    block and copy back pointer tables from the heap.  The block map keeps
+    freed nodes and entries for reuse, so nothing is ever given back.
+
+Arguments:
+
+    Table   - Supplies the block map.
+
+    Size    - Supplies the number of bytes to allocate.
+
+Return Value:
+
+    The memory or NULL if the heap is used up and its successor has not
+    been created yet.
+
+--*/
+
 {
     PVOLUME_EXTENSION   extension = (PVOLUME_EXTENSION) Table->TableContext;
     PVOID               p;
@@ -7743,15 +8771,6 @@ VspTableAllocateRoutine(
     return p;
 }
 
-VOID
-VspTableFreeRoutine(
-    IN  PRTL_GENERIC_TABLE  Table,
-    IN  PVOID               Buffer
-    )
-
-{
-}
-
 PVOID
 VspTempTableAllocateRoutine(
     IN  PRTL_GENERIC_TABLE  Table,
@@ -8078,6 +9097,8 @@ Return Value:
         InterlockedIncrement(&filter->RefCount);
     } else {
         InterlockedIncrement(&filter->HoldIncomingWrites);
+        filter->HoldWritesStartTime = KeQueryInterruptTime();
+        filter->HoldWritesEndTime = 0;
     }
     KeReleaseSpinLock(&filter->SpinLock, irql);
 
@@ -10028,7 +11049,7 @@ AddInTable:
         _try {
 
             p = (PTRANSLATION_TABLE_ENTRY)
-                RtlEnumerateGenericTable(&e->VolumeBlockTable, TRUE);
+                VspEnumerateBlockMap(&e->VolumeBlockTable, TRUE);
 
             while (p) {
 
@@ -10039,13 +11060,13 @@ AddInTable:
                 }
 
                 p = (PTRANSLATION_TABLE_ENTRY)
-                    RtlEnumerateGenericTable(&e->VolumeBlockTable, FALSE);
+                    VspEnumerateBlockMap(&e->VolumeBlockTable, FALSE);
             }
 
             if (moveEntries) {
 
                 p = (PTRANSLATION_TABLE_ENTRY)
-                    RtlEnumerateGenericTable(&e->VolumeBlockTable, TRUE);
+                    VspEnumerateBlockMap(&e->VolumeBlockTable, TRUE);
 
                 while (p) {
 
@@ -10055,7 +11076,7 @@ AddInTable:
                     }
 
                     p = (PTRANSLATION_TABLE_ENTRY)
-                        RtlEnumerateGenericTable(&e->VolumeBlockTable, FALSE);
+                        VspEnumerateBlockMap(&e->VolumeBlockTable, FALSE);
                 }
             }
 
@@ -12060,15 +13081,13 @@ VspPrepareForSnapshotWorker(
         goto Finish;
     }
 
-    RtlInitializeGenericTable(&extension->VolumeBlockTable,
-                              VspTableCompareRoutine,
-                              VspTableAllocateRoutine,
-                              VspTableFreeRoutine, extension);
+    VspInitializeBlockMap(&extension->VolumeBlockTable, BLOCK_SHIFT,
+                          sizeof(TRANSLATION_TABLE_ENTRY),
+                          VspTableAllocateRoutine, extension);
 
-    RtlInitializeGenericTable(&extension->CopyBackPointerTable,
-                              VspTableCompareRoutine,
-                              VspTableAllocateRoutine,
-                              VspTableFreeRoutine, extension);
+    VspInitializeBlockMap(&extension->CopyBackPointerTable, BLOCK_SHIFT,
+                          sizeof(TRANSLATION_TABLE_ENTRY),
+                          VspTableAllocateRoutine, extension);
 
     RtlInitializeGenericTable(&extension->TempVolumeBlockTable,
                               VspTableCompareRoutine,
@@ -12462,6 +13481,8 @@ VspPrepareForSnapshotWorker(
         VspCleanupInitialSnapshot(e, TRUE, FALSE);
     }
 
+    VspPrecomputeFreeSpace(extension);
+
     fallThrough = TRUE;
 
 Finish:
@@ -12571,6 +13592,8 @@ VspCleanupInitialSnapshot(
     NTSTATUS        status;
     KIRQL           irql;
 
+    VspDiscardPreCommitFreeBitmap(Extension->Filter, Extension);
+
     if (Extension->IsPersistent) {
         VspCleanupControlItemsForSnapshot(Extension);
     }
@@ -12780,66 +13803,385 @@ Return Value:
         f = bpc/BLOCK_SIZE;
     }
 
-    startBit = 0;
-    for (;;) {
-
-        if (startBit < freeSpaceBitmap.SizeOfBitMap) {
-            numBits = RtlFindNextForwardRunClear(&freeSpaceBitmap, startBit,
-                                                 &startBit);
-        } else {
-            numBits = 0;
-        }
-        if (!numBits) {
-            break;
-        }
+    startBit = 0;
+    for (;;) {
+
+        if (startBit < freeSpaceBitmap.SizeOfBitMap) {
+            numBits = RtlFindNextForwardRunClear(&freeSpaceBitmap, startBit,
+                                                 &startBit);
+        } else {
+            numBits = 0;
+        }
+        if (!numBits) {
+            break;
+        }
+
+        if (bpc == BLOCK_SIZE) {
+            s = startBit;
+            n = numBits;
+        } else if (bpc < BLOCK_SIZE) {
+            s = (startBit + f - 1)/f;
+            r = startBit%f;
+            if (r) {
+                if (numBits > f - r) {
+                    n = numBits - (f - r);
+                } else {
+                    n = 0;
+                }
+            } else {
+                n = numBits;
+            }
+            n /= f;
+        } else {
+            s = startBit*f;
+            n = numBits*f;
+        }
+
+        if (n) {
+            if (BitmapToSet) {
+                RtlSetBits(BitmapToSet, s, n);
+            } else {
+                KeAcquireSpinLock(&Extension->SpinLock, &irql);
+                if (Extension->VolumeBlockBitmap) {
+                    if (Extension->IgnorableProduct) {
+                        for (i = 0; i < n; i++) {
+                            if (RtlCheckBit(Extension->IgnorableProduct, i + s)) {
+                                RtlSetBit(Extension->VolumeBlockBitmap, i + s);
+                            }
+                        }
+                    } else {
+                        RtlSetBits(Extension->VolumeBlockBitmap, s, n);
+                    }
+                }
+                KeReleaseSpinLock(&Extension->SpinLock, irql);
+            }
+        }
+
+        startBit += numBits;
+    }
+
+    ExFreePool(output);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+VspPrecomputeFreeSpace(
+    IN  PVOLUME_EXTENSION   Extension
+    )
+
+/*++
+
+Routine Description:
+
+    This routine is called while the given snapshot is being prepared,
+    before any writes are held.  It finds the free space of the original
+    volume and leaves it in 'Filter->PreCommitFreeBitmap' where
+    'VolSnapWrite' will keep it up to date until commit.
+
+    Tracking of writes starts before the free space is queried, with
+    every block assumed free, so that a write that races with the query
+    cannot leave its block marked as free.
+
+Arguments:
+
+    Extension   - Supplies the prepared snapshot.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    PFILTER_EXTENSION   filter = Extension->Filter;
+    ULONGLONG           startTime;
+    ULONG               bitmapSize, bufferSize;
+    PRTL_BITMAP         bitmap;
+    PVOID               bitmapBuffer, freeBuffer;
+    RTL_BITMAP          freeBitmap;
+    KIRQL               irql;
+    CHAR                buffer[512];
+    PMOUNTDEV_NAME      mountdevName;
+    KEVENT              event;
+    PIRP                irp;
+    IO_STATUS_BLOCK     ioStatus;
+    UNICODE_STRING      fileName;
+    OBJECT_ATTRIBUTES   oa;
+    HANDLE              h;
+    NTSTATUS            status;
+
+    startTime = KeQueryInterruptTime();
+
+    KeAcquireSpinLock(&Extension->SpinLock, &irql);
+    if (!Extension->VolumeBlockBitmap) {
+        KeReleaseSpinLock(&Extension->SpinLock, irql);
+        return STATUS_INVALID_PARAMETER;
+    }
+    bitmapSize = Extension->VolumeBlockBitmap->SizeOfBitMap;
+    KeReleaseSpinLock(&Extension->SpinLock, irql);
+
+    bufferSize = (bitmapSize + 8*sizeof(ULONG) - 1)/
+                 (8*sizeof(ULONG))*sizeof(ULONG);
+
+    bitmap = (PRTL_BITMAP) ExAllocatePoolWithTag(NonPagedPool,
+                                                 sizeof(RTL_BITMAP),
+                                                 VOLSNAP_TAG_BITMAP);
+    if (!bitmap) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    bitmapBuffer = ExAllocatePoolWithTag(NonPagedPool, bufferSize,
+                                         VOLSNAP_TAG_BITMAP);
+    if (!bitmapBuffer) {
+        ExFreePool(bitmap);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    freeBuffer = ExAllocatePoolWithTag(NonPagedPool, bufferSize,
+                                       VOLSNAP_TAG_BITMAP);
+    if (!freeBuffer) {
+        ExFreePool(bitmapBuffer);
+        ExFreePool(bitmap);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlInitializeBitMap(bitmap, (PULONG) bitmapBuffer, bitmapSize);
+    RtlSetAllBits(bitmap);
+    RtlInitializeBitMap(&freeBitmap, (PULONG) freeBuffer, bitmapSize);
+    RtlClearAllBits(&freeBitmap);
+
+    KeAcquireSpinLock(&filter->SpinLock, &irql);
+    if (filter->PreparedSnapshot != Extension ||
+        filter->PreCommitFreeBitmap) {
+
+        KeReleaseSpinLock(&filter->SpinLock, irql);
+        ExFreePool(freeBuffer);
+        ExFreePool(bitmapBuffer);
+        ExFreePool(bitmap);
+        return STATUS_INVALID_PARAMETER;
+    }
+    filter->PreCommitFreeBitmap = bitmap;
+    filter->PreCommitExtension = Extension;
+    filter->PreCommitFreeBitmapValid = FALSE;
+    KeReleaseSpinLock(&filter->SpinLock, irql);
+
+    mountdevName = (PMOUNTDEV_NAME) buffer;
+
+    KeInitializeEvent(&event, NotificationEvent, FALSE);
+    irp = IoBuildDeviceIoControlRequest(IOCTL_MOUNTDEV_QUERY_DEVICE_NAME,
+                                        filter->TargetObject, NULL, 0,
+                                        mountdevName, 500, FALSE, &event,
+                                        &ioStatus);
+    if (!irp) {
+        ExFreePool(freeBuffer);
+        VspDiscardPreCommitFreeBitmap(filter, Extension);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    status = IoCallDriver(filter->TargetObject, irp);
+    if (status == STATUS_PENDING) {
+        KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
+        status = ioStatus.Status;
+    }
+
+    if (!NT_SUCCESS(status)) {
+        ExFreePool(freeBuffer);
+        VspDiscardPreCommitFreeBitmap(filter, Extension);
+        return status;
+    }
+
+    mountdevName->Name[mountdevName->NameLength/sizeof(WCHAR)] = 0;
+    RtlInitUnicodeString(&fileName, mountdevName->Name);
+
+    InitializeObjectAttributes(&oa, &fileName, OBJ_CASE_INSENSITIVE |
+                               OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    status = ZwOpenFile(&h, FILE_GENERIC_READ, &oa, &ioStatus,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE |
+                        FILE_SHARE_DELETE,
+                        FILE_SYNCHRONOUS_IO_NONALERT);
+    if (!NT_SUCCESS(status)) {
+        ExFreePool(freeBuffer);
+        VspDiscardPreCommitFreeBitmap(filter, Extension);
+        return status;
+    }
+
+    status = VspMarkFreeSpaceInBitmap(NULL, h, &freeBitmap);
+    ZwClose(h);
+    if (!NT_SUCCESS(status)) {
+        ExFreePool(freeBuffer);
+        VspDiscardPreCommitFreeBitmap(filter, Extension);
+        return status;
+    }
+
+    KeAcquireSpinLock(&filter->SpinLock, &irql);
+    if (filter->PreCommitFreeBitmap == bitmap) {
+        VspAndBitmaps(bitmap, &freeBitmap);
+        filter->PreCommitFreeBitmapValid = TRUE;
+    }
+    KeReleaseSpinLock(&filter->SpinLock, irql);
+
+    ExFreePool(freeBuffer);
+
+    Extension->CommitTimes.PreCommitScan = KeQueryInterruptTime() -
+                                           startTime;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+VspDiscardPreCommitFreeBitmap(
+    IN  PFILTER_EXTENSION   Filter,
+    IN  PVOLUME_EXTENSION   Extension
+    )
+
+/*++
+
+Routine Description:
+
+    This routine stops the tracking of free space for the given prepared
+    snapshot and frees the bitmap, if there is one.
+
+Arguments:
+
+    Filter      - Supplies the filter extension.
+
+    Extension   - Supplies the prepared snapshot.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    KIRQL       irql;
+    PRTL_BITMAP bitmap;
+
+    KeAcquireSpinLock(&Filter->SpinLock, &irql);
+    if (Filter->PreCommitExtension != Extension) {
+        KeReleaseSpinLock(&Filter->SpinLock, irql);
+        return;
+    }
+    bitmap = Filter->PreCommitFreeBitmap;
+    Filter->PreCommitFreeBitmap = NULL;
+    Filter->PreCommitExtension = NULL;
+    Filter->PreCommitFreeBitmapValid = FALSE;
+    KeReleaseSpinLock(&Filter->SpinLock, irql);
+
+    if (bitmap) {
+        ExFreePool(bitmap->Buffer);
+        ExFreePool(bitmap);
+    }
+}
+
+VOID
+VspApplyPreCommitFreeBitmap(
+    IN  PFILTER_EXTENSION   Filter,
+    IN  PVOLUME_EXTENSION   Extension
+    )
+
+/*++
+
+Routine Description:
+
+    This routine is called at commit time, with writes held, to mark the
+    blocks that have been free since the given snapshot was prepared as
+    ignorable.  Only the blocks that are also ignorable in all of the
+    previous snapshots are marked, as 'VspMarkFreeSpaceInBitmap' does.
+
+Arguments:
+
+    Filter      - Supplies the filter extension.
+
+    Extension   - Supplies the snapshot being committed.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    KIRQL       irql;
+    PRTL_BITMAP bitmap;
+    BOOLEAN     isValid;
+    ULONG       n, i;
+    PULONG      p, q, r;
+
+    KeAcquireSpinLock(&Filter->SpinLock, &irql);
+    if (Filter->PreCommitExtension != Extension) {
+        KeReleaseSpinLock(&Filter->SpinLock, irql);
+        return;
+    }
+    bitmap = Filter->PreCommitFreeBitmap;
+    isValid = Filter->PreCommitFreeBitmapValid;
+    Filter->PreCommitFreeBitmap = NULL;
+    Filter->PreCommitExtension = NULL;
+    Filter->PreCommitFreeBitmapValid = FALSE;
+    KeReleaseSpinLock(&Filter->SpinLock, irql);
+
+    if (!bitmap) {
+        return;
+    }
 
-        if (bpc == BLOCK_SIZE) {
-            s = startBit;
-            n = numBits;
-        } else if (bpc < BLOCK_SIZE) {
-            s = (startBit + f - 1)/f;
-            r = startBit%f;
-            if (r) {
-                if (numBits > f - r) {
-                    n = numBits - (f - r);
-                } else {
-                    n = 0;
+    if (isValid) {
+        KeAcquireSpinLock(&Extension->SpinLock, &irql);
+        if (Extension->VolumeBlockBitmap &&
+            Extension->VolumeBlockBitmap->SizeOfBitMap ==
+            bitmap->SizeOfBitMap) {
+
+            n = (bitmap->SizeOfBitMap + 8*sizeof(ULONG) - 1)/
+                (8*sizeof(ULONG));
+            p = Extension->VolumeBlockBitmap->Buffer;
+            q = bitmap->Buffer;
+            if (Extension->IgnorableProduct) {
+                r = Extension->IgnorableProduct->Buffer;
+                for (i = 0; i < n; i++) {
+                    p[i] |= q[i]&r[i];
                 }
             } else {
-                n = numBits;
-            }
-            n /= f;
-        } else {
-            s = startBit*f;
-            n = numBits*f;
-        }
-
-        if (n) {
-            if (BitmapToSet) {
-                RtlSetBits(BitmapToSet, s, n);
-            } else {
-                KeAcquireSpinLock(&Extension->SpinLock, &irql);
-                if (Extension->VolumeBlockBitmap) {
-                    if (Extension->IgnorableProduct) {
-                        for (i = 0; i < n; i++) {
-                            if (RtlCheckBit(Extension->IgnorableProduct, i + s)) {
-                                RtlSetBit(Extension->VolumeBlockBitmap, i + s);
-                            }
-                        }
-                    } else {
-                        RtlSetBits(Extension->VolumeBlockBitmap, s, n);
-                    }
+                for (i = 0; i < n; i++) {
+                    p[i] |= q[i];
                 }
-                KeReleaseSpinLock(&Extension->SpinLock, irql);
             }
         }
+        KeReleaseSpinLock(&Extension->SpinLock, irql);
+    }
 
-        startBit += numBits;
+    ExFreePool(bitmap->Buffer);
+    ExFreePool(bitmap);
+}
+
+VOID
+VspClearBitsForWrite(
+    IN  PRTL_BITMAP Bitmap,
+    IN  PIRP        Irp
+    )
+
+{
+    PIO_STACK_LOCATION  irpSp = IoGetCurrentIrpStackLocation(Irp);
+    LONGLONG            start;
+    ULONG               startBlock, endBlock;
+
+    start = irpSp->Parameters.Write.ByteOffset.QuadPart;
+    if (start < 0 || !irpSp->Parameters.Write.Length) {
+        return;
     }
 
-    ExFreePool(output);
+    startBlock = (ULONG) (start >> BLOCK_SHIFT);
+    endBlock = (ULONG) ((start + irpSp->Parameters.Write.Length - 1) >>
+                        BLOCK_SHIFT);
 
-    return STATUS_SUCCESS;
+    if (startBlock >= Bitmap->SizeOfBitMap) {
+        return;
+    }
+    if (endBlock >= Bitmap->SizeOfBitMap) {
+        endBlock = Bitmap->SizeOfBitMap - 1;
+    }
+
+    RtlClearBits(Bitmap, startBlock, endBlock - startBlock + 1);
 }
 
 NTSTATUS
@@ -12871,6 +14213,9 @@ Return Value:
     PVOLUME_EXTENSION       extension, previousExtension;
     PLIST_ENTRY             l;
     PVSP_DIFF_AREA_FILE     diffAreaFile;
+    ULONGLONG               startTime;
+
+    startTime = KeQueryInterruptTime();
 
     InterlockedIncrement(&Filter->IgnoreCopyData);
 
@@ -12913,6 +14258,8 @@ Return Value:
 
     extension->IgnoreCopyDataReference = TRUE;
 
+    VspApplyPreCommitFreeBitmap(Filter, extension);
+
     KeAcquireSpinLock(&Filter->SpinLock, &irql);
     InterlockedExchange(&Filter->SnapshotsPresent, TRUE);
     if (extension->IsPersistent) {
@@ -12948,6 +14295,15 @@ Return Value:
         extension->ContainsCrashdumpFile = TRUE;
     }
 
+    KeAcquireSpinLock(&Filter->SpinLock, &irql);
+    if (Filter->HoldWritesStartTime) {
+        extension->CommitTimes.HoldToCommit =
+                startTime - Filter->HoldWritesStartTime;
+    }
+    KeReleaseSpinLock(&Filter->SpinLock, irql);
+
+    extension->CommitTimes.Commit = KeQueryInterruptTime() - startTime;
+
     VspRelease(Filter->Root);
 
     return STATUS_SUCCESS;
@@ -13096,6 +14452,7 @@ Return Value:
     NTSTATUS            status;
     LARGE_INTEGER       timeout;
     PVSP_CONTEXT        context;
+    KIRQL               irql;
 
     VspAcquire(Filter->Root);
 
@@ -13149,6 +14506,15 @@ Return Value:
 
     extension->HasEndCommit = TRUE;
 
+    KeAcquireSpinLock(&Filter->SpinLock, &irql);
+    if (Filter->HoldWritesStartTime &&
+        Filter->HoldWritesEndTime > Filter->HoldWritesStartTime) {
+
+        extension->CommitTimes.WritesHeld =
+                Filter->HoldWritesEndTime - Filter->HoldWritesStartTime;
+    }
+    KeReleaseSpinLock(&Filter->SpinLock, irql);
+
     if (extension->IsPersistent) {
         VspAcquireNonPagedResource(extension, NULL, FALSE);
         status = VspCheckOnDiskNotCommitted(extension);
@@ -13642,6 +15008,70 @@ Return Value:
 }
 
 NTSTATUS
+VspQueryReadCacheStatistics(
+    IN  PDEVICE_EXTENSION   DeviceExtension,
+    IN  PIRP                Irp
+    )
+
+/*++
+
+Routine Description:
+
+    This routine returns the statistics of the diff area read cache that
+    is shared by the snapshots of this volume.
+
+Arguments:
+
+    DeviceExtension - Supplies the filter or volume extension.
+
+    Irp             - Supplies the I/O request packet.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+
+{
+    PFILTER_EXTENSION               filter = (PFILTER_EXTENSION) DeviceExtension;
+    PVOLUME_EXTENSION               extension = (PVOLUME_EXTENSION) DeviceExtension;
+    PIO_STACK_LOCATION              irpSp = IoGetCurrentIrpStackLocation(Irp);
+    PVOLSNAP_READ_CACHE_STATISTICS  output = (PVOLSNAP_READ_CACHE_STATISTICS) Irp->AssociatedIrp.SystemBuffer;
+    PVSP_READ_CACHE                 cache;
+    KIRQL                           irql;
+
+    Irp->IoStatus.Information = sizeof(VOLSNAP_READ_CACHE_STATISTICS);
+
+    if (irpSp->Parameters.DeviceIoControl.OutputBufferLength <
+        Irp->IoStatus.Information) {
+
+        Irp->IoStatus.Information = 0;
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (filter->DeviceExtensionType != DEVICE_EXTENSION_FILTER) {
+        ASSERT(extension->DeviceExtensionType == DEVICE_EXTENSION_VOLUME);
+        filter = extension->Filter;
+    }
+
+    cache = &filter->ReadCache;
+
+    RtlZeroMemory(output, sizeof(VOLSNAP_READ_CACHE_STATISTICS));
+    output->BlockSize = BLOCK_SIZE;
+
+    KeAcquireSpinLock(&cache->SpinLock, &irql);
+    output->MaximumBlocks = cache->MaximumBlocks;
+    output->NumberOfBlocks = cache->NumberOfBlocks;
+    output->Hits = cache->Hits;
+    output->Misses = cache->Misses;
+    output->Evictions = cache->Evictions;
+    output->Invalidations = cache->Invalidations;
+    KeReleaseSpinLock(&cache->SpinLock, irql);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
 VspQueryOriginalVolumeName(
     IN  PVOLUME_EXTENSION   Extension,
     IN  PIRP                Irp
@@ -14435,20 +15865,18 @@ VspCreateSnapshotExtension(
     extension->SnapshotGuid = LookupEntry->SnapshotGuid;
     extension->SnapshotOrderNumber = LookupEntry->SnapshotOrderNumber;
 
-    RtlInitializeGenericTable(&extension->VolumeBlockTable,
-                              VspTableCompareRoutine,
-                              VspTableAllocateRoutine,
-                              VspTableFreeRoutine, extension);
+    VspInitializeBlockMap(&extension->VolumeBlockTable, BLOCK_SHIFT,
+                          sizeof(TRANSLATION_TABLE_ENTRY),
+                          VspTableAllocateRoutine, extension);
 
     RtlInitializeGenericTable(&extension->TempVolumeBlockTable,
                               VspTableCompareRoutine,
                               VspTempTableAllocateRoutine,
                               VspTempTableFreeRoutine, extension);
 
-    RtlInitializeGenericTable(&extension->CopyBackPointerTable,
-                              VspTableCompareRoutine,
-                              VspTableAllocateRoutine,
-                              VspTableFreeRoutine, extension);
+    VspInitializeBlockMap(&extension->CopyBackPointerTable, BLOCK_SHIFT,
+                          sizeof(TRANSLATION_TABLE_ENTRY),
+                          VspTableAllocateRoutine, extension);
 
     extension->DiffAreaFileIncrease = NOMINAL_DIFF_AREA_FILE_GROWTH;
 
@@ -14711,7 +16139,7 @@ VspSignalWorker(
 PVOID
 VspInsertWithAllocateAndWait(
     IN  PVOLUME_EXTENSION   Extension,
-    IN  PRTL_GENERIC_TABLE  Table,
+    IN  PVSP_BLOCK_MAP      Table,
     IN  PVOID               TableEntry
     )
 
@@ -14719,15 +16147,11 @@ VspInsertWithAllocateAndWait(
     NTSTATUS                    status = STATUS_SUCCESS;
     PTRANSLATION_TABLE_ENTRY    t1, t2;
     PVOID                       r;
-    PVOID                       nodeOrParent;
-    TABLE_SEARCH_RESULT         searchResult;
     KEVENT                      event;
     KIRQL                       irql;
 
     _try {
-        t1 = (PTRANSLATION_TABLE_ENTRY)
-             RtlLookupElementGenericTableFull(Table, TableEntry, &nodeOrParent,
-                                              &searchResult);
+        t1 = (PTRANSLATION_TABLE_ENTRY) VspLookupBlockMap(Table, TableEntry);
     } _except (EXCEPTION_EXECUTE_HANDLER) {
         status = GetExceptionCode();
     }
@@ -14745,9 +16169,7 @@ VspInsertWithAllocateAndWait(
     }
 
     _try {
-        r = RtlInsertElementGenericTableFull(Table, TableEntry,
-                                             sizeof(TRANSLATION_TABLE_ENTRY),
-                                             NULL, nodeOrParent, searchResult);
+        r = VspInsertBlockMap(Table, TableEntry, NULL);
     } _except (EXCEPTION_EXECUTE_HANDLER) {
         r = NULL;
     }
@@ -14774,10 +16196,7 @@ VspInsertWithAllocateAndWait(
         }
 
         _try {
-            r = RtlInsertElementGenericTableFull(Table, TableEntry,
-                                                 sizeof(TRANSLATION_TABLE_ENTRY),
-                                                 NULL, nodeOrParent,
-                                                 searchResult);
+            r = VspInsertBlockMap(Table, TableEntry, NULL);
         } _except (EXCEPTION_EXECUTE_HANDLER) {
             r = NULL;
         }
@@ -14897,7 +16316,7 @@ VspReadDiffAreaTable(
 
             _try {
                 backPointer = (PTRANSLATION_TABLE_ENTRY)
-                              RtlLookupElementGenericTable(
+                              VspLookupBlockMap(
                               &extension->CopyBackPointerTable,
                               &tableEntry);
             } _except (EXCEPTION_EXECUTE_HANDLER) {
@@ -14911,7 +16330,7 @@ VspReadDiffAreaTable(
             if (backPointer) {
                 tmp = backPointer->TargetOffset;
                 _try {
-                    b = RtlDeleteElementGenericTable(
+                    b = VspDeleteBlockMap(
                         &extension->CopyBackPointerTable, &tableEntry);
                     if (!b) {
                         status = STATUS_INVALID_PARAMETER;
@@ -15329,7 +16748,7 @@ VspProcessInMemoryCopyOnWrites(
 
         _try {
             backPointer = (PTRANSLATION_TABLE_ENTRY)
-                          RtlLookupElementGenericTable(
+                          VspLookupBlockMap(
                           &Extension->CopyBackPointerTable,
                           &tableEntry);
         } _except (EXCEPTION_EXECUTE_HANDLER) {
@@ -15343,7 +16762,7 @@ VspProcessInMemoryCopyOnWrites(
         if (backPointer) {
             tmp = backPointer->TargetOffset;
             _try {
-                b = RtlDeleteElementGenericTable(
+                b = VspDeleteBlockMap(
                     &Extension->CopyBackPointerTable, &tableEntry);
                 if (!b) {
                     status = STATUS_INVALID_PARAMETER;
@@ -15511,7 +16930,7 @@ VspActivateSnapshots(
     _try {
 
         p = (PTRANSLATION_TABLE_ENTRY)
-            RtlEnumerateGenericTable(&extension->VolumeBlockTable, TRUE);
+            VspEnumerateBlockMap(&extension->VolumeBlockTable, TRUE);
         while (p) {
 
             RtlSetBit(extension->VolumeBlockBitmap,
@@ -15522,13 +16941,13 @@ VspActivateSnapshots(
             }
 
             p = (PTRANSLATION_TABLE_ENTRY)
-                RtlEnumerateGenericTable(&extension->VolumeBlockTable, FALSE);
+                VspEnumerateBlockMap(&extension->VolumeBlockTable, FALSE);
         }
 
         if (moveEntries) {
 
             p = (PTRANSLATION_TABLE_ENTRY)
-                RtlEnumerateGenericTable(&extension->VolumeBlockTable, TRUE);
+                VspEnumerateBlockMap(&extension->VolumeBlockTable, TRUE);
 
             while (p) {
 
@@ -15538,8 +16957,8 @@ VspActivateSnapshots(
                 }
 
                 p = (PTRANSLATION_TABLE_ENTRY)
-                    RtlEnumerateGenericTable(&extension->VolumeBlockTable,
-                                             FALSE);
+                    VspEnumerateBlockMap(&extension->VolumeBlockTable,
+                                         FALSE);
             }
         }
 
@@ -16682,8 +18101,7 @@ VspCopyBlock(
 
     _try {
         sourceBackPointer = (PTRANSLATION_TABLE_ENTRY)
-                RtlLookupElementGenericTable(&Extension->CopyBackPointerTable,
-                                             &key);
+                VspLookupBlockMap(&Extension->CopyBackPointerTable, &key);
     } _except (EXCEPTION_EXECUTE_HANDLER) {
         status = GetExceptionCode();
     }
@@ -16704,8 +18122,7 @@ VspCopyBlock(
         }
 
         _try {
-            b = RtlDeleteElementGenericTable(&Extension->CopyBackPointerTable,
-                                             &key);
+            b = VspDeleteBlockMap(&Extension->CopyBackPointerTable, &key);
             ASSERT(b);
         } _except (EXCEPTION_EXECUTE_HANDLER) {
             status = GetExceptionCode();
@@ -16722,8 +18139,8 @@ VspCopyBlock(
         key.TargetOffset = sourceSource;
 
         _try {
-            r2 = RtlInsertElementGenericTable(&Extension->CopyBackPointerTable,
-                                              &key, sizeof(key), NULL);
+            r2 = VspInsertBlockMap(&Extension->CopyBackPointerTable, &key,
+                                   NULL);
             if (!r2) {
                 status = STATUS_INSUFFICIENT_RESOURCES;
             }
@@ -16744,8 +18161,7 @@ VspCopyBlock(
 
         _try {
             sourceTableEntry = (PTRANSLATION_TABLE_ENTRY)
-                    RtlLookupElementGenericTable(&Extension->VolumeBlockTable,
-                                                 &key);
+                    VspLookupBlockMap(&Extension->VolumeBlockTable, &key);
             ASSERT(sourceTableEntry);
             if (!sourceTableEntry) {
                 status = STATUS_INVALID_PARAMETER;
@@ -16770,9 +18186,7 @@ VspCopyBlock(
     } else {
 
         _try {
-            r = RtlLookupElementGenericTableFull(&Extension->VolumeBlockTable,
-                                                 &key, &nodeOrParent,
-                                                 &searchResult);
+            r = VspLookupBlockMap(&Extension->VolumeBlockTable, &key);
         } _except (EXCEPTION_EXECUTE_HANDLER) {
             r = (PVOID) 1;
         }
@@ -16784,10 +18198,7 @@ VspCopyBlock(
         }
 
         _try {
-            r = RtlInsertElementGenericTableFull(&Extension->VolumeBlockTable,
-                                                 &key,
-                                                 sizeof(TRANSLATION_TABLE_ENTRY),
-                                                 NULL, nodeOrParent, searchResult);
+            r = VspInsertBlockMap(&Extension->VolumeBlockTable, &key, NULL);
         } _except (EXCEPTION_EXECUTE_HANDLER) {
             r = NULL;
         }
@@ -16802,17 +18213,15 @@ VspCopyBlock(
         key.TargetOffset = Source;
 
         _try {
-            r2 = RtlInsertElementGenericTable(&Extension->CopyBackPointerTable,
-                                              &key,
-                                              sizeof(TRANSLATION_TABLE_ENTRY),
-                                              NULL);
+            r2 = VspInsertBlockMap(&Extension->CopyBackPointerTable, &key,
+                                   NULL);
         } _except (EXCEPTION_EXECUTE_HANDLER) {
             r2 = NULL;
         }
 
         if (!r2) {
             _try {
-                b = RtlDeleteElementGenericTable(&Extension->VolumeBlockTable, r);
+                b = VspDeleteBlockMap(&Extension->VolumeBlockTable, r);
             } _except (EXCEPTION_EXECUTE_HANDLER) {
                 b = FALSE;
             }
@@ -16849,14 +18258,12 @@ VspCopyBlock(
             sourceTableEntry->TargetOffset = Source;
 
             _try {
-                b = RtlDeleteElementGenericTable(
-                        &Extension->CopyBackPointerTable, r2);
+                b = VspDeleteBlockMap(&Extension->CopyBackPointerTable, r2);
                 if (b) {
                     key.VolumeOffset = Source;
                     key.TargetOffset = sourceSource;
-                    r = RtlInsertElementGenericTable(
-                        &Extension->CopyBackPointerTable, &key, sizeof(key),
-                        NULL);
+                    r = VspInsertBlockMap(&Extension->CopyBackPointerTable,
+                                          &key, NULL);
                     b = r ? TRUE : FALSE;
                 }
             } _except (EXCEPTION_EXECUTE_HANDLER) {
@@ -16865,11 +18272,10 @@ VspCopyBlock(
 
         } else {
             _try {
-                b = RtlDeleteElementGenericTable(&Extension->VolumeBlockTable,
-                                                 r);
+                b = VspDeleteBlockMap(&Extension->VolumeBlockTable, r);
                 if (b) {
-                    b = RtlDeleteElementGenericTable(
-                        &Extension->CopyBackPointerTable, r2);
+                    b = VspDeleteBlockMap(&Extension->CopyBackPointerTable,
+                                          r2);
                 }
             } _except (EXCEPTION_EXECUTE_HANDLER) {
                 b = FALSE;
@@ -17345,6 +18751,15 @@ Return Value:
                 status = VspQueryDiffAreaSizes(filter, Irp);
                 break;
 
+            case IOCTL_VOLSNAP_QUERY_READ_CACHE_STATISTICS:
+                status = VspCheckSecurity(filter, Irp);
+                if (!NT_SUCCESS(status)) {
+                    break;
+                }
+                VspCheckCodeLocked(filter->Root, FALSE);
+                status = VspQueryReadCacheStatistics(filter, Irp);
+                break;
+
             case IOCTL_VOLSNAP_DELETE_OLDEST_SNAPSHOT:
             case IOCTL_VOLSNAP_DELETE_SNAPSHOT:
                 VspCheckCodeLocked(filter->Root, FALSE);
@@ -17529,6 +18944,14 @@ Return Value:
             status = VspQueryDiffAreaSizes(extension, Irp);
             break;
 
+        case IOCTL_VOLSNAP_QUERY_READ_CACHE_STATISTICS:
+            status = VspCheckSecurity(extension->Filter, Irp);
+            if (!NT_SUCCESS(status)) {
+                break;
+            }
+            status = VspQueryReadCacheStatistics(extension, Irp);
+            break;
+
         case IOCTL_DISK_SET_PARTITION_INFO:
             status = STATUS_SUCCESS;
             break;
@@ -19184,7 +20607,7 @@ VspProtectDiffAreaClusters(
         _try {
 
             tableEntry = (PTRANSLATION_TABLE_ENTRY)
-                         RtlEnumerateGenericTable(
+                         VspEnumerateBlockMap(
                          &extension->VolumeBlockTable, TRUE);
             while (tableEntry) {
 
@@ -19194,7 +20617,7 @@ VspProtectDiffAreaClusters(
                 }
 
                 tableEntry = (PTRANSLATION_TABLE_ENTRY)
-                             RtlEnumerateGenericTable(
+                             VspEnumerateBlockMap(
                              &extension->VolumeBlockTable, FALSE);
             }
 
@@ -20504,6 +21927,51 @@ VspAbortCopyOnWrites(
     IoCallDriver(Filter->TargetObject, Irp);
 }
 
+BOOLEAN
+VspIsCopyOnWriteListed(
+    IN  PFILTER_EXTENSION   Filter,
+    IN  LONGLONG            RoundedStart
+    )
+
+/*++
+
+Routine Description:
+
+    This routine checks whether the given block has already been copied to
+    the copy on write list.
+
+Arguments:
+
+    Filter          - Supplies the filter extension.
+
+    RoundedStart    - Supplies the volume offset of the block.
+
+Return Value:
+
+    BOOLEAN
+
+Notes:
+
+    Callers of this routine must be holding 'Filter->SpinLock'.
+
+--*/
+
+{
+    PLIST_ENTRY         l;
+    PVSP_COPY_ON_WRITE  copyOnWrite;
+
+    for (l = Filter->CopyOnWriteList.Flink; l != &Filter->CopyOnWriteList;
+         l = l->Flink) {
+
+        copyOnWrite = CONTAINING_RECORD(l, VSP_COPY_ON_WRITE, ListEntry);
+        if (copyOnWrite->RoundedStart == RoundedStart) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
 NTSTATUS
 VspCopyOnWriteReadCompletion(
     IN  PDEVICE_OBJECT  DeviceObject,
@@ -20516,9 +21984,10 @@ VspCopyOnWriteReadCompletion(
     PFILTER_EXTENSION   filter = context->CopyOnWrite.Filter;
     PIRP                irp = context->CopyOnWrite.Irp;
     NTSTATUS            status = Irp->IoStatus.Status;
-    PVSP_COPY_ON_WRITE  copyOnWrite, cow;
+    PVSP_COPY_ON_WRITE  copyOnWrite;
     KIRQL               irql;
-    PLIST_ENTRY         l;
+    PVOID               buffer;
+    ULONG               runLength, i;
 
     ASSERT(context->Type == VSP_CONTEXT_TYPE_COPY_ON_WRITE);
 
@@ -20531,42 +22000,63 @@ VspCopyOnWriteReadCompletion(
         return STATUS_MORE_PROCESSING_REQUIRED;
     }
 
-    copyOnWrite = (PVSP_COPY_ON_WRITE)
-                  ExAllocatePoolWithTag(NonPagedPool,
-                                        sizeof(VSP_COPY_ON_WRITE),
-                                        VOLSNAP_TAG_COPY);
-    if (!copyOnWrite) {
-        VspFreeContext(filter->Root, context);
-        ExFreePool(MmGetMdlVirtualAddress(Irp->MdlAddress));
-        IoFreeMdl(Irp->MdlAddress);
-        IoFreeIrp(Irp);
-        VspAbortCopyOnWrites(filter, irp);
-        return STATUS_MORE_PROCESSING_REQUIRED;
-    }
-
-    copyOnWrite->RoundedStart = context->CopyOnWrite.RoundedStart;
-    copyOnWrite->Buffer = MmGetMdlVirtualAddress(Irp->MdlAddress);
+    buffer = MmGetMdlVirtualAddress(Irp->MdlAddress);
+    runLength = MmGetMdlByteCount(Irp->MdlAddress)>>BLOCK_SHIFT;
     IoFreeMdl(Irp->MdlAddress);
     IoFreeIrp(Irp);
 
-    KeAcquireSpinLock(&filter->SpinLock, &irql);
-    for (l = filter->CopyOnWriteList.Flink; l != &filter->CopyOnWriteList;
-         l = l->Flink) {
+    //
+    // A single block keeps the read buffer.  The blocks of a longer run
+    // each get a buffer of their own, since the list entries are freed
+    // one at a time.
+    //
+
+    for (i = 0; i < runLength; i++) {
+
+        copyOnWrite = (PVSP_COPY_ON_WRITE)
+                      ExAllocatePoolWithTag(NonPagedPool,
+                                            sizeof(VSP_COPY_ON_WRITE),
+                                            VOLSNAP_TAG_COPY);
+        if (copyOnWrite) {
+            if (runLength == 1) {
+                copyOnWrite->Buffer = buffer;
+            } else {
+                copyOnWrite->Buffer = ExAllocatePoolWithTag(NonPagedPool,
+                                      BLOCK_SIZE, VOLSNAP_TAG_BUFFER);
+                if (copyOnWrite->Buffer) {
+                    RtlCopyMemory(copyOnWrite->Buffer,
+                                  (PCHAR) buffer + i*BLOCK_SIZE, BLOCK_SIZE);
+                } else {
+                    ExFreePool(copyOnWrite);
+                    copyOnWrite = NULL;
+                }
+            }
+        }
 
-        cow = CONTAINING_RECORD(l, VSP_COPY_ON_WRITE, ListEntry);
-        if (copyOnWrite->RoundedStart == cow->RoundedStart) {
-            break;
+        if (!copyOnWrite) {
+            VspFreeContext(filter->Root, context);
+            ExFreePool(buffer);
+            VspAbortCopyOnWrites(filter, irp);
+            return STATUS_MORE_PROCESSING_REQUIRED;
         }
+
+        copyOnWrite->RoundedStart = context->CopyOnWrite.RoundedStart;
+
+        KeAcquireSpinLock(&filter->SpinLock, &irql);
+        if (VspIsCopyOnWriteListed(filter, copyOnWrite->RoundedStart)) {
+            ExFreePool(copyOnWrite->Buffer);
+            ExFreePool(copyOnWrite);
+        } else {
+            InsertTailList(&filter->CopyOnWriteList, &copyOnWrite->ListEntry);
+        }
+        KeReleaseSpinLock(&filter->SpinLock, irql);
+
+        context->CopyOnWrite.RoundedStart += BLOCK_SIZE;
     }
-    if (l == &filter->CopyOnWriteList) {
-        InsertTailList(&filter->CopyOnWriteList, &copyOnWrite->ListEntry);
-    } else {
-        ExFreePool(copyOnWrite->Buffer);
-        ExFreePool(copyOnWrite);
-    }
-    KeReleaseSpinLock(&filter->SpinLock, irql);
 
-    context->CopyOnWrite.RoundedStart += BLOCK_SIZE;
+    if (runLength > 1) {
+        ExFreePool(buffer);
+    }
 
     VspStartCopyOnWrite(context);
 
@@ -20578,14 +22068,33 @@ VspStartCopyOnWrite(
     IN  PVOID   Context
     )
 
+/*++
+
+Routine Description:
+
+    This routine copies the blocks covered by a write that have not yet
+    been copied to the copy on write list, and then passes the write on.
+    Consecutive blocks that still need copying are read together, up to
+    'VSP_MAX_COPY_RUN_BLOCKS' at a time.
+
+Arguments:
+
+    Context - Supplies the context.
+
+Return Value:
+
+    None.
+
+--*/
+
 {
     PVSP_CONTEXT        context = (PVSP_CONTEXT) Context;
     PFILTER_EXTENSION   filter = context->CopyOnWrite.Filter;
     LONGLONG            roundedStart = context->CopyOnWrite.RoundedStart;
     LONGLONG            roundedEnd = context->CopyOnWrite.RoundedEnd;
     KIRQL               irql;
-    PLIST_ENTRY         l;
-    PVSP_COPY_ON_WRITE  copyOnWrite;
+    BOOLEAN             isListed;
+    ULONG               runLength;
     PIRP                irp;
     PMDL                mdl;
     PVOID               buffer;
@@ -20595,25 +22104,37 @@ VspStartCopyOnWrite(
 
     for (; roundedStart < roundedEnd; roundedStart += BLOCK_SIZE) {
 
+        runLength = 0;
+
         KeAcquireSpinLock(&filter->SpinLock, &irql);
-        for (l = filter->CopyOnWriteList.Flink;
-             l != &filter->CopyOnWriteList; l = l->Flink) {
+        isListed = VspIsCopyOnWriteListed(filter, roundedStart);
+        if (!isListed) {
+            for (runLength = 1; runLength < VSP_MAX_COPY_RUN_BLOCKS &&
+                 roundedStart + runLength*BLOCK_SIZE < roundedEnd;
+                 runLength++) {
 
-            copyOnWrite = CONTAINING_RECORD(l, VSP_COPY_ON_WRITE, ListEntry);
-            if (copyOnWrite->RoundedStart == roundedStart) {
-                break;
+                if (VspIsCopyOnWriteListed(filter,
+                        roundedStart + runLength*BLOCK_SIZE)) {
+
+                    break;
+                }
             }
         }
         KeReleaseSpinLock(&filter->SpinLock, irql);
 
-        if (l != &filter->CopyOnWriteList) {
+        if (isListed) {
             continue;
         }
 
         irp = IoAllocateIrp(filter->TargetObject->StackSize, FALSE);
-        buffer = ExAllocatePoolWithTag(NonPagedPool, BLOCK_SIZE,
+        buffer = ExAllocatePoolWithTag(NonPagedPool, runLength*BLOCK_SIZE,
                                        VOLSNAP_TAG_BUFFER);
-        mdl = IoAllocateMdl(buffer, BLOCK_SIZE, FALSE, FALSE, NULL);
+        if (!buffer && runLength > 1) {
+            runLength = 1;
+            buffer = ExAllocatePoolWithTag(NonPagedPool, BLOCK_SIZE,
+                                           VOLSNAP_TAG_BUFFER);
+        }
+        mdl = IoAllocateMdl(buffer, runLength*BLOCK_SIZE, FALSE, FALSE, NULL);
         if (!irp || !buffer || !mdl) {
             if (irp) {
                 IoFreeIrp(irp);
@@ -20636,7 +22157,7 @@ VspStartCopyOnWrite(
         irp->Tail.Overlay.Thread = PsGetCurrentThread();
         nextSp = IoGetNextIrpStackLocation(irp);
         nextSp->Parameters.Read.ByteOffset.QuadPart = roundedStart;
-        nextSp->Parameters.Read.Length = BLOCK_SIZE;
+        nextSp->Parameters.Read.Length = runLength*BLOCK_SIZE;
         nextSp->MajorFunction = IRP_MJ_READ;
         nextSp->DeviceObject = filter->TargetObject;
         nextSp->Flags = SL_OVERRIDE_VERIFY_VOLUME;
@@ -21394,6 +22915,10 @@ Return Value:
         IoInvalidateDeviceRelations(Filter->Pdo, BusRelations);
     }
 
+    if (IsFinalRemove) {
+        VspDeleteReadCache(Filter);
+    }
+
     if (!IsOffline && !Filter->NotInFilterList) {
         RemoveEntryList(&Filter->ListEntry);
         Filter->NotInFilterList = TRUE;
@@ -21811,6 +23336,14 @@ Return Value:
         KeReleaseSpinLock(&filter->SpinLock, irql);
     }
 
+    if (filter->PreCommitFreeBitmap) {
+        KeAcquireSpinLock(&filter->SpinLock, &irql);
+        if (filter->PreCommitFreeBitmap) {
+            VspClearBitsForWrite(filter->PreCommitFreeBitmap, Irp);
+        }
+        KeReleaseSpinLock(&filter->SpinLock, irql);
+    }
+
     if (filter->SnapshotDiscoveryPending) {
         VspCopyOnWriteToNonPagedPool(filter, Irp);
         return STATUS_PENDING;
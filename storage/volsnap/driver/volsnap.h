@@ -49,9 +49,12 @@ Revision History:
 #define VOLSNAP_TAG_WORK_QUEUE  'wSoV'  // VoSw - Work queue allocations
 #define VOLSNAP_TAG_DISPATCH    'xSoV'  // VoSx - Dispatch context allocations
 #define VOLSNAP_TAG_COPY        'CSoV'  // VoSx - Copy On Write Structures
+#define VOLSNAP_TAG_READ_CACHE  'RSoV'  // VoSR - Diff area read cache
 
 #define NUMBER_OF_THREAD_POOLS  (3)
 
+#include "blockmap.h"
+
 struct _VSP_CONTEXT;
 typedef struct _VSP_CONTEXT VSP_CONTEXT, *PVSP_CONTEXT;
 
@@ -83,6 +86,79 @@ typedef struct _VSP_COPY_ON_WRITE {
     PVOID       Buffer;
 } VSP_COPY_ON_WRITE, *PVSP_COPY_ON_WRITE;
 
+//
+// Diff area read cache.  Each filter keeps a bounded cache of the diff area
+// blocks most recently read through any of its snapshots.  A block is only
+// cached while the snapshot whose table entry pointed at it, its 'Owner',
+// is alive.  Protect everything with 'SpinLock'.
+//
+
+typedef struct _VSP_READ_CACHE_BLOCK {
+    LIST_ENTRY          LruListEntry;
+    LIST_ENTRY          HashListEntry;
+    PDEVICE_OBJECT      TargetObject;
+    LONGLONG            TargetOffset;
+    PVOLUME_EXTENSION   Owner;
+    PVOID               Buffer;
+} VSP_READ_CACHE_BLOCK, *PVSP_READ_CACHE_BLOCK;
+
+typedef struct _VSP_READ_CACHE {
+    KSPIN_LOCK  SpinLock;
+
+    //
+    // The cache is disabled when 'MaximumBlocks' is 0.
+    //
+
+    ULONG       MaximumBlocks;
+    ULONG       NumberOfBlocks;
+
+    //
+    // 'HashMask' + 1 lists of blocks hashed by target offset, and a list of
+    // all blocks with the most recently used at the head.
+    //
+
+    ULONG       HashMask;
+    PLIST_ENTRY HashTable;
+    LIST_ENTRY  LruList;
+
+    //
+    // Bumped by every invalidation.  A miss that started under an older
+    // generation does not get cached.
+    //
+
+    ULONG       Generation;
+
+    LONGLONG    Hits;
+    LONGLONG    Misses;
+    LONGLONG    Evictions;
+    LONGLONG    Invalidations;
+} VSP_READ_CACHE, *PVSP_READ_CACHE;
+
+#define IOCTL_VOLSNAP_QUERY_READ_CACHE_STATISTICS   CTL_CODE(VOLSNAPCONTROLTYPE, 200, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+typedef struct _VOLSNAP_READ_CACHE_STATISTICS {
+    ULONG       MaximumBlocks;
+    ULONG       NumberOfBlocks;
+    ULONG       BlockSize;
+    ULONG       Reserved;
+    LONGLONG    Hits;
+    LONGLONG    Misses;
+    LONGLONG    Evictions;
+    LONGLONG    Invalidations;
+} VOLSNAP_READ_CACHE_STATISTICS, *PVOLSNAP_READ_CACHE_STATISTICS;
+
+//
+// The time taken by each phase of creating a snapshot, in 100 ns units.
+//
+
+typedef struct _VSP_COMMIT_TIMES {
+    ULONGLONG   PreCommitScan;
+    ULONGLONG   HoldToCommit;
+    ULONGLONG   Commit;
+    ULONGLONG   WritesHeld;
+    ULONGLONG   FreeSpaceScan;
+} VSP_COMMIT_TIMES, *PVSP_COMMIT_TIMES;
+
 struct _TEMP_TRANSLATION_TABLE_ENTRY;
 typedef struct _TEMP_TRANSLATION_TABLE_ENTRY TEMP_TRANSLATION_TABLE_ENTRY,
 *PTEMP_TRANSLATION_TABLE_ENTRY;
@@ -456,6 +532,14 @@ class VOLUME_EXTENSION : public DEVICE_EXTENSION {
 
         LARGE_INTEGER CommitTimeStamp;
 
+        //
+        // How long each phase of creating this snapshot took, in 100 ns
+        // units, for the event log entry written once the ignorable
+        // blocks have been found.
+        //
+
+        VSP_COMMIT_TIMES CommitTimes;
+
         //
         // A list entry for 'Filter->VolumeList'.
         // Write protect with 'Filter->SpinLock', 'Root->Semaphore', and
@@ -495,8 +579,8 @@ class VOLUME_EXTENSION : public DEVICE_EXTENSION {
         // Protect with 'PagedResource'.
         //
 
-        RTL_GENERIC_TABLE VolumeBlockTable;
-        RTL_GENERIC_TABLE CopyBackPointerTable;
+        VSP_BLOCK_MAP VolumeBlockTable;
+        VSP_BLOCK_MAP CopyBackPointerTable;
 
         //
         // A table to store entries in flight.  This table is non-paged.
@@ -648,6 +732,8 @@ struct _VSP_CONTEXT {
             PDEVICE_OBJECT      TargetObject;
             BOOLEAN             IsCopyTarget;
             LONGLONG            TargetOffset;
+            PVOLUME_EXTENSION   CacheOwner;
+            ULONG               CacheGeneration;
         } ReadSnapshot;
 
         struct {
@@ -834,6 +920,14 @@ class FILTER_EXTENSION : public DEVICE_EXTENSION {
         KDPC HoldWritesTimerDpc;
         ULONG HoldWritesTimeout;
 
+        //
+        // The interrupt times at which writes were last held and released.
+        // Protect with 'SpinLock'.
+        //
+
+        ULONGLONG HoldWritesStartTime;
+        ULONGLONG HoldWritesEndTime;
+
         //
         // The flush and hold irp is kept here while it is cancellable.
         // Protect with the cancel spin lock.
@@ -1028,6 +1122,20 @@ class FILTER_EXTENSION : public DEVICE_EXTENSION {
 
         PRTL_BITMAP ProtectedBlocksBitmap;
 
+        //
+        // The free space of this volume found while the prepared snapshot
+        // 'PreCommitExtension' was being prepared.  Every write that comes
+        // through clears its blocks from the bitmap so that at commit time
+        // what is left can be marked ignorable in the new snapshot
+        // without scanning the volume while writes are held.  The bitmap
+        // is only usable once 'PreCommitFreeBitmapValid' is set.
+        // Protect with 'SpinLock'.
+        //
+
+        PRTL_BITMAP PreCommitFreeBitmap;
+        PVOLUME_EXTENSION PreCommitExtension;
+        BOOLEAN PreCommitFreeBitmapValid;
+
         //
         // A list of copy on writes should be kept in non-paged pool
         // for a spell until the diff area volumes all arrive.
@@ -1042,6 +1150,12 @@ class FILTER_EXTENSION : public DEVICE_EXTENSION {
         LIST_ENTRY CopyOnWriteList;
         PVSP_CONTEXT PnpWaitTimerContext;
 
+        //
+        // The diff area read cache shared by the snapshots of this volume.
+        //
+
+        VSP_READ_CACHE ReadCache;
+
         //
         // A ref count to keep track of pending file system operations
         // on this filter.
@@ -1077,6 +1191,7 @@ typedef struct _VSP_WAIT_BLOCK {
 #define VSP_HIGH_PRIORITY                   (20)
 #define VSP_LOWER_PRIORITY                  (10)
 #define VSP_MAX_SNAPSHOTS                   (512)
+#define VSP_MAX_COPY_RUN_BLOCKS             (16)
 
 #define NOMINAL_DIFF_AREA_FILE_GROWTH   (50*1024*1024)
 #define MAXIMUM_DIFF_AREA_FILE_GROWTH   (1000*1024*1024)
@@ -1116,6 +1231,18 @@ struct _TEMP_TRANSLATION_TABLE_ENTRY {
 
     LIST_ENTRY          TableUpdateListEntry;
     LONGLONG            FileOffset;
+
+    //
+    // Entries for consecutive blocks of a write with contiguous diff area
+    // space are copied together as a run.  The first entry of the run owns
+    // the 'CopyIrp' and 'CopyRunLength' blocks of buffer, the others have
+    // no 'CopyIrp'.  All of the entries of a run are linked in a ring
+    // through 'CopyRunListEntry', which only the owner of the 'CopyIrp'
+    // touches.
+    //
+
+    LIST_ENTRY          CopyRunListEntry;
+    ULONG               CopyRunLength;
 };
 
 //